@@ -10,6 +10,7 @@
 
 #include "AppManager.h"
 
+#include <algorithm>
 #include <clocale>
 
 #include <QDebug>
@@ -20,9 +21,13 @@
 #include "Global/QtCompat.h" // for removeRecursively
 #include "Global/GlobalDefines.h" // for removeRecursively
 #include "Global/Enums.h"
+#ifndef __NATRON_WIN32__
+#include <unistd.h> // getuid
+#endif
 
 #include "Engine/AppInstance.h"
 #include "Engine/OfxHost.h"
+#include "Engine/ImageBufferPool.h"
 #include "Engine/Settings.h"
 #include "Engine/LibraryBinary.h"
 #include "Engine/ProcessHandler.h"
@@ -35,10 +40,14 @@
 #include "Engine/Format.h"
 #include "Engine/Log.h"
 #include "Engine/Cache.h"
+#include "Engine/CacheJournal.h"
+#include "Engine/CacheCompression.h"
+#include "Engine/SharedMemoryCache.h"
 #include "Engine/ChannelSet.h"
 #include "Engine/Variant.h"
 #include "Engine/Knob.h"
 #include "Engine/Rect.h"
+#include "Engine/TaskScheduler.h"
 
 BOOST_CLASS_EXPORT(Natron::FrameParams)
 BOOST_CLASS_EXPORT(Natron::ImageParams)
@@ -58,7 +67,8 @@ struct AppManagerPrivate {
     std::vector<Natron::Plugin*> _plugins; //< list of the plugins
     boost::scoped_ptr<Natron::OfxHost> ofxHost; //< OpenFX host
     boost::scoped_ptr<KnobFactory> _knobFactory; //< knob maker
-    boost::shared_ptr<Natron::Cache<Natron::Image> >  _nodeCache; //< Images cache
+    boost::scoped_ptr<Natron::TaskScheduler> _taskScheduler; //< threads executing the render tasks
+    boost::shared_ptr<Natron::Cache<Natron::Image,GreedyDualSizeEvictionPolicy> >  _nodeCache; //< Images cache, weighs render time against size
     boost::shared_ptr<Natron::Cache<Natron::FrameEntry> > _viewerCache; //< Viewer textures cache
     ProcessInputChannel* _backgroundIPC; //< object used to communicate with the main app
     //if this app is background, see the ProcessInputChannel def
@@ -82,6 +92,7 @@ struct AppManagerPrivate {
         , _plugins()
         , ofxHost(new Natron::OfxHost())
         , _knobFactory(new KnobFactory())
+        , _taskScheduler()
         , _nodeCache()
         , _viewerCache()
         ,_backgroundIPC(0)
@@ -106,9 +117,20 @@ struct AppManagerPrivate {
     
     void restoreCaches();
     
-    bool checkForCacheDiskStructure(const QString& cachePath);
+    template<typename CacheType>
+    void restoreCache(CacheType* cache);
+    
+    bool checkForCacheDiskStructure(const QString& cachePath,unsigned int cacheVersion);
     
     void cleanUpCacheDiskStructure(const QString& cachePath);
+    
+    void openSharedNodeCache();
+    
+    /**
+     * @brief Gives a part of the RAM of the node cache to the pool of the image buffers, so that the buffers it keeps
+     * are charged to the RAM setting. Returns the RAM left to the node cache.
+     **/
+    U64 reserveImageBufferPoolMemory(U64 nodeCacheRAM);
 
 };
 
@@ -324,12 +346,15 @@ bool AppManager::loadInternal(const QString& projectFilename,const QStringList&
     U64 playbackSize = maxCacheRAM * _imp->_settings->getRamPlaybackMaximumPercent();
 
     setLoadingStatus(QString("Restoring the image cache..."));
-    _imp->_nodeCache.reset(new Cache<Image>("NodeCache",0x1, maxCacheRAM - playbackSize,1));
+    _imp->_nodeCache.reset(new Cache<Image,GreedyDualSizeEvictionPolicy>("NodeCache",0x1,
+                                                                          _imp->reserveImageBufferPoolMemory(maxCacheRAM - playbackSize),1));
     _imp->_viewerCache.reset(new Cache<FrameEntry>("ViewerCache",0x1,maxDiskCache,(double)playbackSize / (double)maxDiskCache));
 
     qDebug() << "NodeCache RAM size: " << printAsRAM(_imp->_nodeCache->getMaximumMemorySize());
+    qDebug() << "Image buffers pool RAM size: " << printAsRAM(ImageBufferPool::instance().getMaxPooledBytes());
     qDebug() << "ViewerCache RAM size (playback-cache): " << printAsRAM(_imp->_viewerCache->getMaximumMemorySize());
     qDebug() << "ViewerCache disk size: " << printAsRAM(maxDiskCache);
+    setApplicationsCachesDiskCompression(_imp->_settings->getDiskCacheCompression());
 
 
     _imp->restoreCaches();
@@ -338,6 +363,16 @@ bool AppManager::loadInternal(const QString& projectFilename,const QStringList&
 
 
     _imp->_settings->restoreSettings();
+
+    ///The size of the shared cache is a user setting and it has no knob handler: it is only read here,
+    ///before the first render
+    if (isBackground()) {
+        _imp->openSharedNodeCache();
+    }
+
+    ///The number of threads is known only once the settings are restored
+    _imp->_taskScheduler.reset(new TaskScheduler(1));
+    onNumberOfThreadsChanged(_imp->_settings->getNumberOfThreads());
     
     ///Set host properties after restoring settings since it depends on the host name.
     _imp->ofxHost->setProperties();
@@ -462,6 +497,8 @@ void AppManager::clearPluginsLoadedCache() {
 void AppManager::clearAllCaches() {
     clearDiskCache();
     clearNodeCache();
+    ///the buffers of the evicted entries are kept for reuse, give them back to the system too
+    Natron::ImageBufferPool::instance().clear();
     
     ///for each app instance clear all its nodes cache
     for (std::map<int,AppInstanceRef>::iterator it = _imp->_appInstances.begin(); it!= _imp->_appInstances.end(); ++it) {
@@ -573,7 +610,7 @@ void AppManager::registerAppInstance(AppInstance* app){
 void AppManager::setApplicationsCachesMaximumMemoryPercent(double p){
     size_t maxCacheRAM = p * getSystemTotalRAM_conditionnally();
     U64 playbackSize = maxCacheRAM * _imp->_settings->getRamPlaybackMaximumPercent();
-    _imp->_nodeCache->setMaximumCacheSize(maxCacheRAM - playbackSize);
+    _imp->_nodeCache->setMaximumCacheSize(_imp->reserveImageBufferPoolMemory(maxCacheRAM - playbackSize));
     _imp->_nodeCache->setMaximumInMemorySize(1);
     U64 maxDiskCacheSize = _imp->_settings->getMaximumDiskCacheSize();
     _imp->_viewerCache->setMaximumInMemorySize((double)playbackSize / (double)maxDiskCacheSize);
@@ -594,11 +631,16 @@ void AppManager::setApplicationsCachesMaximumDiskSpace(unsigned long long size){
     qDebug() << "ViewerCache disk size: " << printAsRAM(size);
 }
 
+void AppManager::setApplicationsCachesDiskCompression(int mode){
+    _imp->_viewerCache->setDiskCompression((Natron::CacheCompressionMode)mode);
+    _imp->_nodeCache->setDiskCompression((Natron::CacheCompressionMode)mode);
+}
+
 void AppManager::setPlaybackCacheMaximumSize(double p)
 {
     size_t maxCacheRAM = _imp->_settings->getRamMaximumPercent() * getSystemTotalRAM_conditionnally();
     U64 playbackSize = maxCacheRAM * p;
-    _imp->_nodeCache->setMaximumCacheSize(maxCacheRAM - playbackSize);
+    _imp->_nodeCache->setMaximumCacheSize(_imp->reserveImageBufferPoolMemory(maxCacheRAM - playbackSize));
     _imp->_nodeCache->setMaximumInMemorySize(1);
     U64 maxDiskCacheSize = _imp->_settings->getMaximumDiskCacheSize();
     _imp->_viewerCache->setMaximumInMemorySize((double)playbackSize / (double)maxDiskCacheSize);
@@ -792,6 +834,19 @@ const KnobFactory& AppManager::getKnobFactory() const {
     return *(_imp->_knobFactory);
 }
 
+Natron::TaskScheduler* AppManager::getTaskScheduler() const {
+    return _imp->_taskScheduler.get();
+}
+
+void AppManager::onNumberOfThreadsChanged(int threadsNb) {
+    if (!_imp->_taskScheduler) {
+        return;
+    }
+    ///-1 means multi-threading is disabled: one worker still runs the tasks, the waiting thread helping it.
+    ///0 means as many workers as cores
+    _imp->_taskScheduler->setWorkersCount(threadsNb == -1 ? 1 : threadsNb);
+}
+
 Natron::LibraryBinary* AppManager::getPluginBinary(const QString& pluginId,int majorVersion,int minorVersion) const{
     std::map<int,Natron::Plugin*> matches;
     for (U32 i = 0; i < _imp->_plugins.size(); ++i) {
@@ -827,6 +882,23 @@ void AppManager::removeFromNodeCache(const boost::shared_ptr<Natron::Image>& ima
     _imp->_nodeCache->removeEntry(image);
 }
 
+void AppManager::publishImageToSharedCache(const boost::shared_ptr<Natron::Image>& image) const {
+    ///nobody to share with: don't copy the image for nothing
+    const boost::shared_ptr<SharedMemoryCache>& sharedMemory = _imp->_nodeCache->getSharedMemoryCache();
+    if (!sharedMemory || !sharedMemory->hasOtherMappings()) {
+        return;
+    }
+    ///a partially rendered image would be taken for a complete one by the other processes
+    if (!image->getRestToRender(image->getPixelRoD()).empty()) {
+        return;
+    }
+    _imp->_nodeCache->publishToSharedMemory(image);
+}
+
+bool AppManager::isNodeCacheShared() const {
+    return _imp->_nodeCache->getSharedMemoryCache().get() != NULL;
+}
+
 void AppManager::removeFromViewerCache(const boost::shared_ptr<Natron::FrameEntry>& texture){
     _imp->_viewerCache->removeEntry(texture);
     if(texture) {
@@ -987,155 +1059,115 @@ void AppManager::registerEngineMetaTypes() const {
 }
 
 void AppManagerPrivate::saveCaches() {
-    
-    
-    {
-        std::ofstream ofile;
-        ofile.exceptions(std::ifstream::failbit | std::ifstream::badbit);
-        std::string cacheRestoreFilePath = _viewerCache->getRestoreFilePath();
-        try {
-            ofile.open(cacheRestoreFilePath.c_str(),std::ofstream::out);
-        } catch (const std::ofstream::failure& e) {
-            qDebug() << "Exception occured when opening file " <<  cacheRestoreFilePath.c_str() << ": " << e.what();
-            return;
-        }
-        
-        if (!ofile.good()) {
-            ofile.close();
-            qDebug() << "Failed to save cache to " << cacheRestoreFilePath.c_str();
-            return;
-        }
-        
-        Natron::Cache<FrameEntry>::CacheTOC toc;
-        _viewerCache->save(&toc);
-        
-        try {
-            boost::archive::binary_oarchive oArchive(ofile);
-            oArchive << toc;
-        } catch(const std::exception& e) {
-            qDebug() << "Failed to serialize the cache table of contents: " << e.what();
-        }
-        ofile.close();
+    ///The disk portions are journaled as their entries are written: saving only moves the entries living in RAM
+    ///to disk and compacts the journals.
+    _viewerCache->save();
+    _nodeCache->save();
+    qDebug() << "ViewerCache eviction latency: " << _viewerCache->getEvictionLatency().toString().c_str();
+    qDebug() << "ViewerCache write-back latency: " << _viewerCache->getWriteBackLatency().toString().c_str();
+    qDebug() << "NodeCache eviction latency: " << _nodeCache->getEvictionLatency().toString().c_str();
+    if (_viewerCache->getDiskCompression() != Natron::CACHE_COMPRESSION_NONE) {
+        qDebug() << "ViewerCache disk compression ratio: " << _viewerCache->getDiskCompressionRatio();
     }
-
-    
-    {
-        std::ofstream ofile;
-        ofile.exceptions(std::ifstream::failbit | std::ifstream::badbit);
-        std::string cacheRestoreFilePath = _nodeCache->getRestoreFilePath();
-        try {
-            ofile.open(cacheRestoreFilePath.c_str(),std::ofstream::out);
-        } catch (const std::ofstream::failure& e) {
-            qDebug() << "Exception occured when opening file " << cacheRestoreFilePath.c_str() << ": " << e.what();
-            return;
-        }
-        
-        if(!ofile.good()) {
-            qDebug() << "Failed to save cache to " << cacheRestoreFilePath.c_str();
-            return;
-        }
-        
-        Natron::Cache<Image>::CacheTOC toc;
-        _nodeCache->save(&toc);
-        
-        try {
-            boost::archive::binary_oarchive oArchive(ofile);
-            oArchive << toc;
-            ofile.close();
-        } catch(const std::exception& e) {
-            qDebug() << "Failed to serialize the cache table of contents: " << e.what();
-        }
+    if (_nodeCache->getSharedMemoryCache()) {
+        qDebug() << "NodeCache images copied from the other render processes: " << _nodeCache->getSharedMemoryImportsCount()
+        << ", shared with them: " << _nodeCache->getSharedMemoryPublicationsCount();
     }
+    ImageBufferPool::Statistics poolStats = ImageBufferPool::instance().getStatistics();
+    qDebug() << "Image buffers pool: " << poolStats.allocationsCount << " buffers allocated ("
+    << printAsRAM(poolStats.allocatedBytes) << "), reuse hit rate: " << poolStats.getReuseHitRate()
+    << ", replaced on another NUMA node: " << poolStats.replacedCount << ", released: " << poolStats.releasesCount
+    << ", freed: " << poolStats.freedCount << ", pooled: " << printAsRAM(poolStats.pooledBytes) << " in "
+    << poolStats.pooledBuffersCount << " buffers";
 }
 
-void AppManagerPrivate::restoreCaches() {
-    
-    {
-        if (checkForCacheDiskStructure(_nodeCache->getCachePath())) {
-            std::ifstream ifile;
-            std::string settingsFilePath = _nodeCache->getRestoreFilePath();
-            try {
-                ifile.exceptions(std::ifstream::failbit | std::ifstream::badbit);
-                ifile.open(settingsFilePath.c_str(),std::ifstream::in);
-            } catch (const std::ifstream::failure& e) {
-                qDebug() << "Failed to open the cache restoration file: " << e.what();
-                return;
-            }
-            
-            if (!ifile.good()) {
-                qDebug() << "Failed to cache file for restoration: " <<  settingsFilePath.c_str();
-                ifile.close();
-                return;
-            }
-            
-            Natron::Cache<Image>::CacheTOC tableOfContents;
-            try {
-                boost::archive::binary_iarchive iArchive(ifile);
-                iArchive >> tableOfContents;
-            } catch(const std::exception & e) {
-                qDebug() << e.what();
-                ifile.close();
-                return;
-            }
-            ifile.close();
+U64 AppManagerPrivate::reserveImageBufferPoolMemory(U64 nodeCacheRAM) {
+    U64 poolSize = std::min((U64)NATRON_IMAGE_BUFFER_POOL_DEFAULT_MAX_BYTES,
+                            (U64)(nodeCacheRAM * NATRON_IMAGE_BUFFER_POOL_CACHE_FRACTION));
+    ImageBufferPool::instance().setMaxPooledBytes(poolSize);
+    return nodeCacheRAM - poolSize;
+}
 
-            QFile restoreFile(settingsFilePath.c_str());
-            restoreFile.remove();
-            
-            _nodeCache->restore(tableOfContents);
-        }
+void AppManagerPrivate::openSharedNodeCache() {
+    U64 size = _settings->getSharedImageCacheSize();
+    if (size == 0) {
+        return;
     }
-    {
-        if (checkForCacheDiskStructure(_viewerCache->getCachePath())) {
-            std::ifstream ifile;
-            std::string settingsFilePath = _viewerCache->getRestoreFilePath();
-            try {
-                ifile.exceptions(std::ifstream::failbit | std::ifstream::badbit);
-                ifile.open(settingsFilePath.c_str(),std::ifstream::in);
-            } catch (const std::ifstream::failure& e) {
-                qDebug() << "Failed to open the cache restoration file: " << e.what();
-                return;
-            }
-            
-            if (!ifile.good()) {
-                qDebug() << "Failed to cache file for restoration: " <<  settingsFilePath.c_str();
-                ifile.close();
-                return;
-            }
-            
-            Natron::Cache<FrameEntry>::CacheTOC tableOfContents;
-            try {
-                boost::archive::binary_iarchive iArchive(ifile);
-                iArchive >> tableOfContents;
-            } catch(const std::exception & e) {
-                qDebug() << e.what();
-                ifile.close();
-                return;
-            }
-            ifile.close();
+    ///One segment per user: the images of another user's projects must not leak
+    std::string name = QString("/" NATRON_APPLICATION_NAME "NodeCache-%1").arg(_nodeCache->cacheVersion()).toStdString();
+#ifndef __NATRON_WIN32__
+    name += QString("-%1").arg((qulonglong)::getuid()).toStdString();
+#endif
+    boost::shared_ptr<SharedMemoryCache> sharedMemory(new SharedMemoryCache);
+    if (!sharedMemory->open(name,size)) {
+        return;
+    }
+    _nodeCache->setSharedMemoryCache(sharedMemory);
+    qDebug() << "NodeCache shared with the other render processes: " << printAsRAM(sharedMemory->getCapacity());
+}
 
-            QFile restoreFile(settingsFilePath.c_str());
-            restoreFile.remove();
-            
-            _viewerCache->restore(tableOfContents);
-        }
+template<typename CacheType>
+void AppManagerPrivate::restoreCache(CacheType* cache) {
+    bool diskStructureValid = checkForCacheDiskStructure(cache->getCachePath(),cache->cacheVersion());
+    cache->restoreFromJournal();
+    if (!diskStructureValid) {
+        return;
     }
+    
+    ///Migrate the table of contents written by the versions of Natron which didn't journal the caches
+    std::string settingsFilePath = cache->getRestoreFilePath();
+    if (!QFile::exists(settingsFilePath.c_str())) {
+        return;
+    }
+    std::ifstream ifile;
+    try {
+        ifile.exceptions(std::ifstream::failbit | std::ifstream::badbit);
+        ifile.open(settingsFilePath.c_str(),std::ifstream::in);
+    } catch (const std::ifstream::failure& e) {
+        qDebug() << "Failed to open the cache restoration file: " << e.what();
+        return;
+    }
+    
+    if (!ifile.good()) {
+        qDebug() << "Failed to cache file for restoration: " <<  settingsFilePath.c_str();
+        ifile.close();
+        return;
+    }
+    
+    typename CacheType::CacheTOC tableOfContents;
+    try {
+        boost::archive::binary_iarchive iArchive(ifile);
+        iArchive >> tableOfContents;
+    } catch(const std::exception & e) {
+        qDebug() << e.what();
+        ifile.close();
+        return;
+    }
+    ifile.close();
+    
+    QFile restoreFile(settingsFilePath.c_str());
+    restoreFile.remove();
+    
+    cache->restore(tableOfContents);
+}
+
+void AppManagerPrivate::restoreCaches() {
+    restoreCache(_nodeCache.get());
+    restoreCache(_viewerCache.get());
 }
 
-bool AppManagerPrivate::checkForCacheDiskStructure(const QString& cachePath) {
+bool AppManagerPrivate::checkForCacheDiskStructure(const QString& cachePath,unsigned int cacheVersion) {
+    QString journalFilePath(cachePath+QDir::separator()+"journal." NATRON_CACHE_FILE_EXT);
     QString settingsFilePath(cachePath+QDir::separator()+"restoreFile." NATRON_CACHE_FILE_EXT);
-    if (!QFile::exists(settingsFilePath)) {
-        qDebug() << "Cache folder doesn't exist.";
+    if (!Natron::CacheJournal::isCompatible(journalFilePath.toStdString(),cacheVersion) && !QFile::exists(settingsFilePath)) {
+        qDebug() << "Cache folder doesn't exist or was written by another version.";
         cleanUpCacheDiskStructure(cachePath);
         return false;
     }
     QDir directory(cachePath);
     QStringList files = directory.entryList(QDir::AllDirs);
     
-    
-    /*Now counting actual data files in the cache*/
-    /*check if there's 256 subfolders, otherwise reset cache.*/
-    int count = 0; // -1 because of the restoreFile
+    /*check if there's 256 subfolders, otherwise reset cache. The files themselves are listed by the journal.*/
     int subFolderCount = 0;
     for (int i =0; i< files.size(); ++i) {
         QString subFolder(cachePath);
@@ -1145,12 +1177,6 @@ bool AppManagerPrivate::checkForCacheDiskStructure(const QString& cachePath) {
         QDir d(subFolder);
         if (d.exists()) {
             ++subFolderCount;
-            QStringList items = d.entryList();
-            for (int j = 0; j < items.size(); ++j) {
-                if(items[j] != QString(".") && items[j] != QString("..")) {
-                    ++count;
-                }
-            }
         }
     }
     if (subFolderCount<256) {
@@ -49,6 +49,7 @@ namespace Natron {
     class FrameEntry;
     class Plugin;
     class CacheSignalEmitter;
+    class TaskScheduler;
     
     enum AppInstanceStatus
     {
@@ -179,10 +180,22 @@ public:
 
     void setApplicationsCachesMaximumDiskSpace(unsigned long long size);
 
+    ///mode is a Natron::CacheCompressionMode, it applies to the frames moved to disk from now on
+    void setApplicationsCachesDiskCompression(int mode);
+
     void setPlaybackCacheMaximumSize(double p);
 
     void removeFromNodeCache(const boost::shared_ptr<Natron::Image>& image);
 
+    /**
+     * @brief If the node cache is shared with the other render processes of the host (background processes only),
+     * copies the image there once it is completely rendered so that they don't render it again.
+     **/
+    void publishImageToSharedCache(const boost::shared_ptr<Natron::Image>& image) const;
+
+    ///True if the node cache is shared with the other render processes of the host
+    bool isNodeCacheShared() const;
+
     void removeFromViewerCache(const boost::shared_ptr<Natron::FrameEntry>& texture);
     
     /**
@@ -196,6 +209,17 @@ public:
 
     const KnobFactory& getKnobFactory() const WARN_UNUSED_RETURN;
 
+    /**
+     * @brief Returns the scheduler executing the render tasks (tiles, inputs renders, OpenFX multi-thread suite).
+     * Returns NULL until the application is loaded.
+     **/
+    Natron::TaskScheduler* getTaskScheduler() const WARN_UNUSED_RETURN;
+
+    /**
+     * @brief Called when the number of threads preference changes, resizes the task scheduler accordingly.
+     **/
+    void onNumberOfThreadsChanged(int threadsNb);
+
     /**
      * @brief If the current process is a background process, then it will right the output pipe the
      * short message. Otherwise the longMessage is printed to stdout
@@ -17,17 +17,24 @@
 #include <fstream>
 #include <functional>
 #include <list>
+#include <set>
 
 #include "Global/GlobalDefines.h"
 CLANG_DIAG_OFF(deprecated)
 #include <QtCore/QMutex>
 #include <QtCore/QMutexLocker>
+#include <QtCore/QWaitCondition>
+#include <QtCore/QAtomicInt>
 #include <QtCore/QObject>
 #include <QtCore/QDebug>
 #include <QtCore/QTextStream>
 #include <QtCore/QBuffer>
+#include <QtCore/QElapsedTimer>
 CLANG_DIAG_ON(deprecated)
 #include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/bind.hpp>
 CLANG_DIAG_OFF(unused-parameter)
 // /opt/local/include/boost/serialization/smart_cast.hpp:254:25: warning: unused parameter 'u' [-Wunused-parameter]
 #include <boost/archive/binary_iarchive.hpp>
@@ -43,6 +50,11 @@ CLANG_DIAG_ON(unused-parameter)
 #include "Engine/FrameEntrySerialization.h"
 #include "Engine/FrameParamsSerialization.h"
 #include "Engine/CacheEntry.h"
+#include "Engine/CacheJournal.h"
+#include "Engine/CacheCompression.h"
+#include "Engine/SharedMemoryCache.h"
+#include "Engine/CacheIOQueue.h"
+#include "Engine/LatencyHistogram.h"
 #include "Engine/LRUHashTable.h"
 #include "Engine/StandardPaths.h"
 
@@ -71,10 +83,47 @@ namespace Natron {
 
     };
 
+/**
+ * @brief The number of shards a cache is split into by default. Each shard has its own lock, eviction order
+ * and in-memory/on-disk containers, so that threads looking up entries whose hash fall in different
+ * shards never wait on each other. Must be >= 1.
+ **/
+#define NATRON_CACHE_DEFAULT_SHARDS_COUNT 16
+
     /*
          * ValueType must be derived of CacheEntryHelper
+         * EvictionPolicy orders the entries of each portion of the cache, see LRUHashTable.h
+         *
+         * Thread safety: The cache is split in several shards, selected by the hash of the entry.
+         * Each shard is protected by its own mutex. The sizes of the memory and disk portions
+         * are global to all the shards and are protected by _sizeLock which is always taken
+         * after a shard lock (never the other way around) and held only for a few instructions.
+         * A thread never holds 2 shard locks at the same time.
+         *
+         * Each portion of each shard orders its entries with its own instance of the EvictionPolicy. Every look-up
+         * also stamps the entry with the value of a global access clock. When the cache exceeds its budget the
+         * entry evicted is the first one of the shard whose first entry has the lowest rank, which is computed by
+         * the policy: with LRUEvictionPolicy the rank is given by the access clock, making the eviction
+         * approximately global-LRU.
+         *
+         * Once restoreFromJournal() has been called, the entries of the disk portion are indexed by a
+         * CacheJournal, updated as they are written to disk and removed, so that they survive a crash.
+         *
+         * The disk work of the evictions (unmapping the files of the entries moved to the disk portion,
+         * computing their checksum, deleting the files evicted from the disk portion) and the journal updates
+         * are done by a CacheIOQueue thread, in the order the containers were changed. Under the shard lock an
+         * eviction only moves the entry between the containers and collects the jobs, which are queued once the
+         * lock is released: a render thread making room for a new entry never waits for the disk.
+         *
+         * The disk portion can be compressed (see setDiskCompression()): the I/O thread then writes the data of the
+         * entries moved to disk compressed (see CacheCompression) and replaces their file, and the data is
+         * decompressed when the entry is looked-up again. The disk budget counts the size of the compressed files:
+         * until its file is compressed an entry is counted with the average compression ratio measured so far.
+         *
+         * Several processes can share their entries through a SharedMemoryCache (see setSharedMemoryCache()):
+         * an entry missing in this cache is copied from there by get() if another process published it.
          */
-    template<typename EntryType>
+    template<typename EntryType,typename EvictionPolicy = LRUEvictionPolicy>
     class Cache {
 
         
@@ -109,6 +158,9 @@ namespace Natron {
 
     private:
 
+        ///Jobs collected while a shard lock is held, queued on the I/O thread once it is released
+        typedef std::vector<CacheIOQueue::Job> IOJobs;
+
         
         
         
@@ -116,60 +168,49 @@ namespace Natron {
         struct CachedValue {
             EntryTypePtr _entry;
             NonKeyParamsPtr _params;
+            int _lastAccess; //< value of the cache access clock the last time this entry was inserted or looked-up
+            U64 _checksum; //< checksum of the file of an entry restored from the journal
+            bool _verifyChecksum; //< true until the file of an entry restored from the journal is checked
+            bool _writeBackPending; //< in the disk portion but still mapped, until the I/O thread unmaps it
+            U64 _diskSize; //< bytes counted in the size of the disk portion while the entry is in there
+            
+            CachedValue() : _entry(), _params(), _lastAccess(0), _checksum(0), _verifyChecksum(false), _writeBackPending(false), _diskSize(0) {}
+            
+            ///What the eviction policies need to know about a value
+            long use_count() const { return _entry.use_count(); }
+            
+            int getLastAccess() const { return _lastAccess; }
+            
+            U64 getSize() const { return _entry->size(); }
+            
+            double getComputeCost() const { return _entry->getComputeTime(); }
         };
 
     public:
-        
-
 
-#ifdef USE_VARIADIC_TEMPLATES
-
-#ifdef NATRON_CACHE_USE_BOOST
-#ifdef NATRON_CACHE_USE_HASH
-        typedef BoostLRUHashTable<hash_type, CachedValue>, boost::bimaps::unordered_set_of> CacheContainer;
-#else
-        typedef BoostLRUHashTable<hash_type, CachedValue > , boost::bimaps::set_of> CacheContainer;
-#endif
-        typedef typename CacheContainer::container_type::left_iterator CacheIterator;
-        typedef typename CacheContainer::container_type::left_const_iterator ConstCacheIterator;
-        static std::list<CachedValue>&  getValueFromIterator(CacheIterator it){return it->second;}
-
-#else // cache use STL
-
-#ifdef NATRON_CACHE_USE_HASH
-        typedef StlLRUHashTable<hash_type,CachedValue >, std::unordered_map> CacheContainer;
-#else
-        typedef StlLRUHashTable<hash_type,CachedValue >, std::map> CacheContainer;
-#endif
-        typedef typename CacheContainer::key_to_value_type::iterator CacheIterator;
-        typedef typename CacheContainer::key_to_value_type::const_iterator ConstCacheIterator;
-        static std::list<CachedValue>&  getValueFromIterator(CacheIterator it){return it->second;}
-#endif // NATRON_CACHE_USE_BOOST
-
-#else // !USE_VARIADIC_TEMPLATES
-
-#ifdef NATRON_CACHE_USE_BOOST
-#ifdef NATRON_CACHE_USE_HASH
-        typedef BoostLRUHashTable<hash_type,CachedValue> CacheContainer;
-#else
-        typedef BoostLRUHashTable<hash_type, CachedValue > CacheContainer;
-#endif
-        typedef typename CacheContainer::container_type::left_iterator CacheIterator;
-        typedef typename CacheContainer::container_type::left_const_iterator ConstCacheIterator;
-        static std::list<CachedValue>&  getValueFromIterator(CacheIterator it){return it->second;}
-
-#else // cache use STL and tree (std map)
-
-        typedef StlLRUHashTable<hash_type, CachedValue > CacheContainer;
-        typedef typename CacheContainer::key_to_value_type::iterator CacheIterator;
-        typedef typename CacheContainer::key_to_value_type::const_iterator ConstCacheIterator;
-        static std::list<CachedValue>&   getValueFromIterator(CacheIterator it){return it->second.first;}
-#endif // NATRON_CACHE_USE_BOOST
-
-#endif // USE_VARIADIC_TEMPLATES
+        typedef EvictionHashTable<hash_type,CachedValue,EvictionPolicy> CacheContainer;
+        typedef typename CacheContainer::iterator CacheIterator;
+        static std::list<CachedValue>& getValueFromIterator(CacheIterator it) { return CacheContainer::getValues(it); }
     private:
      
-
+        /**
+         * @brief A portion of the cache holding all the entries whose hash map to it.
+         * All members are protected by the lock.
+         **/
+        struct CacheShard {
+            QMutex lock;
+            CacheContainer memoryCache;
+            CacheContainer diskCache;
+            
+            ///The hashes whose file is being unmapped, replaced or removed by the I/O thread, read back from the disk
+            ///portion or imported from the shared memory cache, without the lock
+            std::multiset<hash_type> busyFiles;
+            
+            ///Signaled when a hash is removed from busyFiles
+            QWaitCondition fileReady;
+            
+            CacheShard() : lock(), memoryCache(), diskCache(), busyFiles(), fileReady() {}
+        };
 
         U64 _maximumInMemorySize; // the maximum size of the in-memory portion of the cache.(in % of the maximum cache size)
 
@@ -181,12 +222,16 @@ namespace Natron {
         mutable U64 _memoryCacheSize; // current size of the cache in bytes
         mutable U64 _diskCacheSize;
 
-        mutable QMutex _lock;
+        ///Protects the sizes above as well as the creation of the signal emitter
+        mutable QMutex _sizeLock;
 
-        /*These 2 are mutable because we need to modify the LRU list even
-             when we call get() and we want this function to be const.*/
-        mutable CacheContainer _memoryCache;
-        mutable CacheContainer _diskCache;
+        ///Incremented on every insertion and look-up, used to approximate a global LRU ordering across shards.
+        ///It is allowed to wrap around: ages are always computed as a difference with the current value.
+        mutable QAtomicInt _accessClock;
+        
+        ///The shards are allocated once in the constructor and never change afterwards, hence
+        ///the vector itself doesn't need to be protected.
+        std::vector<CacheShard*> _shards;
 
         const std::string _cacheName;
 
@@ -196,6 +241,27 @@ namespace Natron {
              be const somehow .*/
         mutable CacheSignalEmitter* _signalEmitter;
 
+        ///Set once by restoreFromJournal() before the cache is shared, NULL until then. It has its own lock.
+        boost::scoped_ptr<CacheJournal> _journal;
+
+        ///Runs the disk work of the evictions and the journal updates. It has its own lock.
+        mutable CacheIOQueue _ioQueue;
+
+        ///Time spent by the threads making room in the cache to evict one entry, I/O jobs queuing included
+        mutable LatencyHistogram _evictionLatency;
+
+        ///A CacheCompressionMode, read by the I/O thread
+        QAtomicInt _diskCompression;
+
+        ///Running average of the size of the compressed files over the size of their data, protected by _sizeLock
+        mutable double _compressionRatio;
+        mutable bool _compressionRatioMeasured;
+
+        ///The entries shared with the other processes of the host, NULL unless setSharedMemoryCache() was called
+        boost::shared_ptr<SharedMemoryCache> _sharedMemory;
+        mutable QAtomicInt _sharedMemoryImports;
+        mutable QAtomicInt _sharedMemoryPublications;
+
     public:
 
 
@@ -203,24 +269,48 @@ namespace Natron {
         Cache(const std::string& cacheName
               ,unsigned int version
               ,U64 maximumCacheSize // total size
-              ,double maximumInMemoryPercentage) //how much should live in RAM
+              ,double maximumInMemoryPercentage //how much should live in RAM
+              ,unsigned int shardsCount = NATRON_CACHE_DEFAULT_SHARDS_COUNT)
             :_maximumInMemorySize(maximumCacheSize*maximumInMemoryPercentage)
             ,_maximumCacheSize(maximumCacheSize)
             ,_memoryCacheSize(0)
             ,_diskCacheSize(0)
-            ,_lock()
-            ,_memoryCache()
-            ,_diskCache()
+            ,_sizeLock()
+            ,_accessClock(0)
+            ,_shards()
             ,_cacheName(cacheName)
             ,_version(version)
             ,_signalEmitter(NULL)
+            ,_journal()
+            ,_ioQueue()
+            ,_evictionLatency()
+            ,_diskCompression(CACHE_COMPRESSION_NONE)
+            ,_compressionRatio(1.)
+            ,_compressionRatioMeasured(false)
+            ,_sharedMemory()
+            ,_sharedMemoryImports(0)
+            ,_sharedMemoryPublications(0)
         {
+            if (shardsCount == 0) {
+                shardsCount = 1;
+            }
+            for (unsigned int i = 0; i < shardsCount; ++i) {
+                _shards.push_back(new CacheShard);
+            }
         }
 
         ~Cache() {
-            QMutexLocker locker(&_lock);
-            _memoryCache.clear();
-            _diskCache.clear();
+            ///the jobs reference the entries and the journal
+            _ioQueue.waitForIdle();
+            for (U32 i = 0; i < _shards.size(); ++i) {
+                {
+                    QMutexLocker locker(&_shards[i]->lock);
+                    _shards[i]->memoryCache.clear();
+                    _shards[i]->diskCache.clear();
+                }
+                delete _shards[i];
+            }
+            _shards.clear();
             if(_signalEmitter)
                 delete _signalEmitter;
         }
@@ -238,89 +328,25 @@ namespace Natron {
      **/
         bool get(const typename EntryType::key_type& key,NonKeyParamsPtr* params,EntryTypePtr* returnValue) const {
 
-            ///lock the cache before reading it.
-            QMutexLocker locker(&_lock);
-
-            ///find a matching value in the internal memory container
-            CacheIterator memoryCached = _memoryCache(key.getHash());
-
-            if (memoryCached != _memoryCache.end()) {
-                /*we found something with a matching hash key. There may be several entries linked to
-                    this key, we need to find one with matching params*/
-                std::list<CachedValue>& ret = getValueFromIterator(memoryCached);
-                for (typename std::list<CachedValue>::const_iterator it = ret.begin(); it!=ret.end(); ++it) {
-                    if (it->_entry->getKey() == key) {
-                        if(_signalEmitter) {
-                            ///emit the signal add entry so it can sync any external structure.
-                            _signalEmitter->emitAddedEntry();
-                        }
-
-                        *returnValue = it->_entry;
-                        *params = it->_params;
-                        return true;
-                    }
-                }
-                return false;
-            } else {
-
-                ///fallback on the disk cache internal container
-                CacheIterator diskCached = _diskCache(key.getHash());
-
-                if (diskCached == _diskCache.end()) {
-                    /*the entry was neither in memory or disk, just allocate a new one*/
-                    return false;
-                } else {
-                    /*we found something with a matching hash key. There may be several entries linked to
-                         this key, we need to find one with matching values(operator ==)*/
-                    std::list<CachedValue>& ret = getValueFromIterator(diskCached);
-
-                    for (typename std::list<CachedValue>::iterator it = ret.begin();
-                         it!=ret.end(); ++it) {
-                        if (it->_entry->getKey() == key) {
-                            /*If we found 1 entry in the list that has exactly the same key params,
-                         we re-open the mapping to the RAM put the entry
-                         back into the memoryCache.*/
-
-                            // remove it from the disk cache
-                            _diskCacheSize -= it->_entry->size();
-
-                            if(ret.empty()){
-                                _diskCache.erase(diskCached);
-                            }
-
-                            try {
-                                it->_entry->reOpenFileMapping();
-                            } catch (const std::exception& e) {
-                                qDebug() << "Error while reopening cache file: " << e.what();
-                                ret.erase(it);
-                                return false;
-                            } catch (...) {
-                                qDebug() << "Error while reopening cache file";
-                                ret.erase(it);
-                                return false;
-                            }
-
-                            //put it back into the RAM
-                            _memoryCache.insert(it->_entry->getHashKey(),*it);
-                            _memoryCacheSize += it->_entry->size();
-
-
-                            if(_signalEmitter)
-                                _signalEmitter->emitAddedEntry();
-                            *returnValue = it->_entry;
-                            *params = it->_params;
-                            ret.erase(it);
-
-                            return true;
-
-                        }
-                    }
-                    /*if we reache here it means no entries linked to the hash key matches the params,then
-                         we allocate a new one*/
-                    return false;
+            CacheShard* shard = getShard(key.getHash());
+            IOJobs jobs;
+            bool found;
+            bool importing = false;
+            {
+                ///lock the shard before reading it.
+                QMutexLocker locker(&shard->lock);
+                found = getInternal(shard,key,params,returnValue,&jobs);
+                if (!found && _sharedMemory && _sharedMemory->contains(key.getHash())) {
+                    ///the other look-ups of the hash wait for the import
+                    shard->busyFiles.insert(key.getHash());
+                    importing = true;
                 }
             }
-
+            submitIOJobs(jobs);
+            if (importing) {
+                found = importFromSharedMemory(shard,key,params,returnValue);
+            }
+            return found;
         }
 
 
@@ -346,10 +372,22 @@ namespace Natron {
      **/
         bool getOrCreate(const typename EntryType::key_type& key,NonKeyParamsPtr params,EntryTypePtr* returnValue) const {
             NonKeyParamsPtr cachedParams;
-            if (!get(key,&cachedParams,returnValue)) {
-                ///lock the cache before writing it.
-                QMutexLocker locker(&_lock);
-                *returnValue = newEntry(key,params);
+            CacheShard* shard = getShard(key.getHash());
+            IOJobs jobs;
+            bool found;
+            {
+                ///The look-up and the insertion are made under the same lock so 2 threads
+                ///cannot create 2 entries for the same key.
+                QMutexLocker locker(&shard->lock);
+                found = getInternal(shard,key,&cachedParams,returnValue,&jobs);
+                if (!found) {
+                    *returnValue = newEntry(shard,key,params,&jobs);
+                }
+            }
+            submitIOJobs(jobs);
+            if (!found) {
+                ///The new entry is referenced by returnValue, hence it cannot be evicted by this call.
+                makeRoomInMemory();
                 return false;
             } else {
                 if (*cachedParams != *params) {
@@ -372,58 +410,37 @@ namespace Natron {
          **/
         void clearDiskPortion() {
             
-            QMutexLocker locker(&_lock);
-            
             /// An entry which has a use_count greater than 1 is not removable:
             /// The backing file must not be removed because it might be read/written to
             /// at the same time. The best we can do is just let it here in the cache.
-
-            std::pair<hash_type,CachedValue> evictedFromDisk = _diskCache.evict();
-            //if the cache couldn't evict that means all entries are used somewhere and we shall not remove them!
-            //we'll let the user of these entries purge the extra entries left in the cache later on
-            while (evictedFromDisk.second._entry) {
-                _diskCacheSize -= evictedFromDisk.second._entry->size();
-                evictedFromDisk.second._entry->removeAnyBackingFile();
-                evictedFromDisk = _diskCache.evict();
+            for (U32 i = 0; i < _shards.size(); ++i) {
+                IOJobs jobs;
+                {
+                    QMutexLocker locker(&_shards[i]->lock);
+                    //if the cache couldn't evict that means all entries are used somewhere and we shall not remove them!
+                    //we'll let the user of these entries purge the extra entries left in the cache later on
+                    _shards[i]->diskCache.recheckPinnedOnNextProbe();
+                    while (evictFromShard(_shards[i], true, &jobs)) {
+                    }
+                }
+                submitIOJobs(jobs);
             }
         }
 
         void clearInMemoryPortion() {
-            QMutexLocker locker(&_lock);
-            std::pair<hash_type,CachedValue> evictedFromMemory = _memoryCache.evict();
-            while (evictedFromMemory.second._entry) {
-                _memoryCacheSize -= evictedFromMemory.second._entry->size();
-                
-                ///move back the entry on disk if it can be store on disk
-                if (evictedFromMemory.second._entry->isStoredOnDisk()) {
-                    
-                    evictedFromMemory.second._entry->deallocate();
-                    /*insert it back into the disk portion */
-                    
-                    /*before that we need to clear the disk cache if it exceeds the maximum size allowed*/
-                    while (_diskCacheSize + evictedFromMemory.second._entry->size() >= _maximumCacheSize) {
-                        
-                        std::pair<hash_type,CachedValue> evictedFromDisk = _diskCache.evict();
-                        //if the cache couldn't evict that means all entries are used somewhere and we shall not remove them!
-                        //we'll let the user of these entries purge the extra entries left in the cache later on
-                        if (!evictedFromDisk.second._entry) {
-                            break;
-                        }
-                        _diskCacheSize -= evictedFromDisk.second._entry->size();
+            for (U32 i = 0; i < _shards.size(); ++i) {
+                IOJobs jobs;
+                {
+                    QMutexLocker locker(&_shards[i]->lock);
+                    ///move back the entries on disk if they can be stored on disk
+                    _shards[i]->memoryCache.recheckPinnedOnNextProbe();
+                    while (evictFromShard(_shards[i], false, &jobs, false)) {
                     }
-                    
-                    /*update the disk cache size*/
-                    _diskCacheSize += evictedFromMemory.second._entry->size();
-                    CacheIterator existingDiskCacheEntry = _diskCache(evictedFromMemory.second._entry->getHashKey());
-                    /*if the entry doesn't exist on the disk cache,make a new list and insert it*/
-                    if(existingDiskCacheEntry == _diskCache.end()){
-                        _diskCache.insert(evictedFromMemory.second._entry->getHashKey(),evictedFromMemory.second);
-                    }
-                    
                 }
-
-                evictedFromMemory = _memoryCache.evict();
+                submitIOJobs(jobs);
             }
+            ///the entries moved to disk may have exceeded the disk budget
+            makeRoomOnDisk();
             
             if (_signalEmitter) {
                 _signalEmitter->emitSignalClearedInMemoryPortion();
@@ -431,12 +448,13 @@ namespace Natron {
         }
 
         void clearExceedingEntries(){
-            QMutexLocker locker(&_lock);
-            while (_memoryCacheSize >= _maximumInMemorySize) {
-                if (!tryEvictEntry()) {
-                    break;
-                }
+            ///called once the entries are released: make the shards look at their entries in use again
+            for (U32 i = 0; i < _shards.size(); ++i) {
+                QMutexLocker locker(&_shards[i]->lock);
+                _shards[i]->memoryCache.recheckPinnedOnNextProbe();
+                _shards[i]->diskCache.recheckPinnedOnNextProbe();
             }
+            makeRoomInMemory();
         }
         
         /**
@@ -446,17 +464,20 @@ namespace Natron {
          **/
         void getCopy(std::list<EntryTypePtr>* copy) const
         {
-            QMutexLocker locker(&_lock);
-            for (CacheIterator it = _memoryCache.begin() ; it!=_memoryCache.end(); ++it) {
-                const std::list<CachedValue>& entries = getValueFromIterator(it);
-                for (typename std::list<CachedValue>::const_iterator it2 = entries.begin() ; it2!=entries.end(); ++it2) {
-                    copy->push_back(it2->_entry);
+            for (U32 i = 0; i < _shards.size(); ++i) {
+                CacheShard* shard = _shards[i];
+                QMutexLocker locker(&shard->lock);
+                for (CacheIterator it = shard->memoryCache.begin() ; it!=shard->memoryCache.end(); ++it) {
+                    const std::list<CachedValue>& entries = getValueFromIterator(it);
+                    for (typename std::list<CachedValue>::const_iterator it2 = entries.begin() ; it2!=entries.end(); ++it2) {
+                        copy->push_back(it2->_entry);
+                    }
                 }
-            }
-            for (CacheIterator it = _diskCache.begin() ; it!=_diskCache.end(); ++it) {
-                const std::list<CachedValue>& entries = getValueFromIterator(it);
-                for (typename std::list<CachedValue>::const_iterator it2 = entries.begin() ; it2!=entries.end(); ++it2) {
-                    copy->push_back(it2->_entry);
+                for (CacheIterator it = shard->diskCache.begin() ; it!=shard->diskCache.end(); ++it) {
+                    const std::list<CachedValue>& entries = getValueFromIterator(it);
+                    for (typename std::list<CachedValue>::const_iterator it2 = entries.begin() ; it2!=entries.end(); ++it2) {
+                        copy->push_back(it2->_entry);
+                    }
                 }
             }
         }
@@ -470,6 +491,9 @@ namespace Natron {
         // const data member: no need to take the lock
         unsigned int cacheVersion() const { return _version;}
 
+        // the shards never change after the constructor: no need to take the lock
+        unsigned int getShardsCount() const { return (unsigned int)_shards.size(); }
+
         /*Returns the name of the cache with its path preprended*/
         QString getCachePath() const {
             QString cacheFolderName(Natron::StandardPaths::writableLocation(Natron::StandardPaths::CacheLocation) + QDir::separator());
@@ -486,21 +510,86 @@ namespace Natron {
             newCachePath.append("restoreFile." NATRON_CACHE_FILE_EXT);
             return newCachePath.toStdString();
         }
+        
+        std::string getJournalFilePath() const {
+            QString newCachePath(getCachePath());
+            newCachePath.append(QDir::separator());
+            newCachePath.append("journal." NATRON_CACHE_FILE_EXT);
+            return newCachePath.toStdString();
+        }
+
+        void setMaximumCacheSize(U64 newSize) { QMutexLocker locker(&_sizeLock); _maximumCacheSize = newSize;}
+
+        void setMaximumInMemorySize(double percentage) { QMutexLocker locker(&_sizeLock); _maximumInMemorySize = _maximumCacheSize * percentage; }
+
+        U64 getMaximumSize() const  { QMutexLocker locker(&_sizeLock); return _maximumCacheSize;}
+
+        U64 getMaximumMemorySize() const { QMutexLocker locker(&_sizeLock); return _maximumInMemorySize;}
+
+        U64 getMemoryCacheSize() const  { QMutexLocker locker(&_sizeLock); return _memoryCacheSize;}
+
+        U64 getDiskCacheSize() const { QMutexLocker locker(&_sizeLock); return _diskCacheSize;}
 
-        void setMaximumCacheSize(U64 newSize) { _maximumCacheSize = newSize;}
+        ///Time taken by the threads making room in the cache to evict one entry
+        const LatencyHistogram& getEvictionLatency() const { return _evictionLatency; }
 
-        void setMaximumInMemorySize(double percentage) { _maximumInMemorySize = _maximumCacheSize * percentage; }
+        ///Time between the eviction of an entry and the end of its disk work on the I/O thread
+        const LatencyHistogram& getWriteBackLatency() const { return _ioQueue.getJobLatency(); }
 
-        U64 getMaximumSize() const  { QMutexLocker locker(&_lock); return _maximumCacheSize;}
+        ///Blocks until the disk work of the evictions made so far is done
+        void waitForPendingIO() const { _ioQueue.waitForIdle(); }
 
-        U64 getMaximumMemorySize() const { QMutexLocker locker(&_lock); return _maximumInMemorySize;}
+        /**
+         * @brief Sets how the entries moved to the disk portion from now on are stored. The entries already on disk
+         * are left as they are.
+         **/
+        void setDiskCompression(CacheCompressionMode mode) { _diskCompression = (int)mode; }
+
+        CacheCompressionMode getDiskCompression() const { return (CacheCompressionMode)(int)_diskCompression; }
+
+        ///The average size of the compressed files over the size of their data, 1 until a file was compressed
+        double getDiskCompressionRatio() const { QMutexLocker locker(&_sizeLock); return _compressionRatio; }
+
+        /**
+         * @brief Shares the entries of this cache with the other processes whose cache uses the same segment: get()
+         * looks-up the segment on a miss, and publishToSharedMemory() copies entries in it.
+         * Must be called before the cache is shared with other threads.
+         **/
+        void setSharedMemoryCache(const boost::shared_ptr<SharedMemoryCache>& sharedMemory) { _sharedMemory = sharedMemory; }
+
+        const boost::shared_ptr<SharedMemoryCache>& getSharedMemoryCache() const { return _sharedMemory; }
+
+        /**
+         * @brief Copies the entry, whose data must be complete, in the shared memory cache for the other processes.
+         * Nothing is done if an entry with the same hash is already there or if the entry has no data.
+         * @returns True if the entry was copied.
+         **/
+        bool publishToSharedMemory(const EntryTypePtr& entry) const {
+            if (!_sharedMemory || !entry || entry->dataSize() == 0) {
+                return false;
+            }
+            if (_sharedMemory->contains(entry->getHashKey())) {
+                return false;
+            }
+            std::string header;
+            if (!serializeEntry(entry,entry->getParams(),&header)) {
+                return false;
+            }
+            if (!_sharedMemory->insert(entry->getHashKey(),header,entry->readableData(),entry->dataSize())) {
+                return false;
+            }
+            _sharedMemoryPublications.ref();
+            return true;
+        }
 
-        U64 getMemoryCacheSize() const  { QMutexLocker locker(&_lock); return _memoryCacheSize;}
+        ///Number of entries copied from the shared memory cache by get()
+        int getSharedMemoryImportsCount() const { return (int)_sharedMemoryImports; }
 
-        U64 getDiskCacheSize() const { QMutexLocker locker(&_lock); return _diskCacheSize;}
+        ///Number of entries copied to the shared memory cache by publishToSharedMemory()
+        int getSharedMemoryPublicationsCount() const { return (int)_sharedMemoryPublications; }
 
         CacheSignalEmitter* activateSignalEmitter() const {
-            QMutexLocker locker(&_lock);
+            QMutexLocker locker(&_sizeLock);
             if(!_signalEmitter)
                 _signalEmitter = new CacheSignalEmitter;
             return _signalEmitter;
@@ -509,162 +598,500 @@ namespace Natron {
         /** @brief This function can be called to remove a specific entry from the cache. For example a frame
          * that has had its render aborted but already belong to the cache.
          **/
-        void removeEntry(EntryTypePtr entry) {
+        void removeEntry(EntryTypePtr entry) const {
 
             ///early return if entry is NULL
             if (!entry) {
                 return;
             }
 
-            QMutexLocker l(&_lock);
-            CacheIterator existingEntry = _memoryCache(entry->getHashKey());
-            if (existingEntry != _memoryCache.end()) {
-                std::list<CachedValue>& ret = getValueFromIterator(existingEntry);
-                for (typename std::list<CachedValue>::iterator it = ret.begin(); it!=ret.end(); ++it) {
-                    if(it->_entry->getKey() == entry->getKey()){
-                        ret.erase(it);
-                        _memoryCacheSize -= entry->size();
-                        break;
-                    }
-                }
-                if (ret.empty()) {
-                    _memoryCache.erase(existingEntry);
-                }
-            } else {
-                existingEntry = _diskCache(entry->getHashKey());
-                if (existingEntry != _diskCache.end()) {
+            CacheShard* shard = getShard(entry->getHashKey());
+            bool removed = false;
+            {
+                QMutexLocker l(&shard->lock);
+                waitForFile(shard,entry->getHashKey());
+                CacheIterator existingEntry = shard->memoryCache.find(entry->getHashKey());
+                if (existingEntry != shard->memoryCache.end()) {
                     std::list<CachedValue>& ret = getValueFromIterator(existingEntry);
                     for (typename std::list<CachedValue>::iterator it = ret.begin(); it!=ret.end(); ++it) {
-                        if (it->_entry->getKey() == entry->getKey()) {
+                        if(it->_entry->getKey() == entry->getKey()){
                             ret.erase(it);
-                            _diskCacheSize -= entry->size();
+                            addToMemorySize(-(qint64)entry->size());
+                            removed = true;
                             break;
                         }
                     }
                     if (ret.empty()) {
-                        _diskCache.erase(existingEntry);
+                        shard->memoryCache.erase(existingEntry);
+                    }
+                } else {
+                    existingEntry = shard->diskCache.find(entry->getHashKey());
+                    if (existingEntry != shard->diskCache.end()) {
+                        std::list<CachedValue>& ret = getValueFromIterator(existingEntry);
+                        for (typename std::list<CachedValue>::iterator it = ret.begin(); it!=ret.end(); ++it) {
+                            if (it->_entry->getKey() == entry->getKey()) {
+                                addToDiskSize(-(qint64)it->_diskSize);
+                                ret.erase(it);
+                                removed = true;
+                                break;
+                            }
+                        }
+                        if (ret.empty()) {
+                            shard->diskCache.erase(existingEntry);
+                        }
                     }
                 }
             }
+            if (removed && _journal && entry->isStoredOnDisk()) {
+                ///the file is left as is because the entry may still be used, it is removed on the next restore
+                _ioQueue.push(boost::bind(&CacheJournal::appendDiscard,_journal.get(),entry->getHashKey(),true));
+            }
         }
 
         
         
-        /*Saves cache to disk as a settings file.
-         */
-        void save(CacheTOC* tableOfContents) {
+        /**
+         * @brief Moves the entries living in memory to the disk portion when they can be stored on disk,
+         * which journals them, and compacts the journal so that the next restoreFromJournal() reads only
+         * the live entries.
+         **/
+        void save() {
             clearInMemoryPortion();
-            QMutexLocker l(&_lock); // must be locked
+            _ioQueue.waitForIdle();
+            if (_journal) {
+                _journal->compact();
+            }
+        }
+        
+        /**
+         * @brief Opens the journal of the disk portion and puts back the entries it lists in the disk portion,
+         * without reading their files: the content of a file is checked against the checksum recorded in
+         * the journal the first time its entry is looked-up. The files left by the entries that were being
+         * written or removed when the journal was last updated are deleted.
+         * Until this is called the disk portion isn't journaled. It must be called once, before the cache is
+         * shared with other threads.
+         **/
+        void restoreFromJournal() {
+            std::string cachePath = QString(getCachePath()+QDir::separator()).toStdString();
+            _journal.reset(new CacheJournal(getJournalFilePath(),_version));
+            std::vector<CacheJournal::Record> records;
+            std::vector<U64> discardedFiles;
+            _journal->open(&records,&discardedFiles);
+            for (U32 i = 0; i < discardedFiles.size(); ++i) {
+                removeEntryFiles(EntryType::generateStringFromHash(cachePath,discardedFiles[i]));
+            }
             
-            for (CacheIterator it = _diskCache.begin(); it!= _diskCache.end() ; ++it) {
-                std::list<CachedValue>& listOfValues  = getValueFromIterator(it);
-                for (typename std::list<CachedValue>::const_iterator it2 = listOfValues.begin() ;it2 != listOfValues.end(); ++it2) {
-                    if (it2->_entry->isStoredOnDisk()) {
-                        SerializedEntry serialization;
-                        serialization.hash = it2->_entry->getHashKey();
-                        serialization.params = it2->_params;
-                        serialization.key = it2->_entry->getKey();
-                        tableOfContents->push_back(serialization);
+            for (U32 i = 0; i < records.size(); ++i) {
+                const CacheJournal::Record& record = records[i];
+                SerializedEntry serialization;
+                EntryType* value = NULL;
+                try {
+                    std::istringstream iss(record.key);
+                    boost::archive::binary_iarchive iArchive(iss);
+                    iArchive >> serialization;
+                    if (serialization.key.getHash() == record.hash) {
+                        value = new EntryType(serialization.key,serialization.params,true,cachePath);
                     }
+                } catch (const std::exception& e) {
+                    qDebug() << "Failed to restore a cache entry: " << e.what();
+                }
+                std::string filePath = EntryType::generateStringFromHash(cachePath,record.hash);
+                ///a compressed file being written when the journal was last updated
+                QFile::remove(CacheCompression::getCompressedFilePath(filePath).c_str());
+                if (!value || value->getStoredSize() != record.dataSize) {
+                    ///the file is missing or was not completely written
+                    delete value;
+                    QFile::remove(filePath.c_str());
+                    _journal->appendDiscard(record.hash,false);
+                    continue;
                 }
+                CachedValue cachedValue;
+                cachedValue._entry = EntryTypePtr(value);
+                cachedValue._params = serialization.params;
+                cachedValue._checksum = record.dataChecksum;
+                cachedValue._verifyChecksum = true;
+                cachedValue._diskSize = value->getStoredSize();
                 
+                ///the journal lists the entries from the least recently used
+                CacheShard* shard = getShard(record.hash);
+                QMutexLocker locker(&shard->lock);
+                cachedValue._lastAccess = tickAccessClock();
+                insertInDiskPortion(shard,record.hash,cachedValue);
             }
-            
-            
+            ///the disk budget may have been reduced since the entries were written
+            makeRoomOnDisk();
+            _ioQueue.waitForIdle();
+            _journal->compact();
         }
         
-        /*Restores the cache from disk.*/
+        /**
+         * @brief Restores the cache from the table of contents written by the versions of Natron which
+         * didn't journal the disk portion. restoreFromJournal() should be called first so that the restored
+         * entries are journaled.
+         **/
         void restore(const CacheTOC& tableOfContents) {
-            QMutexLocker locker(&_lock);
+            std::string cachePath = QString(getCachePath()+QDir::separator()).toStdString();
             for (typename CacheTOC::const_iterator it =
                  tableOfContents.begin(); it!=tableOfContents.end(); ++it) {
                 if (it->hash != it->key.getHash()) {
-                    /*
-                     * If this warning is printed this means that the value computed by it->key()
-                     * is different than the value stored prior to serialiazing this entry. In other words there're
-                     * 2 possibilities:
-                     * 1) The key has changed since it has been added to the cache: maybe you forgot to serialize some 
-                     * members of the key or you didn't save them correctly.
-                     * 2) The hash key computation is unreliable and is depending upon changing or non-deterministic
-                     * parameters which is wrong.
-                     */
-                    qDebug() << "WARNING: serialized hash key different than the restored one";
+                    if (it->hash != it->key.getLegacyHash()) {
+                        /*
+                         * If this warning is printed this means that the value computed by it->key()
+                         * is different than the value stored prior to serialiazing this entry. In other words there're
+                         * 2 possibilities:
+                         * 1) The key has changed since it has been added to the cache: maybe you forgot to serialize some
+                         * members of the key or you didn't save them correctly.
+                         * 2) The hash key computation is unreliable and is depending upon changing or non-deterministic
+                         * parameters which is wrong.
+                         */
+                        qDebug() << "WARNING: serialized hash key different than the restored one";
+                    }
+                    ///Otherwise the entry was saved by a version of Natron hashing with a CRC64. Its key holds the
+                    ///hashes of the nodes computed the same way, which no render asks for anymore: drop it.
+                    QFile::remove(EntryType::generateStringFromHash(cachePath,it->hash).c_str());
+                    continue;
                 }
                 EntryType* value = NULL;
                 try {
-                    value = new EntryType(it->key,it->params,true,QString(getCachePath()+QDir::separator()).toStdString());
+                    value = new EntryType(it->key,it->params,true,cachePath);
+                } catch (const std::bad_alloc& e) {
+                    qDebug() << e.what();
+                    continue;
+                }
+                try {
+                    value->reOpenFileMapping();
                 } catch (const std::bad_alloc& e) {
                     qDebug() << e.what();
+                    delete value;
                     continue;
                 }
                 CachedValue cachedValue;
                 cachedValue._entry = EntryTypePtr(value);
                 cachedValue._params = it->params;
-                sealEntry(cachedValue);
+                
+                CacheShard* shard = getShard(cachedValue._entry->getHashKey());
+                {
+                    QMutexLocker locker(&shard->lock);
+                    sealEntry(shard,cachedValue);
+                }
+                if (_journal) {
+                    ///journaled with its checksum when it is moved to the disk portion
+                    _ioQueue.push(boost::bind(&CacheJournal::appendDiscard,_journal.get(),value->getHashKey(),true));
+                }
+                ///cachedValue still holds a reference, release it before evicting
+                cachedValue._entry.reset();
+                makeRoomInMemory();
             }
             
         }
     private:
 
-   
+        CacheShard* getShard(hash_type hash) const {
+            ///fold the high bits so that hash keys differing only by their high bits don't fall in the same shard
+            U64 h = (U64)hash;
+            return _shards[(U32)((h ^ (h >> 32)) % _shards.size())];
+        }
+        
+        int tickAccessClock() const {
+            return _accessClock.fetchAndAddRelaxed(1) + 1;
+        }
+        
+        void addToMemorySize(qint64 delta) const {
+            QMutexLocker l(&_sizeLock);
+            _memoryCacheSize += delta;
+        }
+        
+        void addToDiskSize(qint64 delta) const {
+            QMutexLocker l(&_sizeLock);
+            _diskCacheSize += delta;
+        }
+
+        /** @brief Same as get() but the caller must hold the lock of the shard. The lock is released while
+         * waiting for the file of the entry and while reading it back from the disk portion.
+         * @param jobs [out] The I/O jobs to queue once the lock is released.
+         **/
+        bool getInternal(CacheShard* shard,const typename EntryType::key_type& key,NonKeyParamsPtr* params,EntryTypePtr* returnValue,
+                         IOJobs* jobs) const {
+            assert(!shard->lock.tryLock()); // must be locked
+            
+            ///the file of the entry may not be in a state it can be mapped in
+            waitForFile(shard,key.getHash());
+            
+            ///find a matching value in the internal memory container
+            CacheIterator memoryCached = shard->memoryCache(key.getHash());
+            
+            if (memoryCached != shard->memoryCache.end()) {
+                /*we found something with a matching hash key. There may be several entries linked to
+                 this key, we need to find one with matching params*/
+                std::list<CachedValue>& ret = getValueFromIterator(memoryCached);
+                for (typename std::list<CachedValue>::iterator it = ret.begin(); it!=ret.end(); ++it) {
+                    if (it->_entry->getKey() == key) {
+                        if(_signalEmitter) {
+                            ///emit the signal add entry so it can sync any external structure.
+                            _signalEmitter->emitAddedEntry();
+                        }
+                        it->_lastAccess = tickAccessClock();
+                        *returnValue = it->_entry;
+                        *params = it->_params;
+                        return true;
+                    }
+                }
+                return false;
+            } else {
+                
+                ///fallback on the disk cache internal container
+                CacheIterator diskCached = shard->diskCache(key.getHash());
+                
+                if (diskCached == shard->diskCache.end()) {
+                    /*the entry was neither in memory or disk, just allocate a new one*/
+                    return false;
+                } else {
+                    /*we found something with a matching hash key. There may be several entries linked to
+                     this key, we need to find one with matching values(operator ==)*/
+                    std::list<CachedValue>& ret = getValueFromIterator(diskCached);
+                    
+                    for (typename std::list<CachedValue>::iterator it = ret.begin();
+                         it!=ret.end(); ++it) {
+                        if (it->_entry->getKey() == key) {
+                            /*If we found 1 entry in the list that has exactly the same key params,
+                             we re-open the mapping to the RAM put the entry
+                             back into the memoryCache.*/
+                            
+                            // remove it from the disk cache
+                            CachedValue value = *it;
+                            addToDiskSize(-(qint64)value._diskSize);
+                            ret.erase(it);
+                            if (ret.empty()) {
+                                shard->diskCache.erase(diskCached);
+                            }
+                            
+                            ///checksum of the content of the file, as journaled
+                            U64 fileChecksum = 0;
+                            bool fileBusy = false;
+                            if (value._writeBackPending) {
+                                ///the I/O thread didn't unmap it yet, and won't once the flag is cleared
+                                assert(!value._verifyChecksum);
+                                value._writeBackPending = false;
+                            } else {
+                                ///the file is read and decompressed out of the lock, while the look-ups of the hash
+                                ///wait for it: the entry is in none of the containers meanwhile
+                                shard->busyFiles.insert(key.getHash());
+                                fileBusy = true;
+                                shard->lock.unlock();
+                                bool reopened = false;
+                                try {
+                                    ///a compressed file is decompressed in place
+                                    value._entry->reOpenFileMapping(value._verifyChecksum ? &fileChecksum : NULL);
+                                    reopened = true;
+                                } catch (const std::exception& e) {
+                                    qDebug() << "Error while reopening cache file: " << e.what();
+                                } catch (...) {
+                                    qDebug() << "Error while reopening cache file";
+                                }
+                                shard->lock.lock();
+                                if (!reopened) {
+                                    jobs->push_back(boost::bind(&Cache::removeEvictedFile,this,key.getHash(),value._entry));
+                                    releaseFile(shard,key.getHash());
+                                    return false;
+                                }
+                            }
+                            
+                            if (value._verifyChecksum) {
+                                ///first look-up of an entry restored from the journal: make sure its file
+                                ///holds what was written
+                                if (fileChecksum != value._checksum) {
+                                    qDebug() << "WARNING: the cache file of an entry is corrupted, it is removed.";
+                                    jobs->push_back(boost::bind(&Cache::removeEvictedFile,this,key.getHash(),value._entry));
+                                    if (fileBusy) {
+                                        releaseFile(shard,key.getHash());
+                                    }
+                                    return false;
+                                }
+                                value._verifyChecksum = false;
+                            }
+                            
+                            //put it back into the RAM
+                            value._lastAccess = tickAccessClock();
+                            shard->memoryCache.insert(value._entry->getHashKey(),value);
+                            addToMemorySize(value._entry->size());
+                            
+                            
+                            if(_signalEmitter)
+                                _signalEmitter->emitAddedEntry();
+                            *returnValue = value._entry;
+                            *params = value._params;
+                            if (fileBusy) {
+                                releaseFile(shard,key.getHash());
+                            }
+                            return true;
+                            
+                        }
+                    }
+                    /*if we reache here it means no entries linked to the hash key matches the params,then
+                     we allocate a new one*/
+                    return false;
+                }
+            }
+        }
 
 
         /** @brief Allocates a new entry by the cache. The storage is then handled by
      * the cache solely.
+     * @param jobs [out] The I/O jobs to queue once the lock is released.
      **/
-        EntryTypePtr newEntry(const typename EntryType::key_type& key,const NonKeyParamsPtr& params) const {
-            assert(!_lock.tryLock()); // must be locked
+        EntryTypePtr newEntry(CacheShard* shard,const typename EntryType::key_type& key,const NonKeyParamsPtr& params,IOJobs* jobs) const {
+            assert(!shard->lock.tryLock()); // must be locked
             EntryTypePtr entryptr;
             try {
                 entryptr.reset(new EntryType(key,params, false , QString(getCachePath()+QDir::separator()).toStdString()));
             } catch(const std::bad_alloc& e) {
                 return entryptr;
             }
+            if (_journal && entryptr->isStoredOnDisk()) {
+                ///the file is about to be written: if we crash before the entry is journaled it must be removed
+                jobs->push_back(boost::bind(&CacheJournal::appendDiscard,_journal.get(),entryptr->getHashKey(),true));
+            }
             CachedValue cachedValue;
             cachedValue._entry = entryptr;
             cachedValue._params = params;
-            sealEntry(cachedValue);
+            sealEntry(shard,cachedValue);
             return entryptr;
 
         }
 
-        /** @brief Inserts into the cache an entry that was previously allocated by the newEntry()
-     * function. This is called directly by newEntry() if the allocation was successful
+        /** @brief Inserts into the shard an entry that was previously allocated by the newEntry()
+     * function. This is called directly by newEntry() if the allocation was successful.
+     * This doesn't make room for the entry: the caller is expected to call makeRoomInMemory()
+     * once the shard lock is released.
      **/
-        void sealEntry(const CachedValue& entry) const {
-            assert(!_lock.tryLock()); // must be locked
-            /*If the cache size exceeds the maximum size allowed, try to make some space*/
-            while (_memoryCacheSize+entry._entry->size() >= _maximumInMemorySize) {
-                if (!tryEvictEntry()) {
+        void sealEntry(CacheShard* shard,CachedValue entry) const {
+            assert(!shard->lock.tryLock()); // must be locked
+            if(_signalEmitter) {
+                _signalEmitter->emitAddedEntry();
+            }
+            entry._lastAccess = tickAccessClock();
+            /*appended to the list of the hash if it exists*/
+            shard->memoryCache.insert(entry._entry->getHashKey(),entry);
+            addToMemorySize(entry._entry->size());
+        }
+        
+        /**
+         * @brief Evicts entries from the memory portion of the cache until it fits in its budget, or
+         * until nothing can be evicted anymore. The caller must not hold any shard lock.
+         **/
+        void makeRoomInMemory() const {
+            std::vector<bool> exhausted(_shards.size(),false);
+            for (;;) {
+                {
+                    QMutexLocker l(&_sizeLock);
+                    if (_memoryCacheSize < _maximumInMemorySize) {
+                        break;
+                    }
+                }
+                if (!evictNextEntry(false,&exhausted)) {
                     break;
                 }
             }
-            if(_signalEmitter) {
-                _signalEmitter->emitAddedEntry();
+            makeRoomOnDisk();
+        }
+        
+        /**
+         * @brief Same as makeRoomInMemory() but for the disk portion of the cache.
+         **/
+        void makeRoomOnDisk() const {
+            std::vector<bool> exhausted(_shards.size(),false);
+            for (;;) {
+                {
+                    QMutexLocker l(&_sizeLock);
+                    if (_diskCacheSize < _maximumCacheSize) {
+                        return;
+                    }
+                }
+                if (!evictNextEntry(true,&exhausted)) {
+                    return;
+                }
             }
-            typename EntryType::hash_type hash = entry._entry->getHashKey();
-            /*if the entry doesn't exist on the memory cache,make a new list and insert it*/
-            CacheIterator existingEntry = _memoryCache(hash);
-            if (existingEntry == _memoryCache.end()) {
-                _memoryCache.insert(hash,entry);
-            } else {
-                /*append to the existing list*/
-                getValueFromIterator(existingEntry).push_back(entry);
+        }
+        
+        /**
+         * @brief Evicts one entry from the shard whose next entry to evict has the lowest rank according to the
+         * EvictionPolicy. Shards whose entries are all in use are skipped.
+         * The caller must not hold any shard lock.
+         * @param exhausted [in/out] The shards found with nothing to evict, which are not probed again. The callers
+         * evicting several entries in a row pass the same vector, so that each eviction doesn't lock every shard.
+         * @returns False if no entry could be evicted in any shard.
+         **/
+        bool evictNextEntry(bool fromDisk,std::vector<bool>* exhausted) const {
+            assert(exhausted->size() == _shards.size());
+            for (;;) {
+                const U32 now = (U32)tickAccessClock();
+                int victimShard = -1;
+                double lowestRank = 0.;
+                for (U32 i = 0; i < _shards.size(); ++i) {
+                    if ((*exhausted)[i]) {
+                        continue;
+                    }
+                    QMutexLocker l(&_shards[i]->lock);
+                    CacheContainer& container = fromDisk ? _shards[i]->diskCache : _shards[i]->memoryCache;
+                    double rank;
+                    if (!container.getNextVictimRank(now,&rank)) {
+                        (*exhausted)[i] = true;
+                        continue;
+                    }
+                    if (victimShard == -1 || rank < lowestRank) {
+                        victimShard = i;
+                        lowestRank = rank;
+                    }
+                }
+                if (victimShard == -1) {
+                    return false;
+                }
+                ///The shard may have changed since we peeked at it, this is why the eviction order is only approximate.
+                QElapsedTimer timer;
+                timer.start();
+                IOJobs jobs;
+                bool evicted;
+                {
+                    QMutexLocker l(&_shards[victimShard]->lock);
+                    evicted = evictFromShard(_shards[victimShard], fromDisk, &jobs);
+                }
+                if (evicted) {
+                    submitIOJobs(jobs);
+                    _evictionLatency.record(timer.nsecsElapsed());
+                    return true;
+                }
+                (*exhausted)[victimShard] = true;
             }
-            _memoryCacheSize += entry._entry->size();
         }
 
-        bool tryEvictEntry() const {
-            assert(!_lock.tryLock());
-            std::pair<hash_type,CachedValue> evicted = _memoryCache.evict();
+        /**
+         * @brief Evicts the first entry of the given portion of the shard in the eviction order. An entry
+         * evicted from memory is moved to the disk portion if it is stored on disk.
+         * The caller must hold the lock of the shard.
+         * @param jobs [out] The I/O jobs to queue once the lock is released: the removal of the file of an entry
+         * evicted from the disk portion, the write-back of an entry moved to the disk portion.
+         * @param emitRemovedSignal If true, the removedLRUEntry() signal is emitted for an entry evicted from memory.
+         * @returns False if the portion is empty or all its entries are in use.
+         **/
+        bool evictFromShard(CacheShard* shard,bool fromDisk,IOJobs* jobs,bool emitRemovedSignal = true) const {
+            assert(!shard->lock.tryLock());
+            CacheContainer& container = fromDisk ? shard->diskCache : shard->memoryCache;
+            std::pair<hash_type,CachedValue> evicted = container.evict();
             //if the cache couldn't evict that means all entries are used somewhere and we shall not remove them!
             //we'll let the user of these entries purge the extra entries left in the cache later on
             if (!evicted.second._entry) {
                 return false;
             }
-            _memoryCacheSize -= evicted.second._entry->size();
+            
+            if (fromDisk) {
+                addToDiskSize(-(qint64)evicted.second._diskSize);
+                jobs->push_back(boost::bind(&Cache::removeEvictedFile,this,evicted.first,evicted.second._entry));
+                return true;
+            }
+            
+            addToMemorySize(-(qint64)evicted.second._entry->size());
 
-            if (_signalEmitter) {
+            if (emitRemovedSignal && _signalEmitter) {
                 _signalEmitter->emitRemovedLRUEntry();
             }
 
@@ -673,34 +1100,320 @@ namespace Natron {
             if (evicted.second._entry->isStoredOnDisk()) {
 
                 assert(evicted.second._entry.unique());
-                evicted.second._entry->deallocate();
-                /*insert it back into the disk portion */
-
-                /*before that we need to clear the disk cache if it exceeds the maximum size allowed*/
-                while (_diskCacheSize + evicted.second._entry->size() >= _maximumCacheSize) {
+                evicted.second._writeBackPending = true;
+                evicted.second._diskSize = estimateStoredSize(*evicted.second._entry);
+                ///the job doesn't keep the entry alive, so that it can still be evicted from the disk portion
+                jobs->push_back(boost::bind(&Cache::writeBack,this,evicted.first,boost::weak_ptr<EntryType>(evicted.second._entry),
+                                            evicted.second._params));
+                
+                /*insert it back into the disk portion. The disk budget is enforced afterwards by makeRoomOnDisk()
+                 once the shard lock is released.*/
+                insertInDiskPortion(shard,evicted.first,evicted.second);
+            }
 
-                    std::pair<hash_type,CachedValue> evictedFromDisk = _diskCache.evict();
-                    //if the cache couldn't evict that means all entries are used somewhere and we shall not remove them!
-                    //we'll let the user of these entries purge the extra entries left in the cache later on
-                    if (!evictedFromDisk.second._entry) {
-                        break;
-                    }
-                    _diskCacheSize -= evictedFromDisk.second._entry->size();
+            return true;
+        }
+        
+        /** @brief Inserts an entry in the disk portion of the shard, its file must not be mapped unless
+         * its write-back is pending. It is counted for its _diskSize. The caller must hold the lock of the shard.
+         **/
+        void insertInDiskPortion(CacheShard* shard,hash_type hash,const CachedValue& value) const {
+            assert(!shard->lock.tryLock());
+            /*update the disk cache size*/
+            addToDiskSize(value._diskSize);
+            /*appended to the list of the hash if it exists*/
+            shard->diskCache.insert(hash,value);
+        }
+        
+        /** @brief The number of bytes the entry, whose file is not compressed yet, is expected to take on disk once
+         * the I/O thread is done with it.
+         **/
+        U64 estimateStoredSize(const EntryType& entry) const {
+            if (getDiskCompression() == CACHE_COMPRESSION_NONE) {
+                return entry.getStoredSize();
+            }
+            QMutexLocker l(&_sizeLock);
+            return (U64)(entry.getStoredSize() * _compressionRatio);
+        }
+        
+        /** @brief Records in the journal that the file of the entry holds its data, which must be mapped.
+         **/
+        void journalInsertion(const EntryTypePtr& entry,const NonKeyParamsPtr& params) const {
+            journalInsertion(entry,params,entry->dataSize(),entry->computeChecksum());
+        }
+        
+        /** @brief Records in the journal that the file of the entry has the given size and checksum.
+         **/
+        void journalInsertion(const EntryTypePtr& entry,const NonKeyParamsPtr& params,U64 fileSize,U64 fileChecksum) const {
+            CacheJournal::Record record;
+            record.hash = entry->getHashKey();
+            if (!serializeEntry(entry,params,&record.key)) {
+                _journal->appendDiscard(record.hash,true);
+                return;
+            }
+            record.dataSize = fileSize;
+            record.dataChecksum = fileChecksum;
+            _journal->appendInsertion(record);
+        }
+        
+        ///Serializes the key and the params of the entry, as the journal and the shared memory cache store them
+        static bool serializeEntry(const EntryTypePtr& entry,const NonKeyParamsPtr& params,std::string* serialized) {
+            SerializedEntry serialization;
+            serialization.hash = entry->getHashKey();
+            serialization.key = entry->getKey();
+            serialization.params = params;
+            try {
+                std::ostringstream oss;
+                {
+                    boost::archive::binary_oarchive oArchive(oss);
+                    oArchive << serialization;
                 }
-
-                /*update the disk cache size*/
-                _diskCacheSize += evicted.second._entry->size();
-                CacheIterator existingDiskCacheEntry = _diskCache(evicted.first);
-                /*if the entry doesn't exist on the disk cache,make a new list and insert it*/
-                if(existingDiskCacheEntry == _diskCache.end()){
-                    _diskCache.insert(evicted.first,evicted.second);
-                }else{ /*append to the existing list*/
-                    getValueFromIterator(existingDiskCacheEntry).push_back(evicted.second);
+                *serialized = oss.str();
+            } catch (const std::exception& e) {
+                qDebug() << "Failed to serialize a cache entry: " << e.what();
+                return false;
+            }
+            return true;
+        }
+        
+        /**
+         * @brief Looks-up the shared memory cache for the entry missing in this cache. If another process put it
+         * there, a new entry is created in this cache with a copy of its data.
+         * The entry is only inserted in the shard once its data is complete. The caller marked the hash busy
+         * in the shard so that the other look-ups of the hash wait for the import: it is released here.
+         **/
+        bool importFromSharedMemory(CacheShard* shard,const typename EntryType::key_type& key,NonKeyParamsPtr* params,
+                                    EntryTypePtr* returnValue) const {
+            EntryTypePtr entry;
+            NonKeyParamsPtr entryParams = readFromSharedMemory(key,&entry);
+            IOJobs jobs;
+            {
+                QMutexLocker l(&shard->lock);
+                if (entry) {
+                    if (_journal && entry->isStoredOnDisk()) {
+                        ///if we crash before the entry is journaled its file must be removed
+                        jobs.push_back(boost::bind(&CacheJournal::appendDiscard,_journal.get(),entry->getHashKey(),true));
+                    }
+                    CachedValue cachedValue;
+                    cachedValue._entry = entry;
+                    cachedValue._params = entryParams;
+                    sealEntry(shard,cachedValue);
                 }
+                releaseFile(shard,key.getHash());
             }
-
+            if (!entry) {
+                return false;
+            }
+            submitIOJobs(jobs);
+            ///The new entry is referenced by returnValue, hence it cannot be evicted by this call.
+            makeRoomInMemory();
+            _sharedMemoryImports.ref();
+            *params = entryParams;
+            *returnValue = entry;
             return true;
         }
+        
+        /**
+         * @brief Copies the record of the key in the shared memory cache in a new entry, which isn't in the cache.
+         * @returns The parameters of the entry, or NULL and entry is left NULL if the record isn't there anymore,
+         * is corrupted or was overwritten while it was copied.
+         **/
+        NonKeyParamsPtr readFromSharedMemory(const typename EntryType::key_type& key,EntryTypePtr* entry) const {
+            SharedMemoryCache::Record record;
+            std::string header;
+            if (!_sharedMemory->find(key.getHash(),&record,&header)) {
+                return NonKeyParamsPtr();
+            }
+            SerializedEntry serialization;
+            try {
+                std::istringstream iss(header);
+                boost::archive::binary_iarchive iArchive(iss);
+                iArchive >> serialization;
+            } catch (const std::exception& e) {
+                qDebug() << "Failed to read an entry of the shared memory cache: " << e.what();
+                return NonKeyParamsPtr();
+            }
+            ///the hashes of 2 different keys may collide
+            if (!serialization.params || !(serialization.key == key)) {
+                return NonKeyParamsPtr();
+            }
+            EntryTypePtr newEntry;
+            try {
+                newEntry.reset(new EntryType(key,serialization.params,false,QString(getCachePath()+QDir::separator()).toStdString()));
+            } catch (const std::bad_alloc& e) {
+                return NonKeyParamsPtr();
+            }
+            if (newEntry->dataSize() != record.dataSize || !_sharedMemory->readData(record,newEntry->writableData())) {
+                ///the record was overwritten while it was copied: the entry holds garbage
+                newEntry->deallocate();
+                newEntry->removeAnyBackingFile();
+                return NonKeyParamsPtr();
+            }
+            newEntry->onDataImported();
+            *entry = newEntry;
+            return serialization.params;
+        }
+        
+        /** @brief Queues the jobs on the I/O thread. The caller must not hold any shard lock since this may block
+         * until the I/O thread catches up.
+         **/
+        void submitIOJobs(const IOJobs& jobs) const {
+            for (U32 i = 0; i < jobs.size(); ++i) {
+                _ioQueue.push(jobs[i]);
+            }
+        }
+        
+        /** @brief I/O job of an entry moved from memory to the disk portion: journals it and unmaps its file,
+         * replacing it by a compressed file if the disk portion is compressed.
+         * Nothing is done if the entry was looked-up or removed from the disk portion meanwhile.
+         **/
+        void writeBack(hash_type hash,boost::weak_ptr<EntryType> weakEntry,NonKeyParamsPtr params) const {
+            ///if the entry was evicted from the disk portion meanwhile, the removal job queued after this one holds it
+            EntryTypePtr entry = weakEntry.lock();
+            if (!entry) {
+                return;
+            }
+            CacheShard* shard = getShard(hash);
+            if (!isWriteBackPending(shard,hash,entry)) {
+                return;
+            }
+            ///Only the I/O thread unmaps the entries moved to the disk portion, hence the file stays mapped while
+            ///it is compressed or its checksum is computed. If the entry is looked-up meanwhile and modified, the
+            ///checksum won't match and the entry is dropped if the cache is restored before it is journaled again.
+            std::string compressedPath;
+            U64 compressedSize = 0,compressedChecksum = 0;
+            CacheCompressionMode compression = getDiskCompression();
+            if (compression != CACHE_COMPRESSION_NONE) {
+                compressedPath = entry->writeCompressedFile(compression,&compressedSize,&compressedChecksum);
+            }
+            if (_journal && compressedPath.empty()) {
+                journalInsertion(entry,params);
+            }
+            ///only the state changes under the lock: the file is unmapped and replaced once it is released, while
+            ///the look-ups of the hash wait for it
+            bool unmapped = false;
+            MemoryFile* mapping = NULL;
+            {
+                QMutexLocker l(&shard->lock);
+                CachedValue* value = findInDiskPortion(shard,hash,entry);
+                if (value && value->_writeBackPending) {
+                    value->_writeBackPending = false;
+                    mapping = entry->detachFileMapping();
+                    shard->busyFiles.insert(hash);
+                    unmapped = true;
+                }
+            }
+            bool compressed = false;
+            if (!unmapped) {
+                ///looked-up meanwhile: the entry is back in memory
+                if (!compressedPath.empty()) {
+                    QFile::remove(compressedPath.c_str());
+                }
+            } else {
+                delete mapping;
+                compressed = !compressedPath.empty() && entry->moveCompressedFile(compressedPath);
+                QMutexLocker l(&shard->lock);
+                if (compressed) {
+                    entry->setCompressedFile(compressedSize);
+                }
+                ///the entry is in use by this job, hence it wasn't evicted, and removeEntry() waits for the file
+                CachedValue* value = findInDiskPortion(shard,hash,entry);
+                if (value) {
+                    ///the entry was counted with an estimate of its compressed size
+                    U64 storedSize = entry->getStoredSize();
+                    addToDiskSize((qint64)storedSize - (qint64)value->_diskSize);
+                    value->_diskSize = storedSize;
+                }
+                releaseFile(shard,hash);
+            }
+            if (compressed) {
+                if (_journal) {
+                    journalInsertion(entry,params,compressedSize,compressedChecksum);
+                }
+                updateCompressionRatio((double)compressedSize / entry->dataSize());
+            } else if (compression != CACHE_COMPRESSION_NONE && compressedPath.empty()) {
+                ///not worth it: the estimates must not stay optimistic about these entries
+                updateCompressionRatio(1.);
+            }
+        }
+        
+        void updateCompressionRatio(double ratio) const {
+            QMutexLocker l(&_sizeLock);
+            _compressionRatio = _compressionRatioMeasured ? 0.9 * _compressionRatio + 0.1 * ratio : ratio;
+            _compressionRatioMeasured = true;
+        }
+        
+        bool isWriteBackPending(CacheShard* shard,hash_type hash,const EntryTypePtr& entry) const {
+            QMutexLocker l(&shard->lock);
+            CachedValue* value = findInDiskPortion(shard,hash,entry);
+            return value && value->_writeBackPending;
+        }
+        
+        /** @brief I/O job of an entry removed from the disk portion: unmaps and deletes its file, unless a new
+         * entry with the same hash, hence the same file, was created meanwhile.
+         **/
+        void removeEvictedFile(hash_type hash,EntryTypePtr entry) const {
+            ///the entry is in none of the containers, the cache doesn't reference it anymore
+            entry->deallocate();
+            CacheShard* shard = getShard(hash);
+            {
+                QMutexLocker l(&shard->lock);
+                if (shard->memoryCache.find(hash) != shard->memoryCache.end() ||
+                    shard->diskCache.find(hash) != shard->diskCache.end()) {
+                    return;
+                }
+                ///no entry with the same hash, hence the same file, can be created until the file is removed
+                shard->busyFiles.insert(hash);
+            }
+            entry->removeAnyBackingFile();
+            {
+                QMutexLocker l(&shard->lock);
+                releaseFile(shard,hash);
+            }
+            if (_journal) {
+                _journal->appendDiscard(hash,false);
+            }
+        }
+        
+        /** @brief Blocks until the I/O thread is done with the file of the entries with the given hash.
+         * The caller must hold the lock of the shard, which is released while waiting.
+         **/
+        void waitForFile(CacheShard* shard,hash_type hash) const {
+            assert(!shard->lock.tryLock());
+            while (!shard->busyFiles.empty() && shard->busyFiles.find(hash) != shard->busyFiles.end()) {
+                shard->fileReady.wait(&shard->lock);
+            }
+        }
+        
+        ///Wakes up the threads waiting for the file of the hash. The caller must hold the lock of the shard.
+        void releaseFile(CacheShard* shard,hash_type hash) const {
+            assert(!shard->lock.tryLock());
+            shard->busyFiles.erase(shard->busyFiles.find(hash));
+            shard->fileReady.wakeAll();
+        }
+        
+        ///Removes the file of an entry and what may be left of its compressed file
+        static void removeEntryFiles(const std::string& filePath) {
+            QFile::remove(filePath.c_str());
+            QFile::remove(CacheCompression::getCompressedFilePath(filePath).c_str());
+        }
+        
+        /** @brief Returns the value of the entry in the disk portion of the shard, NULL if it isn't there.
+         * The caller must hold the lock of the shard.
+         **/
+        CachedValue* findInDiskPortion(CacheShard* shard,hash_type hash,const EntryTypePtr& entry) const {
+            CacheIterator existing = shard->diskCache.find(hash);
+            if (existing == shard->diskCache.end()) {
+                return NULL;
+            }
+            std::list<CachedValue>& values = getValueFromIterator(existing);
+            for (typename std::list<CachedValue>::iterator it = values.begin(); it != values.end(); ++it) {
+                if (it->_entry == entry) {
+                    return &*it;
+                }
+            }
+            return NULL;
+        }
 
     };
 
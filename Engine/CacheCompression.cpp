@@ -0,0 +1,395 @@
+//  Natron
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "CacheCompression.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#include "Global/Macros.h"
+CLANG_DIAG_OFF(deprecated)
+#include <QtCore/QByteArray>
+#include <QtCore/QDebug>
+CLANG_DIAG_ON(deprecated)
+
+using namespace Natron;
+
+///Bumped whenever the layout of the compressed buffers changes
+#define NATRON_CACHE_COMPRESSION_FORMAT_VERSION 1
+
+/*
+ * Layout of a compressed buffer, in the native byte order (the cache is never shared between machines):
+ * header: 8 bytes magic, U32 format version, U32 flags, U32 element size, U32 chunks count, U64 data size
+ * chunk: U32 size, the output of qCompress() for the shuffled (and maybe converted to half floats) chunk
+ * All the chunks but the last hold NATRON_CACHE_COMPRESSION_CHUNK_SIZE bytes of data once decompressed.
+ */
+
+namespace {
+
+const char kMagic[8] = { 'N', 'T', 'R', 'C', 'Z', 'B', 'U', 'F' };
+const std::size_t kHeaderSize = sizeof(kMagic) + 4 * sizeof(U32) + sizeof(U64);
+const U32 kFlagHalfFloat = 0x1;
+
+///The fastest zlib level: the ratio is close to the default level on images, for several times the throughput
+const int kDeflateLevel = 1;
+
+struct Header
+{
+    U32 flags;
+    U32 elementSize; //< of the stored elements, i.e: 2 for half floats
+    U32 chunksCount;
+    U64 dataSize;
+};
+
+template<typename T>
+void
+appendValue(std::vector<char>* buffer,
+            T value)
+{
+    const char* bytes = reinterpret_cast<const char*>(&value);
+    buffer->insert(buffer->end(),bytes,bytes + sizeof(T));
+}
+
+template<typename T>
+T
+readValue(const char* p)
+{
+    T value;
+    std::memcpy(&value,p,sizeof(T));
+    return value;
+}
+
+bool
+parseHeader(const char* p,
+            std::size_t size,
+            Header* header)
+{
+    if (size < kHeaderSize || std::memcmp(p,kMagic,sizeof(kMagic)) != 0) {
+        return false;
+    }
+    p += sizeof(kMagic);
+    if (readValue<U32>(p) != NATRON_CACHE_COMPRESSION_FORMAT_VERSION) {
+        return false;
+    }
+    p += sizeof(U32);
+    header->flags = readValue<U32>(p);
+    p += sizeof(U32);
+    header->elementSize = readValue<U32>(p);
+    p += sizeof(U32);
+    header->chunksCount = readValue<U32>(p);
+    p += sizeof(U32);
+    header->dataSize = readValue<U64>(p);
+    return header->elementSize > 0;
+}
+
+} // anon namespace
+
+bool
+CacheCompression::compress(const void* data,
+                           std::size_t size,
+                           int elementSize,
+                           bool toHalfFloat,
+                           std::vector<char>* compressed)
+{
+    compressed->clear();
+    if (!data || elementSize <= 0) {
+        return false;
+    }
+    ///the chunks must hold whole floats
+    toHalfFloat = toHalfFloat && (size % sizeof(float)) == 0;
+    const int storedElementSize = toHalfFloat ? (int)sizeof(U16) : elementSize;
+    const std::size_t chunksCount = (size + NATRON_CACHE_COMPRESSION_CHUNK_SIZE - 1) / NATRON_CACHE_COMPRESSION_CHUNK_SIZE;
+
+    compressed->reserve(kHeaderSize + size / 2);
+    compressed->insert(compressed->end(),kMagic,kMagic + sizeof(kMagic));
+    appendValue<U32>(compressed,NATRON_CACHE_COMPRESSION_FORMAT_VERSION);
+    appendValue<U32>(compressed,toHalfFloat ? kFlagHalfFloat : 0);
+    appendValue<U32>(compressed,storedElementSize);
+    appendValue<U32>(compressed,(U32)chunksCount);
+    appendValue<U64>(compressed,size);
+
+    const U8* src = (const U8*)data;
+    std::vector<U8> halfChunk;
+    std::vector<U8> shuffled(std::min(size,(std::size_t)NATRON_CACHE_COMPRESSION_CHUNK_SIZE));
+    for (std::size_t i = 0; i < chunksCount; ++i) {
+        const std::size_t offset = i * NATRON_CACHE_COMPRESSION_CHUNK_SIZE;
+        const std::size_t chunkSize = std::min(size - offset,(std::size_t)NATRON_CACHE_COMPRESSION_CHUNK_SIZE);
+        const U8* chunk = src + offset;
+        std::size_t storedSize = chunkSize;
+        if (toHalfFloat) {
+            storedSize = chunkSize / 2;
+            halfChunk.resize(storedSize);
+            const float* floats = (const float*)chunk;
+            U16* halves = (U16*)&halfChunk[0];
+            for (std::size_t j = 0; j < chunkSize / sizeof(float); ++j) {
+                halves[j] = floatToHalf(floats[j]);
+            }
+            chunk = &halfChunk[0];
+        }
+        shuffle(chunk,storedSize,storedElementSize,&shuffled[0]);
+        QByteArray deflated = qCompress(&shuffled[0],(int)storedSize,kDeflateLevel);
+        if (deflated.isEmpty()) {
+            compressed->clear();
+            return false;
+        }
+        appendValue<U32>(compressed,(U32)deflated.size());
+        compressed->insert(compressed->end(),deflated.constData(),deflated.constData() + deflated.size());
+    }
+    return true;
+}
+
+bool
+CacheCompression::readHeader(const void* compressed,
+                             std::size_t compressedSize,
+                             U64* dataSize)
+{
+    Header header;
+    if (!parseHeader((const char*)compressed,compressedSize,&header)) {
+        return false;
+    }
+    *dataSize = header.dataSize;
+    return true;
+}
+
+bool
+CacheCompression::decompress(const void* compressed,
+                             std::size_t compressedSize,
+                             void* data,
+                             std::size_t dataSize)
+{
+    Header header;
+    if (!parseHeader((const char*)compressed,compressedSize,&header) || header.dataSize != dataSize) {
+        return false;
+    }
+    const bool fromHalfFloat = (header.flags & kFlagHalfFloat) != 0;
+    const std::size_t chunksCount = (dataSize + NATRON_CACHE_COMPRESSION_CHUNK_SIZE - 1) / NATRON_CACHE_COMPRESSION_CHUNK_SIZE;
+    if (header.chunksCount != chunksCount || (fromHalfFloat && (header.elementSize != sizeof(U16) || dataSize % sizeof(float)))) {
+        return false;
+    }
+
+    const char* p = (const char*)compressed + kHeaderSize;
+    const char* end = (const char*)compressed + compressedSize;
+    U8* dst = (U8*)data;
+    std::vector<U8> halfChunk;
+    for (std::size_t i = 0; i < chunksCount; ++i) {
+        const std::size_t offset = i * NATRON_CACHE_COMPRESSION_CHUNK_SIZE;
+        const std::size_t chunkSize = std::min(dataSize - offset,(std::size_t)NATRON_CACHE_COMPRESSION_CHUNK_SIZE);
+        const std::size_t storedSize = fromHalfFloat ? chunkSize / 2 : chunkSize;
+        if ((std::size_t)(end - p) < sizeof(U32)) {
+            return false;
+        }
+        U32 deflatedSize = readValue<U32>(p);
+        p += sizeof(U32);
+        if ((std::size_t)(end - p) < deflatedSize) {
+            return false;
+        }
+        QByteArray shuffled = qUncompress((const uchar*)p,(int)deflatedSize);
+        p += deflatedSize;
+        if ((std::size_t)shuffled.size() != storedSize) {
+            return false;
+        }
+        if (fromHalfFloat) {
+            halfChunk.resize(storedSize);
+            unshuffle((const U8*)shuffled.constData(),storedSize,header.elementSize,&halfChunk[0]);
+            const U16* halves = (const U16*)&halfChunk[0];
+            float* floats = (float*)(dst + offset);
+            for (std::size_t j = 0; j < chunkSize / sizeof(float); ++j) {
+                floats[j] = halfToFloat(halves[j]);
+            }
+        } else {
+            unshuffle((const U8*)shuffled.constData(),storedSize,header.elementSize,dst + offset);
+        }
+    }
+    return p == end;
+}
+
+bool
+CacheCompression::isCompressedFile(const std::string& path,
+                                   U64* dataSize,
+                                   U64* fileSize)
+{
+    std::FILE* file = std::fopen(path.c_str(),"rb");
+    if (!file) {
+        return false;
+    }
+    char header[kHeaderSize];
+    bool ret = std::fread(header,1,kHeaderSize,file) == kHeaderSize && readHeader(header,kHeaderSize,dataSize);
+    if (ret && std::fseek(file,0,SEEK_END) == 0) {
+        long size = std::ftell(file);
+        ret = size >= 0;
+        *fileSize = (U64)size;
+    }
+    std::fclose(file);
+    return ret;
+}
+
+bool
+CacheCompression::readFile(const std::string& path,
+                           std::vector<char>* content)
+{
+    std::FILE* file = std::fopen(path.c_str(),"rb");
+    if (!file) {
+        return false;
+    }
+    bool ret = false;
+    if (std::fseek(file,0,SEEK_END) == 0) {
+        long size = std::ftell(file);
+        if (size >= 0 && std::fseek(file,0,SEEK_SET) == 0) {
+            content->resize((std::size_t)size);
+            ret = size == 0 || std::fread(&(*content)[0],1,(std::size_t)size,file) == (std::size_t)size;
+        }
+    }
+    std::fclose(file);
+    return ret;
+}
+
+bool
+CacheCompression::writeFile(const std::string& path,
+                            const std::vector<char>& content)
+{
+    std::FILE* file = std::fopen(path.c_str(),"wb");
+    if (!file) {
+        qDebug() << "Could not create the cache file" << path.c_str();
+        return false;
+    }
+    bool ret = content.empty() || std::fwrite(&content[0],1,content.size(),file) == content.size();
+    ret = (std::fclose(file) == 0) && ret;
+    if (!ret) {
+        qDebug() << "Could not write the cache file" << path.c_str();
+        std::remove(path.c_str());
+    }
+    return ret;
+}
+
+bool
+CacheCompression::replaceFile(const std::string& from,
+                              const std::string& to)
+{
+#ifdef __NATRON_WIN32__
+    ///rename doesn't replace an existing file on Windows
+    std::remove(to.c_str());
+#endif
+    if (std::rename(from.c_str(),to.c_str()) != 0) {
+        qDebug() << "Failed to replace the cache file" << to.c_str();
+        std::remove(from.c_str());
+        return false;
+    }
+    return true;
+}
+
+U16
+CacheCompression::floatToHalf(float f)
+{
+    U32 x;
+    std::memcpy(&x,&f,sizeof(x));
+    const U32 sign = (x >> 16) & 0x8000;
+    U32 mantissa = x & 0x7fffff;
+    const int exponent = (int)((x >> 23) & 0xff);
+    if (exponent == 0xff) {
+        ///infinity stays infinity, NaNs stay (quiet) NaNs
+        return (U16)(sign | 0x7c00 | (mantissa ? 0x200 | (mantissa >> 13) : 0));
+    }
+    const int halfExponent = exponent - 127 + 15;
+    if (halfExponent >= 0x1f) {
+        return (U16)(sign | 0x7c00);
+    }
+    if (halfExponent <= 0) {
+        ///denormal half, or zero
+        if (halfExponent < -10) {
+            return (U16)sign;
+        }
+        mantissa |= 0x800000;
+        const int shift = 14 - halfExponent;
+        U32 half = mantissa >> shift;
+        const U32 remainder = mantissa & ((1u << shift) - 1);
+        const U32 halfway = 1u << (shift - 1);
+        if (remainder > halfway || (remainder == halfway && (half & 1))) {
+            ++half;
+        }
+        return (U16)(sign | half);
+    }
+    U32 half = ((U32)halfExponent << 10) | (mantissa >> 13);
+    const U32 remainder = mantissa & 0x1fff;
+    ///a carry out of the mantissa correctly bumps the exponent, up to infinity
+    if (remainder > 0x1000 || (remainder == 0x1000 && (half & 1))) {
+        ++half;
+    }
+    return (U16)(sign | half);
+}
+
+float
+CacheCompression::halfToFloat(U16 h)
+{
+    const U32 sign = ((U32)h & 0x8000) << 16;
+    U32 exponent = ((U32)h >> 10) & 0x1f;
+    U32 mantissa = (U32)h & 0x3ff;
+    U32 x;
+    if (exponent == 0) {
+        if (mantissa == 0) {
+            x = sign;
+        } else {
+            ///denormal half: normalize it
+            exponent = 127 - 15 + 1;
+            while (!(mantissa & 0x400)) {
+                mantissa <<= 1;
+                --exponent;
+            }
+            mantissa &= 0x3ff;
+            x = sign | (exponent << 23) | (mantissa << 13);
+        }
+    } else if (exponent == 0x1f) {
+        x = sign | 0x7f800000 | (mantissa << 13);
+    } else {
+        x = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+    }
+    float f;
+    std::memcpy(&f,&x,sizeof(f));
+    return f;
+}
+
+void
+CacheCompression::shuffle(const U8* src,
+                          std::size_t size,
+                          int elementSize,
+                          U8* dst)
+{
+    if (elementSize <= 1) {
+        std::memcpy(dst,src,size);
+        return;
+    }
+    const std::size_t count = size / elementSize;
+    for (int b = 0; b < elementSize; ++b) {
+        U8* plane = dst + b * count;
+        const U8* s = src + b;
+        for (std::size_t i = 0; i < count; ++i, s += elementSize) {
+            plane[i] = *s;
+        }
+    }
+    const std::size_t whole = count * elementSize;
+    std::memcpy(dst + whole,src + whole,size - whole);
+}
+
+void
+CacheCompression::unshuffle(const U8* src,
+                            std::size_t size,
+                            int elementSize,
+                            U8* dst)
+{
+    if (elementSize <= 1) {
+        std::memcpy(dst,src,size);
+        return;
+    }
+    const std::size_t count = size / elementSize;
+    for (int b = 0; b < elementSize; ++b) {
+        const U8* plane = src + b * count;
+        U8* d = dst + b;
+        for (std::size_t i = 0; i < count; ++i, d += elementSize) {
+            *d = plane[i];
+        }
+    }
+    const std::size_t whole = count * elementSize;
+    std::memcpy(dst + whole,src + whole,size - whole);
+}
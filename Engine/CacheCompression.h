@@ -0,0 +1,106 @@
+//  Natron
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef NATRON_ENGINE_CACHECOMPRESSION_H_
+#define NATRON_ENGINE_CACHECOMPRESSION_H_
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "Global/GlobalDefines.h"
+
+///The data is compressed by chunks of this many bytes, so that chunks are independent and fit what zlib takes
+#define NATRON_CACHE_COMPRESSION_CHUNK_SIZE (4 * 1024 * 1024)
+
+///A compressed file is kept only if it is at most this fraction of the size of the data
+#define NATRON_CACHE_COMPRESSION_MAX_RATIO 0.9
+
+namespace Natron {
+
+enum CacheCompressionMode
+{
+    CACHE_COMPRESSION_NONE = 0, //< the files hold the data as is
+    CACHE_COMPRESSION_LOSSLESS, //< byte-shuffled, then deflated
+    CACHE_COMPRESSION_HALF_FLOAT //< same as lossless, but the float data of the entries that allow it is stored as half floats
+};
+
+/**
+ * @brief The codec of the compressed files of the disk portion of the caches.
+ *
+ * The data is split in chunks compressed independently. Each chunk is first byte-shuffled: the bytes of its
+ * elements (e.g: the 4 bytes of a float, or the 4 channels of a 8 bits pixel) are regrouped by significance, so
+ * that the exponents and high bits, which vary slowly across an image, end up next to each other. It is then
+ * deflated with the fastest zlib level, which typically shrinks rendered images 2 to 3 times at several
+ * hundreds of MB/s.
+ * Float data may also be converted to half floats first (11 bits of precision, enough for what is only displayed),
+ * which halves it again. This is the only lossy step.
+ *
+ * A compressed file starts with a header recognizable by its magic number, so that a file can be told apart from
+ * the raw data of an entry without any other information.
+ *
+ * Thread safety: all functions are reentrant.
+ **/
+class CacheCompression
+{
+public:
+
+    /**
+     * @brief Compresses size bytes of data made of elements of elementSize bytes.
+     * @param toHalfFloat If true the data is made of floats and is stored as half floats.
+     * @param compressed [out] The header and the compressed chunks.
+     * @returns False if the data couldn't be compressed.
+     **/
+    static bool compress(const void* data,std::size_t size,int elementSize,bool toHalfFloat,std::vector<char>* compressed);
+
+    /**
+     * @brief Returns true if the given bytes start with the header of a compressed buffer, in which case dataSize is
+     * set to the size of the data once decompressed.
+     **/
+    static bool readHeader(const void* compressed,std::size_t compressedSize,U64* dataSize);
+
+    /**
+     * @brief Decompresses a buffer made by compress() into data, which must be readHeader()'s dataSize bytes.
+     * @returns False if the buffer is corrupted.
+     **/
+    static bool decompress(const void* compressed,std::size_t compressedSize,void* data,std::size_t dataSize);
+
+    /**
+     * @brief Returns true if the file at the given path is a compressed buffer. Only its header is read.
+     * @param dataSize [out] The size of the data once decompressed.
+     * @param fileSize [out] The size of the file.
+     **/
+    static bool isCompressedFile(const std::string& path,U64* dataSize,U64* fileSize);
+
+    ///The path of the compressed file written for the data of the file at the given path, before it replaces it
+    static std::string getCompressedFilePath(const std::string& path) { return path + ".z"; }
+
+    ///Reads the whole file, returns false if it couldn't be read
+    static bool readFile(const std::string& path,std::vector<char>* content);
+
+    ///Writes the whole file, returns false (and removes it) if it couldn't be written
+    static bool writeFile(const std::string& path,const std::vector<char>& content);
+
+    ///Moves the file at from over the file at to. Returns false (and removes from) if it failed.
+    static bool replaceFile(const std::string& from,const std::string& to);
+
+    ///Round to nearest even, overflows to infinity
+    static U16 floatToHalf(float f);
+
+    static float halfToFloat(U16 h);
+
+    /**
+     * @brief Regroups the bytes of the elements of src in dst by significance: the first byte of all the
+     * elements, then the second byte, etc... The bytes after the last whole element are copied as is.
+     **/
+    static void shuffle(const U8* src,std::size_t size,int elementSize,U8* dst);
+
+    ///The inverse of shuffle()
+    static void unshuffle(const U8* src,std::size_t size,int elementSize,U8* dst);
+};
+
+} // namespace Natron
+
+#endif // NATRON_ENGINE_CACHECOMPRESSION_H_
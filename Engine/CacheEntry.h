@@ -3,9 +3,13 @@
 
 #include <iostream>
 #include <cassert>
+#include <climits>
+#include <algorithm>
 #include <stdexcept>
 #include <QtCore/QFile>
 #include <QtCore/QDir>
+#include <QtCore/QAtomicInt>
+#include <QtCore/QDebug>
 
 #include <boost/utility.hpp>
 #include <boost/shared_ptr.hpp>
@@ -13,6 +17,9 @@
 
 #include "Engine/Hash64.h"
 #include "Engine/MemoryFile.h"
+#include "Engine/CacheJournal.h"
+#include "Engine/CacheCompression.h"
+#include "Engine/ImageBufferPool.h"
 #include "Engine/NonKeyParams.h"
 
 namespace Natron {
@@ -70,6 +77,17 @@ public:
     
     void resetHash() const { _hashComputed = false;}
     
+    /**
+     * @brief Returns the hash the key had in the versions of Natron which computed it with a CRC64.
+     * It is not cached and is only meant to recognize the entries of an old cache table of contents.
+     **/
+    hash_type getLegacyHash() const {
+        Hash64 hash(Hash64::CRC64_HASH);
+        fillHash(&hash);
+        hash.computeHash();
+        return hash.value();
+    }
+    
 protected:
     
     /*for now HashType can only be 64 bits...the implementation should
@@ -95,12 +113,14 @@ private:
 
 
 /** @brief Buffer represents  an internal buffer that can be allocated on different devices.
- * For now the class is simple and can only be either on disk using mmap or in RAM using malloc.
+ * For now the class is simple and can only be either on disk using mmap or in RAM, using the ImageBufferPool.
  * The cost parameter given to the allocate() function is a hint that the Buffer classes uses
  * to select a device to use. By default -1 means it should not allocate any memory,
  * 0 means RAM and >= 1 means the data will be stored on disk using mmap. We could see this
  * scheme evolve in the future with other storage devices such as OpenGL textures, Cuda buffers,
  * ... etc
+ * While it is not mapped, the file of a buffer stored on disk may hold its data compressed (see CacheCompression):
+ * it is decompressed in place when the mapping is reopened.
  *
  * Thread safety : This class is not thread-safe but is used ONLY by the CacheEntryHelper class
  * which is itself manipulated by the Cache which is thread-safe.
@@ -115,7 +135,7 @@ public:
     
     enum StorageMode{RAM=0,DISK};
     
-    Buffer():_path(),_size(0),_buffer(NULL),_backingFile(NULL),_storageMode(RAM){}
+    Buffer():_path(),_size(0),_buffer(NULL),_backingFile(NULL),_storageMode(RAM),_compressed(false),_compressedSize(0){}
     
     ~Buffer(){deallocate();}
     
@@ -134,7 +154,7 @@ public:
             try {
                 _backingFile  = new MemoryFile(_path,Natron::if_exists_keep_if_dont_exists_create);
             } catch(const std::runtime_error& r) {
-                std::cout << r.what() << std::endl;
+                qDebug() << r.what();
                 
                 ///if opening the file mapping failed, just call allocate again, but this time on disk!
                 delete _backingFile;
@@ -152,43 +172,118 @@ public:
             }
         } else if(cost == 0) {
             _storageMode = RAM;
-            _buffer = new DataType[count];
-            if (!_buffer) {
-                throw std::bad_alloc();
-            }
+            ///DataType is a plain pixel type, no construction needed
+            _buffer = (DataType*)ImageBufferPool::instance().allocate(count * sizeof(DataType));
         }
         _size = count * sizeof(DataType);
     }
     
-    void reOpenFileMapping() const {
+    /** @brief Maps the file again, decompressing it first if it is compressed.
+     * @param fileChecksum If not NULL, set to the CacheJournal::checksum() of the content the file had.
+     **/
+    void reOpenFileMapping(U64* fileChecksum = NULL) const {
         assert(!_backingFile && _storageMode == DISK);
+        std::vector<char> compressed;
+        if (_compressed) {
+            if (!CacheCompression::readFile(_path,&compressed)) {
+                qDebug() << "Failed to read the compressed cache file" << _path.c_str();
+                throw std::bad_alloc();
+            }
+            if (fileChecksum) {
+                *fileChecksum = CacheJournal::checksum(compressed.empty() ? NULL : &compressed[0],compressed.size());
+            }
+        }
         try{
             _backingFile  = new MemoryFile(_path,Natron::if_exists_keep_if_dont_exists_create);
+            if (_compressed) {
+                ///the file is overwritten by the data, which is larger
+                _backingFile->resize(_size);
+                if (!_backingFile->data() || !CacheCompression::decompress(&compressed[0],compressed.size(),_backingFile->data(),_size)) {
+                    throw std::runtime_error("Corrupted compressed cache file " + _path);
+                }
+                _compressed = false;
+                _compressedSize = 0;
+            } else if (fileChecksum) {
+                *fileChecksum = CacheJournal::checksum(_backingFile->data(),_size);
+            }
         }catch(const std::runtime_error& r){
             delete _backingFile;
             _backingFile = NULL;
-            std::cout << r.what() << std::endl;
+            qDebug() << r.what();
             throw std::bad_alloc();
         }
     }
     
+    /** @brief Attaches the buffer to an existing file, without mapping it: reOpenFileMapping() must be
+     * called before accessing the data. Throws std::bad_alloc if the file doesn't exist.
+     **/
     void restoreBufferFromFile(const std::string& path)  {
-        try{
-            _backingFile  = new MemoryFile(path,Natron::if_exists_keep_if_dont_exists_create);
-        }catch(const std::runtime_error& /*r*/){
-            delete _backingFile;
-            _backingFile = NULL;
+        QFile file(path.c_str());
+        if (!file.exists()) {
             throw std::bad_alloc();
         }
         _path = path;
-        _size = _backingFile->size();
         _storageMode = DISK;
+        U64 dataSize,fileSize;
+        if (CacheCompression::isCompressedFile(path,&dataSize,&fileSize)) {
+            _size = dataSize;
+            _compressed = true;
+            _compressedSize = fileSize;
+        } else {
+            _size = file.size();
+        }
+    }
+    
+    /** @brief Writes the data, which must be mapped, compressed in a new file next to the file of the buffer.
+     * @returns The path of the new file, empty if the data couldn't be compressed or compressing it isn't worth it.
+     **/
+    std::string writeCompressedFile(int elementSize,bool toHalfFloat,U64* compressedSize,U64* compressedChecksum) const {
+        assert(_storageMode == DISK && _backingFile && !_compressed);
+        std::vector<char> compressed;
+        if (!CacheCompression::compress(_backingFile->data(),_size,elementSize,toHalfFloat,&compressed) ||
+            compressed.size() > _size * NATRON_CACHE_COMPRESSION_MAX_RATIO) {
+            return std::string();
+        }
+        std::string compressedPath = CacheCompression::getCompressedFilePath(_path);
+        if (!CacheCompression::writeFile(compressedPath,compressed)) {
+            return std::string();
+        }
+        *compressedSize = compressed.size();
+        *compressedChecksum = CacheJournal::checksum(&compressed[0],compressed.size());
+        return compressedPath;
+    }
+    
+    /** @brief Replaces the file of the buffer, which must not be mapped, by the one written by writeCompressedFile().
+     * The buffer reads the file as uncompressed until setCompressedFile() is called.
+     * @returns False if the file couldn't be replaced, in which case the compressed file is removed.
+     **/
+    bool moveCompressedFile(const std::string& compressedPath) const {
+        assert(_storageMode == DISK && !_backingFile && !_compressed);
+        return CacheCompression::replaceFile(compressedPath,_path);
+    }
+    
+    ///Once moveCompressedFile() succeeded, the data is decompressed from the file when the mapping is reopened
+    void setCompressedFile(U64 compressedSize) {
+        assert(_storageMode == DISK && !_backingFile);
+        _compressed = true;
+        _compressedSize = compressedSize;
+    }
+    
+    /** @brief Takes the mapping of the file away from the buffer, which is left as after deallocate().
+     * Deleting it unmaps and closes the file, which the cache does once it doesn't hold a lock anymore.
+     **/
+    MemoryFile* detachFileMapping() {
+        assert(_storageMode == DISK);
+        MemoryFile* mapping = _backingFile;
+        _backingFile = NULL;
+        return mapping;
     }
     
     void deallocate() {
         
         if (_storageMode == RAM) {
-            delete [] _buffer;
+            ///the buffer is recycled for the next entry of the same size
+            ImageBufferPool::instance().release(_buffer, _size);
             _buffer = NULL;
         } else {
             delete _backingFile;
@@ -207,6 +302,11 @@ public:
     
     size_t size() const {return _size;}
     
+    ///The size of the data, or of the file while it holds the data compressed
+    U64 getStoredSize() const { return _compressed ? _compressedSize : _size; }
+    
+    bool isCompressed() const { return _compressed; }
+    
     DataType* writable() const {
         if (_storageMode == DISK) {
             if(_backingFile) {
@@ -221,7 +321,7 @@ public:
     
     const DataType* readable() const {
         if (_storageMode == DISK) {
-            return (DataType*)_backingFile->data();
+            return _backingFile ? (const DataType*)_backingFile->data() : NULL;
         } else {
             return _buffer;
         }
@@ -240,6 +340,10 @@ private:
     mutable MemoryFile* _backingFile;
     
     StorageMode _storageMode;
+    
+    ///True while the file holds the data compressed, mutable for the same reason as _backingFile
+    mutable bool _compressed;
+    mutable U64 _compressedSize;
 };
 
 /////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -286,7 +390,7 @@ public:
      * memory specified by the key.
      * @param params The key associated to this cache entry, this is the object containing all the parameters.
      * @param restore If true then the entry will try to restore its buffer from a file pointed to
-     * by path.
+     * by path. The file is not mapped until reOpenFileMapping() is called.
      * @param path The path of the file where to save/restore the buffer. If empty then it assumes
      * the buffer will be in RAM, hence volatile.
      **/
@@ -294,6 +398,7 @@ public:
     : _key(key)
     , _params(params)
     , _data()
+    , _computeTime(0)
     {
         try {
             if (restore) {
@@ -314,7 +419,6 @@ public:
     typename AbstractCacheEntry<KeyType>::hash_type getHashKey() const OVERRIDE FINAL {return _key.getHash();}
     
     std::string generateStringFromHash(const std::string& path) const {
-        std::string name(path);
         if (path.empty()) {
             QDir subfolder(path.c_str());
             if(!subfolder.exists()){
@@ -323,8 +427,15 @@ public:
                 throw std::invalid_argument(path);
             }
         }
+        return generateStringFromHash(path, getHashKey());
+    }
+    
+    /**
+     * @brief Returns the path of the file backing the entry with the given hash key, in the cache folder path.
+     **/
+    static std::string generateStringFromHash(const std::string& path,typename AbstractCacheEntry<KeyType>::hash_type _hashKey) {
+        std::string name(path);
         std::ostringstream oss1;
-        typename AbstractCacheEntry<KeyType>::hash_type _hashKey = getHashKey();
         oss1 << std::hex << (_hashKey >> (sizeof(typename AbstractCacheEntry<KeyType>::hash_type)*8 - 4));
         oss1 << std::hex << ((_hashKey << 4) >> (sizeof(typename AbstractCacheEntry<KeyType>::hash_type)*8 - 4));
         name.append(oss1.str());
@@ -340,8 +451,8 @@ public:
      * living only in the disk portion of the cache. No locking is required here because the
      * caller is already preventing other threads to call this function.
      **/
-    void reOpenFileMapping() const {
-        _data.reOpenFileMapping();
+    void reOpenFileMapping(U64* fileChecksum = NULL) const {
+        _data.reOpenFileMapping(fileChecksum);
     }
     
     
@@ -355,6 +466,65 @@ public:
     
     void removeAnyBackingFile() const {_data.removeAnyBackingFile();}
     
+    ///The number of bytes the entry takes on disk: its size, unless its file is compressed
+    U64 getStoredSize() const { return _data.getStoredSize(); }
+    
+    bool isCompressed() const { return _data.isCompressed(); }
+    
+    /** @brief The size in bytes of the elements of the data, which the compression regroups by significance
+     * (see CacheCompression::shuffle()).
+     **/
+    virtual int getCompressionElementSize() const { return sizeof(DataType); }
+    
+    ///True if the data is made of floats which are only displayed, hence can be stored as half floats
+    virtual bool canBeStoredAsHalfFloat() const { return false; }
+    
+    /** @brief Called by the cache on its I/O thread for an entry moved to the disk portion, whose file is still
+     * mapped: writes the data compressed next to the file (see Buffer::writeCompressedFile()).
+     * @param compressedChecksum [out] The CacheJournal::checksum() of the compressed file.
+     **/
+    std::string writeCompressedFile(CacheCompressionMode mode,U64* compressedSize,U64* compressedChecksum) const {
+        bool toHalfFloat = mode == CACHE_COMPRESSION_HALF_FLOAT && canBeStoredAsHalfFloat();
+        return _data.writeCompressedFile(getCompressionElementSize(),toHalfFloat,compressedSize,compressedChecksum);
+    }
+    
+    ///Once the file is unmapped, replaces it by the file written by writeCompressedFile(), see Buffer::moveCompressedFile()
+    bool moveCompressedFile(const std::string& compressedPath) const { return _data.moveCompressedFile(compressedPath); }
+    
+    void setCompressedFile(U64 compressedSize) { _data.setCompressedFile(compressedSize); }
+    
+    ///See Buffer::detachFileMapping()
+    MemoryFile* detachFileMapping() { return _data.detachFileMapping(); }
+    
+    /** @brief Returns the CacheJournal::checksum() of the data, which must be allocated or mapped.
+     **/
+    U64 computeChecksum() const { return CacheJournal::checksum(_data.readable(),_data.size()); }
+    
+    ///The parameters the entry was made with
+    const boost::shared_ptr<const NonKeyParams>& getParams() const { return _params; }
+    
+    ///Used by the cache to copy the data to and from the shared memory cache, the data must be allocated or mapped
+    const DataType* readableData() const { return _data.readable(); }
+    
+    DataType* writableData() const { return _data.writable(); }
+    
+    /** @brief Called by the cache once the data of an entry it just created was filled with the data another
+     * process computed for the same key (see SharedMemoryCache).
+     **/
+    virtual void onDataImported() {}
+    
+    /** @brief Adds to the time spent computing the data of the entry, which cost-aware eviction policies weigh
+     * against its size. Thread-safe: the entry is rendered while the cache may be evicting.
+     **/
+    void addComputeTime(double milliseconds) {
+        if (milliseconds >= 1.) {
+            _computeTime.fetchAndAddRelaxed((int)std::min(milliseconds,(double)INT_MAX / 2));
+        }
+    }
+    
+    ///In milliseconds
+    double getComputeTime() const { return (double)(int)_computeTime; }
+    
 private:
     /** @brief This function is called upon the constructor and before the object is exposed
      * to other threads. Hence this function doesn't need locking mechanism at all.
@@ -398,6 +568,7 @@ protected:
     KeyType _key;
     boost::shared_ptr<const NonKeyParams> _params;
     Buffer<DataType> _data;
+    QAtomicInt _computeTime; //< in milliseconds
 };
 
 }
@@ -0,0 +1,156 @@
+//  Natron
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "CacheIOQueue.h"
+
+#include <cassert>
+#include <stdexcept>
+
+CLANG_DIAG_OFF(deprecated)
+#include <QtCore/QThread>
+#include <QtCore/QDebug>
+CLANG_DIAG_ON(deprecated)
+
+using namespace Natron;
+
+namespace Natron {
+
+///The thread of a CacheIOQueue, it just runs the queue's loop.
+class CacheIOWorker : public QThread
+{
+public:
+
+    CacheIOWorker(CacheIOQueue* queue)
+    : QThread()
+    , _queue(queue)
+    {
+    }
+
+    virtual ~CacheIOWorker() {}
+
+private:
+
+    virtual void run() OVERRIDE FINAL
+    {
+        _queue->workerLoop();
+    }
+
+    CacheIOQueue* _queue;
+};
+
+} // namespace Natron
+
+namespace {
+
+void
+runJob(const CacheIOQueue::Job& job)
+{
+    try {
+        job();
+    } catch (const std::exception & e) {
+        qDebug() << "Exception caught in a cache I/O job: " << e.what();
+    } catch (...) {
+        qDebug() << "Unknown exception caught in a cache I/O job.";
+    }
+}
+
+} // anon namespace
+
+CacheIOQueue::CacheIOQueue(std::size_t capacity)
+: _capacity(capacity > 0 ? capacity : 1)
+, _mutex()
+, _jobAvailableCond()
+, _jobDoneCond()
+, _jobs()
+, _running(false)
+, _quit(false)
+, _worker(0)
+, _jobLatency()
+{
+}
+
+CacheIOQueue::~CacheIOQueue()
+{
+    {
+        QMutexLocker l(&_mutex);
+        _quit = true;
+        _jobAvailableCond.wakeAll();
+    }
+    if (_worker) {
+        ///the worker only quits once the queue is empty
+        _worker->wait();
+        delete _worker;
+    }
+    assert(_jobs.empty());
+}
+
+void
+CacheIOQueue::push(const Job& job)
+{
+    QMutexLocker l(&_mutex);
+    if (_worker && QThread::currentThread() == _worker) {
+        ///a job queuing more work would wait for itself if the queue is full
+        l.unlock();
+        runJob(job);
+        return;
+    }
+    while (_jobs.size() >= _capacity) {
+        _jobDoneCond.wait(&_mutex);
+    }
+    _jobs.push_back(QueuedJob());
+    _jobs.back().job = job;
+    _jobs.back().timer.start();
+    if (!_worker) {
+        _worker = new CacheIOWorker(this);
+        _worker->start();
+    }
+    _jobAvailableCond.wakeOne();
+}
+
+void
+CacheIOQueue::waitForIdle()
+{
+    QMutexLocker l(&_mutex);
+    while (!_jobs.empty() || _running) {
+        _jobDoneCond.wait(&_mutex);
+    }
+}
+
+std::size_t
+CacheIOQueue::getPendingJobsCount() const
+{
+    QMutexLocker l(&_mutex);
+    return _jobs.size() + (_running ? 1 : 0);
+}
+
+void
+CacheIOQueue::workerLoop()
+{
+    QMutexLocker l(&_mutex);
+    for (;;) {
+        while (_jobs.empty() && !_quit) {
+            _jobAvailableCond.wait(&_mutex);
+        }
+        if (_jobs.empty()) {
+            ///quit was requested and everything queued has run
+            return;
+        }
+        QueuedJob job = _jobs.front();
+        _jobs.pop_front();
+        _running = true;
+        ///a slot is free, let a blocked push() go on while the job runs
+        _jobDoneCond.wakeAll();
+        l.unlock();
+
+        runJob(job.job);
+        _jobLatency.record(job.timer.nsecsElapsed());
+        ///release whatever the job holds (e.g: the last reference to an entry) before reporting it done
+        job.job.clear();
+
+        l.relock();
+        _running = false;
+        _jobDoneCond.wakeAll();
+    }
+}
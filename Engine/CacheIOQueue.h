@@ -0,0 +1,98 @@
+//  Natron
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef NATRON_ENGINE_CACHEIOQUEUE_H_
+#define NATRON_ENGINE_CACHEIOQUEUE_H_
+
+#include <deque>
+
+#include "Global/Macros.h"
+CLANG_DIAG_OFF(deprecated)
+#include <QtCore/QMutex>
+#include <QtCore/QWaitCondition>
+#include <QtCore/QElapsedTimer>
+CLANG_DIAG_ON(deprecated)
+#ifndef Q_MOC_RUN
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#endif
+
+#include "Engine/LatencyHistogram.h"
+
+///Default number of jobs a CacheIOQueue holds before push() blocks
+#define NATRON_CACHE_IO_QUEUE_DEFAULT_CAPACITY 64
+
+namespace Natron {
+
+class CacheIOWorker;
+
+/**
+ * @brief A thread running the disk work of a cache (unmapping and deleting files, writing the journal) in the
+ * order it was pushed, so that the render threads evicting entries never wait for the disk.
+ *
+ * The queue is bounded: when the thread cannot keep up, push() blocks until a job is done. This bounds the
+ * memory still held by the entries waiting to be unmapped, and slows the render threads down to the speed
+ * of the disk instead of letting the backlog grow forever.
+ *
+ * The thread is only started by the first push(), caches which never touch the disk don't spawn it.
+ *
+ * Thread safety: all functions are thread-safe. push() must not be called while holding a lock that a job
+ * may take, since it may block until the queued jobs have run.
+ **/
+class CacheIOQueue : boost::noncopyable
+{
+    friend class CacheIOWorker;
+
+public:
+
+    typedef boost::function0<void> Job;
+
+    CacheIOQueue(std::size_t capacity = NATRON_CACHE_IO_QUEUE_DEFAULT_CAPACITY);
+
+    ///Runs all the queued jobs before returning
+    ~CacheIOQueue();
+
+    /**
+     * @brief Queues the job, blocking while the queue is full. The job must not throw: exceptions are caught
+     * and logged.
+     **/
+    void push(const Job& job);
+
+    ///Blocks until all the jobs pushed so far have run
+    void waitForIdle();
+
+    ///Number of jobs queued or running
+    std::size_t getPendingJobsCount() const;
+
+    std::size_t getCapacity() const { return _capacity; }
+
+    ///Time between the push() and the end of each job
+    const LatencyHistogram& getJobLatency() const { return _jobLatency; }
+
+private:
+
+    struct QueuedJob
+    {
+        Job job;
+        QElapsedTimer timer; //< started when the job was pushed
+    };
+
+    ///Called by the worker's run loop
+    void workerLoop();
+
+    const std::size_t _capacity;
+    mutable QMutex _mutex; //< protects all the members below
+    QWaitCondition _jobAvailableCond; //< woken up when a job is pushed or on quit
+    QWaitCondition _jobDoneCond; //< woken up when a job is done
+    std::deque<QueuedJob> _jobs;
+    bool _running; //< true while the worker runs a job popped from _jobs
+    bool _quit;
+    CacheIOWorker* _worker; //< NULL until the first push()
+    LatencyHistogram _jobLatency;
+};
+
+} // namespace Natron
+
+#endif // NATRON_ENGINE_CACHEIOQUEUE_H_
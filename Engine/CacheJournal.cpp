@@ -0,0 +1,438 @@
+//  Natron
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "CacheJournal.h"
+
+#include <algorithm>
+#include <cstring>
+
+CLANG_DIAG_OFF(deprecated)
+#include <QtCore/QDebug>
+CLANG_DIAG_ON(deprecated)
+
+using namespace Natron;
+
+///Bumped whenever the layout of the records changes
+#define NATRON_CACHE_JOURNAL_FORMAT_VERSION 1
+
+/*
+ * Layout of the file, in the native byte order (the cache is never shared between machines):
+ * header: 8 bytes magic, U32 format version, U32 cache version
+ * record: U32 body length, body, U64 checksum of the body
+ * body: U8 type, U64 hash, then for an insertion: U64 data size, U64 data checksum, serialized key
+ */
+
+namespace {
+
+const char kMagic[8] = { 'N', 'T', 'R', 'C', 'J', 'R', 'N', 'L' };
+const std::size_t kHeaderSize = sizeof(kMagic) + 2 * sizeof(U32);
+const std::size_t kDiscardBodySize = 1 + sizeof(U64);
+const std::size_t kInsertionBodyMinSize = kDiscardBodySize + 2 * sizeof(U64);
+
+///The constants of xxHash64, which is what checksum() computes
+const U64 kPrime1 = 11400714785074694791ULL;
+const U64 kPrime2 = 14029467366897019727ULL;
+const U64 kPrime3 = 1609587929392839161ULL;
+const U64 kPrime4 = 9650029242287828579ULL;
+const U64 kPrime5 = 2870177450012600261ULL;
+
+inline U64
+rotl(U64 x,
+     int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+inline U64
+read64(const unsigned char* p)
+{
+    U64 v;
+    std::memcpy(&v,p,sizeof(v));
+    return v;
+}
+
+inline U64
+mixLane(U64 acc,
+        U64 input)
+{
+    acc += input * kPrime2;
+    acc = rotl(acc,31);
+    return acc * kPrime1;
+}
+
+inline U64
+mergeLane(U64 acc,
+          U64 lane)
+{
+    acc ^= mixLane(0,lane);
+    return acc * kPrime1 + kPrime4;
+}
+
+template<typename T>
+void
+appendValue(std::string* buffer,
+            T value)
+{
+    buffer->append((const char*)&value,sizeof(T));
+}
+
+template<typename T>
+T
+readValue(const char* p)
+{
+    T value;
+    std::memcpy(&value,p,sizeof(T));
+    return value;
+}
+
+struct OlderFirst
+{
+    bool operator()(const std::pair<U64,const CacheJournal::Record*>& a,const std::pair<U64,const CacheJournal::Record*>& b) const
+    {
+        return a.first < b.first;
+    }
+};
+
+}
+
+CacheJournal::Record::Record()
+: hash(0)
+, dataSize(0)
+, dataChecksum(0)
+, key()
+{
+}
+
+CacheJournal::CacheJournal(const std::string& filePath,
+                           unsigned int cacheVersion)
+: _lock()
+, _filePath(filePath)
+, _cacheVersion(cacheVersion)
+, _file(NULL)
+, _live()
+, _sequence(0)
+, _discarded()
+, _recordsCount(0)
+{
+}
+
+CacheJournal::~CacheJournal()
+{
+    if (_file) {
+        std::fclose(_file);
+    }
+}
+
+U64
+CacheJournal::checksum(const void* data,
+                       std::size_t size)
+{
+    const unsigned char* p = (const unsigned char*)data;
+    const unsigned char* end = p + size;
+    U64 h;
+    if (size >= 32) {
+        ///4 independent lanes, so that the multiplications of consecutive words overlap in the CPU
+        U64 v1 = kPrime1 + kPrime2;
+        U64 v2 = kPrime2;
+        U64 v3 = 0;
+        U64 v4 = 0 - kPrime1;
+        const unsigned char* limit = end - 32;
+        do {
+            v1 = mixLane(v1,read64(p));
+            v2 = mixLane(v2,read64(p + 8));
+            v3 = mixLane(v3,read64(p + 16));
+            v4 = mixLane(v4,read64(p + 24));
+            p += 32;
+        } while (p <= limit);
+        h = rotl(v1,1) + rotl(v2,7) + rotl(v3,12) + rotl(v4,18);
+        h = mergeLane(h,v1);
+        h = mergeLane(h,v2);
+        h = mergeLane(h,v3);
+        h = mergeLane(h,v4);
+    } else {
+        h = kPrime5;
+    }
+    h += (U64)size;
+    while (p + 8 <= end) {
+        h ^= mixLane(0,read64(p));
+        h = rotl(h,27) * kPrime1 + kPrime4;
+        p += 8;
+    }
+    if (p + 4 <= end) {
+        U32 v;
+        std::memcpy(&v,p,sizeof(v));
+        h ^= (U64)v * kPrime1;
+        h = rotl(h,23) * kPrime2 + kPrime3;
+        p += 4;
+    }
+    while (p < end) {
+        h ^= (U64)(*p) * kPrime5;
+        h = rotl(h,11) * kPrime1;
+        ++p;
+    }
+    h ^= h >> 33;
+    h *= kPrime2;
+    h ^= h >> 29;
+    h *= kPrime3;
+    h ^= h >> 32;
+    return h;
+}
+
+bool
+CacheJournal::isCompatible(const std::string& filePath,
+                           unsigned int cacheVersion)
+{
+    std::FILE* file = std::fopen(filePath.c_str(),"rb");
+    if (!file) {
+        return false;
+    }
+    char header[kHeaderSize];
+    bool ok = std::fread(header,1,kHeaderSize,file) == kHeaderSize
+              && !std::memcmp(header,kMagic,sizeof(kMagic))
+              && readValue<U32>(header + sizeof(kMagic)) == NATRON_CACHE_JOURNAL_FORMAT_VERSION
+              && readValue<U32>(header + sizeof(kMagic) + sizeof(U32)) == cacheVersion;
+    std::fclose(file);
+    return ok;
+}
+
+bool
+CacheJournal::open(std::vector<Record>* entries,
+                   std::vector<U64>* discardedFiles)
+{
+    QMutexLocker l(&_lock);
+    if (_file) {
+        std::fclose(_file);
+        _file = NULL;
+    }
+    _live.clear();
+    _discarded.clear();
+    _recordsCount = 0;
+
+    std::vector<char> content;
+    std::FILE* file = std::fopen(_filePath.c_str(),"rb");
+    if (file) {
+        char chunk[64 * 1024];
+        std::size_t read;
+        while ((read = std::fread(chunk,1,sizeof(chunk),file)) > 0) {
+            content.insert(content.end(),chunk,chunk + read);
+        }
+        std::fclose(file);
+    }
+
+    bool valid = content.size() >= kHeaderSize
+                 && !std::memcmp(&content[0],kMagic,sizeof(kMagic))
+                 && readValue<U32>(&content[sizeof(kMagic)]) == NATRON_CACHE_JOURNAL_FORMAT_VERSION
+                 && readValue<U32>(&content[sizeof(kMagic) + sizeof(U32)]) == _cacheVersion;
+    std::size_t validEnd = kHeaderSize;
+    if (valid) {
+        std::size_t pos = kHeaderSize;
+        while (pos + sizeof(U32) <= content.size()) {
+            const char* p = &content[pos];
+            U32 bodySize = readValue<U32>(p);
+            if (bodySize < kDiscardBodySize || content.size() - pos - sizeof(U32) < (std::size_t)bodySize + sizeof(U64)) {
+                break;
+            }
+            const char* body = p + sizeof(U32);
+            if (readValue<U64>(body + bodySize) != checksum(body,bodySize)) {
+                ///everything written after a torn record is untrusted
+                break;
+            }
+            unsigned char type = (unsigned char)body[0];
+            U64 hash = readValue<U64>(body + 1);
+            if (type == RECORD_INSERTION && bodySize >= kInsertionBodyMinSize) {
+                LiveRecord& live = _live[hash];
+                live.sequence = _sequence++;
+                live.record.hash = hash;
+                live.record.dataSize = readValue<U64>(body + kDiscardBodySize);
+                live.record.dataChecksum = readValue<U64>(body + kDiscardBodySize + sizeof(U64));
+                live.record.key.assign(body + kInsertionBodyMinSize,bodySize - kInsertionBodyMinSize);
+                _discarded.erase(hash);
+            } else if (type == RECORD_DISCARD) {
+                _live.erase(hash);
+                _discarded.insert(hash);
+            } else {
+                break;
+            }
+            ++_recordsCount;
+            pos += sizeof(U32) + bodySize + sizeof(U64);
+            validEnd = pos;
+        }
+    }
+
+    std::vector<std::pair<U64,const Record*> > ordered;
+    ordered.reserve(_live.size());
+    for (std::map<U64,LiveRecord>::const_iterator it = _live.begin(); it != _live.end(); ++it) {
+        ordered.push_back(std::make_pair(it->second.sequence,&it->second.record));
+    }
+    std::sort(ordered.begin(),ordered.end(),OlderFirst());
+    for (U32 i = 0; i < ordered.size(); ++i) {
+        entries->push_back(*ordered[i].second);
+    }
+    discardedFiles->insert(discardedFiles->end(),_discarded.begin(),_discarded.end());
+    ///removing the files is the job of the caller from now on
+    _discarded.clear();
+
+    if (!valid || validEnd != content.size()) {
+        if (!content.empty()) {
+            qDebug() << "The cache journal" << _filePath.c_str() << (valid ? "is truncated, it is repaired." : "is unusable, it is reset.");
+        }
+        compactInternal();
+    } else {
+        _file = std::fopen(_filePath.c_str(),"ab");
+        if (!_file) {
+            qDebug() << "Could not open the cache journal" << _filePath.c_str();
+        }
+    }
+    return valid;
+}
+
+bool
+CacheJournal::writeHeader(std::FILE* file) const
+{
+    std::string header(kMagic,sizeof(kMagic));
+    appendValue<U32>(&header,NATRON_CACHE_JOURNAL_FORMAT_VERSION);
+    appendValue<U32>(&header,_cacheVersion);
+    return std::fwrite(header.data(),1,header.size(),file) == header.size();
+}
+
+bool
+CacheJournal::writeRecord(std::FILE* file,
+                          RecordType type,
+                          U64 hash,
+                          const Record* record) const
+{
+    std::string body;
+    body.reserve(kInsertionBodyMinSize + (record ? record->key.size() : 0));
+    appendValue<unsigned char>(&body,(unsigned char)type);
+    appendValue<U64>(&body,hash);
+    if (type == RECORD_INSERTION) {
+        appendValue<U64>(&body,record->dataSize);
+        appendValue<U64>(&body,record->dataChecksum);
+        body.append(record->key);
+    }
+    std::string buffer;
+    buffer.reserve(sizeof(U32) + body.size() + sizeof(U64));
+    appendValue<U32>(&buffer,(U32)body.size());
+    buffer.append(body);
+    appendValue<U64>(&buffer,checksum(body.data(),body.size()));
+    return std::fwrite(buffer.data(),1,buffer.size(),file) == buffer.size();
+}
+
+void
+CacheJournal::append(RecordType type,
+                     U64 hash,
+                     const Record* record)
+{
+    if (type == RECORD_INSERTION) {
+        LiveRecord& live = _live[hash];
+        live.sequence = _sequence++;
+        live.record = *record;
+    }
+    if (_file) {
+        ///flushed right away, so that the record is in the file if the process dies
+        if (!writeRecord(_file,type,hash,record) || std::fflush(_file) != 0) {
+            qDebug() << "Failed to write to the cache journal" << _filePath.c_str();
+        }
+    }
+    ++_recordsCount;
+    std::size_t needed = _live.size() + _discarded.size();
+    if (_recordsCount >= NATRON_CACHE_JOURNAL_COMPACTION_MIN_RECORDS && _recordsCount > 2 * needed) {
+        compactInternal();
+    }
+}
+
+void
+CacheJournal::appendInsertion(const Record& record)
+{
+    QMutexLocker l(&_lock);
+    _discarded.erase(record.hash);
+    append(RECORD_INSERTION,record.hash,&record);
+}
+
+void
+CacheJournal::appendDiscard(U64 hash,
+                            bool fileExists)
+{
+    QMutexLocker l(&_lock);
+    _live.erase(hash);
+    if (fileExists) {
+        _discarded.insert(hash);
+    } else {
+        _discarded.erase(hash);
+    }
+    append(RECORD_DISCARD,hash,NULL);
+}
+
+void
+CacheJournal::compact()
+{
+    QMutexLocker l(&_lock);
+    compactInternal();
+}
+
+void
+CacheJournal::compactInternal()
+{
+    std::string tmpPath = _filePath + ".tmp";
+    std::FILE* file = std::fopen(tmpPath.c_str(),"wb");
+    if (!file) {
+        qDebug() << "Could not create" << tmpPath.c_str();
+        return;
+    }
+    std::vector<std::pair<U64,const Record*> > ordered;
+    ordered.reserve(_live.size());
+    for (std::map<U64,LiveRecord>::const_iterator it = _live.begin(); it != _live.end(); ++it) {
+        ordered.push_back(std::make_pair(it->second.sequence,&it->second.record));
+    }
+    std::sort(ordered.begin(),ordered.end(),OlderFirst());
+
+    bool ok = writeHeader(file);
+    for (std::set<U64>::const_iterator it = _discarded.begin(); ok && it != _discarded.end(); ++it) {
+        ok = writeRecord(file,RECORD_DISCARD,*it,NULL);
+    }
+    for (U32 i = 0; ok && i < ordered.size(); ++i) {
+        ok = writeRecord(file,RECORD_INSERTION,ordered[i].second->hash,ordered[i].second);
+    }
+    ok = std::fflush(file) == 0 && ok;
+    std::fclose(file);
+    if (!ok) {
+        qDebug() << "Failed to write" << tmpPath.c_str();
+        std::remove(tmpPath.c_str());
+        return;
+    }
+
+    if (_file) {
+        std::fclose(_file);
+        _file = NULL;
+    }
+#ifdef __NATRON_WIN32__
+    ///rename doesn't replace an existing file on Windows
+    std::remove(_filePath.c_str());
+#endif
+    if (std::rename(tmpPath.c_str(),_filePath.c_str()) != 0) {
+        qDebug() << "Failed to replace the cache journal" << _filePath.c_str();
+        std::remove(tmpPath.c_str());
+    } else {
+        _recordsCount = _discarded.size() + _live.size();
+    }
+    _file = std::fopen(_filePath.c_str(),"ab");
+    if (!_file) {
+        qDebug() << "Could not open the cache journal" << _filePath.c_str();
+    }
+}
+
+std::size_t
+CacheJournal::getRecordsCount() const
+{
+    QMutexLocker l(&_lock);
+    return _recordsCount;
+}
+
+std::size_t
+CacheJournal::getLiveEntriesCount() const
+{
+    QMutexLocker l(&_lock);
+    return _live.size();
+}
@@ -0,0 +1,150 @@
+//  Natron
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef NATRON_ENGINE_CACHEJOURNAL_H_
+#define NATRON_ENGINE_CACHEJOURNAL_H_
+
+#include <cstddef>
+#include <cstdio>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "Global/Macros.h"
+CLANG_DIAG_OFF(deprecated)
+#include <QtCore/QMutex>
+CLANG_DIAG_ON(deprecated)
+#ifndef Q_MOC_RUN
+#include <boost/noncopyable.hpp>
+#endif
+
+#include "Global/GlobalDefines.h"
+
+///The journal is rewritten with only the live entries when it holds more than this many records and
+///most of them are obsolete
+#define NATRON_CACHE_JOURNAL_COMPACTION_MIN_RECORDS 4096
+
+namespace Natron {
+
+/**
+ * @brief The index of the disk portion of a cache: an append-only file recording the entries as they are
+ * written to disk and removed, so that the cache can be restored after a crash without scanning its files.
+ *
+ * Each record is checksummed: a record partially written when the process died ends the journal, it is cut
+ * off the next time the journal is opened. The entries themselves carry the checksum of their data, which the
+ * cache verifies the first time a restored entry is used.
+ *
+ * For a given hash only the last record counts:
+ * - an insertion: the file of the entry holds the data of the given size and checksum.
+ * - a discard: the file, if any, must not be trusted. It is recorded as soon as a file is created for an entry
+ * which isn't written yet, and when an entry is removed, so that the cache deletes the left-overs when it is
+ * restored.
+ *
+ * The journal is compacted (rewritten with only the records that still matter) when it is opened by the cache,
+ * when the cache is saved and when obsolete records dominate.
+ *
+ * Thread safety: all functions are thread-safe. Once the cache is shared, it only updates the journal from its
+ * CacheIOQueue thread so that the records of a hash are appended in the order the entry changed. No cache lock
+ * must be taken while holding the lock of the journal.
+ **/
+class CacheJournal : boost::noncopyable
+{
+public:
+
+    struct Record
+    {
+        U64 hash;
+        U64 dataSize; //< size in bytes of the file of the entry
+        U64 dataChecksum; //< checksum() of the content of the file
+        std::string key; //< the serialized key and non-key parameters of the entry
+
+        Record();
+    };
+
+    CacheJournal(const std::string& filePath,unsigned int cacheVersion);
+
+    ~CacheJournal();
+
+    /**
+     * @brief Reads the journal, cuts off any partially written record at its end and opens it for appending.
+     * If the file doesn't exist or was written for another version of the cache, a new empty journal is created.
+     * @param entries [out] The live entries, in the order they were inserted.
+     * @param discardedFiles [out] The hashes of the entries whose files, if they exist, must be removed.
+     * @returns False if the journal didn't exist or couldn't be used.
+     **/
+    bool open(std::vector<Record>* entries,std::vector<U64>* discardedFiles);
+
+    void appendInsertion(const Record& record);
+
+    /**
+     * @param fileExists True if the file of the entry may still exist after this call, so that it is removed
+     * next time the journal is opened.
+     **/
+    void appendDiscard(U64 hash,bool fileExists);
+
+    /**
+     * @brief Rewrites the journal with only the records that matter. The new journal is written beside the
+     * current one and renamed over it, so that a crash in the middle leaves one of them intact.
+     **/
+    void compact();
+
+    ///Number of records in the file
+    std::size_t getRecordsCount() const;
+
+    std::size_t getLiveEntriesCount() const;
+
+    const std::string& getFilePath() const { return _filePath; }
+
+    /**
+     * @brief Returns true if the file at the given path is a journal written for the given version of a cache.
+     * Only its header is read.
+     **/
+    static bool isCompatible(const std::string& filePath,unsigned int cacheVersion);
+
+    /**
+     * @brief A fast 64 bits non-cryptographic checksum of the given bytes (several GB/s), used to detect
+     * corrupted records and entries.
+     **/
+    static U64 checksum(const void* data,std::size_t size);
+
+private:
+
+    enum RecordType
+    {
+        RECORD_INSERTION = 1,
+        RECORD_DISCARD = 2
+    };
+
+    ///All the functions below must be called with _lock held
+    bool writeHeader(std::FILE* file) const;
+
+    bool writeRecord(std::FILE* file,RecordType type,U64 hash,const Record* record) const;
+
+    void append(RecordType type,U64 hash,const Record* record);
+
+    void compactInternal();
+
+    struct LiveRecord
+    {
+        U64 sequence; //< to write the entries back in the order they were inserted
+        Record record;
+
+        LiveRecord() : sequence(0), record() {}
+    };
+
+    mutable QMutex _lock; //< protects all the members below
+    const std::string _filePath;
+    const unsigned int _cacheVersion;
+    std::FILE* _file; //< opened for appending, NULL if the journal couldn't be opened
+    std::map<U64,LiveRecord> _live;
+    U64 _sequence;
+    std::set<U64> _discarded; //< hashes whose file may exist but is not a live entry
+    std::size_t _recordsCount;
+};
+
+} // namespace Natron
+
+#endif // NATRON_ENGINE_CACHEJOURNAL_H_
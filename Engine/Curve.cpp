@@ -223,6 +223,7 @@ void Curve::operator=(const Curve& other) {
 void Curve::clearKeyFrames()
 {
     QWriteLocker l(&_imp->_lock);
+    _imp->invalidateSnapshot();
     _imp->keyFrames.clear();
 }
 
@@ -237,6 +238,7 @@ void Curve::clone(const Curve& other)
 {
     KeyFrameSet otherKeys = other.getKeyFrames_mt_safe();
     QWriteLocker l(&_imp->_lock);
+    _imp->invalidateSnapshot();
     _imp->keyFrames.clear();
     std::transform(otherKeys.begin(), otherKeys.end(), std::inserter(_imp->keyFrames, _imp->keyFrames.begin()), KeyFrameCloner());
 }
@@ -248,6 +250,7 @@ void Curve::clone(const Curve& other, SequenceTime offset, const RangeD* range)
     // it prevents copying the value of frame 0.
     bool copyRange = range != NULL /*&& (range->min != 0 || range->max != 0)*/;
     QWriteLocker l(&_imp->_lock);
+    _imp->invalidateSnapshot();
     _imp->keyFrames.clear();
     for (KeyFrameSet::iterator it = otherKeys.begin(); it!=otherKeys.end(); ++it) {
         double time = it->getTime();
@@ -281,6 +284,7 @@ bool Curve::addKeyFrame(KeyFrame key)
 {
     
     QWriteLocker l(&_imp->_lock);
+    _imp->invalidateSnapshot();
     
     if (_imp->type == CurvePrivate::BOOL_CURVE || _imp->type == CurvePrivate::STRING_CURVE ||
         _imp->type == CurvePrivate::INT_CURVE_CONSTANT_INTERP) {
@@ -368,12 +372,14 @@ void Curve::removeKeyFrame(KeyFrameSet::const_iterator it)
 void Curve::removeKeyFrameWithIndex(int index)
 {
     QWriteLocker l(&_imp->_lock);
+    _imp->invalidateSnapshot();
     removeKeyFrame(atIndex(index));
 }
 
 void Curve::removeKeyFrameWithTime(double time)
 {
     QWriteLocker l(&_imp->_lock);
+    _imp->invalidateSnapshot();
     KeyFrameSet::iterator it = find(time);
 
     if (it == _imp->keyFrames.end()) {
@@ -505,52 +511,85 @@ interParams(const KeyFrameSet &keyFrames,
     }
 }
 
-double Curve::getValueAt(double t) const
+/// returns the snapshot of the keyframes, building it if a modification invalidated it
+static boost::shared_ptr<const CurvePrivate::Snapshot>
+getCurveSnapshot(const CurvePrivate& imp)
 {
-    QReadLocker l(&_imp->_lock);
+    {
+        QMutexLocker l(&imp.snapshotMutex);
+        if (imp.snapshot) {
+            return imp.snapshot;
+        }
+    }
     
-    if (_imp->keyFrames.empty()) {
-        throw std::runtime_error("Curve has no control points!");
+    ///The snapshot is stored while holding the read lock: a writer cannot modify the keyframes (and reset the
+    ///snapshot) in between, hence a snapshot which does not match the keyframes can never be stored.
+    QReadLocker l(&imp._lock);
+    boost::shared_ptr<CurvePrivate::Snapshot> snapshot(new CurvePrivate::Snapshot);
+    snapshot->hasYRange = imp.hasYRange;
+    snapshot->yMin = imp.yMin;
+    snapshot->yMax = imp.yMax;
+    const KeyFrameSet& keyFrames = imp.keyFrames;
+    if (!keyFrames.empty()) {
+        snapshot->times.reserve(keyFrames.size());
+        snapshot->segments.resize(keyFrames.size() + 1);
+        KeyFrameSet::const_iterator itup = keyFrames.begin();
+        for (std::size_t i = 0; i <= keyFrames.size(); ++i) {
+            double tcur,tnext;
+            double vcurDerivRight ,vnextDerivLeft ,vcur ,vnext ;
+            Natron::KeyframeType interp ,interpNext;
+            ///any time of the segment will do, interParams only uses it in assertions
+            double t = itup == keyFrames.begin() ? itup->getTime() - 1. : snapshot->times.back();
+            interParams(keyFrames,
+                        t,
+                        itup,
+                        &tcur,
+                        &vcur,
+                        &vcurDerivRight,
+                        &interp,
+                        &tnext,
+                        &vnext,
+                        &vnextDerivLeft,
+                        &interpNext);
+            CurvePrivate::Snapshot::Segment& segment = snapshot->segments[i];
+            Natron::interpolationCoefficients(tcur,vcur,
+                                              vcurDerivRight,
+                                              vnextDerivLeft,
+                                              tnext,vnext,
+                                              interp,
+                                              interpNext,
+                                              &segment.t0,
+                                              &segment.t1,
+                                              segment.c);
+            if (itup != keyFrames.end()) {
+                snapshot->times.push_back(itup->getTime());
+                ++itup;
+            }
+        }
     }
+    
+    QMutexLocker sl(&imp.snapshotMutex);
+    imp.snapshot = snapshot;
+    return snapshot;
+}
 
-    // even when there is only one keyframe, there may be tangents!
-    //if (_imp->keyFrames.size() == 1) {
-    //    //if there's only 1 keyframe, don't bother interpolating
-    //    return (*_imp->keyFrames.begin()).getValue();
-    //}
-    double tcur,tnext;
-    double vcurDerivRight ,vnextDerivLeft ,vcur ,vnext ;
-    Natron::KeyframeType interp ,interpNext;
-
-    KeyFrame k(t,0.);
-    // find the first keyframe with time greater than t
-    KeyFrameSet::const_iterator itup;
-    itup = _imp->keyFrames.upper_bound(k);
-    interParams(_imp->keyFrames,
-                t,
-                itup,
-                &tcur,
-                &vcur,
-                &vcurDerivRight,
-                &interp,
-                &tnext,
-                &vnext,
-                &vnextDerivLeft,
-                &interpNext);
-
-    double v = Natron::interpolate(tcur,vcur,
-                                   vcurDerivRight,
-                                   vnextDerivLeft,
-                                   tnext,vnext,
-                                   t,
-                                   interp,
-                                   interpNext);
-
-    if (mustClamp()) {
-        v = clampValueToCurveYRange(v);
-    }
+/// evaluates the given segment of a snapshot, same computation as Natron::interpolate()
+static double
+evaluateSegment(const CurvePrivate::Snapshot::Segment& segment,
+                double t)
+{
+    const double x = (t - segment.t0) / (segment.t1 - segment.t0);
+    const double x2 = x * x;
+    const double x3 = x2 * x;
+    return segment.c[0] + segment.c[1]*x + segment.c[2]*x2 + segment.c[3]*x3;
+}
 
-    switch (_imp->type) {
+/// rounds an interpolated value according to the type of the curve
+static double
+roundToCurveType(CurvePrivate::CurveType type,
+                 double v)
+{
+    switch (type) {
         case CurvePrivate::STRING_CURVE:
         case CurvePrivate::INT_CURVE:
             return std::floor(v + 0.5);
@@ -563,6 +602,78 @@ double Curve::getValueAt(double t) const
     }
 }
 
+double Curve::getValueAt(double t) const
+{
+    ///No locking: the snapshot is immutable, the type and owner of the curve are set once in the constructor
+    boost::shared_ptr<const CurvePrivate::Snapshot> snapshot = getCurveSnapshot(*_imp);
+    
+    if (snapshot->times.empty()) {
+        throw std::runtime_error("Curve has no control points!");
+    }
+
+    // find the first keyframe with time greater than t
+    std::size_t index = std::upper_bound(snapshot->times.begin(), snapshot->times.end(), t) - snapshot->times.begin();
+    double v = evaluateSegment(snapshot->segments[index], t);
+
+    if (_imp->owner || snapshot->hasYRange) {
+        ///the range of the owner knob is thread-safe, the Y range is the one the snapshot was built with
+        std::pair<double,double> minmax = _imp->owner ? getCurveYRange_internal() : std::make_pair(snapshot->yMin, snapshot->yMax);
+        if (v > minmax.second) {
+            v = minmax.second;
+        } else if (v < minmax.first) {
+            v = minmax.first;
+        }
+    }
+
+    return roundToCurveType(_imp->type, v);
+}
+
+void Curve::getValuesAt(double first,
+                        double last,
+                        double step,
+                        std::vector<double>* values) const
+{
+    assert(step > 0.);
+    values->clear();
+    boost::shared_ptr<const CurvePrivate::Snapshot> snapshot = getCurveSnapshot(*_imp);
+    
+    if (snapshot->times.empty()) {
+        throw std::runtime_error("Curve has no control points!");
+    }
+    if (last < first) {
+        return;
+    }
+    
+    bool clamp = _imp->owner || snapshot->hasYRange;
+    std::pair<double,double> minmax;
+    if (clamp) {
+        minmax = _imp->owner ? getCurveYRange_internal() : std::make_pair(snapshot->yMin, snapshot->yMax);
+    }
+    
+    const std::vector<double>& times = snapshot->times;
+    values->reserve((std::size_t)((last - first) / step) + 1);
+    std::size_t index = std::upper_bound(times.begin(), times.end(), first) - times.begin();
+    for (int i = 0; ; ++i) {
+        double t = first + i * step;
+        if (t > last) {
+            break;
+        }
+        ///times are increasing: walk the segments forward instead of searching
+        while (index < times.size() && times[index] <= t) {
+            ++index;
+        }
+        double v = evaluateSegment(snapshot->segments[index], t);
+        if (clamp) {
+            if (v > minmax.second) {
+                v = minmax.second;
+            } else if (v < minmax.first) {
+                v = minmax.first;
+            }
+        }
+        values->push_back(roundToCurveType(_imp->type, v));
+    }
+}
+
 double Curve::getDerivativeAt(double t) const
 {
     QReadLocker l(&_imp->_lock);
@@ -731,6 +842,12 @@ double Curve::getIntegrateFromTo(double t1, double t2) const
 std::pair<double,double>  Curve::getCurveYRange() const
 {
     QReadLocker l(&_imp->_lock);
+    return getCurveYRange_internal();
+}
+
+std::pair<double,double>  Curve::getCurveYRange_internal() const
+{
+    // PRIVATE - should not lock
     if (!mustClamp()) {
         throw std::logic_error("Curve::getCurveYRange() called for a curve without owner or Y range");
     }
@@ -753,7 +870,7 @@ double Curve::clampValueToCurveYRange(double v) const
 {
     // PRIVATE - should not lock
     ////clamp to min/max if the owner of the curve is a Double or Int knob.
-    std::pair<double,double> minmax = getCurveYRange();
+    std::pair<double,double> minmax = getCurveYRange_internal();
 
     if (v > minmax.second) {
         return minmax.second;
@@ -812,6 +929,7 @@ KeyFrame Curve::setKeyFrameValueAndTime(double time,double value,int index,int*
     KeyFrame ret;
     {
         QWriteLocker l(&_imp->_lock);
+        _imp->invalidateSnapshot();
         KeyFrameSet::iterator it = atIndex(index);
         if (it == _imp->keyFrames.end()) {
             QString err = QString("No such keyframe at index %1").arg(index);
@@ -848,6 +966,7 @@ KeyFrame Curve::setKeyFrameLeftDerivative(double value,int index,int* newIndex)
     {
         
         QWriteLocker l(&_imp->_lock);
+        _imp->invalidateSnapshot();
         KeyFrameSet::iterator it = atIndex(index);
         assert(it != _imp->keyFrames.end());
         
@@ -878,6 +997,7 @@ KeyFrame Curve::setKeyFrameRightDerivative(double value,int index,int* newIndex)
         
         
         QWriteLocker l(&_imp->_lock);
+        _imp->invalidateSnapshot();
         KeyFrameSet::iterator it = atIndex(index);
         assert(it != _imp->keyFrames.end());
         
@@ -907,6 +1027,7 @@ KeyFrame Curve::setKeyFrameDerivatives(double left, double right,int index,int*
     {
         
         QWriteLocker l(&_imp->_lock);
+        _imp->invalidateSnapshot();
         KeyFrameSet::iterator it = atIndex(index);
         assert(it != _imp->keyFrames.end());
         
@@ -938,6 +1059,7 @@ KeyFrame Curve::setKeyFrameInterpolation(Natron::KeyframeType interp,int index,i
     KeyFrame ret;
     {
         QWriteLocker l(&_imp->_lock);
+        _imp->invalidateSnapshot();
         KeyFrameSet::iterator it = atIndex(index);
         assert(it != _imp->keyFrames.end());
         
@@ -968,6 +1090,7 @@ void Curve::setCurveInterpolation(Natron::KeyframeType interp)
 
     {
         QWriteLocker l(&_imp->_lock);
+        _imp->invalidateSnapshot();
         ///if the curve is a string_curve or bool_curve the interpolation is bound to be constant.
         if ((_imp->type == CurvePrivate::STRING_CURVE || _imp->type == CurvePrivate::BOOL_CURVE ||
              _imp->type == CurvePrivate::INT_CURVE_CONSTANT_INTERP) && interp != Natron::KEYFRAME_CONSTANT) {
@@ -1188,10 +1311,11 @@ bool Curve::areKeyFramesValuesClampedToBooleans() const
 
 void Curve::setYRange(double yMin, double yMax)
 {
-    QReadLocker l(&_imp->_lock);
+    QWriteLocker l(&_imp->_lock);
     _imp->yMin = yMin;
     _imp->yMax = yMax;
     _imp->hasYRange = true;
+    _imp->invalidateSnapshot();
 }
 
 bool Curve::hasYRange() const
@@ -199,6 +199,13 @@ public:
     double getMaximumTimeCovered() const WARN_UNUSED_RETURN;
 
     double getValueAt(double t) const WARN_UNUSED_RETURN;
+    
+    /**
+     * @brief Evaluates the curve at first, first + step, first + 2*step... up to last (included) in values.
+     * Much cheaper than calling getValueAt() for each time: the segments are walked in order
+     * and the curve range is fetched once.
+     **/
+    void getValuesAt(double first,double last,double step,std::vector<double>* values) const;
 
     double getDerivativeAt(double t) const WARN_UNUSED_RETURN;
 
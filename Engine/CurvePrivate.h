@@ -11,8 +11,10 @@
 #ifndef NATRON_ENGINE_CURVEPRIVATE_H_
 #define NATRON_ENGINE_CURVEPRIVATE_H_
 
+#include <vector>
 #include <boost/shared_ptr.hpp>
 #include <QReadWriteLock>
+#include <QMutex>
 
 #include "Engine/Rect.h"
 #include "Engine/Variant.h"
@@ -35,7 +37,43 @@ struct CurvePrivate{
                      // and times
     };
 
+    /**
+     * @brief A flat copy of the keyframes with the cubic of each segment precomputed, so that evaluating the curve
+     * is a binary search in a contiguous array followed by a polynomial evaluation.
+     * segments[i] is the segment ending at times[i]: segments[0] extrapolates before the first keyframe and
+     * segments[times.size()] after the last one, hence the segment of a time t is upper_bound(times,t).
+     * A snapshot is immutable once built: readers share it without holding the curve lock.
+     **/
+    struct Snapshot
+    {
+        struct Segment
+        {
+            double t0,t1; //< the cubic variable is (t - t0) / (t1 - t0)
+            double c[4];
+        };
+
+        std::vector<double> times;
+        std::vector<Segment> segments;
+        
+        ///The Y range of the curve when the snapshot was built, used when the curve has no owner
+        bool hasYRange;
+        double yMin, yMax;
+        
+        Snapshot()
+        : times()
+        , segments()
+        , hasYRange(false)
+        , yMin(INT_MIN)
+        , yMax(INT_MAX)
+        {
+        }
+    };
+
     KeyFrameSet keyFrames;
+    
+    ///Built lazily by readers from keyFrames and the Y range, reset by every function modifying them (under the write lock)
+    mutable boost::shared_ptr<const Snapshot> snapshot;
+    mutable QMutex snapshotMutex; //< protects the snapshot pointer only
 
     KnobI* owner;
     bool isParametric;
@@ -48,6 +86,8 @@ struct CurvePrivate{
     
     CurvePrivate()
     : keyFrames()
+    , snapshot()
+    , snapshotMutex()
     , owner(NULL)
     , isParametric(false)
     , type(DOUBLE_CURVE)
@@ -60,13 +100,16 @@ struct CurvePrivate{
     {}
     
     CurvePrivate(const CurvePrivate& other)
-    : _lock(QReadWriteLock::Recursive)
+    : snapshot()
+    , snapshotMutex()
+    , _lock(QReadWriteLock::Recursive)
     {
         *this = other;
     }
     
     void operator=(const CurvePrivate& other) {
         keyFrames = other.keyFrames;
+        invalidateSnapshot();
         owner = other.owner;
         isParametric = other.isParametric;
         type = other.type;
@@ -76,6 +119,12 @@ struct CurvePrivate{
         yMax = other.yMax;
         hasYRange = other.hasYRange;
     }
+    
+    ///Must be called whenever keyFrames or the Y range is modified, with the write lock held
+    void invalidateSnapshot() {
+        QMutexLocker l(&snapshotMutex);
+        snapshot.reset();
+    }
 };
 
 
@@ -34,6 +34,7 @@ void Curve::serialize(Archive & ar, const unsigned int version)
     (void)version;
     QReadLocker l(&_imp->_lock);
     ar & boost::serialization::make_nvp("KeyFrameSet",_imp->keyFrames);
+    _imp->invalidateSnapshot();
 }
 
 
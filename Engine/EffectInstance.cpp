@@ -12,10 +12,11 @@
 #include "EffectInstance.h"
 
 #include <sstream>
-#include <QtConcurrentMap>
+#include <algorithm>
+#include <QThread>
 #include <QReadWriteLock>
 #include <QCoreApplication>
-#include <QtConcurrentRun>
+#include <QElapsedTimer>
 
 #include <boost/bind.hpp>
 
@@ -31,6 +32,7 @@
 #include "Engine/KnobFile.h"
 #include "Engine/OfxEffectInstance.h"
 #include "Engine/OfxImageEffectInstance.h"
+#include "Engine/OfxHost.h"
 #include "Engine/KnobTypes.h"
 #include "Engine/PluginMemory.h"
 #include "Engine/Project.h"
@@ -39,6 +41,7 @@
 #include "Engine/ThreadStorage.h"
 #include "Engine/Settings.h"
 #include "Engine/RotoContext.h"
+#include "Engine/TaskScheduler.h"
 using namespace Natron;
 
 
@@ -46,6 +49,115 @@ class File_Knob;
 class OutputFile_Knob;
 
 
+namespace {
+    ///Runs func and stores its result, used to schedule functions with a return value on the TaskScheduler.
+    template <typename RET>
+    void storeTaskResult(const boost::function0<RET>& func,RET* ret)
+    {
+        *ret = func();
+    }
+    
+    ///Allocates an image which is not cached, with the RoD of the image described by params but pixels only within bounds.
+    boost::shared_ptr<Image>
+    makeLocalImage(const ImageKey& key,
+                   const ImageParams& params,
+                   const RectI& bounds,
+                   Natron::ImageComponents components,
+                   Natron::ImageBitDepth bitdepth)
+    {
+        boost::shared_ptr<const NonKeyParams> localParams(new ImageParams(0,params.getRoD(),bounds,bitdepth,
+                                                                          params.isRodProjectFormat(),components,
+                                                                          -1,0,params.getFramesNeeded()));
+        return boost::shared_ptr<Image>(new Image(key,localParams,false,std::string()));
+    }
+    
+    ///For an image cached as tiles, whose header has the given params: fetches from the cache (or allocates) the tiles
+    ///intersecting roi and returns a local image covering roi, with their pixels and bitmap. Only the tiles which have
+    ///something left to render in roi are appended to tilesToRender: the others needn't be written back.
+    ///Returns NULL if a tile couldn't be allocated.
+    boost::shared_ptr<Image>
+    makeImageFromTiles(const ImageKey& key,
+                       const ImageParams& headerParams,
+                       int cost,
+                       const RectI& roi,
+                       bool byPassCache,
+                       std::vector<boost::shared_ptr<Image> >* tilesToRender)
+    {
+        int tileSize = headerParams.getTileSize();
+        const RectI& pixelRoD = headerParams.getPixelRoD();
+        assert(tileSize > 0 && !pixelRoD.isNull());
+        RectI clippedRoI;
+        if (!roi.intersect(pixelRoD, &clippedRoI)) {
+            ///nothing will be rendered but the caller still needs an image
+            clippedRoI.set(pixelRoD.x1, pixelRoD.y1, pixelRoD.x1 + 1, pixelRoD.y1 + 1);
+        }
+        int tileX1,tileY1,tileX2,tileY2;
+        Image::getTilesRange(clippedRoI, tileSize, &tileX1, &tileY1, &tileX2, &tileY2);
+        ///only what the caller asked for: the tiles are not copied as a whole
+        boost::shared_ptr<Image> ret = makeLocalImage(key, headerParams, clippedRoI,
+                                                      headerParams.getComponents(), headerParams.getBitDepth());
+        
+        for (int tileY = tileY1; tileY < tileY2; ++tileY) {
+            for (int tileX = tileX1; tileX < tileX2; ++tileX) {
+                ImageKey tileKey = key.makeTileKey(tileSize, tileX, tileY);
+                boost::shared_ptr<const ImageParams> tileParams = Image::makeTileParams(cost, headerParams, key._mipMapLevel,
+                                                                                        tileX, tileY);
+                boost::shared_ptr<const ImageParams> cachedTileParams;
+                boost::shared_ptr<Image> tile;
+                if (Natron::getImageFromCache(tileKey, &cachedTileParams, &tile) && *cachedTileParams != *tileParams) {
+                    ///The tile was cached with another RoD (e.g: the RoD depends on the project format which changed)
+                    appPTR->removeFromNodeCache(tile);
+                    tile.reset();
+                }
+                if (!tile) {
+                    Natron::getImageFromCacheOrCreate(tileKey, tileParams, &tile);
+                    if (!tile) {
+                        return boost::shared_ptr<Image>();
+                    }
+                }
+                if (byPassCache) {
+                    tile->clearBitmap();
+                }
+                RectI tileRoI;
+                if (!tile->getPixelRoD().intersect(clippedRoI, &tileRoI)) {
+                    continue;
+                }
+                ret->copy(*tile, tileRoI, true);
+                if (!tile->getRestToRender(tileRoI).empty()) {
+                    tilesToRender->push_back(tile);
+                }
+            }
+        }
+        return ret;
+    }
+    
+    ///Fetches from the cache (or allocates) the variant with the given components and bit depth of the whole image
+    ///identified by key, whose params are sourceParams. A variant cached with params which no longer match the image
+    ///(e.g: its RoD depends on the project format which changed) is discarded.
+    ///Returns false if the variant couldn't be allocated, params is set anyway.
+    bool
+    getImageVariantFromCacheOrCreate(const ImageKey& key,
+                                     const ImageParams& sourceParams,
+                                     int cost,
+                                     Natron::ImageComponents components,
+                                     Natron::ImageBitDepth bitdepth,
+                                     boost::shared_ptr<const ImageParams>* params,
+                                     boost::shared_ptr<Image>* variant)
+    {
+        ImageKey variantKey = key.makeVariantKey(components, bitdepth);
+        *params = Image::makeVariantParams(cost, sourceParams, components, bitdepth);
+        boost::shared_ptr<const ImageParams> cachedVariantParams;
+        if (Natron::getImageFromCache(variantKey, &cachedVariantParams, variant) && *cachedVariantParams != **params) {
+            appPTR->removeFromNodeCache(*variant);
+            variant->reset();
+        }
+        if (!*variant) {
+            Natron::getImageFromCacheOrCreate(variantKey, *params, variant);
+        }
+        return variant->get() != NULL;
+    }
+}
+
 OutputImageLocker::OutputImageLocker(Natron::Node* node,const boost::shared_ptr<Natron::Image>& image)
 : n (node) , img(image)
 {
@@ -75,6 +187,7 @@ struct EffectInstance::RenderArgs {
     U64 _nodeHash;
     U64 _rotoAge;
     int _channelForAlpha;
+    boost::shared_ptr<const KnobsValuesSnapshot> _knobsValues; //< the parameters captured for this render
     
     RenderArgs()
     : _roi()
@@ -90,6 +203,7 @@ struct EffectInstance::RenderArgs {
     , _nodeHash(0)
     , _rotoAge(0)
     , _channelForAlpha(3)
+    , _knobsValues()
     {}
 };
 
@@ -177,12 +291,22 @@ struct EffectInstance::Implementation {
     
     /**
      * @brief Small helper class that set the render args and
-     * invalidate them when it is destroyed.
+     * invalidate them when it is destroyed. If the thread already had valid
+     * args (e.g: it is rendering tiles of the render it is waiting for), they are restored instead.
      **/
     class ScopedRenderArgs {
         
         RenderArgs args;
+        RenderArgs _previousArgs;
         ThreadStorage<RenderArgs>* _dst;
+        
+        void savePreviousArgs()
+        {
+            if (_dst->hasLocalData()) {
+                _previousArgs = _dst->localData();
+            }
+        }
+        
     public:
         ScopedRenderArgs(ThreadStorage<RenderArgs>* dst,
                          const RectI& roi,
@@ -196,11 +320,14 @@ struct EffectInstance::Implementation {
                          bool bypassCache,
                          U64 nodeHash,
                          U64 rotoAge,
-                         int channelForAlpha)
+                         int channelForAlpha,
+                         const boost::shared_ptr<const KnobsValuesSnapshot>& knobsValues)
         : args()
+        , _previousArgs()
         , _dst(dst)
         {
             assert(_dst);
+            savePreviousArgs();
             args._roi = roi;
             args._regionOfInterestResults = roiMap;
             args._time = time;
@@ -213,14 +340,17 @@ struct EffectInstance::Implementation {
             args._nodeHash = nodeHash;
             args._rotoAge = rotoAge;
             args._channelForAlpha = channelForAlpha;
+            args._knobsValues = knobsValues;
             args._validArgs = true;
             _dst->setLocalData(args);
         }
         
         ScopedRenderArgs(ThreadStorage<RenderArgs>* dst,const RenderArgs& a)
         : args(a)
+        , _previousArgs()
         , _dst(dst)
         {
+            savePreviousArgs();
             args._validArgs = true;
             _dst->setLocalData(args);
         }
@@ -228,8 +358,12 @@ struct EffectInstance::Implementation {
         ~ScopedRenderArgs()
         {
             assert(_dst->hasLocalData());
-            args._validArgs = false;
-            _dst->setLocalData(args);
+            if (_previousArgs._validArgs) {
+                _dst->setLocalData(_previousArgs);
+            } else {
+                args._validArgs = false;
+                _dst->setLocalData(args);
+            }
         }
         
         /**
@@ -478,16 +612,26 @@ boost::shared_ptr<Natron::Image> EffectInstance::getImage(int inputNb,
         return boost::shared_ptr<Natron::Image>();
     }
     
-    ///Launch in another thread as the current thread might already have been created by the multi-thread suite,
-    ///hence it might have a thread-id.
-    QThreadPool::globalInstance()->reserveThread();
+    ///Render the input through the task scheduler: an idle worker may pick it up, otherwise this thread
+    ///renders it itself while waiting instead of parking, so deep graphs do not need one thread per node.
     U64 inputNodeHash;
-    QFuture< boost::shared_ptr<Image > > future = QtConcurrent::run(n,&Natron::EffectInstance::renderRoI,
-                RenderRoIArgs(time,scale,mipMapLevel,view,roi,isSequentialRender,isRenderUserInteraction,
-                              byPassCache, NULL,comp,depth,channelForAlpha),&inputNodeHash);
-    future.waitForFinished();
-    QThreadPool::globalInstance()->releaseThread();
-    boost::shared_ptr<Natron::Image> inputImg = future.result();
+    boost::shared_ptr<Natron::Image> inputImg;
+    {
+        typedef boost::shared_ptr<Natron::Image> (EffectInstance::*RenderRoIFunc)(const RenderRoIArgs&,U64*);
+        TaskScheduler* scheduler = appPTR->getTaskScheduler();
+        TaskGroup group;
+        ///This thread may be running a thread function of the multi-thread suite (the plug-in fetches its inputs
+        ///from it), in which case the render of the input, made inline while waiting, must not inherit its index.
+        int multiThreadIndex = Natron::OfxHost::clearThreadIndex();
+        scheduler->schedule(&group,boost::bind(&storeTaskResult< boost::shared_ptr<Natron::Image> >,
+                                               boost::function0< boost::shared_ptr<Natron::Image> >(
+                                               boost::bind((RenderRoIFunc)&Natron::EffectInstance::renderRoI,n,
+                                               RenderRoIArgs(time,scale,mipMapLevel,view,roi,isSequentialRender,isRenderUserInteraction,
+                                                             byPassCache, NULL,comp,depth,channelForAlpha),&inputNodeHash)),
+                                               &inputImg));
+        scheduler->wait(&group);
+        Natron::OfxHost::restoreThreadIndex(multiThreadIndex);
+    }
 	if (!inputImg) {
 		return inputImg;
 	}
@@ -716,6 +860,14 @@ boost::shared_ptr<Natron::Image> EffectInstance::renderRoI(const RenderRoIArgs&
         }
     }
     
+    ///When the tile size is not 0 the image is cached as tiles: the entry of the image is only a header holding
+    ///the results of the actions and each tile has its own entry, so that only the tiles covering the RoI are
+    ///rendered and cached. This requires the effect to render any portion of the image at the requested scale.
+    int tileSize = appPTR->getCurrentSettings()->getImageCacheTileSize();
+    if (!supportsTiles() || (!supportsRenderScale() && args.mipMapLevel != 0)) {
+        tileSize = 0;
+    }
+    
     /// First-off look-up the cache and see if we can find the cached actions results and cached image.
     bool isCached = Natron::getImageFromCache(key, &cachedImgParams,&image);
     
@@ -728,7 +880,14 @@ boost::shared_ptr<Natron::Image> EffectInstance::renderRoI(const RenderRoIArgs&
         
         imageLock.reset(new OutputImageLocker(_node.get(),image));
         
-        if (cachedImgParams->isRodProjectFormat()) {
+        if (cachedImgParams->getInputNbIdentity() == -1 && cachedImgParams->getTileSize() != tileSize) {
+            ////The image was cached as a whole image or with another tile size (the setting changed): discard it
+            isCached = false;
+            appPTR->removeFromNodeCache(image);
+            cachedImgParams.reset();
+            imageLock.reset(); //< release the lock after cleaning it from the cache
+            image.reset();
+        } else if (cachedImgParams->isRodProjectFormat()) {
             ////If the image was cached with a RoD dependent on the project format, but the project format changed,
             ////just discard this entry
             Format projectFormat;
@@ -742,29 +901,29 @@ boost::shared_ptr<Natron::Image> EffectInstance::renderRoI(const RenderRoIArgs&
             }
         }
         
-        if (image) {
-            ///If components are different but convertible without damage, or bit depth is different, keep this image, convert it
-            ///and continue render on it. This is in theory still faster than ignoring the image and doing a full render again.
-            if ((image->getComponents() != args.components && Image::hasEnoughDataToConvert(image->getComponents(),args.components)) ||
-                image->getBitDepth() != args.bitdepth) {
-                ///Convert the image to the requested components
-                boost::shared_ptr<Image> remappedImage(new Image(args.components,image->getRoD(),args.mipMapLevel,args.bitdepth));
-                if (!byPassCache) {
-                    image->convertToFormat(image->getPixelRoD(), remappedImage.get(),
-                                           getApp()->getDefaultColorSpaceForBitDepth(image->getBitDepth()),
-                                           getApp()->getDefaultColorSpaceForBitDepth(args.bitdepth),
-                                           args.channelForAlpha,false, true);
+        ///The components of tiled images are handled once the tiles are fetched
+        if (image && !image->isTiled()) {
+            if (cachedImgParams->getInputNbIdentity() == -1 &&
+                (image->getComponents() != args.components || image->getBitDepth() != args.bitdepth)) {
+                ///The image was cached with other components or bit depth: the requested format is cached as a variant
+                ///of this image, render in the variant instead so that the next request for this format is a plain hit.
+                ///The image itself stays in the cache for the requests of its own format.
+                boost::shared_ptr<const ImageParams> variantParams;
+                boost::shared_ptr<OutputImageLocker> variantLock;
+                boost::shared_ptr<Image> variant = getImageVariant(key, image, *cachedImgParams, args.roi, args.components,
+                                                                   args.bitdepth, args.channelForAlpha, byPassCache,
+                                                                   &variantParams, &variantLock);
+                if (!variant) {
+                    std::stringstream ss;
+                    ss << "Failed to allocate an image of ";
+                    ss << printAsRAM(variantParams->getElementsCount() * sizeof(Image::data_t)).toStdString();
+                    Natron::errorDialog("Out of memory",ss.str());
+                    return variant;
                 }
-                ///switch the pointer
-                image = remappedImage;
-            } else if (image->getComponents() != args.components) {
-                assert(!Image::hasEnoughDataToConvert(image->getComponents(),args.components));
-                ///we cannot convert without loosing data of some channels, we better off render everything again
-                isCached = false;
-                appPTR->removeFromNodeCache(image);
-                cachedImgParams.reset();
-                imageLock.reset(); //< release the lock after cleaning it from the cache
-                image.reset();
+                ///switch the pointers, this also releases the lock of the source image
+                cachedImgParams = variantParams;
+                image = variant;
+                imageLock = variantLock;
             }
             
             if (isCached && byPassCache) {
@@ -820,7 +979,8 @@ boost::shared_ptr<Natron::Image> EffectInstance::renderRoI(const RenderRoIArgs&
                                                             byPassCache,
                                                             nodeHash,
                                                             0,
-                                                            args.channelForAlpha);
+                                                            args.channelForAlpha,
+                                                            boost::shared_ptr<const KnobsValuesSnapshot>());
                 Natron::ImageComponents inputPrefComps;
                 Natron::ImageBitDepth inputPrefDepth;
                 Natron::EffectInstance* inputEffectIdentity = input_other_thread(inputNbIdentity);
@@ -872,12 +1032,18 @@ boost::shared_ptr<Natron::Image> EffectInstance::renderRoI(const RenderRoIArgs&
         }
       
         
-        ///Cache the image with the requested components instead of the remapped ones
-        cachedImgParams = Natron::Image::makeParams(cost, rod,args.mipMapLevel,isProjectFormat,
+        if (identity) {
+            tileSize = 0;
+        }
+        
+        ///Cache the image with the requested components instead of the remapped ones.
+        ///The header of a tiled image has no pixels, it has the cost of identities.
+        cachedImgParams = Natron::Image::makeParams(tileSize ? -1 : cost, rod,args.mipMapLevel,isProjectFormat,
                                                     args.components,
                                                     args.bitdepth,
                                                     inputNbIdentity, inputTimeIdentity,
-                                                    framesNeeded);
+                                                    framesNeeded,
+                                                    tileSize);
     
         ///even though we called getImage before and it returned false, it may now
         ///return true if another thread created the image in the cache, so we can't
@@ -948,7 +1114,8 @@ boost::shared_ptr<Natron::Image> EffectInstance::renderRoI(const RenderRoIArgs&
                                                         byPassCache,
                                                         nodeHash,
                                                         0,
-                                                        args.channelForAlpha);
+                                                        args.channelForAlpha,
+                                                        boost::shared_ptr<const KnobsValuesSnapshot>());
             Natron::ImageComponents inputPrefComps;
             Natron::ImageBitDepth inputPrefDepth;
             Natron::EffectInstance* inputEffectIdentity = input_other_thread(inputNbIdentity);
@@ -993,9 +1160,39 @@ boost::shared_ptr<Natron::Image> EffectInstance::renderRoI(const RenderRoIArgs&
     ////The lock must be taken here otherwise this could lead to corruption if multiple threads
     ////are accessing the output image.
     assert(imageLock);
+    
+    ///For a tiled image, render in a local image covering the RoI made from the tiles. The header stays locked
+    ///meanwhile so the tiles are not modified by another thread. Only the tiles with something left to render
+    ///are kept to be written back.
+    std::vector<boost::shared_ptr<Image> > tiles;
+    if (image->isTiled()) {
+        assert(image == downscaledImage);
+        image = makeImageFromTiles(key, *cachedImgParams, shouldRenderedDataBePersistent() ? 1 : 0,
+                                   args.roi, byPassCache, &tiles);
+        if (!image) {
+            Natron::errorDialog("Out of memory","Failed to allocate the tiles of an image.");
+            return image;
+        }
+        if (image->getComponents() != args.components || image->getBitDepth() != args.bitdepth) {
+            ///Same as for whole images: convert what was cached if possible, but the remapped image is not cached
+            boost::shared_ptr<Image> remappedImage = makeLocalImage(key, *cachedImgParams, image->getPixelRoD(),
+                                                                    args.components, args.bitdepth);
+            if (!byPassCache && Image::hasEnoughDataToConvert(image->getComponents(),args.components)) {
+                image->convertToFormat(image->getPixelRoD(), remappedImage.get(),
+                                       getApp()->getDefaultColorSpaceForBitDepth(image->getBitDepth()),
+                                       getApp()->getDefaultColorSpaceForBitDepth(args.bitdepth),
+                                       args.channelForAlpha,false, true);
+            }
+            image = remappedImage;
+            tiles.clear();
+        }
+        downscaledImage = image;
+    }
 
     ///If we reach here, it can be either because the image is cached or not, either way
     ///the image is NOT an identity, and it may have some content left to render.
+    QElapsedTimer renderTimer;
+    renderTimer.start();
     EffectInstance::RenderRoIStatus renderRetCode = renderRoIInternal(args.time, args.scale,args.mipMapLevel,
                                                                       args.view, args.roi, cachedImgParams, image,
                                                                       downscaledImage,args.isSequentialRender,
@@ -1008,6 +1205,40 @@ boost::shared_ptr<Natron::Image> EffectInstance::renderRoI(const RenderRoIArgs&
         appPTR->removeFromNodeCache(image);
     } else if (renderRetCode == eImageRenderFailed) {
         throw std::runtime_error("Rendering Failed");
+    } else if (renderRetCode == eImageRendered) {
+        ///Record what the render cost so the cache keeps the expensive images longer. For a tiled image the
+        ///time is split among the tiles by area.
+        double renderTime = renderTimer.nsecsElapsed() / 1000000.;
+        if (tiles.empty()) {
+            image->addComputeTime(renderTime);
+        } else {
+            ///store what was rendered in the tiles, the local image holds their part within the RoI
+            std::vector<RectI> renderedRoIs(tiles.size());
+            double totalArea = 0.;
+            for (U32 i = 0; i < tiles.size(); ++i) {
+                tiles[i]->getPixelRoD().intersect(image->getPixelRoD(), &renderedRoIs[i]);
+                totalArea += (double)renderedRoIs[i].width() * renderedRoIs[i].height();
+            }
+            for (U32 i = 0; i < tiles.size(); ++i) {
+                if (renderedRoIs[i].isNull()) {
+                    continue;
+                }
+                tiles[i]->copy(*image, renderedRoIs[i], true);
+                if (totalArea > 0.) {
+                    tiles[i]->addComputeTime(renderTime * ((double)renderedRoIs[i].width() * renderedRoIs[i].height()) / totalArea);
+                }
+            }
+        }
+        
+        ///Let the other render processes of the host reuse what is complete. A tiled image converted to other
+        ///components is a local image: its tiles were not rendered.
+        if (!tiles.empty()) {
+            for (std::vector<boost::shared_ptr<Image> >::iterator it = tiles.begin(); it != tiles.end(); ++it) {
+                appPTR->publishImageToSharedCache(*it);
+            }
+        } else if (cachedImgParams->getTileSize() == 0) {
+            appPTR->publishImageToSharedCache(downscaledImage);
+        }
     }
     
     {
@@ -1040,6 +1271,41 @@ void EffectInstance::renderRoI(SequenceTime time,const RenderScale& scale,unsign
     }
 }
 
+boost::shared_ptr<Image> EffectInstance::getImageVariant(const ImageKey& key,
+                                                         const boost::shared_ptr<Image>& image,
+                                                         const ImageParams& params,
+                                                         const RectI& roi,
+                                                         Natron::ImageComponents components,
+                                                         Natron::ImageBitDepth bitdepth,
+                                                         int channelForAlpha,
+                                                         bool byPassCache,
+                                                         boost::shared_ptr<const ImageParams>* variantParams,
+                                                         boost::shared_ptr<OutputImageLocker>* variantLock) {
+    boost::shared_ptr<Image> variant;
+    if (!getImageVariantFromCacheOrCreate(key, params, shouldRenderedDataBePersistent() ? 1 : 0,
+                                          components, bitdepth, variantParams, &variant)) {
+        return variant;
+    }
+    variantLock->reset(new OutputImageLocker(_node.get(),variant));
+    if (byPassCache) {
+        variant->clearBitmap();
+    } else if (Image::hasEnoughDataToConvert(image->getComponents(),components)) {
+        ///Only convert what was rendered in the image since the variant was last updated:
+        ///this is a no-op when the variant is already rendered in the RoI.
+        RectI clippedRoI;
+        if (roi.intersect(image->getPixelRoD(), &clippedRoI)) {
+            std::list<RectI> rectsToConvert = variant->getRestToRender(clippedRoI);
+            for (std::list<RectI>::iterator it = rectsToConvert.begin(); it != rectsToConvert.end(); ++it) {
+                image->convertToFormat(*it, variant.get(),
+                                       getApp()->getDefaultColorSpaceForBitDepth(image->getBitDepth()),
+                                       getApp()->getDefaultColorSpaceForBitDepth(bitdepth),
+                                       channelForAlpha,false, true);
+            }
+        }
+    }
+    return variant;
+}
+
 EffectInstance::RenderRoIStatus EffectInstance::renderRoIInternal(SequenceTime time,const RenderScale& scale,unsigned int mipMapLevel,
                                                                   int view,const RectI& renderWindow,
                                                                   const boost::shared_ptr<const ImageParams>& cachedImgParams,
@@ -1057,6 +1323,12 @@ EffectInstance::RenderRoIStatus EffectInstance::renderRoIInternal(SequenceTime t
     Natron::ImageBitDepth outputDepth ;
     Natron::ImageComponents outputComponents;
     getPreferredDepthAndComponents(-1, &outputComponents, &outputDepth);
+    
+    ///Effects which are not OpenFX render in whichever supported depth they are given: don't convert if the
+    ///requested depth is one of them. (OpenFX effects must render in the depth of their output clip.)
+    if (!isOpenFX() && outputDepth != image->getBitDepth() && isSupportedBitDepth(image->getBitDepth())) {
+        outputDepth = image->getBitDepth();
+    }
     bool imageConversionNeeded = outputComponents != image->getComponents() || outputDepth != image->getBitDepth();
     
     assert(isSupportedBitDepth(outputDepth) && isSupportedComponent(-1, outputComponents));
@@ -1145,6 +1417,13 @@ EffectInstance::RenderRoIStatus EffectInstance::renderRoIInternal(SequenceTime t
         }
     }
     
+    ///Capture the parameters once for all the rectangles and tiles of this render: the render threads
+    ///read them without locking the knobs and every tile sees the same values.
+    boost::shared_ptr<const KnobsValuesSnapshot> knobsValues;
+    if (!rectsToRender.empty()) {
+        knobsValues.reset(new KnobsValuesSnapshot(this,time));
+    }
+    
     for (std::list<RectI>::const_iterator it = rectsToRender.begin(); it != rectsToRender.end(); ++it) {
         
         RectI rectToRender = *it;
@@ -1195,7 +1474,8 @@ EffectInstance::RenderRoIStatus EffectInstance::renderRoIInternal(SequenceTime t
                                                     byPassCache,
                                                     nodeHash,
                                                     rotoAge,
-                                                    channelForAlpha );
+                                                    channelForAlpha,
+                                                    knobsValues);
         const RenderArgs& args = scopedArgs.getArgs();
     
        
@@ -1315,8 +1595,9 @@ EffectInstance::RenderRoIStatus EffectInstance::renderRoIInternal(SequenceTime t
         int nbThreads = appPTR->getCurrentSettings()->getNumberOfThreads();
         if (safety == FULLY_SAFE_FRAME) {
             
-            if (nbThreads == -1 || nbThreads == 1 || (nbThreads == 0 && QThread::idealThreadCount() == 1) ||
-                QThreadPool::globalInstance()->activeThreadCount() >= QThreadPool::globalInstance()->maxThreadCount()) {
+            ///Tiles are queued on the task scheduler, they never spawn threads: no need to check how busy the
+            ///workers are, idle ones steal the tiles and busy ones leave them to the calling thread.
+            if (nbThreads == -1 || nbThreads == 1 || (nbThreads == 0 && QThread::idealThreadCount() == 1)) {
                 safety = FULLY_SAFE;
             } else {
                 if (!getApp()->getProject()->tryLock()) {
@@ -1331,16 +1612,26 @@ EffectInstance::RenderRoIStatus EffectInstance::renderRoIInternal(SequenceTime t
             case FULLY_SAFE_FRAME: // the plugin will not perform any per frame SMP threading
             {
                 // we can split the frame in tiles and do per frame SMP threading (see kOfxImageEffectPluginPropHostFrameThreading)
+                TaskScheduler* scheduler = appPTR->getTaskScheduler();
                 if (nbThreads == 0) {
-                    nbThreads = QThreadPool::globalInstance()->maxThreadCount();
+                    nbThreads = scheduler->getWorkersCount();
                 }
                 std::vector<RectI> splitRects = RectI::splitRectIntoSmallerRect(rectToRender, nbThreads);
+                std::vector<Natron::Status> ret(splitRects.size(),StatOK);
                 // the bitmap is checked again at the beginning of EffectInstance::tiledRenderingFunctor()
-                QFuture<Natron::Status> ret = QtConcurrent::mapped(splitRects,
-                                                                   boost::bind(&EffectInstance::tiledRenderingFunctor,
-                                                                               this,args,_1,downscaledMappedImage,fullScaleMappedImage,
-                                                                               downscaledMappedImage,fullScaleMappedImage));
-                ret.waitForFinished();
+                TaskGroup tilesGroup;
+                for (U32 i = 0; i < splitRects.size(); ++i) {
+                    scheduler->schedule(&tilesGroup,boost::bind(&storeTaskResult<Natron::Status>,
+                                                                boost::function0<Natron::Status>(
+                                                                boost::bind(&EffectInstance::tiledRenderingFunctor,
+                                                                            this,args,splitRects[i],downscaledMappedImage,fullScaleMappedImage,
+                                                                            downscaledMappedImage,fullScaleMappedImage)),
+                                                                &ret[i]));
+                }
+                scheduler->wait(&tilesGroup);
+                if (tilesGroup.hasFailed()) {
+                    renderStatus = StatFailed;
+                }
                 
                 bool callEndRender = false;
                 ///never call endsequence render here if the render is sequential
@@ -1359,7 +1650,7 @@ EffectInstance::RenderRoIStatus EffectInstance::renderRoIInternal(SequenceTime t
                     }
                 }
                 
-                for (QFuture<Natron::Status>::const_iterator it2 = ret.begin(); it2!=ret.end(); ++it2) {
+                for (std::vector<Natron::Status>::const_iterator it2 = ret.begin(); it2!=ret.end(); ++it2) {
                     if ((*it2) == Natron::StatFailed) {
                         renderStatus = *it2;
                         break;
@@ -2161,6 +2452,43 @@ void EffectInstance::onKnobValueChanged(KnobI* /*k*/, Natron::ValueChangedReason
     
 }
 
+const KnobsValuesSnapshot* EffectInstance::getKnobsValuesSnapshot() const
+{
+    if (_imp->renderArgs.hasLocalData()) {
+        const RenderArgs& args = _imp->renderArgs.localData();
+        ///The plug-in may have moved the current frame of the render with timelineGoTo
+        if (args._validArgs && args._knobsValues && args._knobsValues->getTime() == args._time) {
+            return args._knobsValues.get();
+        }
+    }
+    return NULL;
+}
+
+struct EffectInstance::KnobsValuesSnapshotScope::ScopeImpl
+{
+    Implementation::ScopedRenderArgs args;
+    
+    ScopeImpl(Natron::ThreadStorage<RenderArgs>* dst,const RenderArgs& a)
+    : args(dst,a)
+    {
+    }
+};
+
+EffectInstance::KnobsValuesSnapshotScope::KnobsValuesSnapshotScope(EffectInstance* effect,
+                                                                   const boost::shared_ptr<const KnobsValuesSnapshot>& snapshot)
+: _imp()
+{
+    assert(effect && snapshot);
+    RenderArgs args;
+    args._time = snapshot->getTime();
+    args._knobsValues = snapshot;
+    _imp.reset(new ScopeImpl(&effect->_imp->renderArgs,args));
+}
+
+EffectInstance::KnobsValuesSnapshotScope::~KnobsValuesSnapshotScope()
+{
+}
+
 int EffectInstance::getCurrentFrameRecursive() const
 {
     if (_imp->renderArgs.hasLocalData() && _imp->renderArgs.localData()._validArgs) {
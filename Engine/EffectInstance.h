@@ -33,7 +33,9 @@ namespace Natron{
 
 class Node;
 class Image;
+class ImageKey;
 class ImageParams;
+class OutputImageLocker;
 /**
  * @brief This is the base class for visual effects.
  * A live instance is always living throughout the lifetime of a Node and other copies are
@@ -349,6 +351,25 @@ public:
                    bool byPassCache,
                    U64 nodeHash);
     
+    /**
+     * @brief Returns the variant (see ImageKey::makeVariantKey) with the given components and bit depth of the whole
+     * image of this effect identified by key, fetched from the cache or allocated. What was rendered in image within roi
+     * and not yet in the variant is converted into it, unless byPassCache is true in which case the variant is cleared.
+     * The variant is locked by variantLock when this function returns.
+     * @param variantParams Set to the params of the variant, even if it couldn't be allocated.
+     * @returns NULL if the variant couldn't be allocated.
+     **/
+    boost::shared_ptr<Image> getImageVariant(const ImageKey& key,
+                                             const boost::shared_ptr<Image>& image,
+                                             const ImageParams& params,
+                                             const RectI& roi,
+                                             Natron::ImageComponents components,
+                                             Natron::ImageBitDepth bitdepth,
+                                             int channelForAlpha,
+                                             bool byPassCache,
+                                             boost::shared_ptr<const ImageParams>* variantParams,
+                                             boost::shared_ptr<OutputImageLocker>* variantLock);
+    
     /**
      * @breif Don't override this one, override onKnobValueChanged instead.
      **/
@@ -640,6 +661,31 @@ public:
      **/
     int getCurrentFrameRecursive() const;
     
+    /**
+     * @brief Returns the parameters captured when the calling thread started rendering this effect,
+     * or NULL if it is not rendering it. @see KnobsValuesSnapshot
+     **/
+    virtual const KnobsValuesSnapshot* getKnobsValuesSnapshot() const OVERRIDE FINAL;
+    
+    /**
+     * @brief While it exists, the calling thread reads the parameters of the effect from the given snapshot, as the
+     * threads rendering the effect at the time of the snapshot do. Lets the parameter reads of the renders be
+     * measured and tested outside of a render.
+     **/
+    class KnobsValuesSnapshotScope
+    {
+    public:
+        
+        KnobsValuesSnapshotScope(EffectInstance* effect,const boost::shared_ptr<const KnobsValuesSnapshot>& snapshot);
+        
+        ~KnobsValuesSnapshotScope();
+        
+    private:
+        
+        struct ScopeImpl;
+        boost::scoped_ptr<ScopeImpl> _imp;
+    };
+    
     /**
      * @brief If the plug-in calls timelineGoTo and we're during a render/instance changed action,
      * then all the knobs will retrieve the current time as being the one in the last render args thread-storage.
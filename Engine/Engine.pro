@@ -40,6 +40,10 @@ SOURCES += \
     AppInstance.cpp \
     AppManager.cpp \
     BlockingBackgroundRender.cpp \
+    CacheJournal.cpp \
+    CacheIOQueue.cpp \
+    CacheCompression.cpp \
+    SharedMemoryCache.cpp \
     ChannelSet.cpp \
     Curve.cpp \
     CurveSerialization.cpp \
@@ -57,6 +61,7 @@ SOURCES += \
     KnobFactory.cpp \
     KnobFile.cpp \
     KnobTypes.cpp \
+    LatencyHistogram.cpp \
     LibraryBinary.cpp \
     Log.cpp \
     Lut.cpp \
@@ -83,6 +88,8 @@ SOURCES += \
     Settings.cpp \
     StandardPaths.cpp \
     StringAnimationManager.cpp \
+    TaskScheduler.cpp \
+    ImageBufferPool.cpp \
     TimeLine.cpp \
     Timer.cpp \
     Transform.cpp \
@@ -96,6 +103,10 @@ HEADERS += \
     BlockingBackgroundRender.h \
     Cache.h \
     CacheEntry.h \
+    CacheJournal.h \
+    CacheIOQueue.h \
+    CacheCompression.h \
+    SharedMemoryCache.h \
     Curve.h \
     CurveSerialization.h \
     CurvePrivate.h \
@@ -122,6 +133,7 @@ HEADERS += \
     KnobFactory.h \
     KnobFile.h \
     KnobTypes.h \
+    LatencyHistogram.h \
     LibraryBinary.h \
     Log.h \
     LRUHashTable.h \
@@ -154,6 +166,8 @@ HEADERS += \
     Singleton.h \
     StandardPaths.h \
     StringAnimationManager.h \
+    TaskScheduler.h \
+    ImageBufferPool.h \
     TextureRect.h \
     TextureRectSerialization.h \
     ThreadStorage.h \
@@ -11,6 +11,7 @@
 
 #include "Engine/FrameEntry.h"
 #include "Engine/FrameParams.h"
+#include "Engine/OpenGLViewerI.h"
 
 using namespace Natron;
 
@@ -95,3 +96,14 @@ boost::shared_ptr<const FrameParams> FrameEntry::makeParams(const RectI rod,int
     return boost::shared_ptr<const FrameParams>(new FrameParams(rod,bitDepth,texW,texH));
 }
 
+int FrameEntry::getCompressionElementSize() const
+{
+    ///the textures are RGBA
+    return _key.getBitDepth() == OpenGLViewerI::BYTE ? 4 : sizeof(float);
+}
+
+bool FrameEntry::canBeStoredAsHalfFloat() const
+{
+    return _key.getBitDepth() != OpenGLViewerI::BYTE;
+}
+
@@ -119,6 +119,12 @@ namespace Natron{
         {
             return _data.writable();
         }
+        
+        ///The channels of 8 bits textures, the bytes of the floats otherwise
+        virtual int getCompressionElementSize() const OVERRIDE FINAL;
+        
+        ///Float textures are only displayed
+        virtual bool canBeStoredAsHalfFloat() const OVERRIDE FINAL;
     };
     
     
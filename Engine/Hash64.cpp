@@ -23,6 +23,21 @@ using namespace Natron;
 
 void Hash64::computeHash() {
 
+    if (algorithm == FAST_HASH) {
+        if (count == 0) {
+            return;
+        }
+        ///Final avalanche of xxHash64, the length is mixed in so that trailing zeroes change the hash
+        U64 h = state + count * sizeof(U64);
+        h ^= h >> 33;
+        h *= kPrime2;
+        h ^= h >> 29;
+        h *= kPrime3;
+        h ^= h >> 32;
+        hash = h;
+        return;
+    }
+    
     if (node_values.empty() ) {
         return;
     }
@@ -35,14 +50,31 @@ void Hash64::computeHash() {
 
 void Hash64::reset(){
     node_values.clear();
+    state = kSeed;
+    count = 0;
     hash=0;
 }
 
 
 void Hash64_appendQString(Hash64* hash, const QString& str) {
-    for(int i =0 ; i< str.size();++i) {
-        hash->append<unsigned short>(str.at(i).unicode());
+    if (hash->getAlgorithm() == Hash64::CRC64_HASH) {
+        for(int i =0 ; i< str.size();++i) {
+            hash->append<unsigned short>(str.at(i).unicode());
+        }
+        return;
+    }
+    ///pack 4 UTF-16 code units per value
+    const ushort* utf16 = str.utf16();
+    int size = str.size();
+    int i = 0;
+    for (; i + 4 <= size; i += 4) {
+        hash->append<U64>((U64)utf16[i] | ((U64)utf16[i + 1] << 16) | ((U64)utf16[i + 2] << 32) | ((U64)utf16[i + 3] << 48));
+    }
+    if (i < size) {
+        U64 last = 0;
+        for (int shift = 0; i < size; ++i, shift += 16) {
+            last |= (U64)utf16[i] << shift;
+        }
+        hash->append<U64>(last);
     }
 }
-
-
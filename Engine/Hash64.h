@@ -30,16 +30,38 @@ namespace Natron{
     - the hash values for the  tree upstream
 */
 
+/**
+ * @brief A 64 bit non-cryptographic hash of a sequence of values, each of them being widened to 64 bits.
+ * By default the values are mixed as soon as they are appended, word by word with multiplications and rotations
+ * in the manner of xxHash64, which requires no intermediate storage.
+ * The CRC64 mode reproduces the hash values of the previous versions of Natron, which were checksums
+ * of all the values appended. It is slower and only meant to recognize the entries of old on-disk caches.
+ **/
 class Hash64 {
     
 public:
-    Hash64(){hash=0;}
+    
+    enum Algorithm {
+        FAST_HASH = 0, //< streaming xxHash64-like word mixing
+        CRC64_HASH //< compatibility mode: CRC64 of all the values, computed in computeHash()
+    };
+    
+    Hash64(Algorithm algo = FAST_HASH)
+    : hash(0)
+    , state(kSeed)
+    , count(0)
+    , algorithm(algo)
+    , node_values()
+    {
+    }
+    
     ~Hash64(){
         node_values.clear();
     }
     
     U64 value() const {return hash;}
 
+    Algorithm getAlgorithm() const { return algorithm; }
     
     void computeHash();
     
@@ -57,7 +79,11 @@ public:
 
     template<typename T>
     void append(T value) {
-        node_values.push_back(toU64(value));
+        if (algorithm == FAST_HASH) {
+            mix(toU64(value));
+        } else {
+            node_values.push_back(toU64(value));
+        }
     }
 
     bool operator== (const Hash64& h) const {
@@ -80,9 +106,31 @@ private:
             T data;
         };
     };
+    
+    static const U64 kPrime1 = 11400714785074694791ULL;
+    static const U64 kPrime2 = 14029467366897019727ULL;
+    static const U64 kPrime3 = 1609587929392839161ULL;
+    static const U64 kPrime4 = 9650029242287828579ULL;
+    static const U64 kPrime5 = 2870177450012600261ULL;
+    static const U64 kSeed = kPrime5;
+    
+    static U64 rotl(U64 x,int r) { return (x << r) | (x >> (64 - r)); }
+    
+    ///Same as the processing of an 8 bytes lane in xxHash64
+    void mix(U64 v) {
+        v *= kPrime2;
+        v = rotl(v, 31);
+        v *= kPrime1;
+        state ^= v;
+        state = rotl(state, 27) * kPrime1 + kPrime4;
+        ++count;
+    }
 
     U64 hash;
-    std::vector<U64> node_values;
+    U64 state; //< FAST_HASH only
+    U64 count; //< FAST_HASH only: number of values mixed into state
+    Algorithm algorithm;
+    std::vector<U64> node_values; //< CRC64_HASH only
 };
 
 void Hash64_appendQString(Hash64* hash, const QString& str);
@@ -11,11 +11,27 @@
 
 #include "Image.h"
 
+#include <algorithm>
+#include <cstring>
+#include <vector>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define NATRON_IMAGE_SSE2
+#include <emmintrin.h>
+#endif
+
 #include <QDebug>
 
+#ifndef Q_MOC_RUN
+#include <boost/bind.hpp>
+#endif
+
 #include "Engine/AppManager.h"
 #include "Engine/ImageParams.h"
 #include "Engine/Lut.h"
+#include "Engine/TaskScheduler.h"
+
+///Images with at least twice this number of pixels are converted by bands of scan-lines on the TaskScheduler
+#define NATRON_IMAGE_CONVERSION_BAND_MIN_PIXELS 32768
 
 using namespace Natron;
 
@@ -28,6 +44,11 @@ ImageKey::ImageKey()
 , _mipMapLevel(0)
 , _view(0)
 , _pixelAspect(1)
+, _tileSize(0)
+, _tileX(0)
+, _tileY(0)
+, _variantComponents(ImageComponentNone)
+, _variantBitDepth(IMAGE_BYTE)
 {}
 
 
@@ -41,14 +62,48 @@ ImageKey::ImageKey(U64 nodeHashKey,
 , _time(time)
 , _view(view)
 , _pixelAspect(pixelAspect)
+, _tileSize(0)
+, _tileX(0)
+, _tileY(0)
+, _variantComponents(ImageComponentNone)
+, _variantBitDepth(IMAGE_BYTE)
 { _mipMapLevel = mipMapLevel; }
 
+ImageKey ImageKey::makeTileKey(int tileSize,int tileX,int tileY) const {
+    assert(tileSize > 0 && !isTile());
+    ImageKey ret(*this);
+    ret._tileSize = tileSize;
+    ret._tileX = tileX;
+    ret._tileY = tileY;
+    ret.resetHash();
+    return ret;
+}
+
+ImageKey ImageKey::makeVariantKey(Natron::ImageComponents components,Natron::ImageBitDepth bitdepth) const {
+    assert(components != ImageComponentNone && !isVariant() && !isTile());
+    ImageKey ret(*this);
+    ret._variantComponents = components;
+    ret._variantBitDepth = bitdepth;
+    ret.resetHash();
+    return ret;
+}
+
 void ImageKey::fillHash(Hash64* hash) const {
     hash->append(_nodeHashKey);
     hash->append(_mipMapLevel);
     hash->append(_time);
     hash->append(_view);
     hash->append(_pixelAspect);
+    ///whole images keep the same hash as before tiles were introduced
+    if (_tileSize) {
+        hash->append(_tileSize);
+        hash->append(_tileX);
+        hash->append(_tileY);
+    }
+    if (isVariant()) {
+        hash->append(_variantComponents);
+        hash->append(_variantBitDepth);
+    }
 }
 
 
@@ -58,27 +113,193 @@ bool ImageKey::operator==(const ImageKey& other) const {
     _mipMapLevel == other._mipMapLevel &&
     _time == other._time &&
     _view == other._view &&
-    _pixelAspect == other._pixelAspect;
+    _pixelAspect == other._pixelAspect &&
+    _tileSize == other._tileSize &&
+    _tileX == other._tileX &&
+    _tileY == other._tileY &&
+    _variantComponents == other._variantComponents &&
+    _variantBitDepth == other._variantBitDepth;
     
 }
 
 
 
 
+namespace {
+    
+typedef std::vector<std::pair<int,int> > BitmapRow;
+
+bool
+intervalEndsBefore(const std::pair<int,int>& interval,int x)
+{
+    return interval.second < x;
+}
+
+bool
+intervalEndsAtOrBefore(const std::pair<int,int>& interval,int x)
+{
+    return interval.second <= x;
+}
+
+bool
+startsAfter(int x,const std::pair<int,int>& interval)
+{
+    return x < interval.first;
+}
+
+///Returns the interval containing x, or row.end()
+BitmapRow::const_iterator
+findInterval(const BitmapRow& row,int x)
+{
+    BitmapRow::const_iterator it = std::upper_bound(row.begin(), row.end(), x, startsAfter);
+    if (it == row.begin()) {
+        return row.end();
+    }
+    --it;
+    return it->second > x ? it : row.end();
+}
+
+///Marks [x1,x2), merging the intervals it overlaps or touches
+void
+markRow(BitmapRow& row,int x1,int x2)
+{
+    if (x1 >= x2) {
+        return;
+    }
+    BitmapRow::iterator first = std::lower_bound(row.begin(), row.end(), x1, intervalEndsBefore);
+    BitmapRow::iterator last = std::upper_bound(first, row.end(), x2, startsAfter);
+    if (first != last) {
+        x1 = std::min(x1, first->first);
+        x2 = std::max(x2, (last - 1)->second);
+        first = row.erase(first, last);
+    }
+    row.insert(first, std::make_pair(x1, x2));
+}
+
+///Unmarks [x1,x2), splitting the intervals crossing its edges
+void
+unmarkRow(BitmapRow& row,int x1,int x2)
+{
+    if (x1 >= x2) {
+        return;
+    }
+    BitmapRow::iterator first = std::lower_bound(row.begin(), row.end(), x1, intervalEndsAtOrBefore);
+    BitmapRow::iterator last = std::lower_bound(first, row.end(), x2, intervalEndsAtOrBefore);
+    if (last != row.end() && last->first < x2) {
+        ///this interval contains x2
+        ++last;
+    }
+    if (first == last) {
+        return;
+    }
+    std::pair<int,int> head(first->first, x1);
+    std::pair<int,int> tail(x2, (last - 1)->second);
+    first = row.erase(first, last);
+    if (tail.first < tail.second) {
+        first = row.insert(first, tail);
+    }
+    if (head.first < head.second) {
+        row.insert(first, head);
+    }
+}
+
+///Returns the first x in [x1,x2) which is not marked, or x2
+int
+firstUnmarked(const BitmapRow& row,int x1,int x2)
+{
+    BitmapRow::const_iterator it = findInterval(row, x1);
+    return it == row.end() ? x1 : std::min(it->second, x2);
+}
+
+///Returns 1 + the last x in [x1,x2) which is not marked, or x1
+int
+lastUnmarkedEnd(const BitmapRow& row,int x1,int x2)
+{
+    BitmapRow::const_iterator it = findInterval(row, x2 - 1);
+    return it == row.end() ? x2 : std::max(it->first, x1);
+}
+
+///Returns the first x in [x1,x2) which is marked, or x2
+int
+firstMarked(const BitmapRow& row,int x1,int x2)
+{
+    BitmapRow::const_iterator it = std::lower_bound(row.begin(), row.end(), x1, intervalEndsAtOrBefore);
+    if (it == row.end() || it->first >= x2) {
+        return x2;
+    }
+    return std::max(it->first, x1);
+}
+
+///Returns 1 + the last x in [x1,x2) which is marked, or x1
+int
+lastMarkedEnd(const BitmapRow& row,int x1,int x2)
+{
+    BitmapRow::const_iterator it = std::upper_bound(row.begin(), row.end(), x2 - 1, startsAfter);
+    if (it == row.begin()) {
+        return x1;
+    }
+    --it;
+    if (it->second <= x1) {
+        return x1;
+    }
+    return std::min(it->second, x2);
+}
+
+bool
+isRowFullyMarked(const BitmapRow& row,int x1,int x2)
+{
+    return firstUnmarked(row, x1, x2) >= x2;
+}
+
+bool
+isRowMarked(const BitmapRow& row,int x1,int x2)
+{
+    return firstMarked(row, x1, x2) < x2;
+}
+
+}
+
+void Natron::Bitmap::initialize(const RectI& rod)
+{
+    assert(_rows.empty());
+    _rod = rod;
+    _rows.resize(std::max(rod.height(), 0));
+}
+
+void Natron::Bitmap::clear()
+{
+    for (std::vector<Row>::iterator it = _rows.begin(); it != _rows.end(); ++it) {
+        it->clear();
+    }
+}
+
+const Natron::Bitmap::Row& Natron::Bitmap::rowAt(int y) const
+{
+    static const Row emptyRow;
+    if (y < _rod.bottom() || y >= _rod.top()) {
+        return emptyRow;
+    }
+    return _rows[y - _rod.bottom()];
+}
+
+size_t Natron::Bitmap::sizeEstimate() const
+{
+    ///assume a couple of intervals per row
+    return _rows.size() * (sizeof(Row) + 2 * sizeof(std::pair<int,int>));
+}
+
+bool Natron::Bitmap::isMarked(int x,int y) const
+{
+    const Row& row = rowAt(y);
+    return findInterval(row, x) != row.end();
+}
+
 RectI Natron::Bitmap::minimalNonMarkedBbox(const RectI& roi) const
 {
-    /*if we rendered everything we just append
-     a NULL box to indicate we rendered it all.*/
-//    if(!memchr(_map.get(),0,_rod.area())){
-//        ret.push_back(RectI());
-//        return ret;
-//    }
-    
     RectI bbox = roi;
     //find bottom
     for (int i = bbox.bottom(); i < bbox.top();++i) {
-        char* buf = &_map[(i-_rod.bottom())*_rod.width()];
-        if(!memchr(buf, 0, _rod.width())){
+        if (isRowFullyMarked(rowAt(i), bbox.left(), bbox.right())) {
             bbox.set_bottom(bbox.bottom()+1);
         } else {
             break;
@@ -87,50 +308,29 @@ RectI Natron::Bitmap::minimalNonMarkedBbox(const RectI& roi) const
 
     //find top (will do zero iteration if the bbox is already empty)
     for (int i = bbox.top()-1; i >= bbox.bottom();--i) {
-        char* buf = &_map[(i-_rod.bottom())*_rod.width()];
-        if (!memchr(buf, 0, _rod.width())) {
+        if (isRowFullyMarked(rowAt(i), bbox.left(), bbox.right())) {
             bbox.set_top(bbox.top()-1);
         } else {
             break;
         }
     }
 
-    // avoid making bbox.width() iterations for nothing
     if (bbox.isNull()) {
         return bbox;
     }
 
-    //find left
-    for (int j = bbox.left(); j < bbox.right(); ++j) {
-        bool shouldStop = false;
-        for (int i = bbox.bottom(); i < bbox.top(); ++i) {
-            if (!_map[(i-_rod.bottom())*_rod.width() + (j-_rod.left())]) {
-                shouldStop = true;
-                break;
-            }
-        }
-        if (!shouldStop) {
-            bbox.set_left(bbox.left()+1);
-        } else {
-            break;
-        }
-    }
-
-    //find right
-    for (int j = bbox.right()-1; j >= bbox.left(); --j) {
-        bool shouldStop = false;
-        for (int i = bbox.bottom(); i < bbox.top(); ++i) {
-            if (!_map[(i-_rod.bottom())*_rod.width() + (j-_rod.left())]) {
-                shouldStop = true;
-                break;
-            }
-        }
-        if (!shouldStop) {
-            bbox.set_right(bbox.right()-1);
-        } else {
-            break;
-        }
+    //find left and right: the leftmost and rightmost unmarked pixels of the remaining rows
+    int left = bbox.right();
+    int right = bbox.left();
+    for (int i = bbox.bottom(); i < bbox.top(); ++i) {
+        const Row& row = rowAt(i);
+        left = std::min(left, firstUnmarked(row, bbox.left(), bbox.right()));
+        right = std::max(right, lastUnmarkedEnd(row, bbox.left(), bbox.right()));
     }
+    ///the bottom row has an unmarked pixel, hence left < right
+    assert(left < right);
+    bbox.set_left(left);
+    bbox.set_right(right);
     return bbox;
 }
 
@@ -176,8 +376,7 @@ std::list<RectI> Natron::Bitmap::minimalNonMarkedRects(const RectI& roi) const
     RectI bboxA = bboxX;
     bboxA.set_top(bboxX.bottom());
     for (int i = bboxX.bottom(); i < bboxX.top();++i) {
-        char* buf = &_map[(i-_rod.bottom())*_rod.width()];
-        if (!memchr(buf, 1, _rod.width())) {
+        if (!isRowMarked(rowAt(i), bboxX.left(), bboxX.right())) {
             bboxX.set_bottom(bboxX.bottom()+1);
             bboxA.set_top(bboxX.bottom());
         } else {
@@ -193,8 +392,7 @@ std::list<RectI> Natron::Bitmap::minimalNonMarkedRects(const RectI& roi) const
     RectI bboxB = bboxX;
     bboxB.set_bottom(bboxX.top());
     for (int i = bboxX.top()-1; i >= bboxX.bottom();--i) {
-        char* buf = &_map[(i-_rod.bottom())*_rod.width()];
-        if (!memchr(buf, 1, _rod.width())) {
+        if (!isRowMarked(rowAt(i), bboxX.left(), bboxX.right())) {
             bboxX.set_top(bboxX.top()-1);
             bboxB.set_bottom(bboxX.top());
         } else {
@@ -207,44 +405,24 @@ std::list<RectI> Natron::Bitmap::minimalNonMarkedRects(const RectI& roi) const
 
     //find left
     RectI bboxC = bboxX;
-    bboxC.set_right(bboxX.left());
-    for (int j = bboxX.left(); j < bboxX.right(); ++j) {
-        bool shouldStop = false;
-        for (int i = bboxX.bottom(); i < bboxX.top(); ++i) {
-            if (_map[(i-_rod.bottom())*_rod.width()+(j-_rod.left())]) {
-                shouldStop = true;
-                break;
-            }
-        }
-        if (!shouldStop) {
-            bboxX.set_left(bboxX.left()+1);
-            bboxC.set_right(bboxX.left());
-        } else {
-            break;
-        }
+    int firstMarkedCol = bboxX.right();
+    for (int i = bboxX.bottom(); i < bboxX.top(); ++i) {
+        firstMarkedCol = std::min(firstMarkedCol, firstMarked(rowAt(i), bboxX.left(), bboxX.right()));
     }
+    bboxX.set_left(firstMarkedCol);
+    bboxC.set_right(bboxX.left());
     if (!bboxC.isNull()) { // empty boxes should not be pushed
         ret.push_back(bboxC);
     }
 
     //find right
     RectI bboxD = bboxX;
-    bboxD.set_left(bboxX.right());
-    for (int j = bboxX.right()-1; j >= bboxX.left(); --j) {
-        bool shouldStop = false;
-        for (int i = bboxX.bottom(); i < bboxX.top(); ++i) {
-            if (_map[(i-_rod.bottom())*_rod.width()+(j-_rod.left())]) {
-                shouldStop = true;
-                break;
-            }
-        }
-        if (!shouldStop) {
-            bboxX.set_right(bboxX.right()-1);
-            bboxD.set_left(bboxX.right());
-        } else {
-            break;
-        }
+    int lastMarkedCol = bboxX.left();
+    for (int i = bboxX.bottom(); i < bboxX.top(); ++i) {
+        lastMarkedCol = std::max(lastMarkedCol, lastMarkedEnd(rowAt(i), bboxX.left(), bboxX.right()));
     }
+    bboxX.set_right(lastMarkedCol);
+    bboxD.set_left(bboxX.right());
     if (!bboxD.isNull()) { // empty boxes should not be pushed
         ret.push_back(bboxD);
     }
@@ -276,10 +454,6 @@ std::list<RectI> Natron::Bitmap::minimalNonMarkedRects(const RectI& roi) const
     }
 
 #endif // NATRON_BITMAP_DISABLE_OPTIMIZATION
-    qDebug() << "render " << ret.size() << " rectangles";
-    for (std::list<RectI>::const_iterator it = ret.begin(); it != ret.end(); ++it) {
-        qDebug() << "rect: " << "x1= "<<  it->x1 << " , x2= "<< it->x2 << " , y1= " << it->y1 << " , y2= " << it->y2;
-    }
     return ret;
 }
 
@@ -294,27 +468,28 @@ const RectI& Image::getRoD() const
 }
 
 void Natron::Bitmap::markForRendered(const RectI& roi){
-    for (int i = roi.bottom(); i < roi.top();++i) {
-        char* buf = &_map[(i-_rod.bottom())*_rod.width() + (roi.left() - _rod.left())];
-        memset(buf, 1, roi.width());
+    RectI intersection;
+    if (!roi.intersect(_rod, &intersection)) {
+        return;
     }
-}
-
-const char* Natron::Bitmap::getBitmapAt(int x,int y) const
-{
-    if (x >= _rod.left() && x < _rod.right() && y >= _rod.bottom() && y < _rod.top()) {
-        return _map + (y - _rod.bottom()) * _rod.width() + (x - _rod.left());
-    } else {
-        return NULL;
+    for (int i = intersection.bottom(); i < intersection.top();++i) {
+        markRow(_rows[i - _rod.bottom()], intersection.left(), intersection.right());
     }
 }
 
-char* Natron::Bitmap::getBitmapAt(int x,int y)
+void Natron::Bitmap::copyFrom(const Bitmap& other,const RectI& roi)
 {
-    if (x >= _rod.left() && x < _rod.right() && y >= _rod.bottom() && y < _rod.top()) {
-        return _map + (y - _rod.bottom()) * _rod.width() + (x - _rod.left());
-    } else {
-        return NULL;
+    RectI intersection;
+    if (!roi.intersect(_rod, &intersection)) {
+        return;
+    }
+    for (int i = intersection.bottom(); i < intersection.top();++i) {
+        Row& row = _rows[i - _rod.bottom()];
+        unmarkRow(row, intersection.left(), intersection.right());
+        const Row& otherRow = other.rowAt(i);
+        for (Row::const_iterator it = otherRow.begin(); it != otherRow.end(); ++it) {
+            markRow(row, std::max(it->first, intersection.left()), std::min(it->second, intersection.right()));
+        }
     }
 }
 
@@ -324,14 +499,17 @@ CacheEntryHelper<unsigned char,ImageKey>(key,params,restore,path)
     const ImageParams* p = dynamic_cast<const ImageParams*>(params.get());
     _components = p->getComponents();
     _bitDepth = p->getBitDepth();
-    _bitmap.initialize(p->getPixelRoD());
     _rod = p->getRoD();
     _pixelRod = p->getPixelRoD();
     
+    ///the header of a tiled image has no pixels, hence nothing to mark as rendered
+    if (!p->getTileSize()) {
+        _bitmap.initialize(p->getPixelRoD());
 #ifdef NATRON_DEBUG
-    ///fill with red, to recognize unrendered pixels
-    fill(_pixelRod,1.,0.,0.,1.);
+        ///fill with red, to recognize unrendered pixels
+        fill(_pixelRod,1.,0.,0.,1.);
 #endif
+    }
 }
 
 /*This constructor can be used to allocate a local Image. The deallocation should
@@ -372,26 +550,69 @@ boost::shared_ptr<ImageParams> Image::makeParams(int cost,const RectI& rod,unsig
                                                  bool isRoDProjectFormat,ImageComponents components,
                                                  Natron::ImageBitDepth bitdepth,
                                                  int inputNbIdentity,int inputTimeIdentity,
-                                                 const std::map<int, std::vector<RangeD> >& framesNeeded) {
+                                                 const std::map<int, std::vector<RangeD> >& framesNeeded,
+                                                 int tileSize) {
     return boost::shared_ptr<ImageParams>(new ImageParams(cost,rod,rod.downscalePowerOfTwoSmallestEnclosing(mipMapLevel)
                                                           ,bitdepth,isRoDProjectFormat,components,
-                                                          inputNbIdentity,inputTimeIdentity,framesNeeded));
+                                                          inputNbIdentity,inputTimeIdentity,framesNeeded,tileSize));
+}
+
+boost::shared_ptr<ImageParams> Image::makeTileParams(int cost,const ImageParams& headerParams,unsigned int mipMapLevel,
+                                                     int tileX,int tileY) {
+    assert(headerParams.getTileSize() > 0);
+    RectI bounds = getTileBounds(headerParams.getPixelRoD(), headerParams.getTileSize(), tileX, tileY);
+    assert(!bounds.isNull());
+    ///the tile is a regular image: its own RoD is the tile itself
+    return boost::shared_ptr<ImageParams>(new ImageParams(cost,bounds.upscalePowerOfTwo(mipMapLevel),bounds,
+                                                          headerParams.getBitDepth(),false,headerParams.getComponents(),
+                                                          -1,0,std::map<int, std::vector<RangeD> >()));
+}
+
+boost::shared_ptr<ImageParams> Image::makeVariantParams(int cost,const ImageParams& sourceParams,
+                                                        Natron::ImageComponents components,
+                                                        Natron::ImageBitDepth bitdepth) {
+    assert(sourceParams.getTileSize() == 0 && sourceParams.getInputNbIdentity() == -1);
+    return boost::shared_ptr<ImageParams>(new ImageParams(cost,sourceParams.getRoD(),sourceParams.getPixelRoD(),
+                                                          bitdepth,sourceParams.isRodProjectFormat(),components,
+                                                          -1,0,sourceParams.getFramesNeeded()));
+}
+
+static int floorDiv(int a,int b) {
+    return a >= 0 ? a / b : -((-a + b - 1) / b);
+}
+
+RectI Image::getTileBounds(const RectI& pixelRoD,int tileSize,int tileX,int tileY) {
+    RectI tile(tileX * tileSize, tileY * tileSize, (tileX + 1) * tileSize, (tileY + 1) * tileSize);
+    RectI ret;
+    if (!tile.intersect(pixelRoD, &ret)) {
+        return RectI();
+    }
+    return ret;
+}
+
+void Image::getTilesRange(const RectI& rect,int tileSize,int* tileX1,int* tileY1,int* tileX2,int* tileY2) {
+    assert(tileSize > 0 && !rect.isNull());
+    *tileX1 = floorDiv(rect.x1, tileSize);
+    *tileY1 = floorDiv(rect.y1, tileSize);
+    *tileX2 = floorDiv(rect.x2 - 1, tileSize) + 1;
+    *tileY2 = floorDiv(rect.y2 - 1, tileSize) + 1;
+}
+
+bool Image::isTiled() const {
+    return dynamic_cast<const ImageParams*>(_params.get())->getTileSize() != 0;
 }
 
 template<typename PIX>
-void copyInternal(const Image& srcImg,Image& dstImg,const RectI& dstRoD,int elemCount,const RectI& renderWindow,bool copyBitmap)
+void copyInternal(const Image& srcImg,Image& dstImg,int elemCount,const RectI& renderWindow,bool copyBitmap)
 {
     for (int y = renderWindow.y1; y < renderWindow.y2; ++y) {
-        const PIX* src = (const PIX*)srcImg.pixelAt(dstRoD.x1, y);
+        const PIX* src = (const PIX*)srcImg.pixelAt(renderWindow.x1, y);
         PIX* dst = (PIX*)dstImg.pixelAt(renderWindow.x1, y);
         memcpy(dst, src, renderWindow.width() * sizeof(PIX) * elemCount);
-        
-        if (copyBitmap) {
-            const char* srcBm = srcImg.getBitmapAt(dstRoD.x1, y);
-            char* dstBm = dstImg.getBitmapAt(renderWindow.x1, y);
-            memcpy(dstBm, srcBm, renderWindow.width());
-        }
-        
+    }
+    
+    if (copyBitmap) {
+        dstImg.copyBitmapFrom(srcImg, renderWindow);
     }
 
 }
@@ -424,13 +645,13 @@ void Natron::Image::copy(const Natron::Image& other,const RectI& roi,bool copyBi
     int components = getElementsCountForComponents(getComponents());
     switch (depth) {
         case IMAGE_BYTE:
-            copyInternal<unsigned char>(other, *this, dstRoD, components, intersection, copyBitmap);
+            copyInternal<unsigned char>(other, *this, components, intersection, copyBitmap);
             break;
         case IMAGE_SHORT:
-            copyInternal<unsigned short>(other, *this, dstRoD, components, intersection, copyBitmap);
+            copyInternal<unsigned short>(other, *this, components, intersection, copyBitmap);
             break;
         case IMAGE_FLOAT:
-            copyInternal<float>(other, *this, dstRoD, components, intersection, copyBitmap);
+            copyInternal<float>(other, *this, components, intersection, copyBitmap);
             break;
         default:
             break;
@@ -511,6 +732,24 @@ unsigned int Image::getComponentsCount() const
     return getElementsCountForComponents(getComponents());
 }
 
+int Image::getCompressionElementSize() const
+{
+    switch (getBitDepth()) {
+        case Natron::IMAGE_BYTE:
+            return (int)getComponentsCount();
+        case Natron::IMAGE_SHORT:
+            return sizeof(unsigned short);
+        case Natron::IMAGE_FLOAT:
+        default:
+            return sizeof(float);
+    }
+}
+
+void Image::onDataImported()
+{
+    markForRendered(_pixelRod);
+}
+
 bool Image::hasEnoughDataToConvert(Natron::ImageComponents from,Natron::ImageComponents to)
 {
     return getElementsCountForComponents(from) >= getElementsCountForComponents(to);
@@ -567,182 +806,123 @@ unsigned int Image::getRowElements() const
     return getComponentsCount() * _pixelRod.width();
 }
 
-template <typename PIX,int maxValue>
-void halveRoIInternal(const Image& srcImg,const RectI& srcRoD,Image& dstImg,const RectI& dstRoD,
-                      const RectI& srcRoI,const RectI& dstRoI,int components)
-{
-    int srcRoIWidth = srcRoI.width();
-    //int srcRoIHeight = srcRoI.height();
-    int dstRoIWidth = dstRoI.width();
-    int dstRoIHeight = dstRoI.height();
-    const PIX* src = (const PIX*)srcImg.pixelAt(srcRoI.x1, srcRoI.y1);
-    PIX* dst = (PIX*)dstImg.pixelAt(dstRoI.x1, dstRoI.y1);
-    
-    int srcRowSize = srcRoD.width() * components;
-    int dstRowSize = dstRoD.width() * components;
-    
-    // Loop with sliding pointers:
-    // at each loop iteration, add the step to the pointer, minus what was done during previous iteration.
-    // This is the *good* way to code it, let the optimizer do the rest!
-    // Please don't change this, and don't remove the comments.
-    for (int y = 0; y < dstRoIHeight;
-         ++y,
-         src += (srcRowSize+srcRowSize) - srcRoIWidth*components, // two rows minus what was done on previous iteration
-         dst += (dstRowSize) - dstRoIWidth*components) { // one row minus what was done on previous iteration
-        for (int x = 0; x < dstRoIWidth;
-             ++x,
-             src += (components+components) - components, // two pixels minus what was done on previous iteration
-             dst += (components) - components) { // one pixel minus what was done on previous iteration
-            assert(dstRoD.x1 <= dstRoI.x1+x && dstRoI.x1+x < dstRoD.x2);
-            assert(dstRoD.y1 <= dstRoI.y1+y && dstRoI.y1+y < dstRoD.y2);
-            assert(dst == (PIX*)dstImg.pixelAt(dstRoI.x1+x, dstRoI.y1+y));
-            assert(srcRoD.x1 <= srcRoI.x1+2*x && srcRoI.x1+2*x < srcRoD.x2);
-            assert(srcRoD.y1 <= srcRoI.y1+2*y && srcRoI.y1+2*y < srcRoD.y2);
-            assert(src == (const PIX*)srcImg.pixelAt(srcRoI.x1+2*x, srcRoI.y1+2*y));
-            for (int k = 0; k < components; ++k, ++dst, ++src) {
-                *dst = PIX((float)(*src +
-                        *(src + components) +
-                        *(src + srcRowSize) +
-                        *(src + srcRowSize  + components)) / 4.);
-            }
-        }
-    }
-
-}
+static const Natron::Color::Lut* lutFromColorspace(Natron::ViewerColorSpace cs);
 
-void Image::halveRoI(const RectI& roi,Natron::Image* output) const
-{
-    ///handle case where there is only 1 column/row
-    if (roi.width() == 1 || roi.height() == 1) {
-        assert( !(roi.width() == 1 && roi.height() == 1) ); /// can't be 1x1
-        halve1DImage(roi,output);
-        return;
-    }
+namespace {
 
-    ///The source rectangle, intersected to this image region of definition in pixels
-    const RectI &srcRoD = getPixelRoD();
-    const RectI &dstRoD = output->getPixelRoD();
-
-   // the srcRoD of the output should be enclosed in half the roi.
-    // It does not have to be exactly half of the input.
-//    assert(dstRoD.x1*2 >= roi.x1 &&
-//           dstRoD.x2*2 <= roi.x2 &&
-//           dstRoD.y1*2 >= roi.y1 &&
-//           dstRoD.y2*2 <= roi.y2 &&
-//           dstRoD.width()*2 <= roi.width() &&
-//           dstRoD.height()*2 <= roi.height());
-    assert(getComponents() == output->getComponents());
-    
-    int components = getElementsCountForComponents(getComponents());
+///Converts the color elements of a pixel to linear before averaging them and back to the color-space after.
+template <typename PIX>
+struct MipMapElement;
 
-    RectI srcRoI = roi;
-    srcRoI.intersect(srcRoD, &srcRoI); // intersect srcRoI with the region of definition
-    srcRoI = srcRoI.roundPowerOfTwoLargestEnclosed(1);
-    
-    RectI dstRoI = srcRoI.downscalePowerOfTwo(1);
-    // a few checks...
-    // srcRoI must be inside srcRoD
-    assert(srcRoI.x1 >= srcRoD.x1);
-    assert(srcRoI.x2 <= srcRoD.x2);
-    assert(srcRoI.y1 >= srcRoD.y1);
-    assert(srcRoI.y2 <= srcRoD.y2);
-    // srcRoI must be inside dstRoD*2
-    assert(srcRoI.x1 >= dstRoD.x1*2);
-    assert(srcRoI.x2 <= dstRoD.x2*2);
-    assert(srcRoI.y1 >= dstRoD.y1*2);
-    assert(srcRoI.y2 <= dstRoD.y2*2);
-    // srcRoI must be equal to dstRoI*2
-    assert(srcRoI.x1 == dstRoI.x1*2);
-    assert(srcRoI.x2 == dstRoI.x2*2);
-    assert(srcRoI.y1 == dstRoI.y1*2);
-    assert(srcRoI.y2 == dstRoI.y2*2);
-    assert(srcRoI.width() == dstRoI.width()*2);
-    assert(srcRoI.height() == dstRoI.height()*2);
+template <>
+struct MipMapElement<unsigned char>
+{
+    static float toLinear(const Color::Lut* lut,unsigned char v) { return lut->fromColorSpaceUint8ToLinearFloatFast(v); }
+    static unsigned char fromLinear(const Color::Lut* lut,float v) { return lut->toColorSpaceUint8FromLinearFloatFast(v); }
+    static unsigned char fromAverage(float v) { return (unsigned char)(v + 0.5f); }
+};
 
-    switch (getBitDepth()) {
-        case IMAGE_BYTE:
-            halveRoIInternal<unsigned char,255>(*this,srcRoD, *output, dstRoD, srcRoI, dstRoI, components);
-            break;
-        case IMAGE_SHORT:
-            halveRoIInternal<unsigned short,65535>(*this,srcRoD, *output, dstRoD, srcRoI, dstRoI, components);
-            break;
-        case IMAGE_FLOAT:
-            halveRoIInternal<float,1>(*this,srcRoD, *output, dstRoD, srcRoI, dstRoI, components);
-            break;
-        default:
-            break;
-    }
-}
+template <>
+struct MipMapElement<unsigned short>
+{
+    static float toLinear(const Color::Lut* lut,unsigned short v) { return lut->fromColorSpaceUint16ToLinearFloatFast(v); }
+    static unsigned short fromLinear(const Color::Lut* lut,float v) { return lut->toColorSpaceUint16FromLinearFloatFast(v); }
+    static unsigned short fromAverage(float v) { return (unsigned short)(v + 0.5f); }
+};
 
-template <typename PIX,int maxValue>
-void halve1DImageInternal(const Image& srcImg,Image& dstImg,const RectI& roi,int width,int height,int components)
+template <>
+struct MipMapElement<float>
 {
-    int halfWidth = width / 2;
-    int halfHeight = height / 2;
-    if (height == 1) { //1 row
-        assert(width != 1);	/// widthxheight can't be 1x1
-        
-        const PIX* src = (const PIX*)srcImg.pixelAt(roi.x1, roi.y1);
-        PIX* dst = (PIX*)dstImg.pixelAt(dstImg.getRoD().x1, dstImg.getRoD().y1);
-        assert(src && dst);
-        for (int x = 0; x < halfWidth; ++x) {
+    static float toLinear(const Color::Lut* lut,float v) { return lut->fromColorSpaceFloatToLinearFloat(v); }
+    static float fromLinear(const Color::Lut* lut,float v) { return lut->toColorSpaceFloatFromLinearFloat(v); }
+    static float fromAverage(float v) { return v; }
+};
+
+///Each pixel of dstRoI is the average of the 2x2 block of srcRoI starting at twice its coordinates, clipped to srcRoI:
+///the pixels of the edges of odd bounds average the 1 or 2 pixels they cover.
+///With a color-space, the first colorElements elements of the pixels are averaged in linear, alpha is never converted.
+template <typename PIX,bool hasLut>
+void halveRoIInternal(const Image& srcImg,const RectI& srcRoI,Image& dstImg,const RectI& dstRoI,int components,
+                      const Color::Lut* lut)
+{
+    const int colorElements = components > 1 ? 3 : 0;
+    const int srcRowElements = srcImg.getPixelRoD().width() * components;
+    for (int y = dstRoI.y1; y < dstRoI.y2; ++y) {
+        const int sy1 = std::max(2 * y, srcRoI.y1);
+        const int rowsCount = std::min(2 * y + 2, srcRoI.y2) - sy1;
+        assert(rowsCount == 1 || rowsCount == 2);
+        PIX* dst = (PIX*)dstImg.pixelAt(dstRoI.x1, y);
+        assert(dst);
+        for (int x = dstRoI.x1; x < dstRoI.x2; ++x, dst += components) {
+            const int sx1 = std::max(2 * x, srcRoI.x1);
+            const int colsCount = std::min(2 * x + 2, srcRoI.x2) - sx1;
+            assert(colsCount == 1 || colsCount == 2);
+            const PIX* src = (const PIX*)srcImg.pixelAt(sx1, sy1);
+            assert(src);
+            const float norm = 1.f / (rowsCount * colsCount);
             for (int k = 0; k < components; ++k) {
-                *dst++ = PIX((float)(*src + *(src + components)) / 2.);
-                ++src;
-            }
-            src += components;
-        }
-        
-    } else if (width == 1) {
-        
-        int rowSize = srcImg.getPixelRoD().width() * components;
-        
-        const PIX* src = (const PIX*)srcImg.pixelAt(roi.x1, roi.y1);
-        PIX* dst = (PIX*)dstImg.pixelAt(dstImg.getRoD().x1, dstImg.getRoD().y1);
-        assert(src && dst);
-        for (int y = 0; y < halfHeight; ++y) {
-            for (int k = 0; k < components;++k) {
-                *dst++ = PIX((float)(*src + (*src + rowSize)) / 2.);
-                ++src;
+                const bool linear = hasLut && k < colorElements;
+                float sum = 0.f;
+                for (int j = 0; j < rowsCount; ++j) {
+                    const PIX* srcPix = src + j * srcRowElements + k;
+                    for (int i = 0; i < colsCount; ++i, srcPix += components) {
+                        sum += linear ? MipMapElement<PIX>::toLinear(lut, *srcPix) : (float)*srcPix;
+                    }
+                }
+                dst[k] = linear ? MipMapElement<PIX>::fromLinear(lut, sum * norm) : MipMapElement<PIX>::fromAverage(sum * norm);
             }
-            src += rowSize;
         }
     }
+}
+
+template <typename PIX>
+void halveRoIForDepth(const Image& srcImg,const RectI& srcRoI,Image& dstImg,const RectI& dstRoI,int components,
+                      const Color::Lut* lut)
+{
+    if (lut) {
+        halveRoIInternal<PIX,true>(srcImg, srcRoI, dstImg, dstRoI, components, lut);
+    } else {
+        halveRoIInternal<PIX,false>(srcImg, srcRoI, dstImg, dstRoI, components, lut);
+    }
+}
 
 }
 
-void Image::halve1DImage(const RectI& roi,Natron::Image* output) const
+void Image::halveRoI(const RectI& roi,Natron::Image* output,Natron::ViewerColorSpace colorSpace) const
 {
-    int width = roi.width();
-    int height = roi.height();
+    assert(getComponents() == output->getComponents());
+    assert(getBitDepth() == output->getBitDepth());
     
+    ///The source rectangle, intersected to this image region of definition in pixels
+    RectI srcRoI;
+    if (!roi.intersect(getPixelRoD(), &srcRoI)) {
+        return;
+    }
     
+    ///Rounded outward, like the box filter of the viewer: the edges of odd bounds are not dropped
+    RectI dstRoI;
+    if (!srcRoI.downscalePowerOfTwoSmallestEnclosing(1).intersect(output->getPixelRoD(), &dstRoI)) {
+        return;
+    }
     
-    assert(width == 1 || height == 1); /// must be 1D
-    assert(output->getComponents() == getComponents());
-    assert(output->getPixelRoD().x1*2 == roi.x1 &&
-           output->getPixelRoD().x2*2 == roi.x2 &&
-           output->getPixelRoD().y1*2 == roi.y1 &&
-           output->getPixelRoD().y2*2 == roi.y2);
-
     int components = getElementsCountForComponents(getComponents());
+    const Color::Lut* lut = lutFromColorspace(colorSpace);
     switch (getBitDepth()) {
         case IMAGE_BYTE:
-            halve1DImageInternal<unsigned char,255>(*this, *output, roi, width, height, components);
+            halveRoIForDepth<unsigned char>(*this, srcRoI, *output, dstRoI, components, lut);
             break;
         case IMAGE_SHORT:
-            halve1DImageInternal<unsigned short,65535>(*this, *output, roi, width, height, components);
+            halveRoIForDepth<unsigned short>(*this, srcRoI, *output, dstRoI, components, lut);
             break;
         case IMAGE_FLOAT:
-            halve1DImageInternal<float , 1>(*this, *output, roi, width, height, components);
+            halveRoIForDepth<float>(*this, srcRoI, *output, dstRoI, components, lut);
             break;
         default:
             break;
     }
-    
 }
 
-void Image::downscale_mipmap(const RectI& roi,Natron::Image* output,unsigned int level) const
+void Image::downscale_mipmap(const RectI& roi,Natron::Image* output,unsigned int level,Natron::ViewerColorSpace colorSpace) const
 {
     ///You should not call this function with a level equal to 0.
     assert(level > 0);
@@ -754,7 +934,7 @@ void Image::downscale_mipmap(const RectI& roi,Natron::Image* output,unsigned int
     ///resulting mipmap of that roi should fit into output.
     Natron::Image* tmpImg = new Natron::Image(getComponents(),dstRoI,0,getBitDepth());
     
-    buildMipMapLevel(tmpImg, roi, level);
+    buildMipMapLevel(tmpImg, roi, level, colorSpace);
   
     ///Now copy the result of tmpImg into the output image
     output->copy(*tmpImg, dstRoI,false);
@@ -1059,7 +1239,7 @@ void Image::scale_box_generic(const RectI& roi,Natron::Image* output) const
     
 }
 
-void Image::buildMipMapLevel(Natron::Image* output,const RectI& roi,unsigned int level) const
+void Image::buildMipMapLevel(Natron::Image* output,const RectI& roi,unsigned int level,Natron::ViewerColorSpace colorSpace) const
 {
     ///The output image data window
     const RectI& dstRoD = output->getPixelRoD();
@@ -1096,7 +1276,7 @@ void Image::buildMipMapLevel(Natron::Image* output,const RectI& roi,unsigned int
         ///Half the source image into dstImg.
         ///We pass the closestPo2 roi which might not be the entire size of the source image
         ///If the source image'sroi was originally a po2.
-        srcImg->halveRoI(previousRoI, dstImg);
+        srcImg->halveRoI(previousRoI, dstImg, colorSpace);
         
         ///Clean-up, we should use shared_ptrs for safety
         if (mustFreeSrc) {
@@ -1141,9 +1321,27 @@ Image::getLevelFromScale(double s)
 
 void Image::clearBitmap()
 {
+    QWriteLocker locker(&_lock);
     _bitmap.clear();
 }
 
+void Image::copyBitmapFrom(const Natron::Image& other,const RectI& roi)
+{
+    if (&other == this) {
+        return;
+    }
+    ///always lock the two images in the same order so that 2 concurrent copies cannot deadlock
+    if (&other < this) {
+        QReadLocker otherLocker(&other._lock);
+        QWriteLocker locker(&_lock);
+        _bitmap.copyFrom(other._bitmap, roi);
+    } else {
+        QWriteLocker locker(&_lock);
+        QReadLocker otherLocker(&other._lock);
+        _bitmap.copyFrom(other._bitmap, roi);
+    }
+}
+
 namespace Natron {
 ///explicit template instantiations
 
@@ -1230,273 +1428,500 @@ lutFromColorspace(Natron::ViewerColorSpace cs)
     return lut;
 }
 
-///Fast version when components are the same
-template <typename SRCPIX,typename DSTPIX,int srcMaxValue,int dstMaxValue>
-void convertToFormatInternal_sameComps(const RectI& renderWindow,const Image& srcImg,Image& dstImg,
-                                       Natron::ViewerColorSpace srcColorSpace,
-                                       Natron::ViewerColorSpace dstColorSpace,
-                                       bool invert,bool copyBitmap)
+namespace {
+
+template <typename PIX>
+struct PixelMaxValue;
+
+template <>
+struct PixelMaxValue<unsigned char> { static unsigned char get() { return 255; } };
+
+template <>
+struct PixelMaxValue<unsigned short> { static unsigned short get() { return 65535; } };
+
+template <>
+struct PixelMaxValue<float> { static float get() { return 1.f; } };
+
+///Converts count elements to another bit depth, same as convertPixelDepth
+template <typename SRCPIX,typename DSTPIX>
+void
+convertElements(const SRCPIX* src,
+                int count,
+                DSTPIX* dst)
 {
-    const RectI& r = srcImg.getPixelRoD();
+    for (int i = 0; i < count; ++i) {
+        dst[i] = convertPixelDepth<SRCPIX, DSTPIX>(src[i]);
+    }
+}
 
-    RectI intersection;
-    if (!renderWindow.intersect(r, &intersection)) {
-        return;
+template <>
+void
+convertElements(const unsigned char* src,
+                int count,
+                unsigned char* dst)
+{
+    std::memcpy(dst, src, count * sizeof(unsigned char));
+}
+
+template <>
+void
+convertElements(const unsigned short* src,
+                int count,
+                unsigned short* dst)
+{
+    std::memcpy(dst, src, count * sizeof(unsigned short));
+}
+
+template <>
+void
+convertElements(const float* src,
+                int count,
+                float* dst)
+{
+    std::memcpy(dst, src, count * sizeof(float));
+}
+
+#ifdef NATRON_IMAGE_SSE2
+///Same as Color::floatToInt<numvals> on 4 floats. _mm_max_ps returns its second operand if the first is NaN: NaNs become 0.
+template <int numvals>
+__m128i
+floatToInt_SSE2(__m128 v)
+{
+    v = _mm_mul_ps(_mm_min_ps(_mm_max_ps(v, _mm_setzero_ps()), _mm_set1_ps(1.f)), _mm_set1_ps((float)(numvals - 1)));
+    ///floatToInt adds 0.5 in double precision, which float can't represent exactly:
+    ///round up when the fractional part is >= 0.5 instead, the comparison mask is -1
+    __m128i t = _mm_cvttps_epi32(v);
+    __m128 frac = _mm_sub_ps(v, _mm_cvtepi32_ps(t));
+    return _mm_sub_epi32(t, _mm_castps_si128(_mm_cmpge_ps(frac, _mm_set1_ps(0.5f))));
+}
+
+///SSE2 has no unsigned saturating pack from 32 to 16 bits: pack signed values shifted by 32768 and shift them back
+inline __m128i
+packUint16_SSE2(__m128i lo,
+                __m128i hi)
+{
+    const __m128i bias32 = _mm_set1_epi32(32768);
+    const __m128i bias16 = _mm_set1_epi16((short)0x8000);
+    return _mm_xor_si128(_mm_packs_epi32(_mm_sub_epi32(lo, bias32), _mm_sub_epi32(hi, bias32)), bias16);
+}
+#endif
+
+///Same as Color::floatToInt<numvals> on count elements, numvals must be at most 65536
+template <int numvals>
+void
+floatToIntElements(const float* src,
+                   int count,
+                   unsigned short* dst)
+{
+    int i = 0;
+#ifdef NATRON_IMAGE_SSE2
+    for (; i + 8 <= count; i += 8) {
+        __m128i lo = floatToInt_SSE2<numvals>(_mm_loadu_ps(src + i));
+        __m128i hi = floatToInt_SSE2<numvals>(_mm_loadu_ps(src + i + 4));
+        _mm_storeu_si128((__m128i*)(dst + i), packUint16_SSE2(lo, hi));
     }
-    
-    Natron::ImageBitDepth dstDepth = dstImg.getBitDepth();
-    Natron::ImageBitDepth srcDepth = srcImg.getBitDepth();
-    
-    int nComp = (int)srcImg.getComponentsCount();
+#endif
+    for (; i < count; ++i) {
+        dst[i] = (unsigned short)Color::floatToInt<numvals>(src[i]);
+    }
+}
+
+template <>
+void
+convertElements(const float* src,
+                int count,
+                unsigned short* dst)
+{
+    floatToIntElements<65536>(src, count, dst);
+}
 
-    const Natron::Color::Lut* srcLut = lutFromColorspace(srcColorSpace);
-    const Natron::Color::Lut* dstLut = lutFromColorspace(dstColorSpace);
+template <>
+void
+convertElements(const float* src,
+                int count,
+                unsigned char* dst)
+{
+    int i = 0;
+#ifdef NATRON_IMAGE_SSE2
+    for (; i + 16 <= count; i += 16) {
+        __m128i p0 = floatToInt_SSE2<256>(_mm_loadu_ps(src + i));
+        __m128i p1 = floatToInt_SSE2<256>(_mm_loadu_ps(src + i + 4));
+        __m128i p2 = floatToInt_SSE2<256>(_mm_loadu_ps(src + i + 8));
+        __m128i p3 = floatToInt_SSE2<256>(_mm_loadu_ps(src + i + 12));
+        __m128i packed = _mm_packus_epi16(_mm_packs_epi32(p0, p1), _mm_packs_epi32(p2, p3));
+        _mm_storeu_si128((__m128i*)(dst + i), packed);
+    }
+#endif
+    for (; i < count; ++i) {
+        dst[i] = (unsigned char)Color::floatToInt<256>(src[i]);
+    }
+}
+
+template <typename PIX>
+void
+invertElements(int count,
+               PIX* dst)
+{
+    const PIX maxValue = PixelMaxValue<PIX>::get();
+    for (int i = 0; i < count; ++i) {
+        dst[i] = maxValue - dst[i];
+    }
+}
+
+///Converts the channels of count pixels which are not converted from a color-space to another: all of them,
+///or only the alpha channel when colorConverted is true (the 3 color channels are then written by a LinearToRow kernel).
+template <typename SRCPIX,typename DSTPIX,int srcNComps,int dstNComps>
+void
+mapChannelsRow(const void* srcRow,
+               int count,
+               int channelForAlpha,
+               bool colorConverted,
+               bool invert,
+               void* dstRow)
+{
+    const SRCPIX* src = (const SRCPIX*)srcRow;
+    DSTPIX* dst = (DSTPIX*)dstRow;
+    const DSTPIX maxValue = PixelMaxValue<DSTPIX>::get();
     
-    ///no colorspace conversion applied when luts are the same
-    if (srcLut == dstLut) {
-        srcLut = dstLut = 0;
+    if (srcNComps == dstNComps && !colorConverted) {
+        convertElements<SRCPIX, DSTPIX>(src, count * srcNComps, dst);
+        if (invert) {
+            invertElements<DSTPIX>(count * dstNComps, dst);
+        }
+        return;
     }
     
-    for (int y = 0; y < intersection.height();++y) {
-        
-        int start = rand() % intersection.width();
-        
-        const SRCPIX* srcPixels = (const SRCPIX*)srcImg.pixelAt(intersection.x1 + start, intersection.y1 + y);
-        DSTPIX* dstPixels = (DSTPIX*)dstImg.pixelAt(intersection.x1 + start, intersection.y1 + y);
-        const SRCPIX* srcStart = srcPixels;
-        DSTPIX* dstStart = dstPixels;
-        
-        for (int backward = 0;backward < 2; ++backward) {
-            int x = backward ? start - 1 : start;
-            int end = backward ? -1 : intersection.width();
-            
-            unsigned error[3] = { 0x80,0x80,0x80 };
-            
-            while (x != end && x >= 0 && x < intersection.width()) {
-                
-                for (int k = 0; k < nComp; ++k) {
-                    
-                    if (k <= 2 && (srcLut || dstLut)) {
-                        float pixFloat;
-                        
-                        if (srcLut) {
-                            if (srcDepth == IMAGE_BYTE) {
-                                pixFloat = srcLut->fromColorSpaceUint8ToLinearFloatFast(srcPixels[k]);
-                            } else if (srcDepth == IMAGE_SHORT) {
-                                pixFloat = srcLut->fromColorSpaceUint16ToLinearFloatFast(srcPixels[k]);
-                            } else {
-                                pixFloat = srcLut->fromColorSpaceFloatToLinearFloat(srcPixels[k]);
-                            }
-                        } else {
-                            pixFloat = convertPixelDepth<SRCPIX, float>(srcPixels[k]);
-                        }
-                        
-
-                        DSTPIX pix;
-                        if (dstDepth == IMAGE_BYTE) {
-                            ///small increase in perf we use Luts. This should be anyway the most used case.
-                            error[k] = (error[k]&0xff) + (dstLut ? dstLut->toColorSpaceUint8xxFromLinearFloatFast(pixFloat) :
-                                                          Color::floatToInt<0xff01>(pixFloat));
-                            pix = error[k] >> 8;
-                        } else if (dstDepth == IMAGE_SHORT) {
-                            pix = dstLut ? dstLut->toColorSpaceUint16FromLinearFloatFast(pixFloat) :
-                            convertPixelDepth<float, DSTPIX>(pixFloat);
-                        } else {
-                            
-                            if (dstLut) {
-                                pixFloat = dstLut->toColorSpaceFloatFromLinearFloat(pixFloat);
-                            }
-                            pix = convertPixelDepth<float, DSTPIX>(pixFloat);
-                        }
-                        dstPixels[k] = invert ? dstMaxValue - pix : pix;
-                        
-                    } else {
-                        DSTPIX pix = convertPixelDepth<SRCPIX, DSTPIX>(srcPixels[k]);
-                        dstPixels[k] = invert ? dstMaxValue - pix : pix;
-                    }
-                }
-                
-                if (backward) {
-                    --x;
-                    srcPixels -= nComp;
-                    dstPixels -= nComp;
-                } else {
-                    ++x;
-                    srcPixels += nComp;
-                    dstPixels += nComp;
+    for (int x = 0; x < count; ++x, src += srcNComps, dst += dstNComps) {
+        if (dstNComps == 1) {
+            assert(srcNComps == 1 || (channelForAlpha >= 0 && channelForAlpha < srcNComps));
+            DSTPIX pix = convertPixelDepth<SRCPIX, DSTPIX>(src[srcNComps == 1 ? 0 : channelForAlpha]);
+            dst[0] = invert ? maxValue - pix : pix;
+        } else if (srcNComps == 1) {
+            DSTPIX pix = convertPixelDepth<SRCPIX, DSTPIX>(src[0]);
+            if (dstNComps == 3) {
+                dst[0] = dst[1] = dst[2] = invert ? maxValue - pix : pix;
+            } else {
+                dst[0] = dst[1] = dst[2] = invert ? maxValue : 0;
+                dst[dstNComps - 1] = invert ? maxValue : pix;
+            }
+        } else {
+            if (!colorConverted) {
+                for (int k = 0; k < 3; ++k) {
+                    DSTPIX pix = convertPixelDepth<SRCPIX, DSTPIX>(src[k]);
+                    dst[k] = invert ? maxValue - pix : pix;
                 }
             }
-            srcPixels = srcStart - nComp;
-            dstPixels = dstStart - nComp;
-        }
-
-        if (copyBitmap) {
-            const char* srcBitmap = srcImg.getBitmapAt(intersection.x1, intersection.y1 + y);
-            char* dstBitmap = dstImg.getBitmapAt(intersection.x1, intersection.y1 + y);
-            memcpy(dstBitmap, srcBitmap, intersection.width());
+            if (dstNComps == 4) {
+                DSTPIX alpha = srcNComps == 4 ? convertPixelDepth<SRCPIX, DSTPIX>(src[srcNComps - 1]) : maxValue;
+                dst[dstNComps - 1] = invert ? maxValue - alpha : alpha;
+            }
         }
     }
 }
 
-template <typename SRCPIX,typename DSTPIX,int srcMaxValue,int dstMaxValue>
-void convertToFormatInternal(const RectI& renderWindow,const Image& srcImg,Image& dstImg,
-                             Natron::ViewerColorSpace srcColorSpace,
-                             Natron::ViewerColorSpace dstColorSpace,
-                             int channelForAlpha,bool invert,bool copyBitmap)
+template <typename PIX,bool hasLut>
+struct ElementToLinear;
+
+template <>
+struct ElementToLinear<unsigned char,false>
 {
-    
-    const RectI& r = srcImg.getPixelRoD();
-    
-    RectI intersection;
-    if (!renderWindow.intersect(r, &intersection)) {
-        return;
+    static float get(const Color::Lut* /*lut*/,unsigned char v) { return convertPixelDepth<unsigned char, float>(v); }
+};
+
+template <>
+struct ElementToLinear<unsigned char,true>
+{
+    static float get(const Color::Lut* lut,unsigned char v) { return lut->fromColorSpaceUint8ToLinearFloatFast(v); }
+};
+
+template <>
+struct ElementToLinear<unsigned short,false>
+{
+    static float get(const Color::Lut* /*lut*/,unsigned short v) { return convertPixelDepth<unsigned short, float>(v); }
+};
+
+template <>
+struct ElementToLinear<unsigned short,true>
+{
+    static float get(const Color::Lut* lut,unsigned short v) { return lut->fromColorSpaceUint16ToLinearFloatFast(v); }
+};
+
+template <>
+struct ElementToLinear<float,false>
+{
+    static float get(const Color::Lut* /*lut*/,float v) { return v; }
+};
+
+template <>
+struct ElementToLinear<float,true>
+{
+    static float get(const Color::Lut* lut,float v) { return lut->fromColorSpaceFloatToLinearFloat(v); }
+};
+
+///Converts the 3 color channels of count pixels of nComps elements to linear float, in a buffer of 4 floats per pixel
+///(the 4th is not written).
+template <typename SRCPIX,bool hasSrcLut>
+void
+rowToLinear(const void* srcRow,
+            int nComps,
+            int count,
+            const Color::Lut* lut,
+            float* linear)
+{
+    const SRCPIX* src = (const SRCPIX*)srcRow;
+    for (int x = 0; x < count; ++x, src += nComps, linear += 4) {
+        linear[0] = ElementToLinear<SRCPIX, hasSrcLut>::get(lut, src[0]);
+        linear[1] = ElementToLinear<SRCPIX, hasSrcLut>::get(lut, src[1]);
+        linear[2] = ElementToLinear<SRCPIX, hasSrcLut>::get(lut, src[2]);
     }
-    
-    Natron::ImageComponents dstComp = dstImg.getComponents();
-    Natron::ImageBitDepth dstDepth = dstImg.getBitDepth();
-    Natron::ImageBitDepth srcDepth = srcImg.getBitDepth();
-    
-    bool sameBitDepth = srcImg.getBitDepth() == dstImg.getBitDepth();
+}
 
-    int dstNComp = getElementsCountForComponents(dstComp);
-    int srcNComp = getElementsCountForComponents(srcImg.getComponents());
+///Writes the 3 color channels of count pixels of nComps elements from the linear buffer filled by rowToLinear.
+///indices is a buffer of count * 4 elements. Converting to 8 bits uses error diffusion starting from a
+///pseudo-random column of the scan-line y.
+template <typename DSTPIX,bool hasDstLut>
+struct LinearToRow;
 
-    ///special case comp == alpha && channelForAlpha = -1 clear out the mask
-    if (dstComp == Natron::ImageComponentAlpha && channelForAlpha == -1) {
-        DSTPIX* dstPixels = (DSTPIX*)dstImg.pixelAt(intersection.x1, intersection.y1);
+template <bool hasDstLut>
+struct LinearToRow<unsigned char,hasDstLut>
+{
+    static void store(const float* linear,int count,int y,const Color::Lut* lut,bool invert,int nComps,
+                      unsigned short* indices,void* dstRow)
+    {
+        unsigned char* dst = (unsigned char*)dstRow;
+        if (hasDstLut) {
+            lut->to_uint8xx_rgba_row(indices, linear, count);
+        } else {
+            floatToIntElements<0xff01>(linear, count * 4, indices);
+        }
         
-        for (int y = 0; y < intersection.height();
-             ++y, dstPixels += (r.width() * dstNComp)) {
-            std::fill(dstPixels, dstPixels + intersection.width() * dstNComp, 0.);
-            if (copyBitmap) {
-                const char* srcBitmap = srcImg.getBitmapAt(intersection.x1, intersection.y1 + y);
-                char* dstBitmap = dstImg.getBitmapAt(intersection.x1, intersection.y1 + y);
-                memcpy(dstBitmap, srcBitmap, intersection.width());
+        int start = Color::getDitherStart(y, count);
+        /* go fowards from starting point to end of line, then backwards from the starting point to the start of the line: */
+        for (int backward = 0; backward < 2; ++backward) {
+            unsigned error[3] = { 0x80, 0x80, 0x80 };
+            int end = backward ? -1 : count;
+            int step = backward ? -1 : 1;
+            for (int x = backward ? start - 1 : start; x != end; x += step) {
+                const unsigned short* index = indices + x * 4;
+                unsigned char* pix = dst + x * nComps;
+                for (int k = 0; k < 3; ++k) {
+                    error[k] = (error[k] & 0xff) + index[k];
+                    unsigned char v = (unsigned char)(error[k] >> 8);
+                    pix[k] = invert ? 255 - v : v;
+                }
             }
         }
-        return;
     }
-    
-    const Natron::Color::Lut* srcLut = lutFromColorspace(srcColorSpace);
-    const Natron::Color::Lut* dstLut = lutFromColorspace(dstColorSpace);
-
-    
-    for (int y = 0; y < intersection.height(); ++y) {
-        
-        int start = rand() % intersection.width();
-        
-        const SRCPIX* srcPixels = (const SRCPIX*)srcImg.pixelAt(intersection.x1 + start, intersection.y1 + y);
-        DSTPIX* dstPixels = (DSTPIX*)dstImg.pixelAt(intersection.x1 + start, intersection.y1 + y);
-        const SRCPIX* srcStart = srcPixels;
-        DSTPIX* dstStart = dstPixels;
-        
-        for (int backward = 0;backward < 2; ++backward) {
-            int x = backward ? start - 1 : start;
-            int end = backward ? -1 : intersection.width();
-            
-            unsigned error[3] = { 0x80,0x80,0x80 };
-            
-            while (x != end && x >= 0 && x < intersection.width()) {
-                
-                if (dstComp == Natron::ImageComponentAlpha) {
-                    assert(channelForAlpha < srcNComp && channelForAlpha >= 0);
-                    *dstPixels = !sameBitDepth ? convertPixelDepth<SRCPIX, DSTPIX>(srcPixels[channelForAlpha])
-                    : srcPixels[channelForAlpha];
-                    if (invert) {
-                        *dstPixels = dstMaxValue - *dstPixels;
-                    }
-                } else {
-                    if (srcImg.getComponents() == Natron::ImageComponentAlpha) {
-                        if (dstComp == Natron::ImageComponentRGB) {
-                            for (int k = 0; k < dstNComp; ++k) {
-                                DSTPIX pix = convertPixelDepth<SRCPIX, DSTPIX>(*srcPixels);
-                                dstPixels[k] = invert ? dstMaxValue - pix : pix;
-                            }
-                        } else {
-                            assert(dstComp == Natron::ImageComponentRGBA);
-                            for (int k = 0; k < dstNComp - 1; ++k) {
-                                dstPixels[k] = invert ? dstMaxValue : 0;
-                            }
-                            DSTPIX pix = convertPixelDepth<SRCPIX, DSTPIX>(*srcPixels);
-                            dstPixels[3] = invert ? dstMaxValue : pix;
-                        }
-                    } else {
-                        for (int k = 0; k < dstNComp; ++k) {
-                            if (k < srcNComp) {
-                                if (k <= 2 && (srcLut || dstLut)) {
-                                    float pixFloat;
-                                    
-                                    if (srcLut) {
-                                        if (srcDepth == IMAGE_BYTE) {
-                                            pixFloat = srcLut->fromColorSpaceUint8ToLinearFloatFast(srcPixels[k]);
-                                        } else if (srcDepth == IMAGE_SHORT) {
-                                            pixFloat = srcLut->fromColorSpaceUint16ToLinearFloatFast(srcPixels[k]);
-                                        } else {
-                                            pixFloat = srcLut->fromColorSpaceFloatToLinearFloat(srcPixels[k]);
-                                        }
-                                    } else {
-                                        pixFloat = convertPixelDepth<SRCPIX, float>(srcPixels[k]);
-                                    }
-                                    
-                                    
-                                    DSTPIX pix;
-                                    if (dstDepth == IMAGE_BYTE) {
-                                        error[k] = (error[k]&0xff) + (dstLut ? dstLut->toColorSpaceUint8xxFromLinearFloatFast(pixFloat):
-                                                                      Color::floatToInt<0xff01>(pixFloat));
-                                        pix = error[k] >> 8;
-                                    } else if (dstDepth == IMAGE_SHORT) {
-                                        pix = dstLut ? dstLut->toColorSpaceUint16FromLinearFloatFast(pixFloat) :
-                                        convertPixelDepth<float, DSTPIX>(pixFloat);
-                                    } else {
-                                        if (dstLut) {
-                                            pixFloat = dstLut->toColorSpaceFloatFromLinearFloat(pixFloat);
-                                        } else {
-                                            pix = convertPixelDepth<float, DSTPIX>(pixFloat);
-                                        }
-                                    }
-                                    dstPixels[k] = invert ? dstMaxValue - pix : pix;
-                                    
-                                } else {
-                                    DSTPIX pix = convertPixelDepth<SRCPIX, DSTPIX>(srcPixels[k]);
-                                    dstPixels[k] = invert ? dstMaxValue - pix : pix;
-                                }
-                                
-                            } else {
-                                dstPixels[k] = k == 3 ? dstMaxValue :  0.;
-                                if (invert) {
-                                    dstPixels[k] = dstMaxValue - dstPixels[k];
-                                }
-                            }
-                        }
-                    }
-                }
+};
 
-                if (backward) {
-                    --x;
-                    srcPixels -= srcNComp;
-                    dstPixels -= dstNComp;
-                } else {
-                    ++x;
-                    srcPixels += srcNComp;
-                    dstPixels += dstNComp;
-                }
+template <bool hasDstLut>
+struct LinearToRow<unsigned short,hasDstLut>
+{
+    static void store(const float* linear,int count,int /*y*/,const Color::Lut* lut,bool invert,int nComps,
+                      unsigned short* indices,void* dstRow)
+    {
+        unsigned short* dst = (unsigned short*)dstRow;
+        if (hasDstLut) {
+            for (int i = 0; i < count * 4; i += 4) {
+                indices[i] = lut->toColorSpaceUint16FromLinearFloatFast(linear[i]);
+                indices[i + 1] = lut->toColorSpaceUint16FromLinearFloatFast(linear[i + 1]);
+                indices[i + 2] = lut->toColorSpaceUint16FromLinearFloatFast(linear[i + 2]);
             }
-            srcPixels = srcStart - srcNComp;
-            dstPixels = dstStart - dstNComp;
+        } else {
+            floatToIntElements<65536>(linear, count * 4, indices);
         }
-        
-        
-        if (copyBitmap) {
-            const char* srcBitmap = srcImg.getBitmapAt(intersection.x1, intersection.y1 + y);
-            char* dstBitmap = dstImg.getBitmapAt(intersection.x1, intersection.y1 + y);
-            memcpy(dstBitmap, srcBitmap, intersection.width());
+        for (int x = 0; x < count; ++x, indices += 4, dst += nComps) {
+            for (int k = 0; k < 3; ++k) {
+                dst[k] = invert ? 65535 - indices[k] : indices[k];
+            }
+        }
+    }
+};
+
+template <bool hasDstLut>
+struct LinearToRow<float,hasDstLut>
+{
+    static void store(const float* linear,int count,int /*y*/,const Color::Lut* lut,bool invert,int nComps,
+                      unsigned short* /*indices*/,void* dstRow)
+    {
+        float* dst = (float*)dstRow;
+        for (int x = 0; x < count; ++x, linear += 4, dst += nComps) {
+            for (int k = 0; k < 3; ++k) {
+                float pix = hasDstLut ? lut->toColorSpaceFloatFromLinearFloat(linear[k]) : linear[k];
+                dst[k] = invert ? 1.f - pix : pix;
+            }
         }
-        
     }
+};
+
+///The kernels converting the scan-lines of an image to another format, picked once per conversion from the formats
+///of the images and the color-spaces, and the arguments they share.
+struct RowConverter
+{
+    typedef void (*MapChannelsFunc)(const void* src,int count,int channelForAlpha,bool colorConverted,bool invert,void* dst);
+    typedef void (*ToLinearFunc)(const void* src,int nComps,int count,const Color::Lut* lut,float* linear);
+    typedef void (*FromLinearFunc)(const float* linear,int count,int y,const Color::Lut* lut,bool invert,int nComps,
+                                   unsigned short* indices,void* dst);
     
+    MapChannelsFunc mapChannels;
+    ToLinearFunc toLinear; //< NULL if there's no color-space conversion
+    FromLinearFunc fromLinear;
+    const Color::Lut* srcLut;
+    const Color::Lut* dstLut;
+    int srcNComps;
+    int dstNComps;
+    int channelForAlpha;
+    bool invert;
+};
+
+template <typename SRCPIX,typename DSTPIX,int srcNComps>
+RowConverter::MapChannelsFunc
+getMapChannelsFunc(int dstNComps)
+{
+    switch (dstNComps) {
+        case 1:
+            return &mapChannelsRow<SRCPIX, DSTPIX, srcNComps, 1>;
+        case 3:
+            return &mapChannelsRow<SRCPIX, DSTPIX, srcNComps, 3>;
+        case 4:
+        default:
+            return &mapChannelsRow<SRCPIX, DSTPIX, srcNComps, 4>;
+    }
+}
+
+template <typename SRCPIX,typename DSTPIX>
+RowConverter::MapChannelsFunc
+getMapChannelsFunc(int srcNComps,
+                   int dstNComps)
+{
+    switch (srcNComps) {
+        case 1:
+            return getMapChannelsFunc<SRCPIX, DSTPIX, 1>(dstNComps);
+        case 3:
+            return getMapChannelsFunc<SRCPIX, DSTPIX, 3>(dstNComps);
+        case 4:
+        default:
+            return getMapChannelsFunc<SRCPIX, DSTPIX, 4>(dstNComps);
+    }
+}
+
+template <typename DSTPIX>
+void
+setDstKernels(Natron::ImageBitDepth srcDepth,
+              RowConverter* conv)
+{
+    switch (srcDepth) {
+        case IMAGE_BYTE:
+            conv->mapChannels = getMapChannelsFunc<unsigned char, DSTPIX>(conv->srcNComps, conv->dstNComps);
+            break;
+        case IMAGE_SHORT:
+            conv->mapChannels = getMapChannelsFunc<unsigned short, DSTPIX>(conv->srcNComps, conv->dstNComps);
+            break;
+        case IMAGE_FLOAT:
+        default:
+            conv->mapChannels = getMapChannelsFunc<float, DSTPIX>(conv->srcNComps, conv->dstNComps);
+            break;
+    }
+    if (conv->toLinear) {
+        conv->fromLinear = conv->dstLut ? &LinearToRow<DSTPIX, true>::store : &LinearToRow<DSTPIX, false>::store;
+    }
+}
+
+template <typename SRCPIX>
+RowConverter::ToLinearFunc
+getToLinearFunc(bool hasSrcLut)
+{
+    return hasSrcLut ? &rowToLinear<SRCPIX, true> : &rowToLinear<SRCPIX, false>;
+}
+
+///Picks the kernels converting srcImg to dstImg. The 3 color channels go through linear float only if the color-spaces
+///differ, and only between color images: the alpha channel is never converted from a color-space to another.
+void
+makeRowConverter(const Image& srcImg,
+                 const Image& dstImg,
+                 Natron::ViewerColorSpace srcColorSpace,
+                 Natron::ViewerColorSpace dstColorSpace,
+                 int channelForAlpha,
+                 bool invert,
+                 RowConverter* conv)
+{
+    conv->srcNComps = (int)srcImg.getComponentsCount();
+    conv->dstNComps = (int)dstImg.getComponentsCount();
+    conv->channelForAlpha = channelForAlpha;
+    conv->invert = invert;
+    conv->srcLut = 0;
+    conv->dstLut = 0;
+    conv->toLinear = 0;
+    conv->fromLinear = 0;
+    if (srcColorSpace != dstColorSpace && conv->srcNComps >= 3 && conv->dstNComps >= 3) {
+        conv->srcLut = lutFromColorspace(srcColorSpace);
+        conv->dstLut = lutFromColorspace(dstColorSpace);
+    }
+    if (conv->srcLut != conv->dstLut) {
+        switch (srcImg.getBitDepth()) {
+            case IMAGE_BYTE:
+                conv->toLinear = getToLinearFunc<unsigned char>(conv->srcLut != 0);
+                break;
+            case IMAGE_SHORT:
+                conv->toLinear = getToLinearFunc<unsigned short>(conv->srcLut != 0);
+                break;
+            case IMAGE_FLOAT:
+            default:
+                conv->toLinear = getToLinearFunc<float>(conv->srcLut != 0);
+                break;
+        }
+    }
+    switch (dstImg.getBitDepth()) {
+        case IMAGE_BYTE:
+            setDstKernels<unsigned char>(srcImg.getBitDepth(), conv);
+            break;
+        case IMAGE_SHORT:
+            setDstKernels<unsigned short>(srcImg.getBitDepth(), conv);
+            break;
+        case IMAGE_FLOAT:
+        default:
+            setDstKernels<float>(srcImg.getBitDepth(), conv);
+            break;
+    }
 }
 
+///Converts the scan-lines of rect, executed concurrently on bands of rect for large images
+void
+convertRows(const RowConverter* conv,
+            const Image* srcImg,
+            Image* dstImg,
+            const RectI& rect)
+{
+    int width = rect.width();
+    std::vector<float> linear;
+    std::vector<unsigned short> indices;
+    if (conv->toLinear) {
+        linear.resize(width * 4);
+        indices.resize(width * 4);
+    }
+    for (int y = rect.y1; y < rect.y2; ++y) {
+        const unsigned char* src = srcImg->pixelAt(rect.x1, y);
+        unsigned char* dst = dstImg->pixelAt(rect.x1, y);
+        conv->mapChannels(src, width, conv->channelForAlpha, conv->toLinear != 0, conv->invert, dst);
+        if (conv->toLinear) {
+            conv->toLinear(src, conv->srcNComps, width, conv->srcLut, &linear[0]);
+            conv->fromLinear(&linear[0], width, y, conv->dstLut, conv->invert, conv->dstNComps, &indices[0], dst);
+        }
+    }
+}
+
+///Clears out the mask: special case of a conversion to alpha with channelForAlpha = -1
+void
+clearRows(Image* dstImg,
+          const RectI& rect)
+{
+    size_t rowSize = rect.width() * dstImg->getComponentsCount() * getSizeOfForBitDepth(dstImg->getBitDepth());
+    for (int y = rect.y1; y < rect.y2; ++y) {
+        std::memset(dstImg->pixelAt(rect.x1, y), 0, rowSize);
+    }
+}
 
+}
 
 void Image::convertToFormat(const RectI& renderWindow,Natron::Image* dstImg,
                             Natron::ViewerColorSpace srcColorSpace,
@@ -1505,159 +1930,42 @@ void Image::convertToFormat(const RectI& renderWindow,Natron::Image* dstImg,
 {
     assert(getPixelRoD() == dstImg->getPixelRoD());
     
-    if (dstImg->getComponents() == getComponents()) {
-        switch (dstImg->getBitDepth()) {
-            case IMAGE_BYTE: {
-                switch (getBitDepth()) {
-                    case IMAGE_BYTE:
-                        ///Same as a copy
-                        convertToFormatInternal_sameComps<unsigned char, unsigned char, 255, 255>(renderWindow,*this, *dstImg,
-                                                                                                  srcColorSpace,
-                                                                                                  dstColorSpace,invert,copyBitmap);
-                        break;
-                    case IMAGE_SHORT:
-                        convertToFormatInternal_sameComps<unsigned short, unsigned char, 65535, 255>(renderWindow,*this, *dstImg,
-                                                                                                     srcColorSpace,
-                                                                                                     dstColorSpace,invert,copyBitmap);
-                        break;
-                    case IMAGE_FLOAT:
-                        convertToFormatInternal_sameComps<float, unsigned char, 1, 255>(renderWindow,*this, *dstImg,
-                                                                                        srcColorSpace,
-                                                                                        dstColorSpace,invert,copyBitmap);
-                        break;
-                    default:
-                        break;
-                }
-            } break;
-            case IMAGE_SHORT: {
-                switch (getBitDepth()) {
-                    case IMAGE_BYTE:
-                        convertToFormatInternal_sameComps<unsigned char, unsigned short, 255, 65535>(renderWindow,*this, *dstImg,
-                                                                                                     srcColorSpace,
-                                                                                                     dstColorSpace,invert,copyBitmap);
-                        break;
-                    case IMAGE_SHORT:
-                        ///Same as a copy
-                        convertToFormatInternal_sameComps<unsigned short, unsigned short, 65535, 65535>(renderWindow,*this, *dstImg,
-                                                                                                        srcColorSpace,
-                                                                                                        dstColorSpace,invert,copyBitmap);
-                        break;
-                    case IMAGE_FLOAT:
-                        convertToFormatInternal_sameComps<float, unsigned short, 1, 65535>(renderWindow,*this, *dstImg,
-                                                                                           srcColorSpace,
-                                                                                           dstColorSpace,invert,copyBitmap);
-                        break;
-                    default:
-                        break;
-                }
-            } break;
-            case IMAGE_FLOAT: {
-                switch (getBitDepth()) {
-                    case IMAGE_BYTE:
-                        convertToFormatInternal_sameComps<unsigned char, float, 255, 1>(renderWindow,*this, *dstImg,
-                                                                                        srcColorSpace,
-                                                                                        dstColorSpace,invert,copyBitmap);
-                        break;
-                    case IMAGE_SHORT:
-                        convertToFormatInternal_sameComps<unsigned short, float, 65535, 1>(renderWindow,*this, *dstImg,
-                                                                                           srcColorSpace,
-                                                                                           dstColorSpace,invert,copyBitmap);
-                        break;
-                    case IMAGE_FLOAT:
-                        ///Same as a copy
-                        convertToFormatInternal_sameComps<float, float, 1, 1>(renderWindow,*this, *dstImg,
-                                                                              srcColorSpace,
-                                                                              dstColorSpace,invert,copyBitmap);
-                        break;
-                    default:
-                        break;
-                }
-            } break;
-                
-            default:
-                break;
-        }
+    RectI intersection;
+    if (!renderWindow.intersect(getPixelRoD(), &intersection)) {
+        return;
+    }
+    
+    if (dstImg->getComponents() == Natron::ImageComponentAlpha && getComponents() != Natron::ImageComponentAlpha &&
+        channelForAlpha == -1) {
+        clearRows(dstImg, intersection);
     } else {
-        switch (dstImg->getBitDepth()) {
-            case IMAGE_BYTE: {
-                switch (getBitDepth()) {
-                    case IMAGE_BYTE:
-                        convertToFormatInternal<unsigned char, unsigned char, 255, 255>(renderWindow,*this, *dstImg,
-                                                                                        srcColorSpace,
-                                                                                        dstColorSpace,
-                                                                                        channelForAlpha,
-                                                                                        invert,copyBitmap);
-                        break;
-                    case IMAGE_SHORT:
-                        convertToFormatInternal<unsigned short, unsigned char, 65535, 255>(renderWindow,*this, *dstImg,
-                                                                                           srcColorSpace,
-                                                                                           dstColorSpace,
-                                                                                           channelForAlpha,
-                                                                                           invert,copyBitmap);
-                        break;
-                    case IMAGE_FLOAT:
-                        convertToFormatInternal<float, unsigned char, 1, 255>(renderWindow,*this, *dstImg,
-                                                                              srcColorSpace,
-                                                                              dstColorSpace,
-                                                                              channelForAlpha,
-                                                                              invert,copyBitmap);
-                        break;
-                    default:
-                        break;
-                }
-            } break;
-            case IMAGE_SHORT: {
-                switch (getBitDepth()) {
-                    case IMAGE_BYTE:
-                        convertToFormatInternal<unsigned char, unsigned short, 255, 65535>(renderWindow,*this, *dstImg,
-                                                                                           srcColorSpace,
-                                                                                           dstColorSpace,
-                                                                                           channelForAlpha,
-                                                                                           invert,copyBitmap);
-                        break;
-                    case IMAGE_SHORT:
-                        convertToFormatInternal<unsigned short, unsigned short, 65535, 65535>(renderWindow,*this, *dstImg,
-                                                                                              srcColorSpace,
-                                                                                              dstColorSpace,channelForAlpha, invert,copyBitmap);
-                        break;
-                    case IMAGE_FLOAT:
-                        convertToFormatInternal<float, unsigned short, 1, 65535>(renderWindow,*this, *dstImg,
-                                                                                 srcColorSpace,
-                                                                                 dstColorSpace,
-                                                                                 channelForAlpha,
-                                                                                 invert,copyBitmap);
-                        break;
-                    default:
-                        break;
-                }
-            } break;
-            case IMAGE_FLOAT: {
-                switch (getBitDepth()) {
-                    case IMAGE_BYTE:
-                        convertToFormatInternal<unsigned char, float, 255, 1>(renderWindow,*this, *dstImg,
-                                                                              srcColorSpace,
-                                                                              dstColorSpace, channelForAlpha,
-                                                                              invert,copyBitmap);
-                        break;
-                    case IMAGE_SHORT:
-                        convertToFormatInternal<unsigned short, float, 65535, 1>(renderWindow,*this, *dstImg,
-                                                                                 srcColorSpace,
-                                                                                 dstColorSpace, channelForAlpha,
-                                                                                 invert,copyBitmap);
-                        break;
-                    case IMAGE_FLOAT:
-                        convertToFormatInternal<float, float, 1, 1>(renderWindow,*this, *dstImg,
-                                                                    srcColorSpace,
-                                                                    dstColorSpace, channelForAlpha,
-                                                                    invert,copyBitmap);
-                        break;
-                    default:
-                        break;
-                }
-            } break;
-                
-            default:
-                break;
+        RowConverter conv;
+        makeRowConverter(*this, *dstImg, srcColorSpace, dstColorSpace, channelForAlpha, invert, &conv);
+        
+        TaskScheduler* scheduler = appPTR ? appPTR->getTaskScheduler() : 0;
+        int bandsCount = 1;
+        if (scheduler) {
+            bandsCount = std::min((int)(intersection.area() / NATRON_IMAGE_CONVERSION_BAND_MIN_PIXELS),
+                                  std::min(scheduler->getWorkersCount() * 2, intersection.height()));
+        }
+        if (bandsCount <= 1) {
+            convertRows(&conv, this, dstImg, intersection);
+        } else {
+            TaskGroup group;
+            int y = intersection.y1;
+            for (int i = 0; i < bandsCount; ++i) {
+                ///distribute the remainder of the rows on the first bands
+                int bandHeight = intersection.height() / bandsCount + (i < intersection.height() % bandsCount ? 1 : 0);
+                RectI band(intersection.x1, y, intersection.x2, y + bandHeight);
+                scheduler->schedule(&group, boost::bind(&convertRows, &conv, this, dstImg, band));
+                y += bandHeight;
+            }
+            assert(y == intersection.y2);
+            scheduler->wait(&group);
         }
     }
+    
+    if (copyBitmap) {
+        dstImg->copyBitmapFrom(*this, intersection);
+    }
 }
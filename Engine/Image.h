@@ -14,6 +14,8 @@
 
 #include <list>
 #include <map>
+#include <vector>
+#include <utility>
 
 #include "Global/GlobalDefines.h"
 
@@ -38,6 +40,18 @@ namespace Natron {
         unsigned int _mipMapLevel;
         int _view;
         double _pixelAspect;
+        
+        ///When images are cached as tiles, each tile has its own entry, identified by the key of the image
+        ///plus the index of the tile in the grid of tiles of _tileSize pixels. _tileSize is 0 for whole images.
+        int _tileSize;
+        int _tileX;
+        int _tileY;
+        
+        ///The image of a node converted to other components and/or bit depth than the ones it was cached with
+        ///is cached as a variant of that image: same key plus the format of the variant.
+        ///_variantComponents is ImageComponentNone for the image as it was rendered.
+        Natron::ImageComponents _variantComponents;
+        Natron::ImageBitDepth _variantBitDepth;
 
         ImageKey();
         
@@ -47,6 +61,20 @@ namespace Natron {
                  int view,
                  double pixelAspect = 1.);
         
+        /**
+         * @brief Returns the key of the tile at (tileX,tileY) of the image identified by this key.
+         **/
+        ImageKey makeTileKey(int tileSize,int tileX,int tileY) const;
+        
+        bool isTile() const { return _tileSize != 0; }
+        
+        /**
+         * @brief Returns the key of the image identified by this key converted to the given components and bit depth.
+         **/
+        ImageKey makeVariantKey(Natron::ImageComponents components,Natron::ImageBitDepth bitdepth) const;
+        
+        bool isVariant() const { return _variantComponents != Natron::ImageComponentNone; }
+        
         void fillHash(Hash64* hash) const;
         
         U64 getTreeVersion() const { return _nodeHashKey; }
@@ -56,37 +84,36 @@ namespace Natron {
     };
     
     
+    /**
+     * @brief Keeps track of the pixels of an image that were already rendered.
+     * Each row of the bitmap is stored as a sorted list of disjoint, non-adjacent [x1,x2) intervals
+     * of rendered pixels. Renders usually mark whole rectangles, so a row typically holds a handful
+     * of intervals: the memory used no longer grows with the area of the image and the queries below
+     * cost O(rows * log(intervals)) instead of scanning every pixel.
+     **/
     class Bitmap {
     public:
         Bitmap(const RectI& rod)
-        : _rod(rod)
-        , _map(new char[rod.area()])
+        : _rod()
+        , _rows()
         {
             //Do not assert !rod.isNull() : An empty image can be created for entries that correspond to
             // "identities" images (i.e: images that are just a link to another image). See EffectInstance :
             // "!!!Note that if isIdentity is true it will allocate an empty image object with 0 bytes of data."
             //assert(!rod.isNull());
-            clear();
+            initialize(rod);
         }
         
         Bitmap()
         : _rod()
-        , _map(0)
+        , _rows()
         {
             
         }
         
-        void initialize(const RectI& rod)
-        {
-            assert(!_map);
-            _rod = rod;
-            _map = new char[rod.area()];
-            clear();
-        }
-        
-        ~Bitmap() { delete [] _map; }
+        void initialize(const RectI& rod);
         
-        void clear() { std::fill(_map, _map+ _rod.area(), 0); }
+        void clear();
         
         const RectI& getRoD() const {return _rod;}
         
@@ -95,18 +122,30 @@ namespace Natron {
         RectI minimalNonMarkedBbox(const RectI& roi) const;
 
         void markForRendered(const RectI& roi);
-
-        const char* getBitmap() const { return _map; }
         
-        char* getBitmap() { return _map; }
+        /**
+         * @brief Replaces the state of the pixels in roi by the state they have in other.
+         **/
+        void copyFrom(const Bitmap& other,const RectI& roi);
         
-        const char* getBitmapAt(int x,int y) const;
+        bool isMarked(int x,int y) const;
         
-        char* getBitmapAt(int x,int y);
+        /**
+         * @brief An estimate of the memory used by the bitmap, which only depends on its RoD:
+         * the cache accounts for the size of an entry when it is inserted and when it is removed,
+         * hence it must not change while the entry lives.
+         **/
+        size_t sizeEstimate() const;
 
     private:
+        
+        typedef std::vector<std::pair<int,int> > Row;
+        
+        ///Returns the intervals of row y, an empty row if y is outside of the RoD
+        const Row& rowAt(int y) const;
+        
         RectI _rod;
-        char* _map;
+        std::vector<Row> _rows;
     };
     
 
@@ -140,11 +179,47 @@ namespace Natron {
                                 unsigned int mipMapLevel,
                                 int view);
         
+        /**
+         * @param tileSize If not 0, the image is cached as tiles of tileSize pixels: the entry made with these params
+         * is only a header holding the results of the actions, it has no pixels. See makeTileParams().
+         **/
         static boost::shared_ptr<ImageParams> makeParams(int cost,const RectI& rod,unsigned int mipMapLevel,
                                                          bool isRoDProjectFormat,ImageComponents components,
                                                          Natron::ImageBitDepth bitdepth,
                                                          int inputNbIdentity,int inputTimeIdentity,
-                                                         const std::map<int, std::vector<RangeD> >& framesNeeded) ;
+                                                         const std::map<int, std::vector<RangeD> >& framesNeeded,
+                                                         int tileSize = 0) ;
+        
+        /**
+         * @brief Returns the params of the tile at (tileX,tileY) of an image cached as tiles, whose header has the given params.
+         **/
+        static boost::shared_ptr<ImageParams> makeTileParams(int cost,const ImageParams& headerParams,unsigned int mipMapLevel,
+                                                             int tileX,int tileY);
+        
+        /**
+         * @brief Returns the params of the variant of a whole image (see ImageKey::makeVariantKey) holding
+         * the same pixels as the image with the given params, converted to the given components and bit depth.
+         **/
+        static boost::shared_ptr<ImageParams> makeVariantParams(int cost,const ImageParams& sourceParams,
+                                                                Natron::ImageComponents components,
+                                                                Natron::ImageBitDepth bitdepth);
+        
+        /**
+         * @brief Returns the bounds in pixel coordinates of the tile at (tileX,tileY), i.e the intersection of the tile
+         * with pixelRoD. The returned rectangle is null if they do not intersect.
+         **/
+        static RectI getTileBounds(const RectI& pixelRoD,int tileSize,int tileX,int tileY);
+        
+        /**
+         * @brief Returns the range of tiles [*tileX1,*tileX2[ x [*tileY1,*tileY2[ covering the given rectangle.
+         **/
+        static void getTilesRange(const RectI& rect,int tileSize,int* tileX1,int* tileY1,int* tileX2,int* tileY2);
+        
+        /**
+         * @brief Returns true if this entry is the header of an image cached as tiles: it has no pixels and no bitmap,
+         * only the results of the actions. The pixels are in the entries of the tiles.
+         **/
+        bool isTiled() const;
         
         /**
          * @brief Returns the region of definition of the image in canonical coordinates. It doesn't have any
@@ -159,7 +234,7 @@ namespace Natron {
          **/
         const RectI& getPixelRoD() const;
         
-        virtual size_t size() const OVERRIDE FINAL { return dataSize() + _bitmap.getRoD().area(); }
+        virtual size_t size() const OVERRIDE FINAL { return dataSize() + _bitmap.sizeEstimate(); }
         
         unsigned int getMipMapLevel() const {return this->_key._mipMapLevel;}
         
@@ -183,6 +258,12 @@ namespace Natron {
         
         Natron::ImageBitDepth getBitDepth() const {return this->_bitDepth;}
         
+        ///The channels of 8 bits pixels, the bytes of the shorts and floats otherwise
+        virtual int getCompressionElementSize() const OVERRIDE FINAL;
+        
+        ///The pixels were rendered by another process: mark them all
+        virtual void onDataImported() OVERRIDE FINAL;
+        
         void setPixelAspect(double pa) { this->_key._pixelAspect = pa; }
         
         double getPixelAspect() const { return this->_key._pixelAspect; }
@@ -198,9 +279,18 @@ namespace Natron {
          **/
         unsigned int getRowElements() const;
         
-        const char* getBitmapAt(int x,int y) const { return this->_bitmap.getBitmapAt(x,y); }
+        /**
+         * @brief Returns true if the pixel (x,y) was marked as rendered.
+         **/
+        bool isPixelRendered(int x,int y) const {
+            QReadLocker locker(&_lock);
+            return _bitmap.isMarked(x,y);
+        }
         
-        char* getBitmapAt(int x,int y) { return this->_bitmap.getBitmapAt(x,y); }
+        /**
+         * @brief Copies the rendered state of the pixels of other in roi to this image.
+         **/
+        void copyBitmapFrom(const Natron::Image& other,const RectI& roi);
         
         /**
          * @brief Zeroes out the bitmap so the image is considered to be as though nothing
@@ -263,11 +353,12 @@ namespace Natron {
         
         /**
          * @brief Downscales a portion of this image into output.
-         * This function will adjust roi to the largest enclosed rectangle for the
-         * given mipmap level,
-         * and then computes the mipmap of the given level of that rectangle.
+         * This function computes the mipmap of the given level of roi, rounded to the smallest enclosing
+         * rectangle for the given mipmap level. The pixels of its edges average the pixels of roi they cover.
+         * The color channels are averaged in linear: colorSpace is the color-space of the pixels of this image.
          **/
-        void downscale_mipmap(const RectI& roi, Natron::Image* output, unsigned int level) const;
+        void downscale_mipmap(const RectI& roi, Natron::Image* output, unsigned int level,
+                              Natron::ViewerColorSpace colorSpace = Natron::Linear) const;
 
         /**
          * @brief Upscales a portion of this image into output.
@@ -331,19 +422,16 @@ namespace Natron {
          * function computes the mip map of this image in the given roi.
          * If roi is NOT a power of 2, then it will be rounded to the closest power of 2.
          **/
-        void buildMipMapLevel(Natron::Image* output,const RectI& roi,unsigned int level) const;
+        void buildMipMapLevel(Natron::Image* output,const RectI& roi,unsigned int level,
+                              Natron::ViewerColorSpace colorSpace = Natron::Linear) const;
         
         
         /**
          * @brief Halve the given roi of this image into output.
-         * If the RoI bounds are odd, the largest enclosing RoI with even bounds will be considered.
-         **/
-        void halveRoI(const RectI& roi,Natron::Image* output) const;
-        
-        /**
-         * @brief Same as halveRoI but for 1D only (either width == 1 or height == 1)
+         * If the RoI bounds are odd, the output pixels of the edges are the average of the 1 or 2 pixels
+         * of the RoI they cover. The color channels are averaged in linear.
          **/
-        void halve1DImage(const RectI& roi,Natron::Image* output) const;
+        void halveRoI(const RectI& roi,Natron::Image* output,Natron::ViewerColorSpace colorSpace = Natron::Linear) const;
     };
     
     template <typename SRCPIX,typename DSTPIX>
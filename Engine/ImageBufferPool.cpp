@@ -0,0 +1,294 @@
+//  Natron
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "ImageBufferPool.h"
+
+#include <cassert>
+#include <cstdlib>
+#include <new>
+
+#if defined(__NATRON_UNIX__)
+#include <sys/mman.h>
+#endif
+#if defined(__NATRON_LINUX__)
+#include <unistd.h>
+#include <sys/syscall.h>
+#endif
+
+using namespace Natron;
+
+///Below this size, classes are multiples of 64 kB, above multiples of the size of a huge page
+#define NATRON_IMAGE_BUFFER_POOL_SMALL_CLASSES_MAX_BYTES (16 * 1024 * 1024)
+#define NATRON_IMAGE_BUFFER_POOL_HUGE_PAGE_BYTES (2 * 1024 * 1024)
+
+namespace {
+
+///The NUMA node of the CPU running the calling thread, -1 if unknown
+int
+getCurrentNode()
+{
+#if defined(__NATRON_LINUX__) && defined(SYS_getcpu)
+    unsigned int cpu = 0,node = 0;
+    if (syscall(SYS_getcpu,&cpu,&node,NULL) == 0) {
+        return (int)node;
+    }
+#endif
+    return -1;
+}
+
+///The NUMA node of the page at the given address, -1 if unknown or if the page was never touched
+int
+getPageNode(void* ptr)
+{
+#if defined(__NATRON_LINUX__) && defined(SYS_get_mempolicy)
+    ///MPOL_F_NODE | MPOL_F_ADDR, from numaif.h which is not always installed
+    const unsigned long flags = (1 << 0) | (1 << 1);
+    int node = -1;
+    if (syscall(SYS_get_mempolicy,&node,NULL,0,ptr,flags) == 0) {
+        return node;
+    }
+#else
+    (void)ptr;
+#endif
+    return -1;
+}
+
+}
+
+ImageBufferPool ImageBufferPool::_instance;
+
+ImageBufferPool::Statistics::Statistics()
+: allocationsCount(0)
+, allocatedBytes(0)
+, reusedCount(0)
+, replacedCount(0)
+, releasesCount(0)
+, freedCount(0)
+, pooledBytes(0)
+, pooledBuffersCount(0)
+{
+}
+
+double
+ImageBufferPool::Statistics::getReuseHitRate() const
+{
+    return allocationsCount ? (double)reusedCount / allocationsCount : 0.;
+}
+
+ImageBufferPool::ImageBufferPool()
+: _lock()
+, _buffers()
+, _maxPooledBytes(NATRON_IMAGE_BUFFER_POOL_DEFAULT_MAX_BYTES)
+, _hugePages(false)
+, _stats()
+{
+}
+
+ImageBufferPool::~ImageBufferPool()
+{
+    clear();
+}
+
+ImageBufferPool &
+ImageBufferPool::instance()
+{
+    return _instance;
+}
+
+std::size_t
+ImageBufferPool::getSizeClass(std::size_t bytes)
+{
+    if (bytes < NATRON_IMAGE_BUFFER_POOL_MIN_BYTES) {
+        return bytes;
+    }
+    std::size_t step = bytes <= NATRON_IMAGE_BUFFER_POOL_SMALL_CLASSES_MAX_BYTES ? 64 * 1024 : NATRON_IMAGE_BUFFER_POOL_HUGE_PAGE_BYTES;
+    return (bytes + step - 1) / step * step;
+}
+
+void*
+ImageBufferPool::map(std::size_t sizeClass,
+                     bool hugePages)
+{
+#if defined(__NATRON_UNIX__)
+    void* ptr = mmap(NULL,sizeClass,PROT_READ | PROT_WRITE,MAP_PRIVATE | MAP_ANON,-1,0);
+    if (ptr == MAP_FAILED) {
+        throw std::bad_alloc();
+    }
+#if defined(__NATRON_LINUX__) && defined(MADV_HUGEPAGE)
+    if (hugePages && sizeClass >= NATRON_IMAGE_BUFFER_POOL_HUGE_PAGE_BYTES) {
+        madvise(ptr,sizeClass,MADV_HUGEPAGE);
+    }
+#else
+    (void)hugePages;
+#endif
+#else
+    (void)hugePages;
+    void* ptr = std::malloc(sizeClass);
+    if (!ptr) {
+        throw std::bad_alloc();
+    }
+#endif
+    return ptr;
+}
+
+void
+ImageBufferPool::unmap(void* ptr,
+                       std::size_t sizeClass)
+{
+#if defined(__NATRON_UNIX__)
+    munmap(ptr,sizeClass);
+#else
+    (void)sizeClass;
+    std::free(ptr);
+#endif
+}
+
+void*
+ImageBufferPool::allocate(std::size_t bytes)
+{
+    if (bytes < NATRON_IMAGE_BUFFER_POOL_MIN_BYTES) {
+        return new char[bytes];
+    }
+    std::size_t sizeClass = getSizeClass(bytes);
+    int node = getCurrentNode();
+    bool hugePages;
+    {
+        QMutexLocker l(&_lock);
+        hugePages = _hugePages;
+        ++_stats.allocationsCount;
+        _stats.allocatedBytes += sizeClass;
+
+        ///Most recently released first, preferably of the node of this thread
+        std::list<PooledBuffer>::iterator found = _buffers.end();
+        for (std::list<PooledBuffer>::reverse_iterator it = _buffers.rbegin(); it != _buffers.rend(); ++it) {
+            if (it->sizeClass != sizeClass) {
+                continue;
+            }
+            if (it->node == node || it->node == -1 || node == -1) {
+                found = --it.base();
+                break;
+            } else if (found == _buffers.end()) {
+                found = --it.base();
+            }
+        }
+        if (found != _buffers.end()) {
+            void* ptr = found->ptr;
+            bool remote = found->node != -1 && node != -1 && found->node != node;
+            _buffers.erase(found);
+            ++_stats.reusedCount;
+            _stats.pooledBytes -= sizeClass;
+            --_stats.pooledBuffersCount;
+            if (remote) {
+                ++_stats.replacedCount;
+                l.unlock();
+#if defined(__NATRON_UNIX__) && defined(MADV_DONTNEED)
+                ///The pages are zero-filled again on the next access, on the node of the thread touching them
+                madvise(ptr,sizeClass,MADV_DONTNEED);
+#endif
+            }
+            return ptr;
+        }
+    }
+    ///Mapping can be slow, don't hold the lock
+    return map(sizeClass,hugePages);
+}
+
+void
+ImageBufferPool::release(void* ptr,
+                         std::size_t bytes)
+{
+    if (!ptr) {
+        return;
+    }
+    if (bytes < NATRON_IMAGE_BUFFER_POOL_MIN_BYTES) {
+        delete [] (char*)ptr;
+        return;
+    }
+    PooledBuffer buffer;
+    buffer.ptr = ptr;
+    buffer.sizeClass = getSizeClass(bytes);
+    buffer.node = getPageNode(ptr);
+
+    QMutexLocker l(&_lock);
+    ++_stats.releasesCount;
+    if (buffer.sizeClass > _maxPooledBytes) {
+        ++_stats.freedCount;
+        l.unlock();
+        unmap(ptr,buffer.sizeClass);
+        return;
+    }
+    trim(_maxPooledBytes - buffer.sizeClass);
+    _buffers.push_back(buffer);
+    _stats.pooledBytes += buffer.sizeClass;
+    ++_stats.pooledBuffersCount;
+}
+
+void
+ImageBufferPool::trim(U64 maxBytes)
+{
+    while (_stats.pooledBytes > maxBytes) {
+        assert(!_buffers.empty());
+        const PooledBuffer& oldest = _buffers.front();
+        unmap(oldest.ptr,oldest.sizeClass);
+        _stats.pooledBytes -= oldest.sizeClass;
+        --_stats.pooledBuffersCount;
+        ++_stats.freedCount;
+        _buffers.pop_front();
+    }
+}
+
+void
+ImageBufferPool::clear()
+{
+    QMutexLocker l(&_lock);
+    trim(0);
+}
+
+void
+ImageBufferPool::setMaxPooledBytes(U64 maxBytes)
+{
+    QMutexLocker l(&_lock);
+    _maxPooledBytes = maxBytes;
+    trim(maxBytes);
+}
+
+U64
+ImageBufferPool::getMaxPooledBytes() const
+{
+    QMutexLocker l(&_lock);
+    return _maxPooledBytes;
+}
+
+void
+ImageBufferPool::setHugePagesEnabled(bool enabled)
+{
+    QMutexLocker l(&_lock);
+    _hugePages = enabled;
+}
+
+bool
+ImageBufferPool::isHugePagesEnabled() const
+{
+    QMutexLocker l(&_lock);
+    return _hugePages;
+}
+
+ImageBufferPool::Statistics
+ImageBufferPool::getStatistics() const
+{
+    QMutexLocker l(&_lock);
+    return _stats;
+}
+
+void
+ImageBufferPool::resetStatistics()
+{
+    QMutexLocker l(&_lock);
+    U64 pooledBytes = _stats.pooledBytes;
+    U64 pooledBuffersCount = _stats.pooledBuffersCount;
+    _stats = Statistics();
+    _stats.pooledBytes = pooledBytes;
+    _stats.pooledBuffersCount = pooledBuffersCount;
+}
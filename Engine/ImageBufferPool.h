@@ -0,0 +1,138 @@
+//  Natron
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef NATRON_ENGINE_IMAGEBUFFERPOOL_H_
+#define NATRON_ENGINE_IMAGEBUFFERPOOL_H_
+
+#include <cstddef>
+#include <list>
+
+#include "Global/Macros.h"
+CLANG_DIAG_OFF(deprecated)
+#include <QtCore/QMutex>
+CLANG_DIAG_ON(deprecated)
+#ifndef Q_MOC_RUN
+#include <boost/noncopyable.hpp>
+#endif
+
+#include "Global/GlobalDefines.h"
+
+///Buffers smaller than this are not pooled, they are allocated on the heap
+#define NATRON_IMAGE_BUFFER_POOL_MIN_BYTES (256 * 1024)
+
+///Default for the amount of memory the released buffers may keep
+#define NATRON_IMAGE_BUFFER_POOL_DEFAULT_MAX_BYTES (512ULL * 1024 * 1024)
+
+///The fraction of the RAM of the node cache the application gives to the pool instead, up to the default above
+#define NATRON_IMAGE_BUFFER_POOL_CACHE_FRACTION 0.1
+
+namespace Natron {
+
+/**
+ * @brief A process-wide pool of the large buffers holding the pixels of the images and viewer textures living in RAM.
+ *
+ * When a cache entry is evicted, its buffer goes back into the pool instead of being freed, and the next entry of
+ * the same size class gets it back without a system call nor page faults. Sizes are rounded up to a size class
+ * (64 kB steps below 16 MB, 2 MB steps above) so that all the frames of a format share one.
+ * The pool keeps at most getMaxPooledBytes() bytes: the oldest buffers are freed first.
+ *
+ * Fresh buffers are mapped but never written here, so their pages are placed on the NUMA node of the thread that
+ * first touches them, i.e: the workers rendering the tiles. A released buffer remembers the node of its first page:
+ * it is preferably reused by a thread of the same node, and when it is reused from another node its pages are given
+ * back to the system so that they are placed again by the threads touching them.
+ *
+ * Thread safety: all functions are thread-safe.
+ **/
+class ImageBufferPool : boost::noncopyable
+{
+public:
+
+    struct Statistics
+    {
+        ///Only the buffers of at least NATRON_IMAGE_BUFFER_POOL_MIN_BYTES are counted
+        U64 allocationsCount; //< number of buffers handed out by allocate()
+        U64 allocatedBytes; //< sum of their sizes
+        U64 reusedCount; //< number of them taken from the pool
+        U64 replacedCount; //< number of reused buffers whose pages were given back to be placed again
+        U64 releasesCount; //< number of buffers given back with release()
+        U64 freedCount; //< number of buffers freed because the pool was full or cleared
+        U64 pooledBytes; //< memory held by the pool right now
+        U64 pooledBuffersCount;
+
+        Statistics();
+
+        ///The fraction of allocations served from the pool
+        double getReuseHitRate() const;
+    };
+
+    static ImageBufferPool & instance();
+
+    /**
+     * @brief Returns a buffer of at least the given number of bytes, not initialized.
+     * Throws std::bad_alloc if the memory cannot be allocated.
+     **/
+    void* allocate(std::size_t bytes);
+
+    /**
+     * @brief Gives back a buffer returned by allocate(), with the same size. Does nothing if ptr is NULL.
+     **/
+    void release(void* ptr,std::size_t bytes);
+
+    /**
+     * @brief Frees all the buffers held by the pool.
+     **/
+    void clear();
+
+    void setMaxPooledBytes(U64 maxBytes);
+
+    U64 getMaxPooledBytes() const;
+
+    /**
+     * @brief When enabled, new buffers of at least 2 MB are mapped with transparent huge pages (Linux only).
+     * Disabled by default.
+     **/
+    void setHugePagesEnabled(bool enabled);
+
+    bool isHugePagesEnabled() const;
+
+    Statistics getStatistics() const;
+
+    void resetStatistics();
+
+    ///The size actually reserved for a buffer of the given size
+    static std::size_t getSizeClass(std::size_t bytes);
+
+private:
+
+    ImageBufferPool();
+
+    ~ImageBufferPool();
+
+    struct PooledBuffer
+    {
+        void* ptr;
+        std::size_t sizeClass;
+        int node; //< -1 if unknown
+    };
+
+    ///Frees the oldest buffers until the pool fits in maxBytes. Must be called with _lock held.
+    void trim(U64 maxBytes);
+
+    static void* map(std::size_t sizeClass,bool hugePages);
+
+    static void unmap(void* ptr,std::size_t sizeClass);
+
+    static ImageBufferPool _instance;
+
+    mutable QMutex _lock; //< protects all the members below
+    std::list<PooledBuffer> _buffers; //< released buffers, oldest first
+    U64 _maxPooledBytes;
+    bool _hugePages;
+    Statistics _stats;
+};
+
+} // namespace Natron
+
+#endif // NATRON_ENGINE_IMAGEBUFFERPOOL_H_
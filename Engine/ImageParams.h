@@ -55,6 +55,7 @@ public:
     , _inputTimeIdentity(0)
     , _framesNeeded()
     , _components(Natron::ImageComponentRGBA)
+    , _tileSize(0)
     {
         
     }
@@ -68,14 +69,16 @@ public:
     , _inputTimeIdentity(other._inputTimeIdentity)
     , _framesNeeded(other._framesNeeded)
     , _components(other._components)
+    , _bitdepth(other._bitdepth)
+    , _tileSize(other._tileSize)
     {
         
     }
     
     ImageParams(int cost,const RectI& rod,const RectI& pixelRoD,Natron::ImageBitDepth bitdepth,
                 bool isRoDProjectFormat,ImageComponents components,int inputNbIdentity,int inputTimeIdentity,
-                const std::map<int, std::vector<RangeD> >& framesNeeded)
-    : NonKeyParams(cost,pixelRoD.area() * getElementsCountForComponents(components) * getSizeOfForBitDepth(bitdepth))
+                const std::map<int, std::vector<RangeD> >& framesNeeded,int tileSize = 0)
+    : NonKeyParams(cost,tileSize ? 0 : pixelRoD.area() * getElementsCountForComponents(components) * getSizeOfForBitDepth(bitdepth))
     , _rod(rod)
     , _pixelRoD(pixelRoD)
     , _isRoDProjectFormat(isRoDProjectFormat)
@@ -84,6 +87,7 @@ public:
     , _framesNeeded(framesNeeded)
     , _components(components)
     , _bitdepth(bitdepth)
+    , _tileSize(tileSize)
     {
         
     }
@@ -106,6 +110,9 @@ public:
     
     ImageComponents getComponents() const { return _components; }
     
+    ///If not 0, these are the params of the header of an image cached as tiles of this size
+    int getTileSize() const { return _tileSize; }
+    
     template<class Archive>
     void serialize(Archive & ar, const unsigned int version);
     
@@ -135,7 +142,8 @@ private:
         && _inputNbIdentity == imgParams._inputNbIdentity
         && _inputTimeIdentity == imgParams._inputTimeIdentity
         && _components == imgParams._components
-        && _bitdepth == imgParams._bitdepth;
+        && _bitdepth == imgParams._bitdepth
+        && _tileSize == imgParams._tileSize;
     }
     
     RectI _rod;
@@ -152,6 +160,7 @@ private:
     std::map<int, std::vector<RangeD> > _framesNeeded;
     Natron::ImageComponents _components;
     Natron::ImageBitDepth _bitdepth;
+    int _tileSize;
 };
 
 
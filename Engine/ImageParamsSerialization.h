@@ -12,6 +12,10 @@ CLANG_DIAG_ON(unused-parameter)
 #include <boost/serialization/base_object.hpp>
 #include <boost/serialization/map.hpp>
 #include <boost/serialization/vector.hpp>
+#include <boost/serialization/version.hpp>
+
+#define IMAGE_PARAMS_INTRODUCES_TILE_SIZE 2
+#define IMAGE_PARAMS_VERSION IMAGE_PARAMS_INTRODUCES_TILE_SIZE
 
 using namespace Natron;
 
@@ -28,7 +32,7 @@ namespace boost {
 }
 
 template<class Archive>
-void ImageParams::serialize(Archive & ar,const unsigned int /*version*/)
+void ImageParams::serialize(Archive & ar,const unsigned int version)
 {
     ar & BOOST_SERIALIZATION_BASE_OBJECT_NVP(Natron::NonKeyParams);
     ar & boost::serialization::make_nvp("Rod",_rod);
@@ -38,9 +42,13 @@ void ImageParams::serialize(Archive & ar,const unsigned int /*version*/)
     ar & boost::serialization::make_nvp("InputTimeIdentity",_inputTimeIdentity);
     ar & boost::serialization::make_nvp("FramesNeeded",_framesNeeded);
     ar & boost::serialization::make_nvp("Components",_components);
-    
+    if (version >= IMAGE_PARAMS_INTRODUCES_TILE_SIZE) {
+        ar & boost::serialization::make_nvp("TileSize",_tileSize);
+    }
 }
 
+BOOST_CLASS_VERSION(Natron::ImageParams, IMAGE_PARAMS_VERSION)
+
 
 
 #endif // IMAGEPARAMSSERIALIZATION_H
@@ -10,20 +10,37 @@ CLANG_DIAG_OFF(unused-parameter)
 #include <boost/archive/binary_iarchive.hpp>
 CLANG_DIAG_ON(unused-parameter)
 #include <boost/archive/binary_oarchive.hpp>
+#include <boost/serialization/version.hpp>
+
+#define IMAGE_KEY_INTRODUCES_TILES 2
+#define IMAGE_KEY_INTRODUCES_VARIANTS 3
+#define IMAGE_KEY_VERSION IMAGE_KEY_INTRODUCES_VARIANTS
+
 namespace boost {
     namespace serialization {
 
         template<class Archive>
-        void serialize(Archive & ar, Natron::ImageKey& k,const unsigned int /*version*/ )
+        void serialize(Archive & ar, Natron::ImageKey& k,const unsigned int version )
         {
             ar & boost::serialization::make_nvp("NodeHashKey",k._nodeHashKey);
             ar & boost::serialization::make_nvp("MipMapLevel",k._mipMapLevel);
             ar & boost::serialization::make_nvp("Time",k._time);
             ar & boost::serialization::make_nvp("View",k._view);
             ar & boost::serialization::make_nvp("PixelAspect",k._pixelAspect);
+            if (version >= IMAGE_KEY_INTRODUCES_TILES) {
+                ar & boost::serialization::make_nvp("TileSize",k._tileSize);
+                ar & boost::serialization::make_nvp("TileX",k._tileX);
+                ar & boost::serialization::make_nvp("TileY",k._tileY);
+            }
+            if (version >= IMAGE_KEY_INTRODUCES_VARIANTS) {
+                ar & boost::serialization::make_nvp("VariantComponents",k._variantComponents);
+                ar & boost::serialization::make_nvp("VariantBitDepth",k._variantBitDepth);
+            }
         }
 
     }
 }
 
+BOOST_CLASS_VERSION(Natron::ImageKey, IMAGE_KEY_VERSION)
+
 #endif // IMAGESERIALIZATION_H
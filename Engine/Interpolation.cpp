@@ -294,21 +294,21 @@ Natron::solveQuartic(double c0, double c1, double c2, double c3, double c4, doub
  * Note that for CATMULL-ROM you must use the function interpolate_catmullRom
  * which will compute the derivatives for you.
  **/
-double Natron::interpolate(double tcur, const double vcur, //start control point
-                           const double vcurDerivRight, //being the derivative dv/dt at tcur
-                           const double vnextDerivLeft, //being the derivative dv/dt at tnext
-                           double tnext, const double vnext, //end control point
-                           double currentTime,
-                           Natron::KeyframeType interp,
-                           Natron::KeyframeType interpNext)
+void Natron::interpolationCoefficients(double tcur, const double vcur, //start control point
+                                       const double vcurDerivRight, //being the derivative dv/dt at tcur
+                                       const double vnextDerivLeft, //being the derivative dv/dt at tnext
+                                       double tnext, const double vnext, //end control point
+                                       Natron::KeyframeType interp,
+                                       Natron::KeyframeType interpNext,
+                                       double *t0,
+                                       double *t1,
+                                       double c[4])
 {
     double P0 = vcur;
     double P3 = vnext;
     // Hermite coefficients P0' and P3' are the derivatives with respect to x \in [0,1]
     double P0pr = vcurDerivRight*(tnext-tcur); // normalize for x \in [0,1]
     double P3pl = vnextDerivLeft*(tnext-tcur); // normalize for x \in [0,1]
-    // if the following is true, this makes the special case for KEYFRAME_CONSTANT at tnext useless, and we can always use a cubic - the strict "currentTime < tnext" is the key
-    assert(((interp == KEYFRAME_NONE) || (tcur <= currentTime)) && ((currentTime < tnext) || (interpNext == KEYFRAME_NONE)));
     // after the last / before the first keyframe, derivatives are wrt currentTime (i.e. non-normalized)
     if (interp == KEYFRAME_NONE) {
         // virtual previous frame at t-1
@@ -326,11 +326,27 @@ double Natron::interpolate(double tcur, const double vcur, //start control point
         P3 = P0 + P0pr;
         tnext = tcur + 1;
     }
-    double c0, c1, c2, c3;
-    hermiteToCubicCoeffs(P0, P0pr, P3pl, P3, &c0, &c1, &c2, &c3);
+    hermiteToCubicCoeffs(P0, P0pr, P3pl, P3, &c[0], &c[1], &c[2], &c[3]);
+    *t0 = tcur;
+    *t1 = tnext;
+}
 
-    const double t = (currentTime - tcur)/(tnext - tcur);
-    double ret = cubicEval(c0, c1, c2, c3, t);
+double Natron::interpolate(double tcur, const double vcur, //start control point
+                           const double vcurDerivRight, //being the derivative dv/dt at tcur
+                           const double vnextDerivLeft, //being the derivative dv/dt at tnext
+                           double tnext, const double vnext, //end control point
+                           double currentTime,
+                           Natron::KeyframeType interp,
+                           Natron::KeyframeType interpNext)
+{
+    // if the following is true, this makes the special case for KEYFRAME_CONSTANT at tnext useless, and we can always use a cubic - the strict "currentTime < tnext" is the key
+    assert(((interp == KEYFRAME_NONE) || (tcur <= currentTime)) && ((currentTime < tnext) || (interpNext == KEYFRAME_NONE)));
+    double t0, t1;
+    double c[4];
+    interpolationCoefficients(tcur, vcur, vcurDerivRight, vnextDerivLeft, tnext, vnext, interp, interpNext, &t0, &t1, c);
+
+    const double t = (currentTime - t0)/(t1 - t0);
+    double ret = cubicEval(c[0], c[1], c[2], c[3], t);
 
     // cubicDerive: divide the result by (tnext-tcur)
     // cubicIntegrate: multiply the result by (tnext-tcur)
@@ -34,6 +34,21 @@ double interpolate(double tcur, const double vcur, //start control point
                    KeyframeType interp,
                    KeyframeType interpNext) WARN_UNUSED_RETURN;
 
+/**
+ * @brief Computes the cubic evaluated by interpolate() between the two control points: the value at
+ * currentTime is c[0] + c[1]*x + c[2]*x^2 + c[3]*x^3 with x = (currentTime - *t0) / (*t1 - *t0).
+ * t0 and t1 differ from tcur and tnext before the first and after the last keyframe.
+ **/
+void interpolationCoefficients(double tcur, const double vcur, //start control point
+                               const double vcurDerivRight, //being the derivative dv/dt at tcur
+                               const double vnextDerivLeft, //being the derivative dv/dt at tnext
+                               double tnext, const double vnext, //end control point
+                               KeyframeType interp,
+                               KeyframeType interpNext,
+                               double *t0,
+                               double *t1,
+                               double c[4]);
+
 /// derive at currentTime. The derivative is with respect to currentTime
 double derive(double tcur, const double vcur, //start control point
               const double vcurDerivRight, //being the derivative dv/dt at tcur
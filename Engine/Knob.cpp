@@ -11,6 +11,9 @@
 #include "Knob.h"
 #include "KnobImpl.h"
 
+#include <algorithm>
+#include <functional>
+
 #include <QtCore/QDataStream>
 #include <QtCore/QByteArray>
 #include <QtCore/QCoreApplication>
@@ -525,6 +528,26 @@ KnobHolder*  KnobHelper::getHolder() const
     return _imp->holder;
 }
 
+bool KnobHelper::getRenderSnapshotValue(int dimension,double* value) const
+{
+    KnobHolder* holder = getHolder();
+    if (!holder) {
+        return false;
+    }
+    const KnobsValuesSnapshot* snapshot = holder->getKnobsValuesSnapshot();
+    return snapshot && snapshot->getValue(this, dimension, value);
+}
+
+bool KnobHelper::getRenderSnapshotValueAtTime(double time,int dimension,double* value) const
+{
+    KnobHolder* holder = getHolder();
+    if (!holder) {
+        return false;
+    }
+    const KnobsValuesSnapshot* snapshot = holder->getKnobsValuesSnapshot();
+    return snapshot && snapshot->getTime() == time && snapshot->getValue(this, dimension, value);
+}
+
 void KnobHelper::setAnimationEnabled(bool val)
 {
     _imp->isAnimationEnabled = val;
@@ -938,6 +961,61 @@ KnobHolder::~KnobHolder()
     }
 }
 
+/***************************KNOBS VALUES SNAPSHOT******************************************/
+
+KnobsValuesSnapshot::KnobsValuesSnapshot(const KnobHolder* holder,SequenceTime time)
+: _time(time)
+, _entries()
+, _values()
+{
+    assert(holder);
+    const std::vector< boost::shared_ptr<KnobI> >& knobs = holder->getKnobs();
+    _entries.reserve(knobs.size());
+    for (U32 i = 0; i < knobs.size(); ++i) {
+        Knob<int>* isInt = dynamic_cast<Knob<int>*>(knobs[i].get());
+        Knob<bool>* isBool = dynamic_cast<Knob<bool>*>(knobs[i].get());
+        Knob<double>* isDouble = dynamic_cast<Knob<double>*>(knobs[i].get());
+        if (!isInt && !isBool && !isDouble) {
+            continue;
+        }
+        Entry e;
+        e.knob = knobs[i].get();
+        e.firstValue = (int)_values.size();
+        e.dimension = knobs[i]->getDimension();
+        ///getValueAtTime() resolves the master/slave links and interpolates the curves
+        for (int d = 0; d < e.dimension; ++d) {
+            if (isInt) {
+                _values.push_back(isInt->getValueAtTime(time, d));
+            } else if (isBool) {
+                _values.push_back(isBool->getValueAtTime(time, d));
+            } else {
+                _values.push_back(isDouble->getValueAtTime(time, d));
+            }
+        }
+        _entries.push_back(e);
+    }
+    std::sort(_entries.begin(), _entries.end(), compareEntries);
+}
+
+bool KnobsValuesSnapshot::compareEntries(const Entry& a,const Entry& b)
+{
+    return std::less<const KnobI*>()(a.knob, b.knob);
+}
+
+bool KnobsValuesSnapshot::getValue(const KnobI* knob,int dimension,double* value) const
+{
+    Entry key;
+    key.knob = knob;
+    key.firstValue = 0;
+    key.dimension = 0;
+    std::vector<Entry>::const_iterator found = std::lower_bound(_entries.begin(), _entries.end(), key, compareEntries);
+    if (found == _entries.end() || found->knob != knob || dimension < 0 || dimension >= found->dimension) {
+        return false;
+    }
+    *value = _values[found->firstValue + dimension];
+    return true;
+}
+
 KnobHolder::MultipleParamsEditLevel KnobHolder::getMultipleParamsEditLevel() const
 {
     QMutexLocker l(&_imp->paramsEditLevelMutex);
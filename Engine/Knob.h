@@ -24,10 +24,12 @@
 
 class Curve;
 class KeyFrame;
+class Hash64;
 class KnobHolder;
 class AppInstance;
 class KnobSerialization;
 class StringAnimationManager;
+class KnobsValuesSnapshot;
 
 namespace Natron {
 class OfxParamOverlayInteract;
@@ -227,6 +229,13 @@ public:
      **/
     virtual const std::vector< boost::shared_ptr<Curve>  >& getCurves() const = 0;
     
+    /**
+     * @brief Appends the content of the knob to the hash: for each dimension either its value or, if animated,
+     * all its keyframes (time, value, interpolation and derivatives). This is used by the content-based node hashing
+     * so that 2 knobs with the same values produce the same hash, regardless of the node or project holding them. MT-safe
+     **/
+    virtual void appendToHash(Hash64* hash) const = 0;
+    
     /**
      * @brief Activates or deactivates the animation for this parameter. On the GUI side that means
      * the user can never interact with the animation curves nor can he/she set any keyframe.
@@ -804,6 +813,16 @@ protected:
      * e.g: The File_Knob parses the files list to create a pattern for the files list.
      **/
     virtual void processNewValue(Natron::ValueChangedReason /*reason*/){}
+    
+    /**
+     * @brief If the calling thread is rendering the holder of this knob, returns in value the value
+     * that was captured for the given dimension when the render started.
+     * @returns False if there is no such value, in which case the knob must be read normally.
+     **/
+    bool getRenderSnapshotValue(int dimension,double* value) const WARN_UNUSED_RETURN;
+    
+    ///Same as getRenderSnapshotValue() but only succeeds if the render is at the given time
+    bool getRenderSnapshotValueAtTime(double time,int dimension,double* value) const WARN_UNUSED_RETURN;
 
     boost::shared_ptr<KnobSignalSlotHandler> _signalSlotHandler;
     
@@ -960,10 +979,14 @@ public:
     
     virtual void clone(const boost::shared_ptr<KnobI>& other,SequenceTime offset, const RangeD* range) OVERRIDE FINAL;
     
+    virtual void appendToHash(Hash64* hash) const OVERRIDE;
+    
 private:
     
     void cloneValues(const boost::shared_ptr<KnobI>& other);
     
+    static void appendValueToHash(Hash64* hash,const T& value);
+    
     T getValueFromMaster(int dimension);
     
     void valueToVariant(const T& v,Variant* vari);
@@ -1041,6 +1064,42 @@ private:
 };
 
 
+/**
+ * @brief The values of all the int, bool and double knobs of a holder at a given time, with the
+ * master/slave links resolved. An effect captures it once before calling its render action: all
+ * the tiles of the render then read the same parameters, without locking the knobs.
+ * It is immutable once built and can be shared by any number of threads.
+ **/
+class KnobsValuesSnapshot
+{
+public:
+    
+    KnobsValuesSnapshot(const KnobHolder* holder,SequenceTime time);
+    
+    SequenceTime getTime() const { return _time; }
+    
+    /**
+     * @brief Returns in value the value of the knob in the given dimension.
+     * @returns False if the knob was not captured (e.g: it is a string knob) or the dimension is out of range.
+     **/
+    bool getValue(const KnobI* knob,int dimension,double* value) const WARN_UNUSED_RETURN;
+    
+private:
+    
+    struct Entry
+    {
+        const KnobI* knob;
+        int firstValue; //< index in _values of the first dimension of the knob
+        int dimension;
+    };
+    
+    static bool compareEntries(const Entry& a,const Entry& b);
+    
+    SequenceTime _time;
+    std::vector<Entry> _entries; //< sorted by knob pointer
+    std::vector<double> _values;
+};
+
 /**
  * @brief A Knob holder is a class that stores Knobs and interact with them in some way.
  * It serves 2 purpose:
@@ -1088,6 +1147,12 @@ public:
     
     void setMultipleParamsEditLevel(KnobHolder::MultipleParamsEditLevel level);
     
+    /**
+     * @brief Returns the values of the knobs captured for the render the calling thread is running
+     * for this holder, or NULL if it is not rendering it. The pointer is valid until the render returns.
+     **/
+    virtual const KnobsValuesSnapshot* getKnobsValuesSnapshot() const { return NULL; }
+    
 protected:
     /**
      * @brief Equivalent to assert(actionsRecursionLevel == 0).
@@ -18,6 +18,7 @@
 #include <string>
 #include <QString>
 #include "Engine/Curve.h"
+#include "Engine/Hash64.h"
 #include "Engine/AppInstance.h"
 #include "Engine/Project.h"
 #include "Engine/TimeLine.h"
@@ -79,6 +80,12 @@ std::string Knob<std::string>::getValue(int dimension) const
 template <typename T>
 T Knob<T>::getValue(int dimension) const
 {
+    ///During a render, the values were captured when the render started: no locking
+    double snapshotValue;
+    if (getRenderSnapshotValue(dimension, &snapshotValue)) {
+        return (T)snapshotValue;
+    }
+    
     if (isAnimated(dimension)) {
         SequenceTime time;
         if (!getHolder() || !getHolder()->getApp()) {
@@ -167,6 +174,11 @@ T Knob<T>::getValueAtTime(double time, int dimension ) const
     if (dimension > getDimension() || dimension < 0) {
         throw std::invalid_argument("Knob::getValueAtTime(): Dimension out of range");
     }
+    
+    double snapshotValue;
+    if (getRenderSnapshotValueAtTime(time, dimension, &snapshotValue)) {
+        return (T)snapshotValue;
+    }
 
 
     ///if the knob is slaved to another knob, returns the other knob value
@@ -869,4 +881,41 @@ void Knob<T>::clone(const boost::shared_ptr<KnobI>& other, SequenceTime offset,
     cloneExtraData(other,offset,range);
 }
 
+template<typename T>
+void Knob<T>::appendValueToHash(Hash64* hash,const T& value)
+{
+    hash->append(value);
+}
+
+template<>
+void Knob<std::string>::appendValueToHash(Hash64* hash,const std::string& value)
+{
+    ///append the length too, otherwise "ab" + "c" would hash like "a" + "bc"
+    hash->append((U64)value.size());
+    Hash64_appendQString(hash, QString::fromUtf8(value.c_str()));
+}
+
+template<typename T>
+void Knob<T>::appendToHash(Hash64* hash) const
+{
+    int dims = getDimension();
+    for (int i = 0; i < dims; ++i) {
+        ///Take a copy of the keyframes so that the curve is not locked while we read the values
+        KeyFrameSet keys = getCurve(i)->getKeyFrames_mt_safe();
+        hash->append((U64)keys.size());
+        if (keys.empty()) {
+            appendValueToHash(hash, getValue(i));
+        } else {
+            for (KeyFrameSet::const_iterator it = keys.begin(); it != keys.end(); ++it) {
+                hash->append(it->getTime());
+                ///don't append the keyframe value directly: for strings it is an index in the StringAnimationManager
+                appendValueToHash(hash, getValueAtTime(it->getTime(), i));
+                hash->append((int)it->getInterpolation());
+                hash->append(it->getLeftDerivative());
+                hash->append(it->getRightDerivative());
+            }
+        }
+    }
+}
+
 #endif // KNOBIMPL_H
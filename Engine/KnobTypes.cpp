@@ -17,6 +17,7 @@
 #include <QCoreApplication>
 
 #include "Engine/Curve.h"
+#include "Engine/Hash64.h"
 #include "Engine/KnobFile.h"
 #include "Engine/AppInstance.h"
 #include "Engine/RotoContext.h"
@@ -1255,3 +1256,19 @@ void Parametric_Knob::loadParametricCurves(const std::list< Curve >& curves)
         ++i;
     }
 }
+
+void Parametric_Knob::appendToHash(Hash64* hash) const
+{
+    Knob<double>::appendToHash(hash);
+    for (U32 i = 0; i < _curves.size(); ++i) {
+        KeyFrameSet keys = _curves[i]->getKeyFrames_mt_safe();
+        hash->append((U64)keys.size());
+        for (KeyFrameSet::const_iterator it = keys.begin(); it != keys.end(); ++it) {
+            hash->append(it->getTime());
+            hash->append(it->getValue());
+            hash->append((int)it->getInterpolation());
+            hash->append(it->getLeftDerivative());
+            hash->append(it->getRightDerivative());
+        }
+    }
+}
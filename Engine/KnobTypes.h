@@ -704,6 +704,9 @@ private:
     
     virtual void cloneExtraData(const boost::shared_ptr<KnobI>& other, SequenceTime offset, const RangeD* range) OVERRIDE FINAL;
     
+    ///Also appends the control points of the parametric curves
+    virtual void appendToHash(Hash64* hash) const OVERRIDE FINAL;
+    
     static const std::string _typeNameStr;
 };
 
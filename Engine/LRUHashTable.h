@@ -30,513 +30,393 @@
 #include <map>
 #include <list>
 #include <utility>
+#include <cassert>
+#include <algorithm>
 #ifndef Q_MOC_RUN
-CLANG_DIAG_OFF(unknown-pragmas)
-CLANG_DIAG_OFF(redeclared-class-member)
-#include <boost/bimap/list_of.hpp>
-#include <boost/bimap/set_of.hpp>
-#include <boost/bimap/unordered_set_of.hpp>
-#include <boost/bimap.hpp>
-CLANG_DIAG_ON(redeclared-class-member)
-CLANG_DIAG_ON(unknown-pragmas)
+#include <boost/unordered_map.hpp>
 #endif
 
-//#define USE_VARIADIC_TEMPLATES
-#define NATRON_CACHE_USE_HASH
-#define NATRON_CACHE_USE_BOOST
+#include "Global/GlobalDefines.h"
 
+///The cost given by GreedyDualSizeEvictionPolicy to values whose computation time is unknown or negligible (in ms)
+#define NATRON_CACHE_MIN_COMPUTE_COST 1.
+///Values smaller than this are considered of this size by GreedyDualSizeEvictionPolicy (in bytes)
+#define NATRON_CACHE_MIN_EVICTION_SIZE 1024
 
-/**@brief 4 types of LRU caches are defined here:
+/**
+ * @brief Eviction policies of the EvictionHashTable. A policy orders the keys of a table: it gives each key a
+ * Record when it is inserted or looked-up, and the key whose record has the lowest priority is evicted first.
  *
- *- STL with hashing : std::unordered_map
- *- STL with comparison: std::map
- *- BOOST with hashing: boost::bimap with boost::unordered_set_of
- *- BOOST with comparison : boost::bimap with boost::set_of
- *
- *Using the appropriate #define , the software can be tuned to use a specific
- *underlying container version for all caches.
- *
- *USE_VARIADIC_TEMPLATES : define this if c++11 features like var args are
- *supported. It will make use of variadic templates to greatly
- *reduce the line of codes necessary, and it will also make it possible
- *to use STL with hashing (std::unordered_map), as it is defined in c++11
- *
- *NATRON_CACHE_USE_BOOST : define this to tell the compiler to use boost internally
- *for caches. Otherwise it will fallback on a STL version
- *
- *NATRON_CACHE_USE_HASH : define this to tell the compiler to use hashing
- *(std::unordered_map or boost::unordered_set_of) instead of a
- *tree-based version (std::map or boost::set_of).
- *
- *WARNING:  definining NATRON_CACHE_USE_HASH and not defining
- *NATRON_CACHE_USE_BOOST will require USE_VARIADIC_TEMPLATES to be
- *defined otherwise it will not compile. (no std::unordered_map
- *support on c++98)
+ * A policy provides:
+ * - a Record type with a priority member of type priority_type, stored along each key.
+ * - template<typename V> void onAccess(Record* record,const std::list<V>& values): the key was inserted or looked-up.
+ * - template<typename V> bool refresh(Record* record,const std::list<V>& values): called before evicting a key.
+ *   Returns true if its priority changed since onAccess(), e.g: the cost of its values became known, in which case
+ *   the key is moved in the order instead of being evicted.
+ * - void onEvicted(const Record& record).
+ * - template<typename V> static double getRank(const Record& record,const std::list<V>& values,U32 now): the rank
+ *   of the next key to be evicted, comparable between tables using the same policy (lower is evicted first). The
+ *   cache uses it to pick the shard to evict from. now is the value of the access clock shared by the tables.
  *
+ * The values must provide use_count(), getLastAccess() (the value of the shared access clock when the value was
+ * last inserted or looked-up), getSize() in bytes and getComputeCost() in milliseconds.
+ **/
+
+/**
+ * @brief The least recently used key goes first.
  **/
+class LRUEvictionPolicy
+{
+public:
+
+    typedef U64 priority_type;
+
+    struct Record
+    {
+        priority_type priority;
+
+        Record() : priority(0) {}
+    };
 
-#ifdef USE_VARIADIC_TEMPLATES // c++11 is defined as well as unordered_map
+    LRUEvictionPolicy() : _clock(0) {}
 
-#  ifndef NATRON_CACHE_USE_BOOST
+    template<typename V>
+    void onAccess(Record* record,const std::list<V>& /*values*/) { record->priority = ++_clock; }
 
-#include <unordered_map>
+    template<typename V>
+    bool refresh(Record* /*record*/,const std::list<V>& /*values*/) { return false; }
 
-// Class providing fixed-size (by number of records)
-// LRU-replacement cache of a function with signature
-// V f(K).
-// MAP should be one of std::map or std::unordered_map.
-// Variadic template args used to deal with the
-// different type argument signatures of those
-// containers; the default comparator/hash/allocator
-// will be used.
+    void onEvicted(const Record& /*record*/) {}
 
-///WARNING: Cached element must have a use_count() method that returns
-///the current reference counting of the object. Typically a shared_ptr.
+    ///The clock of a table isn't shared with the others: the age of the values is, it wraps around hence the difference
+    template<typename V>
+    static double getRank(const Record& /*record*/,const std::list<V>& values,U32 now) {
+        return -(double)(U32)(now - (U32)values.front().getLastAccess());
+    }
+
+private:
 
+    U64 _clock;
+};
 
-template <typename K,typename V,template<typename...> class MAP>
-class StlLRUHashTable
+/**
+ * @brief GreedyDual-Size: the priority of a key is L + cost / size, where the cost is the time it took to compute
+ * its values and L, the inflation, is the priority of the last key evicted. Cheap and large values go first, and
+ * values which are not used anymore age as L grows, however expensive they were.
+ *
+ * The cost of a value is usually unknown when it is inserted, since it is computed afterwards: refresh() gives a
+ * new priority, with the inflation of its last access, to a key whose cost changed before it may be evicted.
+ *
+ * Each table has its own inflation. Since the cache evicts from the table holding the lowest priority, the
+ * inflations of its shards stay close to each other.
+ **/
+class GreedyDualSizeEvictionPolicy
 {
 public:
-    typedef K key_type;
-    typedef std::list<V> value_type;
-    // Key access history, most recent at back
-    typedef std::list<key_type> key_tracker_type;
-    // Key to value and key history iterator
-    typedef MAP<key_type,std::pair<value_type,typename key_tracker_type::iterator> > key_to_value_type;
-    
-    // Constuctor specifies the cached function and
-    // the maximum number of records to be stored
-    StlLRUHashTable(){}
-    
-    // Obtain value of the cached function for k
-    typename key_to_value_type::iterator operator()(const key_type& k) {
-        // Attempt to find existing record
-        typename key_to_value_type::iterator it = _key_to_value.find(k);
-        if (it!=_key_to_value.end()) {
-            // We do have it:
-            // Update access record by moving
-            // accessed key to back of list
-            _key_tracker.splice(_key_tracker.end(),_key_tracker,(*it).second.second);
-        }
-        return it;
-    }
-    
-    void erase(typename key_to_value_type::iterator it){
-        _key_tracker.erase(it->second.second);
-        _key_to_value.erase(it);
+
+    typedef double priority_type;
+
+    struct Record
+    {
+        priority_type priority;
+        double inflation; //< value of the inflation at the last access
+        double cost; //< the cost the priority was computed with
+
+        Record() : priority(0.), inflation(0.), cost(0.) {}
+    };
+
+    GreedyDualSizeEvictionPolicy() : _inflation(0.) {}
+
+    template<typename V>
+    void onAccess(Record* record,const std::list<V>& values) {
+        record->inflation = _inflation;
+        record->cost = getCost(values);
+        record->priority = record->inflation + getPriorityOffset(record->cost,values);
     }
-    
-    typename key_to_value_type::iterator end() { return _key_to_value.end(); }
-    
-    typename key_to_value_type::iterator begin() { return _key_to_value.begin(); }
-    
-    // Record a fresh key-value pair in the cache
-    void insert(const key_type& k,const value_type& v) {
-        typename key_to_value_type::iterator found =  _key_to_value.find(k);
-        if(found != _key_to_value.end()){
-            found->second.first.push_back(v);
-        }else{
-            value_type list;
-            list.push_back(v);
-            // Create the key-value entry,
-            // linked to the usage record.
-            typename key_tracker_type::iterator it =_key_tracker.insert(_key_tracker.end(),k);
-            _key_to_value.insert(std::make_pair(k,std::make_pair(v,it)));
+
+    template<typename V>
+    bool refresh(Record* record,const std::list<V>& values) {
+        double cost = getCost(values);
+        if (cost == record->cost) {
+            return false;
         }
+        record->cost = cost;
+        record->priority = record->inflation + getPriorityOffset(cost,values);
+        return true;
     }
-    
-    void clear() {
-        _key_to_value.clear();
-        _key_tracker.clear();
+
+    void onEvicted(const Record& record) { _inflation = std::max(_inflation,record.priority); }
+
+    template<typename V>
+    static double getRank(const Record& record,const std::list<V>& /*values*/,U32 /*now*/) { return record.priority; }
+
+private:
+
+    template<typename V>
+    static double getCost(const std::list<V>& values) {
+        double cost = 0.;
+        for (typename std::list<V>::const_iterator it = values.begin(); it != values.end(); ++it) {
+            cost += it->getComputeCost();
+        }
+        return cost;
     }
-    
-    // Purge the least-recently-used element in the cache
-    std::pair<key_type,V> evict() {
-        // Assert method is never called when cache is empty
-        assert(!_key_tracker.empty());
-        // Identify least recently used key
-        const typename key_to_value_type::iterator  it  = _key_to_value.find(_key_tracker.front());
-        for(typename std::list<V>::iterator it2 = it->second.first.begin();it2!=it->second.first.end();++it2){
-            if((*it2).use_count() == 1){
-                std::pair<key_type,V> ret = std::make_pair(it->first,*it2);
-                if(it->second.first.size() == 1){
-                    // Erase both elements to completely purge record
-                    _key_to_value.erase(it);
-                    _key_tracker.pop_front();
-                }else{
-                    it->second.first.erase(it2);
-                }
-                return ret;
-            }
+
+    ///Milliseconds of computation per MB
+    template<typename V>
+    static double getPriorityOffset(double cost,const std::list<V>& values) {
+        U64 size = 0;
+        for (typename std::list<V>::const_iterator it = values.begin(); it != values.end(); ++it) {
+            size += it->getSize();
         }
-        return std::make_pair(key_type(),V());
+        size = std::max(size,(U64)NATRON_CACHE_MIN_EVICTION_SIZE);
+        return std::max(cost,NATRON_CACHE_MIN_COMPUTE_COST) * (1024. * 1024.) / (double)size;
     }
-    
-    unsigned int size() { return _container.size(); }
-    
-    
-    
-private:
-    // Key access history
-    key_tracker_type _key_tracker;
-    
-    // Key-to-value lookup
-    key_to_value_type _key_to_value;
+
+    double _inflation;
 };
 
-#  else // NATRON_CACHE_USE_BOOST
-        // Class providing fixed-size (by number of records)
-        // LRU-replacement cache of a function with signature
-        // V f(K).
-        // SET is expected to be one of boost::bimaps::set_of
-        // or boost::bimaps::unordered_set_of
-template <typename K,typename V,template <typename...> class SET>
-class BoostLRUHashTable
+/**
+ * @brief A hash table mapping each key to a list of values, whose keys are evicted in the order given by the
+ * eviction Policy (see LRUEvictionPolicy and GreedyDualSizeEvictionPolicy).
+ *
+ * Values referenced outside of the table (use_count() > 1) cannot be evicted. When evict() meets a key whose values
+ * are all in use, the key is pinned: it is moved aside, out of the eviction order, so that the following evictions
+ * don't scan it again. A pinned key goes back to the eviction order when it is looked-up, and the pinned keys are
+ * checked again once as many evictions as there are pinned keys were made, or when nothing else can be evicted.
+ * The table cannot see the values being released: when nothing else can be evicted and the last check of the
+ * pinned keys found nothing, they are checked again only once as many look-ups of the next key to evict as there
+ * are pinned keys were made, or once recheckPinnedOnNextProbe() was called. Hence finding the next key to evict is O(1) amortized, plus the O(log n) of the
+ * ordering, even while all the keys are in use.
+ *
+ * Thread safety: none, the cache protects each table with the lock of its shard.
+ **/
+template <typename K,typename V,typename Policy>
+class EvictionHashTable
 {
+    typedef std::multimap<typename Policy::priority_type,K> order_type;
+
 public:
+
     typedef K key_type;
-    typedef V value_type;
-    typedef boost::bimaps::bimap<SET<key_type>,boost::bimaps::list_of<value_type> > container_type;
-    
-    BoostLRUHashTable(){}
-    
-    // Obtain value of the cached function for k
-    typename container_type::left_iterator operator()(const key_type& k) {
-        // Attempt to find existing record
-        typename container_type::left_iterator it=_container.left.find(k);
-        if (it!=_container.left.end()) {
-            // We do have it:
-            // Update the access record view.
-            _container.right.relocate(_container.right.end(),_container.project_right(it));
+
+    struct Node
+    {
+        std::list<V> values;
+        typename Policy::Record record;
+        bool pinned;
+        typename order_type::iterator orderIt; //< valid if not pinned
+        typename std::list<K>::iterator pinnedIt; //< valid if pinned
+
+        Node() : values(), record(), pinned(false), orderIt(), pinnedIt() {}
+    };
+
+    typedef boost::unordered_map<K,Node> container_type;
+    typedef typename container_type::iterator iterator;
+
+    EvictionHashTable()
+    : _nodes()
+    , _order()
+    , _pinned()
+    , _evictionsSinceRecheck(0)
+    , _lastRecheckFoundNothing(false)
+    , _probesSinceRecheck(0)
+    , _policy()
+    {
+    }
+
+    static std::list<V>& getValues(iterator it) { return it->second.values; }
+
+    ///Look-up, the key is accessed as far as the policy is concerned
+    iterator operator()(const key_type& k) {
+        iterator it = _nodes.find(k);
+        if (it != _nodes.end()) {
+            touch(it);
         }
         return it;
     }
-    
-    void erase(typename container_type::left_iterator it){
-        _container.left.erase(it);
-    }
-    
-    // return end of the iterator
-    typename container_type::left_iterator end() {
-        return _container.left.end();
-    }
-    
-    // return begin of the iterator
-    typename container_type::left_iterator begin() {
-        return _container.left.begin();
+
+    ///Look-up which doesn't change the eviction order
+    iterator find(const key_type& k) { return _nodes.find(k); }
+
+    iterator begin() { return _nodes.begin(); }
+
+    iterator end() { return _nodes.end(); }
+
+    void erase(iterator it) {
+        if (it->second.pinned) {
+            _pinned.erase(it->second.pinnedIt);
+        } else {
+            _order.erase(it->second.orderIt);
+        }
+        _nodes.erase(it);
     }
-    
+
     void insert(const key_type& k,const V& v) {
-        // Create a new record from the key and the value
-        // bimap's list_view defaults to inserting this at
-        // the list tail (considered most-recently-used).
-        typename container_type::left_iterator found = this->operator ()(k);
-        if(found != _container.left.end()){
-            found->second.push_back(v);
-        }else{
-            value_type list;
-            list.push_back(v);
-            _container.insert(typename container_type::value_type(k,list));
+        iterator found = _nodes.find(k);
+        if (found != _nodes.end()) {
+            found->second.values.push_back(v);
+            touch(found);
+            return;
         }
+        Node& node = _nodes[k];
+        node.values.push_back(v);
+        _policy.onAccess(&node.record,node.values);
+        node.orderIt = _order.insert(std::make_pair(node.record.priority,k));
     }
-    
-    
+
     void clear() {
-        _container.clear();
-    }
-    
-    std::pair<key_type,V> evict() {
-        typename container_type::right_iterator it = _container.right.begin();
-        while(it != _container.right.end()){
-            for(typename std::list<V>::iterator it2 = it->first.begin();it2 != it->first.end();++it2){
-                if((*it2).use_count() == 1){
-                    std::pair<key_type,V> ret = std::make_pair(it->second,*it2);
-                    if(it->first.size() == 1){
-                        _container.right.erase(it);
-                    }
-                    else{
-                        it->first.erase(it2);
-                    }
-                    return ret;
-                }
-            }
-            ++it;
-        }
-        return std::make_pair(key_type(),V());
-        
+        _nodes.clear();
+        _order.clear();
+        _pinned.clear();
+        _evictionsSinceRecheck = 0;
+        _lastRecheckFoundNothing = false;
+        _probesSinceRecheck = 0;
     }
-    
-    unsigned int size(){return _container.size();}
-    
-    
-private:
-    container_type _container;
-};
-#  endif // NATRON_CACHE_USE_BOOST
 
-#else // !USE_VARIADIC_TEMPLATES
+    unsigned int size() const { return (unsigned int)_nodes.size(); }
 
-// c++98 does not support stl unordered_map + variadic templates
+    std::size_t getPinnedCount() const { return _pinned.size(); }
 
-#  ifndef NATRON_CACHE_USE_BOOST
-template <typename K,typename V>
-class StlLRUHashTable{
-public:
-    typedef K key_type;
-    typedef V value_type;
-    // Key access history, most recent at back
-    typedef std::list<key_type> key_tracker_type;
-    // Key to value and key history iterator
-    typedef std::map<key_type,std::pair<value_type,typename key_tracker_type::iterator> > key_to_value_type;
-    
-    // Constuctor specifies the cached function and
-    // the maximum number of records to be stored
-    StlLRUHashTable(){}
-    
-    // Obtain value of the cached function for k
-    typename key_to_value_type::iterator operator()(const key_type& k) {
-        // Attempt to find existing record
-        typename key_to_value_type::iterator it =_key_to_value.find(k);
-        if (it!=_key_to_value.end()) {
-            // We do have it:
-            // Update access record by moving
-            // accessed key to back of list
-            _key_tracker.splice(_key_tracker.end(),_key_tracker,(*it).second.second);
-        }
-        return it;
-    }
-    
-    void erase(typename key_to_value_type::iterator it){
-        _key_tracker.erase(it->second.second);
-        _key_to_value.erase(it);
-    }
-    
-    
-    typename key_to_value_type::iterator end() { return _key_to_value.end(); }
-    
-    
-    typename key_to_value_type::iterator begin() { return _key_to_value.begin(); }
-    
-    
-    // Record a fresh key-value pair in the cache
-    void insert(const key_type& k,const value_type& v) {
-        typename key_to_value_type::iterator found =  _key_to_value.find(k);
-        if(found != _key_to_value.end()){
-            found->second.first.push_back(v);
-        }else{
-            value_type list;
-            list.push_back(v);
-            // Create the key-value entry,
-            // linked to the usage record.
-            typename key_tracker_type::iterator it =_key_tracker.insert(_key_tracker.end(),k);
-            _key_to_value.insert(std::make_pair(k,std::make_pair(v,it)));
-        }
-    }
-    
-    void clear() {
-        _key_to_value.clear();
-        _key_tracker.clear();
+    /**
+     * @brief Makes the next probe check the pinned keys again even if the last check found them all in use.
+     * The table cannot see the values being released: callers knowing they were call this.
+     **/
+    void recheckPinnedOnNextProbe() {
+        _lastRecheckFoundNothing = false;
     }
-    
-    // Purge the least-recently-used element in the cache
+
+    /**
+     * @brief Removes a value which isn't used anywhere else from the key to evict first.
+     * @returns A NULL value if all the values are in use.
+     **/
     std::pair<key_type,V> evict() {
-        // Assert method is never called when cache is empty
-        assert(!_key_tracker.empty());
-        // Identify least recently used key
-        const typename key_to_value_type::iterator  it  = _key_to_value.find(_key_tracker.front());
-        for(typename std::list<V>::iterator it2 = it->second.first.begin();it2!=it->second.first.end();++it2){
-            if((*it2).use_count() == 1){
+        iterator it = nextVictim();
+        if (it == _nodes.end()) {
+            return std::make_pair(key_type(),V());
+        }
+        std::list<V>& values = it->second.values;
+        for (typename std::list<V>::iterator it2 = values.begin(); it2 != values.end(); ++it2) {
+            if (it2->use_count() == 1) {
                 std::pair<key_type,V> ret = std::make_pair(it->first,*it2);
-                if(it->second.first.size() == 1){
-                    // Erase both elements to completely purge record
-                    _key_to_value.erase(it);
-                    _key_tracker.pop_front();
-                }else{
-                    it->second.first.erase(it2);
+                values.erase(it2);
+                _policy.onEvicted(it->second.record);
+                if (values.empty()) {
+                    erase(it);
                 }
+                ++_evictionsSinceRecheck;
                 return ret;
             }
         }
+        assert(false); // nextVictim() returns only keys with a value not in use
         return std::make_pair(key_type(),V());
     }
-    
-    unsigned int size() { return _key_to_value.size(); }
-    
-    
-private:
-    // Key access history
-    key_tracker_type _key_tracker;
-    
-    // Key-to-value lookup
-    key_to_value_type _key_to_value;
-};
-
-#  else // NATRON_CACHE_USE_BOOST
 
-#    ifdef NATRON_CACHE_USE_HASH
-template <typename K,typename V>
-class BoostLRUHashTable{
-public:
-    typedef K key_type;
-    typedef std::list<V> value_type;
-    typedef boost::bimaps::bimap<boost::bimaps::unordered_set_of<key_type>,boost::bimaps::list_of<value_type> > container_type;
-    
-    BoostLRUHashTable(){}
-    
-    typename container_type::left_iterator operator()(const key_type& k) {
-        // Attempt to find existing record
-        typename container_type::left_iterator it=_container.left.find(k);
-        if (it!=_container.left.end()) {
-            // We do have it:
-            // Update the access record view.
-            _container.right.relocate(_container.right.end(),_container.project_right(it));
+    /**
+     * @brief Returns in rank the Policy::getRank() of the key that evict() would pick, false if all the values are
+     * in use. The access clock shared by the tables is now.
+     **/
+    bool getNextVictimRank(U32 now,double* rank) {
+        iterator it = nextVictim();
+        if (it == _nodes.end()) {
+            return false;
         }
-        return it;
-    }
-    
-    void erase(typename container_type::left_iterator it){
-        _container.left.erase(it);
+        *rank = Policy::getRank(it->second.record,it->second.values,now);
+        return true;
     }
 
-    
-    // return end of the iterator
-    typename container_type::left_iterator end() {
-        return _container.left.end();
-    }
-    
-    // return begin of the iterator
-    typename container_type::left_iterator begin() {
-        return _container.left.begin();
-    }
-    
-    void insert(const key_type& k,const V& v) {
-        // Create a new record from the key and the value
-        // bimap's list_view defaults to inserting this at
-        // the list tail (considered most-recently-used).
-        typename container_type::left_iterator found = this->operator ()(k);
-        if(found != _container.left.end()){
-            found->second.push_back(v);
-        }else{
-            value_type list;
-            list.push_back(v);
-            _container.insert(typename container_type::value_type(k,list));
-        }
-    }
-    
-    
-    void clear() {
-        _container.clear();
-    }
-    
-    std::pair<key_type,V> evict() {
-        typename container_type::right_iterator it = _container.right.begin();
-        while(it != _container.right.end()){
-            for(typename std::list<V>::iterator it2 = it->first.begin();it2 != it->first.end();++it2){
-                if(it2->_entry.use_count() == 1){
-                    std::pair<key_type,V> ret = std::make_pair(it->second,*it2);
-                    if(it->first.size() == 1){
-                        _container.right.erase(it);
-                    }else{
-                        it->first.erase(it2);
-                    }
-                    return ret;
-                }
+private:
+
+    static bool hasUnusedValue(const std::list<V>& values) {
+        for (typename std::list<V>::const_iterator it = values.begin(); it != values.end(); ++it) {
+            if (it->use_count() == 1) {
+                return true;
             }
-            ++it;
         }
-        return std::make_pair(key_type(),V());
-        
+        return false;
     }
-    
-    unsigned int size() { return _container.size(); }
-    
-private:
-    container_type _container;
-};
 
-#    else // !NATRON_CACHE_USE_HASH
-
-template <typename K,typename V>
-class BoostLRUHashTable{
-public:
-    typedef K key_type;
-    typedef V value_type;
-    typedef boost::bimaps::bimap<boost::bimaps::set_of<key_type>,boost::bimaps::list_of<value_type> > container_type;
-    
-    BoostLRUHashTable(){}
-    
-    typename container_type::left_iterator operator()(const key_type& k) {
-        // Attempt to find existing record
-        typename container_type::left_iterator it=_container.left.find(k);
-        if (it!=_container.left.end()) {
-            // We do have it:
-            // Update the access record view.
-            _container.right.relocate(_container.right.end(),_container.project_right(it));
+    void touch(iterator it) {
+        Node& node = it->second;
+        _policy.onAccess(&node.record,node.values);
+        if (node.pinned) {
+            _pinned.erase(node.pinnedIt);
+            node.pinned = false;
+        } else {
+            _order.erase(node.orderIt);
         }
-        return it;
-    }
-    
-    void erase(typename container_type::left_iterator it){
-        _container.left.erase(it);
-    }
-    
-    // return end of the iterator
-    typename container_type::left_iterator end() {
-        return _container.left.end();
+        node.orderIt = _order.insert(std::make_pair(node.record.priority,it->first));
     }
-    
-    // return begin of the iterator
-    typename container_type::left_iterator begin() {
-        return _container.left.begin();
+
+    void pin(iterator it) {
+        Node& node = it->second;
+        assert(!node.pinned);
+        _order.erase(node.orderIt);
+        node.pinned = true;
+        node.pinnedIt = _pinned.insert(_pinned.end(),it->first);
     }
-    void insert(const key_type& k,const V& v) {
-        // Create a new record from the key and the value
-        // bimap's list_view defaults to inserting this at
-        // the list tail (considered most-recently-used).
-        typename container_type::left_iterator found = this->operator ()(k);
-        if(found != _container.left.end()){
-            found->second.push_back(v);
-        }else{
-            value_type list;
-            list.push_back(v);
-            _container.insert(typename container_type::value_type(k,list));
+
+    ///Puts back in the eviction order the pinned keys that have a value not in use anymore
+    void recheckPinned() {
+        bool foundSome = false;
+        for (typename std::list<K>::iterator it = _pinned.begin(); it != _pinned.end();) {
+            iterator found = _nodes.find(*it);
+            assert(found != _nodes.end() && found->second.pinned);
+            if (hasUnusedValue(found->second.values)) {
+                Node& node = found->second;
+                node.pinned = false;
+                node.orderIt = _order.insert(std::make_pair(node.record.priority,found->first));
+                it = _pinned.erase(it);
+                foundSome = true;
+            } else {
+                ++it;
+            }
         }
+        _evictionsSinceRecheck = 0;
+        _lastRecheckFoundNothing = !foundSome;
+        _probesSinceRecheck = 0;
     }
-    
-    
-    void clear() {
-        _container.clear();
-    }
-    
-    std::pair<key_type,V> evict() {
-        typename container_type::right_iterator it = _container.right.begin();
-        while(it != _container.right.end()){
-            for(typename std::list<V>::iterator it2 = it->first.begin();it2 != it->first.end();++it2){
-                if((*it2).use_count() == 1){
-                    std::pair<key_type,V> ret = std::make_pair(it->second,*it2);
-                    if(it->first.size() == 1){
-                        _container.right.erase(it);
-                    }
-                    else{
-                        it->first.erase(it2);
-                    }
-                    return ret;
+
+    ///The key evict() would pick, end() if all the values are in use
+    iterator nextVictim() {
+        if (!_pinned.empty() && _evictionsSinceRecheck >= _pinned.size()) {
+            recheckPinned();
+        }
+        bool recheckedPinned = false;
+        for (;;) {
+            if (_order.empty()) {
+                if (_pinned.empty() || recheckedPinned) {
+                    return _nodes.end();
+                }
+                ///all the keys were in use the last time: don't scan them again on every probe
+                if (_lastRecheckFoundNothing && ++_probesSinceRecheck < _pinned.size()) {
+                    return _nodes.end();
                 }
+                recheckPinned();
+                recheckedPinned = true;
+                continue;
+            }
+            iterator it = _nodes.find(_order.begin()->second);
+            assert(it != _nodes.end());
+            Node& node = it->second;
+            if (_policy.refresh(&node.record,node.values)) {
+                _order.erase(node.orderIt);
+                node.orderIt = _order.insert(std::make_pair(node.record.priority,it->first));
+                continue;
+            }
+            if (hasUnusedValue(node.values)) {
+                return it;
             }
-            ++it;
+            pin(it);
         }
-        return std::make_pair(key_type(),V());
-        
     }
-    unsigned int size() { return _container.size(); }
-    
-private:
-    container_type _container;
-};
-#    endif // !NATRON_CACHE_USE_HASH
-#  endif // NATRON_CACHE_USE_BOOST
 
-#endif // !USE_VARIADIC_TEMPLATES
+    container_type _nodes;
+    order_type _order; //< the keys which are not pinned, by priority
+    std::list<K> _pinned;
+    std::size_t _evictionsSinceRecheck;
+    bool _lastRecheckFoundNothing; //< true if the last recheckPinned() didn't put any key back in the order
+    std::size_t _probesSinceRecheck; //< calls to nextVictim() which found nothing to evict since recheckPinned()
+    Policy _policy;
+};
 
 #endif
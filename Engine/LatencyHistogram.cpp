@@ -0,0 +1,101 @@
+//  Natron
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "LatencyHistogram.h"
+
+#include <sstream>
+
+using namespace Natron;
+
+LatencyHistogram::LatencyHistogram()
+{
+    for (int i = 0; i < NATRON_LATENCY_HISTOGRAM_BUCKETS_COUNT; ++i) {
+        _buckets[i] = 0;
+    }
+}
+
+int
+LatencyHistogram::getBucketIndex(qint64 nanoseconds)
+{
+    qint64 us = nanoseconds / 1000;
+    int index = 0;
+    while (us > 0 && index < NATRON_LATENCY_HISTOGRAM_BUCKETS_COUNT - 1) {
+        us >>= 1;
+        ++index;
+    }
+    return index;
+}
+
+double
+LatencyHistogram::getBucketUpperBound(int index)
+{
+    return (double)((U64)1 << index);
+}
+
+void
+LatencyHistogram::record(qint64 nanoseconds)
+{
+    _buckets[getBucketIndex(nanoseconds)].fetchAndAddRelaxed(1);
+}
+
+void
+LatencyHistogram::getBuckets(std::vector<U64>* counts) const
+{
+    counts->resize(NATRON_LATENCY_HISTOGRAM_BUCKETS_COUNT);
+    for (int i = 0; i < NATRON_LATENCY_HISTOGRAM_BUCKETS_COUNT; ++i) {
+        (*counts)[i] = (U64)(int)_buckets[i];
+    }
+}
+
+U64
+LatencyHistogram::getCount() const
+{
+    U64 count = 0;
+    for (int i = 0; i < NATRON_LATENCY_HISTOGRAM_BUCKETS_COUNT; ++i) {
+        count += (U64)(int)_buckets[i];
+    }
+    return count;
+}
+
+double
+LatencyHistogram::getPercentile(double fraction) const
+{
+    std::vector<U64> counts;
+    getBuckets(&counts);
+    U64 total = 0;
+    for (U32 i = 0; i < counts.size(); ++i) {
+        total += counts[i];
+    }
+    if (!total) {
+        return 0.;
+    }
+    ///the smallest bucket such that at least fraction of the samples are in it or below
+    double needed = fraction * total;
+    U64 cumulated = 0;
+    for (U32 i = 0; i < counts.size(); ++i) {
+        cumulated += counts[i];
+        if (counts[i] && cumulated >= needed) {
+            return getBucketUpperBound(i);
+        }
+    }
+    return getBucketUpperBound(NATRON_LATENCY_HISTOGRAM_BUCKETS_COUNT - 1);
+}
+
+void
+LatencyHistogram::reset()
+{
+    for (int i = 0; i < NATRON_LATENCY_HISTOGRAM_BUCKETS_COUNT; ++i) {
+        _buckets[i] = 0;
+    }
+}
+
+std::string
+LatencyHistogram::toString() const
+{
+    std::ostringstream ss;
+    ss << getCount() << " samples, p50 < " << getPercentile(0.5) << " us, p99 < " << getPercentile(0.99)
+    << " us, max < " << getPercentile(1.) << " us";
+    return ss.str();
+}
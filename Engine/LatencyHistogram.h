@@ -0,0 +1,68 @@
+//  Natron
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef NATRON_ENGINE_LATENCYHISTOGRAM_H_
+#define NATRON_ENGINE_LATENCYHISTOGRAM_H_
+
+#include <string>
+#include <vector>
+
+#include "Global/Macros.h"
+CLANG_DIAG_OFF(deprecated)
+#include <QtCore/QAtomicInt>
+CLANG_DIAG_ON(deprecated)
+#ifndef Q_MOC_RUN
+#include <boost/noncopyable.hpp>
+#endif
+
+#include "Global/GlobalDefines.h"
+
+///Bucket i counts the durations in [2^(i-1),2^i) microseconds, the last one everything above
+#define NATRON_LATENCY_HISTOGRAM_BUCKETS_COUNT 32
+
+namespace Natron {
+
+/**
+ * @brief Counts durations in buckets of powers of 2 microseconds: bucket 0 counts the durations under 1 us,
+ * bucket i those in [2^(i-1),2^i) us.
+ *
+ * Thread safety: all functions are thread-safe and record() is lock-free, so that it can be called on hot paths.
+ **/
+class LatencyHistogram : boost::noncopyable
+{
+public:
+
+    LatencyHistogram();
+
+    void record(qint64 nanoseconds);
+
+    U64 getCount() const;
+
+    /**
+     * @brief Returns the upper bound, in microseconds, of the bucket holding the given fraction (in [0,1]) of
+     * the durations recorded, e.g: getPercentile(0.99) for the 99th percentile. Returns 0 if nothing was recorded.
+     **/
+    double getPercentile(double fraction) const;
+
+    void getBuckets(std::vector<U64>* counts) const;
+
+    void reset();
+
+    ///e.g: "1200 samples, p50 < 16 us, p99 < 512 us, max < 1024 us"
+    std::string toString() const;
+
+    static int getBucketIndex(qint64 nanoseconds);
+
+    ///The upper bound of the given bucket, in microseconds
+    static double getBucketUpperBound(int index);
+
+private:
+
+    QAtomicInt _buckets[NATRON_LATENCY_HISTOGRAM_BUCKETS_COUNT];
+};
+
+} // namespace Natron
+
+#endif // NATRON_ENGINE_LATENCYHISTOGRAM_H_
@@ -12,9 +12,35 @@
 #include "Lut.h"
 
 #include <cstring> // for memcpy
+#include <algorithm>
+#include <vector>
+#include <limits>
+#include <stdexcept>
+
+CLANG_DIAG_OFF(deprecated)
+#include <QtCore/QThreadStorage>
+#include <QtCore/QAtomicInt>
+CLANG_DIAG_ON(deprecated)
 
 #include "Engine/Rect.h"
 
+///The SSE2 kernels are always compiled on x86-64, the AVX2 ones are compiled with a function attribute
+///so that no particular compiler flag is needed, they are only used if the CPU supports them.
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define NATRON_LUT_SSE2
+#include <emmintrin.h>
+#if defined(__clang__) || (defined(__GNUC__) && (__GNUC__ * 100 + __GNUC_MINOR__) >= 409)
+#define NATRON_LUT_AVX2
+#define NATRON_LUT_AVX2_FUNCTION __attribute__((target("avx2")))
+#include <immintrin.h>
+#elif defined(_MSC_VER) && _MSC_VER >= 1700
+#define NATRON_LUT_AVX2
+#define NATRON_LUT_AVX2_FUNCTION
+#include <immintrin.h>
+#include <intrin.h>
+#endif
+#endif
+
 namespace Natron {
     namespace Color {
         
@@ -82,6 +108,216 @@ namespace Natron {
         }
         
         
+        ///////////////////////
+        /////////////////////////////////////////// KERNELS //////////////////////////////////////////////
+        ///////////////////////
+        
+        ///Fills dst with the table entries of the 4 channels of count packed float pixels, premultiplied
+        ///by their alpha (the 4th channel) if premult is true. The value computed for the alpha channel is unused.
+        typedef void (*ToUint8xxRowKernel)(const unsigned short* table,const float* src,int count,bool premult,unsigned short* dst);
+        
+        ///Converts count packed 8 bits pixels to float: the 3 first channels through the table, the 4th (alpha) linearly.
+        typedef void (*FromUint8RowKernel)(const float* table,const unsigned char* src,int count,float* dst);
+        
+        static void toUint8xxRow_scalar(const unsigned short* table,const float* src,int count,bool premult,unsigned short* dst)
+        {
+            for (int i = 0; i < count; ++i, src += 4, dst += 4) {
+                float a = premult ? src[3] : 1.f;
+                dst[0] = table[hipart(src[0] * a)];
+                dst[1] = table[hipart(src[1] * a)];
+                dst[2] = table[hipart(src[2] * a)];
+            }
+        }
+        
+        static void fromUint8Row_scalar(const float* table,const unsigned char* src,int count,float* dst)
+        {
+            for (int i = 0; i < count; ++i, src += 4, dst += 4) {
+                dst[0] = table[src[0]];
+                dst[1] = table[src[1]];
+                dst[2] = table[src[2]];
+                dst[3] = Color::intToFloat<256>(src[3]);
+            }
+        }
+        
+#ifdef NATRON_LUT_SSE2
+        ///SSE2 has no gather: only the premultiplication and the index computation are vectorized
+        static void toUint8xxRow_SSE2(const unsigned short* table,const float* src,int count,bool premult,unsigned short* dst)
+        {
+            union {
+                __m128i v;
+                unsigned int i[4];
+            } idx;
+            for (int i = 0; i < count; ++i, src += 4, dst += 4) {
+                __m128 p = _mm_loadu_ps(src);
+                if (premult) {
+                    p = _mm_mul_ps(p, _mm_shuffle_ps(p, p, _MM_SHUFFLE(3,3,3,3)));
+                }
+                ///the hipart of a float is its 16 most significant bits
+                idx.v = _mm_srli_epi32(_mm_castps_si128(p), 16);
+                dst[0] = table[idx.i[0]];
+                dst[1] = table[idx.i[1]];
+                dst[2] = table[idx.i[2]];
+            }
+        }
+#endif
+        
+#ifdef NATRON_LUT_AVX2
+        NATRON_LUT_AVX2_FUNCTION
+        static void toUint8xxRow_AVX2(const unsigned short* table,const float* src,int count,bool premult,unsigned short* dst)
+        {
+            const __m256i lowMask = _mm256_set1_epi32(0xffff);
+            int i = 0;
+            ///2 pixels per iteration
+            for (; i + 2 <= count; i += 2, src += 8, dst += 8) {
+                __m256 p = _mm256_loadu_ps(src);
+                if (premult) {
+                    p = _mm256_mul_ps(p, _mm256_permute_ps(p, 0xff));
+                }
+                __m256i idx = _mm256_srli_epi32(_mm256_castps_si256(p), 16);
+                ///gather 32 bits at table + 2 * idx and keep the low 16 bits (x86 is little endian)
+                __m256i v = _mm256_and_si256(_mm256_i32gather_epi32((const int*)table, idx, 2), lowMask);
+                v = _mm256_permute4x64_epi64(_mm256_packus_epi32(v, v), _MM_SHUFFLE(3,1,2,0));
+                _mm_storeu_si128((__m128i*)dst, _mm256_castsi256_si128(v));
+            }
+            if (i < count) {
+                toUint8xxRow_SSE2(table, src, count - i, premult, dst);
+            }
+        }
+        
+        NATRON_LUT_AVX2_FUNCTION
+        static void fromUint8Row_AVX2(const float* table,const unsigned char* src,int count,float* dst)
+        {
+            const __m256 maxValue = _mm256_set1_ps(255.f);
+            int i = 0;
+            for (; i + 2 <= count; i += 2, src += 8, dst += 8) {
+                __m256i bytes = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)src));
+                __m256 colors = _mm256_i32gather_ps(table, bytes, 4);
+                __m256 alphas = _mm256_div_ps(_mm256_cvtepi32_ps(bytes), maxValue);
+                _mm256_storeu_ps(dst, _mm256_blend_ps(colors, alphas, 0x88));
+            }
+            if (i < count) {
+                fromUint8Row_scalar(table, src, count - i, dst);
+            }
+        }
+#endif
+        
+        static SIMDLevel detectSIMDLevel()
+        {
+#if defined(NATRON_LUT_AVX2) && defined(_MSC_VER)
+            int info[4];
+            __cpuid(info, 0);
+            if (info[0] >= 7) {
+                __cpuid(info, 1);
+                ///the OS must save the YMM registers (OSXSAVE + AVX, then XCR0)
+                bool osxsaveAndAvx = (info[2] & (1 << 27)) && (info[2] & (1 << 28));
+                if (osxsaveAndAvx && (_xgetbv(0) & 6) == 6) {
+                    __cpuidex(info, 7, 0);
+                    if (info[1] & (1 << 5)) {
+                        return SIMD_AVX2;
+                    }
+                }
+            }
+            return SIMD_SSE2;
+#elif defined(NATRON_LUT_AVX2)
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("avx2") ? SIMD_AVX2 : SIMD_SSE2;
+#elif defined(NATRON_LUT_SSE2)
+            return SIMD_SSE2;
+#else
+            return SIMD_NONE;
+#endif
+        }
+        
+        static QAtomicInt gSIMDLevel(-1); //< -1 until detected
+        
+        SIMDLevel getSupportedSIMDLevel()
+        {
+            static SIMDLevel supported = detectSIMDLevel();
+            return supported;
+        }
+        
+        SIMDLevel getSIMDLevel()
+        {
+            int level = gSIMDLevel;
+            if (level < 0) {
+                level = getSupportedSIMDLevel();
+                gSIMDLevel.testAndSetOrdered(-1, level);
+            }
+            return (SIMDLevel)level;
+        }
+        
+        void setSIMDLevel(SIMDLevel level)
+        {
+            gSIMDLevel.fetchAndStoreOrdered(std::min(level, getSupportedSIMDLevel()));
+        }
+        
+        static ToUint8xxRowKernel getToUint8xxRowKernel()
+        {
+            switch (getSIMDLevel()) {
+#ifdef NATRON_LUT_AVX2
+                case SIMD_AVX2:
+                    return toUint8xxRow_AVX2;
+#endif
+#ifdef NATRON_LUT_SSE2
+                case SIMD_SSE2:
+                    return toUint8xxRow_SSE2;
+#endif
+                default:
+                    return toUint8xxRow_scalar;
+            }
+        }
+        
+        static FromUint8RowKernel getFromUint8RowKernel()
+        {
+#ifdef NATRON_LUT_AVX2
+            if (getSIMDLevel() == SIMD_AVX2) {
+                return fromUint8Row_AVX2;
+            }
+#endif
+            ///without gather there's nothing to vectorize, the loads dominate
+            return fromUint8Row_scalar;
+        }
+        
+        int getDitherStart(int seed,int width)
+        {
+            if (width <= 0) {
+                return 0;
+            }
+            ///finalizer of MurmurHash3
+            unsigned int h = (unsigned int)seed;
+            h ^= h >> 16;
+            h *= 0x85ebca6bU;
+            h ^= h >> 13;
+            h *= 0xc2b2ae35U;
+            h ^= h >> 16;
+            return (int)(h % (unsigned int)width);
+        }
+        
+        ///Used by the planar conversions which don't know which scan-line they convert: each thread has
+        ///its own xorshift generator, with the same seed, so there is no shared state.
+        struct DitherRNG
+        {
+            unsigned int state;
+            
+            DitherRNG() : state(2463534242U) {}
+            
+            int next(int width) {
+                state ^= state << 13;
+                state ^= state >> 17;
+                state ^= state << 5;
+                return width > 0 ? (int)(state % (unsigned int)width) : 0;
+            }
+        };
+        
+        static int getThreadDitherStart(int width)
+        {
+            static QThreadStorage<DitherRNG*> rng;
+            if (!rng.hasLocalData()) {
+                rng.setLocalData(new DitherRNG);
+            }
+            return rng.localData()->next(width);
+        }
+        
         ///initialize the singleton
         LutManager LutManager::m_instance = LutManager();
         
@@ -191,6 +427,12 @@ namespace Natron {
             return toFunc_hipart_to_uint8xx[hipart(v)];
         }
 
+        void Lut::to_uint8xx_rgba_row(unsigned short* to,const float* from,int W) const
+        {
+            assert(init_);
+            getToUint8xxRowKernel()(toFunc_hipart_to_uint8xx, from, W, false, to);
+        }
+        
         // the following only works for increasing LUTs
         unsigned short Lut::toColorSpaceUint16FromLinearFloatFast(float v) const
         {
@@ -251,6 +493,7 @@ namespace Natron {
             if (init_) {
                 return;
             }
+            toFunc_hipart_to_uint8xx[0x10000] = 0;
             // fill all
             for (int i = 0; i < 0x10000; ++i) {
                 float inp = index_to_float((unsigned short)i);
@@ -274,7 +517,7 @@ namespace Natron {
         void Lut::to_byte_planar(unsigned char* to, const float* from,int W,const float* alpha,int inDelta,int outDelta) const {
             validate();
             unsigned char *end = to + W * outDelta;
-            int start = rand() % W;
+            int start = getThreadDitherStart(W);
             const float *q;
             unsigned char *p;
             unsigned error;
@@ -338,7 +581,8 @@ namespace Natron {
         
         void Lut::to_byte_packed(unsigned char* to, const float* from,const RectI& conversionRect,
                                  const RectI& srcRoD,const RectI& dstRoD,
-                                 PixelPacking inputPacking,PixelPacking outputPacking,bool invertY,bool premult) const {
+                                 PixelPacking inputPacking,PixelPacking outputPacking,bool invertY,bool premult,
+                                 std::vector<unsigned short>* scratch) const {
             
            
             ///clip the conversion rect to srcRoD and dstRoD
@@ -362,8 +606,20 @@ namespace Natron {
             
             validate();
             
+            int width = rect.x2 - rect.x1;
+            if (width <= 0) {
+                return;
+            }
+            ///the table values of a scan-line, 4 per pixel in the input order
+            std::vector<unsigned short> localRow;
+            std::vector<unsigned short>& row = scratch ? *scratch : localRow;
+            if (row.size() < (std::size_t)width * 4) {
+                row.resize((std::size_t)width * 4);
+            }
+            ToUint8xxRowKernel kernel = inputHasAlpha ? getToUint8xxRowKernel() : NULL;
+            
             for (int y = rect.y1; y < rect.y2; ++y) {
-                int start = rand() % (rect.x2 - rect.x1) + rect.x1;
+                int start = getDitherStart(y, width) + rect.x1;
                 unsigned error_r, error_g, error_b;
                 error_r = error_g = error_b = 0x80;
                 int srcY = y;
@@ -376,21 +632,37 @@ namespace Natron {
                 
                 const float *src_pixels = from + (srcY * (srcRoD.x2 - srcRoD.x1) * inPackingSize);
                 unsigned char *dst_pixels = to + (dstY * (dstRoD.x2 - dstRoD.x1) * outPackingSize);
+                
+                ///the look-ups don't depend on each other, do them all first so that they can be vectorized.
+                ///Only the error diffusion is sequential.
+                if (kernel) {
+                    kernel(toFunc_hipart_to_uint8xx, src_pixels + rect.x1 * inPackingSize, width, premult, &row[0]);
+                } else {
+                    for (int x = rect.x1; x < rect.x2; ++x) {
+                        const float* src = src_pixels + x * inPackingSize;
+                        unsigned short* dst = &row[(x - rect.x1) * 4];
+                        dst[inROffset] = toFunc_hipart_to_uint8xx[hipart(src[inROffset])];
+                        dst[inGOffset] = toFunc_hipart_to_uint8xx[hipart(src[inGOffset])];
+                        dst[inBOffset] = toFunc_hipart_to_uint8xx[hipart(src[inBOffset])];
+                    }
+                }
+                
                 /* go fowards from starting point to end of line: */
                 for (int x = start; x < rect.x2; ++x) {
                     
                     int inCol = x * inPackingSize;
                     int outCol = x * outPackingSize;
+                    const unsigned short* values = &row[(x - rect.x1) * 4];
                     
-                    float a = (inputHasAlpha && premult) ? src_pixels[inCol + inAOffset] : 1.f;
-                    error_r = (error_r & 0xff) + toFunc_hipart_to_uint8xx[hipart(src_pixels[inCol + inROffset] * a)];
-                    error_g = (error_g & 0xff) + toFunc_hipart_to_uint8xx[hipart(src_pixels[inCol + inGOffset] * a)];
-                    error_b = (error_b & 0xff) + toFunc_hipart_to_uint8xx[hipart(src_pixels[inCol + inBOffset] * a)];
+                    error_r = (error_r & 0xff) + values[inROffset];
+                    error_g = (error_g & 0xff) + values[inGOffset];
+                    error_b = (error_b & 0xff) + values[inBOffset];
                     assert(error_r < 0x10000 && error_g < 0x10000 && error_b < 0x10000);
                     dst_pixels[outCol + outROffset] = (unsigned char)(error_r >> 8);
                     dst_pixels[outCol + outGOffset] = (unsigned char)(error_g >> 8);
                     dst_pixels[outCol + outBOffset] = (unsigned char)(error_b >> 8);
                     if(outputHasAlpha){
+                        float a = (inputHasAlpha && premult) ? src_pixels[inCol + inAOffset] : 1.f;
                         dst_pixels[outCol + outAOffset] = floatToInt<256>(a);
                     }
                 }
@@ -400,16 +672,17 @@ namespace Natron {
                     
                     int inCol = x * inPackingSize;
                     int outCol = x * outPackingSize;
+                    const unsigned short* values = &row[(x - rect.x1) * 4];
                     
-                    float a = (inputHasAlpha && premult) ? src_pixels[inCol + inAOffset] : 1.f;
-                    error_r = (error_r & 0xff) + toFunc_hipart_to_uint8xx[hipart(src_pixels[inCol + inROffset] * a)];
-                    error_g = (error_g & 0xff) + toFunc_hipart_to_uint8xx[hipart(src_pixels[inCol + inGOffset] * a)];
-                    error_b = (error_b & 0xff) + toFunc_hipart_to_uint8xx[hipart(src_pixels[inCol + inBOffset] * a)];
+                    error_r = (error_r & 0xff) + values[inROffset];
+                    error_g = (error_g & 0xff) + values[inGOffset];
+                    error_b = (error_b & 0xff) + values[inBOffset];
                     assert(error_r < 0x10000 && error_g < 0x10000 && error_b < 0x10000);
                     dst_pixels[outCol + outROffset] = (unsigned char)(error_r >> 8);
                     dst_pixels[outCol + outGOffset] = (unsigned char)(error_g >> 8);
                     dst_pixels[outCol + outBOffset] = (unsigned char)(error_b >> 8);
                     if(outputHasAlpha){
+                        float a = (inputHasAlpha && premult) ? src_pixels[inCol + inAOffset] : 1.f;
                         dst_pixels[outCol + outAOffset] = floatToInt<256>(a);
                     }
                 }
@@ -543,6 +816,13 @@ namespace Natron {
             outPackingSize = outputHasAlpha ? 4 : 3;
             
             validate();
+            
+            ///same layout on both sides and nothing to unpremultiply: convert whole scan-lines at once
+            FromUint8RowKernel kernel = NULL;
+            if (inputHasAlpha && inputPacking == outputPacking && !premult) {
+                kernel = getFromUint8RowKernel();
+            }
+            
             for (int y = rect.y1; y < rect.y2; ++y) {
                 int srcY = y;
                 if (invertY) {
@@ -551,6 +831,11 @@ namespace Natron {
                 
                 const unsigned char *src_pixels = from + (srcY * (srcRoD.x2 - srcRoD.x1) * inPackingSize);
                 float *dst_pixels = to + (y * (dstRoD.x2 - dstRoD.x1) * outPackingSize);
+                if (kernel) {
+                    kernel(fromFunc_uint8_to_float, src_pixels + rect.x1 * inPackingSize, rect.x2 - rect.x1,
+                           dst_pixels + rect.x1 * outPackingSize);
+                    continue;
+                }
                 for (int x = rect.x1; x < rect.x2; ++x) {
                     int inCol = x * inPackingSize;
                     int outCol = x * outPackingSize;
@@ -817,7 +1102,7 @@ namespace Natron {
             {
                 if(!alpha){
                     unsigned char *end = to + W * outDelta;
-                    int start = rand() % W;
+                    int start = getThreadDitherStart(W);
                     const float *q;
                     unsigned char *p;
                     /* go fowards from starting point to end of line: */
@@ -851,7 +1136,7 @@ namespace Natron {
                     }
                 }else{
                     unsigned char *end = to + W * outDelta;
-                    int start = rand() % W;
+                    int start = getThreadDitherStart(W);
                     const float *q;
                     const float *a = alpha;
                     unsigned char *p;
@@ -954,7 +1239,7 @@ namespace Natron {
                 outPackingSize = outputHasAlpha ? 4 : 3;
                 
                 for (int y = rect.y1; y < rect.y2; ++y) {
-                    int start = rand() % (rect.x2 - rect.x1) + rect.x1;
+                    int start = getDitherStart(y, rect.x2 - rect.x1) + rect.x1;
                     unsigned error_r, error_g, error_b;
                     error_r = error_g = error_b = 0x80;
                     int srcY = y;
@@ -46,6 +46,7 @@
 #include <cmath>
 #include <map>
 #include <string>
+#include <vector>
 
 #include "Global/Macros.h"
 CLANG_DIAG_OFF(deprecated)
@@ -69,6 +70,36 @@ namespace Natron {
         
         
         
+        /// @enum The instruction sets the conversion kernels of the Lut class may use
+        enum SIMDLevel {
+            SIMD_NONE = 0,
+            SIMD_SSE2,
+            SIMD_AVX2
+        };
+        
+        /**
+         * @brief Returns the best instruction set supported by both the CPU (detected at runtime) and this build.
+         **/
+        SIMDLevel getSupportedSIMDLevel();
+        
+        /**
+         * @brief Returns the instruction set currently used by the conversion kernels.
+         **/
+        SIMDLevel getSIMDLevel();
+        
+        /**
+         * @brief Restricts the instruction set used by the conversion kernels, it is clamped to getSupportedSIMDLevel().
+         * By default the best supported level is used: this is meant for testing and benchmarking.
+         **/
+        void setSIMDLevel(SIMDLevel level);
+        
+        /**
+         * @brief Returns the position in [0, width) where the error diffusion of a scan-line starts.
+         * It is a pseudo-random function of the seed only (typically the scan-line index): unlike rand()
+         * it doesn't lock anything, and converting the same image twice gives the same result.
+         **/
+        int getDitherStart(int seed,int width);
+        
         /* @brief Converts a float ranging in [0 - 1.f] in the desired color-space to linear color-space also ranging in [0 - 1.f]*/
         typedef float (*fromColorSpaceFunctionV1)(float v);
         
@@ -148,7 +179,9 @@ namespace Natron {
             
             /// the fast lookup tables are mutable, because they are automatically initialized post-construction,
             /// and never change afterwards
-            mutable unsigned short toFunc_hipart_to_uint8xx[0x10000]; /// contains  2^16 = 65536 values between 0-255
+            /// contains  2^16 = 65536 values between 0-255. The extra entry is padding: the AVX2 kernel gathers
+            /// 32 bits per lookup, so looking up the last entry reads 2 bytes past it.
+            mutable unsigned short toFunc_hipart_to_uint8xx[0x10000 + 1];
             mutable float fromFunc_uint8_to_float[256]; /// values between 0-1.f
             mutable bool init_; ///< false if the tables are not yet initialized
             mutable QMutex _lock; ///< protects init_
@@ -232,6 +265,12 @@ namespace Natron {
              * @return A float in [0 - 1.f] in linear color-space.
              */
             float fromColorSpaceUint16ToLinearFloatFast(unsigned short v) const;
+            
+            /* @brief Same as toColorSpaceUint8xxFromLinearFloatFast() applied to the 3 first channels of W packed
+             * RGBA float pixels, using the instruction set returned by getSIMDLevel().
+             * The 4th element of each output pixel is unspecified.
+             */
+            void to_uint8xx_rgba_row(unsigned short* to,const float* from,int W) const;
 
             
             /////@TODO the following functions expects a float input buffer, one could extend it to cover all bitdepths.
@@ -283,10 +322,15 @@ namespace Natron {
              should be converted with the scan-line (srcRoD.y2 - y - 1) of the
              input buffer.
              
+             \arg scratch - to_byte_packed only: if not NULL, the buffer holding the look-ups of a scan-line,
+             grown as needed, so that a caller converting many images (e.g: one per thread) allocates it once.
+             Otherwise it is allocated for the call.
+             
              **/
             void to_byte_packed(unsigned char* to, const float* from,const RectI& conversionRect,
                                 const RectI& srcRoD,const RectI& dstRoD,
-                                PixelPacking inputPacking,PixelPacking outputPacking,bool invertY,bool premult) const;
+                                PixelPacking inputPacking,PixelPacking outputPacking,bool invertY,bool premult,
+                                std::vector<unsigned short>* scratch = NULL) const;
             void to_short_packed(unsigned short* to, const float* from,const RectI& conversionRect,
                                  const RectI& srcRoD,const RectI& dstRoD,
                                  PixelPacking inputPacking,PixelPacking outputPacking,bool invertY,bool premult) const;
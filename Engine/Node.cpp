@@ -43,6 +43,7 @@
 #include "Engine/KnobTypes.h"
 #include "Engine/ImageParams.h"
 #include "Engine/RotoContext.h"
+#include "Engine/Settings.h"
 
 using namespace Natron;
 using std::make_pair;
@@ -280,8 +281,30 @@ void Node::computeHash()
         ///reset the hash value
         _imp->hash.reset();
         
-        ///append the effect's own age
-        _imp->hash.append(_imp->knobsAge);
+        bool contentBased = appPTR->getCurrentSettings()->isContentBasedNodeHashEnabled();
+        if (contentBased) {
+            ///Hash what the node actually computes instead of its history: the plug-in, its version and the
+            ///content of the parameters. The age is session dependant and would defeat sharing the cache.
+            ::Hash64_appendQString(&_imp->hash, QString(pluginID().c_str()));
+            _imp->hash.append(majorVersion());
+            _imp->hash.append(minorVersion());
+            
+            const std::vector< boost::shared_ptr<KnobI> >& knobs = _imp->liveInstance->getKnobs();
+            for (U32 i = 0; i < knobs.size(); ++i) {
+                ///the label and the preview don't have any influence on the render
+                if (knobs[i] != _imp->nodeLabelKnob && knobs[i] != _imp->previewEnabledKnob) {
+                    knobs[i]->appendToHash(&_imp->hash);
+                }
+            }
+            
+            ///Roto shapes are not knobs, rely on the age for them. Note that the age is saved in the project.
+            if (_imp->rotoContext) {
+                _imp->hash.append(_imp->knobsAge);
+            }
+        } else {
+            ///append the effect's own age
+            _imp->hash.append(_imp->knobsAge);
+        }
         
         ///append all inputs hash
         {
@@ -307,13 +330,15 @@ void Node::computeHash()
             }
         }
         
-        ///Also append the effect's label to distinguish 2 instances with the same parameters
-        ::Hash64_appendQString(&_imp->hash, QString(getName().c_str()));
-        
-        
-        ///Also append the project's creation time in the hash because 2 projects openend concurrently
-        ///could reproduce the same (especially simple graphs like Viewer-Reader)
-        _imp->hash.append(getApp()->getProject()->getProjectCreationTime());
+        if (!contentBased) {
+            ///Also append the effect's label to distinguish 2 instances with the same parameters
+            ::Hash64_appendQString(&_imp->hash, QString(getName().c_str()));
+            
+            
+            ///Also append the project's creation time in the hash because 2 projects openend concurrently
+            ///could reproduce the same (especially simple graphs like Viewer-Reader)
+            _imp->hash.append(getApp()->getProject()->getProjectCreationTime());
+        }
         
         _imp->hash.computeHash();
     }
@@ -1846,7 +1871,8 @@ boost::shared_ptr<Natron::Image> Node::getImageBeingRendered(int time,unsigned i
     for (std::list<boost::shared_ptr<Natron::Image> >::iterator it = _imp->imagesBeingRendered.begin();
          it!= _imp->imagesBeingRendered.end(); ++it) {
         const Natron::ImageKey &key = (*it)->getKey();
-        if (key._view == view && key._mipMapLevel == mipMapLevel && key._time == time) {
+        ///skip the headers of tiled images, they have no pixels: the image rendered is the one holding the tiles
+        if (key._view == view && key._mipMapLevel == mipMapLevel && key._time == time && !(*it)->isTiled()) {
             return *it;
         }
     }
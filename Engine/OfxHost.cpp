@@ -25,7 +25,6 @@
 #ifdef OFX_SUPPORTS_MULTITHREAD
 #include <QtCore/QThread>
 #include <QtCore/QThreadStorage>
-#include <QtConcurrentMap>
 #include <boost/bind.hpp>
 #endif
 
@@ -56,6 +55,7 @@
 #include "Engine/StandardPaths.h"
 #include "Engine/Settings.h"
 #include "Engine/Node.h"
+#include "Engine/TaskScheduler.h"
 
 using namespace Natron;
 
@@ -574,75 +574,33 @@ const void* Natron::OfxHost::fetchSuite(const char *suiteName, int suiteVersion)
 
 #ifdef OFX_SUPPORTS_MULTITHREAD
 
-// comment out the following to disable the use of QtConcurrent
-//#define OFX_MULTITHREAD_USES_QTCONCURRENT
-
 ///Stored as int, because we need -1
 static QThreadStorage<int> gThreadIndex;
 
 namespace {
-#ifdef OFX_MULTITHREAD_USES_QTCONCURRENT
-    static OfxStatus threadFunctionWrapper(OfxThreadFunctionV1 func,
-                                           unsigned int threadIndex,
-                                           unsigned int threadMax,
-                                           void *customArg)
+    ///Executed by the thread team of the TaskScheduler for each thread index requested by the plug-in
+    static void teamThreadFunction(OfxThreadFunctionV1 func,
+                                   unsigned int threadMax,
+                                   void *customArg,
+                                   OfxStatus *status,
+                                   unsigned int threadIndex)
     {
+        ///A render nested in a thread function clears the index (see OfxHost::clearThreadIndex())
         assert(!gThreadIndex.hasLocalData() || gThreadIndex.localData() == -1);
         assert(threadIndex < threadMax);
         gThreadIndex.localData() = (int)threadIndex;
-        OfxStatus ret = kOfxStatOK;
+        OfxStatus* stat = &status[threadIndex];
+        assert(*stat == kOfxStatFailed);
         try {
             func(threadIndex, threadMax, customArg);
+            *stat = kOfxStatOK;
         } catch (const std::bad_alloc& ba) {
-            ret =  kOfxStatErrMemory;
-        } catch (...) {
-            ret =  kOfxStatFailed;
-        }
-        ///reset back the index otherwise it could mess up the indexes if the same thread is re-used
-        gThreadIndex.localData() = -1;
-        return ret;
-    }
-#else
-#pragma message WARN("QtConcurrent disabled in multithread suite")
-class OfxThread : public QThread
-{
-public:
-    OfxThread(OfxThreadFunctionV1 func,
-              unsigned int threadIndex,
-              unsigned int threadMax,
-              void *customArg,
-              OfxStatus *stat)
-    : _func(func)
-    , _threadIndex(threadIndex)
-    , _threadMax(threadMax)
-    , _customArg(customArg)
-    , _stat(stat)
-    {}
-
-    void run() OVERRIDE {
-        assert(!gThreadIndex.hasLocalData() || gThreadIndex.localData() == -1);
-        assert(_threadIndex < _threadMax);
-        gThreadIndex.localData() = _threadIndex;
-        assert(*_stat == kOfxStatFailed);
-        try {
-            _func(_threadIndex, _threadMax, _customArg);
-            *_stat = kOfxStatOK;
-        } catch (const std::bad_alloc& ba) {
-            *_stat = kOfxStatErrMemory;
+            *stat = kOfxStatErrMemory;
         } catch (...) {
         }
         ///reset back the index otherwise it could mess up the indexes if the same thread is re-used
         gThreadIndex.localData() = -1;
     }
-
-private:
-    OfxThreadFunctionV1 *_func;
-    unsigned int _threadIndex;
-    unsigned int _threadMax;
-    void *_customArg;
-    OfxStatus *_stat;
-};
-#endif
 }
 
 
@@ -688,41 +646,14 @@ OfxStatus Natron::OfxHost::multiThread(OfxThreadFunctionV1 func,unsigned int nTh
         return kOfxStatErrExists;
     }
 
-#ifdef OFX_MULTITHREAD_USES_QTCONCURRENT
-    std::vector<unsigned int> threadIndexes(nThreads);
-    for (unsigned int i = 0; i < nThreads; ++i) {
-        threadIndexes[i] = i;
-    }
-    
-    /// DON'T set the maximum thread count, this is a global application setting, and see the documentation excerpt above
-    //QThreadPool::globalInstance()->setMaxThreadCount(nThreads);
-    QFuture<OfxStatus> future = QtConcurrent::mapped(threadIndexes, boost::bind(::threadFunctionWrapper,func, _1, nThreads, customArg));
-    future.waitForFinished();
-    ///DON'T reset back to the original value the maximum thread count
-    //QThreadPool::globalInstance()->setMaxThreadCount(QThread::idealThreadCount());
-    
-    for (QFuture<OfxStatus>::const_iterator it = future.begin() ; it != future.end(); ++it) {
-        OfxStatus stat = *it;
-        if (stat != kOfxStatOK) {
-            return stat;
-        }
-    }
-#else
     QVector<OfxStatus> status(nThreads); // vector for the return status of each thread
     status.fill(kOfxStatFailed); // by default, a thread fails
-    {
-        QVector<OfxThread*> threads(nThreads);
-        for (unsigned int i = 0; i < nThreads; ++i) {
-            threads[i] = new OfxThread(func, i, nThreads, customArg, &status[i]);
-            threads[i]->start();
-        }
-        for (unsigned int i = 0; i < nThreads; ++i) {
-            threads[i]->wait();
-            assert(!threads[i]->isRunning());
-            assert(threads[i]->isFinished());
-            delete threads[i];
-        }
-    }
+    ///The "threads" are a team formed on the workers of the render scheduler, this thread being one of its members.
+    ///Plug-ins such as blurs call multiThread several times per render: no thread is spawned and only a few
+    ///tasks are queued per call, whatever nThreads is. At most maxConcurrentThread indexes run concurrently.
+    appPTR->getTaskScheduler()->parallelFor(nThreads,
+                                            boost::bind(&teamThreadFunction,func, nThreads, customArg, status.data(), _1),
+                                            (int)maxConcurrentThread);
     // check the return status of each thread, return the first error found
     for (QVector<OfxStatus>::const_iterator it = status.begin(); it != status.end(); ++it) {
         OfxStatus stat = *it;
@@ -730,11 +661,27 @@ OfxStatus Natron::OfxHost::multiThread(OfxThreadFunctionV1 func,unsigned int nTh
             return stat;
         }
     }
-#endif
 
     return kOfxStatOK;
 }
 
+int Natron::OfxHost::clearThreadIndex()
+{
+    if (!gThreadIndex.hasLocalData()) {
+        return -1;
+    }
+    int threadIndex = gThreadIndex.localData();
+    gThreadIndex.localData() = -1;
+    return threadIndex;
+}
+
+void Natron::OfxHost::restoreThreadIndex(int threadIndex)
+{
+    if (threadIndex != -1 || gThreadIndex.hasLocalData()) {
+        gThreadIndex.localData() = threadIndex;
+    }
+}
+
 // Function which indicates the number of CPUs available for SMP processing
 //  This value may be less than the actual number of CPUs on a machine, as the host may reserve other CPUs for itself.
 // http://openfx.sourceforge.net/Documentation/1.3/ofxProgrammingReference.html#OfxMultiThreadSuiteV1_multiThreadNumCPUs
@@ -746,13 +693,9 @@ OfxStatus Natron::OfxHost::multiThreadNumCPUS(unsigned int *nCPUs) const
     if (appPTR->getCurrentSettings()->getNumberOfThreads() == -1) {
         *nCPUs = 1;
     } else {
-        // activeThreadCount may be negative (for example if releaseThread() is called)
-        int activeThreadsCount = std::max(0,QThreadPool::globalInstance()->activeThreadCount());
-        assert(activeThreadsCount >= 0);
-        // better than QThread::idealThreadCount();, because it can be set by a global preference:
-        int maxThreadsCount = QThreadPool::globalInstance()->maxThreadCount();
-        assert(maxThreadsCount >= 0);
-        *nCPUs = std::max(1, maxThreadsCount - activeThreadsCount);
+        // better than QThread::idealThreadCount();, because it can be set by a global preference.
+        // The multiThread tasks share the workers with the rest of the render, a busy worker just leaves them to the others.
+        *nCPUs = std::max(1, appPTR->getTaskScheduler()->getWorkersCount());
     }
 
     return kOfxStatOK;
@@ -915,5 +858,14 @@ OfxStatus Natron::OfxHost::mutexTryLock(const OfxMutexHandle mutex)
         return kOfxStatErrUnknown;
     }
 }
+#else
+int Natron::OfxHost::clearThreadIndex()
+{
+    return -1;
+}
+
+void Natron::OfxHost::restoreThreadIndex(int /*threadIndex*/)
+{
+}
 #endif
 
@@ -108,6 +108,16 @@ public:
 
     virtual OfxStatus mutexTryLock(const OfxMutexHandle mutex) OVERRIDE;
 #endif
+
+    /**
+     * @brief Clears the multi-thread suite index of the calling thread and returns it. A render nested in a thread
+     * function of a plug-in (e.g: an input rendered by clipGetImage) must not see that index, otherwise the
+     * multiThread calls of the nested render would fail or reset it.
+     * restoreThreadIndex() must be called with the returned value once the nested render is done.
+     **/
+    static int clearThreadIndex();
+
+    static void restoreThreadIndex(int threadIndex);
     
     AbstractOfxEffectInstance* createOfxEffect(const std::string& name,boost::shared_ptr<Node> node,
                                                                  const NodeSerialization* serialization );
@@ -18,6 +18,7 @@ CLANG_DIAG_OFF(deprecated)
 #include <QMutex>
 CLANG_DIAG_ON(deprecated)
 #include "Engine/EffectInstance.h"
+#include "Engine/ImageBufferPool.h"
 
 PluginMemory::PluginMemory(Natron::EffectInstance* effect)
 : _ptr(0)
@@ -31,19 +32,22 @@ PluginMemory::PluginMemory(Natron::EffectInstance* effect)
 
 PluginMemory::~PluginMemory() {
     delete _mutex;
-    delete [] _ptr;
+    Natron::ImageBufferPool::instance().release(_ptr, _nBytes);
 }
 
 bool PluginMemory::alloc(size_t nBytes) {
     QMutexLocker l(_mutex);
     if(!_locked){
-        _nBytes = nBytes;
-        if(_ptr)
-            freeMem();
-        _ptr = new char[nBytes];
-        if (!_ptr) {
-            throw std::bad_alloc();
+        if (_ptr) {
+            ///don't call freeMem(), the mutex is not recursive
+            _effect->unregisterPluginMemory(_nBytes);
+            Natron::ImageBufferPool::instance().release(_ptr, _nBytes);
+            _ptr = 0;
+            _nBytes = 0;
         }
+        ///plug-ins allocate their temporary images with this suite, large buffers are recycled like the images'
+        _ptr = (char*)Natron::ImageBufferPool::instance().allocate(nBytes);
+        _nBytes = nBytes;
         
         _effect->registerPluginMemory(nBytes);
 
@@ -56,8 +60,8 @@ bool PluginMemory::alloc(size_t nBytes) {
 void PluginMemory::freeMem() {
     QMutexLocker l(_mutex);
     _effect->unregisterPluginMemory(_nBytes);
+    Natron::ImageBufferPool::instance().release(_ptr, _nBytes);
     _nBytes = 0;
-    delete [] _ptr;
     _ptr = 0;
     _locked = 0;
 }
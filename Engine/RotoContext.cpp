@@ -13,6 +13,9 @@
 
 #include <algorithm>
 #include <sstream>
+#include <cstring>
+#include <stdexcept>
+#include <new>
 
 #include <boost/bind.hpp>
 
@@ -29,6 +32,7 @@
 #include "Engine/Format.h"
 #include "Engine/RotoSerialization.h"
 #include "Engine/Transform.h"
+#include "Engine/TaskScheduler.h"
 
 using namespace Natron;
 
@@ -4008,25 +4012,30 @@ static void adjustToPointToScale(unsigned int mipmapLevel,double &x,double &y)
 }
 
 template <typename PIX,int maxValue>
-void convertCairoImageToNatronImage(cairo_surface_t* cairoImg,Natron::Image* image,const RectI& pixelRod)
+PIX maskValueToNatronValue(float v)
 {
-    unsigned char* cdata = cairo_image_surface_get_data(cairoImg);
-    unsigned char* srcPix = cdata;
-    int stride = cairo_image_surface_get_stride(cairoImg);
+    return (PIX)(v * maxValue + 0.5f);
+}
+
+template <>
+float maskValueToNatronValue<float,1>(float v)
+{
+    return v;
+}
+
+template <typename PIX,int maxValue>
+void writeMaskRow(const std::vector<float>& row,int x1,int y,Natron::Image* image)
+{
+    PIX* dstPix = (PIX*)image->pixelAt(x1, y);
+    assert(dstPix);
     
     int comps = (int)image->getComponentsCount();
-    for (int y = 0; y < pixelRod.height(); ++y, srcPix += stride) {
-        
-        PIX* dstPix = (PIX*)image->pixelAt(pixelRod.x1, pixelRod.y1 + y);
-        assert(dstPix);
-        
-        for (int x = 0; x < pixelRod.width(); ++x) {
-            if (comps == 1) {
-                dstPix[x] = PIX((float)srcPix[x] / 255.f) * maxValue;
-            } else {
-                assert(comps == 4);
-                dstPix[x * 4 + 3] = PIX((float)srcPix[x] / 255.f) * maxValue;
-            }
+    for (U32 x = 0; x < row.size(); ++x) {
+        if (comps == 1) {
+            dstPix[x] = maskValueToNatronValue<PIX,maxValue>(row[x]);
+        } else {
+            assert(comps == 4);
+            dstPix[x * 4 + 3] = maskValueToNatronValue<PIX,maxValue>(row[x]);
         }
     }
 }
@@ -4119,44 +4128,101 @@ boost::shared_ptr<Natron::Image> RotoContext::renderMask(const RectI& roi,U64 no
     RectI pixelRod = params->getPixelRoD();
     RectI clippedRoI;
     roi.intersect(pixelRod, &clippedRoI);
- 
     
-    ////Allocate the cairo temporary buffer
-    cairo_surface_t* cairoImg = cairo_image_surface_create(CAIRO_FORMAT_A8, pixelRod.width(), pixelRod.height());
-    cairo_surface_set_device_offset(cairoImg, -pixelRod.x1, -pixelRod.y1);
-    if (cairo_surface_status(cairoImg) != CAIRO_STATUS_SUCCESS) {
-        appPTR->removeFromNodeCache(image);
+    ///Only the parts of the RoI which are not in the cached image yet are rendered
+    std::list<RectI> rectsToRender = image->getRestToRender(clippedRoI);
+    if (rectsToRender.empty()) {
+        QMutexLocker l(&_imp->lastRenderArgsMutex);
+        _imp->lastRenderHash = hash.value();
+        _imp->lastRenderedImage = image;
         return image;
     }
-    cairo_t* cr = cairo_create(cairoImg);
     
-    ///We could also propose the user to render a mask to SVG
-    _imp->renderInternal(cr, cairoImg, splines,mipmapLevel,time);
-   
-    switch (depth) {
-        case Natron::IMAGE_FLOAT:
-            convertCairoImageToNatronImage<float, 1>(cairoImg, image.get(), pixelRod);
-            break;
-        case Natron::IMAGE_BYTE:
-            convertCairoImageToNatronImage<unsigned char, 255>(cairoImg, image.get(), pixelRod);
-            break;
-        case Natron::IMAGE_SHORT:
-            convertCairoImageToNatronImage<unsigned short, 65535>(cairoImg, image.get(), pixelRod);
-            break;
-        default:
-            assert(false);
+    ///Evaluate the shapes once, the tiles only rasterize them
+    std::vector<RotoShapeRenderData> shapes;
+    shapes.reserve(splines.size());
+    for (std::list< boost::shared_ptr<Bezier> >::const_iterator it = splines.begin(); it != splines.end(); ++it) {
+        shapes.push_back(RotoShapeRenderData());
+        if (!RotoContextPrivate::evaluateShapeForRender(*it, mipmapLevel, time, &shapes.back())) {
+            shapes.pop_back();
+        }
+    }
+    
+    std::vector<RectI> tiles;
+    for (std::list<RectI>::const_iterator it = rectsToRender.begin(); it != rectsToRender.end(); ++it) {
+        for (int y = it->y1; y < it->y2; y += NATRON_ROTO_MASK_TILE_SIZE) {
+            for (int x = it->x1; x < it->x2; x += NATRON_ROTO_MASK_TILE_SIZE) {
+                tiles.push_back(RectI(x, y, std::min(x + NATRON_ROTO_MASK_TILE_SIZE,it->x2),
+                                      std::min(y + NATRON_ROTO_MASK_TILE_SIZE,it->y2)));
+            }
+        }
+    }
+    
+    ///Each shape has its own layer in the node cache and the mask is composited from them: when a single shape
+    ///changes, only its layer is rasterized again, in the tiles of the mask which are rendered.
+    TaskScheduler* scheduler = appPTR->getTaskScheduler();
+    std::vector<RotoShapeLayer> layers;
+    layers.reserve(shapes.size());
+    bool failed = false;
+    TaskGroup layersGroup;
+    for (std::vector<RotoShapeRenderData>::const_iterator it = shapes.begin(); it != shapes.end(); ++it) {
+        RectI bounds;
+        if (it->inverted) {
+            bounds = pixelRod;
+        } else {
+            RectI bbox((int)std::floor(it->bbox.x1), (int)std::floor(it->bbox.y1),
+                       (int)std::ceil(it->bbox.x2), (int)std::ceil(it->bbox.y2));
+            if (!bbox.intersect(pixelRod, &bounds)) {
+                continue;
+            }
+        }
+        layers.push_back(RotoShapeLayer());
+        if (!RotoContextPrivate::getOrCreateShapeLayer(*it, bounds, &layers.back())) {
+            failed = true;
             break;
+        }
+        const RotoShapeLayer& layer = layers.back();
+        for (std::vector<RectI>::const_iterator tile = tiles.begin(); tile != tiles.end(); ++tile) {
+            RectI tileInLayer;
+            if (!tile->intersect(bounds, &tileInLayer)) {
+                continue;
+            }
+            ///The cache may have evicted one of the 2 images only
+            std::list<RectI> missing = layer.over0->getRestToRender(tileInLayer);
+            std::list<RectI> missing1 = layer.over1->getRestToRender(tileInLayer);
+            if (missing.empty()) {
+                missing.swap(missing1);
+            } else if (!missing1.empty()) {
+                missing.assign(1, tileInLayer);
+            }
+            for (std::list<RectI>::const_iterator rect = missing.begin(); rect != missing.end(); ++rect) {
+                scheduler->schedule(&layersGroup,boost::bind(&RotoContextPrivate::rasterizeShapeRect,&(*it),*rect,&layer));
+            }
+        }
     }
+    scheduler->wait(&layersGroup);
+    failed = failed || layersGroup.hasFailed();
     
-    cairo_destroy(cr);
-    ////Free the buffer used by Cairo
-    cairo_surface_destroy(cairoImg);
-
+    if (!failed) {
+        if (tiles.size() == 1) {
+            RotoContextPrivate::compositeTile(&layers, tiles.front(), image.get());
+        } else {
+            TaskGroup tilesGroup;
+            for (U32 i = 0; i < tiles.size(); ++i) {
+                scheduler->schedule(&tilesGroup,boost::bind(&RotoContextPrivate::compositeTile,&layers,tiles[i],image.get()));
+            }
+            scheduler->wait(&tilesGroup);
+            failed = tilesGroup.hasFailed();
+        }
+    }
 
     ////////////////////////////////////
-    if(_imp->node->aborted()){
-        //if render was aborted, remove the frame from the cache as it contains only garbage
+    if (failed || _imp->node->aborted()) {
+        //if render failed or was aborted, remove the frame from the cache as it contains only garbage
         appPTR->removeFromNodeCache(image);
+        if (failed) {
+            return image;
+        }
     } else {
          image->markForRendered(clippedRoI);
     }
@@ -4170,387 +4236,495 @@ boost::shared_ptr<Natron::Image> RotoContext::renderMask(const RectI& roi,U64 no
     return image;
 }
 
-void RotoContextPrivate::renderInternal(cairo_t* cr,cairo_surface_t* cairoImg,const std::list< boost::shared_ptr<Bezier> >& splines,
-                                         unsigned int mipmapLevel,int time)
+namespace {
+    
+void
+mergeIntoBbox(const Point& p,bool* empty,RectD* bbox)
 {
-    ///Maybe all beziers could have a specific blending mode ?
-    cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+    if (*empty) {
+        bbox->set(p.x,p.y,p.x,p.y);
+        *empty = false;
+    } else {
+        bbox->merge(p.x,p.y,p.x,p.y);
+    }
+}
     
-    for (std::list<boost::shared_ptr<Bezier> >::const_iterator it2 = splines.begin(); it2!=splines.end(); ++it2) {
+void
+appendCurve(const Point& c1,const Point& c2,const Point& p,std::vector<Point>* points)
+{
+    points->push_back(c1);
+    points->push_back(c2);
+    points->push_back(p);
+}
+
+///Same control points as cairo_mesh_pattern_line_to()
+void
+appendLine(const Point& from,const Point& to,std::vector<Point>* points)
+{
+    Point c1,c2;
+    c1.x = (2. * from.x + to.x) * (1. / 3.);
+    c1.y = (2. * from.y + to.y) * (1. / 3.);
+    c2.x = (from.x + 2. * to.x) * (1. / 3.);
+    c2.y = (from.y + 2. * to.y) * (1. / 3.);
+    appendCurve(c1, c2, to, points);
+}
+    
+}
+
+bool
+RotoContextPrivate::evaluateShapeForRender(const boost::shared_ptr<Bezier>& bezier,unsigned int mipmapLevel,int time,
+                                           RotoShapeRenderData* data)
+{
+    ///render the bezier only if finished (closed) and activated
+    if (!bezier->isCurveFinished() || !bezier->isActivated(time)) {
+        return false;
+    }
+    
+    double fallOff = bezier->getFeatherFallOff(time);
+    double fallOffInverse = 1. / fallOff;
+    double featherDist = (double)bezier->getFeatherDistance(time);
+    data->opacity = bezier->getOpacity(time);
+    data->inverted = bezier->getInverted(time);
+    
+    BezierCPs cps = bezier->getControlPoints_mt_safe();
+    BezierCPs fps = bezier->getFeatherPoints_mt_safe();
+    
+    assert(cps.size() == fps.size());
+    
+    if (cps.empty()) {
+        return false;
+    }
+    
+    BezierCPs::iterator point = cps.begin();
+    BezierCPs::iterator fpoint = fps.begin();
+    
+    BezierCPs::iterator nextPoint = point;
+    ++nextPoint;
+    BezierCPs::iterator nextFPoint = fpoint;
+    ++nextFPoint;
+    
+    ////1st pass, the internal bezier
+    Point initCp;
+    
+    (*point)->getPositionAtTime(time, &initCp.x,&initCp.y);
+    adjustToPointToScale(mipmapLevel,initCp.x,initCp.y);
+    
+    data->fillPath.reserve(cps.size() * 3 + 1);
+    data->fillPath.push_back(initCp);
+    
+    while (point != cps.end()) {
+        if (nextPoint == cps.end()) {
+            nextPoint = cps.begin();
+        }
+        
+        Point right,next,nextLeft;
+        (*point)->getRightBezierPointAtTime(time, &right.x, &right.y);
+        (*nextPoint)->getLeftBezierPointAtTime(time, &nextLeft.x, &nextLeft.y);
+        (*nextPoint)->getPositionAtTime(time, &next.x, &next.y);
+        
+        adjustToPointToScale(mipmapLevel,right.x,right.y);
+        adjustToPointToScale(mipmapLevel,next.x,next.y);
+        adjustToPointToScale(mipmapLevel,nextLeft.x,nextLeft.y);
+        appendCurve(right, nextLeft, next, &data->fillPath);
+        
+        ++point;
+        ++nextPoint;
+    }
+    
+    ///reset iterators
+    point = cps.begin();
+    nextPoint = point;
+    ++nextPoint;
+    
+    ////2nd pass, the feather edge patches
+    if (mipmapLevel != 0) {
+        featherDist /= (1 << mipmapLevel);
+    }
+    
+    if (featherDist != 0) {
+        
+        ///here is the polygon of the feather bezier
+        ///This is used only if the feather distance is different of 0 and the feather points equal
+        ///the control points in order to still be able to apply the feather distance.
+        std::list<Point> featherPolygon;
+        std::list<Point> bezierPolygon;
+        std::vector<double> multiples,constants;
+        RectD featherPolyBBox(INT_MAX,INT_MAX,INT_MIN,INT_MIN);
+        
+        bezier->evaluateFeatherPointsAtTime_DeCasteljau(time,mipmapLevel, 50, &featherPolygon,true,&featherPolyBBox);
+        bezier->evaluateAtTime_DeCasteljau(time, mipmapLevel, 50, &bezierPolygon);
+        assert(!featherPolygon.empty());
         
-        ///render the bezier only if finished (closed) and activated
-        if ((*it2)->isCurveFinished() && (*it2)->isActivated(time)) {
+        multiples.resize(featherPolygon.size());
+        constants.resize(featherPolygon.size());
+        Bezier::precomputePointInPolygonTables(featherPolygon, &constants, &multiples);
+        
+        data->featherPatches.reserve(featherPolygon.size() * 13);
+        
+        std::list<Point>::iterator cur = featherPolygon.begin();
+        std::list<Point>::iterator next = cur;
+        ++next;
+        std::list<Point>::iterator prev = featherPolygon.end();
+        --prev;
+        std::list<Point>::iterator bezIT = bezierPolygon.begin();
+        std::list<Point>::iterator prevBez = bezierPolygon.end();
+        --prevBez;
+        double absFeatherDist = std::abs(featherDist);
+        
+        Point p1 = *cur;
+        double norm = sqrt((next->x - prev->x) * (next->x - prev->x) + (next->y - prev->y) * (next->y - prev->y));
+        assert(norm != 0);
+        double dx = - ((next->y - prev->y) / norm);
+        double dy = ((next->x - prev->x) / norm);
+        p1.x = cur->x + dx;
+        p1.y = cur->y + dy;
+        
+        bool inside = Bezier::pointInPolygon(p1, featherPolygon, constants, multiples, featherPolyBBox);
+        if ((!inside && featherDist < 0) || (inside && featherDist > 0)) {
+            p1.x = cur->x - dx * absFeatherDist;
+            p1.y = cur->y - dy * absFeatherDist;
+        } else {
+            p1.x = cur->x + dx * absFeatherDist;
+            p1.y = cur->y + dy * absFeatherDist;
+        }
+        
+        Point origin = p1;
+        
+        ++prev; ++next; ++cur; ++bezIT; ++prevBez;
+        
+        for (;;++prev,++cur,++next,++bezIT,++prevBez) {
+            if (next == featherPolygon.end()) {
+                next = featherPolygon.begin();
+            }
+            if (prev == featherPolygon.end()) {
+                prev = featherPolygon.begin();
+            }
+            if (bezIT == bezierPolygon.end()) {
+                bezIT = bezierPolygon.begin();
+            }
+            if (prevBez == bezierPolygon.end()) {
+                prevBez = bezierPolygon.begin();
+            }
+            bool mustStop = false;
+            if (cur == featherPolygon.end()) {
+                mustStop = true;
+                cur = featherPolygon.begin();
+            }
             
+            ///skip it
+            if (cur->x == prev->x && cur->y == prev->y) {
+                continue;
+            }
             
-            double fallOff = (*it2)->getFeatherFallOff(time);
-            double fallOffInverse = 1. / fallOff;
-            double featherDist = (double)(*it2)->getFeatherDistance(time);
-            double opacity = (*it2)->getOpacity(time);
-            bool inverted = (*it2)->getInverted(time);
+            Point p2,p0p1,p1p0,p2p3,p3p2;
             
-        
-            BezierCPs cps = (*it2)->getControlPoints_mt_safe();
-            BezierCPs fps = (*it2)->getFeatherPoints_mt_safe();
+            if (!mustStop) {
+                norm = sqrt((next->x - prev->x) * (next->x - prev->x) + (next->y - prev->y) * (next->y - prev->y));
+                assert(norm != 0);
+                dx = - ((next->y - prev->y) / norm);
+                dy = ((next->x - prev->x) / norm);
+                p2.x = cur->x + dx;
+                p2.y = cur->y + dy;
+                
+                inside = Bezier::pointInPolygon(p2, featherPolygon, constants, multiples, featherPolyBBox);
+                if ((!inside && featherDist < 0) || (inside && featherDist > 0)) {
+                    p2.x = cur->x - dx * absFeatherDist;
+                    p2.y = cur->y - dy * absFeatherDist;
+                } else {
+                    p2.x = cur->x + dx * absFeatherDist;
+                    p2.y = cur->y + dy * absFeatherDist;
+                }
+            } else {
+                p2 = origin;
+            }
             
-            assert(cps.size() == fps.size());
+            ///linear interpolation
+            p0p1.x = (2. * fallOff * prevBez->x + fallOffInverse * p1.x) / (2. * fallOff + fallOffInverse);
+            p0p1.y = (2. * fallOff * prevBez->y + fallOffInverse * p1.y) / (2. * fallOff + fallOffInverse);
+            p1p0.x = (prevBez->x * fallOff + 2. * fallOffInverse * p1.x) / (fallOff + 2. * fallOffInverse);
+            p1p0.y = (prevBez->y * fallOff + 2. * fallOffInverse * p1.y) / (fallOff + 2. * fallOffInverse);
             
-            if (cps.empty()) {
-                continue;
+            p2p3.x = (bezIT->x * fallOff + 2. * fallOffInverse * p2.x) / (fallOff + 2. * fallOffInverse);
+            p2p3.y = (bezIT->y * fallOff + 2. * fallOffInverse * p2.y) / (fallOff + 2. * fallOffInverse);
+            p3p2.x = (2. * fallOff * bezIT->x + fallOffInverse * p2.x) / (2. * fallOff + fallOffInverse);
+            p3p2.y = (2. * fallOff * bezIT->y + fallOffInverse * p2.y) / (2. * fallOff + fallOffInverse);
+            
+            ///the patch goes from the inner curve to the feather contour and back
+            data->featherPatches.push_back(*prevBez);
+            appendCurve(p0p1, p1p0, p1, &data->featherPatches);
+            appendLine(p1, p2, &data->featherPatches);
+            appendCurve(p2p3, p3p2, *bezIT, &data->featherPatches);
+            appendLine(*bezIT, *prevBez, &data->featherPatches);
+            
+            if (mustStop) {
+                break;
             }
             
+            p1 = p2;
+        }
+        
+    } else {
+        
+        data->featherPatches.reserve(cps.size() * 13);
+        
+        while (point != cps.end()) {
             
-            if (inverted) {
-                cairo_set_source_rgba(cr, 1.,1.,1., opacity);
-                cairo_paint(cr);
+            if (nextPoint == cps.end()) {
+                nextPoint = cps.begin();
+                nextFPoint = fps.begin();
             }
             
+            Point p0,p1,p2,p3,p0p1,p1p0,p0Right,p1Right,p2p3,p3p2,p2Left,p3Left;
+            (*point)->getPositionAtTime(time, &p0.x, &p0.y);
+            adjustToPointToScale(mipmapLevel,p0.x,p0.y);
             
-            BezierCPs::iterator point = cps.begin();
-            BezierCPs::iterator fpoint = fps.begin();
-
-            BezierCPs::iterator nextPoint = point;
-            ++nextPoint;
-            BezierCPs::iterator nextFPoint = fpoint;
-            ++nextFPoint;
-
+            (*point)->getRightBezierPointAtTime(time, &p0Right.x, &p0Right.y);
+            adjustToPointToScale(mipmapLevel, p0Right.x, p0Right.y);
             
+            (*fpoint)->getRightBezierPointAtTime(time, &p1Right.x, &p1Right.y);
+            adjustToPointToScale(mipmapLevel, p1Right.x, p1Right.y);
             
+            (*fpoint)->getPositionAtTime(time, &p1.x, &p1.y);
+            adjustToPointToScale(mipmapLevel,p1.x,p1.y);
             
-            ////1st pass, fill the internal bezier
-            Point initCp;
+            (*nextPoint)->getPositionAtTime(time, &p3.x, &p3.y);
+            adjustToPointToScale(mipmapLevel, p3.x, p3.y);
             
-            (*point)->getPositionAtTime(time, &initCp.x,&initCp.y);
-            adjustToPointToScale(mipmapLevel,initCp.x,initCp.y);
+            (*nextPoint)->getLeftBezierPointAtTime(time, &p3Left.x, &p3Left.y);
+            adjustToPointToScale(mipmapLevel, p3Left.x,p3Left.y);
             
-            cairo_set_source_rgba(cr, 1.,1.,1., inverted ? 1. - opacity : opacity);
-            cairo_new_path(cr);
-            cairo_move_to(cr, initCp.x,initCp.y);
+            (*nextFPoint)->getPositionAtTime(time, &p2.x, &p2.y);
+            adjustToPointToScale(mipmapLevel, p2.x, p2.y);
             
-            while (point != cps.end()) {
-                if (nextPoint == cps.end()) {
-                    nextPoint = cps.begin();
-                }
-                
-                double rightX,rightY,nextX,nextY,nextLeftX,nextLeftY;
-                (*point)->getRightBezierPointAtTime(time, &rightX, &rightY);
-                (*nextPoint)->getLeftBezierPointAtTime(time, &nextLeftX, &nextLeftY);
-                (*nextPoint)->getPositionAtTime(time, &nextX, &nextY);
-                
-                adjustToPointToScale(mipmapLevel,rightX,rightY);
-                adjustToPointToScale(mipmapLevel,nextX,nextY);
-                adjustToPointToScale(mipmapLevel,nextLeftX,nextLeftY);
-                cairo_curve_to(cr, rightX, rightY, nextLeftX, nextLeftY, nextX, nextY);
-                
-                ++point;
-                ++nextPoint;
-            }
+            (*nextFPoint)->getLeftBezierPointAtTime(time, &p2Left.x, &p2Left.y);
+            adjustToPointToScale(mipmapLevel, p2Left.x, p2Left.y);
             
-            cairo_fill(cr);
+            ///linear interpolation
+            p0p1.x = (2. * fallOff * p0.x + fallOffInverse * p1.x) / (2. * fallOff + fallOffInverse);
+            p0p1.y = (2. * fallOff * p0.y + fallOffInverse * p1.y) / (2. * fallOff + fallOffInverse);
+            p1p0.x = (p0.x * fallOff + 2. * fallOffInverse * p1.x) / (fallOff + 2. * fallOffInverse);
+            p1p0.y = (p0.y * fallOff + 2. * fallOffInverse * p1.y) /(fallOff + 2. * fallOffInverse);
             
-            ///reset iterators
-            point = cps.begin();
-            nextPoint = point;
-            ++nextPoint;
+            p2p3.x = (p3.x * fallOff + 2. * fallOffInverse * p2.x) / (fallOff + 2. * fallOffInverse);
+            p2p3.y = (p3.y * fallOff + 2. * fallOffInverse * p2.y) / (fallOff + 2. * fallOffInverse);
+            p3p2.x = (2. * fallOff * p3.x + fallOffInverse * p2.x) / (2. * fallOff + fallOffInverse);
+            p3p2.y = (2. * fallOff * p3.y + fallOffInverse * p2.y) / (2. * fallOff + fallOffInverse);
             
-            ////2nd pass, define the feather edge pattern
-            cairo_pattern_t* mesh = cairo_pattern_create_mesh();
-            if (cairo_pattern_status(mesh) != CAIRO_STATUS_SUCCESS) {
-                cairo_pattern_destroy(mesh);
-                continue;
-            }
+            ///move to the initial point
+            data->featherPatches.push_back(p0);
             
-            if (mipmapLevel != 0) {
-                featherDist /= (1 << mipmapLevel);
-            }
+            ///make the 1st bezier segment
+            appendCurve(p0p1, p1p0, p1, &data->featherPatches);
             
-            if (featherDist != 0) {
-                
-                ///here is the polygon of the feather bezier
-                ///This is used only if the feather distance is different of 0 and the feather points equal
-                ///the control points in order to still be able to apply the feather distance.
-                std::list<Point> featherPolygon;
-                std::list<Point> bezierPolygon;
-                std::vector<double> multiples,constants;
-                RectD featherPolyBBox(INT_MAX,INT_MAX,INT_MIN,INT_MIN);
-                
-                (*it2)->evaluateFeatherPointsAtTime_DeCasteljau(time,mipmapLevel, 50, &featherPolygon,true,&featherPolyBBox);
-                (*it2)->evaluateAtTime_DeCasteljau(time, mipmapLevel, 50, &bezierPolygon);
-                assert(!featherPolygon.empty());
-                
-                multiples.resize(featherPolygon.size());
-                constants.resize(featherPolygon.size());
-                Bezier::precomputePointInPolygonTables(featherPolygon, &constants, &multiples);
-                
-  
-                std::list<Point> featherContour;
-                
-                std::list<Point>::iterator cur = featherPolygon.begin();
-                std::list<Point>::iterator next = cur;
-                ++next;
-                std::list<Point>::iterator prev = featherPolygon.end();
-                --prev;
-                std::list<Point>::iterator bezIT = bezierPolygon.begin();
-                std::list<Point>::iterator prevBez = bezierPolygon.end();
-                --prevBez;
-                double absFeatherDist = std::abs(featherDist);
-                
-                Point p1 = *cur;
-                double norm = sqrt((next->x - prev->x) * (next->x - prev->x) + (next->y - prev->y) * (next->y - prev->y));
-                assert(norm != 0);
-                double dx = - ((next->y - prev->y) / norm);
-                double dy = ((next->x - prev->x) / norm);
-                p1.x = cur->x + dx;
-                p1.y = cur->y + dy;
-                
-                bool inside = Bezier::pointInPolygon(p1, featherPolygon, constants, multiples, featherPolyBBox);
-                if ((!inside && featherDist < 0) || (inside && featherDist > 0)) {
-                    p1.x = cur->x - dx * absFeatherDist;
-                    p1.y = cur->y - dy * absFeatherDist;
-                } else {
-                    p1.x = cur->x + dx * absFeatherDist;
-                    p1.y = cur->y + dy * absFeatherDist;
-                }
-                
-                Point origin = p1;
-                featherContour.push_back(p1);
-                
-                ++prev; ++next; ++cur; ++bezIT; ++prevBez;
-                
-                for (;;++prev,++cur,++next,++bezIT,++prevBez) {
-                    if (next == featherPolygon.end()) {
-                        next = featherPolygon.begin();
-                    }
-                    if (prev == featherPolygon.end()) {
-                        prev = featherPolygon.begin();
-                    }
-                    if (bezIT == bezierPolygon.end()) {
-                        bezIT = bezierPolygon.begin();
-                    }
-                    if (prevBez == bezierPolygon.end()) {
-                        prevBez = bezierPolygon.begin();
-                    }
-                    bool mustStop = false;
-                    if (cur == featherPolygon.end()) {
-                        mustStop = true;
-                        cur = featherPolygon.begin();
-                    }
-                    
-                    ///skip it
-                    if (cur->x == prev->x && cur->y == prev->y) {
-                        continue;
-                    }
-                    
-                    Point p2,p0p1,p1p0,p2p3,p3p2;
-                
-                    if (!mustStop) {
-                        norm = sqrt((next->x - prev->x) * (next->x - prev->x) + (next->y - prev->y) * (next->y - prev->y));
-                        assert(norm != 0);
-                        dx = - ((next->y - prev->y) / norm);
-                        dy = ((next->x - prev->x) / norm);
-                        p2.x = cur->x + dx;
-                        p2.y = cur->y + dy;
-                        
-                        inside = Bezier::pointInPolygon(p2, featherPolygon, constants, multiples, featherPolyBBox);
-                        if ((!inside && featherDist < 0) || (inside && featherDist > 0)) {
-                            p2.x = cur->x - dx * absFeatherDist;
-                            p2.y = cur->y - dy * absFeatherDist;
-                        } else {
-                            p2.x = cur->x + dx * absFeatherDist;
-                            p2.y = cur->y + dy * absFeatherDist;
-                        }
-                    } else {
-                        p2 = origin;
-                    }
-                    featherContour.push_back(p2);
-                    
-                    ///linear interpolation
-                    p0p1.x = (2. * fallOff * prevBez->x + fallOffInverse * p1.x) / (2. * fallOff + fallOffInverse);
-                    p0p1.y = (2. * fallOff * prevBez->y + fallOffInverse * p1.y) / (2. * fallOff + fallOffInverse);
-                    p1p0.x = (prevBez->x * fallOff + 2. * fallOffInverse * p1.x) / (fallOff + 2. * fallOffInverse);
-                    p1p0.y = (prevBez->y * fallOff + 2. * fallOffInverse * p1.y) / (fallOff + 2. * fallOffInverse);
-                    
-                    p2p3.x = (bezIT->x * fallOff + 2. * fallOffInverse * p2.x) / (fallOff + 2. * fallOffInverse);
-                    p2p3.y = (bezIT->y * fallOff + 2. * fallOffInverse * p2.y) / (fallOff + 2. * fallOffInverse);
-                    p3p2.x = (2. * fallOff * bezIT->x + fallOffInverse * p2.x) / (2. * fallOff + fallOffInverse);
-                    p3p2.y = (2. * fallOff * bezIT->y + fallOffInverse * p2.y) / (2. * fallOff + fallOffInverse);
-
-                    
-                    ///move to the initial point
-                    cairo_mesh_pattern_begin_patch(mesh);
-                    cairo_mesh_pattern_move_to(mesh, prevBez->x,prevBez->y);
-                    cairo_mesh_pattern_curve_to(mesh, p0p1.x,p0p1.y,p1p0.x,p1p0.y,p1.x,p1.y);
-                    cairo_mesh_pattern_line_to(mesh, p2.x, p2.y);
-                    cairo_mesh_pattern_curve_to(mesh, p2p3.x,p2p3.y,p3p2.x,p3p2.y,bezIT->x,bezIT->y);
-                    cairo_mesh_pattern_line_to(mesh, prevBez->x, prevBez->y);
-                    ///Set the 4 corners color
-                    ///inner is full color
-                    cairo_mesh_pattern_set_corner_color_rgba(mesh, 0, 1., 1., 1., inverted ? 1. - opacity : opacity);
-                    ///outter is faded
-                    cairo_mesh_pattern_set_corner_color_rgba(mesh, 1, 1., 1., 1., inverted ? 1. :  0.);
-                    cairo_mesh_pattern_set_corner_color_rgba(mesh, 2, 1., 1., 1., inverted ? 1. :  0.);
-                    ///inner is full color
-                    cairo_mesh_pattern_set_corner_color_rgba(mesh, 3, 1., 1., 1., inverted ? 1. - opacity : opacity);
-                    assert(cairo_pattern_status(mesh) == CAIRO_STATUS_SUCCESS);
-                    
-                    cairo_mesh_pattern_end_patch(mesh);
-                    
-                    if (mustStop) {
-                        break;
-                    }
-                    
-                    p1 = p2;
-                }
-                
-                cairo_new_path(cr);
-                std::list<Point>::iterator featherContourIT = featherContour.begin();
-                
-                cairo_move_to(cr, featherContourIT->x, featherContourIT->y);
-                ++featherContourIT;
-                while (featherContourIT != featherContour.end()) {
-                    cairo_line_to(cr, featherContourIT->x, featherContourIT->y);
-                    ++featherContourIT;
-                }
-                
-           
-            } else {
-                ///This is a vector of feather points that we compute during
-                ///the first pass to avoid recompute them when we do the actual
-                ///path rendering.
-                ///The points are interpreted as a triplet <prev right point,cur left point,cur>
-                std::vector<Point> preComputedFeatherPoints(cps.size() * 3);
-                std::vector<Point>::iterator preFillIt = preComputedFeatherPoints.begin();
-                
-                while (point != cps.end()) {
-                    
-                    if (nextPoint == cps.end()) {
-                        nextPoint = cps.begin();
-                        nextFPoint = fps.begin();
-                    }
-                    
-                    Point p0,p1,p2,p3,p0p1,p1p0,p0Right,p1Right,p2p3,p3p2,p2Left,p3Left;
-                    (*point)->getPositionAtTime(time, &p0.x, &p0.y);
-                    adjustToPointToScale(mipmapLevel,p0.x,p0.y);
-                    
-                    (*point)->getRightBezierPointAtTime(time, &p0Right.x, &p0Right.y);
-                    adjustToPointToScale(mipmapLevel, p0Right.x, p0Right.y);
-                    
-                    (*fpoint)->getRightBezierPointAtTime(time, &p1Right.x, &p1Right.y);
-                    adjustToPointToScale(mipmapLevel, p1Right.x, p1Right.y);
-                    
-                    (*fpoint)->getPositionAtTime(time, &p1.x, &p1.y);
-                    adjustToPointToScale(mipmapLevel,p1.x,p1.y);
-                    
-                    (*nextPoint)->getPositionAtTime(time, &p3.x, &p3.y);
-                    adjustToPointToScale(mipmapLevel, p3.x, p3.y);
-                    
-                    (*nextPoint)->getLeftBezierPointAtTime(time, &p3Left.x, &p3Left.y);
-                    adjustToPointToScale(mipmapLevel, p3Left.x,p3Left.y);
-                    
-                    (*nextFPoint)->getPositionAtTime(time, &p2.x, &p2.y);
-                    adjustToPointToScale(mipmapLevel, p2.x, p2.y);
-                    
-                    (*nextFPoint)->getLeftBezierPointAtTime(time, &p2Left.x, &p2Left.y);
-                    adjustToPointToScale(mipmapLevel, p2Left.x, p2Left.y);
-                    
-                    
-                    ///This completes the previous iteration's triplet
-                    *preFillIt++ = p1Right;
-                    
-                    ///This makes up the new triplet
-                    *preFillIt++ = p2Left;
-                    *preFillIt++ = p2;
-                    
-                    ///linear interpolation
-                    p0p1.x = (2. * fallOff * p0.x + fallOffInverse * p1.x) / (2. * fallOff + fallOffInverse);
-                    p0p1.y = (2. * fallOff * p0.y + fallOffInverse * p1.y) / (2. * fallOff + fallOffInverse);
-                    p1p0.x = (p0.x * fallOff + 2. * fallOffInverse * p1.x) / (fallOff + 2. * fallOffInverse);
-                    p1p0.y = (p0.y * fallOff + 2. * fallOffInverse * p1.y) /(fallOff + 2. * fallOffInverse);
-                    
-                    p2p3.x = (p3.x * fallOff + 2. * fallOffInverse * p2.x) / (fallOff + 2. * fallOffInverse);
-                    p2p3.y = (p3.y * fallOff + 2. * fallOffInverse * p2.y) / (fallOff + 2. * fallOffInverse);
-                    p3p2.x = (2. * fallOff * p3.x + fallOffInverse * p2.x) / (2. * fallOff + fallOffInverse);
-                    p3p2.y = (2. * fallOff * p3.y + fallOffInverse * p2.y) / (2. * fallOff + fallOffInverse);
-                    
-                    ///move to the initial point
-                    cairo_mesh_pattern_begin_patch(mesh);
-                    cairo_mesh_pattern_move_to(mesh, p0.x, p0.y);
-                    
-                    ///make the 1st bezier segment
-                    cairo_mesh_pattern_curve_to(mesh, p0p1.x,p0p1.y,p1p0.x,p1p0.y,p1.x,p1.y);
-                    
-                    ///make the 2nd bezier segment
-                    cairo_mesh_pattern_curve_to(mesh, p1Right.x,p1Right.y,p2Left.x,p2Left.y,p2.x,p2.y);
-                    
-                    ///make the 3rd bezier segment
-                    cairo_mesh_pattern_curve_to(mesh, p2p3.x,p2p3.y,p3p2.x,p3p2.y,p3.x,p3.y);
-                    
-                    ///make the last bezier segment to close the pattern
-                    cairo_mesh_pattern_curve_to(mesh, p3Left.x,p3Left.y,p0Right.x,p0Right.y,p0.x,p0.y);
-                    
-                    ///Set the 4 corners color
-                    
-                    ///inner is full color
-                    cairo_mesh_pattern_set_corner_color_rgba(mesh, 0, 1., 1., 1., inverted ? 1. - opacity : opacity);
-                    
-                    ///outter is faded
-                    cairo_mesh_pattern_set_corner_color_rgba(mesh, 1, 1., 1., 1., inverted ? 1. :  0.);
-                    cairo_mesh_pattern_set_corner_color_rgba(mesh, 2, 1., 1., 1., inverted ? 1. :  0.);
-                    
-                    ///inner is full color
-                    cairo_mesh_pattern_set_corner_color_rgba(mesh, 3, 1., 1., 1., inverted ? 1. - opacity : opacity);
-                    assert(cairo_pattern_status(mesh) == CAIRO_STATUS_SUCCESS);
-                    
-                    cairo_mesh_pattern_end_patch(mesh);
-                    
-                    ++point;
-                    ++nextPoint;
-                    ++fpoint;
-                    ++nextFPoint;
-                    
-                }
-                
-                ///2nd pass, draw the feather using the pattern previously defined
-                preFillIt = preComputedFeatherPoints.begin();
-                
-                
-                Point initFp = *preComputedFeatherPoints.rbegin();
-                
-                
-                cairo_new_path(cr);
-                cairo_move_to(cr, initFp.x, initFp.y);
-                
-                while (preFillIt != preComputedFeatherPoints.end()) {
-                    
-                    Point right,nextLeft,next;
-                    right = *preFillIt++;
-                    assert(preFillIt != preComputedFeatherPoints.end());
-                    nextLeft = *preFillIt++;
-                    assert(preFillIt != preComputedFeatherPoints.end());
-                    next = *preFillIt++;
-                    
-                    cairo_curve_to(cr,right.x,right.y,nextLeft.x,nextLeft.y,next.x,next.y);
-                    
-                }
-                
-
-            }
+            ///make the 2nd bezier segment
+            appendCurve(p1Right, p2Left, p2, &data->featherPatches);
             
+            ///make the 3rd bezier segment
+            appendCurve(p2p3, p3p2, p3, &data->featherPatches);
             
-            assert(cairo_pattern_status(mesh) == CAIRO_STATUS_SUCCESS);
-            cairo_set_source(cr, mesh);
-    
-                       ///paint with the feather with the pattern as a mask
-            cairo_mask(cr, mesh);
+            ///make the last bezier segment to close the pattern
+            appendCurve(p3Left, p0Right, p0, &data->featherPatches);
             
-            cairo_pattern_destroy(mesh);
+            ++point;
+            ++nextPoint;
+            ++fpoint;
+            ++nextFPoint;
+        }
+    }
+    
+    ///A curve is enclosed in the convex hull of its control points
+    bool emptyBbox = true;
+    for (std::vector<Point>::const_iterator it = data->fillPath.begin(); it != data->fillPath.end(); ++it) {
+        mergeIntoBbox(*it, &emptyBbox, &data->bbox);
+    }
+    for (std::vector<Point>::const_iterator it = data->featherPatches.begin(); it != data->featherPatches.end(); ++it) {
+        mergeIntoBbox(*it, &emptyBbox, &data->bbox);
+    }
+    ///antialiasing touches the pixels around the edges
+    data->bbox.set(data->bbox.x1 - 1., data->bbox.y1 - 1., data->bbox.x2 + 1., data->bbox.y2 + 1.);
+    
+    return true;
+}
 
-            
+U64
+RotoContextPrivate::hashShapeLayer(const RotoShapeRenderData& shape,const RectI& bounds)
+{
+    Hash64 hash;
+    hash.append(shape.opacity);
+    hash.append(shape.inverted);
+    hash.append(bounds.x1);
+    hash.append(bounds.y1);
+    hash.append(bounds.x2);
+    hash.append(bounds.y2);
+    hash.append((U64)shape.fillPath.size());
+    for (std::vector<Point>::const_iterator it = shape.fillPath.begin(); it != shape.fillPath.end(); ++it) {
+        hash.append(it->x);
+        hash.append(it->y);
+    }
+    hash.append((U64)shape.featherPatches.size());
+    for (std::vector<Point>::const_iterator it = shape.featherPatches.begin(); it != shape.featherPatches.end(); ++it) {
+        hash.append(it->x);
+        hash.append(it->y);
+    }
+    hash.computeHash();
+    return hash.value();
+}
+
+bool
+RotoContextPrivate::getOrCreateShapeLayer(const RotoShapeRenderData& shape,const RectI& bounds,RotoShapeLayer* layer)
+{
+    layer->bounds = bounds;
+    U64 layerHash = hashShapeLayer(shape, bounds);
+    
+    ///The bounds are in pixels at the scale of the mask and so is the geometry the hash identifies:
+    ///the layers are made at scale 1
+    boost::shared_ptr<const Natron::ImageParams> params = Natron::Image::makeParams(0, bounds, 0, false,
+                                                                                    Natron::ImageComponentAlpha,
+                                                                                    Natron::IMAGE_BYTE,
+                                                                                    -1, 0,
+                                                                                    std::map<int, std::vector<RangeD> >());
+    boost::shared_ptr<Natron::Image>* images[2] = { &layer->over0, &layer->over1 };
+    for (int i = 0; i < 2; ++i) {
+        Hash64 hash;
+        hash.append(layerHash);
+        hash.append(i);
+        hash.computeHash();
+        appPTR->getImageOrCreate(Natron::Image::makeKey(hash.value(), 0, 0, 0), params, images[i]);
+        if (!*images[i]) {
+            return false;
         }
-        
     }
-    assert(cairo_surface_status(cairoImg) == CAIRO_STATUS_SUCCESS);
+    return true;
+}
+
+namespace {
+    
+void
+drawShape(cairo_t* cr,const RotoShapeRenderData& shape)
+{
+    double insideAlpha = shape.inverted ? 1. - shape.opacity : shape.opacity;
+    double outsideAlpha = shape.inverted ? 1. : 0.;
+    
+    if (shape.inverted) {
+        cairo_set_source_rgba(cr, 1.,1.,1., shape.opacity);
+        cairo_paint(cr);
+    }
+    
+    ////1st pass, fill the internal bezier
+    const std::vector<Point>& fillPath = shape.fillPath;
+    cairo_set_source_rgba(cr, 1.,1.,1., insideAlpha);
+    cairo_new_path(cr);
+    cairo_move_to(cr, fillPath[0].x, fillPath[0].y);
+    for (U32 i = 1; i + 2 < fillPath.size(); i += 3) {
+        cairo_curve_to(cr, fillPath[i].x, fillPath[i].y, fillPath[i + 1].x, fillPath[i + 1].y,
+                       fillPath[i + 2].x, fillPath[i + 2].y);
+    }
+    cairo_fill(cr);
     
-    ///A call to cairo_surface_flush() is required before accessing the pixel data
-    ///to ensure that all pending drawing operations are finished.
-    cairo_surface_flush(cairoImg);
+    ////2nd pass, paint the feather with the edge pattern as a mask
+    const std::vector<Point>& patches = shape.featherPatches;
+    if (patches.empty()) {
+        return;
+    }
+    cairo_pattern_t* mesh = cairo_pattern_create_mesh();
+    if (cairo_pattern_status(mesh) != CAIRO_STATUS_SUCCESS) {
+        cairo_pattern_destroy(mesh);
+        return;
+    }
+    for (U32 p = 0; p + 13 <= patches.size(); p += 13) {
+        cairo_mesh_pattern_begin_patch(mesh);
+        cairo_mesh_pattern_move_to(mesh, patches[p].x, patches[p].y);
+        for (U32 i = p + 1; i < p + 13; i += 3) {
+            cairo_mesh_pattern_curve_to(mesh, patches[i].x, patches[i].y, patches[i + 1].x, patches[i + 1].y,
+                                        patches[i + 2].x, patches[i + 2].y);
+        }
+        ///inner is full color, outter is faded
+        cairo_mesh_pattern_set_corner_color_rgba(mesh, 0, 1., 1., 1., insideAlpha);
+        cairo_mesh_pattern_set_corner_color_rgba(mesh, 1, 1., 1., 1., outsideAlpha);
+        cairo_mesh_pattern_set_corner_color_rgba(mesh, 2, 1., 1., 1., outsideAlpha);
+        cairo_mesh_pattern_set_corner_color_rgba(mesh, 3, 1., 1., 1., insideAlpha);
+        cairo_mesh_pattern_end_patch(mesh);
+    }
+    assert(cairo_pattern_status(mesh) == CAIRO_STATUS_SUCCESS);
+    cairo_set_source(cr, mesh);
+    cairo_mask(cr, mesh);
+    cairo_pattern_destroy(mesh);
+}
+    
+}
+
+void
+RotoContextPrivate::rasterizeShapeRect(const RotoShapeRenderData* shape,const RectI& rect,const RotoShapeLayer* layer)
+{
+    cairo_surface_t* cairoImg = cairo_image_surface_create(CAIRO_FORMAT_A8, rect.width(), rect.height());
+    if (cairo_surface_status(cairoImg) != CAIRO_STATUS_SUCCESS) {
+        cairo_surface_destroy(cairoImg);
+        throw std::bad_alloc();
+    }
+    cairo_surface_set_device_offset(cairoImg, -rect.x1, -rect.y1);
+    const unsigned char* data = cairo_image_surface_get_data(cairoImg);
+    int stride = cairo_image_surface_get_stride(cairoImg);
+    Natron::Image* images[2] = { layer->over0.get(), layer->over1.get() };
+    
+    for (int i = 0; i < 2; ++i) {
+        cairo_t* cr = cairo_create(cairoImg);
+        
+        ///Maybe all beziers could have a specific blending mode ?
+        cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+        
+        ///the shape is drawn over 0, then over 1
+        cairo_set_source_rgba(cr, 1.,1.,1., (double)i);
+        cairo_paint(cr);
+        drawShape(cr, *shape);
+        assert(cairo_surface_status(cairoImg) == CAIRO_STATUS_SUCCESS);
+        
+        ///A call to cairo_surface_flush() is required before accessing the pixel data
+        ///to ensure that all pending drawing operations are finished.
+        cairo_surface_flush(cairoImg);
+        cairo_destroy(cr);
+        
+        for (int y = 0; y < rect.height(); ++y) {
+            std::memcpy(images[i]->pixelAt(rect.x1, rect.y1 + y), data + y * stride, rect.width());
+        }
+        images[i]->markForRendered(rect);
+    }
+    cairo_surface_destroy(cairoImg);
+}
+
+void
+RotoContextPrivate::compositeTile(const std::vector<RotoShapeLayer>* layers,const RectI& tile,
+                                  Natron::Image* image)
+{
+    std::vector<float> row(tile.width());
+    for (int y = tile.y1; y < tile.y2; ++y) {
+        std::fill(row.begin(), row.end(), 0.f);
+        for (std::vector<RotoShapeLayer>::const_iterator it = layers->begin(); it != layers->end(); ++it) {
+            const RectI& bounds = it->bounds;
+            int x1 = std::max(tile.x1,bounds.x1);
+            int x2 = std::min(tile.x2,bounds.x2);
+            if (y < bounds.y1 || y >= bounds.y2 || x1 >= x2) {
+                continue;
+            }
+            const unsigned char* over0 = it->over0->pixelAt(x1, y);
+            const unsigned char* over1 = it->over1->pixelAt(x1, y);
+            float* dst = &row[x1 - tile.x1];
+            for (int x = 0; x < x2 - x1; ++x) {
+                dst[x] = (over0[x] + dst[x] * (over1[x] - over0[x])) * (1.f / 255.f);
+            }
+        }
+        switch (image->getBitDepth()) {
+            case Natron::IMAGE_FLOAT:
+                writeMaskRow<float, 1>(row, tile.x1, y, image);
+                break;
+            case Natron::IMAGE_BYTE:
+                writeMaskRow<unsigned char, 255>(row, tile.x1, y, image);
+                break;
+            case Natron::IMAGE_SHORT:
+                writeMaskRow<unsigned short, 65535>(row, tile.x1, y, image);
+                break;
+            default:
+                assert(false);
+                break;
+        }
+    }
 }
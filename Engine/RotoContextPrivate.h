@@ -14,6 +14,7 @@
 #include <list>
 #include <map>
 #include <string>
+#include <vector>
 #include <boost/shared_ptr.hpp>
 
 #include <QMutex>
@@ -32,6 +33,9 @@
 
 #include "Global/GlobalDefines.h"
 
+///Masks are rendered by tiles of this size, each tile being a separate task
+#define NATRON_ROTO_MASK_TILE_SIZE 256
+
 class Bezier;
 
 struct BezierCPPrivate
@@ -274,6 +278,49 @@ struct RotoDrawableItemPrivate
     ~RotoDrawableItemPrivate() {}
 };
 
+/**
+ * @brief The geometry of a shape at a given time and scale. It is evaluated once per mask render and
+ * then drawn in each tile of the mask.
+ **/
+struct RotoShapeRenderData
+{
+    double opacity;
+    bool inverted;
+    
+    ///The move-to point followed by the (control point,control point,end point) triplets of the curves
+    std::vector<Point> fillPath;
+    
+    ///13 points per feather patch: the first corner followed by the 3 points of each of the 4 sides.
+    ///Straight sides are stored as curves with control points at 1/3 and 2/3, as cairo does.
+    std::vector<Point> featherPatches;
+    
+    ///Encloses all the points above: a shape which is not inverted doesn't draw anything outside
+    RectD bbox;
+    
+    RotoShapeRenderData()
+    : opacity(1.)
+    , inverted(false)
+    , fillPath()
+    , featherPatches()
+    , bbox()
+    {
+    }
+};
+
+/**
+ * @brief The contribution of a single shape to the mask, as 2 byte alpha images of the node cache covering the pixels
+ * the shape may modify: the shape drawn over pixels of value 0 and over pixels of value 1. The drawing operations
+ * are affine in the destination value, hence drawing the shape over v gives over0 + v * (over1 - over0),
+ * which is how masks are composited from the layers of their shapes. Only the parts of the layers needed by
+ * the masks rendered are rasterized, their bitmaps tell which.
+ **/
+struct RotoShapeLayer
+{
+    RectI bounds; //< the shape doesn't modify the pixels outside
+    boost::shared_ptr<Natron::Image> over0;
+    boost::shared_ptr<Natron::Image> over1;
+};
+
 struct RotoContextPrivate
 {
     
@@ -379,8 +426,33 @@ struct RotoContextPrivate
     }
     
    
-    void renderInternal(cairo_t* cr,cairo_surface_t* cairoImg,const std::list< boost::shared_ptr<Bezier> >& splines,
-                        unsigned int mipmapLevel,int time);
+    /**
+     * @brief Evaluates the geometry of the shape. Returns false if the shape doesn't render anything.
+     **/
+    static bool evaluateShapeForRender(const boost::shared_ptr<Bezier>& bezier,unsigned int mipmapLevel,int time,
+                                       RotoShapeRenderData* data);
+    
+    /**
+     * @brief Identifies the layer of a shape: its geometry, appearance and bounds.
+     **/
+    static U64 hashShapeLayer(const RotoShapeRenderData& shape,const RectI& bounds);
+    
+    /**
+     * @brief Returns the layer of the shape from the node cache, or creates it. Returns false if it could not be allocated.
+     **/
+    static bool getOrCreateShapeLayer(const RotoShapeRenderData& shape,const RectI& bounds,RotoShapeLayer* layer);
+    
+    /**
+     * @brief Rasterizes the shape in the given rectangle of its layer and marks it rendered.
+     * Thread-safe: rectangles which don't overlap are rendered concurrently.
+     **/
+    static void rasterizeShapeRect(const RotoShapeRenderData* shape,const RectI& rect,const RotoShapeLayer* layer);
+    
+    /**
+     * @brief Composites the layers, in order, in the given tile of the mask. Thread-safe: tiles are rendered concurrently.
+     **/
+    static void compositeTile(const std::vector<RotoShapeLayer>* layers,const RectI& tile,
+                              Natron::Image* image);
         
     
 };
@@ -26,6 +26,7 @@
 #include "Engine/Project.h"
 #include "Engine/Node.h"
 #include "Engine/ViewerInstance.h"
+#include "Engine/ImageBufferPool.h"
 
 
 #define NATRON_CUSTOM_OCIO_CONFIG_NAME "Custom config"
@@ -97,6 +98,18 @@ void Settings::initializeKnobs(){
     _numberOfThreads->setDisplayMinimum(-1);
     _generalTab->addKnob(_numberOfThreads);
     
+    _numberOfParallelFrames = Natron::createKnob<Int_Knob>(this, "Number of frames rendered concurrently by writers");
+    _numberOfParallelFrames->setAnimationEnabled(false);
+    _numberOfParallelFrames->setHintToolTip("Controls how many frames a write node renders at the same time. Frames are still "
+                                            "written in order. Rendering several frames at once uses more memory but keeps all the cores "
+                                            "busy on light graphs.\n"
+                                            "0: Guess from the number of render threads. \n"
+                                            "1: Render one frame at a time.");
+    _numberOfParallelFrames->disableSlider();
+    _numberOfParallelFrames->setMinimum(0);
+    _numberOfParallelFrames->setDisplayMinimum(0);
+    _generalTab->addKnob(_numberOfParallelFrames);
+    
     _renderInSeparateProcess = Natron::createKnob<Bool_Knob>(this, "Render in a separate process");
     _renderInSeparateProcess->setAnimationEnabled(false);
     _renderInSeparateProcess->setHintToolTip("If true, " NATRON_APPLICATION_NAME " will render (using the write nodes) in "
@@ -268,6 +281,13 @@ void Settings::initializeKnobs(){
     _powerOf2Tiling->setAnimationEnabled(false);
     _viewersTab->addKnob(_powerOf2Tiling);
     
+    _viewerBoxFilter = Natron::createKnob<Bool_Knob>(this, "Filter the image when zoomed out");
+    _viewerBoxFilter->setHintToolTip("When checked, each pixel of the viewer averages the block of image pixels it covers when "
+                                     "the viewer is zoomed out, instead of picking one of them. This removes the aliasing of fine details "
+                                     "at the expense of a slower conversion of the image to the viewer's texture.");
+    _viewerBoxFilter->setAnimationEnabled(false);
+    _viewersTab->addKnob(_viewerBoxFilter);
+    
     /////////// Nodegraph tab
     _nodegraphTab = Natron::createKnob<Page_Knob>(this, "Nodegraph");
     
@@ -425,6 +445,88 @@ void Settings::initializeKnobs(){
     _maxDiskCacheGB->setHintToolTip("The maximum disk space the caches can use. (in GB)");
     _cachingTab->addKnob(_maxDiskCacheGB);
     
+    _diskCacheCompression = Natron::createKnob<Choice_Knob>(this, "Disk cache compression");
+    _diskCacheCompression->setAnimationEnabled(false);
+    std::vector<std::string> compressionModes;
+    std::vector<std::string> helpStringsCompressionModes;
+    compressionModes.push_back("None");
+    helpStringsCompressionModes.push_back("The frames are written to disk as they are in memory.");
+    compressionModes.push_back("Lossless");
+    helpStringsCompressionModes.push_back("The frames are compressed without any loss when they are written to disk. "
+                                          "They typically take 2 to 3 times less space.");
+    compressionModes.push_back("Half-float viewer textures");
+    helpStringsCompressionModes.push_back("Same as lossless, but the 32 bits floating-point viewer textures are stored as 16 bits "
+                                          "half floats, which is more than enough for display. "
+                                          "They typically take 4 to 5 times less space.");
+    _diskCacheCompression->populateChoices(compressionModes,helpStringsCompressionModes);
+    _diskCacheCompression->setHintToolTip("How the frames moved to the disk cache are stored. Compressing them fits more frames "
+                                          "in the maximum disk cache size, at the cost of some CPU time in the background "
+                                          "when they are written and when they are read back.");
+    _cachingTab->addKnob(_diskCacheCompression);
+    
+    _contentBasedNodeHash = Natron::createKnob<Bool_Knob>(this, "Content-based cache keys");
+    _contentBasedNodeHash->setAnimationEnabled(false);
+    _contentBasedNodeHash->setHintToolTip("When checked, the cache keys of the images rendered by a node are computed "
+                                          "from the content of the graph only: the plug-in and its version, the values and "
+                                          "animation of the parameters and the inputs. Identical graphs then share their "
+                                          "cached images, even across projects and sessions, which is useful with the disk cache. "
+                                          "When unchecked, the node name and the project are part of the key as well.");
+    _cachingTab->addKnob(_contentBasedNodeHash);
+    
+    _imageCacheTileSize = Natron::createKnob<Int_Knob>(this, "Image cache tile size");
+    _imageCacheTileSize->setAnimationEnabled(false);
+    _imageCacheTileSize->setMinimum(0);
+    _imageCacheTileSize->setMaximum(4096);
+    _imageCacheTileSize->setHintToolTip("When greater than 0, the images rendered by the nodes are cached as tiles of "
+                                        "this many pixels wide and high instead of as whole images: only the tiles "
+                                        "covering the region that is actually displayed are rendered, allocated and kept in "
+                                        "the cache. This reduces a lot the memory used when looking at a small portion "
+                                        "of a large image. Plug-ins that don't support tiles always use whole images. "
+                                        "0 caches whole images.");
+    _cachingTab->addKnob(_imageCacheTileSize);
+    
+    _imageHugePages = Natron::createKnob<Bool_Knob>(this, "Use huge pages for images");
+    _imageHugePages->setAnimationEnabled(false);
+    _imageHugePages->setHintToolTip("When checked, the memory of the large images kept in RAM is allocated with transparent "
+                                    "huge pages (Linux only). This reduces the cost of the first access to the pixels of "
+                                    "big frames, at the price of a slightly higher memory usage.");
+    _cachingTab->addKnob(_imageHugePages);
+    
+    _playbackReadAheadFrames = Natron::createKnob<Int_Knob>(this, "Playback read-ahead frames");
+    _playbackReadAheadFrames->setAnimationEnabled(false);
+    _playbackReadAheadFrames->setMinimum(0);
+    _playbackReadAheadFrames->setMaximum(64);
+    _playbackReadAheadFrames->setHintToolTip("During playback in a viewer, the read nodes decode this many frames ahead "
+                                             "of the frame being displayed, in the background, so that reading the files "
+                                             "overlaps with the display. This helps a lot when the files are on a slow "
+                                             "(e.g: network) storage. 0 disables it.");
+    _cachingTab->addKnob(_playbackReadAheadFrames);
+    
+    _playbackReadAheadMemoryMB = Natron::createKnob<Int_Knob>(this, "Playback read-ahead memory");
+    _playbackReadAheadMemoryMB->setAnimationEnabled(false);
+    _playbackReadAheadMemoryMB->setMinimum(0);
+    _playbackReadAheadMemoryMB->setMaximum(65536);
+    _playbackReadAheadMemoryMB->setHintToolTip("The maximum memory (in MB) the frames decoded ahead during playback "
+                                               "can use. No more frames are decoded ahead while this limit is reached.");
+    _cachingTab->addKnob(_playbackReadAheadMemoryMB);
+    
+    _sharedImageCacheMB = Natron::createKnob<Int_Knob>(this, "Shared image cache size");
+    _sharedImageCacheMB->setAnimationEnabled(false);
+    _sharedImageCacheMB->setMinimum(0);
+    _sharedImageCacheMB->setMaximum(65536);
+    _sharedImageCacheMB->setHintToolTip("The size (in MB) of the shared memory the background render processes of this "
+                                        "computer use to share the images they render: a process needing an image that "
+                                        "another one already rendered, e.g. for 2 writers downstream of the same nodes, "
+                                        "copies it instead of rendering it again. The images are only shared while "
+                                        "several processes run at the same time, the oldest ones being replaced by the new "
+                                        "ones, and the memory is freed when the last process exits (or when the computer "
+                                        "restarts if one crashed). An image bigger than a quarter of this size is not "
+                                        "shared: e.g. a 4K UHD float RGBA image (about 133 MB) needs more than 512 MB. "
+                                        "It is created by the first process that needs it: changing this has no effect "
+                                        "until all of them exit. 0 disables the sharing. Enable the content-based "
+                                        "cache keys to share the images of identical graphs across projects.");
+    _cachingTab->addKnob(_sharedImageCacheMB);
+    
     
     ///readers & writers settings are created in a postponed manner because we don't know
     ///their dimension yet. See populateReaderPluginsAndFormats & populateWriterPluginsAndFormats
@@ -450,6 +552,7 @@ void Settings::setDefaultValues() {
     _snapNodesToConnections->setDefaultValue(true);
     _useNodeGraphHints->setDefaultValue(true);
     _numberOfThreads->setDefaultValue(0,0);
+    _numberOfParallelFrames->setDefaultValue(0,0);
     _renderInSeparateProcess->setDefaultValue(true,0);
     _autoPreviewEnabledForNewProjects->setDefaultValue(true,0);
     _maxPanelsOpened->setDefaultValue(10,0);
@@ -459,9 +562,17 @@ void Settings::setDefaultValues() {
     _loadBundledPlugins->setDefaultValue(true);
     _texturesMode->setDefaultValue(0,0);
     _powerOf2Tiling->setDefaultValue(8,0);
+    _viewerBoxFilter->setDefaultValue(false,0);
     _maxRAMPercent->setDefaultValue(50,0);
     _maxPlayBackPercent->setDefaultValue(25,0);
     _maxDiskCacheGB->setDefaultValue(10,0);
+    _diskCacheCompression->setDefaultValue(0,0);
+    _contentBasedNodeHash->setDefaultValue(false);
+    _imageCacheTileSize->setDefaultValue(0,0);
+    _imageHugePages->setDefaultValue(false);
+    _playbackReadAheadFrames->setDefaultValue(4,0);
+    _playbackReadAheadMemoryMB->setDefaultValue(1024,0);
+    _sharedImageCacheMB->setDefaultValue(0,0);
     _defaultNodeColor->setDefaultValue(0.6,0);
     _defaultNodeColor->setDefaultValue(0.6,1);
     _defaultNodeColor->setDefaultValue(0.6,2);
@@ -558,6 +669,7 @@ void Settings::saveSettings(){
     settings.setValue("AutoSaveDelay", _autoSaveDelay->getValue());
     settings.setValue("LinearColorPickers",_linearPickers->getValue());
     settings.setValue("Number of threads", _numberOfThreads->getValue());
+    settings.setValue("Number of parallel frames", _numberOfParallelFrames->getValue());
     settings.setValue("RenderInSeparateProcess", _renderInSeparateProcess->getValue());
     settings.setValue("AutoPreviewDefault", _autoPreviewEnabledForNewProjects->getValue());
     settings.setValue("MaxPanelsOpened", _maxPanelsOpened->getValue());
@@ -580,11 +692,19 @@ void Settings::saveSettings(){
     settings.setValue("MaximumRAMUsagePercentage", _maxRAMPercent->getValue());
     settings.setValue("MaximumPlaybackRAMUsage", _maxPlayBackPercent->getValue());
     settings.setValue("MaximumDiskSizeUsage", _maxDiskCacheGB->getValue());
+    settings.setValue("DiskCacheCompression", _diskCacheCompression->getValue());
+    settings.setValue("ContentBasedNodeHash", _contentBasedNodeHash->getValue());
+    settings.setValue("ImageCacheTileSize", _imageCacheTileSize->getValue());
+    settings.setValue("ImageHugePages", _imageHugePages->getValue());
+    settings.setValue("PlaybackReadAheadFrames", _playbackReadAheadFrames->getValue());
+    settings.setValue("PlaybackReadAheadMemory", _playbackReadAheadMemoryMB->getValue());
+    settings.setValue("SharedImageCacheSize", _sharedImageCacheMB->getValue());
     settings.endGroup();
     
     settings.beginGroup("Viewers");
     settings.setValue("ByteTextures", _texturesMode->getValue());
     settings.setValue("TilesPowerOf2", _powerOf2Tiling->getValue());
+    settings.setValue("BoxFilter", _viewerBoxFilter->getValue());
     settings.endGroup();
     
     settings.beginGroup("Nodegraph");
@@ -691,6 +811,9 @@ void Settings::restoreSettings(){
     if (settings.contains("Number of threads")) {
         _numberOfThreads->setValue(settings.value("Number of threads").toInt(),0);
     }
+    if (settings.contains("Number of parallel frames")) {
+        _numberOfParallelFrames->setValue(settings.value("Number of parallel frames").toInt(),0);
+    }
     if (settings.contains("RenderInSeparateProcess")) {
         _renderInSeparateProcess->setValue(settings.value("RenderInSeparateProcess").toBool(),0);
     }
@@ -741,6 +864,27 @@ void Settings::restoreSettings(){
     if(settings.contains("MaximumDiskSizeUsage")){
         _maxDiskCacheGB->setValue(settings.value("MaximumDiskSizeUsage").toInt(),0);
     }
+    if(settings.contains("DiskCacheCompression")){
+        _diskCacheCompression->setValue(settings.value("DiskCacheCompression").toInt(),0);
+    }
+    if(settings.contains("ContentBasedNodeHash")){
+        _contentBasedNodeHash->setValue(settings.value("ContentBasedNodeHash").toBool(),0);
+    }
+    if(settings.contains("ImageCacheTileSize")){
+        _imageCacheTileSize->setValue(settings.value("ImageCacheTileSize").toInt(),0);
+    }
+    if(settings.contains("ImageHugePages")){
+        _imageHugePages->setValue(settings.value("ImageHugePages").toBool(),0);
+    }
+    if(settings.contains("PlaybackReadAheadFrames")){
+        _playbackReadAheadFrames->setValue(settings.value("PlaybackReadAheadFrames").toInt(),0);
+    }
+    if(settings.contains("PlaybackReadAheadMemory")){
+        _playbackReadAheadMemoryMB->setValue(settings.value("PlaybackReadAheadMemory").toInt(),0);
+    }
+    if(settings.contains("SharedImageCacheSize")){
+        _sharedImageCacheMB->setValue(settings.value("SharedImageCacheSize").toInt(),0);
+    }
     settings.endGroup();
     
     settings.beginGroup("Viewers");
@@ -750,6 +894,9 @@ void Settings::restoreSettings(){
     if (settings.contains("TilesPowerOf2")) {
         _powerOf2Tiling->setValue(settings.value("TilesPowerOf2").toInt(),0);
     }
+    if (settings.contains("BoxFilter")) {
+        _viewerBoxFilter->setValue(settings.value("BoxFilter").toBool(),0);
+    }
     settings.endGroup();
     
     settings.beginGroup("Nodegraph");
@@ -1027,8 +1174,38 @@ void Settings::onKnobValueChanged(KnobI* k,Natron::ValueChangedReason /*reason*/
                 }
             }
         }
+    } else if (k == _viewerBoxFilter.get()) {
+        ///the textures in the viewer cache were made with the other filter
+        appPTR->clearPlaybackCache();
+        std::map<int,AppInstanceRef> apps = appPTR->getAppInstances();
+        for(std::map<int,AppInstanceRef>::iterator it = apps.begin();it!=apps.end();++it){
+            const std::vector<boost::shared_ptr<Node> > nodes = it->second.app->getProject()->getCurrentNodes();
+            for (U32 i = 0; i < nodes.size(); ++i) {
+                assert(nodes[i]);
+                if (nodes[i]->pluginID() == "Viewer") {
+                    ViewerInstance* n = dynamic_cast<ViewerInstance*>(nodes[i]->getLiveInstance());
+                    assert(n);
+                    n->updateTreeAndRender();
+                }
+            }
+        }
     } else if(k == _maxDiskCacheGB.get()) {
         appPTR->setApplicationsCachesMaximumDiskSpace(getMaximumDiskCacheSize());
+    } else if(k == _diskCacheCompression.get()) {
+        appPTR->setApplicationsCachesDiskCompression(getDiskCacheCompression());
+    } else if(k == _contentBasedNodeHash.get()) {
+        ///the cache keys of all nodes change, recompute them. computeHash() recurses on the outputs
+        ///but that's fine, the hashes only depend on the inputs.
+        std::map<int,AppInstanceRef> apps = appPTR->getAppInstances();
+        for(std::map<int,AppInstanceRef>::iterator it = apps.begin();it!=apps.end();++it){
+            const std::vector<boost::shared_ptr<Node> > nodes = it->second.app->getProject()->getCurrentNodes();
+            for (U32 i = 0; i < nodes.size(); ++i) {
+                assert(nodes[i]);
+                nodes[i]->computeHash();
+            }
+        }
+    } else if(k == _imageHugePages.get()) {
+        Natron::ImageBufferPool::instance().setHugePagesEnabled(_imageHugePages->getValue());
     } else if(k == _maxRAMPercent.get()) {
         appPTR->setApplicationsCachesMaximumMemoryPercent(getRamMaximumPercent());
     } else if(k == _maxPlayBackPercent.get()) {
@@ -1043,6 +1220,7 @@ void Settings::onKnobValueChanged(KnobI* k,Natron::ValueChangedReason /*reason*/
         } else {
             QThreadPool::globalInstance()->setMaxThreadCount(nbThreads);
         }
+        appPTR->onNumberOfThreadsChanged(nbThreads);
     } else if(k == _ocioConfigKnob.get()) {
         if (_ocioConfigKnob->getActiveEntryText() == std::string(NATRON_CUSTOM_OCIO_CONFIG_NAME)) {
             _customOcioConfigFile->setAllDimensionsEnabled(true);
@@ -1068,6 +1246,10 @@ int Settings::getViewerTilesPowerOf2() const {
     return _powerOf2Tiling->getValue();
 }
 
+bool Settings::isViewerDownscaleFiltered() const {
+    return _viewerBoxFilter->getValue();
+}
+
 double Settings::getRamMaximumPercent() const {
     return (double)_maxRAMPercent->getValue() / 100.;
 }
@@ -1079,6 +1261,10 @@ double Settings::getRamPlaybackMaximumPercent() const{
 U64 Settings::getMaximumDiskCacheSize() const {
     return ((U64)(_maxDiskCacheGB->getValue()) * std::pow(1024.,3.));
 }
+
+int Settings::getDiskCacheCompression() const {
+    return _diskCacheCompression->getValue();
+}
 bool Settings::getColorPickerLinear() const {
     return _linearPickers->getValue();
 }
@@ -1091,6 +1277,10 @@ void Settings::setNumberOfThreads(int threadsNb) {
     _numberOfThreads->setValue(threadsNb,0);
 }
 
+int Settings::getNumberOfParallelFrames() const {
+    return _numberOfParallelFrames->getValue();
+}
+
 bool Settings::isAutoPreviewOnForNewProjects() const {
     return _autoPreviewEnabledForNewProjects->getValue();
 }
@@ -1388,4 +1578,44 @@ bool Settings::getRenderOnEditingFinishedOnly() const
 void Settings::setRenderOnEditingFinishedOnly(bool render)
 {
     _renderOnEditingFinished->setValue(render, 0);
-}
\ No newline at end of file
+}
+
+bool Settings::isContentBasedNodeHashEnabled() const
+{
+    return _contentBasedNodeHash->getValue();
+}
+
+void Settings::setContentBasedNodeHashEnabled(bool enabled)
+{
+    _contentBasedNodeHash->setValue(enabled, 0);
+}
+
+int Settings::getImageCacheTileSize() const
+{
+    return _imageCacheTileSize->getValue();
+}
+
+void Settings::setImageCacheTileSize(int tileSize)
+{
+    _imageCacheTileSize->setValue(tileSize, 0);
+}
+
+int Settings::getPlaybackReadAheadFrames() const
+{
+    return _playbackReadAheadFrames->getValue();
+}
+
+void Settings::setPlaybackReadAheadFrames(int frames)
+{
+    _playbackReadAheadFrames->setValue(frames, 0);
+}
+
+U64 Settings::getPlaybackReadAheadMaxMemory() const
+{
+    return (U64)_playbackReadAheadMemoryMB->getValue() * 1024 * 1024;
+}
+
+U64 Settings::getSharedImageCacheSize() const
+{
+    return (U64)_sharedImageCacheMB->getValue() * 1024 * 1024;
+}
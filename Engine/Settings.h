@@ -55,18 +55,26 @@ public:
     
     int getViewerTilesPowerOf2() const;
     
+    bool isViewerDownscaleFiltered() const;
+    
     double getRamMaximumPercent() const;
     
     double getRamPlaybackMaximumPercent() const;
     
     U64 getMaximumDiskCacheSize() const;
     
+    ///A Natron::CacheCompressionMode
+    int getDiskCacheCompression() const;
+    
     bool getColorPickerLinear() const;
     
     int getNumberOfThreads() const;
     
     void setNumberOfThreads(int threadsNb);
     
+    ///0 means automatic, 1 means writers render one frame at a time
+    int getNumberOfParallelFrames() const;
+    
     const std::string& getReaderPluginIDForFileType(const std::string& extension);
     
     const std::string& getWriterPluginIDForFileType(const std::string& extension);
@@ -144,6 +152,23 @@ public:
     bool getRenderOnEditingFinishedOnly() const;
     void setRenderOnEditingFinishedOnly(bool render);
     
+    bool isContentBasedNodeHashEnabled() const;
+    void setContentBasedNodeHashEnabled(bool enabled);
+    
+    ///0 if images are cached as a whole
+    int getImageCacheTileSize() const;
+    void setImageCacheTileSize(int tileSize);
+    
+    ///Number of frames of the readers decoded ahead of the viewer during playback, 0 disables it
+    int getPlaybackReadAheadFrames() const;
+    void setPlaybackReadAheadFrames(int frames);
+    
+    ///Maximum memory held by the frames decoded ahead, in bytes
+    U64 getPlaybackReadAheadMaxMemory() const;
+    
+    ///Size of the node cache shared by the background render processes, in bytes. 0 disables it
+    U64 getSharedImageCacheSize() const;
+    
     std::string getHostName() const;
 private:
     
@@ -159,6 +184,7 @@ private:
     boost::shared_ptr<Int_Knob> _autoSaveDelay;
     boost::shared_ptr<Bool_Knob> _linearPickers;
     boost::shared_ptr<Int_Knob> _numberOfThreads;
+    boost::shared_ptr<Int_Knob> _numberOfParallelFrames;
     boost::shared_ptr<Bool_Knob> _renderInSeparateProcess;
     boost::shared_ptr<Bool_Knob> _autoPreviewEnabledForNewProjects;
     boost::shared_ptr<Int_Knob> _maxPanelsOpened;
@@ -175,10 +201,18 @@ private:
     boost::shared_ptr<Int_Knob> _maxPlayBackPercent;
     boost::shared_ptr<Int_Knob> _maxRAMPercent;
     boost::shared_ptr<Int_Knob> _maxDiskCacheGB;
+    boost::shared_ptr<Choice_Knob> _diskCacheCompression;
+    boost::shared_ptr<Bool_Knob> _contentBasedNodeHash;
+    boost::shared_ptr<Int_Knob> _imageCacheTileSize;
+    boost::shared_ptr<Bool_Knob> _imageHugePages;
+    boost::shared_ptr<Int_Knob> _playbackReadAheadFrames;
+    boost::shared_ptr<Int_Knob> _playbackReadAheadMemoryMB;
+    boost::shared_ptr<Int_Knob> _sharedImageCacheMB;
     
     boost::shared_ptr<Page_Knob> _viewersTab;
     boost::shared_ptr<Choice_Knob> _texturesMode;
     boost::shared_ptr<Int_Knob> _powerOf2Tiling;
+    boost::shared_ptr<Bool_Knob> _viewerBoxFilter;
     
     boost::shared_ptr<Page_Knob> _nodegraphTab;
     boost::shared_ptr<Bool_Knob> _useNodeGraphHints;
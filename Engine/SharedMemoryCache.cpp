@@ -0,0 +1,472 @@
+//  Natron
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "SharedMemoryCache.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+#include "Global/Macros.h"
+#ifndef __NATRON_WIN32__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+CLANG_DIAG_OFF(deprecated)
+#include <QtCore/QAtomicInt>
+#include <QtCore/QThread>
+#include <QtCore/QDebug>
+CLANG_DIAG_ON(deprecated)
+
+#include "Engine/CacheJournal.h"
+
+using namespace Natron;
+
+///Bumped whenever the layout of the segment changes
+#define NATRON_SHARED_MEMORY_CACHE_LAYOUT_VERSION 2
+
+/*
+ * Layout of the segment:
+ * - the SegmentHeader, in the first block
+ * - slotsCount Slots, padded to a whole number of blocks
+ * - blocksCount blocks of data. A record is a header then data, in consecutive blocks: records never wrap around
+ * the end of the ring.
+ * The counts are powers of 2, so that the allocation cursor can wrap around 2^32 without breaking the modulo.
+ * The segment is zero-filled when it is created, which is the initial state of the atomic ints.
+ */
+
+struct SharedMemoryCache::SegmentHeader
+{
+    char magic[8];
+    U32 layoutVersion;
+    U32 blockSize;
+    U32 slotsCount;
+    U32 blocksCount;
+    QAtomicInt ready; //< set last by the process which created the segment
+    QAtomicInt cursor; //< the allocation cursor, in blocks
+    QAtomicInt attachedCount; //< mappings opened and not closed yet, including the ones of crashed processes
+};
+
+struct SharedMemoryCache::Slot
+{
+    QAtomicInt sequence; //< odd while the slot is being written, 0 if it never was
+    U32 blocksCount;
+    U64 hash;
+    U32 firstBlock;
+    U32 unused;
+    U64 headerSize;
+    U64 dataSize;
+    U64 headerChecksum;
+    U64 dataChecksum;
+    U64 reserved; //< pads the slots to 64 bytes
+};
+
+namespace {
+
+const char kMagic[8] = { 'N', 'T', 'R', 'S', 'H', 'M', 'C', 'H' };
+
+///How long a process opening the segment waits for the process creating it
+const int kCreationTimeoutMs = 2000;
+
+const U32 kMinimumBlocksCount = 64;
+const U32 kMaximumBlocksCount = 1u << 30;
+
+U32
+floorPowerOfTwo(U64 x)
+{
+    U32 p = 1;
+    while ((U64)p * 2 <= x && p < (1u << 31)) {
+        p *= 2;
+    }
+    return p;
+}
+
+std::size_t
+getSlotsAreaSize(U32 slotsCount)
+{
+    std::size_t size = (std::size_t)slotsCount * 64;
+    return (size + NATRON_SHARED_MEMORY_CACHE_BLOCK_SIZE - 1) / NATRON_SHARED_MEMORY_CACHE_BLOCK_SIZE * NATRON_SHARED_MEMORY_CACHE_BLOCK_SIZE;
+}
+
+std::size_t
+getSegmentSize(U32 slotsCount,
+               U32 blocksCount)
+{
+    return NATRON_SHARED_MEMORY_CACHE_BLOCK_SIZE + getSlotsAreaSize(slotsCount) +
+    (std::size_t)blocksCount * NATRON_SHARED_MEMORY_CACHE_BLOCK_SIZE;
+}
+
+///Reads an atomic int of the segment, ordered with the accesses around it
+int
+loadOrdered(QAtomicInt& value)
+{
+    return value.fetchAndAddOrdered(0);
+}
+
+} // anon namespace
+
+SharedMemoryCache::SharedMemoryCache()
+: _segment(NULL)
+, _slots(NULL)
+, _blocks(NULL)
+, _mappedSize(0)
+, _name()
+{
+    assert(sizeof(SegmentHeader) <= NATRON_SHARED_MEMORY_CACHE_BLOCK_SIZE);
+    assert(sizeof(Slot) == 64);
+}
+
+SharedMemoryCache::~SharedMemoryCache()
+{
+    close();
+}
+
+bool
+SharedMemoryCache::open(const std::string& name,
+                        U64 size)
+{
+    close();
+#ifdef __NATRON_WIN32__
+    (void)name;
+    (void)size;
+    qDebug() << "The shared memory cache is not available on Windows";
+    return false;
+#else
+    ///the layout of a new segment: about a slot per 4 blocks, a record usually spans many more
+    U32 blocksCount = std::min(kMaximumBlocksCount,floorPowerOfTwo(std::max((U64)kMinimumBlocksCount,size / NATRON_SHARED_MEMORY_CACHE_BLOCK_SIZE)));
+    U32 slotsCount = std::max((U32)1024,blocksCount / 4);
+
+    int fd = ::shm_open(name.c_str(),O_RDWR | O_CREAT | O_EXCL,0600);
+    bool created = fd >= 0;
+    if (!created) {
+        if (errno != EEXIST) {
+            qDebug() << "Failed to create the shared memory segment" << name.c_str() << ":" << std::strerror(errno);
+            return false;
+        }
+        fd = ::shm_open(name.c_str(),O_RDWR,0600);
+        if (fd < 0) {
+            qDebug() << "Failed to open the shared memory segment" << name.c_str() << ":" << std::strerror(errno);
+            return false;
+        }
+    }
+
+    std::size_t mappedSize = 0;
+    if (created) {
+        mappedSize = getSegmentSize(slotsCount,blocksCount);
+        if (::ftruncate(fd,(off_t)mappedSize) != 0) {
+            qDebug() << "Failed to allocate the shared memory segment" << name.c_str() << ":" << std::strerror(errno);
+            ::close(fd);
+            ::shm_unlink(name.c_str());
+            return false;
+        }
+    } else {
+        ///the process which created the segment may not have sized it yet
+        struct stat st;
+        for (int waited = 0; ; ++waited) {
+            if (::fstat(fd,&st) != 0) {
+                ::close(fd);
+                return false;
+            }
+            if (st.st_size >= NATRON_SHARED_MEMORY_CACHE_BLOCK_SIZE || waited >= kCreationTimeoutMs) {
+                break;
+            }
+            QThread::msleep(1);
+        }
+        mappedSize = (std::size_t)st.st_size;
+        if (mappedSize < NATRON_SHARED_MEMORY_CACHE_BLOCK_SIZE) {
+            qDebug() << "The shared memory segment" << name.c_str() << "was never initialized";
+            ::close(fd);
+            return false;
+        }
+    }
+
+    void* mapping = ::mmap(0,mappedSize,PROT_READ | PROT_WRITE,MAP_SHARED,fd,0);
+    ::close(fd);
+    if (mapping == MAP_FAILED) {
+        qDebug() << "Failed to map the shared memory segment" << name.c_str() << ":" << std::strerror(errno);
+        if (created) {
+            ::shm_unlink(name.c_str());
+        }
+        return false;
+    }
+    SegmentHeader* segment = (SegmentHeader*)mapping;
+
+    if (created) {
+        std::memcpy(segment->magic,kMagic,sizeof(kMagic));
+        segment->layoutVersion = NATRON_SHARED_MEMORY_CACHE_LAYOUT_VERSION;
+        segment->blockSize = NATRON_SHARED_MEMORY_CACHE_BLOCK_SIZE;
+        segment->slotsCount = slotsCount;
+        segment->blocksCount = blocksCount;
+        segment->ready.fetchAndStoreOrdered(1);
+    } else {
+        for (int waited = 0; loadOrdered(segment->ready) == 0 && waited < kCreationTimeoutMs; ++waited) {
+            QThread::msleep(1);
+        }
+        bool valid = loadOrdered(segment->ready) != 0 &&
+        std::memcmp(segment->magic,kMagic,sizeof(kMagic)) == 0 &&
+        segment->layoutVersion == NATRON_SHARED_MEMORY_CACHE_LAYOUT_VERSION &&
+        segment->blockSize == NATRON_SHARED_MEMORY_CACHE_BLOCK_SIZE &&
+        segment->blocksCount >= kMinimumBlocksCount && segment->blocksCount <= kMaximumBlocksCount &&
+        (segment->blocksCount & (segment->blocksCount - 1)) == 0 &&
+        segment->slotsCount > 0 && (segment->slotsCount & (segment->slotsCount - 1)) == 0 &&
+        getSegmentSize(segment->slotsCount,segment->blocksCount) == mappedSize;
+        if (!valid) {
+            qDebug() << "The shared memory segment" << name.c_str() << "was made by another version or is corrupted";
+            ::munmap(mapping,mappedSize);
+            return false;
+        }
+    }
+
+    segment->attachedCount.ref();
+    _segment = segment;
+    _mappedSize = mappedSize;
+    _name = name;
+    _slots = (Slot*)((U8*)mapping + NATRON_SHARED_MEMORY_CACHE_BLOCK_SIZE);
+    _blocks = (U8*)mapping + NATRON_SHARED_MEMORY_CACHE_BLOCK_SIZE + getSlotsAreaSize(_segment->slotsCount);
+    return true;
+#endif
+}
+
+void
+SharedMemoryCache::close()
+{
+#ifndef __NATRON_WIN32__
+    if (_segment) {
+        ///the last one out removes the segment. A process opening it meanwhile keeps its mapping, and the next
+        ///ones create a new segment
+        bool last = !_segment->attachedCount.deref();
+        ::munmap(_segment,_mappedSize);
+        if (last) {
+            removeSegment(_name);
+        }
+    }
+#endif
+    _segment = NULL;
+    _slots = NULL;
+    _blocks = NULL;
+    _mappedSize = 0;
+    _name.clear();
+}
+
+bool
+SharedMemoryCache::hasOtherMappings() const
+{
+    return _segment && loadOrdered(_segment->attachedCount) > 1;
+}
+
+bool
+SharedMemoryCache::removeSegment(const std::string& name)
+{
+#ifdef __NATRON_WIN32__
+    (void)name;
+    return false;
+#else
+    return ::shm_unlink(name.c_str()) == 0;
+#endif
+}
+
+U64
+SharedMemoryCache::getCapacity() const
+{
+    return _segment ? (U64)_segment->blocksCount * NATRON_SHARED_MEMORY_CACHE_BLOCK_SIZE : 0;
+}
+
+U64
+SharedMemoryCache::getMaximumRecordSize() const
+{
+    ///a record may not take more than a fourth of the ring, or a few records would flush the whole cache
+    return getCapacity() / 4;
+}
+
+U8*
+SharedMemoryCache::getBlock(U32 cursor) const
+{
+    return _blocks + (std::size_t)(cursor & (_segment->blocksCount - 1)) * NATRON_SHARED_MEMORY_CACHE_BLOCK_SIZE;
+}
+
+bool
+SharedMemoryCache::isOverwritten(U32 firstBlock) const
+{
+    U32 cursor = (U32)loadOrdered(_segment->cursor);
+    return (U32)(cursor - firstBlock) > _segment->blocksCount;
+}
+
+bool
+SharedMemoryCache::readSlot(Slot* slot,
+                            Record* record,
+                            int* sequence) const
+{
+    int before = loadOrdered(slot->sequence);
+    if (before & 1) {
+        return false;
+    }
+    record->hash = slot->hash;
+    record->firstBlock = slot->firstBlock;
+    record->blocksCount = slot->blocksCount;
+    record->headerSize = slot->headerSize;
+    record->dataSize = slot->dataSize;
+    record->headerChecksum = slot->headerChecksum;
+    record->dataChecksum = slot->dataChecksum;
+    *sequence = before;
+    return loadOrdered(slot->sequence) == before;
+}
+
+bool
+SharedMemoryCache::insert(U64 hash,
+                          const std::string& header,
+                          const void* data,
+                          std::size_t dataSize)
+{
+    if (!_segment) {
+        return false;
+    }
+    U64 recordSize = header.size() + dataSize;
+    if (recordSize == 0 || recordSize > getMaximumRecordSize()) {
+        return false;
+    }
+    const U32 blocksCount = (U32)((recordSize + NATRON_SHARED_MEMORY_CACHE_BLOCK_SIZE - 1) / NATRON_SHARED_MEMORY_CACHE_BLOCK_SIZE);
+
+    ///allocate consecutive blocks: a reservation crossing the end of the ring is dropped and the next one starts
+    ///at its beginning, unless other processes raced us there
+    U32 firstBlock = 0;
+    bool allocated = false;
+    for (int attempt = 0; attempt < 4 && !allocated; ++attempt) {
+        firstBlock = (U32)_segment->cursor.fetchAndAddOrdered((int)blocksCount);
+        allocated = (firstBlock & (_segment->blocksCount - 1)) + blocksCount <= _segment->blocksCount;
+    }
+    if (!allocated) {
+        return false;
+    }
+
+    U8* dst = getBlock(firstBlock);
+    if (!header.empty()) {
+        std::memcpy(dst,header.data(),header.size());
+    }
+    if (dataSize) {
+        std::memcpy(dst + header.size(),data,dataSize);
+    }
+    U64 headerChecksum = CacheJournal::checksum(header.data(),header.size());
+    U64 dataChecksum = CacheJournal::checksum(data,dataSize);
+    if (isOverwritten(firstBlock)) {
+        return false;
+    }
+
+    ///Index the record in the first slot that is free, already holds this hash or whose record was overwritten,
+    ///otherwise replace the oldest record of the probed slots
+    const U32 mask = _segment->slotsCount - 1;
+    const U32 cursor = (U32)loadOrdered(_segment->cursor);
+    Slot* target = NULL;
+    int targetSequence = 0;
+    U32 oldestAge = 0;
+    for (U32 i = 0; i < NATRON_SHARED_MEMORY_CACHE_MAX_PROBES; ++i) {
+        Slot* slot = &_slots[((U32)hash + i) & mask];
+        Record existing;
+        int sequence;
+        if (!readSlot(slot,&existing,&sequence)) {
+            continue;
+        }
+        if (sequence == 0 || existing.hash == hash || isOverwritten(existing.firstBlock)) {
+            target = slot;
+            targetSequence = sequence;
+            break;
+        }
+        U32 age = cursor - existing.firstBlock;
+        if (!target || age > oldestAge) {
+            target = slot;
+            targetSequence = sequence;
+            oldestAge = age;
+        }
+    }
+    if (!target || !target->sequence.testAndSetOrdered(targetSequence,targetSequence + 1)) {
+        ///another process is writing this slot
+        return false;
+    }
+    target->hash = hash;
+    target->firstBlock = firstBlock;
+    target->blocksCount = blocksCount;
+    target->headerSize = header.size();
+    target->dataSize = dataSize;
+    target->headerChecksum = headerChecksum;
+    target->dataChecksum = dataChecksum;
+    target->sequence.fetchAndAddOrdered(1);
+    return true;
+}
+
+bool
+SharedMemoryCache::contains(U64 hash) const
+{
+    if (!_segment) {
+        return false;
+    }
+    const U32 mask = _segment->slotsCount - 1;
+    for (U32 i = 0; i < NATRON_SHARED_MEMORY_CACHE_MAX_PROBES; ++i) {
+        Record record;
+        int sequence;
+        if (!readSlot(&_slots[((U32)hash + i) & mask],&record,&sequence)) {
+            continue;
+        }
+        if (sequence == 0) {
+            ///slots are never emptied: the hash can't be further
+            return false;
+        }
+        if (record.hash == hash && !isOverwritten(record.firstBlock)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool
+SharedMemoryCache::find(U64 hash,
+                        Record* record,
+                        std::string* header) const
+{
+    if (!_segment) {
+        return false;
+    }
+    const U32 mask = _segment->slotsCount - 1;
+    for (U32 i = 0; i < NATRON_SHARED_MEMORY_CACHE_MAX_PROBES; ++i) {
+        Record found;
+        int sequence;
+        if (!readSlot(&_slots[((U32)hash + i) & mask],&found,&sequence)) {
+            continue;
+        }
+        if (sequence == 0) {
+            return false;
+        }
+        if (found.hash != hash || isOverwritten(found.firstBlock) ||
+            (found.firstBlock & (_segment->blocksCount - 1)) + (U64)found.blocksCount > _segment->blocksCount ||
+            found.headerSize + found.dataSize > (U64)found.blocksCount * NATRON_SHARED_MEMORY_CACHE_BLOCK_SIZE) {
+            continue;
+        }
+        header->assign((const char*)getBlock(found.firstBlock),(std::size_t)found.headerSize);
+        if (isOverwritten(found.firstBlock) ||
+            CacheJournal::checksum(header->data(),header->size()) != found.headerChecksum) {
+            continue;
+        }
+        *record = found;
+        return true;
+    }
+    return false;
+}
+
+bool
+SharedMemoryCache::readData(const Record& record,
+                            void* data) const
+{
+    if (!_segment) {
+        return false;
+    }
+    if (record.dataSize) {
+        std::memcpy(data,getBlock(record.firstBlock) + record.headerSize,(std::size_t)record.dataSize);
+    }
+    return !isOverwritten(record.firstBlock) &&
+    CacheJournal::checksum(data,(std::size_t)record.dataSize) == record.dataChecksum;
+}
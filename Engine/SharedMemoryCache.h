@@ -0,0 +1,138 @@
+//  Natron
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef NATRON_ENGINE_SHAREDMEMORYCACHE_H_
+#define NATRON_ENGINE_SHAREDMEMORYCACHE_H_
+
+#include <cstddef>
+#include <string>
+
+#include "Global/GlobalDefines.h"
+
+///The data of the records is allocated by blocks of this many bytes
+#define NATRON_SHARED_MEMORY_CACHE_BLOCK_SIZE 4096
+
+///Number of consecutive slots of the index where a hash may live
+#define NATRON_SHARED_MEMORY_CACHE_MAX_PROBES 16
+
+namespace Natron {
+
+/**
+ * @brief A cache shared by all the processes of the host that open the same named POSIX shared memory segment:
+ * the background render processes of the same user store there the images they render, so that a process needing
+ * an image another one rendered (e.g: the writers of 2 processes downstream of the same subtree, or a render
+ * restarted after a crash) copies it instead of rendering it again.
+ *
+ * It holds records made of a header (the serialized key and parameters of a cache entry) and data, identified by
+ * the 64 bits hash of the key. The segment is made of:
+ * - a header describing the layout,
+ * - an index: an open addressing hash table of slots, each describing a record. Slots are written under a seqlock
+ * (a sequence number odd while the slot is being written) so that readers never block and writers only compete
+ * for the same slot, in which case the loser just doesn't publish its record.
+ * - the data area, a ring of blocks allocated by atomically bumping a cursor. A new record overwrites the oldest
+ * ones, which is the eviction policy: a record is valid as long as the cursor didn't move more than the size of the
+ * ring since it was allocated.
+ *
+ * Readers copy the record out of the segment and then check that it wasn't overwritten meanwhile, and its checksums:
+ * they also catch what a process which crashed while writing may have left.
+ * Nothing is ever locked, hence a process dying at any point cannot block the others. A slot whose writer died is
+ * lost until the segment is removed (see removeSegment()).
+ *
+ * The segment is removed when the last mapping of it is closed. The mappings of a process which crashed are never
+ * closed: the segment then outlives the processes until removeSegment() or a reboot.
+ * Not available on Windows, where open() fails.
+ **/
+class SharedMemoryCache
+{
+public:
+
+    /**
+     * @brief Where a record lives in the segment, as found by find().
+     **/
+    struct Record
+    {
+        U64 hash;
+        U32 firstBlock; //< value of the allocation cursor when the record was allocated
+        U32 blocksCount;
+        U64 headerSize;
+        U64 dataSize;
+        U64 headerChecksum;
+        U64 dataChecksum;
+    };
+
+    SharedMemoryCache();
+
+    ///Unmaps the segment, see close()
+    ~SharedMemoryCache();
+
+    /**
+     * @brief Maps the segment with the given name, creating it with the given size if it doesn't exist. A segment
+     * that exists keeps its size, whatever the given one.
+     * @param name A POSIX shared memory object name: starting with a '/' and short (31 characters on OS X).
+     * @returns False if the segment couldn't be created or mapped, or was made by an incompatible version.
+     **/
+    bool open(const std::string& name,U64 size);
+
+    ///Unmaps the segment, removing it if this was its last mapping
+    void close();
+
+    bool isOpen() const { return _segment != NULL; }
+
+    ///True if the segment is mapped by another process, or another instance of this class. Cheap: an atomic read.
+    bool hasOtherMappings() const;
+
+    ///The size of the data area, i.e: the bytes of records the segment holds at most
+    U64 getCapacity() const;
+
+    ///The biggest record, header included, that can be inserted
+    U64 getMaximumRecordSize() const;
+
+    /**
+     * @brief Copies a record in the segment, replacing the oldest records if needed.
+     * @returns False if the record is too big or if another process was writing the slot it would go in.
+     **/
+    bool insert(U64 hash,const std::string& header,const void* data,std::size_t dataSize);
+
+    ///Returns true if a record with the given hash is in the index. It may have been overwritten since.
+    bool contains(U64 hash) const;
+
+    /**
+     * @brief Looks-up the record with the given hash and copies its header.
+     * @returns False if it isn't there anymore or is corrupted.
+     **/
+    bool find(U64 hash,Record* record,std::string* header) const;
+
+    /**
+     * @brief Copies the data of a record returned by find() in data, which must hold record.dataSize bytes.
+     * @returns False if the record was overwritten meanwhile or is corrupted, in which case data holds garbage.
+     **/
+    bool readData(const Record& record,void* data) const;
+
+    ///Destroys the segment with the given name. The processes which mapped it keep their mapping.
+    static bool removeSegment(const std::string& name);
+
+private:
+
+    struct SegmentHeader;
+    struct Slot;
+
+    ///Reads a consistent copy of the slot, returns false if it is being written. sequence is 0 for a slot never written.
+    bool readSlot(Slot* slot,Record* record,int* sequence) const;
+
+    ///True if the ring blocks of the record were allocated again since it was written
+    bool isOverwritten(U32 firstBlock) const;
+
+    U8* getBlock(U32 cursor) const;
+
+    SegmentHeader* _segment;
+    Slot* _slots;
+    U8* _blocks;
+    std::size_t _mappedSize;
+    std::string _name;
+};
+
+} // namespace Natron
+
+#endif // NATRON_ENGINE_SHAREDMEMORYCACHE_H_
@@ -0,0 +1,408 @@
+//  Natron
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "TaskScheduler.h"
+
+#include <cassert>
+#include <climits>
+#include <algorithm>
+#include <stdexcept>
+
+CLANG_DIAG_OFF(deprecated)
+#include <QtCore/QThread>
+#include <QtCore/QDebug>
+CLANG_DIAG_ON(deprecated)
+#ifndef Q_MOC_RUN
+#include <boost/bind.hpp>
+#endif
+
+using namespace Natron;
+
+namespace Natron {
+
+///A thread of the scheduler, it just runs the scheduler's loop.
+class TaskWorker : public QThread
+{
+public:
+
+    TaskWorker(TaskScheduler* scheduler,int index)
+    : QThread()
+    , _scheduler(scheduler)
+    , _index(index)
+    {
+    }
+
+    virtual ~TaskWorker() {}
+
+    TaskScheduler* getScheduler() const { return _scheduler; }
+
+    int getIndex() const { return _index; }
+
+private:
+
+    virtual void run() OVERRIDE FINAL
+    {
+        _scheduler->workerLoop(_index);
+    }
+
+    TaskScheduler* _scheduler;
+    int _index;
+};
+
+} // namespace Natron
+
+namespace {
+
+///State shared by the members of a parallelFor team
+struct TeamRun
+{
+    const TaskScheduler::IndexedTask* task;
+    unsigned int count;
+    QAtomicInt nextIndex;
+    QAtomicInt failed;
+
+    TeamRun(const TaskScheduler::IndexedTask* task,unsigned int count)
+    : task(task)
+    , count(count)
+    , nextIndex(0)
+    , failed(0)
+    {
+    }
+};
+
+void
+runTeamMember(TeamRun* run)
+{
+    for (;;) {
+        unsigned int index = (unsigned int)run->nextIndex.fetchAndAddOrdered(1);
+        if (index >= run->count) {
+            return;
+        }
+        try {
+            (*run->task)(index);
+        } catch (const std::exception & e) {
+            qDebug() << "Exception caught in a parallelFor task: " << e.what();
+            run->failed.fetchAndStoreOrdered(1);
+        } catch (...) {
+            qDebug() << "Unknown exception caught in a parallelFor task.";
+            run->failed.fetchAndStoreOrdered(1);
+        }
+    }
+}
+
+}
+
+TaskGroup::TaskGroup()
+: _pending(0)
+, _failed(0)
+, _mutex()
+, _finishedCond()
+{
+}
+
+TaskGroup::~TaskGroup()
+{
+    assert(_pending == 0);
+}
+
+bool
+TaskGroup::hasFailed() const
+{
+    return (int)_failed != 0;
+}
+
+bool
+TaskGroup::isFinished() const
+{
+    ///Same as wait(): once the mutex is acquired the last task is done with the group, it can be destroyed
+    QMutexLocker l(&_mutex);
+    return (int)_pending == 0;
+}
+
+void
+TaskGroup::onTaskFinished(bool failed)
+{
+    if (failed) {
+        _failed.fetchAndStoreOrdered(1);
+    }
+    ///The counter is decremented under the mutex: the waiting thread only returns once it could lock it, hence
+    ///the group cannot be destroyed while we are still using it.
+    QMutexLocker l(&_mutex);
+    if (!_pending.deref()) {
+        _finishedCond.wakeAll();
+    }
+}
+
+TaskScheduler::TaskScheduler(int workersCount)
+: _workers()
+, _workerQueues(NATRON_TASK_SCHEDULER_MAX_WORKERS,(TaskQueue*)NULL)
+, _spawnedWorkersCount(0)
+, _injectionQueue()
+, _queuedTasksCount(0)
+, _activeWorkersCount(0)
+, _sleepingWorkersCount(0)
+, _idleMutex()
+, _workAvailableCond()
+, _quit(false)
+{
+    setWorkersCount(workersCount);
+}
+
+TaskScheduler::~TaskScheduler()
+{
+    {
+        QMutexLocker l(&_idleMutex);
+        _quit = true;
+        _workAvailableCond.wakeAll();
+    }
+    for (std::size_t i = 0; i < _workers.size(); ++i) {
+        _workers[i]->wait();
+        delete _workers[i];
+    }
+    for (int i = 0; i < (int)_spawnedWorkersCount; ++i) {
+        delete _workerQueues[i];
+    }
+}
+
+void
+TaskScheduler::setWorkersCount(int workersCount)
+{
+    if (workersCount <= 0) {
+        workersCount = QThread::idealThreadCount();
+    }
+    workersCount = std::max(1,std::min(workersCount,NATRON_TASK_SCHEDULER_MAX_WORKERS));
+
+    QMutexLocker l(&_idleMutex);
+    while ((int)_workers.size() < workersCount) {
+        int index = (int)_workers.size();
+        ///The queue must be visible before the worker is counted, findTask() reads it without locking
+        _workerQueues[index] = new TaskQueue;
+        _spawnedWorkersCount.fetchAndStoreOrdered(index + 1);
+        TaskWorker* worker = new TaskWorker(this,index);
+        _workers.push_back(worker);
+        worker->start();
+    }
+    _activeWorkersCount.fetchAndStoreOrdered(workersCount);
+    _workAvailableCond.wakeAll();
+}
+
+int
+TaskScheduler::getWorkersCount() const
+{
+    return (int)_activeWorkersCount;
+}
+
+int
+TaskScheduler::getCurrentWorkerIndex() const
+{
+    TaskWorker* worker = dynamic_cast<TaskWorker*>(QThread::currentThread());
+    if (worker && worker->getScheduler() == this) {
+        return worker->getIndex();
+    }
+    return -1;
+}
+
+void
+TaskScheduler::schedule(TaskGroup* group,
+                        const Task& task)
+{
+    assert(group);
+    group->_pending.ref();
+
+    ScheduledTask t;
+    t.task = task;
+    t.group = group;
+
+    int workerIndex = getCurrentWorkerIndex();
+    TaskQueue* queue = workerIndex >= 0 ? _workerQueues[workerIndex] : &_injectionQueue;
+    {
+        QMutexLocker l(&queue->mutex);
+        queue->tasks.push_back(t);
+    }
+
+    ///Both atomic operations are full barriers: either the sleeping worker sees the new task when checking
+    ///_queuedTasksCount, or we see it sleeping and wake it up.
+    _queuedTasksCount.fetchAndAddOrdered(1);
+    if (_sleepingWorkersCount.fetchAndAddOrdered(0) > 0) {
+        wakeOneWorker();
+    }
+}
+
+void
+TaskScheduler::wakeOneWorker()
+{
+    QMutexLocker l(&_idleMutex);
+    if ((int)_workers.size() > (int)_activeWorkersCount) {
+        ///A retired worker could swallow the wake-up
+        _workAvailableCond.wakeAll();
+    } else {
+        _workAvailableCond.wakeOne();
+    }
+}
+
+void
+TaskScheduler::wait(TaskGroup* group)
+{
+    assert(group);
+    int workerIndex = getCurrentWorkerIndex();
+    for (;;) {
+        ScheduledTask t;
+        if (findTaskOfGroup(workerIndex,group,&t)) {
+            execute(t);
+            continue;
+        }
+
+        ///All remaining tasks of the group are being executed by other threads
+        QMutexLocker l(&group->_mutex);
+        if ((int)group->_pending == 0) {
+            return;
+        }
+        group->_finishedCond.wait(&group->_mutex);
+    }
+}
+
+bool
+TaskScheduler::parallelFor(unsigned int count,
+                           const IndexedTask& task,
+                           int maxConcurrency)
+{
+    ///the indexes are handed out with an int counter
+    assert(count <= (unsigned int)INT_MAX / 2);
+    if (count == 0) {
+        return true;
+    }
+    if (maxConcurrency <= 0) {
+        maxConcurrency = getWorkersCount();
+    }
+    unsigned int membersCount = std::min(count,(unsigned int)std::max(maxConcurrency,1));
+
+    TeamRun run(&task,count);
+    TaskGroup group;
+    for (unsigned int i = 1; i < membersCount; ++i) {
+        schedule(&group,boost::bind(&runTeamMember,&run));
+    }
+    ///Members scheduled on workers that get to run after all indexes are taken return immediately
+    runTeamMember(&run);
+    wait(&group);
+    return (int)run.failed == 0;
+}
+
+void
+TaskScheduler::execute(const ScheduledTask& task)
+{
+    bool failed = false;
+    try {
+        task.task();
+    } catch (const std::exception & e) {
+        qDebug() << "Exception caught in a scheduled task: " << e.what();
+        failed = true;
+    } catch (...) {
+        qDebug() << "Unknown exception caught in a scheduled task.";
+        failed = true;
+    }
+    task.group->onTaskFinished(failed);
+}
+
+bool
+TaskScheduler::popGroupTask(TaskQueue* queue,
+                            const TaskGroup* group,
+                            bool fromBack,
+                            ScheduledTask* task)
+{
+    QMutexLocker l(&queue->mutex);
+    if (queue->tasks.empty()) {
+        return false;
+    }
+    if (!group) {
+        if (fromBack) {
+            *task = queue->tasks.back();
+            queue->tasks.pop_back();
+        } else {
+            *task = queue->tasks.front();
+            queue->tasks.pop_front();
+        }
+        return true;
+    }
+    if (fromBack) {
+        for (std::deque<ScheduledTask>::reverse_iterator it = queue->tasks.rbegin(); it != queue->tasks.rend(); ++it) {
+            if (it->group == group) {
+                *task = *it;
+                queue->tasks.erase(--it.base());
+                return true;
+            }
+        }
+    } else {
+        for (std::deque<ScheduledTask>::iterator it = queue->tasks.begin(); it != queue->tasks.end(); ++it) {
+            if (it->group == group) {
+                *task = *it;
+                queue->tasks.erase(it);
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+bool
+TaskScheduler::findTask(int workerIndex,
+                        ScheduledTask* task)
+{
+    return findTaskOfGroup(workerIndex,NULL,task);
+}
+
+bool
+TaskScheduler::findTaskOfGroup(int workerIndex,
+                               const TaskGroup* group,
+                               ScheduledTask* task)
+{
+    if ((int)_queuedTasksCount == 0) {
+        return false;
+    }
+    bool found = false;
+
+    ///Own tasks first, most recent first: they are the most likely to be hot in the caches
+    if (workerIndex >= 0) {
+        found = popGroupTask(_workerQueues[workerIndex],group,true,task);
+    }
+    if (!found) {
+        found = popGroupTask(&_injectionQueue,group,false,task);
+    }
+    if (!found) {
+        ///Steal the oldest tasks of the others, they are usually the biggest chunks of work
+        int count = (int)_spawnedWorkersCount;
+        for (int i = 1; i <= count && !found; ++i) {
+            int victim = (std::max(workerIndex,0) + i) % count;
+            if (victim != workerIndex) {
+                found = popGroupTask(_workerQueues[victim],group,false,task);
+            }
+        }
+    }
+    if (found) {
+        _queuedTasksCount.fetchAndAddOrdered(-1);
+    }
+    return found;
+}
+
+void
+TaskScheduler::workerLoop(int workerIndex)
+{
+    for (;;) {
+        ScheduledTask t;
+        if (workerIndex < (int)_activeWorkersCount && findTask(workerIndex,&t)) {
+            execute(t);
+            continue;
+        }
+
+        QMutexLocker l(&_idleMutex);
+        _sleepingWorkersCount.fetchAndAddOrdered(1);
+        while (!_quit && (workerIndex >= (int)_activeWorkersCount || _queuedTasksCount.fetchAndAddOrdered(0) == 0)) {
+            _workAvailableCond.wait(&_idleMutex);
+        }
+        _sleepingWorkersCount.fetchAndAddOrdered(-1);
+        if (_quit) {
+            return;
+        }
+    }
+}
@@ -0,0 +1,183 @@
+//  Natron
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef NATRON_ENGINE_TASKSCHEDULER_H_
+#define NATRON_ENGINE_TASKSCHEDULER_H_
+
+#include <vector>
+#include <deque>
+
+#include "Global/Macros.h"
+CLANG_DIAG_OFF(deprecated)
+#include <QtCore/QMutex>
+#include <QtCore/QWaitCondition>
+#include <QtCore/QAtomicInt>
+CLANG_DIAG_ON(deprecated)
+#ifndef Q_MOC_RUN
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#endif
+
+///Upper bound of the number of threads a scheduler may spawn
+#define NATRON_TASK_SCHEDULER_MAX_WORKERS 256
+
+namespace Natron {
+
+class TaskScheduler;
+class TaskWorker;
+
+/**
+ * @brief A set of tasks submitted to the TaskScheduler that a thread wants to wait for.
+ * A group must outlive all the tasks scheduled with it, i.e: the owner must call
+ * TaskScheduler::wait() before destroying it.
+ **/
+class TaskGroup : boost::noncopyable
+{
+    friend class TaskScheduler;
+
+public:
+
+    TaskGroup();
+
+    ~TaskGroup();
+
+    /**
+     * @brief Returns true if any task of the group has thrown an exception.
+     **/
+    bool hasFailed() const;
+    
+    /**
+     * @brief Returns true if no task of the group is queued or running, i.e: wait() would not block.
+     **/
+    bool isFinished() const;
+
+private:
+
+    void onTaskFinished(bool failed);
+
+    QAtomicInt _pending; //< number of tasks scheduled but not yet finished
+    QAtomicInt _failed;
+    mutable QMutex _mutex;
+    QWaitCondition _finishedCond; //< woken up when _pending drops to 0
+};
+
+/**
+ * @brief A fixed-size pool of threads executing tasks, meant to replace the QThreadPool + QtConcurrent
+ * combination on the render path.
+ *
+ * Each worker owns a deque: tasks scheduled by a worker are pushed at the back of its own deque and it
+ * pops them back in LIFO order (depth-first, cache friendly), while idle workers steal from the front
+ * of the other deques. Tasks scheduled by any other thread go into a shared injection queue.
+ *
+ * A thread waiting for a TaskGroup does not just block: it executes the pending tasks of that group
+ * itself. This is what makes recursive renders (an effect fetching its inputs which fetch their own inputs...)
+ * possible with a fixed number of threads: a waiting worker is never parked while the work it waits for
+ * is still queued. Only tasks of the waited group are executed while waiting, so that a thread never
+ * resumes an unrelated render in the middle of its own (which would clobber its thread-local render args).
+ *
+ * Thread safety: all public functions are thread-safe.
+ **/
+class TaskScheduler : boost::noncopyable
+{
+    friend class TaskWorker;
+
+public:
+
+    typedef boost::function0<void> Task;
+    typedef boost::function1<void,unsigned int> IndexedTask;
+
+    /**
+     * @param workersCount The number of threads to spawn. If <= 0, QThread::idealThreadCount() is used.
+     * The workers count is clamped to NATRON_TASK_SCHEDULER_MAX_WORKERS.
+     **/
+    TaskScheduler(int workersCount);
+
+    ~TaskScheduler();
+
+    /**
+     * @brief Changes the number of workers executing tasks. Workers beyond the new count are not
+     * destroyed but stop picking tasks, their queued tasks are stolen by the others.
+     **/
+    void setWorkersCount(int workersCount);
+
+    int getWorkersCount() const;
+
+    /**
+     * @brief Queues the task for execution by any worker. The group must not be destroyed before wait() returns.
+     * The task must not throw: exceptions are caught, logged and reported by TaskGroup::hasFailed().
+     * Tasks of a group should be scheduled by the thread that waits for the group.
+     **/
+    void schedule(TaskGroup* group,const Task& task);
+
+    /**
+     * @brief Blocks until all tasks of the group are finished, executing the pending tasks of the group
+     * in the calling thread meanwhile.
+     **/
+    void wait(TaskGroup* group);
+
+    /**
+     * @brief Calls task(i) for every i in [0,count) and returns when all the calls are finished.
+     * The calls are made by a team of at most maxConcurrency threads (the workers count if <= 0): the calling
+     * thread plus tasks scheduled on the workers, each member picking the next index until none is left.
+     * Unlike scheduling one task per index, this costs the same few allocations whatever count is, and the
+     * calling thread starts working right away instead of waiting for a worker to wake up.
+     * @returns False if any call threw an exception, the other indexes are still processed.
+     **/
+    bool parallelFor(unsigned int count,const IndexedTask& task,int maxConcurrency = -1);
+
+    /**
+     * @brief Returns the index of the worker running the calling thread, or -1 if the calling thread is not
+     * a worker of this scheduler.
+     **/
+    int getCurrentWorkerIndex() const;
+
+private:
+
+    struct ScheduledTask
+    {
+        Task task;
+        TaskGroup* group;
+
+        ScheduledTask() : task() , group(0) {}
+    };
+
+    struct TaskQueue
+    {
+        QMutex mutex;
+        std::deque<ScheduledTask> tasks;
+    };
+
+    ///Called by the workers' run loop
+    void workerLoop(int workerIndex);
+
+    ///Pops a task for the given worker: first from its own deque, then the injection queue, then steal from others.
+    bool findTask(int workerIndex,ScheduledTask* task);
+
+    ///Pops a task belonging to the given group, from any queue.
+    bool findTaskOfGroup(int workerIndex,const TaskGroup* group,ScheduledTask* task);
+
+    static bool popGroupTask(TaskQueue* queue,const TaskGroup* group,bool fromBack,ScheduledTask* task);
+
+    void execute(const ScheduledTask& task);
+
+    void wakeOneWorker();
+
+    std::vector<TaskWorker*> _workers; //< protected by _idleMutex
+    std::vector<TaskQueue*> _workerQueues; //< allocated once with NATRON_TASK_SCHEDULER_MAX_WORKERS slots so it never reallocates
+    QAtomicInt _spawnedWorkersCount; //< number of valid entries in _workerQueues
+    TaskQueue _injectionQueue; //< tasks scheduled by threads which are not workers
+
+    QAtomicInt _queuedTasksCount; //< tasks queued in any queue, not yet picked
+    QAtomicInt _activeWorkersCount; //< workers with an index >= this don't pick tasks
+    QAtomicInt _sleepingWorkersCount;
+
+    mutable QMutex _idleMutex; //< protects _quit and _workers
+    QWaitCondition _workAvailableCond;
+    bool _quit;
+};
+
+} // namespace Natron
+
+#endif // NATRON_ENGINE_TASKSCHEDULER_H_
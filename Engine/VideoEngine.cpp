@@ -12,12 +12,16 @@
 #endif
 #include <iterator>
 #include <cassert>
+#include <algorithm>
 
 #include <QtCore/QMutex>
 #include <QtCore/QThread>
 #include <QtCore/QCoreApplication>
 #include <QtCore/QSocketNotifier>
 
+#include <boost/bind.hpp>
+#include <boost/weak_ptr.hpp>
+
 #include "Global/MemoryInfo.h"
 
 #include "Engine/ViewerInstance.h"
@@ -36,6 +40,9 @@
 #include "Engine/AppManager.h"
 #include "Engine/AppInstance.h"
 #include "Engine/Node.h"
+#include "Engine/Image.h"
+#include "Engine/ImageParams.h"
+#include "Engine/TaskScheduler.h"
 
 
 #define NATRON_FPS_REFRESH_RATE 10
@@ -45,6 +52,122 @@ using namespace Natron;
 using std::make_pair;
 using std::cout; using std::endl;
 
+struct VideoEngine::FrameInFlight
+{
+    SequenceTime time;
+    Natron::TaskGroup group; //< the renders of the writer's inputs for this frame
+    QMutex imagesMutex; //< protects images
+    std::list< boost::shared_ptr<Natron::Image> > images; //< held so the cache doesn't evict them before the writer used them
+    
+    FrameInFlight(SequenceTime t)
+    : time(t)
+    , group()
+    , imagesMutex()
+    , images()
+    {
+    }
+};
+
+struct VideoEngine::PrefetchedFrame
+{
+    SequenceTime time;
+    Natron::TaskGroup group; //< the renders of the readers for this frame
+    QAtomicInt cancelled; //< the tasks which did not start yet do nothing
+    QMutex imagesMutex; //< protects images
+    std::list< boost::weak_ptr<Natron::Image> > images; //< not held: the cache may evict them like any other image
+    
+    PrefetchedFrame(SequenceTime t)
+    : time(t)
+    , group()
+    , cancelled(0)
+    , imagesMutex()
+    , images()
+    {
+    }
+    
+    ///The memory taken by the images decoded for this frame which are still in the cache
+    U64 getMemoryHeld()
+    {
+        QMutexLocker l(&imagesMutex);
+        U64 ret = 0;
+        for (std::list< boost::weak_ptr<Natron::Image> >::iterator it = images.begin(); it != images.end(); ++it) {
+            boost::shared_ptr<Natron::Image> img = it->lock();
+            if (img) {
+                ret += img->size();
+            }
+        }
+        return ret;
+    }
+};
+
+namespace {
+    
+///Renders the region of definition of one input of the writer at scale 1, so that the writer finds it in the cache.
+///Only the direct inputs are rendered ahead: the writer's own render stays serial, and it only hits these images
+///when its region of interest lies within the region of definition of the input.
+static void renderWriterInput(Natron::EffectInstance* writer,
+                              int inputNb,
+                              SequenceTime time,
+                              int view,
+                              bool isSequentialRender,
+                              std::list< boost::shared_ptr<Natron::Image> >* images,
+                              QMutex* imagesMutex)
+{
+    Natron::EffectInstance* input = writer->input_other_thread(inputNb);
+    if (!input) {
+        return;
+    }
+    RenderScale scale;
+    scale.x = scale.y = 1.;
+    RectI rod;
+    bool isProjectFormat;
+    if (input->getRegionOfDefinition_public(time,scale,view, &rod,&isProjectFormat) == StatFailed) {
+        return;
+    }
+    Natron::ImageComponents components;
+    Natron::ImageBitDepth imageDepth;
+    writer->getPreferredDepthAndComponents(inputNb, &components, &imageDepth);
+    boost::shared_ptr<Natron::Image> img = input->renderRoI(EffectInstance::RenderRoIArgs(time,scale,0,view,rod,isSequentialRender,
+                                                                                          false,false,&rod,components,imageDepth));
+    if (img) {
+        QMutexLocker l(imagesMutex);
+        images->push_back(img);
+    }
+}
+    
+///Renders the whole frame of a reader at the mipmap level of the viewer, so that the viewer finds it in the cache.
+static void prefetchReaderFrame(Natron::EffectInstance* reader,
+                                SequenceTime time,
+                                int view,
+                                unsigned int mipMapLevel,
+                                const QAtomicInt* cancelled,
+                                std::list< boost::weak_ptr<Natron::Image> >* images,
+                                QMutex* imagesMutex)
+{
+    if ((int)*cancelled || reader->aborted()) {
+        return;
+    }
+    RenderScale scale;
+    scale.x = scale.y = Natron::Image::getScaleFromMipMapLevel(mipMapLevel);
+    RectI rod;
+    bool isProjectFormat;
+    if (reader->getRegionOfDefinition_public(time,scale,view, &rod,&isProjectFormat) == StatFailed) {
+        return;
+    }
+    RectI pixelRoD = rod.downscalePowerOfTwoSmallestEnclosing(mipMapLevel);
+    Natron::ImageComponents components;
+    Natron::ImageBitDepth imageDepth;
+    reader->getPreferredDepthAndComponents(-1, &components, &imageDepth);
+    boost::shared_ptr<Natron::Image> img = reader->renderRoI(EffectInstance::RenderRoIArgs(time,scale,mipMapLevel,view,pixelRoD,true,
+                                                                                           false,false,&rod,components,imageDepth));
+    if (img) {
+        QMutexLocker l(imagesMutex);
+        images->push_back(img);
+    }
+}
+    
+}
+
 
 VideoEngine::VideoEngine(Natron::OutputEffectInstance* owner,QObject* parent)
     : QThread(parent)
@@ -79,6 +202,9 @@ VideoEngine::VideoEngine(Natron::OutputEffectInstance* owner,QObject* parent)
     , _firstFrame(0)
     , _lastFrame(0)
     , _doingARenderSingleThreaded(false)
+    , _framesInFlight()
+    , _prefetchedFrames()
+    , _cancelledPrefetches()
 {
     QObject::connect(this, SIGNAL(mustGetFrameRange()), this, SLOT(getFrameRange()));
 }
@@ -253,6 +379,10 @@ bool VideoEngine::startEngine(bool singleThreaded) {
 }
 bool VideoEngine::stopEngine() {
     
+    ///Before resetting the aborted flag of the nodes, otherwise the frames rendered ahead would be fully computed
+    clearFramesInFlight();
+    cancelPrefetchedFrames();
+    
     bool wasAborted = false;
     bool mustQuit = false;
     {
@@ -651,8 +781,16 @@ Natron::Status VideoEngine::renderFrame(SequenceTime time,bool singleThreaded) {
     gettimeofday(&_startRenderFrameTime, 0);
     if (_tree.isOutputAViewer() && !_tree.isOutputAnOpenFXNode()) {
         ViewerInstance* viewer = _tree.outputAsViewer();
+        if (!singleThreaded) {
+            prefetchReaders(time,isSequentialRender);
+        }
         stat = viewer->renderViewer(time,singleThreaded,isSequentialRender);
         
+        ///The viewer is done with the frames decoded for this time, the cache keeps them as long as it can
+        while (!_prefetchedFrames.empty() && _prefetchedFrames.front()->time == time) {
+            _prefetchedFrames.pop_front();
+        }
+        
         if (!_currentRunArgs._sameFrame) {
             QMutexLocker timerLocker(&_timerMutex);
             _timer->waitUntilNextFrameIsDue(); // timer synchronizing with the requested fps
@@ -680,13 +818,27 @@ Natron::Status VideoEngine::renderFrame(SequenceTime time,bool singleThreaded) {
         if (isSequentialRender) {
             mainView = _tree.getOutput()->getApp()->getMainView();
         }
-        
+        std::vector<int> views;
         for (int i = 0; i < viewsCount;++i) {
-            
             if (isSequentialRender && i != mainView) {
                 ///@see the warning in EffectInstance::evaluate
                 continue;
             }
+            views.push_back(i);
+        }
+        
+        ///Render the inputs of the next frames while the writer renders this one, the writer still gets them in order.
+        int maxFramesInFlight = getMaxFramesInFlight(singleThreaded);
+        if (maxFramesInFlight > 1) {
+            SequenceTime lastFrame = dynamic_cast<Natron::OutputEffectInstance*>(_tree.getOutput())->getLastFrame();
+            if (_currentRunArgs._frameRequestsCount > 0) {
+                lastFrame = std::min(lastFrame,time + _currentRunArgs._frameRequestsCount - 1);
+            }
+            renderFramesInFlight(time,lastFrame,maxFramesInFlight,views,isSequentialRender);
+        }
+        
+        for (U32 j = 0; j < views.size(); ++j) {
+            int i = views[j];
             // Do not catch exceptions: if an exception occurs here it is probably fatal, since
             // it comes from Natron itself. All exceptions from plugins are already caught
             // by the HostSupport library.
@@ -710,6 +862,11 @@ Natron::Status VideoEngine::renderFrame(SequenceTime time,bool singleThreaded) {
                 break;
             }
         }
+        
+        ///The writer is done with the inputs of this frame, release them
+        if (!_framesInFlight.empty() && _framesInFlight.front()->time == time) {
+            _framesInFlight.pop_front();
+        }
     }
 //
 //    if (stat == StatFailed) {
@@ -719,6 +876,252 @@ Natron::Status VideoEngine::renderFrame(SequenceTime time,bool singleThreaded) {
 
 }
 
+int VideoEngine::getMaxFramesInFlight(bool singleThreaded) const
+{
+    ///Unsafe plug-ins would serialize all the frames on the plug-in lock anyway.
+    ///Instance safe and fully safe plug-ins already protect their renders with a per-instance/per-frame lock.
+    bool hasUnsafePlugin = false;
+    for (RenderTree::TreeIterator it = _tree.begin(); it != _tree.end(); ++it) {
+        if ((*it)->getLiveInstance()->renderThreadSafety() == Natron::EffectInstance::UNSAFE) {
+            hasUnsafePlugin = true;
+            break;
+        }
+    }
+    return computeMaxFramesInFlight(singleThreaded,
+                                    _tree.isOutputAViewer(),
+                                    _currentRunArgs._forceSequential,
+                                    appPTR->getCurrentSettings()->getNumberOfThreads(),
+                                    appPTR->getCurrentSettings()->getNumberOfParallelFrames(),
+                                    appPTR->getTaskScheduler()->getWorkersCount(),
+                                    hasUnsafePlugin);
+}
+
+int VideoEngine::computeMaxFramesInFlight(bool singleThreaded,
+                                          bool outputIsViewer,
+                                          bool forceSequential,
+                                          int threadsCount,
+                                          int parallelFrames,
+                                          int workersCount,
+                                          bool hasUnsafePlugin)
+{
+    if (singleThreaded || outputIsViewer || forceSequential || threadsCount == -1 || hasUnsafePlugin) {
+        return 1;
+    }
+    int framesCount = parallelFrames;
+    if (framesCount == 0) {
+        framesCount = std::min(workersCount,NATRON_WRITER_MAX_AUTO_FRAMES_IN_FLIGHT);
+    }
+    return std::max(framesCount,1);
+}
+
+bool VideoEngine::getFramesToSchedule(const std::list<SequenceTime>& inFlight,
+                                      SequenceTime time,
+                                      SequenceTime lastFrame,
+                                      int maxFrames,
+                                      std::list<SequenceTime>* toSchedule)
+{
+    bool mustClear = !inFlight.empty() && inFlight.front() != time;
+    SequenceTime next = (inFlight.empty() || mustClear) ? time : inFlight.back() + 1;
+    for (; next <= lastFrame && next < time + maxFrames; ++next) {
+        toSchedule->push_back(next);
+    }
+    return mustClear;
+}
+
+void VideoEngine::renderFramesInFlight(SequenceTime time,SequenceTime lastFrame,int maxFrames,const std::vector<int>& views,
+                                       bool isSequentialRender)
+{
+    std::list<SequenceTime> inFlight,toSchedule;
+    for (std::list< boost::shared_ptr<FrameInFlight> >::iterator it = _framesInFlight.begin(); it != _framesInFlight.end(); ++it) {
+        inFlight.push_back((*it)->time);
+    }
+    ///The frames ahead are not the ones expected anymore (e.g: the render was restarted)
+    if (getFramesToSchedule(inFlight,time,lastFrame,maxFrames,&toSchedule)) {
+        clearFramesInFlight();
+    }
+    
+    TaskScheduler* scheduler = appPTR->getTaskScheduler();
+    Natron::EffectInstance* writer = _tree.getOutput();
+    
+    for (std::list<SequenceTime>::iterator next = toSchedule.begin(); next != toSchedule.end(); ++next) {
+        boost::shared_ptr<FrameInFlight> frame(new FrameInFlight(*next));
+        for (U32 v = 0; v < views.size(); ++v) {
+            for (int i = 0; i < writer->maximumInputs(); ++i) {
+                if (writer->isInputMask(i) && !writer->isMaskEnabled(i)) {
+                    continue;
+                }
+                scheduler->schedule(&frame->group,boost::bind(&renderWriterInput,writer,i,*next,views[v],isSequentialRender,
+                                                              &frame->images,&frame->imagesMutex));
+            }
+        }
+        _framesInFlight.push_back(frame);
+    }
+    
+    assert(!_framesInFlight.empty() && _framesInFlight.front()->time == time);
+    scheduler->wait(&_framesInFlight.front()->group);
+}
+
+void VideoEngine::clearFramesInFlight()
+{
+    if (_framesInFlight.empty()) {
+        return;
+    }
+    TaskScheduler* scheduler = appPTR->getTaskScheduler();
+    for (std::list< boost::shared_ptr<FrameInFlight> >::iterator it = _framesInFlight.begin(); it != _framesInFlight.end(); ++it) {
+        scheduler->wait(&(*it)->group);
+    }
+    _framesInFlight.clear();
+}
+
+void VideoEngine::prefetchReaders(SequenceTime time,bool isSequentialRender)
+{
+    ///Collect the frames the playback will display next
+    std::list<SequenceTime> nextFrames;
+    int readAhead = appPTR->getCurrentSettings()->getPlaybackReadAheadFrames();
+    if (_currentRunArgs._frameRequestsCount > 0) {
+        readAhead = std::min(readAhead,_currentRunArgs._frameRequestsCount - 1);
+    }
+    if (!isSequentialRender || _currentRunArgs._sameFrame || _currentRunArgs._forceSequential) {
+        ///not a playback, or the readers can only render frames in order
+        readAhead = 0;
+    }
+    bool loop;
+    {
+        QMutexLocker l(&_loopModeMutex);
+        loop = _loopMode;
+    }
+    SequenceTime first = _timeline->leftBound();
+    SequenceTime last = _timeline->rightBound();
+    SequenceTime next = time;
+    for (int i = 0; i < readAhead; ++i) {
+        if (_currentRunArgs._forward) {
+            if (next < last) {
+                ++next;
+            } else if (loop) {
+                next = first;
+            } else {
+                break;
+            }
+        } else {
+            if (next > first) {
+                --next;
+            } else if (loop) {
+                next = last;
+            } else {
+                break;
+            }
+        }
+        if (next == time) {
+            ///the range is shorter than the read-ahead
+            break;
+        }
+        nextFrames.push_back(next);
+    }
+    
+    ///Cancel what is not expected anymore (the user seeked, the direction changed...)
+    std::list< boost::shared_ptr<PrefetchedFrame> >::iterator it = _prefetchedFrames.begin();
+    while (it != _prefetchedFrames.end()) {
+        if ((*it)->time != time && std::find(nextFrames.begin(),nextFrames.end(),(*it)->time) == nextFrames.end()) {
+            (*it)->cancelled.fetchAndStoreOrdered(1);
+            _cancelledPrefetches.push_back(*it);
+            it = _prefetchedFrames.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    it = _cancelledPrefetches.begin();
+    while (it != _cancelledPrefetches.end()) {
+        if ((*it)->group.isFinished()) {
+            it = _cancelledPrefetches.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    
+    if (nextFrames.empty()) {
+        return;
+    }
+    
+    std::vector<Natron::EffectInstance*> readers;
+    for (RenderTree::TreeIterator node = _tree.begin(); node != _tree.end(); ++node) {
+        Natron::EffectInstance* effect = (*node)->getLiveInstance();
+        if (effect->isReader()) {
+            readers.push_back(effect);
+        }
+    }
+    if (readers.empty()) {
+        return;
+    }
+    
+    ViewerInstance* viewer = _tree.outputAsViewer();
+    int view = viewer->getCurrentView();
+    unsigned int mipMapLevel = (unsigned int)viewer->getMipMapLevel();
+    TaskScheduler* scheduler = appPTR->getTaskScheduler();
+    
+    ///The frames being decoded don't hold anything yet: count them as big as the readers' images at this time
+    U64 estimatedFrameSize = 0;
+    {
+        RenderScale scale;
+        scale.x = scale.y = Natron::Image::getScaleFromMipMapLevel(mipMapLevel);
+        for (U32 i = 0; i < readers.size(); ++i) {
+            RectI rod;
+            bool isProjectFormat;
+            if (readers[i]->getRegionOfDefinition_public(time,scale,view, &rod,&isProjectFormat) == StatFailed) {
+                continue;
+            }
+            Natron::ImageComponents components;
+            Natron::ImageBitDepth imageDepth;
+            readers[i]->getPreferredDepthAndComponents(-1, &components, &imageDepth);
+            estimatedFrameSize += (U64)rod.downscalePowerOfTwoSmallestEnclosing(mipMapLevel).area() *
+            Natron::getElementsCountForComponents(components) * Natron::getSizeOfForBitDepth(imageDepth);
+        }
+    }
+    U64 maxMemory = appPTR->getCurrentSettings()->getPlaybackReadAheadMaxMemory();
+    U64 memoryHeld = 0;
+    for (it = _prefetchedFrames.begin(); it != _prefetchedFrames.end(); ++it) {
+        memoryHeld += (*it)->group.isFinished() ? (*it)->getMemoryHeld() : estimatedFrameSize;
+    }
+    
+    ///Frames are scheduled in playback order, the scheduler picks the oldest tasks first
+    for (std::list<SequenceTime>::iterator t = nextFrames.begin();
+         t != nextFrames.end() && memoryHeld + estimatedFrameSize <= maxMemory; ++t) {
+        bool alreadyScheduled = false;
+        for (it = _prefetchedFrames.begin(); it != _prefetchedFrames.end(); ++it) {
+            if ((*it)->time == *t) {
+                alreadyScheduled = true;
+                break;
+            }
+        }
+        if (alreadyScheduled) {
+            continue;
+        }
+        boost::shared_ptr<PrefetchedFrame> frame(new PrefetchedFrame(*t));
+        for (U32 i = 0; i < readers.size(); ++i) {
+            scheduler->schedule(&frame->group,boost::bind(&prefetchReaderFrame,readers[i],*t,view,mipMapLevel,
+                                                          &frame->cancelled,&frame->images,&frame->imagesMutex));
+        }
+        _prefetchedFrames.push_back(frame);
+        memoryHeld += estimatedFrameSize;
+    }
+}
+
+void VideoEngine::cancelPrefetchedFrames()
+{
+    for (std::list< boost::shared_ptr<PrefetchedFrame> >::iterator it = _prefetchedFrames.begin(); it != _prefetchedFrames.end(); ++it) {
+        (*it)->cancelled.fetchAndStoreOrdered(1);
+        _cancelledPrefetches.push_back(*it);
+    }
+    _prefetchedFrames.clear();
+    if (_cancelledPrefetches.empty()) {
+        return;
+    }
+    TaskScheduler* scheduler = appPTR->getTaskScheduler();
+    for (std::list< boost::shared_ptr<PrefetchedFrame> >::iterator it = _cancelledPrefetches.begin(); it != _cancelledPrefetches.end(); ++it) {
+        scheduler->wait(&(*it)->group);
+    }
+    _cancelledPrefetches.clear();
+}
+
 void VideoEngine::onProgressUpdate(int /*i*/){
     // cout << "progress: index = " << i ;
     //    if(i < (int)_currentFrameInfos._rows.size()){
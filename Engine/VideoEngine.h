@@ -35,6 +35,9 @@ CLANG_DIAG_ON(deprecated)
 #include "Global/GlobalDefines.h"
 #include "Engine/FrameEntry.h"
 
+///When the number of frames rendered concurrently by writers is automatic, don't hold more frames than this in memory
+#define NATRON_WRITER_MAX_AUTO_FRAMES_IN_FLIGHT 8
+
 namespace Natron{
 class Node;
 class EffectInstance;
@@ -346,6 +349,35 @@ public:
     
     bool hasBeenAborted() const {return _abortRequested;}
     
+    /**
+     * @brief The decision of getMaxFramesInFlight(), which doesn't need an engine.
+     * @param threadsCount The number of threads setting, -1 if the application renders on a single thread.
+     * @param parallelFrames The number of parallel frames setting, 0 to pick it from workersCount.
+     * @param workersCount The number of workers of the TaskScheduler.
+     * @param hasUnsafePlugin True if the tree contains a plug-in whose render thread safety is UNSAFE.
+     **/
+    static int computeMaxFramesInFlight(bool singleThreaded,
+                                        bool outputIsViewer,
+                                        bool forceSequential,
+                                        int threadsCount,
+                                        int parallelFrames,
+                                        int workersCount,
+                                        bool hasUnsafePlugin);
+    
+    /**
+     * @brief The reorder logic of renderFramesInFlight(), which doesn't need an engine: the frames in flight are
+     * kept while the writer renders the first of them, otherwise (e.g: the render was restarted at another frame)
+     * they must be cleared.
+     * @param inFlight The times of the frames in flight, sorted.
+     * @param toSchedule [out] The frames to start rendering after the ones in flight, sorted.
+     * @returns True if the frames in flight must be cleared before scheduling toSchedule.
+     **/
+    static bool getFramesToSchedule(const std::list<SequenceTime>& inFlight,
+                                    SequenceTime time,
+                                    SequenceTime lastFrame,
+                                    int maxFrames,
+                                    std::list<SequenceTime>* toSchedule);
+    
 private:
 
     /*The function doing all the processing in a separate thread, called by render()*/
@@ -384,6 +416,37 @@ private:
     bool startEngine(bool singleThreaded);
     
     Natron::Status renderFrame(SequenceTime time,bool singleThreaded);
+    
+    /**
+     * @brief Returns how many frames a writer can render concurrently, 1 if frames must be rendered one after the other,
+     * e.g: the tree contains sequential only or unsafe plug-ins.
+     **/
+    int getMaxFramesInFlight(bool singleThreaded) const;
+    
+    /**
+     * @brief Makes sure the inputs of the writer are being rendered for the frames [time, time + maxFrames[ (bounded by
+     * lastFrame) and waits until the inputs for time are rendered. The writer itself still renders the frames in order.
+     **/
+    void renderFramesInFlight(SequenceTime time,SequenceTime lastFrame,int maxFrames,const std::vector<int>& views,
+                              bool isSequentialRender);
+    
+    /**
+     * @brief Waits for all frames scheduled by renderFramesInFlight to finish and releases their images.
+     **/
+    void clearFramesInFlight();
+    
+    /**
+     * @brief During viewer playback, makes sure the readers of the tree are decoding the frames that follow time
+     * (in the playback direction) in the background so that reading the files overlaps with the display.
+     * The number of frames and the memory they hold are bounded by the read-ahead settings.
+     * Frames being decoded which are not expected anymore (e.g: after a seek) are cancelled.
+     **/
+    void prefetchReaders(SequenceTime time,bool isSequentialRender);
+    
+    /**
+     * @brief Cancels the frames decoded ahead which were not used yet and waits for the renders already started.
+     **/
+    void cancelPrefetchedFrames();
 
 private:
     // FIXME: PIMPL
@@ -472,6 +535,15 @@ private:
     int _lastFrame;
     
     bool _doingARenderSingleThreaded;
+    
+    ///The frames whose inputs are being rendered ahead of the writer, sorted by time. Accessed only by the run() thread
+    struct FrameInFlight;
+    std::list< boost::shared_ptr<FrameInFlight> > _framesInFlight;
+    
+    ///The frames the readers are decoding ahead of the viewer, in playback order. Accessed only by the run() thread
+    struct PrefetchedFrame;
+    std::list< boost::shared_ptr<PrefetchedFrame> > _prefetchedFrames;
+    std::list< boost::shared_ptr<PrefetchedFrame> > _cancelledPrefetches; //< cancelled, but their tasks may still run
 
 };
 
@@ -11,6 +11,13 @@
 
 #include "ViewerInstancePrivate.h"
 
+#include <algorithm>
+#include <vector>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define NATRON_VIEWER_SSE2
+#include <emmintrin.h>
+#endif
+
 #include <boost/shared_ptr.hpp>
 #include <boost/bind.hpp>
 
@@ -48,26 +55,11 @@ using boost::shared_ptr;
 
 
 
-static void
-scaleToTexture8bits(std::pair<int,int> yRange,
-                    const RenderViewerArgs& args,
-                    U32* output);
-
-static void
-scaleToTexture32bits(std::pair<int,int> yRange,
-                     const RenderViewerArgs& args,
-                     float *output);
-
 static std::pair<double, double>
 findAutoContrastVminVmax(boost::shared_ptr<const Natron::Image> inputImage,
                          ViewerInstance::DisplayChannels channels,
                          const RectI& rect);
 
-static void
-renderFunctor(std::pair<int,int> yRange,
-              const RenderViewerArgs& args,
-              void *buffer);
-
 /**
  *@brief Actually converting to ARGB... but it is called BGRA by
  the texture format GL_UNSIGNED_INT_8_8_8_8_REV
@@ -106,6 +98,50 @@ lutFromColorspace(Natron::ViewerColorSpace cs)
     return lut;
 }
 
+/**
+ * @brief Returns the size in bytes of the levels of the pyramid.
+ **/
+static U64
+getMipMapPyramidSize(const ViewerMipMapPyramid& pyramid)
+{
+    U64 size = 0;
+    for (U32 i = 0; i < pyramid.levels.size(); ++i) {
+        size += pyramid.levels[i]->size();
+    }
+    return size;
+}
+
+/**
+ * @brief Returns the given mipmap level (> 0) of image, building the missing levels of the pyramid by halving
+ * the last level already built. The pyramid is reset first if it was built from another image or color-space.
+ * The image must be completely rendered. Like the box filter of the viewer, the pixels of the edges of odd
+ * bounds average the pixels they cover and the color channels are averaged in linear.
+ **/
+static boost::shared_ptr<const Natron::Image>
+getMipMapFromPyramid(ViewerMipMapPyramid* pyramid,
+                     const boost::shared_ptr<const Natron::Image>& image,
+                     Natron::ViewerColorSpace colorSpace,
+                     unsigned int level)
+{
+    assert(level > 0);
+    if (pyramid->source != image || pyramid->colorSpace != colorSpace) {
+        pyramid->levels.clear();
+        pyramid->source = image;
+        pyramid->colorSpace = colorSpace;
+    }
+    while (pyramid->levels.size() < level) {
+        const Natron::Image* previous = pyramid->levels.empty() ? image.get() : pyramid->levels.back().get();
+        const RectI& previousRoD = previous->getPixelRoD();
+        boost::shared_ptr<Natron::Image> halved(new Natron::Image(previous->getComponents(),
+                                                                  previousRoD.downscalePowerOfTwoSmallestEnclosing(1),
+                                                                  0,
+                                                                  previous->getBitDepth()));
+        previous->downscale_mipmap(previousRoD, halved.get(), 1, colorSpace);
+        pyramid->levels.push_back(halved);
+    }
+    return pyramid->levels[level - 1];
+}
+
 namespace {
 class MetaTypesRegistration
 {
@@ -177,6 +213,8 @@ ViewerInstance::~ViewerInstance()
     if (_imp->lastRenderedImage[1]) {
         sizeToUnregister += _imp->lastRenderedImage[1]->size();
     }
+    sizeToUnregister += getMipMapPyramidSize(_imp->mipMapPyramid[0]);
+    sizeToUnregister += getMipMapPyramidSize(_imp->mipMapPyramid[1]);
     if (sizeToUnregister != 0) {
         unregisterPluginMemory(sizeToUnregister);
     }
@@ -417,6 +455,11 @@ ViewerInstance::renderViewer_internal(SequenceTime time,bool singleThreaded,bool
         forceRender = _imp->forceRender;
         _imp->forceRender = false;
     }
+    if (forceRender) {
+        ///the image is going to be rendered again in place, its mipmaps would be stale
+        unregisterPluginMemory(getMipMapPyramidSize(_imp->mipMapPyramid[textureIndex]));
+        _imp->mipMapPyramid[textureIndex] = ViewerMipMapPyramid();
+    }
     
     ///instead of calling getRegionOfDefinition on the active input, check the image cache
     ///to see whether the result of getRegionOfDefinition is already present. A cache lookup
@@ -452,6 +495,12 @@ ViewerInstance::renderViewer_internal(SequenceTime time,bool singleThreaded,bool
     
     
     bool isInputImgCached = Natron::getImageFromCache(inputImageKey, &cachedImgParams,&inputImage);
+    if (isInputImgCached && inputImage->isTiled()) {
+        ///The image is cached as tiles: the entry found has no pixels, let renderRoI assemble the tiles
+        isInputImgCached = false;
+        cachedImgParams.reset();
+        inputImage.reset();
+    }
     
     ////Lock the output image so that multiple threads do not access for writing at the same time.
     ////When it goes out of scope the lock will be released automatically
@@ -471,28 +520,27 @@ ViewerInstance::renderViewer_internal(SequenceTime time,bool singleThreaded,bool
             inputImage->clearBitmap();
         }
         
-        ///If components are different but convertible without damage, or bit depth is different, keep this image, convert it
-        ///and continue render on it. This is in theory still faster than ignoring the image and doing a full render again.
-        if ((inputImage->getComponents() != components &&
-             Image::hasEnoughDataToConvert(inputImage->getComponents(),components)) ||
-            inputImage->getBitDepth() != imageDepth) {
-            ///Convert the image to the requested components
-            boost::shared_ptr<Image> remappedImage(new Image(components,inputImage->getRoD(),mipMapLevel,imageDepth));
-            inputImage->convertToFormat(inputImage->getPixelRoD(), remappedImage.get(),
-                                   getApp()->getDefaultColorSpaceForBitDepth(inputImage->getBitDepth()),
-                                   getApp()->getDefaultColorSpaceForBitDepth(imageDepth),
-                                   3, false, true);
-            
-            ///switch the pointer
-            inputImage = remappedImage;
-        } else if (inputImage->getComponents() != components) {
-            assert(!Image::hasEnoughDataToConvert(inputImage->getComponents(),components));
-            ///we cannot convert without loosing data of some channels, we better off render everything again
-            isInputImgCached = false;
-            appPTR->removeFromNodeCache(inputImage);
-            cachedImgParams.reset();
-            imageLock.reset();
-            inputImage.reset();
+        ///If the image was cached with other components or bit depth, render in the variant of the requested format instead,
+        ///which is cached along with the image.
+        if (inputIdentityNumber == -1 &&
+            (inputImage->getComponents() != components || inputImage->getBitDepth() != imageDepth)) {
+            boost::shared_ptr<const ImageParams> variantParams;
+            boost::shared_ptr<OutputImageLocker> variantLock;
+            boost::shared_ptr<Image> variant = activeInputToRender->getImageVariant(inputImageKey, inputImage, *cachedImgParams,
+                                                                                    inputImage->getPixelRoD(), components,
+                                                                                    imageDepth, 3, forceRender,
+                                                                                    &variantParams, &variantLock);
+            if (variant) {
+                cachedImgParams = variantParams;
+                inputImage = variant;
+                imageLock = variantLock;
+            } else {
+                ///let renderRoI report the failure
+                isInputImgCached = false;
+                cachedImgParams.reset();
+                imageLock.reset();
+                inputImage.reset();
+            }
         }
     }
     
@@ -503,6 +551,11 @@ ViewerInstance::renderViewer_internal(SequenceTime time,bool singleThreaded,bool
         if (recursiveInput) {
             inputImageKey = Natron::Image::makeKey(recursiveInput->hash(), inputIdentityTime, mipMapLevel,view);
             isInputImgCached = Natron::getImageFromCache(inputImageKey, &cachedImgParams,&inputImage);
+            if (isInputImgCached && inputImage->isTiled()) {
+                isInputImgCached = false;
+                cachedImgParams.reset();
+                inputImage.reset();
+            }
             if (isInputImgCached) {
                 inputIdentityNumber = cachedImgParams->getInputNbIdentity();
                 inputIdentityTime = cachedImgParams->getInputTimeIdentity();
@@ -908,6 +961,40 @@ ViewerInstance::renderViewer_internal(SequenceTime time,bool singleThreaded,bool
         }
         
         ViewerColorSpace srcColorSpace = getApp()->getDefaultColorSpaceForBitDepth(lastRenderedImage->getBitDepth());
+        bool boxFilter = appPTR->getCurrentSettings()->isViewerDownscaleFiltered();
+        
+        ///When zoomed out with filtering on, convert the level of the mipmap pyramid matching the zoom factor
+        ///instead of averaging all the pixels of the full resolution image. The levels are kept until the image changes,
+        ///so zooming in and out doesn't filter the image again. Only completely rendered images have valid mipmaps.
+        boost::shared_ptr<const Natron::Image> imageToConvert = lastRenderedImage;
+        TextureRect imageTextureRect = textureRect;
+        const RectI& lastRenderedRoD = lastRenderedImage->getPixelRoD();
+        if (boxFilter && textureRect.closestPo2 > 1 &&
+            lastRenderedRoD.width() >= textureRect.closestPo2 && lastRenderedRoD.height() >= textureRect.closestPo2 &&
+            lastRenderedImage->getRestToRender(lastRenderedRoD).empty()) {
+            unsigned int level = 0;
+            while ((1 << level) < textureRect.closestPo2) {
+                ++level;
+            }
+            ViewerMipMapPyramid& pyramid = _imp->mipMapPyramid[textureIndex];
+            U64 previousSize = getMipMapPyramidSize(pyramid);
+            imageToConvert = getMipMapFromPyramid(&pyramid, lastRenderedImage, srcColorSpace, level);
+            U64 newSize = getMipMapPyramidSize(pyramid);
+            if (newSize > previousSize) {
+                registerPluginMemory(newSize - previousSize);
+            } else if (newSize < previousSize) {
+                unregisterPluginMemory(previousSize - newSize);
+            }
+            
+            ///the texture pixels map 1:1 to the level pixels
+            RectI levelRect = texRectClipped.downscalePowerOfTwoSmallestEnclosing(level);
+            assert(levelRect.width() == textureRect.w && levelRect.height() == textureRect.h);
+            imageTextureRect.set(levelRect.x1, levelRect.y1, levelRect.x2, levelRect.y2, textureRect.w, textureRect.h, 1);
+        } else if (_imp->mipMapPyramid[textureIndex].source && _imp->mipMapPyramid[textureIndex].source != lastRenderedImage) {
+            ///don't hold the mipmaps of an image that is not displayed anymore
+            unregisterPluginMemory(getMipMapPyramidSize(_imp->mipMapPyramid[textureIndex]));
+            _imp->mipMapPyramid[textureIndex] = ViewerMipMapPyramid();
+        }
         
         if (singleThreaded) {
             if (autoContrast) {
@@ -925,28 +1012,31 @@ ViewerInstance::renderViewer_internal(SequenceTime time,bool singleThreaded,bool
                 offset = -vmin / ( vmax - vmin);
             }
 
-            const RenderViewerArgs args(lastRenderedImage,
-                                        textureRect,
+            const RenderViewerArgs args(imageToConvert,
+                                        imageTextureRect,
                                         channels,
-                                        closestPowerOf2,
+                                        imageTextureRect.closestPo2,
                                         bitDepth,
                                         gain,
                                         offset,
                                         lutFromColorspace(srcColorSpace),
-                                        lutFromColorspace(lut));
+                                        lutFromColorspace(lut),
+                                        boxFilter);
 
-            renderFunctor(std::make_pair(texRectClipped.y1,texRectClipped.y2),
-                          args,
-                          ramBuffer);
+            scaleToTexture(std::make_pair(imageTextureRect.y1,imageTextureRect.y2),
+                           args,
+                           ramBuffer);
         } else {
 
-            int rowsPerThread = std::ceil((double)(texRectClipped.x2 - texRectClipped.x1) / (double)QThread::idealThreadCount());
+            int rowsPerThread = std::ceil((double)(imageTextureRect.y2 - imageTextureRect.y1) / (double)QThread::idealThreadCount());
+            ///every group must start on a scan-line that goes to the texture
+            rowsPerThread = std::max(1, (rowsPerThread + imageTextureRect.closestPo2 - 1) / imageTextureRect.closestPo2) * imageTextureRect.closestPo2;
             // group of group of rows where first is image coordinate, second is texture coordinate
             QList< std::pair<int, int> > splitRows;
-            int k = texRectClipped.y1;
-            while (k < texRectClipped.y2) {
+            int k = imageTextureRect.y1;
+            while (k < imageTextureRect.y2) {
                 int top = k + rowsPerThread;
-                int realTop = top > texRectClipped.y2 ? texRectClipped.y2 : top;
+                int realTop = top > imageTextureRect.y2 ? imageTextureRect.y2 : top;
                 splitRows.push_back(std::make_pair(k,realTop));
                 k += rowsPerThread;
             }
@@ -990,18 +1080,19 @@ ViewerInstance::renderViewer_internal(SequenceTime time,bool singleThreaded,bool
                 offset =  -vmin / (vmax - vmin);
             }
 
-            const RenderViewerArgs args(lastRenderedImage,
-                                        textureRect,
+            const RenderViewerArgs args(imageToConvert,
+                                        imageTextureRect,
                                         channels,
-                                        closestPowerOf2,
+                                        imageTextureRect.closestPo2,
                                         bitDepth,
                                         gain,
                                         offset,
                                         lutFromColorspace(srcColorSpace),
-                                        lutFromColorspace(lut));
+                                        lutFromColorspace(lut),
+                                        boxFilter);
 
             QtConcurrent::map(splitRows,
-                              boost::bind(&renderFunctor,
+                              boost::bind(&scaleToTexture,
                                           _1,
                                           args,
                                           ramBuffer)).waitForFinished();
@@ -1064,24 +1155,6 @@ ViewerInstance::renderViewer_internal(SequenceTime time,bool singleThreaded,bool
     return StatOK;
 }
 
-void
-renderFunctor(std::pair<int,int> yRange,
-              const RenderViewerArgs& args,
-              void *buffer)
-{
-    assert(args.texRect.y1 <= yRange.first && yRange.first <= yRange.second && yRange.second <= args.texRect.y2);
-    
-    if (args.bitDepth == OpenGLViewerI::FLOAT || args.bitDepth == OpenGLViewerI::HALF_FLOAT) {
-        // image is stored as linear, the OpenGL shader with do gamma/sRGB/Rec709 decompression, as well as gain and offset
-        scaleToTexture32bits(yRange, args, (float*)buffer);
-    }
-    else{
-        // texture is stored as sRGB/Rec709 compressed 8-bit RGBA
-        scaleToTexture8bits(yRange, args, (U32*)buffer);
-    }
-
-}
-
 std::pair<double, double>
 findAutoContrastVminVmax(boost::shared_ptr<const Natron::Image> inputImage,
                          ViewerInstance::DisplayChannels channels,
@@ -1144,367 +1217,396 @@ findAutoContrastVminVmax(boost::shared_ptr<const Natron::Image> inputImage,
 }
 
 
-template <typename PIX,int maxValue>
-void scaleToTexture8bits_internal(const std::pair<int,int>& yRange,
-                                  const RenderViewerArgs& args,
-                                  U32* output,
-                                  int rOffset,int gOffset,int bOffset,int nComps)
+namespace {
+
+/**
+ * @brief Converts a sample of the input image to a linear float, through the color-space of the
+ * input image if hasSrcLut is true. The alpha channel is always converted with hasSrcLut = false.
+ **/
+template <typename PIX,bool hasSrcLut>
+struct SampleToLinear;
+
+template <>
+struct SampleToLinear<unsigned char,false>
 {
-    
-    Natron::ImageComponents comps = args.inputImage->getComponents();
-    const bool luminance = (args.channels == ViewerInstance::LUMINANCE);
+    static float convert(unsigned char v,const Natron::Color::Lut* /*lut*/) { return Natron::Color::intToFloat<256>(v); }
+};
 
-    ///offset the output buffer at the starting point
-    output += ((yRange.first - args.texRect.y1) / args.closestPowerOf2) * args.texRect.w;
-    
-    ///iterating over the scan-lines of the input image
-    int dstY = 0;
-    for (int y = yRange.first; y < yRange.second; y += args.closestPowerOf2) {
-        
-        int start = (int)(rand() % std::max(((args.texRect.x2 - args.texRect.x1)/args.closestPowerOf2),1));
-        const PIX* src_pixels = (const PIX*)args.inputImage->pixelAt(args.texRect.x1, y);
-        
-        U32* dst_pixels = output + dstY * args.texRect.w;
-        
-        /* go fowards from starting point to end of line: */
-        for (int backward = 0;backward < 2; ++backward) {
-            
-            int dstIndex = backward ? start - 1 : start;
-            int srcIndex = dstIndex * args.closestPowerOf2; //< offset from src_pixels
-            assert(backward == 1 || (srcIndex >= 0 && srcIndex < (args.texRect.x2 - args.texRect.x1)));
-            
-            unsigned error_r = 0x80;
-            unsigned error_g = 0x80;
-            unsigned error_b = 0x80;
-            
-            while (dstIndex < args.texRect.w && dstIndex >= 0) {
-                
-                if (srcIndex >= ( args.texRect.x2 - args.texRect.x1)) {
-                    break;
-                } else {
-                    
-                    double r,g,b;
-                    int a;
-                    switch (comps) {
-                        case Natron::ImageComponentRGBA:
-                            r = (src_pixels ? src_pixels[srcIndex * nComps + rOffset] : 0.);
-                            g = (src_pixels ? src_pixels[srcIndex * nComps + gOffset] : 0.);
-                            b = (src_pixels ? src_pixels[srcIndex * nComps + bOffset] : 0.) ;
-                            a = Color::floatToInt<256>(src_pixels[srcIndex * nComps + 3]);
-                            break;
-                        case Natron::ImageComponentRGB:
-                            r = (src_pixels ? src_pixels[srcIndex * nComps + rOffset] : 0.);
-                            g = (src_pixels ? src_pixels[srcIndex * nComps + gOffset] : 0.);
-                            b = (src_pixels ? src_pixels[srcIndex * nComps + bOffset] : 0.);
-                            a = 255;
-                            break;
-                        case Natron::ImageComponentAlpha:
-                            r = src_pixels ? src_pixels[srcIndex] : 0.;
-                            g = b = r;
-                            a = 255;
-                            break;
-                        default:
-                            assert(false);
-                            break;
-                    }
-                    switch (args.inputImage->getBitDepth()) {
-                        case Natron::IMAGE_BYTE:
-                            if (args.srcColorSpace) {
-                                r = args.srcColorSpace->fromColorSpaceUint8ToLinearFloatFast((unsigned char)r);
-                                g = args.srcColorSpace->fromColorSpaceUint8ToLinearFloatFast((unsigned char)g);
-                                b = args.srcColorSpace->fromColorSpaceUint8ToLinearFloatFast((unsigned char)b);
-                            } else {
-                                r = (double)convertPixelDepth<unsigned char, float>((unsigned char)r);
-                                g = (double)convertPixelDepth<unsigned char, float>((unsigned char)g);
-                                b = (double)convertPixelDepth<unsigned char, float>((unsigned char)b);
-                            }
-                            break;
-                        case Natron::IMAGE_SHORT:
-                            if (args.srcColorSpace) {
-                                r = args.srcColorSpace->fromColorSpaceUint16ToLinearFloatFast((unsigned short)r);
-                                g = args.srcColorSpace->fromColorSpaceUint16ToLinearFloatFast((unsigned short)g);
-                                b = args.srcColorSpace->fromColorSpaceUint16ToLinearFloatFast((unsigned short)b);
-                            } else {
-                                r = (double)convertPixelDepth<unsigned short, float>((unsigned char)r);
-                                g = (double)convertPixelDepth<unsigned short, float>((unsigned char)g);
-                                b = (double)convertPixelDepth<unsigned short, float>((unsigned char)b);
-                            }
-                            break;
-                        case Natron::IMAGE_FLOAT:
-                            if (args.srcColorSpace) {
-                                r = args.srcColorSpace->fromColorSpaceFloatToLinearFloat(r);
-                                g = args.srcColorSpace->fromColorSpaceFloatToLinearFloat(g);
-                                b = args.srcColorSpace->fromColorSpaceFloatToLinearFloat(b);
-                            }
-                            break;
-                        default:
-                            break;
-                    }
+template <>
+struct SampleToLinear<unsigned short,false>
+{
+    static float convert(unsigned short v,const Natron::Color::Lut* /*lut*/) { return Natron::Color::intToFloat<65536>(v); }
+};
 
-                    r =  r * args.gain + args.offset;
-                    g =  g * args.gain + args.offset;
-                    b =  b * args.gain + args.offset;
-                    
-                    if (luminance) {
-                        r = 0.299 * r + 0.587 * g + 0.114 * b;
-                        g = r;
-                        b = r;
-                    }
-                    
-                    if (!args.colorSpace) {
-                        dst_pixels[dstIndex] = toBGRA(Color::floatToInt<256>(r),
-                                                      Color::floatToInt<256>(g),
-                                                      Color::floatToInt<256>(b),
-                                                      a);
-                    } else {
-                        error_r = (error_r&0xff) + args.colorSpace->toColorSpaceUint8xxFromLinearFloatFast(r);
-                        error_g = (error_g&0xff) + args.colorSpace->toColorSpaceUint8xxFromLinearFloatFast(g);
-                        error_b = (error_b&0xff) + args.colorSpace->toColorSpaceUint8xxFromLinearFloatFast(b);
-                        assert(error_r < 0x10000 && error_g < 0x10000 && error_b < 0x10000);
-                        dst_pixels[dstIndex] = toBGRA((U8)(error_r >> 8),
-                                                      (U8)(error_g >> 8),
-                                                      (U8)(error_b >> 8),
-                                                      a);
-                    }
-                }
-                if (backward) {
-                    --dstIndex;
-                    srcIndex -= args.closestPowerOf2;
-                } else {
-                    ++dstIndex;
-                    srcIndex += args.closestPowerOf2;
-                }
-                
+template <>
+struct SampleToLinear<float,false>
+{
+    static float convert(float v,const Natron::Color::Lut* /*lut*/) { return v; }
+};
+
+template <>
+struct SampleToLinear<unsigned char,true>
+{
+    static float convert(unsigned char v,const Natron::Color::Lut* lut) { return lut->fromColorSpaceUint8ToLinearFloatFast(v); }
+};
+
+template <>
+struct SampleToLinear<unsigned short,true>
+{
+    static float convert(unsigned short v,const Natron::Color::Lut* lut) { return lut->fromColorSpaceUint16ToLinearFloatFast(v); }
+};
+
+template <>
+struct SampleToLinear<float,true>
+{
+    static float convert(float v,const Natron::Color::Lut* lut) { return lut->fromColorSpaceFloatToLinearFloat(v); }
+};
+
+/**
+ * @brief The offsets in an input pixel of the channels displayed in the red, green and blue channels of the texture.
+ * Images without alpha are displayed opaque.
+ **/
+template <int nComps,ViewerInstance::DisplayChannels channels>
+struct DisplayedChannels
+{
+    enum {
+        rOffset = channels == ViewerInstance::G ? (nComps < 2 ? 0 : 1)
+                : channels == ViewerInstance::B ? (nComps < 3 ? 0 : 2)
+                : channels == ViewerInstance::A ? (nComps < 4 ? 0 : 3)
+                : 0,
+        gOffset = (channels == ViewerInstance::RGB || channels == ViewerInstance::LUMINANCE) ? (nComps < 2 ? 0 : 1) : rOffset,
+        bOffset = (channels == ViewerInstance::RGB || channels == ViewerInstance::LUMINANCE) ? (nComps < 3 ? 0 : 2) : rOffset,
+        hasAlpha = nComps == 4
+    };
+};
+
+///Fills count linear RGBA float pixels of row with one pixel every closestPowerOf2 of the scan-line y.
+template <typename PIX,bool hasSrcLut,int nComps,ViewerInstance::DisplayChannels channels>
+void
+fetchRowPointSampled(const RenderViewerArgs& args,
+                     int y,
+                     int count,
+                     float* row)
+{
+    typedef DisplayedChannels<nComps,channels> Offsets;
+    const PIX* src = (const PIX*)args.inputImage->pixelAt(args.texRect.x1, y);
+    if (!src) {
+        std::fill(row, row + count * 4, 0.f);
+        return;
+    }
+    const Natron::Color::Lut* lut = args.srcColorSpace;
+    const int srcStride = args.closestPowerOf2 * nComps;
+    for (int i = 0; i < count; ++i, src += srcStride, row += 4) {
+        row[0] = SampleToLinear<PIX,hasSrcLut>::convert(src[Offsets::rOffset], lut);
+        row[1] = SampleToLinear<PIX,hasSrcLut>::convert(src[Offsets::gOffset], lut);
+        row[2] = SampleToLinear<PIX,hasSrcLut>::convert(src[Offsets::bOffset], lut);
+        row[3] = Offsets::hasAlpha ? SampleToLinear<PIX,false>::convert(src[nComps - 1], lut) : 1.f;
+    }
+}
+
+///Same as fetchRowPointSampled but each pixel is the average of the closestPowerOf2 x closestPowerOf2 block
+///of the image starting at its sample, clipped to the texture rectangle.
+template <typename PIX,bool hasSrcLut,int nComps,ViewerInstance::DisplayChannels channels>
+void
+fetchRowBoxFiltered(const RenderViewerArgs& args,
+                    int y,
+                    int count,
+                    float* row)
+{
+    typedef DisplayedChannels<nComps,channels> Offsets;
+    const Natron::Color::Lut* lut = args.srcColorSpace;
+    const int p = args.closestPowerOf2;
+    const int x1 = args.texRect.x1;
+    const int x2 = std::min(args.texRect.x1 + count * p, args.texRect.x2);
+    const int yEnd = std::min(y + p, args.texRect.y2);
+
+    ///the color-space conversion is done before averaging: the filter works on linear values
+    std::fill(row, row + count * 4, 0.f);
+    int rowsCount = 0;
+    for (int sy = y; sy < yEnd; ++sy) {
+        const PIX* src = (const PIX*)args.inputImage->pixelAt(x1, sy);
+        if (!src) {
+            continue;
+        }
+        ++rowsCount;
+        float* acc = row;
+        int x = x1;
+        for (int i = 0; i < count; ++i, acc += 4) {
+            int blockEnd = std::min(x + p, x2);
+            float r = 0.f, g = 0.f, b = 0.f, a = 0.f;
+            for (; x < blockEnd; ++x, src += nComps) {
+                r += SampleToLinear<PIX,hasSrcLut>::convert(src[Offsets::rOffset], lut);
+                g += SampleToLinear<PIX,hasSrcLut>::convert(src[Offsets::gOffset], lut);
+                b += SampleToLinear<PIX,hasSrcLut>::convert(src[Offsets::bOffset], lut);
+                a += Offsets::hasAlpha ? SampleToLinear<PIX,false>::convert(src[nComps - 1], lut) : 1.f;
             }
+            acc[0] += r;
+            acc[1] += g;
+            acc[2] += b;
+            acc[3] += a;
         }
-        ++dstY;
     }
-
+    if (rowsCount == 0) {
+        return;
+    }
+    int x = x1;
+    for (int i = 0; i < count; ++i, row += 4, x += p) {
+        float norm = 1.f / (float)(rowsCount * (std::min(x + p, x2) - x));
+        row[0] *= norm;
+        row[1] *= norm;
+        row[2] *= norm;
+        row[3] *= norm;
+    }
 }
 
+///Applies the gain and offset to the color channels (not to alpha) and replaces them by the luminance if needed.
+///There's no dependency between pixels, the compiler vectorizes it.
+template <bool luminance>
 void
-scaleToTexture8bits(std::pair<int,int> yRange,
-                    const RenderViewerArgs& args,
-                    U32* output)
+applyGainAndOffset(float* row,
+                   int count,
+                   float gain,
+                   float offset)
 {
-    assert(output);
+    for (int i = 0; i < count; ++i, row += 4) {
+        float r = row[0] * gain + offset;
+        float g = row[1] * gain + offset;
+        float b = row[2] * gain + offset;
+        if (luminance) {
+            r = g = b = 0.299f * r + 0.587f * g + 0.114f * b;
+        }
+        row[0] = r;
+        row[1] = g;
+        row[2] = b;
+    }
+}
 
-    int rOffset, gOffset, bOffset;
-    int nComps = (int)args.inputImage->getComponentsCount();
-    switch (args.channels) {
-        case ViewerInstance::RGB:
-        case ViewerInstance::LUMINANCE:
-            rOffset = 0;
-            gOffset = nComps < 2 ? 0 : 1;
-            bOffset = nComps < 3 ? 0 : 2;
-            break;
-        case ViewerInstance::R:
-            rOffset = 0;
-            gOffset = 0;
-            bOffset = 0;
-            break;
-        case ViewerInstance::G:
-            rOffset = nComps < 2 ? 0 : 1;
-            gOffset = nComps < 2 ? 0 : 1;
-            bOffset = nComps < 2 ? 0 : 1;
-            break;
-        case ViewerInstance::B:
-            rOffset = nComps < 3 ? 0 : 2;
-            gOffset = nComps < 3 ? 0 : 2;
-            bOffset = nComps < 3 ? 0 : 2;
-            break;
-        case ViewerInstance::A:
-            rOffset = nComps < 4 ? 0 : 3;
-            gOffset = nComps < 4 ? 0 : 3;
-            bOffset = nComps < 4 ? 0 : 3;
-            break;
-        default:
-            rOffset = 0;
-            gOffset = 0;
-            bOffset = 0;
-            break;
+///Packs count linear RGBA float pixels to 8 bits BGRA without color-space, clamping to [0,1] like Color::floatToInt<256>.
+void
+storeRow8bitsLinear(const float* row,
+                    int count,
+                    U32* dst)
+{
+    int i = 0;
+#ifdef NATRON_VIEWER_SSE2
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.f);
+    const __m128 scale = _mm_set1_ps(255.f);
+    const __m128 half = _mm_set1_ps(0.5f);
+    ///4 pixels per iteration. _mm_max_ps returns its second operand if the first is NaN: NaNs become 0.
+    for (; i + 4 <= count; i += 4, row += 16, dst += 4) {
+        __m128i p[4];
+        for (int k = 0; k < 4; ++k) {
+            __m128 v = _mm_mul_ps(_mm_min_ps(_mm_max_ps(_mm_loadu_ps(row + k * 4), zero), one), scale);
+            ///v + 0.5 is not exact in float: round up when the fractional part is >= 0.5 instead,
+            ///the comparison mask is -1
+            __m128i t = _mm_cvttps_epi32(v);
+            __m128 frac = _mm_sub_ps(v, _mm_cvtepi32_ps(t));
+            t = _mm_sub_epi32(t, _mm_castps_si128(_mm_cmpge_ps(frac, half)));
+            ///RGBA -> BGRA
+            p[k] = _mm_shuffle_epi32(t, _MM_SHUFFLE(3,0,1,2));
+        }
+        __m128i packed = _mm_packus_epi16(_mm_packs_epi32(p[0], p[1]), _mm_packs_epi32(p[2], p[3]));
+        _mm_storeu_si128((__m128i*)dst, packed);
     }
-    switch (args.inputImage->getBitDepth()) {
-        case Natron::IMAGE_FLOAT:
-            scaleToTexture8bits_internal<float, 1>(yRange, args, output, rOffset, gOffset, bOffset, nComps);
-            break;
-        case Natron::IMAGE_BYTE:
-            scaleToTexture8bits_internal<unsigned char, 255>(yRange, args, output, rOffset, gOffset, bOffset, nComps);
-            break;
-        case Natron::IMAGE_SHORT:
-            scaleToTexture8bits_internal<unsigned short, 65535>(yRange, args, output, rOffset, gOffset, bOffset, nComps);
-            break;
-            
-        default:
-            break;
+#endif
+    for (; i < count; ++i, row += 4, ++dst) {
+        *dst = toBGRA(Color::floatToInt<256>(row[0]),
+                      Color::floatToInt<256>(row[1]),
+                      Color::floatToInt<256>(row[2]),
+                      Color::floatToInt<256>(row[3]));
     }
 }
 
-template <typename PIX,int maxValue>
-void scaleToTexture32bitsInternal(const std::pair<int,int>& yRange,
-                                  const RenderViewerArgs& args,
-                                  float *output,
-                                  int rOffset,int gOffset,int bOffset,int nComps)
+///Packs count linear RGBA float pixels to 8 bits BGRA in the color-space of the lut, with error diffusion
+///starting from a pseudo-random column of the scan-line y. indices must hold count * 4 elements.
+void
+storeRow8bitsWithLut(const float* row,
+                     int count,
+                     int y,
+                     const Natron::Color::Lut* lut,
+                     unsigned short* indices,
+                     U32* dst)
 {
-    
-    Natron::ImageComponents comps = args.inputImage->getComponents();
-    const bool luminance = (args.channels == ViewerInstance::LUMINANCE);
+    lut->to_uint8xx_rgba_row(indices, row, count);
+
+    int start = Natron::Color::getDitherStart(y, count);
+
+    /* go fowards from starting point to end of line, then backwards from the starting point to the start of the line: */
+    for (int backward = 0; backward < 2; ++backward) {
+        unsigned error_r = 0x80;
+        unsigned error_g = 0x80;
+        unsigned error_b = 0x80;
+        int end = backward ? -1 : count;
+        int step = backward ? -1 : 1;
+        for (int x = backward ? start - 1 : start; x != end; x += step) {
+            error_r = (error_r&0xff) + indices[x * 4];
+            error_g = (error_g&0xff) + indices[x * 4 + 1];
+            error_b = (error_b&0xff) + indices[x * 4 + 2];
+            assert(error_r < 0x10000 && error_g < 0x10000 && error_b < 0x10000);
+            dst[x] = toBGRA((U8)(error_r >> 8),
+                            (U8)(error_g >> 8),
+                            (U8)(error_b >> 8),
+                            Color::floatToInt<256>(row[x * 4 + 3]));
+        }
+    }
+}
 
-    ///the width of the output buffer multiplied by the channels count
-    int dst_width = args.texRect.w * 4;
-    
-    ///offset the output buffer at the starting point
-    output += ((yRange.first - args.texRect.y1) / args.closestPowerOf2) * dst_width;
-    
-    ///iterating over the scan-lines of the input image
-    int dstY = 0;
-    for (int y = yRange.first; y < yRange.second; y += args.closestPowerOf2) {
-        
-        const float* src_pixels = (const float*)args.inputImage->pixelAt(args.texRect.x1, y);
-        float* dst_pixels = output + dstY * dst_width;
-        
-        ///we fill the scan-line with all the pixels of the input image
-        for (int x = args.texRect.x1; x < args.texRect.x2; x += args.closestPowerOf2) {
-            
-            double r,g,b,a;
-            
-            switch (comps) {
-                case Natron::ImageComponentRGBA:
-                    r = (double)(src_pixels[rOffset]);
-                    g = (double)src_pixels[gOffset] ;
-                    b = (double)src_pixels[bOffset] ;
-                    a = (nComps < 4) ? 1. : src_pixels[3];
-                    break;
-                case Natron::ImageComponentRGB:
-                    r = (double)(src_pixels[rOffset]) ;
-                    g = (double)src_pixels[gOffset] ;
-                    b = (double)src_pixels[bOffset] ;
-                    a = 1.;
-                    break;
-                case Natron::ImageComponentAlpha:
-                    a = (nComps < 4) ? 1. : *src_pixels;
-                    r = g = b = a;
-                    a = 1.;
-                    break;
-                default:
-                    assert(false);
-                    break;
-            }
-            
-            switch (args.inputImage->getBitDepth()) {
-                case Natron::IMAGE_BYTE:
-                    if (args.srcColorSpace) {
-                        r = args.srcColorSpace->fromColorSpaceUint8ToLinearFloatFast((unsigned char)r);
-                        g = args.srcColorSpace->fromColorSpaceUint8ToLinearFloatFast((unsigned char)g);
-                        b = args.srcColorSpace->fromColorSpaceUint8ToLinearFloatFast((unsigned char)b);
-                    } else {
-                        r = (double)convertPixelDepth<unsigned char, float>((unsigned char)r);
-                        g = (double)convertPixelDepth<unsigned char, float>((unsigned char)g);
-                        b = (double)convertPixelDepth<unsigned char, float>((unsigned char)b);
-                    }
-                    break;
-                case Natron::IMAGE_SHORT:
-                    if (args.srcColorSpace) {
-                        r = args.srcColorSpace->fromColorSpaceUint16ToLinearFloatFast((unsigned short)r);
-                        g = args.srcColorSpace->fromColorSpaceUint16ToLinearFloatFast((unsigned short)g);
-                        b = args.srcColorSpace->fromColorSpaceUint16ToLinearFloatFast((unsigned short)b);
-                    } else {
-                        r = (double)convertPixelDepth<unsigned short, float>((unsigned char)r);
-                        g = (double)convertPixelDepth<unsigned short, float>((unsigned char)g);
-                        b = (double)convertPixelDepth<unsigned short, float>((unsigned char)b);
-                    }
-                    break;
-                case Natron::IMAGE_FLOAT:
-                    if (args.srcColorSpace) {
-                        r = args.srcColorSpace->fromColorSpaceFloatToLinearFloat(r);
-                        g = args.srcColorSpace->fromColorSpaceFloatToLinearFloat(g);
-                        b = args.srcColorSpace->fromColorSpaceFloatToLinearFloat(b);
-                    }
-                    break;
-                default:
-                    break;
-            }
+template <typename PIX,bool hasSrcLut,int nComps,ViewerInstance::DisplayChannels channels>
+void
+scaleToTexture_internal(const std::pair<int,int>& yRange,
+                        const RenderViewerArgs& args,
+                        void* buffer)
+{
+    const int p = args.closestPowerOf2;
+    assert((yRange.first - args.texRect.y1) % p == 0);
+
+    ///the number of pixels of a scan-line of the texture that are in the texture rectangle
+    const int count = std::min(args.texRect.w, (args.texRect.x2 - args.texRect.x1 + p - 1) / p);
+    if (count <= 0) {
+        return;
+    }
+    const bool floatTexture = args.bitDepth == OpenGLViewerI::FLOAT || args.bitDepth == OpenGLViewerI::HALF_FLOAT;
+    const bool luminance = channels == ViewerInstance::LUMINANCE;
+    const bool boxFilter = args.boxFilter && p > 1;
+
+    ///8 bits textures are converted through a linear float scan-line, float textures are converted in place
+    std::vector<float> rowBuffer;
+    std::vector<unsigned short> indices;
+    if (!floatTexture) {
+        rowBuffer.resize(count * 4);
+        if (args.colorSpace) {
+            indices.resize(count * 4);
+        }
+    }
 
+    int dstY = (yRange.first - args.texRect.y1) / p;
+    for (int y = yRange.first; y < yRange.second; y += p, ++dstY) {
+        float* row = floatTexture ? (float*)buffer + (std::size_t)dstY * args.texRect.w * 4 : &rowBuffer[0];
+        if (boxFilter) {
+            fetchRowBoxFiltered<PIX,hasSrcLut,nComps,channels>(args, y, count, row);
+        } else {
+            fetchRowPointSampled<PIX,hasSrcLut,nComps,channels>(args, y, count, row);
+        }
 
-            
+        if (floatTexture) {
+            // the OpenGL shader does the gamma/sRGB/Rec709 compression, as well as gain and offset
             if (luminance) {
-                r = 0.299 * r + 0.587 * g + 0.114 * b;
-                g = r;
-                b = r;
+                applyGainAndOffset<true>(row, count, 1.f, 0.f);
             }
-            *dst_pixels++ = r;
-            *dst_pixels++ = g;
-            *dst_pixels++ = b;
-            *dst_pixels++ = a;
-            
-            src_pixels += args.closestPowerOf2 * 4;
+            continue;
         }
-        ++dstY;
-    }
 
+        // texture is stored as sRGB/Rec709 compressed 8-bit RGBA
+        if (luminance) {
+            applyGainAndOffset<true>(row, count, (float)args.gain, (float)args.offset);
+        } else if (args.gain != 1. || args.offset != 0.) {
+            applyGainAndOffset<false>(row, count, (float)args.gain, (float)args.offset);
+        }
+        U32* dst = (U32*)buffer + (std::size_t)dstY * args.texRect.w;
+        if (args.colorSpace) {
+            storeRow8bitsWithLut(row, count, y, args.colorSpace, &indices[0], dst);
+        } else {
+            storeRow8bitsLinear(row, count, dst);
+        }
+    }
 }
 
+template <typename PIX,bool hasSrcLut,int nComps>
 void
-scaleToTexture32bits(std::pair<int,int> yRange,
-                     const RenderViewerArgs& args,
-                     float *output)
+scaleToTextureForComponents(const std::pair<int,int>& yRange,
+                            const RenderViewerArgs& args,
+                            void* buffer)
 {
-    assert(output);
-
-    int rOffset, gOffset, bOffset;
-
-    int nComps = (int)args.inputImage->getComponentsCount();
     switch (args.channels) {
-        case ViewerInstance::RGB:
         case ViewerInstance::LUMINANCE:
-            rOffset = 0;
-            gOffset = nComps < 2 ? 0 : 1;
-            bOffset = nComps < 3 ? 0 : 2;
+            scaleToTexture_internal<PIX,hasSrcLut,nComps,ViewerInstance::LUMINANCE>(yRange, args, buffer);
             break;
         case ViewerInstance::R:
-            rOffset = 0;
-            gOffset = 0;
-            bOffset = 0;
+            scaleToTexture_internal<PIX,hasSrcLut,nComps,ViewerInstance::R>(yRange, args, buffer);
             break;
         case ViewerInstance::G:
-            rOffset = nComps < 2 ? 0 : 1;
-            gOffset = nComps < 2 ? 0 : 1;
-            bOffset = nComps < 2 ? 0 : 1;
+            scaleToTexture_internal<PIX,hasSrcLut,nComps,ViewerInstance::G>(yRange, args, buffer);
             break;
         case ViewerInstance::B:
-            rOffset = nComps < 3 ? 0 : 2;
-            gOffset = nComps < 3 ? 0 : 2;
-            bOffset = nComps < 3 ? 0 : 2;
+            scaleToTexture_internal<PIX,hasSrcLut,nComps,ViewerInstance::B>(yRange, args, buffer);
             break;
         case ViewerInstance::A:
-            rOffset = nComps < 4 ? 0 : 3;
-            gOffset = nComps < 4 ? 0 : 3;
-            bOffset = nComps < 4 ? 0 : 3;
+            scaleToTexture_internal<PIX,hasSrcLut,nComps,ViewerInstance::A>(yRange, args, buffer);
             break;
+        case ViewerInstance::RGB:
         default:
-            rOffset = 0;
-            gOffset = 0;
-            bOffset = 0;
+            scaleToTexture_internal<PIX,hasSrcLut,nComps,ViewerInstance::RGB>(yRange, args, buffer);
             break;
     }
+}
+
+template <typename PIX,bool hasSrcLut>
+void
+scaleToTextureForColorSpace(const std::pair<int,int>& yRange,
+                            const RenderViewerArgs& args,
+                            void* buffer)
+{
+    switch (args.inputImage->getComponentsCount()) {
+        case 1:
+            ///an alpha image is displayed as grey in every channel mode except luminance, which is the same
+            if (args.channels == ViewerInstance::LUMINANCE) {
+                scaleToTexture_internal<PIX,hasSrcLut,1,ViewerInstance::LUMINANCE>(yRange, args, buffer);
+            } else {
+                scaleToTexture_internal<PIX,hasSrcLut,1,ViewerInstance::RGB>(yRange, args, buffer);
+            }
+            break;
+        case 3:
+            scaleToTextureForComponents<PIX,hasSrcLut,3>(yRange, args, buffer);
+            break;
+        case 4:
+            scaleToTextureForComponents<PIX,hasSrcLut,4>(yRange, args, buffer);
+            break;
+        default:
+            assert(false);
+            break;
+    }
+}
+
+template <typename PIX>
+void
+scaleToTextureForBitDepth(const std::pair<int,int>& yRange,
+                          const RenderViewerArgs& args,
+                          void* buffer)
+{
+    if (args.srcColorSpace) {
+        scaleToTextureForColorSpace<PIX,true>(yRange, args, buffer);
+    } else {
+        scaleToTextureForColorSpace<PIX,false>(yRange, args, buffer);
+    }
+}
+
+} // anon namespace
+
+void
+scaleToTexture(std::pair<int,int> yRange,
+               const RenderViewerArgs& args,
+               void* buffer)
+{
+    assert(buffer);
+    assert(args.texRect.y1 <= yRange.first && yRange.first <= yRange.second && yRange.second <= args.texRect.y2);
+
     switch (args.inputImage->getBitDepth()) {
         case Natron::IMAGE_FLOAT:
-            scaleToTexture32bitsInternal<float, 1>(yRange, args, output, rOffset, gOffset, bOffset,nComps);
+            scaleToTextureForBitDepth<float>(yRange, args, buffer);
             break;
         case Natron::IMAGE_BYTE:
-            scaleToTexture32bitsInternal<unsigned char, 255>(yRange, args, output, rOffset, gOffset, bOffset,nComps);
+            scaleToTextureForBitDepth<unsigned char>(yRange, args, buffer);
             break;
         case Natron::IMAGE_SHORT:
-            scaleToTexture32bitsInternal<unsigned short, 65535>(yRange, args, output, rOffset, gOffset, bOffset,nComps);
+            scaleToTextureForBitDepth<unsigned short>(yRange, args, buffer);
             break;
         default:
             break;
     }
-    
 }
 
 
-
 void
 ViewerInstance::wakeUpAnySleepingThread()
 {
@@ -13,6 +13,8 @@
 
 #include "ViewerInstance.h"
 
+#include <vector>
+
 #include <QtCore/QMutex>
 #include <QtCore/QWaitCondition>
 #include <QtCore/QThread>
@@ -38,7 +40,8 @@ struct RenderViewerArgs {
                      double gain_,
                      double offset_,
                      const Natron::Color::Lut* srcColorSpace_,
-                     const Natron::Color::Lut* colorSpace_)
+                     const Natron::Color::Lut* colorSpace_,
+                     bool boxFilter_)
     : inputImage(inputImage_)
     , texRect(texRect_)
     , channels(channels_)
@@ -48,6 +51,7 @@ struct RenderViewerArgs {
     , offset(offset_)
     , srcColorSpace(srcColorSpace_)
     , colorSpace(colorSpace_)
+    , boxFilter(boxFilter_)
     {
     }
 
@@ -60,6 +64,36 @@ struct RenderViewerArgs {
     double offset;
     const Natron::Color::Lut* srcColorSpace;
     const Natron::Color::Lut* colorSpace;
+    bool boxFilter; //< if true, each texture pixel averages the closestPowerOf2 x closestPowerOf2 block of the image it covers
+};
+
+/**
+ * @brief Converts the scan-lines [yRange.first, yRange.second[ of args.inputImage to the texture buffer: packed 8 bits
+ * BGRA pixels or linear RGBA floats depending on args.bitDepth. Only one every args.closestPowerOf2 scan-line is
+ * converted, hence yRange.first - args.texRect.y1 must be a multiple of args.closestPowerOf2.
+ * Different ranges can be converted concurrently.
+ **/
+void scaleToTexture(std::pair<int,int> yRange,
+                    const RenderViewerArgs& args,
+                    void* buffer);
+
+/**
+ * @brief The mipmap levels of the last image rendered for an input of the viewer, built lazily when the viewer is
+ * zoomed out with filtering on. Changing the zoom factor then converts the level matching it instead of averaging
+ * the pixels of the full resolution image again, and all the zoom factors share the same levels.
+ **/
+struct ViewerMipMapPyramid
+{
+    ViewerMipMapPyramid()
+    : source()
+    , colorSpace(Natron::Linear)
+    , levels()
+    {
+    }
+
+    boost::shared_ptr<const Natron::Image> source; //< the image the levels were built from
+    Natron::ViewerColorSpace colorSpace; //< the color-space of the pixels of source, they are averaged in linear
+    std::vector< boost::shared_ptr<Natron::Image> > levels; //< levels[i] is source downscaled by 2^(i+1)
 };
 
 /// parameters send from the VideoEngine thread to updateViewer() (which runs in the main thread)
@@ -109,6 +143,7 @@ public:
     , viewerMipMapLevel(0)
     , lastRenderedImageMutex()
     , lastRenderedImage()
+    , mipMapPyramid()
     , threadIdMutex()
     , threadIdVideoEngine(NULL)
     , activeInputsMutex()
@@ -194,6 +229,7 @@ public:
 
     mutable QMutex lastRenderedImageMutex;
     boost::shared_ptr<Natron::Image> lastRenderedImage[2]; //< A ptr to the last returned image by renderRoI. @see getLastRenderedImage()
+    ViewerMipMapPyramid mipMapPyramid[2]; //< the mipmaps of lastRenderedImage, only accessed by the VideoEngine thread
 
     // store the threadId of the VideoEngine thread - used for debugging purposes
     mutable QMutex threadIdMutex;
@@ -2851,12 +2851,21 @@ void CurveWidget::exportCurveToAscii()
         file.open(QIODevice::WriteOnly | QIODevice::Text);
         QTextStream ts(&file);
         
-        for (double i = x; i <= end; i+=incr) {
+        ///evaluate each curve in one go, this is much cheaper than evaluating them one time at a time
+        std::map<int,std::vector<double> > values;
+        std::size_t rowsCount = 0;
+        for (std::map<int,CurveGui*>::const_iterator it = columns.begin(); it != columns.end(); ++it) {
+            std::vector<double>& columnValues = values[it->first];
+            it->second->getInternalCurve()->getValuesAt(x, end, incr, &columnValues);
+            rowsCount = std::max(rowsCount, columnValues.size());
+        }
+        
+        for (std::size_t i = 0; i < rowsCount; ++i) {
             
             for (int c = 0; c < columnsCount; ++c) {
-                std::map<int,CurveGui*>::const_iterator foundCurve = columns.find(c);
-                if (foundCurve != columns.end()) {
-                    QString str = QString::number(foundCurve->second->evaluate(i),'f',10);
+                std::map<int,std::vector<double> >::const_iterator foundCurve = values.find(c);
+                if (foundCurve != values.end() && i < foundCurve->second.size()) {
+                    QString str = QString::number(foundCurve->second[i],'f',10);
                     ts << str;
                 } else {
                     ts <<  0;
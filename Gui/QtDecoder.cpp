@@ -12,10 +12,12 @@
 #include "QtDecoder.h"
 
 #include <stdexcept>
+#include <algorithm>
 
 #include <QtGui/QImage>
 #include <QtGui/QColor>
 #include <QtGui/QImageReader>
+#include <QtCore/QFileInfo>
 
 #include "Engine/AppManager.h"
 #include "Engine/Image.h"
@@ -25,6 +27,7 @@
 #include "Engine/Knob.h"
 #include "Engine/Project.h"
 #include "Engine/Node.h"
+#include "Engine/AppInstance.h"
 
 using namespace Natron;
 using std::cout; using std::endl;
@@ -32,7 +35,10 @@ using std::cout; using std::endl;
 QtReader::QtReader(boost::shared_ptr<Natron::Node> node)
 : Natron::EffectInstance(node)
 , _lut(Color::LutManager::sRGBLut())
-, _img(0)
+, _filename()
+, _imageSize()
+, _lock()
+, _decodedFrame()
 , _fileKnob()
 , _firstFrame()
 , _before()
@@ -49,8 +55,6 @@ QtReader::QtReader(boost::shared_ptr<Natron::Node> node)
 
 
 QtReader::~QtReader(){
-    if(_img)
-        delete _img;
 }
 
 std::string QtReader::pluginID() const {
@@ -141,6 +145,7 @@ void QtReader::initializeKnobs() {
 
 void QtReader::knobChanged(KnobI* k, Natron::ValueChangedReason /*reason*/,const RectI& /*rod*/) {
     if (k == _fileKnob.get()) {
+        _decodedFrame.clear();
         SequenceTime first,last;
         getSequenceTimeDomain(first,last);
         timeDomainFromSequenceTimeDomain(first,last, true);
@@ -387,10 +392,125 @@ void QtReader::getFilenameAtSequenceTime(SequenceTime time, std::string &filenam
     
 }
 
+namespace {
+    
+///Number of scan-lines converted at once by QImage for the formats we can't read directly
+#define NATRON_QTREADER_CONVERSION_BAND_HEIGHT 64
+    
+///Returns true if the scan-lines of the format can be read directly: the 32 bits formats, which are
+///BGRA in memory (on little endian machines, which the previous code assumed too).
+bool
+isBGRAFormat(QImage::Format format)
+{
+    return format == QImage::Format_RGB32 || format == QImage::Format_ARGB32 || format == QImage::Format_ARGB32_Premultiplied;
+}
+    
+///Builds the table converting sRGB bytes to the colorspace of the project's 8-bit images.
+///Returns false if they are sRGB already.
+bool
+getByteRemapTable(Natron::ViewerColorSpace cs,unsigned char* table)
+{
+    if (cs == Natron::sRGB) {
+        return false;
+    }
+    const Natron::Color::Lut* srcLut = Natron::Color::LutManager::sRGBLut();
+    const Natron::Color::Lut* dstLut = cs == Natron::Rec709 ? Natron::Color::LutManager::Rec709Lut() : NULL;
+    for (int i = 0; i < 256; ++i) {
+        float linear = srcLut->fromColorSpaceUint8ToLinearFloatFast((unsigned char)i);
+        table[i] = dstLut ? dstLut->toColorSpaceUint8FromLinearFloatFast(linear) : (unsigned char)Natron::Color::floatToInt<256>(linear);
+    }
+    return true;
+}
+    
+///Converts count BGRA pixels to RGBA. src and dst may be the same buffer.
+void
+convertRowToByte(const unsigned char* src,unsigned char* dst,int count,bool premult,const unsigned char* remap)
+{
+    for (int x = 0; x < count; ++x, src += 4, dst += 4) {
+        unsigned char b = src[0];
+        unsigned char g = src[1];
+        unsigned char r = src[2];
+        unsigned char a = src[3];
+        if (premult && a != 0 && a != 255) {
+            r = (unsigned char)std::min(255,(r * 255 + a / 2) / a);
+            g = (unsigned char)std::min(255,(g * 255 + a / 2) / a);
+            b = (unsigned char)std::min(255,(b * 255 + a / 2) / a);
+        }
+        if (remap) {
+            r = remap[r];
+            g = remap[g];
+            b = remap[b];
+        }
+        dst[0] = r;
+        dst[1] = g;
+        dst[2] = b;
+        dst[3] = a;
+    }
+}
+
+///Converts the columns [roi.x1,roi.x2[ of a BGRA scan-line to the row dstY of the output image.
+void
+convertRow(const unsigned char* src,int width,bool premult,const RectI& roi,int dstY,
+           const Natron::Color::Lut* lut,const unsigned char* remap,Natron::Image* output)
+{
+    if (output->getBitDepth() == Natron::IMAGE_BYTE) {
+        convertRowToByte(src + roi.x1 * 4,output->pixelAt(roi.x1,dstY),roi.x2 - roi.x1,premult,remap);
+    } else {
+        ///convert a single row: the RoDs passed to the lut are the ones of that row
+        RectI rowRoD(0,0,width,1);
+        RectI rowRect(roi.x1,0,roi.x2,1);
+        lut->from_byte_packed((float*)output->pixelAt(0,dstY),src,rowRect,rowRoD,rowRoD,
+                              Natron::Color::PACKING_BGRA,Natron::Color::PACKING_RGBA,false,premult);
+    }
+}
+    
+}
+
+QtDecodedFrame::QtDecodedFrame()
+: _lock()
+, _filename()
+, _lastModified()
+, _image()
+{
+}
+
+QDateTime
+QtDecodedFrame::lastModified(const std::string& filename)
+{
+    return QFileInfo(filename.c_str()).lastModified();
+}
+
+QImage
+QtDecodedFrame::find(const std::string& filename) const
+{
+    QMutexLocker l(&_lock);
+    if (_image.isNull() || filename != _filename || lastModified(filename) != _lastModified) {
+        return QImage();
+    }
+    return _image;
+}
+
+void
+QtDecodedFrame::set(const std::string& filename,const QDateTime& modified,const QImage& img)
+{
+    QMutexLocker l(&_lock);
+    _filename = filename;
+    _lastModified = modified;
+    _image = img;
+}
+
+void
+QtDecodedFrame::clear()
+{
+    QMutexLocker l(&_lock);
+    _filename.clear();
+    _image = QImage();
+}
+
 Natron::Status QtReader::getRegionOfDefinition(SequenceTime time,const RenderScale& /*scale*/,int /*view*/,RectI* rod ) {
 
     QMutexLocker l(&_lock);
-    double sequenceTime;
+    SequenceTime sequenceTime;
     try {
         sequenceTime =  getSequenceTime(time);
     } catch (const std::exception& e) {
@@ -405,82 +525,133 @@ Natron::Status QtReader::getRegionOfDefinition(SequenceTime time,const RenderSca
     }
     
     if(filename != _filename){
-        _filename = filename;
-        if(_img){
-            delete _img;
+        ///Most handlers read the size from the header, the image is decoded only in render()
+        QImageReader reader(filename.c_str());
+        QSize size = reader.size();
+        if (!size.isValid()) {
+            QImage img;
+            if (reader.read(&img)) {
+                size = img.size();
+            }
         }
-        _img = new QImage(_filename.c_str());
-        if(_img->format() == QImage::Format_Invalid){
+        if (!size.isValid() || size.isEmpty()) {
+            _filename.clear();
             setPersistentMessage(Natron::ERROR_MESSAGE, "Failed to load the image " + filename);
             return StatFailed;
         }
+        _filename = filename;
+        _imageSize = size;
     }
     
     rod->x1 = 0;
-    rod->x2 = _img->width();
+    rod->x2 = _imageSize.width();
     rod->y1 = 0;
-    rod->y2 = _img->height();
+    rod->y2 = _imageSize.height();
 
     return StatOK;
 }
 
-Natron::Status QtReader::render(SequenceTime /*time*/,RenderScale /*scale*/,
+Natron::Status QtReader::render(SequenceTime time,RenderScale /*scale*/,
                                 const RectI& roi,int /*view*/,
                                 bool /*isSequentialRender*/,bool /*isRenderResponseToUserInteraction*/,
                                 boost::shared_ptr<Natron::Image> output) {
-    int missingFrameChoice = _missingFrameChoice->getValue();
-    if (!_img) {
-        if (!_img && missingFrameChoice == 2) { // black image
+    std::string filename;
+    try {
+        getFilenameAtSequenceTime(getSequenceTime(time), filename);
+    } catch (const std::exception& e) {
+        filename.clear();
+    }
+    if (filename.empty()) {
+        if (_missingFrameChoice->getValue() == 2) { // black image
+            output->fill(roi,0.f,0.f);
             return StatOK;
         }
-        assert(missingFrameChoice != 0); // nearest value - should never happen
         return StatFailed; // error
     }
     
-    assert(_img);
-    switch (_img->format()) {
-        case QImage::Format_RGB32: // The image is stored using a 32-bit RGB format (0xffRRGGBB).
-        case QImage::Format_ARGB32: // The image is stored using a 32-bit ARGB format (0xAARRGGBB).
-            //might have to invert y coordinates here
-            _lut->from_byte_packed((float*)output->pixelAt(0, 0),_img->bits(), roi, output->getRoD(),output->getRoD(),
-                                   Natron::Color::PACKING_BGRA,Natron::Color::PACKING_RGBA,true,false);
-            break;
-        case QImage::Format_ARGB32_Premultiplied: // The image is stored using a premultiplied 32-bit ARGB format (0xAARRGGBB).
-            //might have to invert y coordinates here
-            _lut->from_byte_packed((float*)output->pixelAt(0, 0),_img->bits(), roi, output->getRoD(),output->getRoD(),
-                                   Natron::Color::PACKING_BGRA,Natron::Color::PACKING_RGBA,true,true);
-            break;
-        case QImage::Format_Mono: // The image is stored using 1-bit per pixel. Bytes are packed with the most significant bit (MSB) first.
-        case QImage::Format_MonoLSB: // The image is stored using 1-bit per pixel. Bytes are packed with the less significant bit (LSB) first.
-        case QImage::Format_Indexed8: // The image is stored using 8-bit indexes into a colormap.
-        case QImage::Format_RGB16: // The image is stored using a 16-bit RGB format (5-6-5).
-        case QImage::Format_RGB666: // The image is stored using a 24-bit RGB format (6-6-6). The unused most significant bits is always zero.
-        case QImage::Format_RGB555: // The image is stored using a 16-bit RGB format (5-5-5). The unused most significant bit is always zero.
-        case QImage::Format_RGB888: // The image is stored using a 24-bit RGB format (8-8-8).
-        case QImage::Format_RGB444: // The image is stored using a 16-bit RGB format (4-4-4). The unused bits are always zero.
-        {
-            QImage img = _img->convertToFormat(QImage::Format_ARGB32);
-            _lut->from_byte_packed((float*)output->pixelAt(0, 0), img.bits(), roi, output->getRoD(), output->getRoD(),
-                                   Natron::Color::PACKING_BGRA, Natron::Color::PACKING_RGBA, true, false);
-        }
-            break;
-        case QImage::Format_ARGB8565_Premultiplied: // The image is stored using a premultiplied 24-bit ARGB format (8-5-6-5).
-        case QImage::Format_ARGB6666_Premultiplied: // The image is stored using a premultiplied 24-bit ARGB format (6-6-6-6).
-        case QImage::Format_ARGB8555_Premultiplied: // The image is stored using a premultiplied 24-bit ARGB format (8-5-5-5).
-        case QImage::Format_ARGB4444_Premultiplied: // The image is stored using a premultiplied 16-bit ARGB format (4-4-4-4).
-        {
-            QImage img = _img->convertToFormat(QImage::Format_ARGB32_Premultiplied);
-            _lut->from_byte_packed((float*)output->pixelAt(0, 0), img.bits(), roi, output->getRoD(), output->getRoD(),
-                                   Natron::Color::PACKING_BGRA, Natron::Color::PACKING_RGBA, true, true);
+    const RectI& pixelRoD = output->getPixelRoD();
+    assert(pixelRoD.x1 == 0 && pixelRoD.y1 == 0);
+    int width = pixelRoD.width();
+    int height = pixelRoD.height();
+    bool byteOutput = output->getBitDepth() == Natron::IMAGE_BYTE;
+    
+    unsigned char remapTable[256];
+    const unsigned char* remap = NULL;
+    if (byteOutput && getByteRemapTable(getApp()->getDefaultColorSpaceForBitDepth(Natron::IMAGE_BYTE),remapTable)) {
+        remap = remapTable;
+    }
+    
+    ///Renders of other parts of the last frame decoded don't decode the file again
+    QImage img = _decodedFrame.find(filename);
+    
+    ///A byte RGBA image has the layout of a 32 bits QImage: when the whole image is requested let the handler
+    ///decode straight in the output buffer, it just needs to be flipped and swizzled afterwards.
+    ///Otherwise keep the image decoded for the next renders of that frame.
+    unsigned char* outputData = output->pixelAt(0,0);
+    if (img.isNull()) {
+        QDateTime modified = QtDecodedFrame::lastModified(filename);
+        QImageReader reader(filename.c_str());
+        bool decodeInOutput = byteOutput && isBGRAFormat(reader.imageFormat()) && roi == pixelRoD &&
+                              reader.size() == QSize(width,height);
+        if (decodeInOutput) {
+            img = QImage(outputData,width,height,width * 4,reader.imageFormat());
         }
-            break;
-        case QImage::Format_Invalid:
-        default:
-            output->fill(roi,0.f,1.f);
-            setPersistentMessage(Natron::ERROR_MESSAGE, "Invalid image format.");
+        if (!reader.read(&img)) {
+            setPersistentMessage(Natron::ERROR_MESSAGE, "Failed to load the image " + filename);
             return StatFailed;
+        }
+        if (!decodeInOutput) {
+            _decodedFrame.set(filename,modified,img);
+        }
+    }
+    if (img.width() != width || img.height() != height) {
+        setPersistentMessage(Natron::ERROR_MESSAGE, "The size of the image " + filename + " changed while reading it");
+        return StatFailed;
+    }
+    
+    ///Scan-line y of the image is row height - y - 1 of the output
+    const QImage& constImg = img;
+    if (constImg.bits() == outputData) {
+        ///The handler used our buffer (most do when the size and format are the expected ones)
+        bool premult = img.format() == QImage::Format_ARGB32_Premultiplied;
+        for (int y = 0; y < height / 2; ++y) {
+            unsigned char* top = output->pixelAt(0,y);
+            std::swap_ranges(top,top + width * 4,output->pixelAt(0,height - y - 1));
+        }
+        for (int y = 0; y < height; ++y) {
+            unsigned char* row = output->pixelAt(0,y);
+            convertRowToByte(row,row,width,premult,remap);
+        }
+    } else if (isBGRAFormat(img.format())) {
+        bool premult = img.format() == QImage::Format_ARGB32_Premultiplied;
+        for (int y = roi.y1; y < roi.y2; ++y) {
+            convertRow(constImg.scanLine(height - y - 1),width,premult,roi,y,_lut,remap,output.get());
+        }
+    } else if (img.format() != QImage::Format_Invalid) {
+        ///Let QImage convert a band of scan-lines at a time rather than a copy of the whole image
+        bool premult = img.format() == QImage::Format_ARGB8565_Premultiplied ||
+                       img.format() == QImage::Format_ARGB6666_Premultiplied ||
+                       img.format() == QImage::Format_ARGB8555_Premultiplied ||
+                       img.format() == QImage::Format_ARGB4444_Premultiplied;
+        QImage::Format targetFormat = premult ? QImage::Format_ARGB32_Premultiplied : QImage::Format_ARGB32;
+        int firstLine = height - roi.y2;
+        int lastLine = height - roi.y1;
+        for (int y = firstLine; y < lastLine; y += NATRON_QTREADER_CONVERSION_BAND_HEIGHT) {
+            int bandHeight = std::min(NATRON_QTREADER_CONVERSION_BAND_HEIGHT,lastLine - y);
+            QImage band = img.copy(0,y,width,bandHeight).convertToFormat(targetFormat);
+            for (int i = 0; i < bandHeight; ++i) {
+                convertRow(band.constScanLine(i),width,premult,roi,height - (y + i) - 1,_lut,remap,output.get());
+            }
+        }
+    } else {
+        output->fill(roi,0.f,1.f);
+        setPersistentMessage(Natron::ERROR_MESSAGE, "Invalid image format.");
+        return StatFailed;
+    }
+    
+    if (img.dotsPerMeterX() > 0 && img.dotsPerMeterY() > 0) {
+        output->setPixelAspect((double)img.dotsPerMeterX() / img.dotsPerMeterY());
     }
-    output->setPixelAspect(_img->dotsPerMeterX() / _img->dotsPerMeterY());
     return StatOK;
 }
 
@@ -504,5 +675,12 @@ void QtReader::addAcceptedComponents(int /*inputNb*/,std::list<Natron::ImageComp
 
 void QtReader::addSupportedBitDepth(std::list<Natron::ImageBitDepth>* depths) const
 {
+    depths->push_back(IMAGE_BYTE);
     depths->push_back(IMAGE_FLOAT);
 }
+
+void QtReader::getPreferredDepthAndComponents(int /*inputNb*/,Natron::ImageComponents* comp,Natron::ImageBitDepth* depth) const
+{
+    *comp = Natron::ImageComponentRGBA;
+    *depth = IMAGE_BYTE;
+}
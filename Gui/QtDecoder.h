@@ -19,6 +19,9 @@
 CLANG_DIAG_OFF(deprecated)
 CLANG_DIAG_OFF(uninitialized)
 #include <QtCore/QMutex>
+#include <QtCore/QSize>
+#include <QtCore/QDateTime>
+#include <QtGui/QImage>
 CLANG_DIAG_ON(deprecated)
 CLANG_DIAG_ON(uninitialized)
 
@@ -30,6 +33,35 @@ namespace Natron {
     }
 }
 
+/**
+ * @brief The last image decoded by a QtReader. QImageReader can only decode a whole file: renders of other parts
+ * of the same frame (viewer pans, tiles) convert the image kept here rather than decoding the file again.
+ **/
+class QtDecodedFrame
+{
+public:
+
+    QtDecodedFrame();
+
+    ///Returns the time the file was last modified, to pass to set() before decoding it
+    static QDateTime lastModified(const std::string& filename);
+
+    ///Returns the image kept if it is the one of filename as it is on disk now, a null image otherwise
+    QImage find(const std::string& filename) const;
+
+    ///Keeps img as the image of filename, decoded when it was last modified at the given time
+    void set(const std::string& filename,const QDateTime& modified,const QImage& img);
+
+    void clear();
+
+private:
+
+    mutable QMutex _lock;
+    std::string _filename;
+    QDateTime _lastModified;
+    QImage _image;
+};
+
 class File_Knob;
 class Choice_Knob;
 class Int_Knob;
@@ -92,6 +124,9 @@ public:
     virtual void addAcceptedComponents(int inputNb,std::list<Natron::ImageComponents>* comps) OVERRIDE FINAL;
 
     virtual void addSupportedBitDepth(std::list<Natron::ImageBitDepth>* depths) const OVERRIDE FINAL;
+    
+    ///QImage only decodes 8-bit images: don't convert them to float unless downstream asks for it
+    virtual void getPreferredDepthAndComponents(int inputNb,Natron::ImageComponents* comp,Natron::ImageBitDepth* depth) const OVERRIDE FINAL;
 
 private:
 
@@ -107,9 +142,10 @@ private:
 
 
     const Natron::Color::Lut* _lut;
-    std::string _filename;
-    QImage* _img;
-    QMutex _lock;
+    std::string _filename; //< the last file whose size was read
+    QSize _imageSize; //< the size of _filename
+    QMutex _lock; //< protects _filename and _imageSize
+    QtDecodedFrame _decodedFrame; //< the last frame decoded for a partial render
     boost::shared_ptr<File_Knob> _fileKnob;
     boost::shared_ptr<Int_Knob> _firstFrame;
     boost::shared_ptr<Choice_Knob> _before;
@@ -0,0 +1,405 @@
+//  Natron
+//
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <vector>
+#include <gtest/gtest.h>
+
+#include <QtCore/QDir>
+#include <QtCore/QFile>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QThread>
+
+#include "Engine/CacheCompression.h"
+#include "Engine/Cache.h"
+#include "Engine/FrameEntry.h"
+#include "Engine/FrameParams.h"
+#include "CacheTestHelpers.h"
+
+using namespace Natron;
+
+namespace {
+
+///A square 32 bits floating point texture
+FrameKey
+makeFloatFrameKey(int time,int size)
+{
+    return makeFrameKey(time,size,2);
+}
+
+///A smooth RGBA float image with a bit of noise, which is what renders look like to the codec
+void
+fillFloatImage(float* pixels,
+               int width,
+               int height,
+               int seed)
+{
+    unsigned int noise = (unsigned int)seed + 1;
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            noise = noise * 1103515245 + 12345;
+            float* p = pixels + 4 * (y * width + x);
+            float grain = ((noise >> 16) & 0xff) / 65536.f;
+            p[0] = (float)x / width + grain + seed * 0.01f;
+            p[1] = (float)y / height + grain;
+            p[2] = 0.5f + 0.25f * std::sin(x * 0.05f + seed);
+            p[3] = 1.f;
+        }
+    }
+}
+
+///A 8 bits RGBA gradient
+void
+fillByteImage(U8* pixels,
+              int width,
+              int height)
+{
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            U8* p = pixels + 4 * (y * width + x);
+            p[0] = (U8)(x * 255 / width);
+            p[1] = (U8)(y * 255 / height);
+            p[2] = (U8)((x + y) / 4);
+            p[3] = 255;
+        }
+    }
+}
+
+/**
+ * @brief Fills the cache with the given number of float frames and waits until their files are compressed.
+ * The first frames are moved to the disk portion since the memory portion holds only a fourth of the cache.
+ **/
+void
+fillCache(TestViewerCache* cache,
+          int framesCount,
+          int size,
+          const boost::shared_ptr<const NonKeyParams>& params)
+{
+    for (int i = 0; i < framesCount; ++i) {
+        boost::shared_ptr<FrameEntry> entry;
+        ASSERT_FALSE(cache->getOrCreate(makeFloatFrameKey(i,size),params,&entry));
+        ASSERT_TRUE(entry && entry->isStoredOnDisk());
+        fillFloatImage((float*)entry->data(),size,size,i);
+    }
+    cache->waitForPendingIO();
+}
+
+///Looks-up a frame, keeping what it found until it is destroyed
+class LookUpThread : public QThread
+{
+public:
+
+    LookUpThread(TestViewerCache* cache,const FrameKey& key)
+    : QThread()
+    , _cache(cache)
+    , _key(key)
+    , found(false)
+    , entry()
+    {
+    }
+
+private:
+
+    virtual void run()
+    {
+        boost::shared_ptr<const NonKeyParams> cachedParams;
+        found = _cache->get(_key,&cachedParams,&entry);
+    }
+
+    TestViewerCache* _cache;
+    FrameKey _key;
+
+public:
+
+    bool found;
+    boost::shared_ptr<FrameEntry> entry;
+};
+
+} // anon namespace
+
+TEST(CacheCompression,HalfFloat) {
+    EXPECT_EQ((U16)0x0000,CacheCompression::floatToHalf(0.f));
+    EXPECT_EQ((U16)0x8000,CacheCompression::floatToHalf(-0.f));
+    EXPECT_EQ((U16)0x3c00,CacheCompression::floatToHalf(1.f));
+    EXPECT_EQ((U16)0xc000,CacheCompression::floatToHalf(-2.f));
+    EXPECT_EQ((U16)0x7bff,CacheCompression::floatToHalf(65504.f));
+    ///overflows and infinities
+    EXPECT_EQ((U16)0x7c00,CacheCompression::floatToHalf(65520.f));
+    EXPECT_EQ((U16)0x7c00,CacheCompression::floatToHalf(1e10f));
+    EXPECT_EQ((U16)0xfc00,CacheCompression::floatToHalf(-std::numeric_limits<float>::infinity()));
+    ///smallest denormal, and what rounds to zero
+    EXPECT_EQ((U16)0x0001,CacheCompression::floatToHalf(std::ldexp(1.f,-24)));
+    EXPECT_EQ((U16)0x0000,CacheCompression::floatToHalf(std::ldexp(1.f,-26)));
+    ///round to nearest even: 1 + 2^-11 is halfway between 1 and the next half
+    EXPECT_EQ((U16)0x3c00,CacheCompression::floatToHalf(1.f + std::ldexp(1.f,-11)));
+    EXPECT_EQ((U16)0x3c02,CacheCompression::floatToHalf(1.f + 3 * std::ldexp(1.f,-11)));
+    U16 nan = CacheCompression::floatToHalf(std::numeric_limits<float>::quiet_NaN());
+    EXPECT_EQ((U16)0x7c00,(U16)(nan & 0x7c00));
+    EXPECT_NE((U16)0,(U16)(nan & 0x3ff));
+
+    ///all the halves but the NaNs go through floats unchanged
+    for (U32 h = 0; h < 0x10000; ++h) {
+        if ((h & 0x7c00) == 0x7c00 && (h & 0x3ff)) {
+            EXPECT_TRUE(CacheCompression::halfToFloat((U16)h) != CacheCompression::halfToFloat((U16)h));
+            continue;
+        }
+        ASSERT_EQ((U16)h,CacheCompression::floatToHalf(CacheCompression::halfToFloat((U16)h))) << "half " << h;
+    }
+}
+
+TEST(CacheCompression,ShuffleRoundTrip) {
+    std::vector<U8> src(4 * 1000 + 3);
+    for (std::size_t i = 0; i < src.size(); ++i) {
+        src[i] = (U8)(i * 7);
+    }
+    int elementSizes[4] = { 1, 2, 3, 4 };
+    for (int e = 0; e < 4; ++e) {
+        std::vector<U8> shuffled(src.size()),unshuffled(src.size());
+        CacheCompression::shuffle(&src[0],src.size(),elementSizes[e],&shuffled[0]);
+        CacheCompression::unshuffle(&shuffled[0],src.size(),elementSizes[e],&unshuffled[0]);
+        EXPECT_TRUE(unshuffled == src) << "element size " << elementSizes[e];
+    }
+    ///the first bytes of the elements come first
+    std::vector<U8> shuffled(src.size());
+    CacheCompression::shuffle(&src[0],src.size(),4,&shuffled[0]);
+    EXPECT_EQ(src[4],shuffled[1]);
+    EXPECT_EQ(src[1],shuffled[1000]);
+}
+
+TEST(CacheCompression,LosslessRoundTrip) {
+    ///more than a chunk, with a partial last chunk
+    const int width = 1100,height = 1000;
+    std::vector<float> floats(4 * width * height);
+    fillFloatImage(&floats[0],width,height,3);
+    const std::size_t floatsSize = floats.size() * sizeof(float);
+    std::vector<char> compressed;
+    ASSERT_TRUE(CacheCompression::compress(&floats[0],floatsSize,sizeof(float),false,&compressed));
+    EXPECT_LT(compressed.size(),floatsSize);
+    U64 dataSize = 0;
+    ASSERT_TRUE(CacheCompression::readHeader(&compressed[0],compressed.size(),&dataSize));
+    EXPECT_EQ((U64)floatsSize,dataSize);
+    std::vector<float> decompressed(floats.size());
+    ASSERT_TRUE(CacheCompression::decompress(&compressed[0],compressed.size(),&decompressed[0],floatsSize));
+    EXPECT_TRUE(std::memcmp(&floats[0],&decompressed[0],floatsSize) == 0);
+
+    std::vector<U8> bytes(4 * width * height);
+    fillByteImage(&bytes[0],width,height);
+    ASSERT_TRUE(CacheCompression::compress(&bytes[0],bytes.size(),4,false,&compressed));
+    EXPECT_LT(compressed.size(),bytes.size() / 4);
+    std::vector<U8> decompressedBytes(bytes.size());
+    ASSERT_TRUE(CacheCompression::decompress(&compressed[0],compressed.size(),&decompressedBytes[0],bytes.size()));
+    EXPECT_TRUE(decompressedBytes == bytes);
+
+    ///half floats: at most half an ulp of error, 2^-11 relative
+    ASSERT_TRUE(CacheCompression::compress(&floats[0],floatsSize,sizeof(float),true,&compressed));
+    EXPECT_LT(compressed.size(),floatsSize / 2);
+    ASSERT_TRUE(CacheCompression::decompress(&compressed[0],compressed.size(),&decompressed[0],floatsSize));
+    for (std::size_t i = 0; i < floats.size(); ++i) {
+        ASSERT_NEAR(floats[i],decompressed[i],std::fabs(floats[i]) / 2048.f) << "float " << i;
+    }
+}
+
+TEST(CacheCompression,CorruptedBufferIsRejected) {
+    std::vector<U8> bytes(4 * 256 * 256);
+    fillByteImage(&bytes[0],256,256);
+    std::vector<char> compressed;
+    ASSERT_TRUE(CacheCompression::compress(&bytes[0],bytes.size(),4,false,&compressed));
+    std::vector<U8> decompressed(bytes.size());
+
+    ///the raw data of an entry isn't taken for a compressed buffer
+    U64 dataSize;
+    EXPECT_FALSE(CacheCompression::readHeader(&bytes[0],bytes.size(),&dataSize));
+    ///truncated
+    EXPECT_FALSE(CacheCompression::decompress(&compressed[0],compressed.size() - 1,&decompressed[0],bytes.size()));
+    ///wrong size
+    EXPECT_FALSE(CacheCompression::decompress(&compressed[0],compressed.size(),&decompressed[0],bytes.size() - 4));
+    ///a flipped bit in the deflated data
+    std::vector<char> corrupted = compressed;
+    corrupted[corrupted.size() / 2] ^= 0x10;
+    EXPECT_FALSE(CacheCompression::decompress(&corrupted[0],corrupted.size(),&decompressed[0],bytes.size()));
+}
+
+///Entries moved to the disk portion are compressed by the I/O thread, counted for their compressed size, and
+///decompressed when they are looked-up again.
+TEST(CacheCompression,CacheCompressesItsDiskPortion) {
+    const int framesCount = 16;
+    const int size = 64;
+    boost::shared_ptr<const NonKeyParams> params = FrameEntry::makeParams(RectI(0,0,size,size),2,size,size);
+    const U64 frameSize = params->getElementsCount();
+    TestViewerCache cache("CacheCompressionTest",1,framesCount * frameSize,0.25);
+    createCacheFolders(cache);
+    QFile::remove(cache.getJournalFilePath().c_str());
+    cache.restoreFromJournal();
+    cache.setDiskCompression(CACHE_COMPRESSION_LOSSLESS);
+    EXPECT_EQ(1.,cache.getDiskCompressionRatio());
+
+    fillCache(&cache,framesCount,size,params);
+    ///the memory portion holds 4 frames, the 12 others are on disk
+    EXPECT_LT(cache.getDiskCompressionRatio(),1.);
+    EXPECT_LE(cache.getMemoryCacheSize(),4 * frameSize);
+    EXPECT_LT(cache.getDiskCacheSize(),12 * frameSize * NATRON_CACHE_COMPRESSION_MAX_RATIO);
+    std::string cachePath = QString(cache.getCachePath() + QDir::separator()).toStdString();
+    U64 dataSize = 0,fileSize = 0;
+    EXPECT_TRUE(CacheCompression::isCompressedFile(FrameEntry::generateStringFromHash(cachePath,makeFloatFrameKey(0,size).getHash()),
+                                                   &dataSize,&fileSize));
+    EXPECT_EQ(frameSize,dataSize);
+    EXPECT_LT(fileSize,frameSize);
+
+    std::vector<float> expected(frameSize / sizeof(float));
+    for (int i = 0; i < framesCount; ++i) {
+        boost::shared_ptr<FrameEntry> entry;
+        boost::shared_ptr<const NonKeyParams> cachedParams;
+        ASSERT_TRUE(cache.get(makeFloatFrameKey(i,size),&cachedParams,&entry)) << "frame " << i;
+        EXPECT_FALSE(entry->isCompressed());
+        fillFloatImage(&expected[0],size,size,i);
+        EXPECT_TRUE(std::memcmp(&expected[0],entry->data(),frameSize) == 0) << "frame " << i;
+    }
+    cache.clear();
+}
+
+///The look-ups of a frame being decompressed, out of the lock of its shard, wait for it instead of
+///reading the file again.
+TEST(CacheCompression,ConcurrentLookUpsOfACompressedFrame) {
+    const int framesCount = 16;
+    const int size = 64;
+    const int threadsCount = 8;
+    boost::shared_ptr<const NonKeyParams> params = FrameEntry::makeParams(RectI(0,0,size,size),2,size,size);
+    const U64 frameSize = params->getElementsCount();
+    TestViewerCache cache("CacheCompressionTest",1,framesCount * frameSize,0.25);
+    createCacheFolders(cache);
+    QFile::remove(cache.getJournalFilePath().c_str());
+    cache.restoreFromJournal();
+    cache.setDiskCompression(CACHE_COMPRESSION_LOSSLESS);
+    fillCache(&cache,framesCount,size,params);
+
+    std::vector<float> expected(frameSize / sizeof(float));
+    fillFloatImage(&expected[0],size,size,0);
+    std::vector<LookUpThread*> threads;
+    for (int i = 0; i < threadsCount; ++i) {
+        threads.push_back(new LookUpThread(&cache,makeFloatFrameKey(0,size)));
+    }
+    for (int i = 0; i < threadsCount; ++i) {
+        threads[i]->start();
+    }
+    for (int i = 0; i < threadsCount; ++i) {
+        threads[i]->wait();
+        ASSERT_TRUE(threads[i]->found) << "thread " << i;
+        EXPECT_EQ(threads[0]->entry,threads[i]->entry) << "thread " << i;
+        EXPECT_FALSE(threads[i]->entry->isCompressed());
+        EXPECT_TRUE(std::memcmp(&expected[0],threads[i]->entry->data(),frameSize) == 0) << "thread " << i;
+    }
+    for (int i = 0; i < threadsCount; ++i) {
+        delete threads[i];
+    }
+    cache.clear();
+}
+
+TEST(CacheCompression,HalfFloatViewerTextures) {
+    const int framesCount = 8;
+    const int size = 64;
+    boost::shared_ptr<const NonKeyParams> params = FrameEntry::makeParams(RectI(0,0,size,size),2,size,size);
+    const U64 frameSize = params->getElementsCount();
+    TestViewerCache cache("CacheCompressionTest",1,framesCount * frameSize,0.25);
+    createCacheFolders(cache);
+    QFile::remove(cache.getJournalFilePath().c_str());
+    cache.restoreFromJournal();
+    cache.setDiskCompression(CACHE_COMPRESSION_HALF_FLOAT);
+
+    fillCache(&cache,framesCount,size,params);
+    EXPECT_LT(cache.getDiskCompressionRatio(),0.5);
+
+    std::vector<float> expected(frameSize / sizeof(float));
+    for (int i = 0; i < framesCount; ++i) {
+        boost::shared_ptr<FrameEntry> entry;
+        boost::shared_ptr<const NonKeyParams> cachedParams;
+        ASSERT_TRUE(cache.get(makeFloatFrameKey(i,size),&cachedParams,&entry)) << "frame " << i;
+        fillFloatImage(&expected[0],size,size,i);
+        const float* pixels = (const float*)entry->data();
+        for (std::size_t j = 0; j < expected.size(); ++j) {
+            ASSERT_NEAR(expected[j],pixels[j],std::fabs(expected[j]) / 2048.f) << "frame " << i << ", float " << j;
+        }
+    }
+    cache.clear();
+}
+
+///The journal records the size and checksum of the compressed files, which are decompressed on the first look-up
+///after a restart.
+TEST(CacheCompression,CacheRestoresCompressedFiles) {
+    const int framesCount = 8;
+    const int size = 64;
+    boost::shared_ptr<const NonKeyParams> params = FrameEntry::makeParams(RectI(0,0,size,size),2,size,size);
+    const U64 frameSize = params->getElementsCount();
+    std::string cachePath;
+    U64 diskSize;
+    {
+        TestViewerCache cache("CacheCompressionTest",1,framesCount * frameSize,0.25);
+        cachePath = QString(cache.getCachePath() + QDir::separator()).toStdString();
+        createCacheFolders(cache);
+        QFile::remove(cache.getJournalFilePath().c_str());
+        cache.restoreFromJournal();
+        cache.setDiskCompression(CACHE_COMPRESSION_LOSSLESS);
+        fillCache(&cache,framesCount,size,params);
+        cache.save();
+        diskSize = cache.getDiskCacheSize();
+        EXPECT_LT(diskSize,framesCount * frameSize);
+    }
+
+    ///corrupt the compressed file of an entry
+    std::string corruptedFile = FrameEntry::generateStringFromHash(cachePath,makeFloatFrameKey(5,size).getHash());
+    U64 dataSize = 0,fileSize = 0;
+    ASSERT_TRUE(CacheCompression::isCompressedFile(corruptedFile,&dataSize,&fileSize));
+    std::FILE* file = std::fopen(corruptedFile.c_str(),"r+b");
+    ASSERT_TRUE(file != NULL);
+    std::fseek(file,(long)fileSize / 2,SEEK_SET);
+    std::fputc(0x5a,file);
+    std::fclose(file);
+
+    TestViewerCache cache("CacheCompressionTest",1,framesCount * frameSize,0.25);
+    cache.restoreFromJournal();
+    EXPECT_EQ(diskSize,cache.getDiskCacheSize());
+    std::vector<float> expected(frameSize / sizeof(float));
+    for (int i = 0; i < framesCount; ++i) {
+        boost::shared_ptr<FrameEntry> entry;
+        boost::shared_ptr<const NonKeyParams> cachedParams;
+        bool found = cache.get(makeFloatFrameKey(i,size),&cachedParams,&entry);
+        if (i == 5) {
+            EXPECT_FALSE(found) << "A corrupted entry must not be restored.";
+            cache.waitForPendingIO();
+            EXPECT_FALSE(QFile::exists(corruptedFile.c_str()));
+        } else {
+            ASSERT_TRUE(found) << "frame " << i;
+            fillFloatImage(&expected[0],size,size,i);
+            EXPECT_TRUE(std::memcmp(&expected[0],entry->data(),frameSize) == 0) << "frame " << i;
+        }
+    }
+    cache.clear();
+}
+
+///Not really a test: prints the ratio and throughput of the codec on 1080p float textures.
+TEST(CacheCompression,DISABLED_Benchmark) {
+    const int width = 1920,height = 1080;
+    std::vector<float> floats(4 * width * height);
+    fillFloatImage(&floats[0],width,height,0);
+    const std::size_t size = floats.size() * sizeof(float);
+    std::vector<float> decompressed(floats.size());
+    std::vector<char> compressed;
+    for (int half = 0; half < 2; ++half) {
+        QElapsedTimer timer;
+        timer.start();
+        ASSERT_TRUE(CacheCompression::compress(&floats[0],size,sizeof(float),half != 0,&compressed));
+        qint64 compressTime = std::max((qint64)1,timer.restart());
+        ASSERT_TRUE(CacheCompression::decompress(&compressed[0],compressed.size(),&decompressed[0],size));
+        qint64 decompressTime = std::max((qint64)1,timer.elapsed());
+        double mb = size / (1024. * 1024.);
+        std::cout << "[CacheCompression] " << (half ? "half float" : "lossless") << ": ratio "
+        << (double)compressed.size() / size << ", compression " << mb * 1000. / compressTime << " MB/s, decompression "
+        << mb * 1000. / decompressTime << " MB/s" << std::endl;
+    }
+}
@@ -0,0 +1,315 @@
+//  Natron
+//
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <gtest/gtest.h>
+
+#include <boost/shared_ptr.hpp>
+
+#include "Engine/LRUHashTable.h"
+
+namespace {
+
+///Number of calls to TestValue::use_count(), i.e: of values the tables looked at
+U64 useCountCalls = 0;
+
+///What a cache entry exposes to the eviction policies. Copies share their data, as the shared pointers held
+///by the cache do.
+class TestValue
+{
+    struct Data
+    {
+        U64 lastAccess;
+        U64 size;
+        double cost;
+    };
+
+public:
+
+    TestValue() : _data() {}
+
+    TestValue(U64 size,double cost)
+    : _data(new Data)
+    {
+        _data->lastAccess = 0;
+        _data->size = size;
+        _data->cost = cost;
+    }
+
+    bool isNull() const { return !_data; }
+
+    long use_count() const { ++useCountCalls; return _data.use_count(); }
+
+    U64 getLastAccess() const { return _data->lastAccess; }
+
+    void setLastAccess(U64 clock) { _data->lastAccess = clock; }
+
+    U64 getSize() const { return _data->size; }
+
+    double getComputeCost() const { return _data->cost; }
+
+    void setComputeCost(double cost) { _data->cost = cost; }
+
+private:
+
+    boost::shared_ptr<Data> _data;
+};
+
+typedef EvictionHashTable<U64,TestValue,LRUEvictionPolicy> LRUTable;
+typedef EvictionHashTable<U64,TestValue,GreedyDualSizeEvictionPolicy> GDSTable;
+
+/**
+ * @brief An access of a replayed trace: the key looked-up and, for a miss, the size and render time (in ms) of
+ * the entry to insert.
+ **/
+struct TraceAccess
+{
+    U64 key;
+    U64 size;
+    double cost;
+};
+
+/**
+ * @brief Simulates a comp session on a node graph of the given number of nodes: the user scrubs back and forth
+ * over a range of frames, each frame looking-up the image of every node. Every now and then a parameter of a
+ * node changes, which changes the keys of the node and of all the nodes downstream.
+ * The readers at the top of the graph are cheap and large (full plates), the filters downstream are expensive.
+ **/
+void
+makeCompTrace(int nodesCount,
+              int framesCount,
+              int accessesCount,
+              unsigned int seed,
+              std::vector<TraceAccess>* trace)
+{
+    std::vector<U64> nodeVersions(nodesCount,0);
+    std::vector<U64> sizes(nodesCount);
+    std::vector<double> costs(nodesCount);
+    for (int n = 0; n < nodesCount; ++n) {
+        seed = seed * 1103515245 + 12345;
+        bool isReader = (n % 4) == 0;
+        sizes[n] = isReader ? 32 * 1024 * 1024 : (4 + (seed >> 16) % 8) * 1024 * 1024;
+        costs[n] = isReader ? 10. : 20. + (double)((seed >> 8) % 400);
+    }
+    int frame = 0;
+    int direction = 1;
+    trace->clear();
+    while ((int)trace->size() < accessesCount) {
+        seed = seed * 1103515245 + 12345;
+        unsigned int r = (seed >> 16) % 100;
+        if (r < 2) {
+            ///a parameter changed: new keys for the node and everything downstream
+            int changed = (seed >> 8) % nodesCount;
+            for (int n = changed; n < nodesCount; ++n) {
+                ++nodeVersions[n];
+            }
+        } else if (r < 10) {
+            direction = -direction;
+        }
+        frame = std::max(0,std::min(framesCount - 1,frame + direction));
+        for (int n = 0; n < nodesCount; ++n) {
+            TraceAccess access;
+            access.key = ((U64)n << 48) | (nodeVersions[n] << 24) | (U64)frame;
+            access.size = sizes[n];
+            access.cost = costs[n];
+            trace->push_back(access);
+        }
+    }
+}
+
+/**
+ * @brief Replays the trace on a table limited to maxSize bytes. Returns the hit rate and in savedCost the
+ * fraction of the render time of the trace that the hits saved.
+ **/
+template<typename TableType>
+double
+replayTrace(const std::vector<TraceAccess>& trace,
+            U64 maxSize,
+            double* savedCost)
+{
+    TableType table;
+    U64 size = 0;
+    U64 clock = 0;
+    U64 hits = 0;
+    double totalCost = 0.,hitsCost = 0.;
+    for (std::vector<TraceAccess>::const_iterator it = trace.begin(); it != trace.end(); ++it) {
+        ++clock;
+        totalCost += it->cost;
+        typename TableType::iterator found = table(it->key);
+        if (found != table.end()) {
+            ++hits;
+            hitsCost += it->cost;
+            TableType::getValues(found).front().setLastAccess(clock);
+            continue;
+        }
+        TestValue value(it->size,it->cost);
+        value.setLastAccess(clock);
+        table.insert(it->key,value);
+        size += it->size;
+        while (size > maxSize) {
+            std::pair<U64,TestValue> evicted = table.evict();
+            if (evicted.second.isNull()) {
+                break;
+            }
+            size -= evicted.second.getSize();
+        }
+    }
+    *savedCost = totalCost > 0. ? hitsCost / totalCost : 0.;
+    return trace.empty() ? 0. : (double)hits / trace.size();
+}
+
+} // anon namespace
+
+TEST(EvictionHashTable,LRUOrder) {
+    LRUTable table;
+    for (U64 i = 0; i < 5; ++i) {
+        table.insert(i,TestValue(1024,0.));
+    }
+    ///look-ups move the key to the end, find() doesn't
+    EXPECT_TRUE(table(0) != table.end());
+    EXPECT_TRUE(table.find(1) != table.end());
+
+    U64 expected[5] = { 1, 2, 3, 4, 0 };
+    for (int i = 0; i < 5; ++i) {
+        std::pair<U64,TestValue> evicted = table.evict();
+        ASSERT_FALSE(evicted.second.isNull());
+        EXPECT_EQ(expected[i],evicted.first);
+    }
+    EXPECT_EQ(0u,table.size());
+    EXPECT_TRUE(table.evict().second.isNull());
+}
+
+TEST(EvictionHashTable,PinnedEntriesAreSkipped) {
+    LRUTable table;
+    std::vector<TestValue> inUse;
+    for (U64 i = 0; i < 10; ++i) {
+        TestValue value(1024,0.);
+        table.insert(i,value);
+        if (i < 5) {
+            inUse.push_back(value);
+        }
+    }
+
+    ///the 5 oldest keys are in use: they are pinned by the first eviction and not scanned again
+    std::pair<U64,TestValue> evicted = table.evict();
+    EXPECT_EQ(5u,evicted.first);
+    EXPECT_EQ(5u,table.getPinnedCount());
+    evicted = table.evict();
+    EXPECT_EQ(6u,evicted.first);
+    EXPECT_EQ(5u,table.getPinnedCount());
+
+    ///a look-up unpins the key
+    EXPECT_TRUE(table(0) != table.end());
+    EXPECT_EQ(4u,table.getPinnedCount());
+
+    ///released keys are evicted once the remaining ones are gone
+    inUse.clear();
+    std::vector<U64> order;
+    for (;;) {
+        evicted = table.evict();
+        if (evicted.second.isNull()) {
+            break;
+        }
+        order.push_back(evicted.first);
+    }
+    EXPECT_EQ(8u,order.size());
+    EXPECT_EQ(0u,table.size());
+    EXPECT_EQ(0u,table.getPinnedCount());
+
+    ///nothing can be evicted while everything is in use
+    TestValue value(1024,0.);
+    table.insert(42,value);
+    EXPECT_TRUE(table.evict().second.isNull());
+    EXPECT_EQ(1u,table.getPinnedCount());
+    double rank;
+    EXPECT_FALSE(table.getNextVictimRank(0,&rank));
+}
+
+TEST(EvictionHashTable,ProbingPinnedEntriesIsAmortized) {
+    ///the cache probes the tables of all its shards to find the next entry to evict: while all the entries
+    ///are in use, the probes must not scan all of them every time
+    const U64 keysCount = 1000;
+    LRUTable table;
+    std::vector<TestValue> inUse;
+    for (U64 i = 0; i < keysCount; ++i) {
+        TestValue value(1024,0.);
+        table.insert(i,value);
+        inUse.push_back(value);
+    }
+    double rank;
+    useCountCalls = 0;
+    const int probesCount = 10 * keysCount;
+    for (int i = 0; i < probesCount; ++i) {
+        EXPECT_FALSE(table.getNextVictimRank(0,&rank));
+    }
+    EXPECT_EQ(keysCount,table.getPinnedCount());
+    ///pinning, then one scan of the pinned keys per keysCount probes
+    EXPECT_LE(useCountCalls,(U64)(2 + probesCount / keysCount) * keysCount);
+
+    ///a released entry is found by a later probe
+    inUse[keysCount / 2] = TestValue();
+    bool found = false;
+    for (U64 i = 0; i <= keysCount && !found; ++i) {
+        found = table.getNextVictimRank(0,&rank);
+    }
+    EXPECT_TRUE(found);
+    EXPECT_EQ(keysCount / 2,table.evict().first);
+}
+
+TEST(EvictionHashTable,GreedyDualSizeKeepsExpensiveEntries) {
+    GDSTable table;
+    table.insert(0,TestValue(1024 * 1024,500.));
+    ///cheaper per byte: smaller cost, or same cost and larger size
+    table.insert(1,TestValue(1024 * 1024,10.));
+    table.insert(2,TestValue(16 * 1024 * 1024,500.));
+    ///the cost is usually known after the insertion
+    TestValue rendered(1024 * 1024,0.);
+    table.insert(3,rendered);
+    rendered.setComputeCost(1000.);
+    rendered = TestValue();
+
+    EXPECT_EQ(1u,table.evict().first);
+    EXPECT_EQ(2u,table.evict().first);
+    EXPECT_EQ(0u,table.evict().first);
+    EXPECT_EQ(3u,table.evict().first);
+}
+
+TEST(EvictionHashTable,GreedyDualSizeAges) {
+    GDSTable table;
+    table.insert(0,TestValue(1024 * 1024,100.));
+    ///the inflation grows with each eviction: cheap entries used recently end up above expensive unused ones
+    for (U64 i = 1; i < 100; ++i) {
+        table.insert(i,TestValue(1024 * 1024,10.));
+        if (i > 1) {
+            table.evict();
+        }
+    }
+    EXPECT_TRUE(table.find(0) == table.end());
+    EXPECT_TRUE(table.find(99) != table.end());
+}
+
+///Not really a test: replays synthetic traces of comp sessions and prints for each policy the hit rate and the
+///fraction of the render time saved by the hits, for several cache sizes.
+TEST(EvictionHashTable,DISABLED_ReplayBenchmark) {
+    const int nodesCount = 12;
+    const int framesCount = 100;
+    std::vector<TraceAccess> trace;
+    makeCompTrace(nodesCount,framesCount,500000,1,&trace);
+
+    U64 sizesMB[3] = { 512, 2048, 8192 };
+    for (int i = 0; i < 3; ++i) {
+        U64 maxSize = sizesMB[i] * 1024 * 1024;
+        double lruSaved,gdsSaved;
+        double lruHits = replayTrace<LRUTable>(trace,maxSize,&lruSaved);
+        double gdsHits = replayTrace<GDSTable>(trace,maxSize,&gdsSaved);
+        std::cout << "[EvictionPolicy] " << sizesMB[i] << " MB, " << trace.size() << " accesses: LRU hit-rate "
+        << lruHits * 100. << "% (render time saved " << lruSaved * 100. << "%), GreedyDual-Size hit-rate "
+        << gdsHits * 100. << "% (render time saved " << gdsSaved * 100. << "%)" << std::endl;
+        EXPECT_GT(gdsSaved,0.);
+    }
+}
@@ -0,0 +1,234 @@
+//  Natron
+//
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <iostream>
+#include <vector>
+#include <gtest/gtest.h>
+
+#include <QtCore/QAtomicInt>
+#include <QtCore/QThread>
+#include <QtCore/QDir>
+#include <QtCore/QFile>
+#include <QtCore/QElapsedTimer>
+
+#ifndef Q_MOC_RUN
+#include <boost/bind.hpp>
+#endif
+
+#include "Engine/CacheIOQueue.h"
+#include "Engine/LatencyHistogram.h"
+#include "Engine/Cache.h"
+#include "Engine/FrameEntry.h"
+#include "Engine/FrameParams.h"
+#include "CacheTestHelpers.h"
+
+using namespace Natron;
+
+namespace {
+
+void
+appendIndex(std::vector<int>* indexes,
+            int index)
+{
+    indexes->push_back(index);
+}
+
+void
+countingJob(QAtomicInt* counter)
+{
+    counter->ref();
+}
+
+///Blocks the I/O thread until the gate is opened
+void
+gateJob(QAtomicInt* started,
+        QAtomicInt* open)
+{
+    started->ref();
+    while ((int)*open == 0) {
+        QThread::msleep(1);
+    }
+}
+
+class PushThread : public QThread
+{
+public:
+
+    PushThread(CacheIOQueue* queue,int jobsCount,QAtomicInt* pushed,QAtomicInt* ran)
+    : QThread()
+    , _queue(queue)
+    , _jobsCount(jobsCount)
+    , _pushed(pushed)
+    , _ran(ran)
+    {
+    }
+
+private:
+
+    virtual void run()
+    {
+        for (int i = 0; i < _jobsCount; ++i) {
+            _queue->push(boost::bind(&countingJob,_ran));
+            _pushed->ref();
+        }
+    }
+
+    CacheIOQueue* _queue;
+    int _jobsCount;
+    QAtomicInt* _pushed;
+    QAtomicInt* _ran;
+};
+
+} // anon namespace
+
+TEST(LatencyHistogram,Percentiles) {
+    LatencyHistogram histogram;
+    EXPECT_EQ((U64)0,histogram.getCount());
+    EXPECT_EQ(0.,histogram.getPercentile(0.5));
+
+    EXPECT_EQ(0,LatencyHistogram::getBucketIndex(999));
+    EXPECT_EQ(1,LatencyHistogram::getBucketIndex(1000));
+    EXPECT_EQ(2,LatencyHistogram::getBucketIndex(3999));
+    EXPECT_EQ(NATRON_LATENCY_HISTOGRAM_BUCKETS_COUNT - 1,LatencyHistogram::getBucketIndex((qint64)1 << 62));
+
+    for (int i = 0; i < 90; ++i) {
+        histogram.record(3000);
+    }
+    for (int i = 0; i < 10; ++i) {
+        histogram.record(1000000);
+    }
+    EXPECT_EQ((U64)100,histogram.getCount());
+    EXPECT_EQ(4.,histogram.getPercentile(0.5));
+    EXPECT_EQ(4.,histogram.getPercentile(0.9));
+    EXPECT_EQ(1024.,histogram.getPercentile(0.99));
+    EXPECT_EQ(1024.,histogram.getPercentile(1.));
+
+    histogram.reset();
+    EXPECT_EQ((U64)0,histogram.getCount());
+}
+
+TEST(CacheIOQueue,RunsJobsInOrder) {
+    std::vector<int> indexes;
+    {
+        CacheIOQueue queue(8);
+        for (int i = 0; i < 1000; ++i) {
+            queue.push(boost::bind(&appendIndex,&indexes,i));
+        }
+        queue.waitForIdle();
+        EXPECT_EQ((std::size_t)0,queue.getPendingJobsCount());
+        EXPECT_EQ((U64)1000,queue.getJobLatency().getCount());
+        ///the destructor runs what is still queued
+        queue.push(boost::bind(&appendIndex,&indexes,1000));
+    }
+    ASSERT_EQ((std::size_t)1001,indexes.size());
+    for (int i = 0; i < 1001; ++i) {
+        EXPECT_EQ(i,indexes[i]);
+    }
+}
+
+TEST(CacheIOQueue,PushBlocksWhenFull) {
+    CacheIOQueue queue(2);
+    QAtomicInt started,open,pushed,ran;
+    queue.push(boost::bind(&gateJob,&started,&open));
+    while ((int)started == 0) {
+        QThread::msleep(1);
+    }
+    ///the I/O thread is stuck in the gate: 2 jobs fit in the queue, the third one must wait
+    PushThread pusher(&queue,3,&pushed,&ran);
+    pusher.start();
+    for (int i = 0; i < 1000 && (int)pushed < 2; ++i) {
+        QThread::msleep(1);
+    }
+    QThread::msleep(50);
+    EXPECT_EQ(2,(int)pushed);
+    EXPECT_EQ((std::size_t)3,queue.getPendingJobsCount());
+
+    open.ref();
+    pusher.wait();
+    queue.waitForIdle();
+    EXPECT_EQ(3,(int)pushed);
+    EXPECT_EQ(3,(int)ran);
+}
+
+///Entries evicted from memory are looked-up again while their write-back may still be pending, and evicted from
+///the disk portion while their file may still be mapped.
+TEST(CacheIOQueue,CacheEvictsInTheBackground) {
+    const int entriesCount = 64;
+    const int memoryEntries = 4;
+    boost::shared_ptr<const NonKeyParams> params = FrameEntry::makeParams(RectI(0,0,32,32),0,32,32);
+    const U64 entrySize = params->getElementsCount();
+    TestViewerCache cache("CacheIOQueueTest",1,4 * memoryEntries * entrySize,0.25);
+    createCacheFolders(cache);
+    QFile::remove(cache.getJournalFilePath().c_str());
+    cache.restoreFromJournal();
+
+    for (int i = 0; i < entriesCount; ++i) {
+        {
+            boost::shared_ptr<FrameEntry> entry;
+            ASSERT_FALSE(cache.getOrCreate(makeFrameKey(i,32),params,&entry));
+            ASSERT_TRUE(entry && entry->isStoredOnDisk());
+            std::memset(entry->data(),i + 1,entrySize);
+        }
+        ///the entries evicted last are the most likely to be still waiting for the I/O thread
+        for (int j = std::max(0,i - 2 * memoryEntries); j < i; ++j) {
+            boost::shared_ptr<FrameEntry> entry;
+            boost::shared_ptr<const NonKeyParams> cachedParams;
+            if (cache.get(makeFrameKey(j,32),&cachedParams,&entry)) {
+                EXPECT_EQ((U8)(j + 1),entry->data()[0]) << "entry " << j;
+                EXPECT_EQ((U8)(j + 1),entry->data()[entrySize - 1]) << "entry " << j;
+            }
+        }
+    }
+    ///look-ups bring entries back in memory without making room
+    cache.clearExceedingEntries();
+    EXPECT_LE(cache.getMemoryCacheSize(),memoryEntries * entrySize);
+    EXPECT_LE(cache.getDiskCacheSize(),4 * memoryEntries * entrySize);
+    EXPECT_GT(cache.getEvictionLatency().getCount(),(U64)0);
+
+    cache.waitForPendingIO();
+    EXPECT_GT(cache.getWriteBackLatency().getCount(),(U64)0);
+    std::string cachePath = QString(cache.getCachePath() + QDir::separator()).toStdString();
+    int filesCount = 0;
+    for (int i = 0; i < entriesCount; ++i) {
+        if (QFile::exists(FrameEntry::generateStringFromHash(cachePath,makeFrameKey(i,32).getHash()).c_str())) {
+            ++filesCount;
+        }
+    }
+    ///the files of the entries evicted from the disk portion are deleted
+    EXPECT_LE((U64)filesCount * entrySize,cache.getMemoryCacheSize() + cache.getDiskCacheSize());
+    cache.clear();
+}
+
+///Not really a test: prints the latency of the evictions made by a thread filling the cache with 4 MB frames,
+///which move the oldest frames to disk and delete the frames falling out of the disk portion.
+TEST(CacheIOQueue,DISABLED_Benchmark) {
+    const int framesCount = 200;
+    const int size = 1024;
+    boost::shared_ptr<const NonKeyParams> params = FrameEntry::makeParams(RectI(0,0,size,size),0,size,size);
+    const U64 frameSize = params->getElementsCount();
+    TestViewerCache cache("CacheIOQueueTest",1,32 * frameSize,0.25);
+    createCacheFolders(cache);
+    QFile::remove(cache.getJournalFilePath().c_str());
+    cache.restoreFromJournal();
+
+    QElapsedTimer timer;
+    timer.start();
+    for (int i = 0; i < framesCount; ++i) {
+        boost::shared_ptr<FrameEntry> entry;
+        cache.getOrCreate(makeFrameKey(i,size),params,&entry);
+        std::memset(entry->data(),i,frameSize);
+    }
+    qint64 fillTime = timer.elapsed();
+    cache.waitForPendingIO();
+    std::cout << "[CacheIOQueue] " << framesCount << " frames of " << frameSize / 1024 / 1024 << " MB cached in "
+    << fillTime << " ms, I/O drained after " << timer.elapsed() << " ms" << std::endl;
+    std::cout << "[CacheIOQueue] eviction latency: " << cache.getEvictionLatency().toString() << std::endl;
+    std::cout << "[CacheIOQueue] write-back latency: " << cache.getWriteBackLatency().toString() << std::endl;
+    cache.clear();
+}
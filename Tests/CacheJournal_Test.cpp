@@ -0,0 +1,320 @@
+//  Natron
+//
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <vector>
+#include <gtest/gtest.h>
+
+#include <QtCore/QDir>
+#include <QtCore/QFile>
+#include <QtCore/QElapsedTimer>
+
+#include "Engine/CacheJournal.h"
+#include "Engine/Cache.h"
+#include "Engine/FrameEntry.h"
+#include "Engine/FrameParams.h"
+#include "CacheTestHelpers.h"
+
+using namespace Natron;
+
+namespace {
+
+std::string
+getJournalPath()
+{
+    return QString(QDir::tempPath() + QDir::separator() + "NatronCacheJournalTest.journal").toStdString();
+}
+
+CacheJournal::Record
+makeRecord(U64 hash)
+{
+    CacheJournal::Record record;
+    record.hash = hash;
+    record.dataSize = hash * 100;
+    record.dataChecksum = hash * 7;
+    record.key = std::string(20 + (size_t)(hash % 13),(char)('a' + hash % 26));
+    return record;
+}
+
+std::vector<char>
+readFile(const std::string& path)
+{
+    std::vector<char> content;
+    std::FILE* file = std::fopen(path.c_str(),"rb");
+    if (file) {
+        char c;
+        while (std::fread(&c,1,1,file) == 1) {
+            content.push_back(c);
+        }
+        std::fclose(file);
+    }
+    return content;
+}
+
+void
+writeFile(const std::string& path,
+          const std::vector<char>& content)
+{
+    std::FILE* file = std::fopen(path.c_str(),"wb");
+    ASSERT_TRUE(file != NULL);
+    if (!content.empty()) {
+        std::fwrite(&content[0],1,content.size(),file);
+    }
+    std::fclose(file);
+}
+
+///Journals entries 0..4 and discards entry 2, leaving the journal in getJournalPath()
+void
+writeSmallJournal()
+{
+    std::remove(getJournalPath().c_str());
+    CacheJournal journal(getJournalPath(),1);
+    std::vector<CacheJournal::Record> records;
+    std::vector<U64> discarded;
+    journal.open(&records,&discarded);
+    for (U64 i = 0; i < 5; ++i) {
+        journal.appendInsertion(makeRecord(i));
+    }
+    journal.appendDiscard(2,true);
+}
+
+}
+
+TEST(CacheJournal,Checksum) {
+    std::vector<unsigned char> data(1000);
+    for (U32 i = 0; i < data.size(); ++i) {
+        data[i] = (unsigned char)(i * 31 + 7);
+    }
+    EXPECT_EQ(CacheJournal::checksum(&data[0],data.size()),CacheJournal::checksum(&data[0],data.size()));
+    ///every length goes through a different tail
+    for (U32 size = 1; size < 70; ++size) {
+        EXPECT_NE(CacheJournal::checksum(&data[0],size),CacheJournal::checksum(&data[0],size - 1));
+    }
+    U64 before = CacheJournal::checksum(&data[0],data.size());
+    data[517] ^= 0x10;
+    EXPECT_NE(before,CacheJournal::checksum(&data[0],data.size()));
+}
+
+TEST(CacheJournal,ReplaysInsertionsAndDiscards) {
+    writeSmallJournal();
+    CacheJournal journal(getJournalPath(),1);
+    std::vector<CacheJournal::Record> records;
+    std::vector<U64> discarded;
+    EXPECT_TRUE(journal.open(&records,&discarded));
+    ASSERT_EQ((size_t)4,records.size());
+    const U64 expected[] = { 0, 1, 3, 4 };
+    for (U32 i = 0; i < records.size(); ++i) {
+        CacheJournal::Record record = makeRecord(expected[i]);
+        EXPECT_EQ(record.hash,records[i].hash);
+        EXPECT_EQ(record.dataSize,records[i].dataSize);
+        EXPECT_EQ(record.dataChecksum,records[i].dataChecksum);
+        EXPECT_EQ(record.key,records[i].key);
+    }
+    ASSERT_EQ((size_t)1,discarded.size());
+    EXPECT_EQ((U64)2,discarded[0]);
+
+    ///a newer insertion replaces the previous one, and moves the entry at the end
+    journal.appendInsertion(makeRecord(0));
+    records.clear();
+    discarded.clear();
+    CacheJournal reopened(getJournalPath(),1);
+    EXPECT_TRUE(reopened.open(&records,&discarded));
+    ASSERT_EQ((size_t)4,records.size());
+    EXPECT_EQ((U64)0,records.back().hash);
+    std::remove(getJournalPath().c_str());
+}
+
+TEST(CacheJournal,TornRecordIsCutOff) {
+    writeSmallJournal();
+    std::vector<char> content = readFile(getJournalPath());
+    ///the process died while writing the discard record
+    content.resize(content.size() - 3);
+    writeFile(getJournalPath(),content);
+    {
+        CacheJournal journal(getJournalPath(),1);
+        std::vector<CacheJournal::Record> records;
+        std::vector<U64> discarded;
+        EXPECT_TRUE(journal.open(&records,&discarded));
+        EXPECT_EQ((size_t)5,records.size());
+        EXPECT_TRUE(discarded.empty());
+        ///what is appended after the repair can be read back
+        journal.appendInsertion(makeRecord(10));
+    }
+    CacheJournal journal(getJournalPath(),1);
+    std::vector<CacheJournal::Record> records;
+    std::vector<U64> discarded;
+    EXPECT_TRUE(journal.open(&records,&discarded));
+    ASSERT_EQ((size_t)6,records.size());
+    EXPECT_EQ((U64)10,records.back().hash);
+    std::remove(getJournalPath().c_str());
+}
+
+TEST(CacheJournal,CorruptRecordEndsTheJournal) {
+    writeSmallJournal();
+    std::vector<char> content = readFile(getJournalPath());
+    CacheJournal::Record third = makeRecord(2);
+    ///find the key of the third record and flip a bit of it
+    std::string contentString(content.begin(),content.end());
+    size_t keyPos = contentString.find(third.key);
+    ASSERT_NE(std::string::npos,keyPos);
+    content[keyPos + 3] ^= 0x1;
+    writeFile(getJournalPath(),content);
+
+    CacheJournal journal(getJournalPath(),1);
+    std::vector<CacheJournal::Record> records;
+    std::vector<U64> discarded;
+    EXPECT_TRUE(journal.open(&records,&discarded));
+    ASSERT_EQ((size_t)2,records.size());
+    EXPECT_EQ((U64)1,records.back().hash);
+    EXPECT_EQ((size_t)2,journal.getRecordsCount());
+    std::remove(getJournalPath().c_str());
+}
+
+TEST(CacheJournal,OtherVersionIsReset) {
+    writeSmallJournal();
+    EXPECT_TRUE(CacheJournal::isCompatible(getJournalPath(),1));
+    EXPECT_FALSE(CacheJournal::isCompatible(getJournalPath(),2));
+    CacheJournal journal(getJournalPath(),2);
+    std::vector<CacheJournal::Record> records;
+    std::vector<U64> discarded;
+    EXPECT_FALSE(journal.open(&records,&discarded));
+    EXPECT_TRUE(records.empty());
+    EXPECT_TRUE(CacheJournal::isCompatible(getJournalPath(),2));
+    std::remove(getJournalPath().c_str());
+}
+
+TEST(CacheJournal,CompactionKeepsTheLiveRecords) {
+    std::remove(getJournalPath().c_str());
+    const U64 liveCount = 100;
+    {
+        CacheJournal journal(getJournalPath(),1);
+        std::vector<CacheJournal::Record> records;
+        std::vector<U64> discarded;
+        journal.open(&records,&discarded);
+        for (U64 i = 0; i < liveCount; ++i) {
+            journal.appendInsertion(makeRecord(i));
+        }
+        ///entries coming and going, as during a playback
+        for (U64 i = 0; i < 3 * NATRON_CACHE_JOURNAL_COMPACTION_MIN_RECORDS; ++i) {
+            U64 hash = 1000 + i;
+            journal.appendDiscard(hash,true);
+            journal.appendInsertion(makeRecord(hash));
+            journal.appendDiscard(hash,false);
+        }
+        EXPECT_LE(journal.getRecordsCount(),(size_t)NATRON_CACHE_JOURNAL_COMPACTION_MIN_RECORDS);
+        EXPECT_EQ((size_t)liveCount,journal.getLiveEntriesCount());
+        journal.appendDiscard(5,true);
+        journal.compact();
+        EXPECT_EQ((size_t)liveCount,journal.getRecordsCount());
+    }
+    CacheJournal journal(getJournalPath(),1);
+    std::vector<CacheJournal::Record> records;
+    std::vector<U64> discarded;
+    EXPECT_TRUE(journal.open(&records,&discarded));
+    ASSERT_EQ((size_t)liveCount - 1,records.size());
+    ///the order of insertion survives the compactions
+    EXPECT_EQ((U64)0,records.front().hash);
+    EXPECT_EQ(liveCount - 1,records.back().hash);
+    EXPECT_EQ(makeRecord(50).key,records[49].key);
+    ASSERT_EQ((size_t)1,discarded.size());
+    EXPECT_EQ((U64)5,discarded[0]);
+    std::remove(getJournalPath().c_str());
+}
+
+TEST(CacheJournal,CacheRestoresItsDiskPortion) {
+    const int entriesCount = 8;
+    boost::shared_ptr<const NonKeyParams> params = FrameEntry::makeParams(RectI(0,0,32,32),0,32,32);
+    const U64 entrySize = params->getElementsCount();
+    std::string cachePath;
+    {
+        TestViewerCache cache("CacheJournalTest",1,4 * entriesCount * entrySize,0.5);
+        cachePath = QString(cache.getCachePath() + QDir::separator()).toStdString();
+        createCacheFolders(cache);
+        QFile::remove(cache.getJournalFilePath().c_str());
+        cache.restoreFromJournal();
+
+        for (int i = 0; i <= entriesCount; ++i) {
+            boost::shared_ptr<FrameEntry> entry;
+            cache.getOrCreate(makeFrameKey(i),params,&entry);
+            ASSERT_TRUE(entry && entry->isStoredOnDisk());
+            std::memset(entry->data(),i + 1,entrySize);
+        }
+        ///an aborted render
+        boost::shared_ptr<FrameEntry> entry;
+        boost::shared_ptr<const NonKeyParams> cachedParams;
+        ASSERT_TRUE(cache.get(makeFrameKey(entriesCount),&cachedParams,&entry));
+        cache.removeEntry(entry);
+        entry.reset();
+        cache.save();
+        EXPECT_EQ(entriesCount * entrySize,cache.getDiskCacheSize());
+    }
+
+    ///corrupt the file of an entry
+    std::string corruptedFile = FrameEntry::generateStringFromHash(cachePath,makeFrameKey(3).getHash());
+    std::FILE* file = std::fopen(corruptedFile.c_str(),"r+b");
+    ASSERT_TRUE(file != NULL);
+    std::fseek(file,100,SEEK_SET);
+    std::fputc(0,file);
+    std::fclose(file);
+
+    TestViewerCache cache("CacheJournalTest",1,4 * entriesCount * entrySize,0.5);
+    cache.restoreFromJournal();
+    EXPECT_EQ(entriesCount * entrySize,cache.getDiskCacheSize());
+    EXPECT_FALSE(QFile::exists(FrameEntry::generateStringFromHash(cachePath,makeFrameKey(entriesCount).getHash()).c_str()));
+    for (int i = 0; i < entriesCount; ++i) {
+        boost::shared_ptr<FrameEntry> entry;
+        boost::shared_ptr<const NonKeyParams> cachedParams;
+        bool found = cache.get(makeFrameKey(i),&cachedParams,&entry);
+        if (i == 3) {
+            EXPECT_FALSE(found) << "A corrupted entry must not be restored.";
+            ///its file is removed by the I/O thread
+            cache.waitForPendingIO();
+            EXPECT_FALSE(QFile::exists(corruptedFile.c_str()));
+        } else {
+            ASSERT_TRUE(found) << "entry " << i;
+            EXPECT_TRUE(*cachedParams == *params);
+            EXPECT_EQ((U8)(i + 1),entry->data()[0]);
+            EXPECT_EQ((U8)(i + 1),entry->data()[entrySize - 1]);
+        }
+    }
+    cache.clear();
+}
+
+///Not really a test: prints the time taken to restore the index of a cache of 20000 entries.
+TEST(CacheJournal,DISABLED_Benchmark) {
+    std::remove(getJournalPath().c_str());
+    const U64 entriesCount = 20000;
+    {
+        CacheJournal journal(getJournalPath(),1);
+        std::vector<CacheJournal::Record> records;
+        std::vector<U64> discarded;
+        journal.open(&records,&discarded);
+        QElapsedTimer timer;
+        timer.start();
+        for (U64 i = 0; i < entriesCount; ++i) {
+            CacheJournal::Record record = makeRecord(i);
+            record.key.resize(200,'x');
+            journal.appendInsertion(record);
+        }
+        std::cout << "[CacheJournal] " << (double)timer.nsecsElapsed() / entriesCount / 1000. << " us per insertion" << std::endl;
+    }
+    QElapsedTimer timer;
+    timer.start();
+    CacheJournal journal(getJournalPath(),1);
+    std::vector<CacheJournal::Record> records;
+    std::vector<U64> discarded;
+    journal.open(&records,&discarded);
+    std::cout << "[CacheJournal] replaying " << records.size() << " entries: " << timer.elapsed() << " ms" << std::endl;
+
+    std::vector<char> frame(1920 * 1080 * 4);
+    timer.restart();
+    U64 checksum = CacheJournal::checksum(&frame[0],frame.size());
+    std::cout << "[CacheJournal] checksum of a 1080p 8 bits frame: " << (double)timer.nsecsElapsed() / 1000000. << " ms ("
+    << checksum << ")" << std::endl;
+    std::remove(getJournalPath().c_str());
+}
@@ -0,0 +1,49 @@
+//  Natron
+//
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef NATRON_TESTS_CACHETESTHELPERS_H_
+#define NATRON_TESTS_CACHETESTHELPERS_H_
+
+/**
+ * @brief Helpers shared by the tests of the caches, which all exercise them through viewer textures, the entries
+ * that are the simplest to make outside of a project.
+ **/
+
+#include <cstdio>
+
+#include <QtCore/QDir>
+
+#include "Engine/Cache.h"
+#include "Engine/FrameEntry.h"
+#include "Engine/FrameParams.h"
+
+typedef Natron::Cache<Natron::FrameEntry> TestViewerCache;
+
+///A square texture of the given bit depth (0: 8 bits, 2: 32 bits floating point)
+inline Natron::FrameKey
+makeFrameKey(int time,
+             int size = 32,
+             int bitDepth = 0)
+{
+    TextureRect texRect(0,0,size,size,size,size,1);
+    RenderScale scale;
+    scale.x = scale.y = 1.;
+    return Natron::FrameEntry::makeKey(time,1,1.,0,bitDepth,0,0,texRect,scale,"Viewer1");
+}
+
+///The disk portion of a cache expects the 256 sub-folders that the application creates when it starts
+inline void
+createCacheFolders(const TestViewerCache& cache)
+{
+    QDir cacheFolder(cache.getCachePath());
+    for (U32 i = 0; i < 256; ++i) {
+        char name[3];
+        std::sprintf(name,"%02x",i);
+        cacheFolder.mkpath(name);
+    }
+}
+
+#endif // NATRON_TESTS_CACHETESTHELPERS_H_
@@ -0,0 +1,197 @@
+//  Natron
+//
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+#include <gtest/gtest.h>
+
+#include <QtCore/QThread>
+#include <QtCore/QElapsedTimer>
+
+#include "Engine/Cache.h"
+
+using namespace Natron;
+
+namespace {
+
+///A minimal key identifying an entry by a single integer.
+class TestCacheKey : public KeyHelper<U64>
+{
+public:
+    TestCacheKey() : KeyHelper<U64>() , _id(0) {}
+
+    TestCacheKey(U64 id) : KeyHelper<U64>() , _id(id) {}
+
+    void fillHash(Hash64* hash) const { hash->append(_id); }
+
+    bool operator==(const TestCacheKey& other) const { return _id == other._id; }
+
+    template<class Archive>
+    void serialize(Archive & ar,const unsigned int /*version*/) { ar & _id; }
+
+    U64 _id;
+};
+
+class TestCacheEntry : public CacheEntryHelper<unsigned char,TestCacheKey>
+{
+public:
+    TestCacheEntry(const TestCacheKey& key,const boost::shared_ptr<const NonKeyParams>& params,bool restore,const std::string& path)
+    : CacheEntryHelper<unsigned char,TestCacheKey>(key,params,restore,path)
+    {
+    }
+};
+
+typedef Cache<TestCacheEntry> TestCache;
+
+static const U64 kEntrySize = 1024;
+
+///Hammers getOrCreate with random keys, most of them being hits.
+class CacheHammerThread : public QThread
+{
+public:
+    CacheHammerThread(const TestCache* cache,int iterations,int keysCount,unsigned int seed)
+    : QThread()
+    , _cache(cache)
+    , _iterations(iterations)
+    , _keysCount(keysCount)
+    , _seed(seed)
+    , _failures(0)
+    {
+    }
+
+    int getFailures() const { return _failures; }
+
+private:
+
+    virtual void run()
+    {
+        boost::shared_ptr<const NonKeyParams> params(new NonKeyParams(0,kEntrySize));
+        for (int i = 0; i < _iterations; ++i) {
+            _seed = _seed * 1103515245 + 12345;
+            TestCacheKey key((_seed >> 16) % _keysCount);
+            boost::shared_ptr<TestCacheEntry> entry;
+            _cache->getOrCreate(key,params,&entry);
+            if (!entry) {
+                ++_failures;
+            }
+        }
+    }
+
+    const TestCache* _cache;
+    int _iterations;
+    int _keysCount;
+    unsigned int _seed;
+    int _failures;
+};
+
+}
+
+TEST(Cache,StaysInBudgetAndEvictsLRU) {
+    const U64 maxEntries = 100;
+    TestCache cache("TestCache",1,maxEntries * kEntrySize,1.);
+    boost::shared_ptr<const NonKeyParams> params(new NonKeyParams(0,kEntrySize));
+
+    boost::shared_ptr<TestCacheEntry> entry;
+    for (U64 i = 0; i < 2 * maxEntries; ++i) {
+        cache.getOrCreate(TestCacheKey(i),params,&entry);
+        ASSERT_TRUE(entry);
+        entry.reset();
+
+        ///keep the first entry alive by looking it up after each insertion
+        boost::shared_ptr<const NonKeyParams> cachedParams;
+        EXPECT_TRUE(cache.get(TestCacheKey(0),&cachedParams,&entry));
+        entry.reset();
+    }
+
+    EXPECT_LT(cache.getMemoryCacheSize(),cache.getMaximumMemorySize());
+
+    boost::shared_ptr<const NonKeyParams> cachedParams;
+    EXPECT_TRUE(cache.get(TestCacheKey(0),&cachedParams,&entry)) << "The most recently used entry must not be evicted.";
+    EXPECT_TRUE(cache.get(TestCacheKey(2 * maxEntries - 1),&cachedParams,&entry));
+    EXPECT_FALSE(cache.get(TestCacheKey(1),&cachedParams,&entry)) << "The least recently used entry should be evicted first.";
+}
+
+TEST(Cache,EntriesInUseAreNotEvicted) {
+    TestCache cache("TestCache",1,10 * kEntrySize,1.);
+    boost::shared_ptr<const NonKeyParams> params(new NonKeyParams(0,kEntrySize));
+
+    std::vector< boost::shared_ptr<TestCacheEntry> > inUse;
+    for (U64 i = 0; i < 20; ++i) {
+        boost::shared_ptr<TestCacheEntry> entry;
+        cache.getOrCreate(TestCacheKey(i),params,&entry);
+        ASSERT_TRUE(entry);
+        inUse.push_back(entry);
+    }
+    std::list< boost::shared_ptr<TestCacheEntry> > copy;
+    cache.getCopy(&copy);
+    EXPECT_EQ(inUse.size(),copy.size());
+
+    inUse.clear();
+    copy.clear();
+    cache.clearExceedingEntries();
+    EXPECT_LT(cache.getMemoryCacheSize(),cache.getMaximumMemorySize());
+}
+
+TEST(Cache,GreedyDualSizeKeepsExpensiveEntries) {
+    const U64 maxEntries = 100;
+    Cache<TestCacheEntry,GreedyDualSizeEvictionPolicy> cache("TestCache",1,maxEntries * kEntrySize,1.,1);
+    boost::shared_ptr<const NonKeyParams> params(new NonKeyParams(0,kEntrySize));
+
+    ///an entry that took long to render is never looked-up again, yet outlives a whole cache of cheap entries
+    boost::shared_ptr<TestCacheEntry> entry;
+    cache.getOrCreate(TestCacheKey(0),params,&entry);
+    ASSERT_TRUE(entry);
+    entry->addComputeTime(1000.);
+    entry.reset();
+    for (U64 i = 1; i < 2 * maxEntries; ++i) {
+        cache.getOrCreate(TestCacheKey(i),params,&entry);
+        ASSERT_TRUE(entry);
+        entry->addComputeTime(10.);
+        entry.reset();
+    }
+    EXPECT_LT(cache.getMemoryCacheSize(),cache.getMaximumMemorySize());
+
+    boost::shared_ptr<const NonKeyParams> cachedParams;
+    EXPECT_TRUE(cache.get(TestCacheKey(0),&cachedParams,&entry));
+    EXPECT_FALSE(cache.get(TestCacheKey(1),&cachedParams,&entry));
+}
+
+///Not really a test: prints the throughput of getOrCreate when many threads hammer the cache,
+///for a cache with a single shard (i.e: one global lock) and the default sharding.
+TEST(Cache,DISABLED_ContentionBenchmark) {
+    int threadsCount = std::max(QThread::idealThreadCount(),4) * 2;
+    const int iterations = 200000;
+    const int keysCount = 4096;
+
+    unsigned int shardsCounts[2] = { 1, NATRON_CACHE_DEFAULT_SHARDS_COUNT };
+    for (int s = 0; s < 2; ++s) {
+        TestCache cache("TestCache",1,(U64)keysCount * kEntrySize,1.,shardsCounts[s]);
+        ASSERT_EQ(shardsCounts[s],cache.getShardsCount());
+
+        std::vector<CacheHammerThread*> threads;
+        for (int i = 0; i < threadsCount; ++i) {
+            threads.push_back(new CacheHammerThread(&cache,iterations,keysCount,i + 1));
+        }
+        QElapsedTimer timer;
+        timer.start();
+        for (int i = 0; i < threadsCount; ++i) {
+            threads[i]->start();
+        }
+        int failures = 0;
+        for (int i = 0; i < threadsCount; ++i) {
+            threads[i]->wait();
+            failures += threads[i]->getFailures();
+            delete threads[i];
+        }
+        qint64 elapsed = std::max(timer.elapsed(),(qint64)1);
+        EXPECT_EQ(0,failures);
+        EXPECT_LT(cache.getMemoryCacheSize(),cache.getMaximumMemorySize());
+
+        std::cout << "[Cache::getOrCreate] " << threadsCount << " threads, " << shardsCounts[s] << " shard(s): "
+        << elapsed << " ms, " << ((double)threadsCount * iterations / elapsed) / 1000. << " Mops/s" << std::endl;
+    }
+}
@@ -4,6 +4,7 @@
  * License, v. 2.0. If a copy of the MPL was not distributed with this
  * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
 
+#include <stdexcept>
 #include <gtest/gtest.h>
 
 #include <QString>
@@ -101,3 +102,35 @@ TEST(Curve,Basic)
 }
 
 
+
+TEST(Curve,BatchEvaluation)
+{
+    Curve c;
+    c.addKeyFrame(KeyFrame(0.,0.));
+    c.addKeyFrame(KeyFrame(10.,5.));
+    c.addKeyFrame(KeyFrame(20.,-3.,0.,0.,Natron::KEYFRAME_LINEAR));
+    c.addKeyFrame(KeyFrame(25.,2.,0.,0.,Natron::KEYFRAME_CONSTANT));
+
+    // the batch evaluation must give the same values as the one-time evaluation, including outside the keyframes
+    std::vector<double> values;
+    c.getValuesAt(-10., 40., 0.25, &values);
+    ASSERT_EQ(201u, values.size());
+    for (std::size_t i = 0; i < values.size(); ++i) {
+        EXPECT_EQ(c.getValueAt(-10. + i * 0.25), values[i]);
+    }
+
+    // editing the curve must be reflected in both evaluations
+    double before = c.getValueAt(15.);
+    c.setKeyFrameValueAndTime(10., 50., 1);
+    EXPECT_NE(before, c.getValueAt(15.));
+    c.removeKeyFrameWithTime(25.);
+    EXPECT_EQ(3, c.getKeyFramesCount());
+    c.setKeyFrameDerivatives(1., 1., 0);
+    c.getValuesAt(-10., 40., 0.25, &values);
+    for (std::size_t i = 0; i < values.size(); ++i) {
+        EXPECT_EQ(c.getValueAt(-10. + i * 0.25), values[i]);
+    }
+
+    c.clearKeyFrames();
+    EXPECT_THROW(c.getValuesAt(0., 1., 1., &values), std::runtime_error);
+}
@@ -10,7 +10,13 @@
  */
 
 #include <cstdlib>
+#include <algorithm>
+#include <iostream>
 #include <gtest/gtest.h>
+
+#include <QtCore/QString>
+#include <QtCore/QElapsedTimer>
+
 #include "Engine/Hash64.h"
 
 TEST(Hash64,GeneralTest) {
@@ -65,3 +71,72 @@ TEST(Hash64,GeneralTest) {
     EXPECT_NE(hash1, hash2);
 
 }
+
+TEST(Hash64,CRC64ModeIsUnchanged) {
+    ///The CRC64 mode must keep producing the values of the previous versions, otherwise
+    ///the entries of old disk caches cannot be recognized.
+    Hash64 hash(Hash64::CRC64_HASH);
+    hash.append<int>(3);
+    hash.computeHash();
+    EXPECT_EQ(0xb2d742eb5fa23398ULL,hash.value());
+
+    Hash64 fast;
+    fast.append<int>(3);
+    fast.computeHash();
+    ASSERT_TRUE(fast.valid());
+    EXPECT_NE(hash.value(),fast.value());
+}
+
+TEST(Hash64,StreamingHashDependsOnOrderAndLength) {
+    Hash64 a,b,c;
+    a.append<int>(1);
+    a.append<int>(2);
+    b.append<int>(2);
+    b.append<int>(1);
+    c.append<int>(1);
+    c.append<int>(2);
+    c.append<int>(0);
+    a.computeHash();
+    b.computeHash();
+    c.computeHash();
+    EXPECT_NE(a,b);
+    EXPECT_NE(a,c) << "Trailing zeroes must change the hash";
+
+    Hash64 s1,s2,s3;
+    Hash64_appendQString(&s1, QString("Natron"));
+    Hash64_appendQString(&s2, QString("Natron"));
+    Hash64_appendQString(&s3, QString("Natrom"));
+    s1.computeHash();
+    s2.computeHash();
+    s3.computeHash();
+    EXPECT_EQ(s1,s2);
+    EXPECT_NE(s1,s3);
+}
+
+///Not really a test: prints the time taken to hash node-sized inputs with the streaming hash and the CRC64.
+TEST(Hash64,DISABLED_Benchmark) {
+    const int iterations = 200000;
+    const int valuesCount = 64;
+    Hash64::Algorithm algorithms[2] = { Hash64::CRC64_HASH, Hash64::FAST_HASH };
+    const char* names[2] = { "CRC64", "streaming" };
+    U64 results[2] = { 0, 0 };
+    for (int a = 0; a < 2; ++a) {
+        QElapsedTimer timer;
+        timer.start();
+        U64 acc = 0;
+        for (int i = 0; i < iterations; ++i) {
+            Hash64 hash(algorithms[a]);
+            for (int v = 0; v < valuesCount; ++v) {
+                hash.append<U64>((U64)i * valuesCount + v);
+            }
+            hash.computeHash();
+            acc += hash.value();
+        }
+        qint64 elapsed = std::max(timer.elapsed(),(qint64)1);
+        results[a] = acc;
+        std::cout << "[Hash64] " << names[a] << ": " << iterations << " hashes of " << valuesCount << " values in "
+        << elapsed << " ms, " << ((double)iterations * valuesCount * sizeof(U64) / (1024. * 1024.)) / (elapsed / 1000.) << " MB/s" << std::endl;
+    }
+    EXPECT_NE(0ULL,results[0]);
+    EXPECT_NE(0ULL,results[1]);
+}
@@ -0,0 +1,154 @@
+//  Natron
+//
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <cstring>
+#include <iostream>
+#include <vector>
+#include <gtest/gtest.h>
+
+#include <QtCore/QElapsedTimer>
+
+#include "Engine/ImageBufferPool.h"
+#include "Engine/Image.h"
+
+using namespace Natron;
+
+TEST(ImageBufferPool,SizeClasses) {
+    ///small buffers are not pooled
+    EXPECT_EQ((std::size_t)1000,ImageBufferPool::getSizeClass(1000));
+    EXPECT_EQ((std::size_t)NATRON_IMAGE_BUFFER_POOL_MIN_BYTES,ImageBufferPool::getSizeClass(NATRON_IMAGE_BUFFER_POOL_MIN_BYTES));
+    EXPECT_EQ((std::size_t)320 * 1024,ImageBufferPool::getSizeClass(256 * 1024 + 1));
+
+    ///a 4K float RGBA frame and a few pixels more share the class
+    std::size_t frame = 3840 * 2160 * 4 * sizeof(float);
+    EXPECT_GE(ImageBufferPool::getSizeClass(frame),frame);
+    EXPECT_EQ((std::size_t)0,ImageBufferPool::getSizeClass(frame) % (2 * 1024 * 1024));
+    EXPECT_EQ(ImageBufferPool::getSizeClass(frame),ImageBufferPool::getSizeClass(frame - 100));
+}
+
+TEST(ImageBufferPool,ReleasedBuffersAreReused) {
+    ImageBufferPool& pool = ImageBufferPool::instance();
+    pool.clear();
+    pool.resetStatistics();
+
+    const std::size_t size = 3 * 1024 * 1024 + 17;
+    void* a = pool.allocate(size);
+    ASSERT_TRUE(a != NULL);
+    std::memset(a,1,size);
+    pool.release(a,size);
+    ImageBufferPool::Statistics stats = pool.getStatistics();
+    EXPECT_EQ((U64)1,stats.pooledBuffersCount);
+    EXPECT_EQ((U64)ImageBufferPool::getSizeClass(size),stats.pooledBytes);
+
+    ///same size class: same buffer
+    void* b = pool.allocate(size - 10);
+    EXPECT_EQ(a,b);
+    ///nothing left for another one
+    void* c = pool.allocate(size);
+    EXPECT_NE(b,c);
+    pool.release(b,size - 10);
+    pool.release(c,size);
+
+    stats = pool.getStatistics();
+    EXPECT_EQ((U64)3,stats.allocationsCount);
+    EXPECT_EQ((U64)1,stats.reusedCount);
+    EXPECT_EQ((U64)3,stats.releasesCount);
+    EXPECT_EQ((U64)2,stats.pooledBuffersCount);
+    EXPECT_DOUBLE_EQ(1. / 3.,stats.getReuseHitRate());
+
+    pool.clear();
+    stats = pool.getStatistics();
+    EXPECT_EQ((U64)0,stats.pooledBytes);
+    EXPECT_EQ((U64)2,stats.freedCount);
+}
+
+TEST(ImageBufferPool,OldestBuffersAreFreedWhenFull) {
+    ImageBufferPool& pool = ImageBufferPool::instance();
+    pool.clear();
+    pool.resetStatistics();
+    U64 maxBytes = pool.getMaxPooledBytes();
+
+    const std::size_t size = 1024 * 1024;
+    pool.setMaxPooledBytes(2 * size);
+    void* buffers[3];
+    for (int i = 0; i < 3; ++i) {
+        buffers[i] = pool.allocate(size);
+    }
+    for (int i = 0; i < 3; ++i) {
+        pool.release(buffers[i],size);
+    }
+    ImageBufferPool::Statistics stats = pool.getStatistics();
+    EXPECT_EQ((U64)2 * size,stats.pooledBytes);
+    EXPECT_EQ((U64)1,stats.freedCount);
+
+    ///the most recently released comes back first
+    void* b = pool.allocate(size);
+    EXPECT_EQ(buffers[2],b);
+    pool.release(b,size);
+
+    ///a buffer bigger than the pool is freed right away
+    void* big = pool.allocate(4 * size);
+    pool.release(big,4 * size);
+    EXPECT_EQ((U64)2 * size,pool.getStatistics().pooledBytes);
+
+    pool.setMaxPooledBytes(maxBytes);
+    pool.clear();
+}
+
+TEST(ImageBufferPool,ImagesRecycleTheirBuffers) {
+    ImageBufferPool& pool = ImageBufferPool::instance();
+    pool.clear();
+    pool.resetStatistics();
+    RectI rod(0,0,512,512);
+    {
+        Image img(ImageComponentRGBA,rod,0,IMAGE_FLOAT);
+        img.fill(rod,0.5,0.5,0.5,1.);
+    }
+    {
+        Image img(ImageComponentRGBA,rod,0,IMAGE_FLOAT);
+        img.fill(rod,0.,0.,0.,0.);
+    }
+    ImageBufferPool::Statistics stats = pool.getStatistics();
+    EXPECT_EQ((U64)2,stats.allocationsCount);
+    EXPECT_EQ((U64)1,stats.reusedCount);
+    pool.clear();
+}
+
+///Not really a test: prints the time taken to allocate, write and free a 4K float frame, with the heap
+///and with the pool.
+TEST(ImageBufferPool,DISABLED_Benchmark) {
+    ImageBufferPool& pool = ImageBufferPool::instance();
+    pool.clear();
+    const std::size_t size = 3840 * 2160 * 4 * sizeof(float);
+    const int iterations = 20;
+
+    QElapsedTimer timer;
+    timer.start();
+    for (int i = 0; i < iterations; ++i) {
+        char* ptr = new char[size];
+        std::memset(ptr,0,size);
+        delete [] ptr;
+    }
+    double heapTime = (double)timer.elapsed() / iterations;
+
+    for (int hugePages = 0; hugePages < 2; ++hugePages) {
+        pool.setHugePagesEnabled(hugePages);
+        pool.clear();
+        pool.resetStatistics();
+        timer.restart();
+        for (int i = 0; i < iterations; ++i) {
+            void* ptr = pool.allocate(size);
+            std::memset(ptr,0,size);
+            pool.release(ptr,size);
+        }
+        double poolTime = (double)timer.elapsed() / iterations;
+        std::cout << "[ImageBufferPool] 4K float frame: heap " << heapTime << " ms, pool " << poolTime
+        << " ms per frame (huge pages " << (hugePages ? "on" : "off") << ", reuse hit rate "
+        << pool.getStatistics().getReuseHitRate() << ")" << std::endl;
+    }
+    pool.setHugePagesEnabled(false);
+    pool.clear();
+}
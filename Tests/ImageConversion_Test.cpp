@@ -0,0 +1,596 @@
+//  Natron
+//
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "BaseTest.h"
+
+#include <cstring>
+#include <iostream>
+
+#include <QtCore/QElapsedTimer>
+
+#include "Engine/Image.h"
+#include "Engine/ImageParams.h"
+#include "Engine/Lut.h"
+
+using namespace Natron;
+
+namespace {
+
+const Natron::Color::Lut*
+lutFromColorspace(Natron::ViewerColorSpace cs)
+{
+    const Natron::Color::Lut* lut;
+    switch (cs) {
+        case Natron::sRGB:
+            lut = Natron::Color::LutManager::sRGBLut();
+            break;
+        case Natron::Rec709:
+            lut = Natron::Color::LutManager::Rec709Lut();
+            break;
+        case Natron::Linear:
+        default:
+            lut = 0;
+            break;
+    }
+    if (lut) {
+        lut->validate();
+    }
+    return lut;
+}
+
+///The golden implementation: Image::convertToFormat as it was before it picked specialized row kernels.
+///The conversion kernels must give exactly the same results, except where the reference was wrong (see below).
+template <typename SRCPIX,typename DSTPIX,int srcMaxValue,int dstMaxValue>
+void
+referenceConvert_sameComps(const RectI& renderWindow,const Image& srcImg,Image& dstImg,
+                           Natron::ViewerColorSpace srcColorSpace,
+                           Natron::ViewerColorSpace dstColorSpace,
+                           bool invert,bool copyBitmap)
+{
+    const RectI& r = srcImg.getPixelRoD();
+
+    RectI intersection;
+    if (!renderWindow.intersect(r, &intersection)) {
+        return;
+    }
+    
+    Natron::ImageBitDepth dstDepth = dstImg.getBitDepth();
+    Natron::ImageBitDepth srcDepth = srcImg.getBitDepth();
+    
+    int nComp = (int)srcImg.getComponentsCount();
+
+    const Natron::Color::Lut* srcLut = lutFromColorspace(srcColorSpace);
+    const Natron::Color::Lut* dstLut = lutFromColorspace(dstColorSpace);
+    
+    ///no colorspace conversion applied when luts are the same
+    if (srcLut == dstLut) {
+        srcLut = dstLut = 0;
+    }
+    
+    for (int y = 0; y < intersection.height();++y) {
+        
+        int start = Natron::Color::getDitherStart(intersection.y1 + y, intersection.width());
+        
+        const SRCPIX* srcPixels = (const SRCPIX*)srcImg.pixelAt(intersection.x1 + start, intersection.y1 + y);
+        DSTPIX* dstPixels = (DSTPIX*)dstImg.pixelAt(intersection.x1 + start, intersection.y1 + y);
+        const SRCPIX* srcStart = srcPixels;
+        DSTPIX* dstStart = dstPixels;
+        
+        for (int backward = 0;backward < 2; ++backward) {
+            int x = backward ? start - 1 : start;
+            int end = backward ? -1 : intersection.width();
+            
+            unsigned error[3] = { 0x80,0x80,0x80 };
+            
+            while (x != end && x >= 0 && x < intersection.width()) {
+                
+                for (int k = 0; k < nComp; ++k) {
+                    
+                    if (k <= 2 && (srcLut || dstLut)) {
+                        float pixFloat;
+                        
+                        if (srcLut) {
+                            if (srcDepth == IMAGE_BYTE) {
+                                pixFloat = srcLut->fromColorSpaceUint8ToLinearFloatFast(srcPixels[k]);
+                            } else if (srcDepth == IMAGE_SHORT) {
+                                pixFloat = srcLut->fromColorSpaceUint16ToLinearFloatFast(srcPixels[k]);
+                            } else {
+                                pixFloat = srcLut->fromColorSpaceFloatToLinearFloat(srcPixels[k]);
+                            }
+                        } else {
+                            pixFloat = convertPixelDepth<SRCPIX, float>(srcPixels[k]);
+                        }
+                        
+
+                        DSTPIX pix;
+                        if (dstDepth == IMAGE_BYTE) {
+                            ///small increase in perf we use Luts. This should be anyway the most used case.
+                            error[k] = (error[k]&0xff) + (dstLut ? dstLut->toColorSpaceUint8xxFromLinearFloatFast(pixFloat) :
+                                                          Color::floatToInt<0xff01>(pixFloat));
+                            pix = error[k] >> 8;
+                        } else if (dstDepth == IMAGE_SHORT) {
+                            pix = dstLut ? dstLut->toColorSpaceUint16FromLinearFloatFast(pixFloat) :
+                            convertPixelDepth<float, DSTPIX>(pixFloat);
+                        } else {
+                            
+                            if (dstLut) {
+                                pixFloat = dstLut->toColorSpaceFloatFromLinearFloat(pixFloat);
+                            }
+                            pix = convertPixelDepth<float, DSTPIX>(pixFloat);
+                        }
+                        dstPixels[k] = invert ? dstMaxValue - pix : pix;
+                        
+                    } else {
+                        DSTPIX pix = convertPixelDepth<SRCPIX, DSTPIX>(srcPixels[k]);
+                        dstPixels[k] = invert ? dstMaxValue - pix : pix;
+                    }
+                }
+                
+                if (backward) {
+                    --x;
+                    srcPixels -= nComp;
+                    dstPixels -= nComp;
+                } else {
+                    ++x;
+                    srcPixels += nComp;
+                    dstPixels += nComp;
+                }
+            }
+            srcPixels = srcStart - nComp;
+            dstPixels = dstStart - nComp;
+        }
+
+    }
+    
+    if (copyBitmap) {
+        dstImg.copyBitmapFrom(srcImg, intersection);
+    }
+}
+
+template <typename SRCPIX,typename DSTPIX,int srcMaxValue,int dstMaxValue>
+void
+referenceConvert(const RectI& renderWindow,const Image& srcImg,Image& dstImg,
+                 Natron::ViewerColorSpace srcColorSpace,
+                 Natron::ViewerColorSpace dstColorSpace,
+                 int channelForAlpha,bool invert,bool copyBitmap)
+{
+    
+    const RectI& r = srcImg.getPixelRoD();
+    
+    RectI intersection;
+    if (!renderWindow.intersect(r, &intersection)) {
+        return;
+    }
+    
+    Natron::ImageComponents dstComp = dstImg.getComponents();
+    Natron::ImageBitDepth dstDepth = dstImg.getBitDepth();
+    Natron::ImageBitDepth srcDepth = srcImg.getBitDepth();
+    
+    bool sameBitDepth = srcImg.getBitDepth() == dstImg.getBitDepth();
+
+    int dstNComp = getElementsCountForComponents(dstComp);
+    int srcNComp = getElementsCountForComponents(srcImg.getComponents());
+
+    ///special case comp == alpha && channelForAlpha = -1 clear out the mask
+    if (dstComp == Natron::ImageComponentAlpha && channelForAlpha == -1) {
+        DSTPIX* dstPixels = (DSTPIX*)dstImg.pixelAt(intersection.x1, intersection.y1);
+        
+        for (int y = 0; y < intersection.height();
+             ++y, dstPixels += (r.width() * dstNComp)) {
+            std::fill(dstPixels, dstPixels + intersection.width() * dstNComp, 0.);
+        }
+        if (copyBitmap) {
+            dstImg.copyBitmapFrom(srcImg, intersection);
+        }
+        return;
+    }
+    
+    const Natron::Color::Lut* srcLut = lutFromColorspace(srcColorSpace);
+    const Natron::Color::Lut* dstLut = lutFromColorspace(dstColorSpace);
+
+    
+    for (int y = 0; y < intersection.height(); ++y) {
+        
+        int start = Natron::Color::getDitherStart(intersection.y1 + y, intersection.width());
+        
+        const SRCPIX* srcPixels = (const SRCPIX*)srcImg.pixelAt(intersection.x1 + start, intersection.y1 + y);
+        DSTPIX* dstPixels = (DSTPIX*)dstImg.pixelAt(intersection.x1 + start, intersection.y1 + y);
+        const SRCPIX* srcStart = srcPixels;
+        DSTPIX* dstStart = dstPixels;
+        
+        for (int backward = 0;backward < 2; ++backward) {
+            int x = backward ? start - 1 : start;
+            int end = backward ? -1 : intersection.width();
+            
+            unsigned error[3] = { 0x80,0x80,0x80 };
+            
+            while (x != end && x >= 0 && x < intersection.width()) {
+                
+                if (dstComp == Natron::ImageComponentAlpha) {
+                    assert(channelForAlpha < srcNComp && channelForAlpha >= 0);
+                    *dstPixels = !sameBitDepth ? convertPixelDepth<SRCPIX, DSTPIX>(srcPixels[channelForAlpha])
+                    : srcPixels[channelForAlpha];
+                    if (invert) {
+                        *dstPixels = dstMaxValue - *dstPixels;
+                    }
+                } else {
+                    if (srcImg.getComponents() == Natron::ImageComponentAlpha) {
+                        if (dstComp == Natron::ImageComponentRGB) {
+                            for (int k = 0; k < dstNComp; ++k) {
+                                DSTPIX pix = convertPixelDepth<SRCPIX, DSTPIX>(*srcPixels);
+                                dstPixels[k] = invert ? dstMaxValue - pix : pix;
+                            }
+                        } else {
+                            assert(dstComp == Natron::ImageComponentRGBA);
+                            for (int k = 0; k < dstNComp - 1; ++k) {
+                                dstPixels[k] = invert ? dstMaxValue : 0;
+                            }
+                            DSTPIX pix = convertPixelDepth<SRCPIX, DSTPIX>(*srcPixels);
+                            dstPixels[3] = invert ? dstMaxValue : pix;
+                        }
+                    } else {
+                        for (int k = 0; k < dstNComp; ++k) {
+                            if (k < srcNComp) {
+                                if (k <= 2 && (srcLut || dstLut)) {
+                                    float pixFloat;
+                                    
+                                    if (srcLut) {
+                                        if (srcDepth == IMAGE_BYTE) {
+                                            pixFloat = srcLut->fromColorSpaceUint8ToLinearFloatFast(srcPixels[k]);
+                                        } else if (srcDepth == IMAGE_SHORT) {
+                                            pixFloat = srcLut->fromColorSpaceUint16ToLinearFloatFast(srcPixels[k]);
+                                        } else {
+                                            pixFloat = srcLut->fromColorSpaceFloatToLinearFloat(srcPixels[k]);
+                                        }
+                                    } else {
+                                        pixFloat = convertPixelDepth<SRCPIX, float>(srcPixels[k]);
+                                    }
+                                    
+                                    
+                                    DSTPIX pix;
+                                    if (dstDepth == IMAGE_BYTE) {
+                                        error[k] = (error[k]&0xff) + (dstLut ? dstLut->toColorSpaceUint8xxFromLinearFloatFast(pixFloat):
+                                                                      Color::floatToInt<0xff01>(pixFloat));
+                                        pix = error[k] >> 8;
+                                    } else if (dstDepth == IMAGE_SHORT) {
+                                        pix = dstLut ? dstLut->toColorSpaceUint16FromLinearFloatFast(pixFloat) :
+                                        convertPixelDepth<float, DSTPIX>(pixFloat);
+                                    } else {
+                                        if (dstLut) {
+                                            pixFloat = dstLut->toColorSpaceFloatFromLinearFloat(pixFloat);
+                                        } else {
+                                            pix = convertPixelDepth<float, DSTPIX>(pixFloat);
+                                        }
+                                    }
+                                    dstPixels[k] = invert ? dstMaxValue - pix : pix;
+                                    
+                                } else {
+                                    DSTPIX pix = convertPixelDepth<SRCPIX, DSTPIX>(srcPixels[k]);
+                                    dstPixels[k] = invert ? dstMaxValue - pix : pix;
+                                }
+                                
+                            } else {
+                                dstPixels[k] = k == 3 ? dstMaxValue :  0.;
+                                if (invert) {
+                                    dstPixels[k] = dstMaxValue - dstPixels[k];
+                                }
+                            }
+                        }
+                    }
+                }
+
+                if (backward) {
+                    --x;
+                    srcPixels -= srcNComp;
+                    dstPixels -= dstNComp;
+                } else {
+                    ++x;
+                    srcPixels += srcNComp;
+                    dstPixels += dstNComp;
+                }
+            }
+            srcPixels = srcStart - srcNComp;
+            dstPixels = dstStart - dstNComp;
+        }
+        
+    }
+    
+    if (copyBitmap) {
+        dstImg.copyBitmapFrom(srcImg, intersection);
+    }
+}
+
+template <typename SRCPIX,typename DSTPIX,int srcMaxValue,int dstMaxValue>
+void
+referenceConvertToFormat(const Image& srcImg,
+                         const RectI& renderWindow,
+                         Image* dstImg,
+                         Natron::ViewerColorSpace srcColorSpace,
+                         Natron::ViewerColorSpace dstColorSpace,
+                         int channelForAlpha,
+                         bool invert)
+{
+    if (srcImg.getComponents() == dstImg->getComponents()) {
+        referenceConvert_sameComps<SRCPIX, DSTPIX, srcMaxValue, dstMaxValue>(renderWindow, srcImg, *dstImg, srcColorSpace,
+                                                                             dstColorSpace, invert, false);
+    } else {
+        referenceConvert<SRCPIX, DSTPIX, srcMaxValue, dstMaxValue>(renderWindow, srcImg, *dstImg, srcColorSpace, dstColorSpace,
+                                                                   channelForAlpha, invert, false);
+    }
+}
+
+template <typename SRCPIX,int srcMaxValue>
+void
+referenceConvertToFormat(const Image& srcImg,
+                         const RectI& renderWindow,
+                         Image* dstImg,
+                         Natron::ViewerColorSpace srcColorSpace,
+                         Natron::ViewerColorSpace dstColorSpace,
+                         int channelForAlpha,
+                         bool invert)
+{
+    switch (dstImg->getBitDepth()) {
+        case IMAGE_BYTE:
+            referenceConvertToFormat<SRCPIX, unsigned char, srcMaxValue, 255>(srcImg, renderWindow, dstImg, srcColorSpace,
+                                                                              dstColorSpace, channelForAlpha, invert);
+            break;
+        case IMAGE_SHORT:
+            referenceConvertToFormat<SRCPIX, unsigned short, srcMaxValue, 65535>(srcImg, renderWindow, dstImg, srcColorSpace,
+                                                                                 dstColorSpace, channelForAlpha, invert);
+            break;
+        case IMAGE_FLOAT:
+            referenceConvertToFormat<SRCPIX, float, srcMaxValue, 1>(srcImg, renderWindow, dstImg, srcColorSpace,
+                                                                    dstColorSpace, channelForAlpha, invert);
+            break;
+    }
+}
+
+void
+referenceConvertToFormat(const Image& srcImg,
+                         const RectI& renderWindow,
+                         Image* dstImg,
+                         Natron::ViewerColorSpace srcColorSpace,
+                         Natron::ViewerColorSpace dstColorSpace,
+                         int channelForAlpha,
+                         bool invert)
+{
+    switch (srcImg.getBitDepth()) {
+        case IMAGE_BYTE:
+            referenceConvertToFormat<unsigned char, 255>(srcImg, renderWindow, dstImg, srcColorSpace, dstColorSpace,
+                                                         channelForAlpha, invert);
+            break;
+        case IMAGE_SHORT:
+            referenceConvertToFormat<unsigned short, 65535>(srcImg, renderWindow, dstImg, srcColorSpace, dstColorSpace,
+                                                            channelForAlpha, invert);
+            break;
+        case IMAGE_FLOAT:
+            referenceConvertToFormat<float, 1>(srcImg, renderWindow, dstImg, srcColorSpace, dstColorSpace,
+                                               channelForAlpha, invert);
+            break;
+    }
+}
+
+///Fills the image with pseudo-random values covering the whole range of the bit depth, and out of [0,1] for floats
+boost::shared_ptr<Image>
+makeImage(Natron::ImageComponents comps,
+          Natron::ImageBitDepth depth,
+          const RectI& rod)
+{
+    boost::shared_ptr<Image> img(new Image(comps,rod,0,depth));
+    int count = rod.width() * (int)img->getComponentsCount();
+    for (int y = rod.y1; y < rod.y2; ++y) {
+        unsigned char* pix = img->pixelAt(rod.x1, y);
+        for (int i = 0; i < count; ++i) {
+            unsigned int r = (unsigned int)(y * 7919 + i * 104729) * 2654435761U;
+            switch (depth) {
+                case IMAGE_BYTE:
+                    pix[i] = (unsigned char)(r >> 24);
+                    break;
+                case IMAGE_SHORT:
+                    ((unsigned short*)pix)[i] = (unsigned short)(r >> 16);
+                    break;
+                case IMAGE_FLOAT:
+                    ((float*)pix)[i] = (r >> 8) / (float)(1 << 24) * 1.2f - 0.1f;
+                    break;
+            }
+        }
+    }
+    return img;
+}
+
+///Returns true if the 2 images have the same pixels, bit for bit
+bool
+samePixels(const Image& a,
+           const Image& b)
+{
+    const RectI& rod = a.getPixelRoD();
+    size_t rowSize = rod.width() * a.getComponentsCount() * getSizeOfForBitDepth(a.getBitDepth());
+    for (int y = rod.y1; y < rod.y2; ++y) {
+        if (std::memcmp(a.pixelAt(rod.x1, y), b.pixelAt(rod.x1, y), rowSize) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+const Natron::ImageBitDepth depths[3] = { IMAGE_BYTE, IMAGE_SHORT, IMAGE_FLOAT };
+
+const Natron::ViewerColorSpace colorSpaces[3] = { Natron::Linear, Natron::sRGB, Natron::Rec709 };
+
+///Converts a sub-rectangle of src to dst with convertToFormat and with the reference and checks they give the same result.
+void
+checkConversionMatchesReference(Natron::ImageComponents srcComps,
+                                Natron::ImageBitDepth srcDepth,
+                                Natron::ImageComponents dstComps,
+                                Natron::ImageBitDepth dstDepth,
+                                Natron::ViewerColorSpace srcColorSpace,
+                                Natron::ViewerColorSpace dstColorSpace,
+                                int channelForAlpha,
+                                bool invert)
+{
+    ///odd sizes to cover the remainders of the vectorized loops
+    RectI rod(-5,3,66,20);
+    RectI renderWindow(-2,4,61,19);
+    boost::shared_ptr<Image> src = makeImage(srcComps, srcDepth, rod);
+    boost::shared_ptr<Image> dst = makeImage(dstComps, dstDepth, rod);
+    boost::shared_ptr<Image> expected = makeImage(dstComps, dstDepth, rod);
+    src->convertToFormat(renderWindow, dst.get(), srcColorSpace, dstColorSpace, channelForAlpha, invert, false);
+    referenceConvertToFormat(*src, renderWindow, expected.get(), srcColorSpace, dstColorSpace, channelForAlpha, invert);
+    EXPECT_TRUE(samePixels(*expected, *dst)) << Image::getFormatString(srcComps, srcDepth) << " to "
+    << Image::getFormatString(dstComps, dstDepth) << ", color-spaces " << srcColorSpace << " to " << dstColorSpace
+    << ", channel for alpha " << channelForAlpha << ", invert " << invert;
+}
+
+}
+
+TEST(ImageConversion,SameComponentsMatchReference) {
+    const Natron::ImageComponents comps[3] = { ImageComponentAlpha, ImageComponentRGB, ImageComponentRGBA };
+    for (int c = 0; c < 3; ++c) {
+        for (int sd = 0; sd < 3; ++sd) {
+            for (int dd = 0; dd < 3; ++dd) {
+                for (int scs = 0; scs < 3; ++scs) {
+                    for (int dcs = 0; dcs < 3; ++dcs) {
+                        ///the reference converted alpha images from a color-space to another
+                        if (comps[c] == ImageComponentAlpha && scs != dcs) {
+                            continue;
+                        }
+                        for (int invert = 0; invert < 2; ++invert) {
+                            checkConversionMatchesReference(comps[c], depths[sd], comps[c], depths[dd],
+                                                            colorSpaces[scs], colorSpaces[dcs], 3, invert);
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+TEST(ImageConversion,DifferentComponentsMatchReference) {
+    struct ComponentsConversion
+    {
+        Natron::ImageComponents src;
+        Natron::ImageComponents dst;
+        int channelForAlpha;
+    };
+    const ComponentsConversion conversions[] = {
+        { ImageComponentRGBA, ImageComponentRGB, 3 },
+        { ImageComponentRGB, ImageComponentRGBA, 3 },
+        { ImageComponentRGBA, ImageComponentAlpha, 3 },
+        { ImageComponentRGBA, ImageComponentAlpha, 0 },
+        { ImageComponentRGBA, ImageComponentAlpha, -1 },
+        { ImageComponentRGB, ImageComponentAlpha, 1 },
+        { ImageComponentAlpha, ImageComponentRGB, 3 },
+        { ImageComponentAlpha, ImageComponentRGBA, 3 },
+    };
+    for (U32 i = 0; i < sizeof(conversions) / sizeof(conversions[0]); ++i) {
+        const ComponentsConversion& c = conversions[i];
+        bool colorToColor = c.src != ImageComponentAlpha && c.dst != ImageComponentAlpha;
+        for (int sd = 0; sd < 3; ++sd) {
+            for (int dd = 0; dd < 3; ++dd) {
+                for (int scs = 0; scs < 3; ++scs) {
+                    for (int dcs = 0; dcs < 3; ++dcs) {
+                        ///the reference converted through linear when both color-spaces are the same (with dithering),
+                        ///and left float pixels uninitialized when converting to a color-space
+                        if (colorToColor && ((scs == dcs && scs != 0) || (depths[dd] == IMAGE_FLOAT && dcs != 0))) {
+                            continue;
+                        }
+                        for (int invert = 0; invert < 2; ++invert) {
+                            checkConversionMatchesReference(c.src, depths[sd], c.dst, depths[dd],
+                                                            colorSpaces[scs], colorSpaces[dcs], c.channelForAlpha, invert);
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+TEST(ImageConversion,SameColorSpaceIsNotConverted) {
+    RectI rod(0,0,37,5);
+    boost::shared_ptr<Image> src = makeImage(ImageComponentRGB, IMAGE_BYTE, rod);
+    boost::shared_ptr<Image> dst = makeImage(ImageComponentRGBA, IMAGE_BYTE, rod);
+    src->convertToFormat(rod, dst.get(), Natron::sRGB, Natron::sRGB, 3, false, false);
+    for (int y = rod.y1; y < rod.y2; ++y) {
+        const unsigned char* srcPix = src->pixelAt(0, y);
+        const unsigned char* dstPix = dst->pixelAt(0, y);
+        for (int x = 0; x < rod.width(); ++x, srcPix += 3, dstPix += 4) {
+            EXPECT_EQ(srcPix[0], dstPix[0]);
+            EXPECT_EQ(srcPix[1], dstPix[1]);
+            EXPECT_EQ(srcPix[2], dstPix[2]);
+            EXPECT_EQ(255, dstPix[3]);
+        }
+    }
+}
+
+TEST(ImageConversion,AlphaIsNotConvertedFromColorSpace) {
+    RectI rod(0,0,37,5);
+    boost::shared_ptr<Image> src = makeImage(ImageComponentAlpha, IMAGE_BYTE, rod);
+    boost::shared_ptr<Image> dst = makeImage(ImageComponentAlpha, IMAGE_FLOAT, rod);
+    src->convertToFormat(rod, dst.get(), Natron::sRGB, Natron::Linear, -1, false, true);
+    for (int y = rod.y1; y < rod.y2; ++y) {
+        const unsigned char* srcPix = src->pixelAt(0, y);
+        const float* dstPix = (const float*)dst->pixelAt(0, y);
+        for (int x = 0; x < rod.width(); ++x) {
+            EXPECT_EQ(Natron::Color::intToFloat<256>(srcPix[x]), dstPix[x]);
+        }
+    }
+    ///the bitmap is copied
+    EXPECT_TRUE(dst->getRestToRender(rod) == src->getRestToRender(rod));
+}
+
+///Large images are converted by bands of scan-lines on the TaskScheduler of the application
+TEST_F(BaseTest,ImageConversionByBandsMatchesReference) {
+    RectI rod(0,0,1023,517);
+    boost::shared_ptr<Image> src = makeImage(ImageComponentRGBA, IMAGE_FLOAT, rod);
+    boost::shared_ptr<Image> dst = makeImage(ImageComponentRGBA, IMAGE_BYTE, rod);
+    boost::shared_ptr<Image> expected = makeImage(ImageComponentRGBA, IMAGE_BYTE, rod);
+    src->convertToFormat(rod, dst.get(), Natron::Linear, Natron::sRGB, 3, false, false);
+    referenceConvertToFormat(*src, rod, expected.get(), Natron::Linear, Natron::sRGB, 3, false);
+    EXPECT_TRUE(samePixels(*expected, *dst));
+}
+
+///Not really a test: prints the time taken by the conversions of a 4K image most used when fetching cached images
+///with another format, with the reference and with convertToFormat (on the calling thread only).
+TEST(ImageConversion,DISABLED_Benchmark) {
+    RectI rod(0,0,3840,2160);
+    const int iterations = 3;
+    struct Conversion
+    {
+        const char* name;
+        Natron::ImageComponents srcComps;
+        Natron::ImageBitDepth srcDepth;
+        Natron::ViewerColorSpace srcColorSpace;
+        Natron::ImageComponents dstComps;
+        Natron::ImageBitDepth dstDepth;
+        Natron::ViewerColorSpace dstColorSpace;
+    };
+    const Conversion conversions[] = {
+        { "float RGBA to 8 bits sRGB RGBA", ImageComponentRGBA, IMAGE_FLOAT, Natron::Linear, ImageComponentRGBA, IMAGE_BYTE, Natron::sRGB },
+        { "8 bits sRGB RGBA to float RGBA", ImageComponentRGBA, IMAGE_BYTE, Natron::sRGB, ImageComponentRGBA, IMAGE_FLOAT, Natron::Linear },
+        { "float RGBA to 8 bits linear RGBA", ImageComponentRGBA, IMAGE_FLOAT, Natron::Linear, ImageComponentRGBA, IMAGE_BYTE, Natron::Linear },
+        { "float RGBA to 16 bits linear RGBA", ImageComponentRGBA, IMAGE_FLOAT, Natron::Linear, ImageComponentRGBA, IMAGE_SHORT, Natron::Linear },
+        { "float RGB to float RGBA", ImageComponentRGB, IMAGE_FLOAT, Natron::Linear, ImageComponentRGBA, IMAGE_FLOAT, Natron::Linear },
+        { "float RGBA to float alpha", ImageComponentRGBA, IMAGE_FLOAT, Natron::Linear, ImageComponentAlpha, IMAGE_FLOAT, Natron::Linear },
+    };
+    for (U32 i = 0; i < sizeof(conversions) / sizeof(conversions[0]); ++i) {
+        const Conversion& c = conversions[i];
+        boost::shared_ptr<Image> src = makeImage(c.srcComps, c.srcDepth, rod);
+        boost::shared_ptr<Image> dst = makeImage(c.dstComps, c.dstDepth, rod);
+        QElapsedTimer timer;
+        timer.start();
+        for (int it = 0; it < iterations; ++it) {
+            referenceConvertToFormat(*src, rod, dst.get(), c.srcColorSpace, c.dstColorSpace, 3, false);
+        }
+        double referenceTime = (double)timer.elapsed() / iterations;
+        timer.restart();
+        for (int it = 0; it < iterations; ++it) {
+            src->convertToFormat(rod, dst.get(), c.srcColorSpace, c.dstColorSpace, 3, false, false);
+        }
+        double kernelsTime = (double)timer.elapsed() / iterations;
+        std::cout << "[ImageConversion] " << c.name << ": reference " << referenceTime << " ms, kernels "
+        << kernelsTime << " ms per frame" << std::endl;
+    }
+}
@@ -9,9 +9,11 @@
  *
  */
 
-#include <cstring>
+#include <vector>
+#include <algorithm>
 #include <gtest/gtest.h>
 #include "Engine/Image.h"
+#include "Engine/ImageParams.h"
 
 
 TEST(BitmapTest,SimpleRect) {
@@ -27,9 +29,12 @@ TEST(BitmapTest,SimpleRect) {
 
     ASSERT_TRUE(rod == nonRenderedRectsUnion);
 
-    ///assert that the "underlying" bitmap is clean
-    const char* map = bm.getBitmap();
-    ASSERT_TRUE(!memchr(map,1,rod.area()));
+    ///assert that the bitmap is clean
+    for (int y = rod.y1; y < rod.y2; ++y) {
+        for (int x = rod.x1; x < rod.x2; ++x) {
+            ASSERT_FALSE(bm.isMarked(x,y));
+        }
+    }
 
     RectI halfRoD(0,0,100,50);
     bm.markForRendered(halfRoD);
@@ -42,22 +47,128 @@ TEST(BitmapTest,SimpleRect) {
     }
 
 
-    ///assert that the underlying bitmap is marked as expected
-    const char* start = map;
-
-    ///check that there are only ones in the rendered half
-    ASSERT_TRUE(!memchr(start,0,halfRoD.area()));
-
-    ///check that there are only 0s in the non rendered half
-    start = map + halfRoD.area();
-    ASSERT_TRUE(!memchr(start,1,halfRoD.area()));
+    ///assert that the bitmap is marked as expected: only the rendered half is marked
+    for (int y = rod.y1; y < rod.y2; ++y) {
+        for (int x = rod.x1; x < rod.x2; ++x) {
+            ASSERT_EQ(y < halfRoD.y2,bm.isMarked(x,y));
+        }
+    }
 
     ///mark for renderer the other half of the rod
     bm.markForRendered(nonRenderedHalf);
 
     ///assert that the bm is rendered totally
     ASSERT_TRUE(bm.minimalNonMarkedRects(rod).empty());
-    ASSERT_TRUE(!memchr(map,0,rod.area()));
+    for (int y = rod.y1; y < rod.y2; ++y) {
+        for (int x = rod.x1; x < rod.x2; ++x) {
+            ASSERT_TRUE(bm.isMarked(x,y));
+        }
+    }
+}
+
+namespace {
+
+///Small deterministic generator so that failures are reproducible
+int
+nextRandom(unsigned int* state,int range)
+{
+    *state = *state * 1103515245u + 12345u;
+    return (int)((*state >> 16) % (unsigned int)range);
+}
+
+RectI
+randomRect(unsigned int* state,const RectI& bounds)
+{
+    int x1 = bounds.x1 + nextRandom(state,bounds.width());
+    int y1 = bounds.y1 + nextRandom(state,bounds.height());
+    int x2 = x1 + 1 + nextRandom(state,bounds.x2 - x1);
+    int y2 = y1 + 1 + nextRandom(state,bounds.y2 - y1);
+    return RectI(x1,y1,x2,y2);
+}
+
+}
+
+TEST(BitmapTest,MatchesPerPixelReference) {
+    ///the interval representation must behave exactly like one flag per pixel
+    RectI rod(-20,-10,80,70);
+    Natron::Bitmap bm(rod);
+    Natron::Bitmap other(rod);
+    std::vector<char> reference(rod.area(),0);
+    std::vector<char> otherReference(rod.area(),0);
+    unsigned int state = 1;
+
+    for (int iteration = 0; iteration < 300; ++iteration) {
+        RectI r = randomRect(&state,rod);
+        int op = nextRandom(&state,4);
+        if (op == 0) {
+            other.markForRendered(r);
+            for (int y = r.y1; y < r.y2; ++y) {
+                std::fill(&otherReference[(y - rod.y1) * rod.width() + r.x1 - rod.x1],
+                          &otherReference[(y - rod.y1) * rod.width() + r.x2 - rod.x1],1);
+            }
+        } else if (op == 1) {
+            bm.copyFrom(other,r);
+            for (int y = r.y1; y < r.y2; ++y) {
+                for (int x = r.x1; x < r.x2; ++x) {
+                    reference[(y - rod.y1) * rod.width() + x - rod.x1] = otherReference[(y - rod.y1) * rod.width() + x - rod.x1];
+                }
+            }
+        } else if (op == 2 && nextRandom(&state,10) == 0) {
+            bm.clear();
+            std::fill(reference.begin(),reference.end(),0);
+        } else {
+            bm.markForRendered(r);
+            for (int y = r.y1; y < r.y2; ++y) {
+                std::fill(&reference[(y - rod.y1) * rod.width() + r.x1 - rod.x1],
+                          &reference[(y - rod.y1) * rod.width() + r.x2 - rod.x1],1);
+            }
+        }
+
+        for (int y = rod.y1; y < rod.y2; ++y) {
+            for (int x = rod.x1; x < rod.x2; ++x) {
+                ASSERT_EQ(reference[(y - rod.y1) * rod.width() + x - rod.x1] != 0,bm.isMarked(x,y));
+            }
+        }
+
+        ///the bbox must be the exact bounding box of the unmarked pixels of the roi and the rects must cover them
+        RectI roi = randomRect(&state,rod);
+        RectI expectedBbox;
+        bool hasUnmarked = false;
+        for (int y = roi.y1; y < roi.y2; ++y) {
+            for (int x = roi.x1; x < roi.x2; ++x) {
+                if (!reference[(y - rod.y1) * rod.width() + x - rod.x1]) {
+                    if (!hasUnmarked) {
+                        expectedBbox = RectI(x,y,x + 1,y + 1);
+                        hasUnmarked = true;
+                    } else {
+                        expectedBbox.merge(RectI(x,y,x + 1,y + 1));
+                    }
+                }
+            }
+        }
+        RectI bbox = bm.minimalNonMarkedBbox(roi);
+        ASSERT_EQ(hasUnmarked,!bbox.isNull());
+        if (hasUnmarked) {
+            ASSERT_TRUE(bbox == expectedBbox);
+        }
+
+        std::list<RectI> rects = bm.minimalNonMarkedRects(roi);
+        for (std::list<RectI>::iterator it = rects.begin(); it != rects.end(); ++it) {
+            ASSERT_FALSE(it->isNull());
+            ASSERT_TRUE(roi.contains(*it));
+        }
+        for (int y = roi.y1; y < roi.y2; ++y) {
+            for (int x = roi.x1; x < roi.x2; ++x) {
+                if (!reference[(y - rod.y1) * rod.width() + x - rod.x1]) {
+                    bool covered = false;
+                    for (std::list<RectI>::iterator it = rects.begin(); it != rects.end(); ++it) {
+                        covered |= it->contains(x,y);
+                    }
+                    ASSERT_TRUE(covered);
+                }
+            }
+        }
+    }
 }
 
 TEST(ImageKeyTest,Equality) {
@@ -114,3 +225,124 @@ TEST(ImageKeyTest,Difference) {
 
 }
 
+
+TEST(ImageKeyTest,Tiles) {
+    Natron::ImageKey key(1234,10,1,0,1.);
+    Natron::ImageKey tile1 = key.makeTileKey(256,0,0);
+    Natron::ImageKey tile2 = key.makeTileKey(256,1,0);
+    Natron::ImageKey tile3 = key.makeTileKey(256,0,1);
+    Natron::ImageKey tile4 = key.makeTileKey(128,0,0);
+
+    ASSERT_FALSE(key.isTile());
+    ASSERT_TRUE(tile1.isTile());
+    ASSERT_FALSE(key == tile1);
+    ASSERT_TRUE(key.getHash() != tile1.getHash());
+    ASSERT_TRUE(tile1.getHash() != tile2.getHash());
+    ASSERT_TRUE(tile1.getHash() != tile3.getHash());
+    ASSERT_TRUE(tile2.getHash() != tile3.getHash());
+    ASSERT_TRUE(tile1.getHash() != tile4.getHash());
+    ASSERT_TRUE(tile1 == key.makeTileKey(256,0,0));
+    ASSERT_TRUE(tile1.getHash() == key.makeTileKey(256,0,0).getHash());
+
+    ///tiles are removed along with the image when the node hash changes
+    ASSERT_EQ(key.getTreeVersion(),tile1.getTreeVersion());
+}
+
+TEST(ImageKeyTest,Variants) {
+    Natron::ImageKey key(1234,10,1,0,1.);
+    Natron::ImageKey rgbaByte = key.makeVariantKey(Natron::ImageComponentRGBA,Natron::IMAGE_BYTE);
+    Natron::ImageKey rgbaFloat = key.makeVariantKey(Natron::ImageComponentRGBA,Natron::IMAGE_FLOAT);
+    Natron::ImageKey rgbFloat = key.makeVariantKey(Natron::ImageComponentRGB,Natron::IMAGE_FLOAT);
+
+    ASSERT_FALSE(key.isVariant());
+    ASSERT_TRUE(rgbaByte.isVariant());
+    ASSERT_FALSE(key == rgbaFloat);
+    ASSERT_TRUE(key.getHash() != rgbaFloat.getHash());
+    ASSERT_TRUE(rgbaByte.getHash() != rgbaFloat.getHash());
+    ASSERT_TRUE(rgbaFloat.getHash() != rgbFloat.getHash());
+    ASSERT_TRUE(rgbFloat == key.makeVariantKey(Natron::ImageComponentRGB,Natron::IMAGE_FLOAT));
+    ASSERT_TRUE(rgbFloat.getHash() == key.makeVariantKey(Natron::ImageComponentRGB,Natron::IMAGE_FLOAT).getHash());
+
+    ///variants are removed along with the image when the node hash changes
+    ASSERT_EQ(key.getTreeVersion(),rgbFloat.getTreeVersion());
+}
+
+TEST(ImageTest,VariantParams) {
+    RectI rod(0,0,100,50);
+    boost::shared_ptr<Natron::ImageParams> params = Natron::Image::makeParams(0,rod,0,true,Natron::ImageComponentRGB,
+                                                                              Natron::IMAGE_FLOAT,-1,0,
+                                                                              std::map<int, std::vector<RangeD> >());
+    boost::shared_ptr<Natron::ImageParams> variant = Natron::Image::makeVariantParams(0,*params,Natron::ImageComponentRGBA,
+                                                                                      Natron::IMAGE_BYTE);
+    EXPECT_TRUE(variant->getRoD() == params->getRoD());
+    EXPECT_TRUE(variant->getPixelRoD() == params->getPixelRoD());
+    EXPECT_TRUE(variant->isRodProjectFormat());
+    EXPECT_EQ(Natron::ImageComponentRGBA,variant->getComponents());
+    EXPECT_EQ(Natron::IMAGE_BYTE,variant->getBitDepth());
+    ///the variant is accounted for its own size in the cache
+    EXPECT_EQ(rod.area() * 4,(int)variant->getElementsCount());
+    EXPECT_TRUE(*variant == *Natron::Image::makeVariantParams(0,*params,Natron::ImageComponentRGBA,Natron::IMAGE_BYTE));
+    EXPECT_TRUE(*variant != *Natron::Image::makeVariantParams(0,*params,Natron::ImageComponentRGBA,Natron::IMAGE_FLOAT));
+}
+
+TEST(ImageTest,TileGrid) {
+    ///a RoD with negative coordinates, not aligned on the tiles
+    RectI pixelRoD(-300,-10,700,300);
+    const int tileSize = 256;
+
+    int tileX1,tileY1,tileX2,tileY2;
+    Natron::Image::getTilesRange(pixelRoD,tileSize,&tileX1,&tileY1,&tileX2,&tileY2);
+    EXPECT_EQ(-2,tileX1);
+    EXPECT_EQ(-1,tileY1);
+    EXPECT_EQ(3,tileX2);
+    EXPECT_EQ(2,tileY2);
+
+    ///the tiles cover exactly the RoD, without overlapping
+    U64 area = 0;
+    RectI tilesUnion = Natron::Image::getTileBounds(pixelRoD,tileSize,tileX1,tileY1);
+    for (int y = tileY1; y < tileY2; ++y) {
+        for (int x = tileX1; x < tileX2; ++x) {
+            RectI bounds = Natron::Image::getTileBounds(pixelRoD,tileSize,x,y);
+            ASSERT_FALSE(bounds.isNull());
+            ASSERT_TRUE(bounds.width() <= tileSize && bounds.height() <= tileSize);
+            area += bounds.area();
+            tilesUnion.merge(bounds);
+        }
+    }
+    EXPECT_EQ((U64)pixelRoD.area(),area);
+    EXPECT_TRUE(tilesUnion == pixelRoD);
+
+    EXPECT_TRUE(Natron::Image::getTileBounds(pixelRoD,tileSize,5,5).isNull());
+
+    ///a single pixel is covered by a single tile
+    Natron::Image::getTilesRange(RectI(255,256,256,257),tileSize,&tileX1,&tileY1,&tileX2,&tileY2);
+    EXPECT_EQ(0,tileX1);
+    EXPECT_EQ(1,tileY1);
+    EXPECT_EQ(1,tileX2);
+    EXPECT_EQ(2,tileY2);
+}
+
+TEST(ImageTest,CopyBetweenDifferentBounds) {
+    ///copying a tile into a larger image and back must preserve the pixels and the bitmap
+    Natron::Image tile(Natron::ImageComponentRGBA,RectI(256,0,512,256),0,Natron::IMAGE_FLOAT);
+    Natron::Image image(Natron::ImageComponentRGBA,RectI(0,0,768,256),0,Natron::IMAGE_FLOAT);
+    tile.fill(RectI(256,0,512,256),0.25f,1.f);
+    tile.markForRendered(RectI(300,10,400,20));
+    image.fill(RectI(0,0,768,256),0.f,0.f);
+
+    image.copy(tile,tile.getPixelRoD(),true);
+    EXPECT_EQ(0.25f,((const float*)image.pixelAt(256,0))[0]);
+    EXPECT_EQ(0.25f,((const float*)image.pixelAt(511,255))[0]);
+    EXPECT_EQ(0.f,((const float*)image.pixelAt(255,0))[0]);
+    EXPECT_EQ(0.f,((const float*)image.pixelAt(512,0))[0]);
+    EXPECT_TRUE(image.isPixelRendered(300,10));
+    EXPECT_FALSE(image.isPixelRendered(299,10));
+
+    image.fill(RectI(400,100,500,200),0.5f,1.f);
+    image.markForRendered(RectI(400,100,500,200));
+    tile.copy(image,tile.getPixelRoD(),true);
+    EXPECT_EQ(0.5f,((const float*)tile.pixelAt(400,100))[0]);
+    EXPECT_EQ(0.25f,((const float*)tile.pixelAt(399,100))[0]);
+    EXPECT_TRUE(tile.isPixelRendered(450,150));
+    EXPECT_TRUE(tile.getRestToRender(RectI(400,100,500,200)).empty());
+}
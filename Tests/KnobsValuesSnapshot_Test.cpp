@@ -0,0 +1,227 @@
+//  Natron
+//
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "BaseTest.h"
+
+#include <iostream>
+#include <map>
+
+#include <boost/scoped_ptr.hpp>
+
+#include <QtCore/QThread>
+#include <QtCore/QElapsedTimer>
+
+#include <ofxParam.h>
+#include <ofxhParam.h>
+
+#include "Engine/Node.h"
+#include "Engine/EffectInstance.h"
+#include "Engine/OfxEffectInstance.h"
+#include "Engine/Knob.h"
+
+using namespace Natron;
+
+namespace {
+
+///Returns all the double parameters declared by the plug-in.
+std::vector<Knob<double>*>
+getDoubleKnobs(const boost::shared_ptr<Node>& node)
+{
+    std::vector<Knob<double>*> ret;
+    const std::vector< boost::shared_ptr<KnobI> >& knobs = node->getLiveInstance()->getKnobs();
+    for (U32 i = 0; i < knobs.size(); ++i) {
+        Knob<double>* isDouble = dynamic_cast<Knob<double>*>(knobs[i].get());
+        if (isDouble && knobs[i]->isDeclaredByPlugin()) {
+            ret.push_back(isDouble);
+        }
+    }
+    return ret;
+}
+
+///Returns the handles of the parameters of the plug-in that paramGetValue returns as doubles.
+std::vector<OfxParamHandle>
+getDoubleParamHandles(const boost::shared_ptr<Node>& node)
+{
+    std::vector<OfxParamHandle> ret;
+    OfxEffectInstance* effect = dynamic_cast<OfxEffectInstance*>(node->getLiveInstance());
+    if (!effect) {
+        return ret;
+    }
+    const std::map<std::string, OFX::Host::Param::Instance*>& params = effect->effectInstance()->getParams();
+    for (std::map<std::string, OFX::Host::Param::Instance*>::const_iterator it = params.begin(); it != params.end(); ++it) {
+        const std::string& type = it->second->getType();
+        if (type == kOfxParamTypeDouble || type == kOfxParamTypeDouble2D || type == kOfxParamTypeDouble3D ||
+            type == kOfxParamTypeRGB || type == kOfxParamTypeRGBA) {
+            ret.push_back(it->second->getHandle());
+        }
+    }
+    return ret;
+}
+
+///Simulates the tiles of a render fetching all the parameters of an OpenFX effect through the parameter suite,
+///like a plug-in calling paramGetValue at the start of its render action. With a snapshot the thread reads the
+///parameters as a render thread does, otherwise as the main thread does.
+class ParamFetchThread : public QThread
+{
+public:
+
+    ParamFetchThread(EffectInstance* effect,
+                     const std::vector<OfxParamHandle>& params,
+                     const boost::shared_ptr<const KnobsValuesSnapshot>& snapshot,
+                     int tilesCount)
+    : QThread()
+    , _effect(effect)
+    , _params(params)
+    , _snapshot(snapshot)
+    , _tilesCount(tilesCount)
+    , _sum(0.)
+    {
+    }
+
+    double getSum() const { return _sum; }
+
+private:
+
+    virtual void run() OVERRIDE FINAL
+    {
+        const OfxParameterSuiteV1* suite = (const OfxParameterSuiteV1*)OFX::Host::Param::GetSuite(1);
+        boost::scoped_ptr<EffectInstance::KnobsValuesSnapshotScope> scope;
+        if (_snapshot) {
+            scope.reset(new EffectInstance::KnobsValuesSnapshotScope(_effect,_snapshot));
+        }
+        for (int t = 0; t < _tilesCount; ++t) {
+            for (U32 i = 0; i < _params.size(); ++i) {
+                ///the suite reads as many values as the parameter has dimensions
+                double v[4] = { 0., 0., 0., 0. };
+                suite->paramGetValue(_params[i], &v[0], &v[1], &v[2], &v[3]);
+                _sum += v[0] + v[1] + v[2] + v[3];
+            }
+        }
+    }
+
+    EffectInstance* _effect;
+    std::vector<OfxParamHandle> _params;
+    boost::shared_ptr<const KnobsValuesSnapshot> _snapshot;
+    int _tilesCount;
+    double _sum;
+};
+
+}
+
+TEST_F(BaseTest,KnobsValuesSnapshotIsImmutable) {
+    boost::shared_ptr<Node> gain = createNode(_gainPluginID);
+    ASSERT_TRUE(gain);
+    std::vector<Knob<double>*> knobs = getDoubleKnobs(gain);
+    ASSERT_FALSE(knobs.empty());
+    Knob<double>* param = knobs.front();
+
+    param->setValue(2.,0);
+    KnobsValuesSnapshot snapshot(gain->getLiveInstance(),0);
+    double v;
+    ASSERT_TRUE(snapshot.getValue(param,0,&v));
+    EXPECT_EQ(2.,v);
+    EXPECT_FALSE(snapshot.getValue(param,param->getDimension(),&v));
+
+    ///Editing the knob after the capture does not change what the render reads
+    param->setValue(3.,0);
+    ASSERT_TRUE(snapshot.getValue(param,0,&v));
+    EXPECT_EQ(2.,v);
+
+    ///Animated knobs are captured at the time of the render
+    param->setValueAtTime(0,0.,0);
+    param->setValueAtTime(10,10.,0);
+    KnobsValuesSnapshot animatedSnapshot(gain->getLiveInstance(),5);
+    ASSERT_TRUE(animatedSnapshot.getValue(param,0,&v));
+    EXPECT_EQ(param->getValueAtTime(5,0),v);
+    EXPECT_EQ(5,animatedSnapshot.getTime());
+
+    ///The main thread is not rendering: the knob is read normally
+    EXPECT_TRUE(gain->getLiveInstance()->getKnobsValuesSnapshot() == NULL);
+
+    ///A thread rendering the effect reads the snapshot, even through the knob
+    param->removeAnimation(0);
+    param->setValue(2.,0);
+    boost::shared_ptr<const KnobsValuesSnapshot> renderSnapshot(new KnobsValuesSnapshot(gain->getLiveInstance(),0));
+    param->setValue(3.,0);
+    {
+        EffectInstance::KnobsValuesSnapshotScope scope(gain->getLiveInstance(),renderSnapshot);
+        EXPECT_TRUE(gain->getLiveInstance()->getKnobsValuesSnapshot() == renderSnapshot.get());
+        EXPECT_EQ(2.,param->getValue(0));
+    }
+    EXPECT_TRUE(gain->getLiveInstance()->getKnobsValuesSnapshot() == NULL);
+    EXPECT_EQ(3.,param->getValue(0));
+}
+
+///Not really a test: prints the cost of fetching all the parameters of an OpenFX effect once per tile from many
+///threads through paramGetValue, reading the knobs (what a thread which is not rendering does) versus reading the
+///snapshot captured by the render. Also prints what the snapshot adds to the reads of the threads which are not
+///rendering (a virtual call and a thread storage lookup) and to each renderRoIInternal call (the capture).
+TEST_F(BaseTest,DISABLED_KnobsValuesSnapshotBenchmark) {
+    boost::shared_ptr<Node> gain = createNode(_gainPluginID);
+    ASSERT_TRUE(gain);
+    EffectInstance* effect = gain->getLiveInstance();
+    std::vector<OfxParamHandle> params = getDoubleParamHandles(gain);
+    ASSERT_FALSE(params.empty());
+    std::vector<Knob<double>*> knobs = getDoubleKnobs(gain);
+    ASSERT_FALSE(knobs.empty());
+
+    boost::shared_ptr<const KnobsValuesSnapshot> snapshot(new KnobsValuesSnapshot(effect,0));
+    int threadsCount = std::max(QThread::idealThreadCount(),4);
+    const int tilesCount = 100000;
+    const char* names[2] = { "knobs", "snapshot" };
+    double sums[2] = { 0., 0. };
+    for (int s = 0; s < 2; ++s) {
+        std::vector<ParamFetchThread*> threads;
+        for (int i = 0; i < threadsCount; ++i) {
+            threads.push_back(new ParamFetchThread(effect,params,s == 0 ? boost::shared_ptr<const KnobsValuesSnapshot>() : snapshot,
+                                                   tilesCount));
+        }
+        QElapsedTimer timer;
+        timer.start();
+        for (int i = 0; i < threadsCount; ++i) {
+            threads[i]->start();
+        }
+        for (int i = 0; i < threadsCount; ++i) {
+            threads[i]->wait();
+            sums[s] += threads[i]->getSum();
+            delete threads[i];
+        }
+        qint64 elapsed = std::max(timer.elapsed(),(qint64)1);
+        std::cout << "[paramGetValue] " << names[s] << ", " << threadsCount << " threads, " << params.size() << " parameters per tile: "
+        << (elapsed * 1000000.) / ((double)threadsCount * tilesCount) << " ns per tile" << std::endl;
+    }
+    EXPECT_EQ(sums[0],sums[1]);
+
+    ///The main thread is not rendering: every getValue() looks up the snapshot in vain before reading the knob
+    const int readsCount = 10000000;
+    double sum = 0.;
+    QElapsedTimer timer;
+    timer.start();
+    for (int i = 0; i < readsCount; ++i) {
+        sum += knobs[i % knobs.size()]->getValue(0);
+    }
+    double getValueNs = (timer.nsecsElapsed() / (double)readsCount);
+    int found = 0;
+    timer.restart();
+    for (int i = 0; i < readsCount; ++i) {
+        found += effect->getKnobsValuesSnapshot() != NULL;
+    }
+    double lookupNs = (timer.nsecsElapsed() / (double)readsCount);
+    EXPECT_EQ(0,found);
+    std::cout << "[getValue] not rendering: " << getValueNs << " ns per read, of which " << lookupNs
+    << " ns looking up the snapshot (" << sum << ")" << std::endl;
+
+    ///The capture made by each renderRoIInternal call which has something to render
+    const int capturesCount = 100000;
+    timer.restart();
+    for (int i = 0; i < capturesCount; ++i) {
+        KnobsValuesSnapshot capture(effect,i);
+        found += capture.getTime() == i;
+    }
+    EXPECT_EQ(capturesCount,found);
+    std::cout << "[renderRoIInternal] capture of " << effect->getKnobs().size() << " knobs: "
+    << (timer.nsecsElapsed() / 1000.) / capturesCount << " us per render" << std::endl;
+}
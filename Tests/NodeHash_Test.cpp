@@ -0,0 +1,101 @@
+//  Natron
+//
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "BaseTest.h"
+
+#include "Engine/Node.h"
+#include "Engine/Project.h"
+#include "Engine/AppManager.h"
+#include "Engine/AppInstance.h"
+#include "Engine/EffectInstance.h"
+#include "Engine/Image.h"
+#include "Engine/Knob.h"
+#include "Engine/Settings.h"
+
+using namespace Natron;
+
+namespace {
+
+///Returns the first double parameter declared by the plug-in, or NULL.
+Knob<double>*
+findDoubleKnob(const boost::shared_ptr<Node>& node)
+{
+    const std::vector< boost::shared_ptr<KnobI> >& knobs = node->getLiveInstance()->getKnobs();
+    for (U32 i = 0; i < knobs.size(); ++i) {
+        Knob<double>* isDouble = dynamic_cast<Knob<double>*>(knobs[i].get());
+        if (isDouble && knobs[i]->isDeclaredByPlugin()) {
+            return isDouble;
+        }
+    }
+    return NULL;
+}
+
+}
+
+class NodeHashTest : public BaseTest
+{
+protected:
+
+    virtual void SetUp()
+    {
+        BaseTest::SetUp();
+        appPTR->getCurrentSettings()->setContentBasedNodeHashEnabled(true);
+    }
+
+    virtual void TearDown()
+    {
+        appPTR->getCurrentSettings()->setContentBasedNodeHashEnabled(false);
+        BaseTest::TearDown();
+    }
+
+    ///Creates Dot Generator -> Gain in the given app and returns the Gain node.
+    boost::shared_ptr<Node> createGraph(AppInstance* app)
+    {
+        boost::shared_ptr<Node> generator = app->createNode(_dotGeneratorPluginID,true,-1,-1,false);
+        boost::shared_ptr<Node> gain = app->createNode(_gainPluginID,true,-1,-1,false);
+        EXPECT_TRUE(generator && gain);
+        EXPECT_TRUE(app->getProject()->connectNodes(0,generator,gain));
+        return gain;
+    }
+};
+
+TEST_F(NodeHashTest,IdenticalGraphsProduceIdenticalKeys) {
+    boost::shared_ptr<Node> gain = createGraph(_app);
+    ASSERT_TRUE(gain);
+
+    ///Same graph in another project: the names and project creation times are different
+    AppInstance* otherApp = appPTR->newAppInstance();
+    ASSERT_TRUE(otherApp != NULL);
+    boost::shared_ptr<Node> otherGain = createGraph(otherApp);
+    ASSERT_TRUE(otherGain);
+    otherGain->setName("SomeOtherName");
+
+    EXPECT_EQ(gain->getHashValue(),otherGain->getHashValue());
+    EXPECT_TRUE(Image::makeKey(gain->getHashValue(),0,0,0) == Image::makeKey(otherGain->getHashValue(),0,0,0));
+    EXPECT_EQ(Image::makeKey(gain->getHashValue(),0,0,0).getHash(),
+              Image::makeKey(otherGain->getHashValue(),0,0,0).getHash());
+
+    ///Editing a parameter must change the key...
+    Knob<double>* param = findDoubleKnob(otherGain);
+    ASSERT_TRUE(param != NULL);
+    double originalValue = param->getValue(0);
+    param->setValue(originalValue + 1.,0);
+    EXPECT_NE(gain->getHashValue(),otherGain->getHashValue());
+
+    ///...and setting it back must give the same key again, whatever the edit history
+    param->setValue(originalValue,0);
+    EXPECT_EQ(gain->getHashValue(),otherGain->getHashValue());
+
+    otherApp->quit();
+}
+
+TEST_F(NodeHashTest,LegacyHashDependsOnTheNode) {
+    appPTR->getCurrentSettings()->setContentBasedNodeHashEnabled(false);
+    boost::shared_ptr<Node> gain = createGraph(_app);
+    boost::shared_ptr<Node> otherGain = createGraph(_app);
+    ASSERT_TRUE(gain && otherGain);
+    EXPECT_NE(gain->getHashValue(),otherGain->getHashValue());
+}
@@ -0,0 +1,71 @@
+//  Natron
+//
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <string>
+#include <gtest/gtest.h>
+
+#include <QtCore/QDir>
+#include <QtCore/QDateTime>
+#include <QtGui/QImage>
+#include <QtGui/QColor>
+
+#include "Gui/QtDecoder.h"
+
+namespace {
+
+///Writes a small gradient, of an odd size so that rows aren't aligned, and returns its path
+std::string
+writeTestImage(const QString& name)
+{
+    QImage img(37,23,QImage::Format_ARGB32);
+    for (int y = 0; y < img.height(); ++y) {
+        for (int x = 0; x < img.width(); ++x) {
+            img.setPixel(x,y,qRgba(x * 6,y * 10,(x + y) * 4,255 - x));
+        }
+    }
+    QString path = QDir::temp().absoluteFilePath(name);
+    img.save(path,"PNG");
+    return path.toStdString();
+}
+
+}
+
+TEST(QtDecodedFrame,ReusesTheLastDecodedImage) {
+    std::string filename = writeTestImage("NatronQtDecodedFrame1.png");
+    std::string other = writeTestImage("NatronQtDecodedFrame2.png");
+    QtDecodedFrame frame;
+    EXPECT_TRUE(frame.find(filename).isNull());
+
+    QImage decoded(filename.c_str());
+    ASSERT_FALSE(decoded.isNull());
+    frame.set(filename,QtDecodedFrame::lastModified(filename),decoded);
+
+    ///the image kept is shared, not copied
+    QImage found = frame.find(filename);
+    ASSERT_FALSE(found.isNull());
+    EXPECT_EQ(decoded.cacheKey(),found.cacheKey());
+    EXPECT_TRUE(frame.find(other).isNull());
+
+    frame.clear();
+    EXPECT_TRUE(frame.find(filename).isNull());
+
+    QDir::temp().remove("NatronQtDecodedFrame1.png");
+    QDir::temp().remove("NatronQtDecodedFrame2.png");
+}
+
+TEST(QtDecodedFrame,FileChangesAreDecodedAgain) {
+    std::string filename = writeTestImage("NatronQtDecodedFrame3.png");
+    QtDecodedFrame frame;
+    QDateTime modified = QtDecodedFrame::lastModified(filename);
+    frame.set(filename,modified,QImage(filename.c_str()));
+    ASSERT_FALSE(frame.find(filename).isNull());
+
+    ///an image decoded before the file was last written is not reused
+    frame.set(filename,modified.addSecs(-10),QImage(filename.c_str()));
+    EXPECT_TRUE(frame.find(filename).isNull());
+
+    QDir::temp().remove("NatronQtDecodedFrame3.png");
+}
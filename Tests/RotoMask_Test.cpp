@@ -0,0 +1,376 @@
+//  Natron
+//
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <cmath>
+#include <climits>
+#include <algorithm>
+#include <list>
+#include <vector>
+#include <gtest/gtest.h>
+
+#include <cairo/cairo.h>
+
+#include "BaseTest.h"
+#include "Engine/Node.h"
+#include "Engine/Image.h"
+#include "Engine/KnobTypes.h"
+#include "Engine/RotoContext.h"
+#include "Engine/RotoContextPrivate.h"
+
+using namespace Natron;
+
+namespace {
+
+typedef std::list< boost::shared_ptr<BezierCP> > CPs;
+
+///The full-frame rasterizer masks were rendered with before they were rendered by tiles. The feather path it built
+///before cairo_mask() is left out: cairo_mask() ignores the current path.
+void
+renderFullFrameReference(const std::list< boost::shared_ptr<Bezier> >& splines,int time,cairo_t* cr)
+{
+    cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+
+    for (std::list< boost::shared_ptr<Bezier> >::const_iterator it = splines.begin(); it != splines.end(); ++it) {
+        if (!(*it)->isCurveFinished() || !(*it)->isActivated(time)) {
+            continue;
+        }
+        double fallOff = (*it)->getFeatherFallOff(time);
+        double fallOffInverse = 1. / fallOff;
+        double featherDist = (double)(*it)->getFeatherDistance(time);
+        double opacity = (*it)->getOpacity(time);
+        bool inverted = (*it)->getInverted(time);
+        double insideAlpha = inverted ? 1. - opacity : opacity;
+        double outsideAlpha = inverted ? 1. : 0.;
+
+        CPs cps = (*it)->getControlPoints_mt_safe();
+        CPs fps = (*it)->getFeatherPoints_mt_safe();
+        if (cps.empty()) {
+            continue;
+        }
+        if (inverted) {
+            cairo_set_source_rgba(cr, 1.,1.,1., opacity);
+            cairo_paint(cr);
+        }
+
+        CPs::iterator point = cps.begin();
+        CPs::iterator fpoint = fps.begin();
+        CPs::iterator nextPoint = point;
+        ++nextPoint;
+        CPs::iterator nextFPoint = fpoint;
+        ++nextFPoint;
+
+        Point initCp;
+        (*point)->getPositionAtTime(time, &initCp.x,&initCp.y);
+        cairo_set_source_rgba(cr, 1.,1.,1., insideAlpha);
+        cairo_new_path(cr);
+        cairo_move_to(cr, initCp.x,initCp.y);
+        while (point != cps.end()) {
+            if (nextPoint == cps.end()) {
+                nextPoint = cps.begin();
+            }
+            double rightX,rightY,nextX,nextY,nextLeftX,nextLeftY;
+            (*point)->getRightBezierPointAtTime(time, &rightX, &rightY);
+            (*nextPoint)->getLeftBezierPointAtTime(time, &nextLeftX, &nextLeftY);
+            (*nextPoint)->getPositionAtTime(time, &nextX, &nextY);
+            cairo_curve_to(cr, rightX, rightY, nextLeftX, nextLeftY, nextX, nextY);
+            ++point;
+            ++nextPoint;
+        }
+        cairo_fill(cr);
+
+        point = cps.begin();
+        nextPoint = point;
+        ++nextPoint;
+
+        cairo_pattern_t* mesh = cairo_pattern_create_mesh();
+        if (featherDist != 0) {
+            std::list<Point> featherPolygon;
+            std::list<Point> bezierPolygon;
+            std::vector<double> multiples,constants;
+            RectD featherPolyBBox(INT_MAX,INT_MAX,INT_MIN,INT_MIN);
+
+            (*it)->evaluateFeatherPointsAtTime_DeCasteljau(time, 0, 50, &featherPolygon,true,&featherPolyBBox);
+            (*it)->evaluateAtTime_DeCasteljau(time, 0, 50, &bezierPolygon);
+            multiples.resize(featherPolygon.size());
+            constants.resize(featherPolygon.size());
+            Bezier::precomputePointInPolygonTables(featherPolygon, &constants, &multiples);
+
+            std::list<Point>::iterator cur = featherPolygon.begin();
+            std::list<Point>::iterator next = cur;
+            ++next;
+            std::list<Point>::iterator prev = featherPolygon.end();
+            --prev;
+            std::list<Point>::iterator bezIT = bezierPolygon.begin();
+            std::list<Point>::iterator prevBez = bezierPolygon.end();
+            --prevBez;
+            double absFeatherDist = std::abs(featherDist);
+
+            Point p1 = *cur;
+            double norm = std::sqrt((next->x - prev->x) * (next->x - prev->x) + (next->y - prev->y) * (next->y - prev->y));
+            double dx = - ((next->y - prev->y) / norm);
+            double dy = ((next->x - prev->x) / norm);
+            p1.x = cur->x + dx;
+            p1.y = cur->y + dy;
+            bool inside = Bezier::pointInPolygon(p1, featherPolygon, constants, multiples, featherPolyBBox);
+            if ((!inside && featherDist < 0) || (inside && featherDist > 0)) {
+                p1.x = cur->x - dx * absFeatherDist;
+                p1.y = cur->y - dy * absFeatherDist;
+            } else {
+                p1.x = cur->x + dx * absFeatherDist;
+                p1.y = cur->y + dy * absFeatherDist;
+            }
+            Point origin = p1;
+
+            ++prev; ++next; ++cur; ++bezIT; ++prevBez;
+            for (;;++prev,++cur,++next,++bezIT,++prevBez) {
+                if (next == featherPolygon.end()) {
+                    next = featherPolygon.begin();
+                }
+                if (prev == featherPolygon.end()) {
+                    prev = featherPolygon.begin();
+                }
+                if (bezIT == bezierPolygon.end()) {
+                    bezIT = bezierPolygon.begin();
+                }
+                if (prevBez == bezierPolygon.end()) {
+                    prevBez = bezierPolygon.begin();
+                }
+                bool mustStop = false;
+                if (cur == featherPolygon.end()) {
+                    mustStop = true;
+                    cur = featherPolygon.begin();
+                }
+                if (cur->x == prev->x && cur->y == prev->y) {
+                    continue;
+                }
+
+                Point p2,p0p1,p1p0,p2p3,p3p2;
+                if (!mustStop) {
+                    norm = std::sqrt((next->x - prev->x) * (next->x - prev->x) + (next->y - prev->y) * (next->y - prev->y));
+                    dx = - ((next->y - prev->y) / norm);
+                    dy = ((next->x - prev->x) / norm);
+                    p2.x = cur->x + dx;
+                    p2.y = cur->y + dy;
+                    inside = Bezier::pointInPolygon(p2, featherPolygon, constants, multiples, featherPolyBBox);
+                    if ((!inside && featherDist < 0) || (inside && featherDist > 0)) {
+                        p2.x = cur->x - dx * absFeatherDist;
+                        p2.y = cur->y - dy * absFeatherDist;
+                    } else {
+                        p2.x = cur->x + dx * absFeatherDist;
+                        p2.y = cur->y + dy * absFeatherDist;
+                    }
+                } else {
+                    p2 = origin;
+                }
+
+                p0p1.x = (2. * fallOff * prevBez->x + fallOffInverse * p1.x) / (2. * fallOff + fallOffInverse);
+                p0p1.y = (2. * fallOff * prevBez->y + fallOffInverse * p1.y) / (2. * fallOff + fallOffInverse);
+                p1p0.x = (prevBez->x * fallOff + 2. * fallOffInverse * p1.x) / (fallOff + 2. * fallOffInverse);
+                p1p0.y = (prevBez->y * fallOff + 2. * fallOffInverse * p1.y) / (fallOff + 2. * fallOffInverse);
+                p2p3.x = (bezIT->x * fallOff + 2. * fallOffInverse * p2.x) / (fallOff + 2. * fallOffInverse);
+                p2p3.y = (bezIT->y * fallOff + 2. * fallOffInverse * p2.y) / (fallOff + 2. * fallOffInverse);
+                p3p2.x = (2. * fallOff * bezIT->x + fallOffInverse * p2.x) / (2. * fallOff + fallOffInverse);
+                p3p2.y = (2. * fallOff * bezIT->y + fallOffInverse * p2.y) / (2. * fallOff + fallOffInverse);
+
+                cairo_mesh_pattern_begin_patch(mesh);
+                cairo_mesh_pattern_move_to(mesh, prevBez->x,prevBez->y);
+                cairo_mesh_pattern_curve_to(mesh, p0p1.x,p0p1.y,p1p0.x,p1p0.y,p1.x,p1.y);
+                cairo_mesh_pattern_line_to(mesh, p2.x, p2.y);
+                cairo_mesh_pattern_curve_to(mesh, p2p3.x,p2p3.y,p3p2.x,p3p2.y,bezIT->x,bezIT->y);
+                cairo_mesh_pattern_line_to(mesh, prevBez->x, prevBez->y);
+                cairo_mesh_pattern_set_corner_color_rgba(mesh, 0, 1., 1., 1., insideAlpha);
+                cairo_mesh_pattern_set_corner_color_rgba(mesh, 1, 1., 1., 1., outsideAlpha);
+                cairo_mesh_pattern_set_corner_color_rgba(mesh, 2, 1., 1., 1., outsideAlpha);
+                cairo_mesh_pattern_set_corner_color_rgba(mesh, 3, 1., 1., 1., insideAlpha);
+                cairo_mesh_pattern_end_patch(mesh);
+
+                if (mustStop) {
+                    break;
+                }
+                p1 = p2;
+            }
+        } else {
+            while (point != cps.end()) {
+                if (nextPoint == cps.end()) {
+                    nextPoint = cps.begin();
+                    nextFPoint = fps.begin();
+                }
+                Point p0,p1,p2,p3,p0p1,p1p0,p0Right,p1Right,p2p3,p3p2,p2Left,p3Left;
+                (*point)->getPositionAtTime(time, &p0.x, &p0.y);
+                (*point)->getRightBezierPointAtTime(time, &p0Right.x, &p0Right.y);
+                (*fpoint)->getRightBezierPointAtTime(time, &p1Right.x, &p1Right.y);
+                (*fpoint)->getPositionAtTime(time, &p1.x, &p1.y);
+                (*nextPoint)->getPositionAtTime(time, &p3.x, &p3.y);
+                (*nextPoint)->getLeftBezierPointAtTime(time, &p3Left.x, &p3Left.y);
+                (*nextFPoint)->getPositionAtTime(time, &p2.x, &p2.y);
+                (*nextFPoint)->getLeftBezierPointAtTime(time, &p2Left.x, &p2Left.y);
+
+                p0p1.x = (2. * fallOff * p0.x + fallOffInverse * p1.x) / (2. * fallOff + fallOffInverse);
+                p0p1.y = (2. * fallOff * p0.y + fallOffInverse * p1.y) / (2. * fallOff + fallOffInverse);
+                p1p0.x = (p0.x * fallOff + 2. * fallOffInverse * p1.x) / (fallOff + 2. * fallOffInverse);
+                p1p0.y = (p0.y * fallOff + 2. * fallOffInverse * p1.y) /(fallOff + 2. * fallOffInverse);
+                p2p3.x = (p3.x * fallOff + 2. * fallOffInverse * p2.x) / (fallOff + 2. * fallOffInverse);
+                p2p3.y = (p3.y * fallOff + 2. * fallOffInverse * p2.y) / (fallOff + 2. * fallOffInverse);
+                p3p2.x = (2. * fallOff * p3.x + fallOffInverse * p2.x) / (2. * fallOff + fallOffInverse);
+                p3p2.y = (2. * fallOff * p3.y + fallOffInverse * p2.y) / (2. * fallOff + fallOffInverse);
+
+                cairo_mesh_pattern_begin_patch(mesh);
+                cairo_mesh_pattern_move_to(mesh, p0.x, p0.y);
+                cairo_mesh_pattern_curve_to(mesh, p0p1.x,p0p1.y,p1p0.x,p1p0.y,p1.x,p1.y);
+                cairo_mesh_pattern_curve_to(mesh, p1Right.x,p1Right.y,p2Left.x,p2Left.y,p2.x,p2.y);
+                cairo_mesh_pattern_curve_to(mesh, p2p3.x,p2p3.y,p3p2.x,p3p2.y,p3.x,p3.y);
+                cairo_mesh_pattern_curve_to(mesh, p3Left.x,p3Left.y,p0Right.x,p0Right.y,p0.x,p0.y);
+                cairo_mesh_pattern_set_corner_color_rgba(mesh, 0, 1., 1., 1., insideAlpha);
+                cairo_mesh_pattern_set_corner_color_rgba(mesh, 1, 1., 1., 1., outsideAlpha);
+                cairo_mesh_pattern_set_corner_color_rgba(mesh, 2, 1., 1., 1., outsideAlpha);
+                cairo_mesh_pattern_set_corner_color_rgba(mesh, 3, 1., 1., 1., insideAlpha);
+                cairo_mesh_pattern_end_patch(mesh);
+
+                ++point;
+                ++nextPoint;
+                ++fpoint;
+                ++nextFPoint;
+            }
+        }
+        cairo_set_source(cr, mesh);
+        cairo_mask(cr, mesh);
+        cairo_pattern_destroy(mesh);
+    }
+    cairo_surface_flush(cairo_get_target(cr));
+}
+
+///Adds a closed polygon, the curve is finished once all the points are added
+boost::shared_ptr<Bezier>
+makeShape(RotoContext* context,const double* points,int count,bool finished)
+{
+    boost::shared_ptr<Bezier> bezier = context->makeBezier(points[0], points[1], "Bezier");
+    for (int i = 1; i < count; ++i) {
+        bezier->addControlPoint(points[i * 2], points[i * 2 + 1]);
+    }
+    bezier->setCurveFinished(finished);
+    return bezier;
+}
+
+}
+
+///The tiles must render the masks the full-frame rasterizer rendered: the shapes are drawn by the same cairo
+///operations, only the 8-bit rounding of the shape layers may differ where shapes overlap.
+TEST_F(BaseTest,RotoMaskTilesMatchFullFrameRender) {
+    boost::shared_ptr<Natron::Node> node = createNode(_genericTestPluginID);
+    ASSERT_TRUE(node);
+    RotoContext context(node.get());
+
+    ///a feathered shape with a steep fall-off, spanning several tiles
+    const double square[] = { 40.,40., 560.,60., 540.,500., 60.,480. };
+    boost::shared_ptr<Bezier> feathered = makeShape(&context, square, 4, true);
+    feathered->getFeatherKnob()->setValue(25, 0);
+    feathered->getFeatherFallOffKnob()->setValue(2.5, 0);
+    feathered->getOpacityKnob()->setValue(0.8, 0);
+
+    ///an inverted shape whose feather is made of moved feather points rather than a distance
+    const double triangle[] = { 300.,200., 620.,380., 250.,560. };
+    boost::shared_ptr<Bezier> inverted = makeShape(&context, triangle, 3, true);
+    inverted->getInvertedKnob()->setValue(true, 0);
+    inverted->getOpacityKnob()->setValue(0.6, 0);
+    for (int i = 0; i < 3; ++i) {
+        inverted->moveFeatherByIndex(i, 0, i == 1 ? 30. : -20., 15.);
+    }
+
+    ///an inverted shape with a negative feather distance
+    const double diamond[] = { 150.,300., 260.,180., 380.,310., 250.,420. };
+    boost::shared_ptr<Bezier> insideFeather = makeShape(&context, diamond, 4, true);
+    insideFeather->getFeatherKnob()->setValue(-12, 0);
+    insideFeather->getInvertedKnob()->setValue(true, 0);
+
+    ///an open bezier doesn't render anything
+    const double open[] = { 10.,10., 300.,20., 200.,200. };
+    makeShape(&context, open, 3, false);
+
+    RectI rod(0,0,640,600);
+    boost::shared_ptr<Natron::Image> mask = context.renderMask(rod, 1, context.getAge(), rod, 0, Natron::IMAGE_FLOAT, 0, 0, true);
+    ASSERT_TRUE(mask);
+
+    cairo_surface_t* cairoImg = cairo_image_surface_create(CAIRO_FORMAT_A8, rod.width(), rod.height());
+    ASSERT_EQ(CAIRO_STATUS_SUCCESS, cairo_surface_status(cairoImg));
+    cairo_t* cr = cairo_create(cairoImg);
+    renderFullFrameReference(context.getCurvesByRenderOrder(), 0, cr);
+    const unsigned char* reference = cairo_image_surface_get_data(cairoImg);
+    int stride = cairo_image_surface_get_stride(cairoImg);
+
+    ///the mask is removed from the cache once a mask of another hash is rendered: keep its pixels
+    std::vector<float> maskPixels;
+    maskPixels.reserve(rod.width() * rod.height());
+    float maxError = 0.f;
+    int pixelsOff = 0;
+    for (int y = rod.y1; y < rod.y2; ++y) {
+        const float* pix = (const float*)mask->pixelAt(rod.x1, y);
+        for (int x = rod.x1; x < rod.x2; ++x) {
+            maskPixels.push_back(pix[x - rod.x1]);
+            float error = std::abs(pix[x - rod.x1] - reference[y * stride + x] / 255.f);
+            maxError = std::max(maxError, error);
+            if (error > 1.5f / 255.f) {
+                ++pixelsOff;
+            }
+        }
+    }
+    EXPECT_LE(maxError, 3.f / 255.f);
+    EXPECT_LE(pixelsOff, rod.width() * rod.height() / 100);
+    mask.reset();
+
+    ///a partial RoI renders the same pixels as the whole mask
+    RectI roi(100,150,420,330);
+    boost::shared_ptr<Natron::Image> partial = context.renderMask(roi, 2, context.getAge(), rod, 0, Natron::IMAGE_FLOAT, 0, 0, true);
+    ASSERT_TRUE(partial);
+    for (int y = roi.y1; y < roi.y2; ++y) {
+        const float* pix = (const float*)partial->pixelAt(roi.x1, y);
+        for (int x = roi.x1; x < roi.x2; ++x) {
+            EXPECT_FLOAT_EQ(maskPixels[(y - rod.y1) * rod.width() + x - rod.x1], pix[x - roi.x1]);
+        }
+    }
+
+    cairo_destroy(cr);
+    cairo_surface_destroy(cairoImg);
+}
+
+///Shape layers are node cache entries, rasterized only in the tiles of the masks rendered
+TEST_F(BaseTest,RotoShapeLayersAreRasterizedByTiles) {
+    boost::shared_ptr<Natron::Node> node = createNode(_genericTestPluginID);
+    ASSERT_TRUE(node);
+    RotoContext context(node.get());
+
+    const double square[] = { 20.,20., 1000.,30., 990.,900., 30.,880. };
+    boost::shared_ptr<Bezier> shape = makeShape(&context, square, 4, true);
+    shape->getFeatherKnob()->setValue(10, 0);
+
+    RectI rod(0,0,1024,1024);
+    RectI roi(0,0,200,200);
+    ASSERT_TRUE(context.renderMask(roi, 1, context.getAge(), rod, 0, Natron::IMAGE_FLOAT, 0, 0, true));
+
+    RotoShapeRenderData data;
+    ASSERT_TRUE(RotoContextPrivate::evaluateShapeForRender(shape, 0, 0, &data));
+    RectI bbox((int)std::floor(data.bbox.x1), (int)std::floor(data.bbox.y1),
+               (int)std::ceil(data.bbox.x2), (int)std::ceil(data.bbox.y2));
+    RectI bounds;
+    ASSERT_TRUE(bbox.intersect(rod, &bounds));
+    RotoShapeLayer layer;
+    ASSERT_TRUE(RotoContextPrivate::getOrCreateShapeLayer(data, bounds, &layer));
+
+    ///the layer is the one the render left in the cache, rasterized in the tile of the RoI only
+    EXPECT_TRUE(layer.over0->isPixelRendered(100,100));
+    EXPECT_TRUE(layer.over1->isPixelRendered(100,100));
+    EXPECT_FALSE(layer.over0->isPixelRendered(600,600));
+    EXPECT_FALSE(layer.over1->isPixelRendered(600,600));
+
+    ///adding a shape doesn't rasterize the layers of the others again, they only get the tiles they miss
+    const double triangle[] = { 500.,500., 800.,550., 600.,800. };
+    makeShape(&context, triangle, 3, true);
+    RectI otherRoI(512,512,700,700);
+    ASSERT_TRUE(context.renderMask(otherRoI, 2, context.getAge(), rod, 0, Natron::IMAGE_FLOAT, 0, 0, true));
+    EXPECT_TRUE(layer.over0->isPixelRendered(100,100));
+    EXPECT_TRUE(layer.over0->isPixelRendered(600,600));
+    EXPECT_TRUE(layer.over1->isPixelRendered(600,600));
+    EXPECT_FALSE(layer.over0->isPixelRendered(900,300));
+}
@@ -0,0 +1,492 @@
+//  Natron
+//
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <gtest/gtest.h>
+
+#include "Global/Macros.h"
+#ifndef __NATRON_WIN32__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+#include <QtCore/QThread>
+#include <QtCore/QDir>
+#include <QtCore/QFile>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QSettings>
+#include <QtCore/QVariant>
+
+#include "Engine/SharedMemoryCache.h"
+#include "Engine/AppManager.h"
+#include "Engine/AppInstance.h"
+#include "Engine/Cache.h"
+#include "Engine/FrameEntry.h"
+#include "Engine/FrameParams.h"
+#include "CacheTestHelpers.h"
+
+using namespace Natron;
+
+#ifndef __NATRON_WIN32__
+
+namespace {
+
+///A segment name of its own for each test, removed when the test ends
+class ScopedSegment
+{
+public:
+
+    ScopedSegment(const char* test)
+    {
+        char name[64];
+        std::sprintf(name,"/NatronTest%s-%d",test,(int)::getpid());
+        _name = name;
+        SharedMemoryCache::removeSegment(_name);
+    }
+
+    ~ScopedSegment() { SharedMemoryCache::removeSegment(_name); }
+
+    const std::string& name() const { return _name; }
+
+private:
+
+    std::string _name;
+};
+
+///The content of the record with the given hash, so that any record can be checked
+void
+fillRecordData(U64 hash,
+               std::size_t size,
+               std::vector<U8>* data)
+{
+    data->resize(size);
+    U64 x = hash;
+    for (std::size_t i = 0; i < size; ++i) {
+        x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+        (*data)[i] = (U8)(x >> 56);
+    }
+}
+
+std::string
+makeRecordHeader(U64 hash)
+{
+    char header[64];
+    std::sprintf(header,"header of %llu",(unsigned long long)hash);
+    return header;
+}
+
+///Inserts and looks-up random records on its own mapping of the segment, checking the content of what it finds
+class SharedMemoryHammerThread : public QThread
+{
+public:
+
+    SharedMemoryHammerThread(const std::string& segmentName,int iterations,int keysCount,unsigned int seed)
+    : QThread()
+    , _segmentName(segmentName)
+    , _iterations(iterations)
+    , _keysCount(keysCount)
+    , _seed(seed)
+    , _hits(0)
+    , _inserts(0)
+    , _corrupted(0)
+    {
+    }
+
+    int getHits() const { return _hits; }
+
+    int getInserts() const { return _inserts; }
+
+    int getCorrupted() const { return _corrupted; }
+
+private:
+
+    virtual void run()
+    {
+        SharedMemoryCache cache;
+        if (!cache.open(_segmentName,4 * 1024 * 1024)) {
+            ++_corrupted;
+            return;
+        }
+        std::vector<U8> expected,data;
+        for (int i = 0; i < _iterations; ++i) {
+            _seed = _seed * 1103515245 + 12345;
+            U64 hash = 1 + (_seed >> 16) % _keysCount;
+            std::size_t size = 1024 + (std::size_t)(hash % 4) * 4096;
+            SharedMemoryCache::Record record;
+            std::string header;
+            if (cache.find(hash,&record,&header)) {
+                data.resize((std::size_t)record.dataSize);
+                if (cache.readData(record,&data[0])) {
+                    fillRecordData(hash,size,&expected);
+                    if (header != makeRecordHeader(hash) || data != expected) {
+                        ++_corrupted;
+                    }
+                    ++_hits;
+                }
+            } else {
+                fillRecordData(hash,size,&data);
+                if (cache.insert(hash,makeRecordHeader(hash),&data[0],data.size())) {
+                    ++_inserts;
+                }
+            }
+        }
+    }
+
+    std::string _segmentName;
+    int _iterations;
+    int _keysCount;
+    unsigned int _seed;
+    int _hits;
+    int _inserts;
+    int _corrupted;
+};
+
+///Looks-up an entry, keeping what it found until it is destroyed
+class CacheLookUpThread : public QThread
+{
+public:
+
+    CacheLookUpThread(TestViewerCache* cache,const FrameKey& key)
+    : QThread()
+    , _cache(cache)
+    , _key(key)
+    , found(false)
+    , entry()
+    {
+    }
+
+private:
+
+    virtual void run()
+    {
+        boost::shared_ptr<const NonKeyParams> cachedParams;
+        found = _cache->get(_key,&cachedParams,&entry);
+    }
+
+    TestViewerCache* _cache;
+    FrameKey _key;
+
+public:
+
+    bool found;
+    boost::shared_ptr<FrameEntry> entry;
+};
+
+} // anon namespace
+
+TEST(SharedMemoryCache,InsertFindRead) {
+    ScopedSegment segment("Insert");
+    SharedMemoryCache cache;
+    ASSERT_TRUE(cache.open(segment.name(),1024 * 1024));
+    EXPECT_EQ((U64)1024 * 1024,cache.getCapacity());
+
+    std::vector<U8> data;
+    fillRecordData(42,100000,&data);
+    EXPECT_FALSE(cache.contains(42));
+    ASSERT_TRUE(cache.insert(42,makeRecordHeader(42),&data[0],data.size()));
+    EXPECT_TRUE(cache.contains(42));
+    EXPECT_FALSE(cache.contains(43));
+
+    SharedMemoryCache::Record record;
+    std::string header;
+    ASSERT_TRUE(cache.find(42,&record,&header));
+    EXPECT_EQ(makeRecordHeader(42),header);
+    ASSERT_EQ((U64)data.size(),record.dataSize);
+    std::vector<U8> read(data.size());
+    ASSERT_TRUE(cache.readData(record,&read[0]));
+    EXPECT_TRUE(read == data);
+    EXPECT_FALSE(cache.find(43,&record,&header));
+
+    ///too big: a record may take at most a fourth of the ring
+    data.resize((std::size_t)cache.getMaximumRecordSize() + 1);
+    EXPECT_FALSE(cache.insert(44,std::string(),&data[0],data.size()));
+}
+
+///Another mapping of the segment, as another process would have, sees the records and keeps the size of the segment
+TEST(SharedMemoryCache,MappingsShareTheRecords) {
+    ScopedSegment segment("Mappings");
+    SharedMemoryCache first,second;
+    ASSERT_TRUE(first.open(segment.name(),1024 * 1024));
+    ASSERT_TRUE(second.open(segment.name(),64 * 1024 * 1024));
+    EXPECT_EQ(first.getCapacity(),second.getCapacity());
+
+    std::vector<U8> data;
+    fillRecordData(7,5000,&data);
+    ASSERT_TRUE(first.insert(7,makeRecordHeader(7),&data[0],data.size()));
+    SharedMemoryCache::Record record;
+    std::string header;
+    ASSERT_TRUE(second.find(7,&record,&header));
+    std::vector<U8> read(data.size());
+    ASSERT_TRUE(second.readData(record,&read[0]));
+    EXPECT_TRUE(read == data);
+}
+
+///The segment is removed once its last mapping is closed
+TEST(SharedMemoryCache,LastMappingRemovesTheSegment) {
+    ScopedSegment segment("LastMapping");
+    SharedMemoryCache first,second;
+    ASSERT_TRUE(first.open(segment.name(),1024 * 1024));
+    EXPECT_FALSE(first.hasOtherMappings());
+    ASSERT_TRUE(second.open(segment.name(),1024 * 1024));
+    EXPECT_TRUE(first.hasOtherMappings());
+    EXPECT_TRUE(second.hasOtherMappings());
+
+    second.close();
+    EXPECT_FALSE(first.hasOtherMappings());
+    int fd = ::shm_open(segment.name().c_str(),O_RDWR,0600);
+    EXPECT_GE(fd,0);
+    if (fd >= 0) {
+        ::close(fd);
+    }
+    first.close();
+    EXPECT_LT(::shm_open(segment.name().c_str(),O_RDWR,0600),0);
+    EXPECT_EQ(ENOENT,errno);
+}
+
+TEST(SharedMemoryCache,OldRecordsAreOverwritten) {
+    ScopedSegment segment("Overwritten");
+    SharedMemoryCache cache;
+    ///the smallest segment: 64 blocks
+    ASSERT_TRUE(cache.open(segment.name(),0));
+    const int recordBlocks = 4;
+    const int recordsPerRing = (int)(cache.getCapacity() / NATRON_SHARED_MEMORY_CACHE_BLOCK_SIZE) / recordBlocks;
+    std::vector<U8> data;
+    for (U64 hash = 1; hash <= 100; ++hash) {
+        fillRecordData(hash,recordBlocks * NATRON_SHARED_MEMORY_CACHE_BLOCK_SIZE - 64,&data);
+        ASSERT_TRUE(cache.insert(hash,makeRecordHeader(hash),&data[0],data.size()));
+    }
+    SharedMemoryCache::Record record;
+    std::string header;
+    EXPECT_FALSE(cache.find(1,&record,&header));
+    EXPECT_FALSE(cache.find(100 - recordsPerRing,&record,&header));
+    for (U64 hash = 100 - recordsPerRing + 1; hash <= 100; ++hash) {
+        ASSERT_TRUE(cache.find(hash,&record,&header)) << "record " << hash;
+        std::vector<U8> read((std::size_t)record.dataSize);
+        EXPECT_TRUE(cache.readData(record,&read[0])) << "record " << hash;
+    }
+}
+
+TEST(SharedMemoryCache,CorruptedRecordIsRejected) {
+    ScopedSegment segment("Corrupted");
+    SharedMemoryCache cache;
+    ASSERT_TRUE(cache.open(segment.name(),1024 * 1024));
+    std::vector<U8> data;
+    fillRecordData(5,20000,&data);
+    ASSERT_TRUE(cache.insert(5,makeRecordHeader(5),&data[0],data.size()));
+
+    ///flip a byte of the data of the record, the first one of the ring which is at the end of the segment
+    int fd = ::shm_open(segment.name().c_str(),O_RDWR,0600);
+    ASSERT_GE(fd,0);
+    struct stat st;
+    ASSERT_EQ(0,::fstat(fd,&st));
+    U8* mapping = (U8*)::mmap(0,(std::size_t)st.st_size,PROT_READ | PROT_WRITE,MAP_SHARED,fd,0);
+    ::close(fd);
+    ASSERT_TRUE(mapping != (U8*)MAP_FAILED);
+    std::size_t ringOffset = (std::size_t)st.st_size - (std::size_t)cache.getCapacity();
+    mapping[ringOffset + makeRecordHeader(5).size() + 1000] ^= 0x20;
+    ::munmap(mapping,(std::size_t)st.st_size);
+
+    SharedMemoryCache::Record record;
+    std::string header;
+    ASSERT_TRUE(cache.find(5,&record,&header));
+    std::vector<U8> read((std::size_t)record.dataSize);
+    EXPECT_FALSE(cache.readData(record,&read[0]));
+}
+
+///A record inserted by a child process, which exits (as a crashed render would), is found by its parent
+TEST(SharedMemoryCache,OtherProcessesSeeTheRecords) {
+    ScopedSegment segment("Processes");
+    pid_t child = ::fork();
+    ASSERT_GE(child,0);
+    if (child == 0) {
+        SharedMemoryCache cache;
+        std::vector<U8> data;
+        fillRecordData(1234,300000,&data);
+        bool ok = cache.open(segment.name(),8 * 1024 * 1024) &&
+        cache.insert(1234,makeRecordHeader(1234),&data[0],data.size());
+        ::_exit(ok ? 0 : 1);
+    }
+    int status = 0;
+    ASSERT_EQ(child,::waitpid(child,&status,0));
+    ASSERT_TRUE(WIFEXITED(status));
+    ASSERT_EQ(0,WEXITSTATUS(status));
+
+    SharedMemoryCache cache;
+    ASSERT_TRUE(cache.open(segment.name(),1024 * 1024));
+    EXPECT_EQ((U64)8 * 1024 * 1024,cache.getCapacity());
+    SharedMemoryCache::Record record;
+    std::string header;
+    ASSERT_TRUE(cache.find(1234,&record,&header));
+    std::vector<U8> expected,read((std::size_t)record.dataSize);
+    fillRecordData(1234,300000,&expected);
+    ASSERT_TRUE(cache.readData(record,&read[0]));
+    EXPECT_TRUE(read == expected);
+}
+
+///2 caches, as in 2 render processes: an entry published by one is a hit for the other
+TEST(SharedMemoryCache,CachesShareTheirEntries) {
+    ScopedSegment segment("Caches");
+    const int size = 64;
+    boost::shared_ptr<const NonKeyParams> params = FrameEntry::makeParams(RectI(0,0,size,size),0,size,size);
+    const U64 entrySize = params->getElementsCount();
+    TestViewerCache first("SharedMemoryCacheTest1",1,64 * entrySize,1.);
+    TestViewerCache second("SharedMemoryCacheTest2",1,64 * entrySize,1.);
+    createCacheFolders(first);
+    createCacheFolders(second);
+    boost::shared_ptr<SharedMemoryCache> firstSegment(new SharedMemoryCache);
+    boost::shared_ptr<SharedMemoryCache> secondSegment(new SharedMemoryCache);
+    ASSERT_TRUE(firstSegment->open(segment.name(),16 * 1024 * 1024));
+    ASSERT_TRUE(secondSegment->open(segment.name(),16 * 1024 * 1024));
+    first.setSharedMemoryCache(firstSegment);
+    second.setSharedMemoryCache(secondSegment);
+
+    for (int i = 0; i < 4; ++i) {
+        boost::shared_ptr<FrameEntry> entry;
+        ASSERT_FALSE(first.getOrCreate(makeFrameKey(i,size),params,&entry));
+        std::memset(entry->data(),i + 1,entrySize);
+        ///the last one is not complete
+        if (i < 3) {
+            EXPECT_TRUE(first.publishToSharedMemory(entry));
+            EXPECT_FALSE(first.publishToSharedMemory(entry)) << "Entries are published once.";
+        }
+    }
+    EXPECT_EQ(3,first.getSharedMemoryPublicationsCount());
+
+    for (int i = 0; i < 4; ++i) {
+        boost::shared_ptr<FrameEntry> entry;
+        boost::shared_ptr<const NonKeyParams> cachedParams;
+        bool found = second.get(makeFrameKey(i,size),&cachedParams,&entry);
+        if (i == 3) {
+            EXPECT_FALSE(found);
+            continue;
+        }
+        ASSERT_TRUE(found) << "entry " << i;
+        EXPECT_TRUE(*cachedParams == *params);
+        EXPECT_EQ((U8)(i + 1),entry->data()[0]);
+        EXPECT_EQ((U8)(i + 1),entry->data()[entrySize - 1]);
+    }
+    EXPECT_EQ(3,second.getSharedMemoryImportsCount());
+    ///the imported entries are now regular entries of the second cache
+    boost::shared_ptr<FrameEntry> entry;
+    boost::shared_ptr<const NonKeyParams> cachedParams;
+    EXPECT_TRUE(second.get(makeFrameKey(0,size),&cachedParams,&entry));
+    EXPECT_EQ(3,second.getSharedMemoryImportsCount());
+    entry.reset();
+    first.clear();
+    second.clear();
+}
+
+///Not really a test: threads with their own mapping of a small segment insert and look-up records concurrently,
+///so that records are constantly overwritten while they are read. Prints the throughput, no corrupted record
+///may ever be returned.
+TEST(SharedMemoryCache,DISABLED_ConcurrentBenchmark) {
+    ScopedSegment segment("Concurrent");
+    const int threadsCount = 8;
+    const int iterations = 20000;
+    std::vector<SharedMemoryHammerThread*> threads;
+    QElapsedTimer timer;
+    timer.start();
+    for (int i = 0; i < threadsCount; ++i) {
+        threads.push_back(new SharedMemoryHammerThread(segment.name(),iterations,500,i + 1));
+        threads.back()->start();
+    }
+    int hits = 0,inserts = 0,corrupted = 0;
+    for (int i = 0; i < threadsCount; ++i) {
+        threads[i]->wait();
+        hits += threads[i]->getHits();
+        inserts += threads[i]->getInserts();
+        corrupted += threads[i]->getCorrupted();
+        delete threads[i];
+    }
+    qint64 elapsed = std::max((qint64)1,timer.elapsed());
+    std::cout << "[SharedMemoryCache] " << threadsCount << " threads, " << threadsCount * iterations << " operations in "
+    << elapsed << " ms (" << (threadsCount * iterations) / elapsed << " ops/ms): " << hits << " hits, " << inserts
+    << " insertions" << std::endl;
+    EXPECT_EQ(0,corrupted);
+    EXPECT_GT(hits,0);
+}
+
+#endif // __NATRON_WIN32__
+
+///The look-ups of an entry being imported wait for its data: it is imported once and never seen incomplete
+TEST(SharedMemoryCache,ConcurrentImportsOfAnEntry) {
+    ScopedSegment segment("ConcurrentImports");
+    const int size = 256;
+    const int threadsCount = 8;
+    boost::shared_ptr<const NonKeyParams> params = FrameEntry::makeParams(RectI(0,0,size,size),0,size,size);
+    const U64 entrySize = params->getElementsCount();
+    TestViewerCache first("SharedMemoryCacheTest1",1,16 * entrySize,1.);
+    TestViewerCache second("SharedMemoryCacheTest2",1,16 * entrySize,1.);
+    createCacheFolders(first);
+    createCacheFolders(second);
+    boost::shared_ptr<SharedMemoryCache> firstSegment(new SharedMemoryCache);
+    boost::shared_ptr<SharedMemoryCache> secondSegment(new SharedMemoryCache);
+    ASSERT_TRUE(firstSegment->open(segment.name(),16 * 1024 * 1024));
+    ASSERT_TRUE(secondSegment->open(segment.name(),16 * 1024 * 1024));
+    first.setSharedMemoryCache(firstSegment);
+    second.setSharedMemoryCache(secondSegment);
+    {
+        boost::shared_ptr<FrameEntry> entry;
+        ASSERT_FALSE(first.getOrCreate(makeFrameKey(0,size),params,&entry));
+        std::memset(entry->data(),7,entrySize);
+        ASSERT_TRUE(first.publishToSharedMemory(entry));
+    }
+
+    std::vector<CacheLookUpThread*> threads;
+    for (int i = 0; i < threadsCount; ++i) {
+        threads.push_back(new CacheLookUpThread(&second,makeFrameKey(0,size)));
+    }
+    for (int i = 0; i < threadsCount; ++i) {
+        threads[i]->start();
+    }
+    for (int i = 0; i < threadsCount; ++i) {
+        threads[i]->wait();
+        ASSERT_TRUE(threads[i]->found) << "thread " << i;
+        EXPECT_EQ(threads[0]->entry,threads[i]->entry) << "thread " << i;
+        EXPECT_EQ((U8)7,threads[i]->entry->data()[0]);
+        EXPECT_EQ((U8)7,threads[i]->entry->data()[entrySize - 1]);
+    }
+    for (int i = 0; i < threadsCount; ++i) {
+        delete threads[i];
+    }
+    EXPECT_EQ(1,second.getSharedMemoryImportsCount());
+    first.clear();
+    second.clear();
+}
+
+///The size set in the preferences is read once they are restored by the start-up of a background process
+TEST(SharedMemoryCache,PreferenceSharesTheNodeCache) {
+    QSettings settings(NATRON_ORGANIZATION_NAME,NATRON_APPLICATION_NAME);
+    bool hadSize = settings.contains("SharedImageCacheSize");
+    QVariant savedSize = settings.value("SharedImageCacheSize");
+    settings.setValue("SharedImageCacheSize",16);
+    settings.sync();
+
+    AppManager* manager = new AppManager;
+    int argc = 0;
+    manager->load(argc,NULL);
+    EXPECT_TRUE(appPTR->isNodeCacheShared());
+    manager->getTopLevelInstance()->quit();
+    appPTR->setNumberOfThreads(0);
+    delete appPTR;
+
+    ///the settings are saved again when the application exits
+    QSettings restored(NATRON_ORGANIZATION_NAME,NATRON_APPLICATION_NAME);
+    if (hadSize) {
+        restored.setValue("SharedImageCacheSize",savedSize);
+    } else {
+        restored.remove("SharedImageCacheSize");
+    }
+}
@@ -0,0 +1,225 @@
+//  Natron
+//
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <stdexcept>
+#include <vector>
+#include <iostream>
+#include <gtest/gtest.h>
+
+#include <QtCore/QAtomicInt>
+#include <QtCore/QThread>
+#include <QtCore/QElapsedTimer>
+
+#include <ofxMultiThread.h>
+
+#ifndef Q_MOC_RUN
+#include <boost/bind.hpp>
+#endif
+
+#include "Engine/TaskScheduler.h"
+
+using namespace Natron;
+
+namespace {
+
+///Recursive fork-join: each level schedules two children and waits for them, like renderRoI fetching its inputs.
+void
+forkJoin(TaskScheduler* scheduler,
+         int depth,
+         QAtomicInt* leaves)
+{
+    if (depth == 0) {
+        leaves->ref();
+        return;
+    }
+    TaskGroup group;
+    scheduler->schedule(&group,boost::bind(&forkJoin,scheduler,depth - 1,leaves));
+    scheduler->schedule(&group,boost::bind(&forkJoin,scheduler,depth - 1,leaves));
+    scheduler->wait(&group);
+}
+
+void
+throwingTask()
+{
+    throw std::runtime_error("task failure");
+}
+
+void
+countingTask(QAtomicInt* counter)
+{
+    counter->ref();
+}
+
+void
+countIndex(std::vector<QAtomicInt>* calls,
+           unsigned int index)
+{
+    (*calls)[index].ref();
+}
+
+///Records the highest number of indexes being processed at the same time
+void
+concurrentIndex(QAtomicInt* running,
+                QAtomicInt* maxRunning,
+                unsigned int /*index*/)
+{
+    int r = running->fetchAndAddOrdered(1) + 1;
+    int m = (int)*maxRunning;
+    while (r > m && !maxRunning->testAndSetOrdered(m,r)) {
+        m = (int)*maxRunning;
+    }
+    QThread::msleep(1);
+    running->deref();
+}
+
+void
+throwingIndex(unsigned int index,
+              QAtomicInt* counter)
+{
+    if (index == 3) {
+        throw std::runtime_error("task failure");
+    }
+    counter->ref();
+}
+
+///What a plug-in passes to OfxHost::multiThread when the work is too small to be worth it
+void
+emptyThreadFunction(unsigned int /*threadIndex*/,
+                    unsigned int /*threadMax*/,
+                    void* /*customArg*/)
+{
+}
+
+void
+callThreadFunction(OfxThreadFunctionV1* func,
+                   unsigned int threadMax,
+                   void* customArg,
+                   unsigned int threadIndex)
+{
+    func(threadIndex,threadMax,customArg);
+}
+
+}
+
+TEST(TaskScheduler,NestedWaitsDoNotDeadlock) {
+    ///Fewer workers than nesting levels: this would deadlock if waiting threads did not help
+    TaskScheduler scheduler(2);
+    QAtomicInt leaves(0);
+    forkJoin(&scheduler,10,&leaves);
+    EXPECT_EQ(1 << 10,(int)leaves);
+}
+
+TEST(TaskScheduler,ExceptionsAreReportedToTheGroup) {
+    TaskScheduler scheduler(2);
+    QAtomicInt counter(0);
+    TaskGroup group;
+    for (int i = 0; i < 100; ++i) {
+        scheduler.schedule(&group,boost::bind(&countingTask,&counter));
+    }
+    scheduler.schedule(&group,&throwingTask);
+    scheduler.wait(&group);
+    EXPECT_TRUE(group.hasFailed());
+    EXPECT_EQ(100,(int)counter);
+}
+
+TEST(TaskScheduler,WorkersCountCanChange) {
+    TaskScheduler scheduler(4);
+    EXPECT_EQ(4,scheduler.getWorkersCount());
+    EXPECT_EQ(-1,scheduler.getCurrentWorkerIndex());
+
+    scheduler.setWorkersCount(1);
+    EXPECT_EQ(1,scheduler.getWorkersCount());
+    QAtomicInt leaves(0);
+    forkJoin(&scheduler,8,&leaves);
+    EXPECT_EQ(1 << 8,(int)leaves);
+
+    scheduler.setWorkersCount(6);
+    EXPECT_EQ(6,scheduler.getWorkersCount());
+    leaves = 0;
+    forkJoin(&scheduler,8,&leaves);
+    EXPECT_EQ(1 << 8,(int)leaves);
+}
+
+TEST(TaskScheduler,GroupsReportWhenTheyAreFinished) {
+    TaskScheduler scheduler(2);
+    TaskGroup group;
+    EXPECT_TRUE(group.isFinished());
+    QAtomicInt leaves(0);
+    scheduler.schedule(&group,boost::bind(&forkJoin,&scheduler,6,&leaves));
+    scheduler.wait(&group);
+    EXPECT_TRUE(group.isFinished());
+    EXPECT_EQ(1 << 6,(int)leaves);
+}
+
+TEST(TaskScheduler,ParallelForCallsEachIndexOnce) {
+    TaskScheduler scheduler(3);
+    for (unsigned int count = 0; count < 40; count += 7) {
+        std::vector<QAtomicInt> calls(count);
+        EXPECT_TRUE(scheduler.parallelFor(count,boost::bind(&countIndex,&calls,_1)));
+        for (unsigned int i = 0; i < count; ++i) {
+            EXPECT_EQ(1,(int)calls[i]) << "index " << i << " of " << count;
+        }
+    }
+
+    ///nested in a task, like a plug-in calling multiThread from its render action
+    std::vector<QAtomicInt> calls(100);
+    TaskGroup group;
+    scheduler.schedule(&group,boost::bind(&TaskScheduler::parallelFor,&scheduler,100,
+                                          TaskScheduler::IndexedTask(boost::bind(&countIndex,&calls,_1)),-1));
+    scheduler.wait(&group);
+    for (unsigned int i = 0; i < calls.size(); ++i) {
+        EXPECT_EQ(1,(int)calls[i]);
+    }
+}
+
+TEST(TaskScheduler,ParallelForRespectsMaxConcurrency) {
+    TaskScheduler scheduler(4);
+    QAtomicInt running(0);
+    QAtomicInt maxRunning(0);
+    scheduler.parallelFor(64,boost::bind(&concurrentIndex,&running,&maxRunning,_1),2);
+    EXPECT_LE((int)maxRunning,2);
+
+    ///more indexes than workers: the team is as large as the workers count, the calling thread included
+    maxRunning = 0;
+    scheduler.parallelFor(64,boost::bind(&concurrentIndex,&running,&maxRunning,_1));
+    EXPECT_LE((int)maxRunning,4);
+}
+
+TEST(TaskScheduler,ParallelForReportsExceptions) {
+    TaskScheduler scheduler(2);
+    QAtomicInt counter(0);
+    EXPECT_FALSE(scheduler.parallelFor(50,boost::bind(&throwingIndex,_1,&counter)));
+    EXPECT_EQ(49,(int)counter);
+}
+
+///Not really a test: prints the cost of dispatching an empty OfxThreadFunctionV1 to as many "threads" as there
+///are workers, scheduling one task per thread index (what OfxHost::multiThread did) versus a parallelFor team.
+TEST(TaskScheduler,DISABLED_MultiThreadDispatchBenchmark) {
+    int workersCount = std::max(QThread::idealThreadCount(),2);
+    TaskScheduler scheduler(workersCount);
+    const int iterations = 20000;
+    const unsigned int nThreads = (unsigned int)workersCount;
+    OfxThreadFunctionV1* func = &emptyThreadFunction;
+
+    QElapsedTimer timer;
+    timer.start();
+    for (int it = 0; it < iterations; ++it) {
+        TaskGroup group;
+        for (unsigned int i = 0; i < nThreads; ++i) {
+            scheduler.schedule(&group,boost::bind(&callThreadFunction,func,nThreads,(void*)NULL,i));
+        }
+        scheduler.wait(&group);
+    }
+    double taskPerIndex = (timer.nsecsElapsed() / 1000.) / iterations;
+
+    timer.restart();
+    for (int it = 0; it < iterations; ++it) {
+        scheduler.parallelFor(nThreads,boost::bind(&callThreadFunction,func,nThreads,(void*)NULL,_1));
+    }
+    double team = (timer.nsecsElapsed() / 1000.) / iterations;
+    std::cout << "[multiThread] empty function, " << nThreads << " threads: one task per index " << taskPerIndex
+    << " us, team " << team << " us per call" << std::endl;
+}
@@ -90,6 +90,8 @@ else:unix: PRE_TARGETDEPS += $$OUT_PWD/../HostSupport/libHostSupport.a
 include(../global.pri)
 include(../config.pri)
 
+# The benchmarks (the "Not really a test" TESTs) are named DISABLED_* so that they don't slow down the suite.
+# Run them with: Tests --gtest_also_run_disabled_tests --gtest_filter=*Benchmark*
 SOURCES += \
     google-test/src/gtest-all.cc \
     google-test/src/gtest_main.cc \
@@ -99,7 +101,23 @@ SOURCES += \
     Image_Test.cpp \
     Lut_Test.cpp \
     File_Knob_Test.cpp \
-    Curve_Test.cpp
+    Curve_Test.cpp \
+    Cache_Test.cpp \
+    TaskScheduler_Test.cpp \
+    KnobsValuesSnapshot_Test.cpp \
+    ViewerTexture_Test.cpp \
+    ImageConversion_Test.cpp \
+    ImageBufferPool_Test.cpp \
+    CacheJournal_Test.cpp \
+    CacheIOQueue_Test.cpp \
+    CacheEvictionPolicy_Test.cpp \
+    CacheCompression_Test.cpp \
+    SharedMemoryCache_Test.cpp \
+    NodeHash_Test.cpp \
+    QtDecodedFrame_Test.cpp \
+    RotoMask_Test.cpp \
+    VideoEngine_Test.cpp
 
 HEADERS += \
-    BaseTest.h
+    BaseTest.h \
+    CacheTestHelpers.h
@@ -0,0 +1,102 @@
+//  Natron
+//
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <list>
+#include <vector>
+#include <gtest/gtest.h>
+
+#include "Engine/VideoEngine.h"
+
+namespace {
+
+///Renders [first,last] as renderFrame() does: the frames in flight are scheduled ahead, and the writer renders the
+///first of them and releases it. Returns the frames in the order the writer got them.
+std::vector<SequenceTime>
+renderFrames(std::list<SequenceTime>* inFlight,
+             SequenceTime first,
+             SequenceTime last,
+             int maxFrames,
+             int* scheduledCount)
+{
+    std::vector<SequenceTime> written;
+    for (SequenceTime time = first; time <= last; ++time) {
+        std::list<SequenceTime> toSchedule;
+        if (VideoEngine::getFramesToSchedule(*inFlight,time,last,maxFrames,&toSchedule)) {
+            inFlight->clear();
+        }
+        *scheduledCount += (int)toSchedule.size();
+        inFlight->splice(inFlight->end(),toSchedule);
+        EXPECT_LE((int)inFlight->size(),maxFrames);
+        if (inFlight->empty() || inFlight->front() != time) {
+            ADD_FAILURE() << "frame " << time << " isn't at the head of the frames in flight";
+            return written;
+        }
+        written.push_back(inFlight->front());
+        inFlight->pop_front();
+    }
+    return written;
+}
+
+} // anon namespace
+
+TEST(VideoEngine,FramesInFlightFallBackToOneFrame) {
+    ///4 threads, automatic parallel frames, 8 workers: the case which renders several frames
+    EXPECT_EQ(8,VideoEngine::computeMaxFramesInFlight(false,false,false,4,0,8,false));
+
+    EXPECT_EQ(1,VideoEngine::computeMaxFramesInFlight(false,false,true,4,0,8,false)) << "sequential render";
+    EXPECT_EQ(1,VideoEngine::computeMaxFramesInFlight(true,false,false,4,0,8,false)) << "single-threaded render";
+    EXPECT_EQ(1,VideoEngine::computeMaxFramesInFlight(false,false,false,-1,0,8,false)) << "multi-threading disabled";
+    EXPECT_EQ(1,VideoEngine::computeMaxFramesInFlight(false,true,false,4,0,8,false)) << "viewer output";
+    EXPECT_EQ(1,VideoEngine::computeMaxFramesInFlight(false,false,false,4,0,8,true)) << "unsafe plug-in";
+    EXPECT_EQ(1,VideoEngine::computeMaxFramesInFlight(false,false,false,4,1,8,false)) << "1 parallel frame";
+    EXPECT_EQ(1,VideoEngine::computeMaxFramesInFlight(false,false,false,4,0,1,false)) << "1 worker";
+}
+
+TEST(VideoEngine,FramesInFlightCount) {
+    EXPECT_EQ(3,VideoEngine::computeMaxFramesInFlight(false,false,false,4,3,8,false));
+    EXPECT_EQ(16,VideoEngine::computeMaxFramesInFlight(false,false,false,4,16,8,false));
+    EXPECT_EQ(NATRON_WRITER_MAX_AUTO_FRAMES_IN_FLIGHT,VideoEngine::computeMaxFramesInFlight(false,false,false,0,0,64,false));
+}
+
+TEST(VideoEngine,FramesInFlightReachTheWriterInOrder) {
+    std::list<SequenceTime> inFlight;
+    int scheduledCount = 0;
+    std::vector<SequenceTime> written = renderFrames(&inFlight,1,20,4,&scheduledCount);
+    ASSERT_EQ((std::size_t)20,written.size());
+    for (int i = 0; i < 20; ++i) {
+        EXPECT_EQ(i + 1,written[i]);
+    }
+    ///each frame is scheduled once, none past the last frame
+    EXPECT_EQ(20,scheduledCount);
+    EXPECT_TRUE(inFlight.empty());
+}
+
+TEST(VideoEngine,FramesInFlightAreClearedOnRestart) {
+    ///the writer rendered up to 5, 6 to 8 are in flight
+    std::list<SequenceTime> inFlight;
+    inFlight.push_back(6);
+    inFlight.push_back(7);
+    inFlight.push_back(8);
+
+    ///restarted at another frame: the frames ahead are not the expected ones anymore
+    std::list<SequenceTime> toSchedule;
+    EXPECT_TRUE(VideoEngine::getFramesToSchedule(inFlight,50,100,4,&toSchedule));
+    ASSERT_EQ((std::size_t)4,toSchedule.size());
+    EXPECT_EQ(50,toSchedule.front());
+    EXPECT_EQ(53,toSchedule.back());
+
+    ///resumed where it was: the frames in flight are kept and only the next one is added
+    toSchedule.clear();
+    EXPECT_FALSE(VideoEngine::getFramesToSchedule(inFlight,6,100,4,&toSchedule));
+    ASSERT_EQ((std::size_t)1,toSchedule.size());
+    EXPECT_EQ(9,toSchedule.front());
+
+    ///restarted at the same frame after the writer released it
+    inFlight.pop_front();
+    toSchedule.clear();
+    EXPECT_TRUE(VideoEngine::getFramesToSchedule(inFlight,6,100,4,&toSchedule));
+    EXPECT_EQ(6,toSchedule.front());
+}
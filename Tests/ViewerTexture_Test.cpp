@@ -0,0 +1,265 @@
+//  Natron
+//
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <algorithm>
+#include <iostream>
+#include <vector>
+#include <gtest/gtest.h>
+
+#include <QtCore/QElapsedTimer>
+
+#include "Engine/ViewerInstancePrivate.h"
+#include "Engine/OpenGLViewerI.h"
+#include "Engine/Image.h"
+#include "Engine/Lut.h"
+
+using namespace Natron;
+
+namespace {
+
+boost::shared_ptr<Image>
+makeFloatImage(Natron::ImageComponents comps,
+               int width,
+               int height)
+{
+    boost::shared_ptr<Image> img(new Image(comps,RectI(0,0,width,height),0,Natron::IMAGE_FLOAT));
+    int nComps = (int)img->getComponentsCount();
+    for (int y = 0; y < height; ++y) {
+        float* pix = (float*)img->pixelAt(0,y);
+        for (int i = 0; i < width * nComps; ++i) {
+            ///covers values out of [0,1] and a bit of everything in between
+            pix[i] = ((y * 7919 + i * 104729) % 1200) / 1000.f - 0.1f;
+        }
+    }
+    return img;
+}
+
+boost::shared_ptr<Image>
+makeByteImage(int width,
+              int height)
+{
+    boost::shared_ptr<Image> img(new Image(Natron::ImageComponentRGBA,RectI(0,0,width,height),0,Natron::IMAGE_BYTE));
+    for (int y = 0; y < height; ++y) {
+        unsigned char* pix = img->pixelAt(0,y);
+        for (int i = 0; i < width * 4; ++i) {
+            pix[i] = (unsigned char)((y * 31 + i * 17) % 256);
+        }
+    }
+    return img;
+}
+
+RenderViewerArgs
+makeArgs(const boost::shared_ptr<Image>& img,
+         int closestPowerOf2,
+         ViewerInstance::DisplayChannels channels,
+         int bitDepth,
+         const Color::Lut* colorSpace,
+         bool boxFilter)
+{
+    const RectI& rod = img->getPixelRoD();
+    unsigned int level = 0;
+    while ((1 << level) < closestPowerOf2) {
+        ++level;
+    }
+    RectI downscaled = rod.downscalePowerOfTwoSmallestEnclosing(level);
+    TextureRect texRect(rod.x1,rod.y1,rod.x2,rod.y2,downscaled.width(),downscaled.height(),closestPowerOf2);
+    return RenderViewerArgs(img,texRect,channels,closestPowerOf2,bitDepth,1.,0.,NULL,colorSpace,boxFilter);
+}
+
+unsigned int
+expectedBGRA(float r,float g,float b,float a)
+{
+    return ((unsigned int)Color::floatToInt<256>(a) << 24) | ((unsigned int)Color::floatToInt<256>(r) << 16)
+    | ((unsigned int)Color::floatToInt<256>(g) << 8) | (unsigned int)Color::floatToInt<256>(b);
+}
+
+}
+
+TEST(ViewerTexture,LinearBytesMatchReference) {
+    const int width = 61;
+    const int height = 7;
+    boost::shared_ptr<Image> img = makeFloatImage(Natron::ImageComponentRGBA,width,height);
+    RenderViewerArgs args = makeArgs(img,1,ViewerInstance::RGB,OpenGLViewerI::BYTE,NULL,false);
+    std::vector<unsigned int> texture(width * height);
+    scaleToTexture(std::make_pair(0,height),args,&texture[0]);
+    for (int y = 0; y < height; ++y) {
+        const float* pix = (const float*)img->pixelAt(0,y);
+        for (int x = 0; x < width; ++x, pix += 4) {
+            EXPECT_EQ(expectedBGRA(pix[0],pix[1],pix[2],pix[3]),texture[y * width + x]) << "x " << x << " y " << y;
+        }
+    }
+
+    ///the alpha channel displayed as grey, and an RGB image is opaque
+    args = makeArgs(img,1,ViewerInstance::A,OpenGLViewerI::BYTE,NULL,false);
+    scaleToTexture(std::make_pair(0,height),args,&texture[0]);
+    const float* pix = (const float*)img->pixelAt(3,2);
+    EXPECT_EQ(expectedBGRA(pix[3],pix[3],pix[3],pix[3]),texture[2 * width + 3]);
+
+    boost::shared_ptr<Image> rgb = makeFloatImage(Natron::ImageComponentRGB,width,height);
+    args = makeArgs(rgb,1,ViewerInstance::G,OpenGLViewerI::BYTE,NULL,false);
+    scaleToTexture(std::make_pair(0,height),args,&texture[0]);
+    pix = (const float*)rgb->pixelAt(5,1);
+    EXPECT_EQ(expectedBGRA(pix[1],pix[1],pix[1],1.f),texture[width + 5]);
+}
+
+TEST(ViewerTexture,ChunksMatchWholeImage) {
+    ///the viewer converts groups of scan-lines concurrently, which must give the same texture
+    const int width = 300;
+    const int height = 101;
+    const Color::Lut* lut = Color::LutManager::sRGBLut();
+    lut->validate();
+    boost::shared_ptr<Image> img = makeFloatImage(Natron::ImageComponentRGBA,width,height);
+    for (int boxFilter = 0; boxFilter < 2; ++boxFilter) {
+        RenderViewerArgs args = makeArgs(img,2,ViewerInstance::LUMINANCE,OpenGLViewerI::BYTE,lut,boxFilter);
+        std::vector<unsigned int> whole(args.texRect.w * args.texRect.h);
+        std::vector<unsigned int> chunks(whole.size());
+        scaleToTexture(std::make_pair(0,height),args,&whole[0]);
+        for (int y = 0; y < height; y += 16) {
+            scaleToTexture(std::make_pair(y,std::min(y + 16,height)),args,&chunks[0]);
+        }
+        EXPECT_TRUE(whole == chunks) << "box filter " << boxFilter;
+    }
+}
+
+TEST(ViewerTexture,BoxFilterAverages) {
+    const int width = 9;
+    const int height = 5;
+    boost::shared_ptr<Image> img = makeFloatImage(Natron::ImageComponentRGBA,width,height);
+    RenderViewerArgs args = makeArgs(img,4,ViewerInstance::RGB,OpenGLViewerI::FLOAT,NULL,true);
+    ASSERT_EQ(3,args.texRect.w);
+    ASSERT_EQ(2,args.texRect.h);
+    std::vector<float> texture(args.texRect.w * args.texRect.h * 4);
+    scaleToTexture(std::make_pair(0,height),args,&texture[0]);
+    for (int ty = 0; ty < args.texRect.h; ++ty) {
+        for (int tx = 0; tx < args.texRect.w; ++tx) {
+            ///the blocks on the right and top edges are clipped to the image
+            for (int c = 0; c < 4; ++c) {
+                double sum = 0.;
+                int n = 0;
+                for (int y = ty * 4; y < std::min(ty * 4 + 4,height); ++y) {
+                    for (int x = tx * 4; x < std::min(tx * 4 + 4,width); ++x) {
+                        sum += ((const float*)img->pixelAt(x,y))[c];
+                        ++n;
+                    }
+                }
+                EXPECT_NEAR(sum / n,texture[(ty * args.texRect.w + tx) * 4 + c],1e-5);
+            }
+        }
+    }
+
+    ///point sampling picks the first pixel of each block
+    args.boxFilter = false;
+    scaleToTexture(std::make_pair(0,height),args,&texture[0]);
+    EXPECT_EQ(((const float*)img->pixelAt(4,4))[1],texture[(args.texRect.w + 1) * 4 + 1]);
+}
+
+TEST(ViewerTexture,MipMapLevelMatchesBoxFilter) {
+    ///when zoomed out with filtering on, the viewer converts a level of the mipmap pyramid of the image:
+    ///it must look the same as filtering the full resolution image, whatever its size and bit depth
+    const Color::Lut* lut = Color::LutManager::sRGBLut();
+    lut->validate();
+    const int sizes[2][2] = { { 64, 32 }, { 61, 29 } };
+    for (int s = 0; s < 2; ++s) {
+        const int width = sizes[s][0];
+        const int height = sizes[s][1];
+        for (int isByte = 0; isByte < 2; ++isByte) {
+            ///bytes are sRGB encoded: the levels must average linear values, and are re-encoded at each level
+            boost::shared_ptr<Image> img = isByte ? makeByteImage(width,height) : makeFloatImage(Natron::ImageComponentRGBA,width,height);
+            const Color::Lut* colorSpace = isByte ? lut : NULL;
+            RenderViewerArgs args = makeArgs(img,4,ViewerInstance::RGB,OpenGLViewerI::FLOAT,colorSpace,true);
+            std::vector<float> filtered(args.texRect.w * args.texRect.h * 4);
+            scaleToTexture(std::make_pair(0,height),args,&filtered[0]);
+
+            boost::shared_ptr<Image> level = img;
+            for (int i = 0; i < 2; ++i) {
+                const RectI& rod = level->getPixelRoD();
+                boost::shared_ptr<Image> halved(new Image(Natron::ImageComponentRGBA,rod.downscalePowerOfTwoSmallestEnclosing(1),0,
+                                                          level->getBitDepth()));
+                level->downscale_mipmap(rod,halved.get(),1,isByte ? Natron::sRGB : Natron::Linear);
+                level = halved;
+            }
+            RenderViewerArgs levelArgs = makeArgs(level,1,ViewerInstance::RGB,OpenGLViewerI::FLOAT,colorSpace,true);
+            ASSERT_EQ(args.texRect.w,levelArgs.texRect.w);
+            ASSERT_EQ(args.texRect.h,levelArgs.texRect.h);
+            std::vector<float> fromLevel(filtered.size());
+            scaleToTexture(std::make_pair(0,level->getPixelRoD().height()),levelArgs,&fromLevel[0]);
+
+            for (int ty = 0; ty < args.texRect.h; ++ty) {
+                for (int tx = 0; tx < args.texRect.w; ++tx) {
+                    bool isEdge = tx * 4 + 4 > width || ty * 4 + 4 > height;
+                    for (int c = 0; c < 4; ++c) {
+                        int i = (ty * args.texRect.w + tx) * 4 + c;
+                        if (!isEdge) {
+                            EXPECT_NEAR(filtered[i],fromLevel[i],isByte ? 1e-2 : 1e-5)
+                            << width << "x" << height << " byte " << isByte << " x " << tx << " y " << ty;
+                            continue;
+                        }
+                        ///the blocks of the odd edges average the pixels they cover with other weights, but are
+                        ///never dark
+                        float minValue = 1e6f, maxValue = -1e6f;
+                        for (int y = ty * 4; y < std::min(ty * 4 + 4,height); ++y) {
+                            for (int x = tx * 4; x < std::min(tx * 4 + 4,width); ++x) {
+                                float v;
+                                if (isByte) {
+                                    unsigned char b = img->pixelAt(x,y)[c];
+                                    v = c < 3 ? lut->fromColorSpaceUint8ToLinearFloatFast(b) : b / 255.f;
+                                } else {
+                                    v = ((const float*)img->pixelAt(x,y))[c];
+                                }
+                                minValue = std::min(minValue,v);
+                                maxValue = std::max(maxValue,v);
+                            }
+                        }
+                        EXPECT_GE(fromLevel[i],minValue - 1e-2) << width << "x" << height << " x " << tx << " y " << ty;
+                        EXPECT_LE(fromLevel[i],maxValue + 1e-2) << width << "x" << height << " x " << tx << " y " << ty;
+                    }
+                }
+            }
+        }
+    }
+}
+
+///Not really a test: prints the time taken to convert a 4K image to the viewer texture for the most common variants.
+TEST(ViewerTexture,DISABLED_Benchmark) {
+    const int width = 3840;
+    const int height = 2160;
+    const int iterations = 5;
+    const Color::Lut* lut = Color::LutManager::sRGBLut();
+    lut->validate();
+    boost::shared_ptr<Image> floatImg = makeFloatImage(Natron::ImageComponentRGBA,width,height);
+    boost::shared_ptr<Image> byteImg = makeByteImage(width,height);
+    std::vector<float> texture(width * height * 4);
+
+    struct Variant
+    {
+        const char* name;
+        boost::shared_ptr<Image> img;
+        int closestPowerOf2;
+        ViewerInstance::DisplayChannels channels;
+        int bitDepth;
+        const Color::Lut* colorSpace;
+        bool boxFilter;
+    };
+    const Variant variants[] = {
+        { "float RGBA to sRGB 8 bits", floatImg, 1, ViewerInstance::RGB, OpenGLViewerI::BYTE, lut, false },
+        { "float RGBA to linear 8 bits", floatImg, 1, ViewerInstance::RGB, OpenGLViewerI::BYTE, NULL, false },
+        { "float RGBA luminance to sRGB 8 bits", floatImg, 1, ViewerInstance::LUMINANCE, OpenGLViewerI::BYTE, lut, false },
+        { "byte RGBA to sRGB 8 bits", byteImg, 1, ViewerInstance::RGB, OpenGLViewerI::BYTE, lut, false },
+        { "float RGBA to float", floatImg, 1, ViewerInstance::RGB, OpenGLViewerI::FLOAT, NULL, false },
+        { "float RGBA to sRGB 8 bits, zoom 1/2", floatImg, 2, ViewerInstance::RGB, OpenGLViewerI::BYTE, lut, false },
+        { "float RGBA to sRGB 8 bits, zoom 1/2 box filtered", floatImg, 2, ViewerInstance::RGB, OpenGLViewerI::BYTE, lut, true },
+    };
+    for (U32 i = 0; i < sizeof(variants) / sizeof(variants[0]); ++i) {
+        const Variant& v = variants[i];
+        RenderViewerArgs args = makeArgs(v.img,v.closestPowerOf2,v.channels,v.bitDepth,v.colorSpace,v.boxFilter);
+        QElapsedTimer timer;
+        timer.start();
+        for (int it = 0; it < iterations; ++it) {
+            scaleToTexture(std::make_pair(0,height),args,&texture[0]);
+        }
+        std::cout << "[ViewerTexture] " << v.name << ": " << (double)timer.elapsed() / iterations << " ms per frame" << std::endl;
+    }
+}
@@ -137,6 +137,8 @@ unix {
      !macx {
          LIBS +=  -lGLU -ldl
      }
+     # shm_open, used by the shared node cache
+     linux-*: LIBS += -lrt
 } #unix
 
 *-xcode {